@@ -26,6 +26,7 @@ int main(int argc, char** argv) {
     init_audio_backend(&engine, &conf);
 
     audio_backend_start_info_t info;
+    memset(&info, 0, sizeof(info));
     audio_backend_start(&engine, &info);
 
     signal(SIGINT, terminate);
@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include "common.h"
+#include "crypto/media_crypto.h"
+
+// Packets a second each way, at 20 ms a packet
+#define PACKETS_PER_SECOND 50
+#define BENCH_PACKETS 20000
+#define BENCH_HANDSHAKES 200
+
+static uint64_t cpu_time_ns(void);
+static int self_check(void);
+static void bench_rate(int wireRate);
+static void bench_handshake(void);
+
+/**
+ * Measure what media encryption costs a call, as a share of one core of the
+ * machine it runs on.
+ *
+ * A call seals and opens PACKETS_PER_SECOND packets a second each, and runs
+ * one key agreement when it starts.
+ */
+int main(int argc, char** argv) {
+    if (self_check() != ST_GOOD) {
+        warn("ChaCha20-Poly1305 does not match the RFC 8439 test vector");
+        return 1;
+    }
+
+    printf("%-10s %-10s %-12s %-12s %s\n", "rate", "payload", "seal", "open", "core per call");
+
+    if (argc > 1) {
+        bench_rate(atoi(argv[1]));
+    } else {
+        bench_rate(8000);
+        bench_rate(16000);
+        bench_rate(48000);
+    }
+
+    bench_handshake();
+    return 0;
+}
+
+static uint64_t cpu_time_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * The AEAD vector from RFC 8439 section 2.8.2.
+ */
+static int self_check(void) {
+    static const char plaintext[] = "Ladies and Gentlemen of the class of '99: If I could offer you only one tip for the future, sunscreen would be it.";
+    static const uint8_t nonce[CHACHA20_NONCE_SIZE] = { 0x07, 0x00, 0x00, 0x00, 0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47 };
+    static const uint8_t aad[] = { 0x50, 0x51, 0x52, 0x53, 0xc0, 0xc1, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7 };
+    static const uint8_t expected[POLY1305_TAG_SIZE] = {
+        0x1a, 0xe1, 0x0b, 0x59, 0x4f, 0x09, 0xe2, 0x6a, 0x7e, 0x90, 0x2e, 0xcb, 0xd0, 0x60, 0x06, 0x91
+    };
+
+    uint8_t key[CHACHA20_KEY_SIZE];
+    uint8_t ciphertext[sizeof(plaintext)];
+    uint8_t decrypted[sizeof(plaintext)];
+    uint8_t tag[POLY1305_TAG_SIZE];
+
+    for (int i = 0; i < CHACHA20_KEY_SIZE; i++) {
+        key[i] = 0x80 + i;
+    }
+
+    const size_t length = sizeof(plaintext) - 1;
+    chacha20_poly1305_seal(ciphertext, tag, (const uint8_t*)plaintext, length, aad, sizeof(aad), key, nonce);
+
+    if (memcmp(tag, expected, sizeof(tag)) != 0) {
+        return ST_FAIL;
+    }
+
+    if (chacha20_poly1305_open(decrypted, ciphertext, length, tag, aad, sizeof(aad), key, nonce) != ST_GOOD) {
+        return ST_FAIL;
+    }
+
+    // A flipped bit must be caught
+    ciphertext[0] ^= 1;
+
+    if (chacha20_poly1305_open(decrypted, ciphertext, length, tag, aad, sizeof(aad), key, nonce) == ST_GOOD) {
+        return ST_FAIL;
+    }
+
+    return memcmp(decrypted, plaintext, length) == 0 ? ST_GOOD : ST_FAIL;
+}
+
+static void bench_rate(int wireRate) {
+    static uint8_t packet[4096];
+    static int16_t payload[2048];
+
+    const size_t length = (size_t)wireRate / PACKETS_PER_SECOND * sizeof(int16_t);
+
+    if (length + MEDIA_OVERHEAD > sizeof(packet)) {
+        warn("Wire rate %d is too high to bench", wireRate);
+        return;
+    }
+
+    uint8_t key[MEDIA_KEY_SIZE];
+    for (int i = 0; i < MEDIA_KEY_SIZE; i++) {
+        key[i] = (uint8_t)rand();
+    }
+
+    for (size_t i = 0; i < length / sizeof(int16_t); i++) {
+        payload[i] = (int16_t)rand();
+    }
+
+    media_crypto_t sender;
+    media_crypto_t receiver;
+    init_media_crypto(&sender, key, MEDIA_SENDER_CALLER, 0);
+    init_media_crypto(&receiver, key, MEDIA_SENDER_CALLEE, 0);
+
+    uint64_t sealNs = 0;
+    uint64_t openNs = 0;
+    int failed = 0;
+
+    for (int i = 0; i < BENCH_PACKETS; i++) {
+        uint64_t start = cpu_time_ns();
+        const size_t packetLength = media_seal(&sender, packet, MEDIA_TYPE_AUDIO, MEDIA_FORMAT(MEDIA_CODEC_L16, 0), (uint32_t)i, payload, length);
+        uint64_t end = cpu_time_ns();
+        sealNs += end - start;
+
+        uint8_t* opened;
+        size_t openedLength;
+
+        start = end;
+        failed += media_open(&receiver, packet, packetLength, &opened, &openedLength) != ST_GOOD;
+        openNs += cpu_time_ns() - start;
+    }
+
+    if (failed > 0) {
+        warn("%d packets failed to open", failed);
+    }
+
+    const double seal = (double)sealNs / BENCH_PACKETS;
+    const double open = (double)openNs / BENCH_PACKETS;
+    const double share = (seal + open) * PACKETS_PER_SECOND / 1e9 * 100;
+
+    printf("%-10d %-10zu %-9.0f ns %-9.0f ns %.4f %%\n", wireRate, length, seal, open, share);
+}
+
+static void bench_handshake(void) {
+    uint8_t secretA[X25519_KEY_SIZE], publicA[X25519_KEY_SIZE];
+    uint8_t secretB[X25519_KEY_SIZE], publicB[X25519_KEY_SIZE];
+    uint8_t keyA[MEDIA_KEY_SIZE], keyB[MEDIA_KEY_SIZE];
+
+    uint64_t totalNs = 0;
+
+    for (int i = 0; i < BENCH_HANDSHAKES; i++) {
+        if (x25519_keypair(secretB, publicB) != ST_GOOD) {
+            return;
+        }
+
+        // One side's work: a key pair and the agreement
+        const uint64_t start = cpu_time_ns();
+
+        if (x25519_keypair(secretA, publicA) != ST_GOOD || media_crypto_derive(keyA, secretA, publicB) != ST_GOOD) {
+            return;
+        }
+
+        totalNs += cpu_time_ns() - start;
+
+        if (media_crypto_derive(keyB, secretB, publicA) != ST_GOOD || memcmp(keyA, keyB, MEDIA_KEY_SIZE) != 0) {
+            warn("Key agreement does not match");
+            return;
+        }
+    }
+
+    printf("Key agreement per call: %.1f us\n", (double)totalNs / BENCH_HANDSHAKES / 1000);
+}
@@ -0,0 +1,209 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "common.h"
+#include "logicbackend/pulse_decoder.h"
+
+#define MS 1000000ull
+
+// A dial breaks the line for 60 ms of each 100 ms pulse
+#define PULSE_PERIOD_NS (100 * MS)
+#define PULSE_BREAK_NS  (60 * MS)
+
+// Edges bounce for a few ms after each real one
+#define BOUNCE_NS (3 * MS)
+
+static const pulse_decoder_conf_t conf = {
+    .debounce_ns = 10 * MS,
+    .digit_gap_ns = 250 * MS,
+    .number_timeout_ns = 3000 * MS,
+};
+
+static int check_debounce(edge_source_t* source);
+static int check_digit_gap(edge_source_t* source);
+static int check_number_timeout(edge_source_t* source);
+static int check_zero(edge_source_t* source);
+static uint64_t dial_digit(edge_source_t* source, uint64_t startNs, int pulses, bool bounce);
+static int feed_edges(edge_source_t* source, pulse_decoder_t* decoder, int* number);
+
+/**
+ * Dial numbers into the pulse decoder through a mock edge source, so the
+ * decoding can be checked without dial hardware.
+ */
+int main(int argc, char** argv) {
+    edge_source_t source;
+
+    if (open_mock_edge_source(&source) != ST_GOOD) {
+        return 1;
+    }
+
+    int failed = 0;
+    failed += check_debounce(&source) != ST_GOOD;
+    failed += check_digit_gap(&source) != ST_GOOD;
+    failed += check_number_timeout(&source) != ST_GOOD;
+    failed += check_zero(&source) != ST_GOOD;
+
+    close_edge_source(&source);
+
+    if (failed > 0) {
+        warn("%d dial checks failed", failed);
+        return 1;
+    }
+
+    info("All dial checks passed");
+    return 0;
+}
+
+/**
+ * Bounce on every edge must not add pulses.
+ */
+static int check_debounce(edge_source_t* source) {
+    pulse_decoder_t decoder;
+    init_pulse_decoder(&decoder, &conf);
+
+    int number = -1;
+    const uint64_t lastNs = dial_digit(source, 0, 3, true);
+
+    if (feed_edges(source, &decoder, &number) != 0) {
+        warn("Debounce: a number ended while dialling");
+        return ST_FAIL;
+    }
+
+    // The digit closes after the gap, the number only after the timeout
+    if (pulse_decoder_expire(&decoder, lastNs + conf.digit_gap_ns, &number)) {
+        warn("Debounce: the number ended at the digit gap");
+        return ST_FAIL;
+    }
+
+    if (!pulse_decoder_expire(&decoder, lastNs + conf.number_timeout_ns, &number) || number != 3) {
+        warn("Debounce: dialled 3, decoded %d", number);
+        return ST_FAIL;
+    }
+
+    return ST_GOOD;
+}
+
+/**
+ * A pause of the digit gap splits digits, shorter ones between pulses do not.
+ */
+static int check_digit_gap(edge_source_t* source) {
+    pulse_decoder_t decoder;
+    init_pulse_decoder(&decoder, &conf);
+
+    int number = -1;
+    uint64_t lastNs = dial_digit(source, 0, 2, false);
+    lastNs = dial_digit(source, lastNs + conf.digit_gap_ns + 100 * MS, 5, false);
+
+    if (feed_edges(source, &decoder, &number) != 0) {
+        warn("Digit gap: a number ended while dialling");
+        return ST_FAIL;
+    }
+
+    if (pulse_decoder_deadline(&decoder) != lastNs + conf.digit_gap_ns) {
+        warn("Digit gap: the deadline is not the digit gap after the last pulse");
+        return ST_FAIL;
+    }
+
+    if (!pulse_decoder_expire(&decoder, lastNs + conf.number_timeout_ns, &number) || number != 25) {
+        warn("Digit gap: dialled 25, decoded %d", number);
+        return ST_FAIL;
+    }
+
+    return ST_GOOD;
+}
+
+/**
+ * A pulse after the number timeout starts a new number, even if the timer
+ * that should have ended the last one ran late.
+ */
+static int check_number_timeout(edge_source_t* source) {
+    pulse_decoder_t decoder;
+    init_pulse_decoder(&decoder, &conf);
+
+    int number = -1;
+    uint64_t lastNs = dial_digit(source, 0, 4, false);
+    lastNs = dial_digit(source, lastNs + conf.number_timeout_ns + 100 * MS, 1, false);
+
+    if (feed_edges(source, &decoder, &number) != 1 || number != 4) {
+        warn("Number timeout: dialled 4 then waited, decoded %d", number);
+        return ST_FAIL;
+    }
+
+    if (!pulse_decoder_expire(&decoder, lastNs + conf.number_timeout_ns, &number) || number != 1) {
+        warn("Number timeout: dialled 1 after 4, decoded %d", number);
+        return ST_FAIL;
+    }
+
+    if (pulse_decoder_deadline(&decoder) != 0) {
+        warn("Number timeout: the decoder is not idle after the number");
+        return ST_FAIL;
+    }
+
+    return ST_GOOD;
+}
+
+/**
+ * Ten pulses dial a zero.
+ */
+static int check_zero(edge_source_t* source) {
+    pulse_decoder_t decoder;
+    init_pulse_decoder(&decoder, &conf);
+
+    int number = -1;
+    uint64_t lastNs = dial_digit(source, 0, 1, true);
+    lastNs = dial_digit(source, lastNs + conf.digit_gap_ns + 100 * MS, 10, true);
+    feed_edges(source, &decoder, &number);
+
+    if (!pulse_decoder_expire(&decoder, lastNs + conf.number_timeout_ns, &number) || number != 10) {
+        warn("Zero: dialled 10, decoded %d", number);
+        return ST_FAIL;
+    }
+
+    return ST_GOOD;
+}
+
+/**
+ * Push the edges of one digit, starting at `startNs`. Returns when its last
+ * pulse began.
+ */
+static uint64_t dial_digit(edge_source_t* source, uint64_t startNs, int pulses, bool bounce) {
+    uint64_t pulseNs = startNs;
+
+    for (int i = 0; i < pulses; i++) {
+        pulseNs = startNs + (uint64_t)i * PULSE_PERIOD_NS;
+        mock_edge_source_push(source, pulseNs, true);
+
+        if (bounce) {
+            mock_edge_source_push(source, pulseNs + BOUNCE_NS, false);
+            mock_edge_source_push(source, pulseNs + 2 * BOUNCE_NS, true);
+        }
+
+        mock_edge_source_push(source, pulseNs + PULSE_BREAK_NS, false);
+
+        if (bounce) {
+            mock_edge_source_push(source, pulseNs + PULSE_BREAK_NS + BOUNCE_NS, true);
+            mock_edge_source_push(source, pulseNs + PULSE_BREAK_NS + 2 * BOUNCE_NS, false);
+        }
+    }
+
+    return pulseNs;
+}
+
+/**
+ * Feed the decoder every edge waiting in the source. Returns how many
+ * numbers the edges ended, the last in `number`.
+ */
+static int feed_edges(edge_source_t* source, pulse_decoder_t* decoder, int* number) {
+    dial_edge_t edges[EDGE_SOURCE_BATCH];
+    int numbers = 0;
+    int count;
+
+    while ((count = source->read(source, edges, EDGE_SOURCE_BATCH)) > 0) {
+        for (int i = 0; i < count; i++) {
+            numbers += pulse_decoder_edge(decoder, &edges[i], number);
+        }
+    }
+
+    return numbers;
+}
@@ -2,9 +2,12 @@
 #define SRC_AUDIO_H
 
 #include <stdbool.h>
+#include <stdatomic.h>
 #include "miniaudio.h"
 #include "utils/args.h"
 #include "audiobackend/ring_buffer.h"
+#include "audiobackend/audio_stats.h"
+#include "audiobackend/dsp.h"
 
 // Defines for miniaudio
 
@@ -47,14 +50,29 @@
  * waiting on the audio engine's read buffer. At this time it will also check
  * to see if there is any data in the write buffer, and if there is, will write
  * it to the audio device.
+ * 
+ * The device callback runs on a real-time thread, so it never logs, allocates
+ * or takes locks. Problems are counted in `stats` and reported from a separate
+ * thread.
+ * 
+ * The device can be left running between calls. While `live` is clear the
+ * callback plays silence, drops anything left in the playback buffer and does
+ * not fill the capture buffer, so a call starts from empty buffers.
+ * 
+ * During a call the callback also mixes filtered mic audio straight into the
+ * output as sidetone, so it has no network latency. A gain of 0 disables it.
  */
 
 typedef struct audio_engine {
     ma_context context;
     ma_device device;
-    ma_biquad biquad;
     ring_buffer_t* playback;
     ring_buffer_t* capture;
+    audio_stats_t stats;
+    atomic_bool live;
+    dsp_graph_t sidetone;
+    int16_t sidetoneGainQ15;
+    int16_t sidetoneBuffer[DSP_BLOCK_FRAMES];
 } audio_engine_t;
 
 extern void init_audio_engine(audio_engine_t* engine, ring_buffer_t* playback, ring_buffer_t* capture, intercom_conf_t* conf);
@@ -62,5 +80,6 @@ extern void destroy_audio_engine(audio_engine_t* engine);
 
 extern int audio_engine_start(audio_engine_t* engine);
 extern int audio_engine_stop(audio_engine_t* engine);
+extern void audio_engine_set_live(audio_engine_t* engine, bool live);
 
 #endif
\ No newline at end of file
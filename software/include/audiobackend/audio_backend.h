@@ -16,10 +16,15 @@ typedef struct audio_backend_impl {
     ring_buffer_t playbackRB;
 } audio_backend_impl_t;
 
+/**
+ * In warm mode the audio device and media socket stay up between calls, so
+ * starting a call only switches the device live instead of opening anything.
+ */
 typedef struct audio_backend {
     audio_backend_impl_t* impl;
     bool initialised;
     bool started;
+    bool warm;
 } audio_backend_t;
 
 extern void init_audio_backend(audio_backend_t* backend, intercom_conf_t* config);
@@ -27,5 +32,7 @@ extern void destroy_audio_backend(audio_backend_t* backend);
 
 extern int  audio_backend_start(audio_backend_t* backend, audio_backend_start_info_t* info);
 extern int  audio_backend_stop(audio_backend_t* backend);
+extern int  audio_backend_answer(audio_backend_t* backend);
+extern uint16_t audio_backend_media_port(audio_backend_t* backend);
 
 #endif
\ No newline at end of file
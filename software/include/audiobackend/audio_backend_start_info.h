@@ -1,13 +1,23 @@
 #ifndef SRC_AUDIO_BACKEND_START_INFO_H
 #define SRC_AUDIO_BACKEND_START_INFO_H
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <netinet/in.h>
+#include "crypto/media_crypto.h"
 
 #define IPV4_MAX_STRLEN 16
 
 typedef struct audio_backend_start_info {
     struct sockaddr_in serverAddr;
     socklen_t serverAddrLen;
+    uint8_t mediaKey[MEDIA_KEY_SIZE]; // The call's key, agreed by the nodes
+    uint8_t mediaSender;              // MEDIA_SENDER_CALLER or MEDIA_SENDER_CALLEE
+    uint32_t mediaToken;              // From the server, names this side to the relay
+    struct sockaddr_in peerAddr;      // Offered for a direct path, port 0 without
+    bool early;                       // Ringing, no audio is sent until answered
+    bool ringback;                    // Play ringback while early
+    bool listen;                      // Paged, audio is only ever received
 } audio_backend_start_info_t;
 
 #endif
\ No newline at end of file
@@ -0,0 +1,62 @@
+#ifndef SRC_AUDIO_STATS_H
+#define SRC_AUDIO_STATS_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#define AUDIO_STATS_REPORT_INTERVAL_S 5
+
+/**
+ * Counters shared between the real-time audio callback and the reporter.
+ *
+ * The callback must never block, allocate or make a syscall, so instead of
+ * logging it bumps these relaxed atomics. A reporter thread wakes up every
+ * AUDIO_STATS_REPORT_INTERVAL_S seconds, swaps the counters out and logs any
+ * that are non zero.
+ */
+typedef struct audio_stats {
+    atomic_uint_fast64_t callbacks;
+    atomic_uint_fast64_t underruns;     // Playback ring was empty
+    atomic_uint_fast64_t shortReads;    // Playback ring held less than a period
+    atomic_uint_fast64_t overruns;      // Capture ring had less than a period free
+    atomic_uint_fast64_t filterErrors;
+    atomic_uint_fast64_t ringErrors;    // Ring buffer acquire / commit failed
+    atomic_uint_fast64_t xruns;         // Callback ran past its deadline
+    atomic_uint_fast64_t lateCallbacks; // Gap between callbacks over 2 periods
+    atomic_uint_fast64_t busyNs;        // Total time spent inside the callback
+    atomic_uint_fast64_t maxCallbackNs;
+    atomic_uint_fast64_t lastStartNs;
+
+    // Reporter thread, owned by the process that initialised the stats
+    pthread_t reporter;
+    pthread_mutex_t reporterMut;
+    pthread_cond_t reporterCond;
+    bool reporterRunning;
+} audio_stats_t;
+
+/**
+ * Increment a statistics counter from the real-time thread.
+ */
+#define audio_stats_count(counter) \
+    atomic_fetch_add_explicit(&(counter), 1, memory_order_relaxed)
+
+/**
+ * Monotonic time in nanoseconds. clock_gettime on CLOCK_MONOTONIC is serviced
+ * by the vDSO on Linux, so this does not enter the kernel.
+ */
+static inline uint64_t audio_stats_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+extern void init_audio_stats(audio_stats_t* stats);
+extern void destroy_audio_stats(audio_stats_t* stats);
+
+extern uint64_t audio_stats_callback_begin(audio_stats_t* stats, uint32_t frameCount, uint32_t sampleRate);
+extern void     audio_stats_callback_end(audio_stats_t* stats, uint64_t startNs, uint32_t frameCount, uint32_t sampleRate);
+
+#endif
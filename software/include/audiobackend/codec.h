@@ -0,0 +1,30 @@
+#ifndef SRC_CODEC_H
+#define SRC_CODEC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "server/packets.h"
+
+// The state written in front of every ADPCM block
+#define CODEC_ADPCM_HEADER_SIZE 4
+
+/**
+ * Encoder state carried between blocks. Only ADPCM keeps any, and each block
+ * starts with a copy of it, so a block decodes without the ones before it.
+ */
+typedef struct codec_state {
+    int32_t predictor;
+    int index;
+} codec_state_t;
+
+extern const char* codec_name(int codec);
+
+extern void   init_codec_state(codec_state_t* state);
+
+extern size_t codec_encoded_size(int codec, size_t frames);
+extern size_t codec_decoded_frames(int codec, const uint8_t* in, size_t length);
+
+extern size_t codec_encode(int codec, codec_state_t* state, const int16_t* in, size_t frames, uint8_t* out);
+extern size_t codec_decode(int codec, const uint8_t* in, size_t length, int16_t* out);
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef SRC_DSP_H
+#define SRC_DSP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "miniaudio.h"
+#include "utils/args.h"
+#include "audiobackend/kernels.h"
+
+// 5 ms at 48 kHz
+#define DSP_BLOCK_FRAMES 240
+
+// Rates are limited to [DSP_MIN_RATE, DSP_MAX_RATE], so a block can grow by
+// at most DSP_MAX_RATE / DSP_MIN_RATE through a resampler
+#define DSP_MIN_RATE 8000
+#define DSP_MAX_RATE 48000
+#define DSP_MAX_BLOCK_FRAMES (DSP_BLOCK_FRAMES * (DSP_MAX_RATE / DSP_MIN_RATE) + 8)
+
+#define DSP_MAX_BIQUADS 8
+
+/**
+ * Normalised biquad coefficients (a0 = 1).
+ */
+typedef struct dsp_biquad {
+    float b0, b1, b2;
+    float a1, a2;
+} dsp_biquad_t;
+
+enum DSP_OP {
+    DSP_OP_CASCADE  = 1,
+    DSP_OP_GAIN     = 2,
+    DSP_OP_LIMITER  = 3,
+    DSP_OP_RESAMPLE = 4,
+};
+
+/**
+ * A stage of a compiled DSP graph.
+ *
+ * Consecutive filters from the config are fused into a single biquad cascade
+ * and gains are folded into neighbouring filter coefficients, so each op here
+ * is one pass over the block.
+ */
+typedef struct dsp_op {
+    enum DSP_OP op;
+    union {
+        struct {
+            int count;
+            dsp_biquad_t coeffs[DSP_MAX_BIQUADS];
+            kernel_biquad_t sections[DSP_MAX_BIQUADS];
+            kernel_biquad_q_t fixed[DSP_MAX_BIQUADS];
+            float state[DSP_MAX_BIQUADS][2];
+            int32_t fixedState[DSP_MAX_BIQUADS][4];
+        } cascade;
+        struct {
+            float gain;
+            int16_t gainQ12;
+        } gain;
+        struct {
+            float threshold;
+            float release;
+            float envelope;
+        } limiter;
+        struct {
+            ma_linear_resampler resampler;
+        } resample;
+    };
+} dsp_op_t;
+
+/**
+ * A DSP chain compiled from a dsp_chain_conf_t.
+ *
+ * All coefficients are computed once at initialisation, processing only runs
+ * the precomputed ops over fixed blocks of at most DSP_BLOCK_FRAMES input
+ * frames. Filters and gains run in fixed point when the selected kernels
+ * prefer it, the limiter and resampler always run in float.
+ */
+typedef struct dsp_graph {
+    int op_count;
+    dsp_op_t ops[DSP_MAX_STAGES];
+    uint32_t in_rate;
+    uint32_t out_rate;
+    float work[2][DSP_MAX_BLOCK_FRAMES];
+    int16_t fixed[DSP_MAX_BLOCK_FRAMES];
+} dsp_graph_t;
+
+extern int  init_dsp_graph(dsp_graph_t* graph, const dsp_chain_conf_t* conf, uint32_t inRate, uint32_t outRate);
+extern void destroy_dsp_graph(dsp_graph_t* graph);
+
+extern int    dsp_graph_process(dsp_graph_t* graph, const int16_t* in, size_t inFrames, int16_t* out, size_t* outFrames);
+extern size_t dsp_graph_max_output(const dsp_graph_t* graph, size_t inFrames);
+
+#endif
@@ -0,0 +1,114 @@
+#ifndef SRC_KERNELS_H
+#define SRC_KERNELS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Audio processing kernels.
+ *
+ * Every kernel has a portable scalar version, and SSE2, AVX2 and NEON versions
+ * where the target supports them. init_kernels() picks the best table for the
+ * running CPU, so the same binary runs on the x86 server and on ARM nodes.
+ *
+ * All s16 kernels saturate rather than wrap. Q15 and Q12 gains are fixed point
+ * with 15 and 12 fractional bits.
+ */
+
+// Number of samples the block form of a biquad is computed for
+#define KERNEL_BIQUAD_BLOCK 8
+
+// Fractional bits of the fixed point biquad coefficients
+#define KERNEL_BIQUAD_Q 14
+
+/**
+ * A biquad section with its normalised (a0 = 1) coefficients and precomputed
+ * block form.
+ *
+ * The block form gives the next KERNEL_BIQUAD_BLOCK outputs directly as a
+ * weighted sum of the two filter states and the block's inputs, which lets
+ * the SIMD kernels compute several outputs of one section at once.
+ */
+typedef struct kernel_biquad {
+    float b0, b1, b2;
+    float a1, a2;
+    float ys1[KERNEL_BIQUAD_BLOCK];                     // Output response to state 1
+    float ys2[KERNEL_BIQUAD_BLOCK];                     // Output response to state 2
+    float yx[KERNEL_BIQUAD_BLOCK][KERNEL_BIQUAD_BLOCK]; // Output response to input j
+} kernel_biquad_t;
+
+/**
+ * A biquad section in fixed point for CPUs without a fast FPU.
+ */
+typedef struct kernel_biquad_q {
+    int32_t b0, b1, b2;
+    int32_t a1, a2;
+} kernel_biquad_q_t;
+
+typedef struct audio_kernels {
+    const char* name;
+
+    // Set when floating point is slow and the fixed point paths should be used
+    bool fixed_point;
+
+    // dst = sat(dst + src)
+    void (*mix_s16)(int16_t* dst, const int16_t* src, size_t count);
+    // dst = sat(dst + src * gain)
+    void (*mix_scaled_s16)(int16_t* dst, const int16_t* src, int16_t gainQ15, size_t count);
+    // samples = sat(samples * gain)
+    void (*gain_s16)(int16_t* samples, int16_t gainQ12, size_t count);
+    // acc += src
+    void (*accumulate_s16)(int32_t* acc, const int16_t* src, size_t count);
+    // dst = sat(src)
+    void (*saturate_s32)(int16_t* dst, const int32_t* src, size_t count);
+    // dst = sat((sum - own) * gain), everyone in a mix but one. The product
+    // must fit 32 bits, as it does for a gain limiting peak_minus_s32()
+    void (*mix_minus_s16)(int16_t* dst, const int32_t* sum, const int16_t* own, int16_t gainQ15, size_t count);
+    // max |sum - own|
+    uint32_t (*peak_minus_s32)(const int32_t* sum, const int16_t* own, size_t count);
+
+    // Conversion between s16 and f32 in [-1, 1)
+    void (*s16_to_f32)(float* dst, const int16_t* src, size_t count);
+    void (*f32_to_s16)(int16_t* dst, const float* src, size_t count);
+
+    void (*gain_f32)(float* samples, float gain, size_t count);
+
+    // Run samples through each section in turn, state is two floats per section
+    void (*biquad_cascade_f32)(const kernel_biquad_t* sections, float (*state)[2], int sectionCount, float* samples, size_t count);
+    // Fixed point cascade, state is {x1, x2, y1, y2} per section
+    void (*biquad_cascade_s16)(const kernel_biquad_q_t* sections, int32_t (*state)[4], int sectionCount, int16_t* samples, size_t count);
+
+    // Sum of squares
+    uint64_t (*energy_s16)(const int16_t* src, size_t count);
+    // Sum of a[i] * b[i], for filter taps against samples. The taps' absolute
+    // values must sum to under 65536, so the sum fits 32 bits
+    int32_t (*dot_s16)(const int16_t* a, const int16_t* b, size_t count);
+} audio_kernels_t;
+
+extern const audio_kernels_t* kernels;
+
+extern void init_kernels(void);
+extern int  kernels_select(const char* name);
+
+extern void kernel_biquad_prepare(kernel_biquad_t* biquad, float b0, float b1, float b2, float a1, float a2);
+extern void kernel_biquad_prepare_q(kernel_biquad_q_t* biquad, const kernel_biquad_t* source);
+
+// Scalar implementations, shared by the SIMD tables for their tails
+extern const audio_kernels_t kernels_scalar;
+
+extern void kernels_scalar_biquad_section(const kernel_biquad_t* section, float* state, float* samples, size_t count);
+extern void kernels_scalar_biquad_cascade_s16(const kernel_biquad_q_t* sections, int32_t (*state)[4], int sectionCount, int16_t* samples, size_t count);
+
+#if defined(__x86_64__) || defined(__i386__)
+extern const audio_kernels_t kernels_sse2;
+extern const audio_kernels_t kernels_avx2;
+#endif
+
+// ARMv6, as on the Pi Zero, has no NEON, so its builds leave the table out
+#if defined(__aarch64__) || (defined(__arm__) && !defined(KERNELS_NO_NEON))
+#define KERNELS_NEON
+extern const audio_kernels_t kernels_neon;
+#endif
+
+#endif
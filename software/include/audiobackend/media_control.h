@@ -0,0 +1,76 @@
+#ifndef SRC_MEDIA_CONTROL_H
+#define SRC_MEDIA_CONTROL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "server/packets.h"
+
+#define MEDIA_REPORT_INTERVAL_MS 1000
+
+/**
+ * A rung of the ladder the controller moves along, from the best quality to
+ * the fewest bits.
+ */
+typedef struct media_level {
+    uint8_t codec;    // MEDIA_CODEC
+    uint8_t ptimeMs;  // A whole number of DSP blocks
+} media_level_t;
+
+/**
+ * Statistics on the stream received from the peer, and the sending side's
+ * choice of codec, packet time and FEC depth.
+ *
+ * Reports from the peer move the sender down the ladder when loss comes with
+ * a rising round trip, since the path is congested and fewer bits help. Loss
+ * without it is taken as random, so FEC goes up instead. After a run of
+ * clean reports FEC is dropped first and then the sender steps back up.
+ *
+ * A relay report caps the bitrate for a while, which only ever moves the
+ * sender down.
+ */
+typedef struct media_control {
+    bool adaptive;
+    unsigned int wireRate;
+
+    // Sending
+    int level;
+    int fec;
+    int cleanReports;
+    uint32_t relayCap;      // Bits a second, 0 without a cap
+    uint64_t relayCapUntilNs;
+    uint64_t nextReportNs;
+
+    // Round trip, from the echo in the peer's reports
+    uint32_t rttMs;
+    uint32_t baseRttMs;     // Lowest seen, 0 until measured
+
+    // Receiving
+    bool receiving;
+    uint32_t baseSequence;
+    uint32_t highestSequence;
+    uint32_t received;
+    uint32_t expectedPrior;
+    uint32_t receivedPrior;
+    double jitter;          // Wire rate samples
+    bool hasTransit;
+    uint32_t transit;       // Arrival less send time of the last audio
+
+    // The last report from the peer, echoed back in ours
+    uint32_t peerTimestampMs;
+    uint64_t peerReportNs;
+} media_control_t;
+
+extern void init_media_control(media_control_t* control, unsigned int wireRate, bool adaptive, uint64_t nowNs);
+
+extern const media_level_t* media_control_level(const media_control_t* control);
+extern uint32_t media_control_bitrate(const media_control_t* control, int level, int fec);
+
+extern void media_control_received(media_control_t* control, const struct media_header* header, uint64_t nowNs);
+extern bool media_control_report_due(const media_control_t* control, uint64_t nowNs);
+extern void media_control_build_report(media_control_t* control, struct media_report* report, uint64_t nowNs);
+
+extern bool media_control_peer_report(media_control_t* control, const struct media_report* report, uint64_t nowNs);
+extern bool media_control_relay_report(media_control_t* control, const struct relay_report* report, uint64_t nowNs);
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef SRC_RESAMPLER_H
+#define SRC_RESAMPLER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// Taps of each phase of the filter when upsampling, a multiple of every
+// kernel's vector width. Downsampling by up to RESAMPLER_MAX_RATIO takes as
+// many times more, so the filter spans as much of the output
+#define RESAMPLER_TAPS 32
+#define RESAMPLER_MAX_RATIO 6
+#define RESAMPLER_MAX_TAPS (RESAMPLER_TAPS * RESAMPLER_MAX_RATIO)
+
+// Taps of all the phases together, enough for any pair of 8, 11.025, 12, 16,
+// 22.05, 24, 44.1 and 48 kHz
+#define RESAMPLER_MAX_COEFFICIENTS 32768
+
+// Input taken through the filter at once
+#define RESAMPLER_CHUNK_FRAMES 256
+
+/**
+ * A polyphase FIR resampler between two fixed rates, in fixed point.
+ *
+ * The rates are reduced to L / M by their common factor. Output n is input
+ * position n * M / L, and is the dot product of the inputs up to it with
+ * phase (n * M) % L of a windowed sinc, low passed below the lower of the two
+ * rates' Nyquist. Each phase's Q14 taps sum to unity, so a DC level passes
+ * unchanged, and the delay is half the taps at the input rate.
+ *
+ * All of it is held in the struct, nothing is allocated.
+ */
+typedef struct resampler {
+    unsigned int inRate;
+    unsigned int outRate;
+    uint32_t phases; // L
+    uint32_t step;   // M
+    uint32_t length; // Taps of each phase
+    uint32_t position; // Of the next output, in 1/L inputs from the next input
+    int16_t taps[RESAMPLER_MAX_COEFFICIENTS]; // By phase, oldest input first
+    int16_t window[RESAMPLER_MAX_TAPS - 1 + RESAMPLER_CHUNK_FRAMES];
+} resampler_t;
+
+extern bool   resampler_supports(unsigned int inRate, unsigned int outRate);
+extern int    init_resampler(resampler_t* resampler, unsigned int inRate, unsigned int outRate);
+extern void   reset_resampler(resampler_t* resampler);
+
+extern size_t resampler_max_output(const resampler_t* resampler, size_t frames);
+extern size_t resample(resampler_t* resampler, const int16_t* in, size_t frames, int16_t* out);
+
+#endif
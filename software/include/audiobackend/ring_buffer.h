@@ -26,6 +26,9 @@ extern int ring_buffer_commit_read(ring_buffer_t* rb, size_t size);
 extern int ring_buffer_acquire_write(ring_buffer_t* rb, size_t* size, void** buffer);
 extern int ring_buffer_commit_write(ring_buffer_t* rb, size_t size);
 
+extern int ring_buffer_read(ring_buffer_t* rb, void* dst, size_t* size);
+extern int ring_buffer_write(ring_buffer_t* rb, const void* src, size_t* size);
+
 extern int     ring_buffer_seek_read(ring_buffer_t* rb, size_t offset);
 extern int     ring_buffer_seek_write(ring_buffer_t* rb, size_t offset);
 extern int32_t ring_buffer_pointer_distance(ring_buffer_t* rb);
@@ -2,12 +2,20 @@
 #define SRC_TRANSFER_H
 
 #include <pthread.h>
+#include <stdatomic.h>
 #include <unistd.h>
 #include "audiobackend/ring_buffer.h"
 #include "audiobackend/audio_backend.h"
+#include "audiobackend/dsp.h"
 
 #define TRANSFER_REQUEST_SIZE 10000 // 10kb
 
+// Datagrams moved per system call where batching is supported
+#define TRANSFER_BATCH 8
+
+// Room for a packet of 20 ms of L16 at the highest wire rate, header and tag
+#define TRANSFER_MAX_PACKET 2048
+
 /**
  * Most of the information here is read only for the child loop.
  * 
@@ -16,6 +24,33 @@
  * 
  * Additionally, since this is shared between processes, it must be allocated
  * using shared memory.
+ * 
+ * The DSP chains from the config run in the child, between the ring buffers
+ * and the network, so the audio callback only has to copy samples.
+ * 
+ * The media socket is bound before a call starts, and its port published in
+ * `mediaPort`, so the node can signal it and the relay forwards to it from
+ * the first packet. In warm mode the child keeps the socket between calls,
+ * otherwise it binds a fresh one after each call.
+ * 
+ * Every packet is sealed with the call's key before it leaves the child, so
+ * audio is only ever in the clear on the nodes.
+ * 
+ * With adaptive media the child picks its codec, packet time and FEC depth
+ * from the reports the peer and relay send back, see media_control.h.
+ * 
+ * With direct media the child probes the peer's address, offered by the
+ * server, and sends media straight to it once a probe is answered. The relay
+ * stays the fallback, media goes back to it if the direct path goes quiet.
+ * 
+ * A call starts early, while the callee's phone rings. The child only sends
+ * reports then, which open the path through any NAT before anyone speaks,
+ * and the caller hears ringback. `early` is cleared when the call is answered, or
+ * by the child once audio arrives from the peer, which only sends it after
+ * picking up.
+ * 
+ * A page is only listened to. The call stays early for good, so the child
+ * sends nothing but reports, which keep the relay's path to it open.
  */
 struct transfer_engine {
     ring_buffer_t* playback;
@@ -25,6 +60,14 @@ struct transfer_engine {
     pthread_mutex_t startMut; // Owned by child proc
     pid_t procID;
     bool started;
+    atomic_bool early;
+    atomic_uint mediaPort; // Host order, 0 while no socket is bound
+    bool warm;
+    bool adaptive;
+    bool direct;
+    unsigned int wireRate;
+    dsp_graph_t captureDsp;  // Owned by child proc
+    dsp_graph_t playbackDsp; // Owned by child proc
 };
 
 extern void init_transfer_engine(struct transfer_engine* engine, ring_buffer_t* playback, ring_buffer_t* capture, intercom_conf_t* config);
@@ -33,6 +76,8 @@ extern void destroy_transfer_engine(struct transfer_engine* engine);
 
 extern int transfer_engine_start(struct transfer_engine* engine, audio_backend_start_info_t* info);
 extern int transfer_engine_stop(struct transfer_engine* engine);
+extern void transfer_engine_answer(struct transfer_engine* engine);
+extern uint16_t transfer_engine_media_port(struct transfer_engine* engine);
 
 
 #endif
\ No newline at end of file
@@ -28,6 +28,7 @@
 #define BIT(n) (0x1 << n)
 
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
 
 enum ST_CODE {
     ST_GOOD            = 0,
@@ -42,6 +43,8 @@ extern int destroy_shared_memory(void* memory, size_t size);
 
 extern uint64_t ntime(void);
 
+extern int copy_string(char* dst, size_t size, const char* src);
+
 #define utime() (ntime() / 1000)
 
 #endif
\ No newline at end of file
@@ -0,0 +1,38 @@
+#ifndef SRC_CHACHA20_POLY1305_H
+#define SRC_CHACHA20_POLY1305_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define CHACHA20_KEY_SIZE 32
+#define CHACHA20_NONCE_SIZE 12
+#define POLY1305_TAG_SIZE 16
+
+/**
+ * ChaCha20-Poly1305 authenticated encryption, as in RFC 8439.
+ *
+ * Plain C with no tables or secret dependent branches, so it runs in constant
+ * time and stays fast on cores without AES instructions. `in` and `out` may
+ * be the same buffer.
+ */
+extern void chacha20_poly1305_seal(uint8_t* out, uint8_t tag[POLY1305_TAG_SIZE], const uint8_t* in, size_t length,
+                                   const uint8_t* aad, size_t aadLength,
+                                   const uint8_t key[CHACHA20_KEY_SIZE], const uint8_t nonce[CHACHA20_NONCE_SIZE]);
+
+/**
+ * Returns ST_GOOD and decrypts into `out` only if the tag is valid.
+ */
+extern int chacha20_poly1305_open(uint8_t* out, const uint8_t* in, size_t length, const uint8_t tag[POLY1305_TAG_SIZE],
+                                  const uint8_t* aad, size_t aadLength,
+                                  const uint8_t key[CHACHA20_KEY_SIZE], const uint8_t nonce[CHACHA20_NONCE_SIZE]);
+
+extern void chacha20_xor(uint8_t* out, const uint8_t* in, size_t length,
+                         const uint8_t key[CHACHA20_KEY_SIZE], const uint8_t nonce[CHACHA20_NONCE_SIZE], uint32_t counter);
+
+/**
+ * Derive a key from `key` and 16 bytes of `input`, the subkey step of
+ * XChaCha20.
+ */
+extern void hchacha20(uint8_t out[CHACHA20_KEY_SIZE], const uint8_t key[CHACHA20_KEY_SIZE], const uint8_t input[16]);
+
+#endif
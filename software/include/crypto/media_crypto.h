@@ -0,0 +1,45 @@
+#ifndef SRC_MEDIA_CRYPTO_H
+#define SRC_MEDIA_CRYPTO_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "crypto/chacha20_poly1305.h"
+#include "crypto/x25519.h"
+#include "server/packets.h"
+
+#define MEDIA_KEY_SIZE CHACHA20_KEY_SIZE
+
+// Bytes a sealed packet adds to its payload
+#define MEDIA_OVERHEAD (sizeof(struct media_header) + MEDIA_TAG_SIZE)
+
+/**
+ * Seals and opens the media packets of one call.
+ *
+ * Both directions share the call's key, the sender id in each nonce keeps
+ * their key streams apart. Received sequence numbers are checked against a
+ * sliding window, so a replayed packet is dropped.
+ */
+typedef struct media_crypto {
+    uint8_t key[MEDIA_KEY_SIZE];
+    uint8_t sender;
+    uint32_t token; // Put in every header for the relay, as the server sent it
+    uint32_t sendSequence;
+    uint32_t probeSequence;
+    bool received;
+    uint32_t highestSequence;
+    uint64_t window; // Bit n set once highestSequence - n has been opened
+} media_crypto_t;
+
+extern int  media_crypto_derive(uint8_t key[MEDIA_KEY_SIZE], const uint8_t secret[X25519_KEY_SIZE], const uint8_t peerKey[X25519_KEY_SIZE]);
+extern int  media_crypto_random_key(uint8_t key[MEDIA_KEY_SIZE]);
+extern void media_crypto_wrap(uint8_t wrapped[MEDIA_WRAPPED_KEY_SIZE], const uint8_t key[MEDIA_KEY_SIZE], const uint8_t wrappingKey[MEDIA_KEY_SIZE]);
+extern int  media_crypto_unwrap(uint8_t key[MEDIA_KEY_SIZE], const uint8_t wrapped[MEDIA_WRAPPED_KEY_SIZE], const uint8_t wrappingKey[MEDIA_KEY_SIZE]);
+
+extern void init_media_crypto(media_crypto_t* crypto, const uint8_t key[MEDIA_KEY_SIZE], uint8_t sender, uint32_t token);
+extern void destroy_media_crypto(media_crypto_t* crypto);
+
+extern size_t media_seal(media_crypto_t* crypto, uint8_t* packet, uint8_t type, uint8_t format, uint32_t timestamp, const void* payload, size_t length);
+extern int    media_open(media_crypto_t* crypto, uint8_t* packet, size_t length, uint8_t** payload, size_t* payloadLength);
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef SRC_X25519_H
+#define SRC_X25519_H
+
+#include <stdint.h>
+
+#define X25519_KEY_SIZE 32
+
+/**
+ * Diffie-Hellman over Curve25519, as in RFC 7748.
+ *
+ * Constant time, and slow next to the cipher, so it is only run once per
+ * call to agree that call's key.
+ */
+extern void x25519(uint8_t out[X25519_KEY_SIZE], const uint8_t scalar[X25519_KEY_SIZE], const uint8_t point[X25519_KEY_SIZE]);
+
+/**
+ * Make a fresh secret from the system's random source, and its public key.
+ */
+extern int x25519_keypair(uint8_t secret[X25519_KEY_SIZE], uint8_t publicKey[X25519_KEY_SIZE]);
+
+/**
+ * The shared secret of `secret` and the peer's public key. Fails if the peer
+ * sent a point that forces a known result.
+ */
+extern int x25519_shared(uint8_t out[X25519_KEY_SIZE], const uint8_t secret[X25519_KEY_SIZE], const uint8_t peerKey[X25519_KEY_SIZE]);
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef SRC_DIAL_PLAN_H
+#define SRC_DIAL_PLAN_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define DIAL_PLAN_MAX_NUMBERS 256
+#define DIAL_PLAN_MAX_DIGITS 5
+#define DIAL_PLAN_MAX_NODES (DIAL_PLAN_MAX_NUMBERS * DIAL_PLAN_MAX_DIGITS + 1)
+
+/**
+ * A trie node. The children of a node are stored next to each other in digit
+ * order, so the child for digit d is at `first` plus the number of lower
+ * digits set in `children`.
+ */
+typedef struct dial_plan_node {
+    uint16_t children; // Bit d set if digit d follows
+    uint16_t first;
+    bool terminal;     // A number ends here
+} dial_plan_node_t;
+
+/**
+ * The numbers that can be called, as a prefix trie of their decimal digits.
+ */
+typedef struct dial_plan {
+    int node_count;
+    int number_count;
+    dial_plan_node_t nodes[DIAL_PLAN_MAX_NODES];
+} dial_plan_t;
+
+extern void init_dial_plan(dial_plan_t* plan);
+extern int  dial_plan_build(dial_plan_t* plan, const uint16_t* numbers, int count);
+extern bool dial_plan_complete(const dial_plan_t* plan, int number, int digits);
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef SRC_PULSE_DECODER_H
+#define SRC_PULSE_DECODER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Phone numbers are 16 bit, so never more than 5 digits
+#define PULSE_DECODER_MAX_DIGITS 5
+
+#define EDGE_SOURCE_BATCH 16
+
+/**
+ * A single transition of the dial line, timestamped when it happened rather
+ * than when it was read.
+ */
+typedef struct dial_edge {
+    uint64_t timestamp_ns; // edge_source_now() clock
+    bool rising;
+} dial_edge_t;
+
+/**
+ * Somewhere dial edges come from. `fd` becomes readable when edges are
+ * waiting, so it can be added to an event loop.
+ */
+typedef struct edge_source {
+    int fd;
+    int writefd; // Mock sources only, -1 otherwise
+    int (*read)(struct edge_source* source, dial_edge_t* edges, int maxEdges);
+} edge_source_t;
+
+/**
+ * Returns true if the digits dialled so far can only be a whole number.
+ */
+typedef bool (*number_complete_t)(void* data, int number, int digits);
+
+typedef struct pulse_decoder_conf {
+    uint64_t debounce_ns;       // Edges closer than this to the last are bounce
+    uint64_t digit_gap_ns;      // Silence after a pulse that ends a digit
+    uint64_t number_timeout_ns; // Silence after a pulse that ends the number
+} pulse_decoder_conf_t;
+
+/**
+ * Turns rotary dial pulses into whole numbers.
+ *
+ * A dial breaks the line once per pulse, ten times a second, with a longer
+ * pause between digits. All timing is taken from the edge timestamps, so a
+ * late wakeup cannot merge or split digits.
+ */
+typedef struct pulse_decoder {
+    pulse_decoder_conf_t conf;
+    bool seenEdge;
+    uint64_t lastEdgeNs;  // Last edge that was not bounce
+    uint64_t lastPulseNs;
+    int pulses;           // In the current digit
+    int digits;
+    int number;
+    number_complete_t complete; // Optional, ends numbers early
+    void* completeData;
+} pulse_decoder_t;
+
+extern void init_pulse_decoder(pulse_decoder_t* decoder, const pulse_decoder_conf_t* conf);
+extern void pulse_decoder_reset(pulse_decoder_t* decoder);
+extern void pulse_decoder_set_complete(pulse_decoder_t* decoder, number_complete_t complete, void* data);
+
+extern bool pulse_decoder_edge(pulse_decoder_t* decoder, const dial_edge_t* edge, int* number);
+extern bool pulse_decoder_expire(pulse_decoder_t* decoder, uint64_t nowNs, int* number);
+extern uint64_t pulse_decoder_deadline(const pulse_decoder_t* decoder);
+
+extern int  open_gpio_edge_source(edge_source_t* source, const char* chip, unsigned int pin);
+extern int  open_mock_edge_source(edge_source_t* source);
+extern int  mock_edge_source_push(edge_source_t* source, uint64_t timestampNs, bool rising);
+extern void close_edge_source(edge_source_t* source);
+extern uint64_t edge_source_now(void);
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef SRC_CONFERENCE_H
+#define SRC_CONFERENCE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <netinet/in.h>
+#include "crypto/media_crypto.h"
+
+#define CONFERENCE_MAX_MEMBERS 8
+
+/**
+ * One member of a conference, as the server signalled it. The bridge holds a
+ * key per member, agreed with it like a peer would, so it can open, mix and
+ * seal the audio.
+ */
+typedef struct conference_member_info {
+    uint32_t token;          // As in the member's media headers, 0 while the slot is free
+    struct sockaddr_in addr; // Port 0 until taken from the member's first packet
+    uint8_t key[MEDIA_KEY_SIZE];
+    bool keyed;              // The key is agreed, audio can be opened
+    bool live;               // Answered, mixed in and sent the others
+} conference_member_info_t;
+
+/**
+ * Shared between the server and the bridge's child. Only the server writes
+ * the members, `generation` is odd while it does.
+ */
+typedef struct conference_bridge {
+    int sockfd;
+    uint16_t port;
+    pid_t pid;
+    unsigned int wireRate;
+    atomic_uint generation;
+    conference_member_info_t members[CONFERENCE_MAX_MEMBERS];
+} conference_bridge_t;
+
+int  start_conference_bridge(conference_bridge_t** bridge, uint16_t port, unsigned int wireRate);
+void stop_conference_bridge(conference_bridge_t* bridge);
+void set_conference_member(conference_bridge_t* bridge, int slot, const conference_member_info_t* member);
+
+#endif
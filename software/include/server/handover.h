@@ -0,0 +1,76 @@
+#ifndef SRC_HANDOVER_H
+#define SRC_HANDOVER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "server/server.h"
+
+// Set for the upgraded server to the end of the socket it is handed over on
+#define HANDOVER_ENV "SERVER_HANDOVER_FD"
+
+#define HANDOVER_MAGIC "srho"
+#define HANDOVER_VERSION 1
+
+// How long the old server waits for the new one to say it is serving
+#define HANDOVER_TIMEOUT_MS 5000
+
+// Each record is one datagram on the handover socket, its type then its payload
+enum HANDOVER_RECORD_TYPE {
+    HANDOVER_HELLO         = 1, // A handover_hello_t, always first
+    HANDOVER_LISTENER      = 2, // The listening socket, no payload
+    HANDOVER_CONNECTION    = 3, // A handover_connection_t and the node's socket
+    HANDOVER_CLIENT        = 4, // A handover_client_t
+    HANDOVER_PENDING_CALL  = 5, // A call_info_t
+    HANDOVER_ONGOING_CALL  = 6, // A call_info_t
+    HANDOVER_RELAY         = 7, // What backs a relay's udp_port_info_t, no payload
+    HANDOVER_DONE          = 8, // Last from the old server
+    HANDOVER_READY         = 9, // From the new server, it is serving
+};
+
+/**
+ * Starts the handover. State goes across as the server holds it, so the new
+ * server only takes it if it was built with the same layouts, relays carry on
+ * with theirs too.
+ */
+typedef struct handover_hello {
+    char magic[4]; // HANDOVER_MAGIC
+    uint32_t version;
+    uint32_t connection_size;
+    uint32_t client_size;
+    uint32_t call_size;
+    uint32_t port_info_size;
+} PACKED_STRUCT handover_hello_t;
+
+/**
+ * A node's control connection, with whatever of its messages has arrived but
+ * not been handled.
+ */
+typedef struct handover_connection {
+    uint8_t index; // In the server's connections, keepalives are kept by it
+    struct sockaddr_in address;
+    socklen_t addrLen;
+    uint64_t heardNs;
+    bool keepalive; // Has sent a heartbeat
+    message_buffer_t messages;
+} handover_connection_t;
+
+typedef struct handover_client {
+    int connection; // Index, -1 while detached
+    client_info_t client;
+} handover_client_t;
+
+void upgrade_server(server_t* server);
+int take_over(server_t* server);
+
+int start_successor(char** argv, int* sockfd, pid_t* pid);
+int take_handover_fd(void);
+
+int offer_handover(int sockfd, int listener);
+int accept_handover(int sockfd, int* listener);
+
+int handover_send(int sockfd, uint8_t type, const void* payload, size_t length, int fd);
+int handover_receive(int sockfd, uint8_t* type, void* payload, size_t size, size_t* length, int* fd);
+int await_handover_ready(int sockfd);
+
+#endif
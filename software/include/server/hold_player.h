@@ -0,0 +1,35 @@
+#ifndef SRC_HOLD_PLAYER_H
+#define SRC_HOLD_PLAYER_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <netinet/in.h>
+#include "crypto/media_crypto.h"
+#include "server/upd_forward.h"
+#include "server/prompt.h"
+
+#define HOLD_MAX_LISTENERS 64
+
+/**
+ * Shared between the server and the player's child. Only the server writes
+ * the key and the listeners, `generation` is odd while it does.
+ *
+ * Every listener hears the same packets under the same key, as with a page,
+ * so a block is sealed once however many calls are on hold.
+ */
+typedef struct hold_player {
+    int sockfd;
+    uint16_t port;
+    pid_t pid;
+    const prompt_t* prompt;
+    atomic_uint generation;
+    uint8_t key[MEDIA_KEY_SIZE];
+    relay_binding_t listeners[HOLD_MAX_LISTENERS];
+} hold_player_t;
+
+int  start_hold_player(hold_player_t** player, uint16_t port, const prompt_t* prompt, const uint8_t* key);
+void stop_hold_player(hold_player_t* player);
+void set_hold_key(hold_player_t* player, const uint8_t* key);
+void set_hold_listener(hold_player_t* player, int slot, const relay_binding_t* binding);
+
+#endif
@@ -0,0 +1,118 @@
+#ifndef SRC_JOURNAL_H
+#define SRC_JOURNAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "server/packets.h"
+#include "utils/args.h"
+
+// The journal is mapped whole. A snapshot of a full server is a few KiB, so
+// this leaves room for thousands of changes between compactions
+#define JOURNAL_SIZE (256u * 1024)
+
+// At least the server's own limits
+#define JOURNAL_MAX_CLIENTS 16
+#define JOURNAL_MAX_CALLS 16
+
+#define JOURNAL_MAGIC "srjl"
+#define JOURNAL_VERSION 1
+
+// Each change to the registry or the call table is one record
+enum JOURNAL_RECORD_TYPE {
+    JOURNAL_CLIENT      = 1, // A journal_client_t, replacing any with its number
+    JOURNAL_CLIENT_GONE = 2, // The phone number forgotten
+    JOURNAL_CALL        = 3, // A journal_call_t, replacing any with its caller token
+    JOURNAL_CALL_GONE   = 4, // The caller token of the call ended
+};
+
+/**
+ * Starts the file, written once when it is created. Records follow it back
+ * to back up to the first that fails its checksum or is out of sequence,
+ * the rest of the file is zero.
+ */
+typedef struct journal_header {
+    char magic[4]; // JOURNAL_MAGIC
+    uint32_t version;
+    uint64_t sequence; // Of the first record
+    uint32_t checksum; // Of the fields before it
+} PACKED_STRUCT journal_header_t;
+
+typedef struct journal_record {
+    uint32_t checksum; // CRC-32 of the rest of the record and its payload
+    uint16_t length;   // Of the payload that follows
+    uint8_t type;      // JOURNAL_RECORD_TYPE
+    uint8_t reserved;
+    uint64_t sequence; // One more than the record before
+} PACKED_STRUCT journal_record_t;
+
+/**
+ * A registered node, as much as it takes to resume its session. Addresses
+ * are in network byte order, the rest in the server's, like the voicemail
+ * store the journal is not meant to move between machines.
+ */
+typedef struct journal_client {
+    uint16_t phone_number;
+    uint8_t token[SESSION_TOKEN_SIZE];
+    uint32_t address;
+    uint32_t wire_rate;
+    uint8_t codecs;
+} PACKED_STRUCT journal_client_t;
+
+/**
+ * An answered call of two, as much as it takes to start its relay again and
+ * tell either side of it after a resume.
+ */
+typedef struct journal_call {
+    uint16_t caller;
+    uint16_t callee;
+    uint16_t port;
+    uint32_t caller_token;
+    uint32_t callee_token;
+    uint16_t caller_media_port;
+    uint16_t callee_media_port;
+    uint32_t caller_media_address;
+    uint32_t callee_media_address;
+    uint8_t caller_key[MEDIA_PUBLIC_KEY_SIZE];
+    uint8_t callee_key[MEDIA_PUBLIC_KEY_SIZE];
+} PACKED_STRUCT journal_call_t;
+
+/**
+ * What the records add up to, kept alongside them so a compaction needs
+ * nothing from the server.
+ */
+typedef struct journal_state {
+    int client_count;
+    journal_client_t clients[JOURNAL_MAX_CLIENTS];
+    int call_count;
+    journal_call_t calls[JOURNAL_MAX_CALLS];
+} journal_state_t;
+
+/**
+ * A write-ahead journal of the server's registry and call table, in one
+ * file mapped shared. A record is in the page cache once it is written, so
+ * survives the server crashing, and the kernel is asked to write it out
+ * straight away.
+ *
+ * A compaction writes the state as it stands to a new file and renames it
+ * over the old, so the journal is only ever the one or the other.
+ */
+typedef struct journal {
+    char path[JOURNAL_PATH_LEN];
+    int fd; // -1 without a journal
+    uint8_t* base;
+    size_t length; // Up to the end of the last record
+    uint64_t sequence; // Of the next record
+    uint32_t appended; // Records since the last compaction
+    journal_state_t state;
+} journal_t;
+
+int  open_journal(journal_t* journal, const char* path);
+void close_journal(journal_t* journal);
+int  compact_journal(journal_t* journal);
+
+int  journal_put_client(journal_t* journal, const journal_client_t* client);
+int  journal_drop_client(journal_t* journal, uint16_t phoneNumber);
+int  journal_put_call(journal_t* journal, const journal_call_t* call);
+int  journal_drop_call(journal_t* journal, uint32_t callerToken);
+
+#endif
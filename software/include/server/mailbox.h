@@ -0,0 +1,64 @@
+#ifndef SRC_MAILBOX_H
+#define SRC_MAILBOX_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <netinet/in.h>
+#include "crypto/media_crypto.h"
+#include "server/voicemail.h"
+
+// Room for the longest message taken, 80 s of L16 at 48 kHz in 20 ms blocks.
+// The pages of the shared mapping are only used once written
+#define MAILBOX_MAX_BYTES (8u * 1024 * 1024)
+
+/**
+ * The node on the line, as the server signalled it. The mailbox agrees a key
+ * with it as a conference bridge does with a member.
+ */
+typedef struct mailbox_peer {
+    uint32_t token;          // As in the node's media headers
+    struct sockaddr_in addr; // Port 0 until taken from the node's first packet
+    uint8_t key[MEDIA_KEY_SIZE];
+    bool keyed;
+    unsigned int wireRate;   // A message's timestamps count at this
+} mailbox_peer_t;
+
+/**
+ * Shared between the server and the mailbox's child, which either records
+ * one message or plays a mailbox's messages to its owner.
+ *
+ * Only the server writes the peer, `generation` is odd while it does. Only
+ * the child writes the message, and the server reads it once the child is
+ * gone.
+ */
+typedef struct mailbox {
+    int sockfd;
+    uint16_t port;
+    pid_t pid;
+    bool playing;
+    uint16_t owner;
+    uint16_t from_phone_number; // Leaving the message
+    atomic_uint generation;
+    mailbox_peer_t peer;
+    atomic_bool finished; // Every message played, or the message is full
+
+    // Playing
+    char directory[VOICEMAIL_DIRECTORY_LEN];
+    int message_count;
+    voicemail_entry_t messages[VOICEMAIL_MAX_MESSAGES]; // Newest first
+
+    // Recording, as voicemail_frame_t followed by the block
+    uint32_t max_ms;
+    uint32_t recorded_frames;
+    atomic_size_t length;
+    uint8_t frames[MAILBOX_MAX_BYTES];
+} mailbox_t;
+
+int  start_mailbox_recording(mailbox_t** mailbox, uint16_t port, uint16_t owner, uint16_t from, uint32_t maxMs);
+int  start_mailbox_playback(mailbox_t** mailbox, uint16_t port, const voicemail_store_t* store, const voicemail_entry_t* messages, int count);
+void stop_mailbox(mailbox_t* mailbox, voicemail_store_t* store);
+void set_mailbox_peer(mailbox_t* mailbox, const mailbox_peer_t* peer);
+bool mailbox_finished(mailbox_t* mailbox);
+
+#endif
@@ -2,26 +2,62 @@
 #define SRC_PACKETS_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 #define HANDSHAKE_MAGIC "bro"
 #define HANDSHAKE_MAGIC_SIZE sizeof(HANDSHAKE_MAGIC)
 
 #define PACKED_STRUCT __attribute((packed))
 
+#define SESSION_TOKEN_SIZE 16
+
+// X25519 public keys, exchanged to agree each call's media key
+#define MEDIA_PUBLIC_KEY_SIZE 32
+
+// A page's media key, sealed for one listener
+#define MEDIA_WRAPPED_KEY_SIZE 48
+
+// Nodes send an empty HEARTBEAT this often. Once one has, the server drops
+// its connection after three and a half intervals without a message
+#define HEARTBEAT_INTERVAL_MS 10000
+
 enum MSG_ID {
     HANDSHAKE_REQUEST       = 1,
     HANDSHAKE_RESPONSE      = 2,
+    DIAL_PLAN               = 3,
+    RESUME_REQUEST          = 4,
+    RESUME_RESPONSE         = 5,
+    HEARTBEAT               = 6,
     CALL_REQUEST            = 10,
     CALL_RESPONSE           = 11,
     INCOMING_CALL           = 12,
     INCOMING_RESPONSE       = 13,
+    CALL_ANSWERED           = 14,
+    CALL_RINGING            = 15,
+    CONFERENCE_ADD          = 16,
+    CONFERENCE_JOIN         = 17,
+    CONFERENCE_JOINED       = 18,
     TERMINATE_CALL          = 20,
     CLIENT_TERMINATE_CALL   = 21,
+    PAGE_RESPONSE           = 30,
+    INCOMING_PAGE           = 31,
+    PAGE_LISTEN             = 32,
+    PAGE_KEY                = 33,
+    RECORD_CALL             = 40,
+    RECORD_KEY              = 41,
+    VOICEMAIL_DIVERT        = 50,
+    VOICEMAIL_JOINED        = 51,
+    CALL_HOLD               = 60,
+    HOLD_START              = 61,
+    HOLD_JOINED             = 62,
+    HOLD_KEY                = 63,
+    HOLD_END                = 64,
 };
 
 enum TERMINATE_CODE {
     CALL_PUTDOWN = 1,
     SERVER_ERROR = 2,
+    NUMBER_UNAVAILABLE = 3,
 };
 
 #define MESSAGE_WRAPPER_START ((uint8_t)0xAA)
@@ -29,51 +65,137 @@ enum TERMINATE_CODE {
 
 /**
  * Message wrapper for all server - client communication
+ * 
+ * A message sent as a request carries a non zero request id, and every reply
+ * to it echoes that id, so several requests can be in flight at once. Other
+ * messages use request id 0.
  */
 struct message_wrapper {
-    uint8_t start;  // 0xAA
-    uint8_t length; // 0-256 bytes
+    uint8_t start;   // 0xAA
+    uint8_t length;  // 0-256 bytes
     uint8_t id;
+    uint8_t request; // 0 if not a request or a reply
     uint8_t data[];
 };
 
 /**
  * Sent by a node to the server to request a handshake.
  * 
- * Phone number represents the node's preferred phone number.
+ * Phone number represents the node's preferred phone number. The wire rate
+ * and codecs are what the node sends and receives audio in, a call between
+ * nodes that differ is transcoded by its relay. A node that leaves them off
+ * is taken to match any other.
  */
 struct handshake_request {
     uint16_t phone_number;
     char magic[4];
+    uint32_t wire_sample_rate;
+    uint8_t codecs; // MEDIA_CODEC_BIT of each it decodes
 } PACKED_STRUCT;
 
 /**
  * Sent by the server to a node to accept a handshake.
  * 
- * Returns the clients allocated number.
+ * Returns the clients allocated number, and a token the node can later resume
+ * the session with instead of handshaking again.
  */
 struct handshake_response {
     uint16_t phone_number;
     char magic[4];
+    uint8_t token[SESSION_TOKEN_SIZE];
 } PACKED_STRUCT;
 
+enum RESUME_CALL_STATE {
+    RESUME_NO_CALL      = 0,
+    RESUME_CALL_PENDING = 1,
+    RESUME_CALL_ONGOING = 2,
+};
+
+/**
+ * Sent by a node after reconnecting, to take back the session the token was
+ * issued for.
+ */
+struct resume_request {
+    uint8_t token[SESSION_TOKEN_SIZE];
+} PACKED_STRUCT;
+
+/**
+ * Sent by the server in reply to a resume request.
+ * 
+ * If accepted the node keeps its phone number, and is told what the server
+ * knows of its call so the two can agree. Otherwise the session has expired
+ * and the node must handshake again.
+ */
+struct resume_response {
+    uint8_t accepted;
+    uint16_t phone_number;
+    uint8_t call_state;
+    uint16_t udp_server_port;
+} PACKED_STRUCT;
+
+#define DIAL_PLAN_FIRST 0x1
+#define DIAL_PLAN_LAST  0x2
+#define DIAL_PLAN_CHUNK ((UINT8_MAX - sizeof(struct dial_plan_update)) / sizeof(uint16_t))
+
+/**
+ * Sent by the server to a node after the handshake, and whenever the numbers
+ * online change, listing the numbers that can be called.
+ * 
+ * Plans longer than DIAL_PLAN_CHUNK numbers are split over several messages,
+ * the first has DIAL_PLAN_FIRST set and the last DIAL_PLAN_LAST.
+ */
+struct dial_plan_update {
+    uint8_t flags;
+    uint16_t numbers[];
+} PACKED_STRUCT;
+
+/**
+ * Where a node sends and receives media, both in network order.
+ * 
+ * A node signals its own, with the address it has on its network. The server
+ * offers each node the peer's, so they can try a direct path, using the
+ * address the peer's control connection comes from unless both come from the
+ * same one, as from behind one NAT. A port of 0 is no address.
+ */
+struct media_candidate {
+    uint32_t address;
+    uint16_t port;
+} PACKED_STRUCT;
+
+// The caller asks for the call to be recorded
+#define CALL_FLAG_RECORD 0x1
+// From the server, the key a node gets is the server's relay or conference
+// bridge rather than its peer's, which hears the call in the clear
+#define CALL_FLAG_RELAYED_CLEAR 0x2
+
 /**
  * Sent by a client to the server to request a call.
  * 
  * The server can send back a call response for a successful call, or a 
- * terminate call for unsuccessful.
+ * terminate call for unsuccessful. The public key is passed on to the callee.
+ * 
+ * The media candidate is where the caller will send audio from, so the relay
+ * can forward to it before it has heard from the caller. Its port is 0 if it
+ * is not known yet, the relay then takes it from the caller's first packet.
  */
 struct call_request {
     uint16_t to_phone_number;
     uint16_t from_phone_number;
+    uint8_t public_key[MEDIA_PUBLIC_KEY_SIZE];
+    struct media_candidate media;
+    uint8_t flags; // CALL_FLAG
 } PACKED_STRUCT;
 
 /**
  * Sent by the server to the client to indicate whether their call request 
  * has been accepted or not.
+ * 
+ * The media token goes in the header of every media packet the client sends
+ * on the call, see media_header.
  */
 struct call_response {
     uint16_t udp_server_port;
+    uint32_t media_token;
 } PACKED_STRUCT;
 
 /**
@@ -83,19 +205,259 @@ struct call_response {
  * for incoming audio data, and write its own audio data.
  * 
  * A client should reply with an incoming_response message to accept, or a 
- * terminate_call message to reject.
+ * client_terminate_call message to reject.
  */
 struct incoming_call {
     uint16_t from_phone_number;
     uint16_t udp_server_port;
+    uint8_t public_key[MEDIA_PUBLIC_KEY_SIZE]; // The caller's
+    uint32_t media_token;                      // The callee's, see call_response
+    struct media_candidate caller_media;       // Offered for a direct path
+    uint8_t flags;                             // CALL_FLAG
 } PACKED_STRUCT;
 
 /**
  * Sent by the client to the server to represent accepting an incoming phone 
  * call.
+ * 
+ * The server replies with a call response once the call is connected, or a
+ * terminate call if the caller has already gone.
  */
 struct incoming_response {
     uint16_t from_phone_number;
+    uint8_t public_key[MEDIA_PUBLIC_KEY_SIZE];
+} PACKED_STRUCT;
+
+/**
+ * Sent by server to the caller when the callee picks up, with the callee's
+ * public key and media candidate, in case the caller missed them while
+ * ringing.
+ */
+struct call_answered {
+    uint8_t public_key[MEDIA_PUBLIC_KEY_SIZE];
+    struct media_candidate callee_media;
+    uint8_t flags; // CALL_FLAG
+} PACKED_STRUCT;
+
+/**
+ * Sent by the callee to the server once its phone rings, and passed on to the
+ * caller. It carries the callee's public key, so both nodes agree the media
+ * key and open the audio path before the call is answered.
+ * 
+ * The media candidate is the callee's, as in call_request. When passed on it
+ * is the one offered to the caller for a direct path.
+ */
+struct call_ringing {
+    uint16_t phone_number; // The callee's
+    uint8_t public_key[MEDIA_PUBLIC_KEY_SIZE];
+    struct media_candidate media;
+    uint8_t flags; // CALL_FLAG, 0 from the callee
+} PACKED_STRUCT;
+
+/**
+ * Sent by a node in a call to add another number to it, which makes the call
+ * a conference if it is not one already.
+ *
+ * The server replies with a conference join, or a terminate call if the
+ * number cannot be added, which leaves the call as it was. The number added
+ * is sent an incoming call, keyed with the bridge rather than a peer.
+ */
+struct conference_add {
+    uint16_t phone_number; // The node's own
+    uint16_t to_phone_number;
+} PACKED_STRUCT;
+
+/**
+ * Sent by the server to each member of a call that became a conference, to
+ * move its media to the bridge. The bridge mixes the audio, so the node
+ * agrees a fresh media key with the bridge's public key, as it would with a
+ * peer, and replies with a conference joined.
+ *
+ * A node already sending to the port with the token has nothing to do.
+ */
+struct conference_join {
+    uint16_t udp_server_port;
+    uint32_t media_token;
+    uint8_t public_key[MEDIA_PUBLIC_KEY_SIZE]; // The bridge's
+    uint8_t flags;                             // CALL_FLAG, the bridge hears the call in the clear
+} PACKED_STRUCT;
+
+/**
+ * Sent by a node to the server once it has moved to the bridge.
+ */
+struct conference_joined {
+    uint16_t phone_number;
+    uint8_t public_key[MEDIA_PUBLIC_KEY_SIZE];
+} PACKED_STRUCT;
+
+/**
+ * Sent by the server in reply to a call request for a page group's number,
+ * instead of a call response. The pager speaks straight away, nobody answers.
+ *
+ * Every listener gets the same packets, so the pager makes up the page's
+ * media key and hands it to each listener sealed under a key agreed with
+ * that listener, see page_key. The server never sees it.
+ */
+struct page_response {
+    uint16_t udp_server_port;
+    uint32_t media_token;
+} PACKED_STRUCT;
+
+/**
+ * Sent by the server to each node in a page group that is free. The node
+ * answers by itself, replying with a page listen, and plays the page once the
+ * key arrives. It never sends audio.
+ *
+ * The media sender is the node's own for the page, MEDIA_SENDER_LISTENER or
+ * above, so the listeners' reports never share a nonce under the one key.
+ */
+struct incoming_page {
+    uint16_t from_phone_number;
+    uint16_t udp_server_port;
+    uint8_t public_key[MEDIA_PUBLIC_KEY_SIZE]; // The pager's, from its call request
+    uint32_t media_token;                      // The listener's, see call_response
+    uint8_t media_sender;
+} PACKED_STRUCT;
+
+/**
+ * Sent by a paged node to the server, and passed on to the pager, with the
+ * listener's public key for the pager to seal the page's key to. The media
+ * candidate is the listener's, as in call_request, so the relay can send to
+ * it from the first packet.
+ */
+struct page_listen {
+    uint16_t phone_number; // The listener's
+    uint8_t public_key[MEDIA_PUBLIC_KEY_SIZE];
+    struct media_candidate media;
+} PACKED_STRUCT;
+
+/**
+ * Sent by the pager to the server for each listener, and passed on to it. The
+ * page's media key is sealed under the key the two agree from their public
+ * keys.
+ */
+struct page_key {
+    uint16_t phone_number; // The listener's
+    uint8_t wrapped_key[MEDIA_WRAPPED_KEY_SIZE];
+} PACKED_STRUCT;
+
+/**
+ * Sent by the server to both sides of a call that is to be recorded, after
+ * the call response or incoming call. The relay can only record what it can
+ * open, so the caller seals the call's media key to the recorder's public
+ * key once it is agreed and replies with a record key. The callee is only
+ * told. A recorded call is never offered a direct path.
+ */
+struct record_call {
+    uint8_t public_key[MEDIA_PUBLIC_KEY_SIZE]; // The recorder's
+    uint8_t seal;                              // 1 for the side that seals the key
+} PACKED_STRUCT;
+
+/**
+ * Sent by the caller of a recorded call, with the media key sealed under a
+ * key agreed from a fresh key pair of its own and the recorder's public key.
+ * The wire rate is the one the call's audio is timestamped at.
+ */
+struct record_key {
+    uint16_t phone_number;
+    uint8_t public_key[MEDIA_PUBLIC_KEY_SIZE];
+    uint8_t wrapped_key[MEDIA_WRAPPED_KEY_SIZE];
+    uint32_t wire_sample_rate;
+} PACKED_STRUCT;
+
+/**
+ * Sent by the server to the caller of a call the callee turned down or left
+ * ringing, to leave a message in the callee's mailbox instead. As with a
+ * conference join, the node agrees a fresh media key with the mailbox's
+ * public key, moves its media to the port with the token and replies with a
+ * voicemail joined. The mailbox has to keep the audio, so it is in the clear
+ * on the server.
+ *
+ * A node already sending to the port with the token has nothing to do.
+ *
+ * Dialling the voicemail number is answered like any call, with the
+ * mailbox's public key in the call answered, and plays the node its
+ * messages.
+ */
+struct voicemail_divert {
+    uint16_t udp_server_port;
+    uint32_t media_token;
+    uint8_t public_key[MEDIA_PUBLIC_KEY_SIZE]; // The mailbox's
+    uint8_t flags;                             // CALL_FLAG, the mailbox hears the call in the clear
+} PACKED_STRUCT;
+
+/**
+ * Sent by a node to the server once it has moved to the mailbox. The wire
+ * rate is the one its audio is timestamped at.
+ */
+struct voicemail_joined {
+    uint16_t phone_number;
+    uint8_t public_key[MEDIA_PUBLIC_KEY_SIZE];
+    uint32_t wire_sample_rate;
+} PACKED_STRUCT;
+
+/**
+ * Sent by a node in a call of two to put the other side on hold, as a
+ * request, or to take it off hold. The server echoes a hold back once the
+ * other side has been moved to the hold player, or replies with a terminate
+ * call if it cannot be, and the call carries on. The node stops its audio
+ * meanwhile.
+ *
+ * Taking the call off hold, the node sends the public key of a fresh key
+ * pair, and the two sides agree a new media key through the server as they
+ * did when the call started. The holder's is passed on in a hold end, the
+ * held side's comes back in another.
+ */
+struct call_hold {
+    uint16_t phone_number;
+    uint8_t hold; // 1 to put on hold, 0 to take off
+    uint8_t public_key[MEDIA_PUBLIC_KEY_SIZE]; // Taking off hold only
+} PACKED_STRUCT;
+
+/**
+ * Sent by the server to the side put on hold. Every node on hold hears the
+ * same packets under the hold program's key, as with a page, so the node
+ * agrees a key with the server's public key here, replies with a hold joined
+ * and is sent the program's key sealed under it in a hold key. It never
+ * sends audio, and its media sender is its own, MEDIA_SENDER_LISTENER or
+ * above.
+ */
+struct hold_start {
+    uint16_t udp_server_port;
+    uint32_t media_token;
+    uint8_t media_sender;
+    uint8_t public_key[MEDIA_PUBLIC_KEY_SIZE]; // The server's, for this hold
+} PACKED_STRUCT;
+
+/**
+ * Sent by the side on hold, with the public key of a fresh key pair, after a
+ * hold start and after a hold end.
+ */
+struct hold_joined {
+    uint16_t phone_number;
+    uint8_t public_key[MEDIA_PUBLIC_KEY_SIZE];
+} PACKED_STRUCT;
+
+/**
+ * Sent by the server to the side on hold, the hold program's key sealed
+ * under the key agreed from the hold start.
+ */
+struct hold_key {
+    uint8_t wrapped_key[MEDIA_WRAPPED_KEY_SIZE];
+} PACKED_STRUCT;
+
+/**
+ * Sent by the server to each side of a call taken off hold, with the other
+ * side's fresh public key, to move its media back to the call's relay under
+ * the key the two agree. The side that was on hold replies with a hold
+ * joined. A recorded call cannot be put on hold, the recorder would need the
+ * new key.
+ */
+struct hold_end {
+    uint16_t udp_server_port;
+    uint32_t media_token;
+    uint8_t media_sender;
+    uint8_t public_key[MEDIA_PUBLIC_KEY_SIZE]; // The other side's
 } PACKED_STRUCT;
 
 /**
@@ -113,7 +475,124 @@ struct client_terminate_call {
     uint16_t phone_number;
 } PACKED_STRUCT;
 
+#define MEDIA_VERSION 3
+#define MEDIA_TAG_SIZE 16
+
+enum MEDIA_SENDER {
+    MEDIA_SENDER_CALLER = 0,
+    MEDIA_SENDER_CALLEE = 1,
+    MEDIA_SENDER_RELAY = 2,
+    MEDIA_SENDER_LISTENER = 3, // The first of a page's listeners, one each
+};
+
+enum MEDIA_TYPE {
+    MEDIA_TYPE_AUDIO = 0,        // Sealed, encoded audio blocks
+    MEDIA_TYPE_REPORT = 1,       // Sealed, a media_report on the stream received
+    MEDIA_TYPE_RELAY_REPORT = 2, // In the clear, a relay_report from the relay
+    MEDIA_TYPE_PROBE = 3,        // Sealed and empty, tries a direct path to the peer
+    MEDIA_TYPE_PROBE_ACK = 4,    // Sealed, answers a probe with its sequence number
+};
+
+#define MEDIA_TYPE_IS_PROBE(type) ((type) == MEDIA_TYPE_PROBE || (type) == MEDIA_TYPE_PROBE_ACK)
+
+enum MEDIA_CODEC {
+    MEDIA_CODEC_L16 = 0,   // 16 bit big endian samples
+    MEDIA_CODEC_PCMU = 1,  // G.711 mu-law, 8 bits a sample
+    MEDIA_CODEC_ADPCM = 2, // IMA ADPCM, 4 bits a sample
+    MEDIA_CODEC_COUNT,
+};
+
+#define MEDIA_CODEC_BIT(codec) ((uint8_t)(1 << (codec)))
+#define MEDIA_CODECS_ALL ((uint8_t)((1 << MEDIA_CODEC_COUNT) - 1))
+
+// Previous blocks carried in an audio packet to repair loss
+#define MEDIA_MAX_FEC 2
+
+#define MEDIA_FORMAT(codec, fec) ((uint8_t)(((fec) << 4) | (codec)))
+#define MEDIA_FORMAT_CODEC(format) ((format) & 0x0f)
+#define MEDIA_FORMAT_FEC(format) ((format) >> 4)
+
+/**
+ * Header in front of every media datagram, followed by the sealed payload and
+ * a MEDIA_TAG_SIZE tag.
+ *
+ * The header is sent in the clear but covered by the tag, so the relay can
+ * forward packets without holding any keys. The token is handed to each side
+ * of a call by the server, which binds it to where that side signalled it
+ * would send from, so the relay knows who sent a packet with one lookup and
+ * forwards even the first. It is opaque and 0 from the relay itself.
+ *
+ * The sender and sequence number make up the nonce, so they must never
+ * repeat under one call's key. Audio and reports share the sender's sequence
+ * numbers. Probes count their own, marked apart in the nonce, so probes lost
+ * on a path that does not work leave no gap in the stream. They are not
+ * checked for replays, an ack is only taken for the last probe sent.
+ *
+ * The timestamp counts samples at the wire rate, so the receiver can place
+ * each block whatever the packet time.
+ *
+ * An audio payload with a FEC depth of n starts with n big endian 16 bit
+ * lengths, followed by the n previous blocks, oldest first, and then the
+ * block the timestamp belongs to. All of them are in the packet's codec.
+ */
+struct media_header {
+    uint8_t version;
+    uint8_t sender;   // MEDIA_SENDER
+    uint8_t type;     // MEDIA_TYPE
+    uint8_t format;   // MEDIA_FORMAT of audio, 0 otherwise
+    uint32_t token;
+    uint32_t sequence;
+    uint32_t timestamp;
+} PACKED_STRUCT;
+
+/**
+ * Sent by each node about once a second, describing the stream it receives.
+ * Every field is big endian.
+ *
+ * The echo fields return the timestamp of the last report received and how
+ * long it was held, so the peer can take its round trip time without the
+ * clocks agreeing.
+ */
+struct media_report {
+    uint8_t fraction_lost;      // Since the last report, out of 256
+    uint8_t reserved;           // 0
+    uint16_t packets;           // Received since the last report
+    uint32_t cumulative_lost;
+    uint32_t highest_sequence;
+    uint32_t jitter_us;         // Interarrival jitter, as RFC 3550 estimates it
+    uint32_t timestamp_ms;      // Sender's monotonic clock
+    uint32_t echo_timestamp_ms; // 0 until a report has been received
+    uint32_t echo_delay_ms;
+} PACKED_STRUCT;
+
+/**
+ * Sent in the clear by an overloaded relay, asking a sender to stay under a
+ * bitrate for a while. It can only ever lower the sender's bitrate.
+ */
+struct relay_report {
+    uint32_t max_bitrate; // Bits a second on the wire, big endian
+} PACKED_STRUCT;
+
+#define MESSAGE_BUFFER_SIZE 1024
+
+/**
+ * Reassembles wrapped messages from a stream socket, where one recv() can
+ * return part of a message or several messages at once.
+ */
+typedef struct message_buffer {
+    uint8_t data[MESSAGE_BUFFER_SIZE];
+    size_t length;
+} message_buffer_t;
 
 void* receive_wrapped_message(void* msg, size_t msgLen, size_t desiredLen, uint8_t msgId);
 
+int send_wrapped_message(int sockfd, uint8_t msgId, uint8_t requestId, const void* data, uint8_t length);
+
+int configure_control_socket(int sockfd);
+
+void init_message_buffer(message_buffer_t* buffer);
+int  message_buffer_fill(message_buffer_t* buffer, int sockfd);
+struct message_wrapper* message_buffer_peek(message_buffer_t* buffer);
+void message_buffer_pop(message_buffer_t* buffer);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,30 @@
+#ifndef SRC_PAGE_RELAY_H
+#define SRC_PAGE_RELAY_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <netinet/in.h>
+#include "server/upd_forward.h"
+
+#define PAGE_MAX_LISTENERS 16
+
+/**
+ * Shared between the server and the page's child. Only the server writes
+ * the bindings, `generation` is odd while it does. A listener's slot is also
+ * its media sender, less MEDIA_SENDER_LISTENER.
+ */
+typedef struct page_relay {
+    int sockfd;
+    uint16_t port;
+    pid_t pid;
+    atomic_uint generation;
+    relay_binding_t pager;
+    relay_binding_t listeners[PAGE_MAX_LISTENERS];
+} page_relay_t;
+
+int  start_page_relay(page_relay_t** relay, uint16_t port);
+void stop_page_relay(page_relay_t* relay);
+void set_page_pager(page_relay_t* relay, const relay_binding_t* binding);
+void set_page_listener(page_relay_t* relay, int slot, const relay_binding_t* binding);
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef SRC_PROMPT_H
+#define SRC_PROMPT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Prompts are cut into blocks of this long, one a packet
+#define PROMPT_BLOCK_MS 20
+
+// Longest a prompt can be, all its files together
+#define PROMPT_MAX_SECONDS 600
+
+/**
+ * Audio the server sends nodes itself, decoded, resampled and encoded once
+ * when it is loaded into blocks ready to be sealed. It is one shared mapping,
+ * made before the players are forked, so however many calls hear it there is
+ * one copy and nothing is decoded per call.
+ *
+ * Every block encodes to the same size, so block n is found by its index.
+ */
+typedef struct prompt {
+    size_t size; // Of the whole mapping
+    unsigned int wireRate;
+    uint8_t codec; // MEDIA_CODEC
+    uint32_t blockFrames;
+    uint32_t blockSize;
+    uint32_t blockCount;
+    uint8_t blocks[];
+} prompt_t;
+
+int  load_prompt(prompt_t** prompt, const char* const* files, int count, unsigned int wireRate, int codec);
+void destroy_prompt(prompt_t* prompt);
+const uint8_t* prompt_block(const prompt_t* prompt, uint64_t index);
+
+#endif
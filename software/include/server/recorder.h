@@ -0,0 +1,31 @@
+#ifndef SRC_RECORDER_H
+#define SRC_RECORDER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "crypto/media_crypto.h"
+
+// Room for the directory, and the call's time and numbers after it
+#define RECORDING_PATH_LEN 192
+
+/**
+ * What a relay needs to record its call, written by the server once the
+ * caller has handed over the media key. Each side goes to its own file, the
+ * path with "-caller.wav" or "-callee.wav" after it.
+ */
+typedef struct recording_info {
+    bool keyed; // The rest is filled in, recording can start
+    bool adpcm; // IMA ADPCM rather than 16 bit PCM
+    unsigned int wireRate;
+    uint8_t key[MEDIA_KEY_SIZE];
+    char path[RECORDING_PATH_LEN];
+} recording_info_t;
+
+typedef struct recorder recorder_t;
+
+int  start_recorder(recorder_t** recorder, const recording_info_t* info, uint16_t port);
+void stop_recorder(recorder_t* recorder);
+void recorder_push(recorder_t* recorder, const uint8_t* packet, size_t length);
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef SRC_ROUTER_H
+#define SRC_ROUTER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "utils/args.h"
+
+// Digits of the longest number, 65535
+#define ROUTER_MAX_DIGITS 5
+
+// Configured routes, and one for each page group and the voicemail number
+#define ROUTER_MAX_ROUTES (ROUTE_MAX_ROUTES + PAGE_MAX_GROUPS + 1)
+
+// A range splits into at most 18 patterns for each length it spans
+#define ROUTER_MAX_PATTERNS 1024
+#define ROUTER_MAX_NODES (ROUTER_MAX_PATTERNS * ROUTER_MAX_DIGITS + 1)
+
+/**
+ * A trie node, laid out like the nodes' dial plan: the children of a node
+ * are next to each other in digit order, so the child for digit d is at
+ * `first` plus the number of lower digits set in `children`.
+ *
+ * Routes are numbered from 1, 0 is none. `any` matches every number going
+ * through the node, `tail[r]` only those with exactly r more digits, so a
+ * range is its prefixes with the rest of its digits left free.
+ */
+typedef struct route_node {
+    uint16_t children; // Bit d set if digit d follows
+    uint16_t first;
+    uint8_t any;
+    uint8_t tail[ROUTER_MAX_DIGITS + 1];
+    bool open; // A prefix or range matches numbers longer than the node's
+} route_node_t;
+
+/**
+ * The server's dial plan, as a prefix trie of decimal digits in one
+ * allocation. A number goes to the route matching the most of its digits,
+ * and between routes matching as many, to a range over a prefix and then to
+ * the earlier route.
+ *
+ * A router is never changed once built, a new plan is built alongside and
+ * replaces it whole.
+ */
+typedef struct router {
+    int route_count;
+    int number_count;
+    int node_count;
+    route_conf_t routes[ROUTER_MAX_ROUTES];
+    uint16_t numbers[ROUTER_MAX_ROUTES]; // Single numbers no prefix or range routes longer ones after
+    route_node_t nodes[];
+} router_t;
+
+extern int  build_router(router_t** router, const route_conf_t* routes, int count);
+extern void free_router(router_t* router);
+
+extern const route_conf_t* route_number(const router_t* router, uint16_t number);
+extern bool router_reserves(const router_t* router, uint16_t number);
+
+#endif
@@ -5,36 +5,209 @@
 #include <unistd.h>
 #include <stdint.h>
 #include "utils/args.h"
+#include "utils/event_loop.h"
+#include "utils/timer_wheel.h"
+#include "server/packets.h"
 #include "server/upd_forward.h"
+#include "server/conference.h"
+#include "server/page_relay.h"
+#include "server/voicemail.h"
+#include "server/mailbox.h"
+#include "server/prompt.h"
+#include "server/hold_player.h"
+#include "server/router.h"
+#include "server/journal.h"
+
+#define SERVER_MAX_CONNECTIONS 16
+#define SERVER_MAX_CLIENTS 10
+#define SERVER_MAX_CALLS 10 // Each of ringing and answered
+
+#define SERVER_MAX_CONFERENCES 4
+#define SERVER_MAX_PAGES 2
+#define SERVER_MAX_VOICEMAIL_CALLS 4
+
+// Open addressed, kept at most a third full so probes stay short
+#define SERVER_SESSION_SLOTS 32
+
+// A session timeout for each client, a ring or media timeout for each call,
+// a keepalive for each connection, and the journal, upgrade and hold timers.
+// Timers are left to find what they guard gone rather than cancelled, so the
+// wheel starts at twice that and grows past it if it has to
+#define SERVER_MAX_TIMERS (2 * (SERVER_MAX_CLIENTS + 2 * SERVER_MAX_CALLS + SERVER_MAX_CONNECTIONS + 3))
+
+// The listener, signal pipe, handover socket, timer wheel and voicemail
+// sweep, and each connection
+#define SERVER_LOOP_SOURCES (SERVER_MAX_CONNECTIONS + 5)
+
+#if SERVER_LOOP_SOURCES > EVENT_LOOP_MAX_SOURCES
+#error "The event loop cannot hold a source for each server connection"
+#endif
 
 typedef struct call_info {
-    uint64_t time;
+    uint64_t time; // Requested, by event_loop_now()
+    uint64_t relayed; // Since when both sides are expected at the relay, by event_loop_now()
     unsigned short port;
     int caller;
     int callee;
     pid_t pid;
+    uint8_t caller_key[MEDIA_PUBLIC_KEY_SIZE];
+    uint8_t callee_key[MEDIA_PUBLIC_KEY_SIZE]; // Once ringing
+    bool ringing;
+    uint32_t caller_token; // Carried in each side's media headers
+    uint32_t callee_token;
+    uint16_t caller_media_port; // As signalled, 0 if not known
+    uint16_t callee_media_port;
+    uint32_t caller_media_address; // As signalled, the node's own
+    uint32_t callee_media_address;
+    bool recorded;  // Kept on the relay, which records it once keyed
+    bool recording; // The caller's key arrived and was passed to the relay
+    uint8_t recorder_secret[X25519_KEY_SIZE]; // Wiped once the key arrives
+    uint8_t recorder_key[MEDIA_PUBLIC_KEY_SIZE];
+    bool transcoded; // The sides differ, the relay holds a key with each
+    bool relay_keyed[2]; // By MEDIA_SENDER, the side's key is agreed and passed to the relay
+    uint8_t relay_secret[2][X25519_KEY_SIZE]; // Wiped once the side's key is agreed
+    uint8_t relay_key[2][MEDIA_PUBLIC_KEY_SIZE]; // The relay's, as sent to each side
 } call_info_t;
 
+/**
+ * A member of a conference. The bridge keeps a key pair per member, the
+ * secret is wiped once the member's public key arrives and the key is agreed.
+ */
+typedef struct conference_member {
+    uint16_t phone_number;
+    uint8_t secret[X25519_KEY_SIZE];
+    uint8_t public_key[MEDIA_PUBLIC_KEY_SIZE]; // The bridge's, as sent to the member
+    bool joining; // Moved from the call, until it says it is on the bridge
+    conference_member_info_t info; // As written to the bridge, a token of 0 is a free slot
+} conference_member_t;
+
+/**
+ * A call of more than two, mixed by a bridge the server runs. Members are
+ * added to an ongoing call one at a time, and the conference ends once only
+ * one is left.
+ */
+typedef struct conference {
+    conference_bridge_t* bridge; // NULL while unused
+    conference_member_t members[CONFERENCE_MAX_MEMBERS];
+} conference_t;
+
+/**
+ * A node being paged. Its public key is kept until the pager has sealed the
+ * page's key to it, so it can be asked again after a reconnect.
+ */
+typedef struct page_listener {
+    uint16_t phone_number; // 0 while the slot is free
+    bool listening;        // Its public key has arrived
+    bool keyed;            // The page's key has been passed on to it
+    uint8_t public_key[MEDIA_PUBLIC_KEY_SIZE];
+    uint16_t media_port;   // As signalled, 0 if not known
+} page_listener_t;
+
+/**
+ * One node speaking to a group, fanned out by a relay the server runs. The
+ * page ends when the pager hangs up, or the last listener does.
+ */
+typedef struct page {
+    page_relay_t* relay; // NULL while unused
+    uint16_t pager;
+    uint8_t pager_key[MEDIA_PUBLIC_KEY_SIZE];
+    page_listener_t listeners[PAGE_MAX_LISTENERS];
+} page_t;
+
+/**
+ * A node on the line to a mailbox, leaving a message or hearing its own. The
+ * mailbox's secret is wiped once the key is agreed.
+ */
+typedef struct voicemail_call {
+    mailbox_t* mailbox; // NULL while unused
+    uint16_t phone_number; // The node on the line
+    uint64_t startedNs;
+    uint8_t secret[X25519_KEY_SIZE];
+    uint8_t public_key[MEDIA_PUBLIC_KEY_SIZE]; // The mailbox's, as sent to the node
+    mailbox_peer_t peer; // As written to the mailbox
+} voicemail_call_t;
+
+/**
+ * A call of two with one side on hold, kept in the slot of the hold player's
+ * listener. The server's secret is wiped once the held side's key arrives.
+ * Taken off hold, the slot is kept until each side has the other's new key.
+ */
+typedef struct hold {
+    uint16_t holder; // 0 while the slot is free
+    uint16_t held;
+    uint8_t sender;  // The held side's at the player
+    bool keyed;      // The program's key has been sealed to the held side
+    bool resuming;   // Taken off hold
+    bool rejoined;   // The held side's new key has arrived
+    uint8_t secret[X25519_KEY_SIZE];
+    uint8_t public_key[MEDIA_PUBLIC_KEY_SIZE]; // The server's, as sent to the held side
+    uint8_t wrapped_key[MEDIA_WRAPPED_KEY_SIZE]; // Kept to pass on again after a reconnect
+    uint8_t holder_key[MEDIA_PUBLIC_KEY_SIZE]; // The holder's new one, for the held side
+    uint8_t held_key[MEDIA_PUBLIC_KEY_SIZE];   // And the held side's, for the holder
+} hold_t;
+
+/**
+ * A node's control connection, messages are reassembled per connection.
+ */
+typedef struct connection {
+    int fd; // -1 when free
+    struct sockaddr_in address;
+    socklen_t addrLen;
+    message_buffer_t messages;
+    uint64_t heardNs; // Last message, by event_loop_now()
+    timer_id_t keepaliveTimer; // Once the node has sent a heartbeat
+    struct server* server;
+} connection_t;
+
+/**
+ * A registered node. A node whose connection drops is detached rather than
+ * forgotten, so it can resume with its token until the session expires.
+ */
 typedef struct client_info {
     uint16_t phone_number;
+    uint8_t token[SESSION_TOKEN_SIZE];
+    connection_t* connection; // NULL while detached
+    uint64_t detachedNs;
     struct sockaddr_in address;
-    socklen_t addrLen; 
+    socklen_t addrLen;
+    uint32_t wire_rate; // 0 if the node did not say
+    uint8_t codecs;     // MEDIA_CODEC_BIT of each it decodes
 } client_info_t;
 
 typedef struct server {
     server_conf_t* conf;
+    char** argv; // Started again from on an upgrade
+    int handoverfd; // To or from the server being upgraded, until the old one exits, otherwise -1
+    bool upgradePending; // Waiting for what cannot be handed over to end
     udp_server_t udp_server;
+    event_loop_t loop;
     int sockfd;
+    timer_wheel_t timers; // Session expiry, ring and keepalive timeouts, idle calls
+    int voicemailTimer; // Ends mailboxes that are done
+    router_t* router; // Replaced whole when the routes are read again
     int client_count;
     int pending_count;
     int ongoing_count;
     struct sockaddr_in server_addr;
     socklen_t server_addr_len;
-    client_info_t clients[10];
-    call_info_t pending_calls[10];
-    call_info_t ongoing_calls[10];
+    connection_t connections[SERVER_MAX_CONNECTIONS];
+    client_info_t clients[SERVER_MAX_CLIENTS];
+    uint8_t sessions[SERVER_SESSION_SLOTS]; // Client index + 1 by token, 0 if empty
+    call_info_t pending_calls[SERVER_MAX_CALLS];
+    call_info_t ongoing_calls[SERVER_MAX_CALLS];
+    pid_t call_relays[SERVER_MAX_CALLS]; // Relay on each call port until it exits, 0 if the port is free
+    conference_t conferences[SERVER_MAX_CONFERENCES];
+    page_t pages[SERVER_MAX_PAGES];
+    voicemail_store_t voicemail; // fd is -1 without voicemail
+    voicemail_call_t voicemail_calls[SERVER_MAX_VOICEMAIL_CALLS];
+    prompt_t* hold_prompt; // NULL if calls cannot be put on hold
+    hold_player_t* hold_player;
+    uint8_t hold_key[MEDIA_KEY_SIZE];
+    uint8_t hold_next_sender; // Never used twice under one key
+    hold_t holds[HOLD_MAX_LISTENERS];
+    journal_t journal; // fd is -1 if nothing is kept across restarts
 } server_t;
 
 extern int server_run(int argc, char** argv);
 
-#endif
\ No newline at end of file
+#endif
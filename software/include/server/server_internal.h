@@ -0,0 +1,97 @@
+#ifndef SRC_SERVER_INTERNAL_H
+#define SRC_SERVER_INTERNAL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "server/server.h"
+
+// Shared by server.c and the files it is split into, each holding a feature
+
+// How long a node that lost its connection can resume its session
+#define SESSION_RESUME_TIMEOUT_MS 30000
+
+// How long a call rings before it is hung up, when there is no voicemail to
+// divert it to after voicemail_answer_s
+#define RING_TIMEOUT_MS 60000
+
+// How long either side of an answered call can go without the relay hearing
+// from it before the call is torn down
+#define MEDIA_TIMEOUT_MS 30000
+
+// Calls, sessions and timeouts, in server.c
+int handle_connection(struct event_loop* loop, int fd, uint32_t events, void* data);
+int handle_ring_timeout(struct timer_wheel* wheel, uint64_t arg, void* data);
+int handle_keepalive_timeout(struct timer_wheel* wheel, uint64_t arg, void* data);
+int handle_media_timeout(struct timer_wheel* wheel, uint64_t arg, void* data);
+int handle_session_expiry(struct timer_wheel* wheel, uint64_t arg, void* data);
+void insert_session(server_t* server, int index);
+int generate_token(uint8_t* token, size_t length);
+int end_call(server_t* server, uint16_t phoneNumber);
+int send_terminate(server_t* server, connection_t* conn, uint8_t requestId, uint8_t code);
+void bind_call_media(server_t* server, const call_info_t* call, uint8_t sender);
+void broadcast_dial_plan(server_t* server);
+client_info_t* find_client(server_t* server, uint16_t phoneNumber);
+call_info_t* find_ongoing_call(server_t* server, uint16_t phoneNumber);
+bool in_call(server_t* server, uint16_t phoneNumber);
+
+// Conferences, in server_conference.c
+int handle_conference_add(server_t* server, connection_t* conn, struct message_wrapper* msg);
+int handle_conference_joined(server_t* server, connection_t* conn, struct message_wrapper* msg);
+int key_conference_member(conference_member_t* member, const uint8_t* publicKey);
+int send_conference_join(server_t* server, const conference_t* conference, int slot, uint8_t requestId);
+bool leave_conference(server_t* server, uint16_t phoneNumber);
+conference_t* find_conference(server_t* server, uint16_t phoneNumber, int* slot);
+
+// Pages, in server_page.c
+int handle_page_listen(server_t* server, connection_t* conn, struct message_wrapper* msg);
+int handle_page_key(server_t* server, connection_t* conn, struct message_wrapper* msg);
+int start_page(server_t* server, connection_t* conn, uint8_t requestId, const struct call_request* request, const page_group_conf_t* group);
+void bind_page_listener(server_t* server, page_t* page, int slot);
+int send_incoming_page(server_t* server, const page_t* page, int slot);
+int send_page_listen(server_t* server, const page_t* page, int slot);
+bool leave_page(server_t* server, uint16_t phoneNumber);
+page_t* find_page(server_t* server, uint16_t phoneNumber, int* slot);
+const page_group_conf_t* find_page_group(server_t* server, uint16_t number);
+
+// Recording, in server_recording.c
+int handle_record_key(server_t* server, connection_t* conn, struct message_wrapper* msg);
+bool should_record(server_t* server, const struct call_request* request);
+int send_record_call(server_t* server, const call_info_t* call, uint8_t sender);
+call_info_t* find_recorded_call(server_t* server, uint16_t caller);
+
+// Voicemail, in server_voicemail.c
+int handle_voicemail_joined(server_t* server, connection_t* conn, struct message_wrapper* msg);
+int divert_to_voicemail(server_t* server, call_info_t* call);
+int play_voicemail(server_t* server, connection_t* conn, uint8_t requestId, const struct call_request* request);
+int send_voicemail_divert(server_t* server, const voicemail_call_t* voicemail);
+int send_voicemail_answer(server_t* server, const voicemail_call_t* voicemail);
+bool leave_voicemail(server_t* server, uint16_t phoneNumber);
+voicemail_call_t* find_voicemail_call(server_t* server, uint16_t phoneNumber);
+int handle_voicemail_sweep(struct event_loop* loop, int fd, uint32_t events, void* data);
+
+// Hold, in server_hold.c
+int handle_call_hold(server_t* server, connection_t* conn, struct message_wrapper* msg);
+int handle_hold_joined(server_t* server, connection_t* conn, struct message_wrapper* msg);
+int start_hold(server_t* server);
+void stop_hold(server_t* server);
+void bind_hold_listener(server_t* server, int slot);
+int send_hold_start(server_t* server, int slot);
+int send_hold_key(server_t* server, int slot);
+int send_hold_end(server_t* server, const call_info_t* call, uint16_t to, const uint8_t* publicKey);
+void release_hold(server_t* server, uint16_t phoneNumber);
+void end_hold(server_t* server, int slot);
+hold_t* find_hold(server_t* server, uint16_t phoneNumber, int* slot);
+int handle_hold_restart(struct timer_wheel* wheel, uint64_t arg, void* data);
+
+// Routing, in server_routing.c
+int build_server_router(server_t* server, const routes_conf_t* routing, router_t** router);
+void reload_routes(server_t* server);
+uint16_t hunt_member(server_t* server, const route_conf_t* route, uint16_t caller);
+
+// Journal, in server_journal.c
+void restore_journal(server_t* server);
+int handle_journal_compact(struct timer_wheel* wheel, uint64_t arg, void* data);
+void journal_save_client(server_t* server, const client_info_t* client);
+void journal_save_call(server_t* server, const call_info_t* call);
+
+#endif
@@ -4,21 +4,64 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <netinet/in.h>
+#include "server/recorder.h"
 
+/**
+ * Where one side of a call is expected to send from, bound by the server
+ * while the call is signalled. A port of 0 is taken from the side's first
+ * packet.
+ */
+typedef struct relay_binding {
+    uint32_t token; // As in the side's media headers, 0 while unbound
+    struct sockaddr_in addr;
+} relay_binding_t;
+
+/**
+ * One side of a call whose sides differ in wire rate or codecs, written by
+ * the server once the relay's key with the side is agreed. The relay opens
+ * what the side sends under the key, and seals what it forwards to the side
+ * under it too, as though from the other side.
+ */
+typedef struct transcode_side {
+    bool keyed; // The rest is filled in
+    uint8_t key[MEDIA_KEY_SIZE];
+    uint32_t wireRate;
+    uint8_t codecs; // MEDIA_CODEC_BIT of each it decodes
+} transcode_side_t;
+
+/**
+ * Shared between the server and the port's child. Only the server writes
+ * the bindings, the recording and the transcoding, `generation` is odd while
+ * it does. Only the child writes when it last heard each side.
+ */
 typedef struct udp_port_info {
     int sockfd;
     uint16_t port;
     pid_t pid;
+    atomic_int owner; // Pid of the server the relay answers to, which may not be its parent after an upgrade
+    atomic_uint generation;
+    relay_binding_t bindings[2]; // By MEDIA_SENDER, caller and callee
+    recording_info_t recording;  // Keyed once the call is to be recorded
+    transcode_side_t transcode[2]; // By MEDIA_SENDER, keyed if the call is transcoded
+    _Atomic uint64_t heard_ns[2];  // By MEDIA_SENDER, event_loop_now() of its last packet, 0 if none
 } udp_port_info_t;
 
 typedef struct udp_server {
     int port_count;
     udp_port_info_t* ports[10];
+    int fds[10]; // Backing each port's info, for handing it over, -1 if it cannot be
 } udp_server_t;
 
 int init_udp_server(udp_server_t* server);
 
 int start_udp_port(udp_server_t* server, uint16_t port);
 int stop_udp_port(udp_server_t* server, uint16_t port);
+int adopt_udp_port(udp_server_t* server, int fd);
+int bind_udp_peer(udp_server_t* server, uint16_t port, uint8_t sender, uint32_t token, const struct sockaddr_in* addr);
+int record_udp_port(udp_server_t* server, uint16_t port, const recording_info_t* recording);
+int transcode_udp_port(udp_server_t* server, uint16_t port, uint8_t sender, const transcode_side_t* side);
+uint64_t udp_port_heard(udp_server_t* server, uint16_t port, uint8_t sender);
 
 #endif
\ No newline at end of file
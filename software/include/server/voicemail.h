@@ -0,0 +1,115 @@
+#ifndef SRC_VOICEMAIL_H
+#define SRC_VOICEMAIL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "server/packets.h"
+#include "utils/args.h"
+
+// Messages kept per mailbox, a new one takes the place of the oldest
+#define VOICEMAIL_MAX_MESSAGES 32
+
+// Messages are appended to a segment until it would pass this, then the
+// next is started. Offsets in a segment fit the index's 32 bits
+#define VOICEMAIL_SEGMENT_SIZE (64u * 1024 * 1024)
+
+#define VOICEMAIL_PATH_LEN (VOICEMAIL_DIRECTORY_LEN + 32)
+
+#define VOICEMAIL_RECORD_MAGIC "vmsg"
+#define VOICEMAIL_INDEX_MAGIC "vmix"
+
+/**
+ * One block of a message as it came off the wire, still in the codec it was
+ * sent in, followed by its `length` bytes. The timestamp counts from the
+ * first block of the message, at the message's wire rate.
+ */
+typedef struct voicemail_frame {
+    uint32_t timestamp;
+    uint8_t format; // MEDIA_FORMAT, never with FEC
+    uint16_t length;
+} PACKED_STRUCT voicemail_frame_t;
+
+/**
+ * Written in front of each message's frames in a segment, so a segment can
+ * be read without the indexes.
+ */
+typedef struct voicemail_record {
+    char magic[4]; // VOICEMAIL_RECORD_MAGIC
+    uint16_t mailbox;
+    uint16_t from_phone_number;
+    uint64_t time; // Seconds since the epoch
+    uint32_t wire_rate;
+    uint32_t duration_ms;
+    uint32_t length; // Of the frames that follow
+} PACKED_STRUCT voicemail_record_t;
+
+/**
+ * Where a message is, as kept in its mailbox's index.
+ */
+typedef struct voicemail_entry {
+    uint32_t segment;
+    uint32_t offset; // Of the message's first frame
+    uint32_t length;
+    uint32_t wire_rate;
+    uint32_t duration_ms;
+    uint64_t time;
+    uint16_t from_phone_number;
+} PACKED_STRUCT voicemail_entry_t;
+
+/**
+ * A mailbox's index file, the only thing read to list or find its messages,
+ * so neither depends on how many the store holds. Entries are a ring, the
+ * newest is at (total - 1) % VOICEMAIL_MAX_MESSAGES.
+ *
+ * Like the records, it is in the server's byte order. The store is not
+ * meant to move between machines.
+ */
+typedef struct voicemail_index {
+    char magic[4]; // VOICEMAIL_INDEX_MAGIC
+    uint16_t mailbox;
+    uint32_t total; // Messages ever left
+    voicemail_entry_t entries[VOICEMAIL_MAX_MESSAGES];
+} PACKED_STRUCT voicemail_index_t;
+
+/**
+ * The segment being appended to. Only the server writes to the store, the
+ * mailboxes it runs only read it.
+ */
+typedef struct voicemail_store {
+    char directory[VOICEMAIL_DIRECTORY_LEN];
+    uint32_t segment;
+    int fd; // -1 if the store could not be opened
+    uint64_t length;
+} voicemail_store_t;
+
+/**
+ * A message's frames, mapped read only from its segment.
+ */
+typedef struct voicemail_map {
+    void* base; // As mapped, from a page boundary
+    size_t mappedLength;
+    const uint8_t* frames;
+    uint32_t length;
+} voicemail_map_t;
+
+/**
+ * A message to store, its frames laid out as in a segment.
+ */
+typedef struct voicemail_message {
+    uint16_t mailbox;
+    uint16_t from_phone_number;
+    uint32_t wire_rate;
+    uint32_t duration_ms;
+    const uint8_t* frames;
+    uint32_t length;
+} voicemail_message_t;
+
+int  open_voicemail_store(voicemail_store_t* store, const char* directory);
+void close_voicemail_store(voicemail_store_t* store);
+int  voicemail_append(voicemail_store_t* store, const voicemail_message_t* message);
+int  voicemail_list(const voicemail_store_t* store, uint16_t mailbox, voicemail_entry_t* entries);
+
+int  voicemail_map(const char* directory, const voicemail_entry_t* entry, voicemail_map_t* map);
+void voicemail_unmap(voicemail_map_t* map);
+
+#endif
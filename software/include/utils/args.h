@@ -4,6 +4,54 @@
 #include <libconfig.h>
 #include <stdbool.h>
 
+#define DSP_MAX_STAGES 16
+#define DSP_STAGE_TYPE_LEN 16
+
+// Device ids are cached as hex, large enough for every miniaudio backend
+#define AUDIO_DEVICE_ID_LEN 640
+#define AUDIO_BACKEND_NAME_LEN 32
+
+#define PAGE_MAX_GROUPS 8
+#define PAGE_GROUP_MAX_MEMBERS 16
+
+#define RECORDING_MAX_NUMBERS 16
+#define RECORDING_DIRECTORY_LEN 128
+
+#define VOICEMAIL_DIRECTORY_LEN 128
+
+#define HOLD_PATH_LEN 128
+
+#define JOURNAL_PATH_LEN 128
+
+#define ROUTE_MAX_ROUTES 32
+#define ROUTE_MAX_MEMBERS 16
+#define ROUTE_PREFIX_LEN 6
+
+// Where a route sends the calls it matches
+#define ROUTE_PHONE 1     // Rings one node
+#define ROUTE_HUNT 2      // Rings the first member free to answer
+#define ROUTE_PAGE 3      // Pages a page group
+#define ROUTE_VOICEMAIL 4 // Plays the caller its messages
+
+/**
+ * A single stage of a DSP chain, as declared in the config file. Only the
+ * parameters relevant to `type` are used.
+ */
+typedef struct dsp_stage_conf {
+    char type[DSP_STAGE_TYPE_LEN];
+    double frequency;   // Hz, filters
+    double q;           // Filters
+    double gain_db;     // Gain, peak and shelf filters
+    double threshold_db; // Limiter
+    double release_ms;  // Limiter
+    unsigned int rate;  // Resampler output rate
+} dsp_stage_conf_t;
+
+typedef struct dsp_chain_conf {
+    int stage_count;
+    dsp_stage_conf_t stages[DSP_MAX_STAGES];
+} dsp_chain_conf_t;
+
 typedef struct intercom_conf {
     // Required
     char config_file[128];
@@ -13,18 +61,87 @@ typedef struct intercom_conf {
 
     // Optional
     bool use_audio_defaults;
+    bool warm_audio;
+    bool adaptive_media;
+    bool direct_media;
+    bool refuse_relayed_clear; // Hang up calls the server keys in place of the peer
+    bool sidetone;
+    double sidetone_db;
+    char audio_backend[AUDIO_BACKEND_NAME_LEN];
+    char playback_device[AUDIO_DEVICE_ID_LEN];
+    char capture_device[AUDIO_DEVICE_ID_LEN];
+    char device_cache[160]; // Where the selected devices are saved
+    char gpio_chip[64];
+    unsigned short dial_pin;
+    unsigned short dial_debounce_ms;
+    unsigned short dial_digit_gap_ms;
+    unsigned short dial_timeout_ms;
+    unsigned int wire_sample_rate;
+    dsp_chain_conf_t capture_dsp;
+    dsp_chain_conf_t playback_dsp;
+    dsp_chain_conf_t sidetone_dsp;
 } intercom_conf_t;
 
+/**
+ * A number that pages its members rather than calling them. A group with no
+ * members pages every node.
+ */
+typedef struct page_group_conf {
+    unsigned short number;
+    int member_count;
+    unsigned short members[PAGE_GROUP_MAX_MEMBERS];
+} page_group_conf_t;
+
+/**
+ * A dial plan route, matching numbers that start with `prefix` or, if that is
+ * empty, the numbers from `low` to `high`.
+ */
+typedef struct route_conf {
+    char prefix[ROUTE_PREFIX_LEN];
+    unsigned short low;
+    unsigned short high;
+    int type; // ROUTE_*
+    unsigned short target; // The node rung, or the page group's number
+    int member_count;
+    unsigned short members[ROUTE_MAX_MEMBERS]; // Hunted in order
+} route_conf_t;
+
+typedef struct routes_conf {
+    int route_count;
+    route_conf_t routes[ROUTE_MAX_ROUTES];
+} routes_conf_t;
+
 typedef struct server_conf {
     // Required
     char config_file[128];
     unsigned short server_port;
     unsigned short audio_port_min;
     unsigned short audio_port_max;
+
+    // Optional
+    unsigned int conference_wire_rate;
+    int page_group_count;
+    page_group_conf_t page_groups[PAGE_MAX_GROUPS];
+    char recording_directory[RECORDING_DIRECTORY_LEN]; // Empty if nothing is recorded
+    bool recording_adpcm; // IMA ADPCM rather than 16 bit PCM
+    int recording_number_count;
+    unsigned short recording_numbers[RECORDING_MAX_NUMBERS]; // Every call to or from these is recorded
+    char voicemail_directory[VOICEMAIL_DIRECTORY_LEN]; // Empty if there is no voicemail
+    unsigned short voicemail_number; // Dialled to hear your own messages
+    unsigned short voicemail_answer_s; // A call left ringing this long goes to voicemail
+    unsigned short voicemail_max_s; // Longest message taken
+    char hold_music[HOLD_PATH_LEN]; // Empty if calls cannot be put on hold
+    char hold_announcement[HOLD_PATH_LEN]; // Played before the music, may be empty
+    int hold_codec; // MEDIA_CODEC the hold program is sent in
+    routes_conf_t routing; // Read again on SIGHUP
+    char journal_path[JOURNAL_PATH_LEN]; // Empty if nothing is kept across restarts
+    unsigned short journal_compact_s; // How often the journal is compacted
 } server_conf_t;
 
 extern void init_intercom_conf(intercom_conf_t* config, int argc, char** argv);
+extern int  save_audio_device_conf(const intercom_conf_t* config);
 
 extern void init_server_conf(server_conf_t* config, int argc, char** argv);
+extern int  read_server_routes(const char* path, routes_conf_t* routes);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,67 @@
+#ifndef SRC_EVENT_LOOP_H
+#define SRC_EVENT_LOOP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define EVENT_LOOP_MAX_SOURCES 64
+
+// Event bits passed to handlers, the same values as POLLIN / POLLOUT / POLLERR
+// / POLLHUP so fd sources can be registered with either backend
+#define EVENT_READ   0x001
+#define EVENT_WRITE  0x004
+#define EVENT_ERROR  0x008
+#define EVENT_HANGUP 0x010
+
+struct event_loop;
+
+/**
+ * Called when a source is ready. Returning anything but ST_GOOD stops the
+ * loop, and event_loop_run() returns that code.
+ */
+typedef int (*event_handler_t)(struct event_loop* loop, int fd, uint32_t events, void* data);
+
+typedef struct event_source {
+    int fd;
+    uint32_t events;
+    event_handler_t handler;
+    void* data;
+    bool used;
+    bool timer;
+    uint64_t deadlineNs; // Timers without timerfd, 0 when disarmed
+    uint64_t periodNs;
+} event_source_t;
+
+/**
+ * A single threaded event loop over file descriptors and timers.
+ *
+ * On Linux this is epoll, with timers as timerfds, so a loop with nothing to
+ * do sleeps in the kernel. Elsewhere it falls back to poll() and keeps timer
+ * deadlines itself.
+ *
+ * Handlers may add and remove sources, including their own.
+ */
+typedef struct event_loop {
+    int epollfd;
+    bool running;
+    int result;
+    event_source_t sources[EVENT_LOOP_MAX_SOURCES];
+} event_loop_t;
+
+extern int  init_event_loop(event_loop_t* loop);
+extern void destroy_event_loop(event_loop_t* loop);
+
+extern int  event_loop_add(event_loop_t* loop, int fd, uint32_t events, event_handler_t handler, void* data);
+extern int  event_loop_remove(event_loop_t* loop, int fd);
+
+extern int  event_loop_add_timer(event_loop_t* loop, event_handler_t handler, void* data);
+extern int  event_loop_arm_timer(event_loop_t* loop, int timer, uint64_t delayMs, uint64_t periodMs);
+extern int  event_loop_disarm_timer(event_loop_t* loop, int timer);
+extern int  event_loop_remove_timer(event_loop_t* loop, int timer);
+
+extern uint64_t event_loop_now(void);
+
+extern int  event_loop_run(event_loop_t* loop);
+extern void event_loop_stop(event_loop_t* loop, int result);
+
+#endif
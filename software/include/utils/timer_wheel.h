@@ -0,0 +1,76 @@
+#ifndef SRC_TIMER_WHEEL_H
+#define SRC_TIMER_WHEEL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "utils/event_loop.h"
+
+// Each level has 2^6 slots, and each slot of a level spans a whole turn of
+// the level below. Four levels of 10 ms ticks reach about 46 hours, later
+// deadlines wait in the top level and are placed again as it turns
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_TICK_MS 10
+
+// Never returned for a timer
+#define TIMER_NONE 0
+
+/**
+ * A timer's id, the slot in the pool and its generation, so an id kept past
+ * its timer firing or being cancelled cannot touch the next one in the slot.
+ */
+typedef uint64_t timer_id_t;
+
+struct timer_wheel;
+
+/**
+ * Called once when a timer expires, it is already free. Returning anything
+ * but ST_GOOD stops the event loop, as for event handlers.
+ */
+typedef int (*timer_handler_t)(struct timer_wheel* wheel, uint64_t arg, void* data);
+
+typedef struct timer_entry {
+    uint32_t next; // In its slot's list, or the free list
+    uint32_t prev;
+    uint32_t generation;
+    uint8_t level;
+    uint8_t slot;
+    bool used;
+    uint64_t expiry; // In ticks
+    timer_handler_t handler;
+    uint64_t arg;
+    void* data;
+} timer_entry_t;
+
+/**
+ * Hierarchical timer wheel over one of the event loop's timers.
+ *
+ * A timer goes in the lowest level whose turn covers its deadline, and a
+ * slot of a higher level is placed again in the levels below when its time
+ * comes round. Adding and cancelling unlink and link one pool entry. The
+ * occupied slots of each level are kept as a bitmap, so the next tick
+ * anything happens at is found without stepping through the empty ones, and
+ * the loop's timer is armed for it rather than for every tick.
+ */
+typedef struct timer_wheel {
+    event_loop_t* loop;
+    int timer;
+    uint64_t armedTick; // UINT64_MAX while disarmed
+    uint64_t originNs;
+    uint64_t tick; // Handled up to and including
+    uint32_t capacity;
+    uint32_t count;
+    uint32_t freeList;
+    uint64_t occupied[TIMER_WHEEL_LEVELS];
+    uint32_t heads[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    timer_entry_t* entries;
+} timer_wheel_t;
+
+extern int  init_timer_wheel(timer_wheel_t* wheel, event_loop_t* loop, uint32_t capacity);
+extern void destroy_timer_wheel(timer_wheel_t* wheel);
+
+extern timer_id_t timer_wheel_add(timer_wheel_t* wheel, uint64_t delayMs, timer_handler_t handler, uint64_t arg, void* data);
+extern int  timer_wheel_cancel(timer_wheel_t* wheel, timer_id_t id);
+
+#endif
@@ -1,21 +1,30 @@
-#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include "utils/args.h"
 #include "common.h"
 #include "audiobackend/ring_buffer.h"
 #include "audiobackend/audio.h"
 
-static void init_biquad(ma_biquad* biquad);
 static void miniaudio_data_callback(ma_device* pDevice, void* pOutput, const void* pInput, ma_uint32 frameCount);
 static int  select_device(ma_device_info* infos, ma_uint32 count, bool useDefaults);
+static void init_sidetone(audio_engine_t* engine, const intercom_conf_t* conf);
+static void mix_sidetone(audio_engine_t* engine, int16_t* output, const int16_t* input, size_t frameCount);
+static int  init_context(audio_engine_t* engine, const char* backendName);
+static int  open_device(audio_engine_t* engine, const ma_device_id* playbackID, const ma_device_id* captureID);
+static int  open_cached_device(audio_engine_t* engine, intercom_conf_t* conf);
+static void device_id_to_hex(const ma_device_id* id, char* hex, size_t maxlen);
+static int  device_id_from_hex(const char* hex, ma_device_id* id);
 
 /**
  * Initialise an audio engine with the given read and write buffers. The engine
  * will read audio data from the playback buffer, and write mic data to the 
  * capture buffer.
  * 
+ * Devices chosen on a previous run are cached in the config and opened
+ * directly, otherwise the devices are enumerated and the selection is saved.
+ * 
  * Will fail if an error happens.
  */
 void init_audio_engine(audio_engine_t* engine, ring_buffer_t* playback, ring_buffer_t* capture, intercom_conf_t* conf) {
@@ -28,13 +37,27 @@ void init_audio_engine(audio_engine_t* engine, ring_buffer_t* playback, ring_buf
     // Save ring buffers
     engine->playback = playback;
     engine->capture = capture;
+    atomic_init(&engine->live, false);
 
-    // Initialise biquad filter
-    init_biquad(&engine->biquad);
+    // Start reporting callback statistics
+    init_audio_stats(&engine->stats);
 
-    // Do device search & user selection
-    if ((res = ma_context_init(NULL, 0, NULL, &engine->context)) != MA_SUCCESS) {
-        ma_error("Failed to initialise miniaudio context", res);
+    init_sidetone(engine, conf);
+
+    if (open_cached_device(engine, conf) == ST_GOOD) {
+        return;
+    }
+
+    if (init_context(engine, NULL) != ST_GOOD) {
+        error("Failed to initialise miniaudio context");
+    }
+
+    // Default devices can be opened without knowing their ids
+    if (conf->use_audio_defaults) {
+        if (open_device(engine, NULL, NULL) != ST_GOOD) {
+            error("Failed to initialise default audio devices");
+        }
+        return;
     }
 
     ma_device_info* pPlaybackInfos;
@@ -42,34 +65,25 @@ void init_audio_engine(audio_engine_t* engine, ring_buffer_t* playback, ring_buf
     ma_uint32 playbackCount;
     ma_uint32 captureCount;
 
-    // TODO : ma_context_enumerate_devices() may be more efficient here
     if ((res = ma_context_get_devices(&engine->context, &pPlaybackInfos, &playbackCount, &pCaptureInfos, &captureCount)) != MA_SUCCESS) {
         ma_error("Failed to get miniaudio devices", res);
     }
     
     // User selections for devices
-    ma_uint32 playbackDeviceSelection = select_device(pPlaybackInfos, playbackCount, conf->use_audio_defaults);
-    ma_uint32 captureDeviceSelection  = select_device(pCaptureInfos, captureCount, conf->use_audio_defaults);
+    ma_uint32 playbackDeviceSelection = select_device(pPlaybackInfos, playbackCount, false);
+    ma_uint32 captureDeviceSelection  = select_device(pCaptureInfos, captureCount, false);
 
-    // Set the device configurations.
-    ma_device_config config = ma_device_config_init(ma_device_type_duplex);
-
-    config.capture.channels  = CHANNELS;
-    config.playback.channels = CHANNELS;
-    config.capture.format  = FORMAT;
-    config.playback.format = FORMAT;
-
-    config.capture.pDeviceID  = &pCaptureInfos[captureDeviceSelection].id;
-    config.playback.pDeviceID = &pPlaybackInfos[playbackDeviceSelection].id;
-
-    config.sampleRate   = SAMPLE_RATE;
-    config.dataCallback = &miniaudio_data_callback;
+    if (open_device(engine, &pPlaybackInfos[playbackDeviceSelection].id, &pCaptureInfos[captureDeviceSelection].id) != ST_GOOD) {
+        error("Failed to initialise selected audio devices");
+    }
 
-    // Set the engine as the user data
-    config.pUserData = engine;
+    // Remember the selection so the next start skips enumeration
+    copy_string(conf->audio_backend, sizeof(conf->audio_backend), ma_get_backend_name(engine->context.backend));
+    device_id_to_hex(&pPlaybackInfos[playbackDeviceSelection].id, conf->playback_device, sizeof(conf->playback_device));
+    device_id_to_hex(&pCaptureInfos[captureDeviceSelection].id, conf->capture_device, sizeof(conf->capture_device));
 
-    if ((res = ma_device_init(&engine->context, &config, &engine->device)) != MA_SUCCESS) {
-        ma_error("Failed to initialise device", res);
+    if (save_audio_device_conf(conf) != ST_GOOD) {
+        warn("Audio device selection will not be remembered");
     }
 }
 
@@ -82,6 +96,9 @@ void destroy_audio_engine(audio_engine_t* engine) {
     ma_device_uninit(&engine->device);
     ma_context_uninit(&engine->context);
 
+    destroy_dsp_graph(&engine->sidetone);
+    destroy_audio_stats(&engine->stats);
+
     destroy_shared_memory(engine, sizeof(*engine));
 }
 
@@ -96,6 +113,14 @@ int audio_engine_start(audio_engine_t* engine) {
     return ST_GOOD;
 }
 
+/**
+ * Set whether the running device is carrying a call. The change is picked up
+ * by the next device callback.
+ */
+void audio_engine_set_live(audio_engine_t* engine, bool live) {
+    atomic_store_explicit(&engine->live, live, memory_order_release);
+}
+
 int audio_engine_stop(audio_engine_t* engine) {
     ma_result res;
 
@@ -107,87 +132,83 @@ int audio_engine_stop(audio_engine_t* engine) {
     return ST_GOOD;
 }
 
-static void init_biquad(ma_biquad* biquad) {
-
-    #if FORMAT != ma_format_s16 && FORMAT != ma_format_f32
-        #error "Cannot initialise biquad filter with current format"
-    #endif
-
-    // Need to calculate coefficients for a band pass filter
-    // https://webaudio.github.io/Audio-EQ-Cookbook/audio-eq-cookbook.html
-    // BPF (constant 0 dB peak gain)
-
-    const double samplingFrequency = SAMPLE_RATE;
-    const double centreFrequency = 1500;
-    const double Q = 0.707;
-
-    const double w0 = 2.0 * M_PI * centreFrequency / samplingFrequency;
-    const double a = sin(2.0 * w0) / (2.0 * Q);
-
-    const double a0 = 1.0 + a;
-    const double a1 = -2 * cos(w0);
-    const double a2 = 1.0 - a;
-    
-    const double b0 = a;
-    const double b1 = 0;
-    const double b2 = -a;
-
-    ma_result result;
-    ma_biquad_config config = ma_biquad_config_init(FORMAT, CHANNELS, b0, b1, b2, a0, a1, a2);
-    
-    if ((result = ma_biquad_init(&config, NULL, biquad)) != MA_SUCCESS) {
-        ma_error("Failed to initialise biquad filter", result);
-    }
-}
-
 /**
  * Main miniaudio device data callback.
  * 
- * This function is called from within the miniaudio worker thread.
+ * This function is called from within the miniaudio worker thread. It must be
+ * real-time safe: no logging, allocation, locking or syscalls. Failures are
+ * counted in the engine stats instead.
  */
 static void miniaudio_data_callback(ma_device* pDevice, void* pOutput, const void* pInput, ma_uint32 frameCount) {
     // Extract engine from data
     audio_engine_t* engine = (audio_engine_t*)pDevice->pUserData;
+    const uint64_t startNs = audio_stats_callback_begin(&engine->stats, frameCount, SAMPLE_RATE);
     
-    ma_result res;
     const size_t expected = frameCount * FRAME_SIZE;
+    const bool live = atomic_load_explicit(&engine->live, memory_order_acquire);
     size_t sizeBytes;
-    void* buffer;
 
-    if (pOutput != NULL) {
-        // Read audio data from ring buffer
-        sizeBytes = expected;
-        if (ring_buffer_acquire_read(engine->playback, &sizeBytes, &buffer) != ST_GOOD) {
-            warn("Failed to acquire a read pointer to the ring buffer");
-            goto write_playback;
+    if (pOutput != NULL && !live) {
+        // Idle between calls, drop anything left over and play silence
+        const int32_t available = ring_buffer_pointer_distance(engine->playback);
+        if (available > 0 && ring_buffer_seek_read(engine->playback, available) != ST_GOOD) {
+            audio_stats_count(engine->stats.ringErrors);
         }
 
-        // Apply a band pass filter on the audio data
-        if ((res = ma_biquad_process_pcm_frames(&engine->biquad, pOutput, buffer, frameCount)) != MA_SUCCESS) {
-            ma_warn("Audio engine failed to apply filter", res);
-            memcpy(pOutput, buffer, frameCount);
+        memset(pOutput, 0, expected);
+    } else if (pOutput != NULL) {
+        // Read audio data from ring buffer, only taking whole frames
+        const int32_t available = ring_buffer_pointer_distance(engine->playback);
+        sizeBytes = available > 0 ? MIN((size_t)available, expected) : 0;
+        sizeBytes -= sizeBytes % FRAME_SIZE;
+
+        if (ring_buffer_read(engine->playback, pOutput, &sizeBytes) != ST_GOOD) {
+            audio_stats_count(engine->stats.ringErrors);
         }
 
-        if (ring_buffer_commit_read(engine->playback, sizeBytes) != ST_GOOD) {
-            warn("Failed to commit a read to the ring buffer");
+        if (sizeBytes == 0) {
+            audio_stats_count(engine->stats.underruns);
+        } else if (sizeBytes < expected) {
+            audio_stats_count(engine->stats.shortReads);
         }
+
+        // Pad anything we could not fill with silence
+        memset((uint8_t*)pOutput + sizeBytes, 0, expected - sizeBytes);
     }
 
-write_playback:
+    if (pOutput != NULL && pInput != NULL && live && engine->sidetoneGainQ15 != 0) {
+        mix_sidetone(engine, (int16_t*)pOutput, (const int16_t*)pInput, frameCount);
+    }
 
-    if (pInput != NULL) {
+    if (pInput != NULL && live) {
         sizeBytes = expected;
-        if (ring_buffer_acquire_write(engine->capture, &sizeBytes, &buffer) != ST_GOOD) {
-            warn("Failed to acquire a write pointer to the ring buffer");
-            return;
+        if (ring_buffer_write(engine->capture, pInput, &sizeBytes) != ST_GOOD) {
+            audio_stats_count(engine->stats.ringErrors);
+        }
+
+        if (sizeBytes < expected) {
+            audio_stats_count(engine->stats.overruns);
         }
+    }
 
-        memcpy(buffer, pInput, sizeBytes);
+    audio_stats_callback_end(&engine->stats, startNs, frameCount, SAMPLE_RATE);
+}
 
-        if (ring_buffer_commit_write(engine->capture, sizeBytes) != ST_GOOD) {
-            warn("Failed to commit a write to the ring buffer");
-            return;
+/**
+ * Filter the mic input and mix it into the output at the sidetone level.
+ * 
+ * Runs in the device callback, the filter is a DSP graph at the device rate
+ * so it only does in place kernel passes over the block.
+ */
+static void mix_sidetone(audio_engine_t* engine, int16_t* output, const int16_t* input, size_t frameCount) {
+    for (size_t offset = 0; offset < frameCount; offset += DSP_BLOCK_FRAMES) {
+        size_t frames = DSP_BLOCK_FRAMES;
+
+        if (dsp_graph_process(&engine->sidetone, input + offset, MIN(frameCount - offset, DSP_BLOCK_FRAMES), engine->sidetoneBuffer, &frames) != ST_GOOD) {
+            audio_stats_count(engine->stats.filterErrors);
         }
+
+        kernels->mix_scaled_s16(output + offset, engine->sidetoneBuffer, engine->sidetoneGainQ15, frames);
     }
 }
 
@@ -233,4 +254,154 @@ static int select_device(ma_device_info* infos, ma_uint32 count, bool useDefault
 
     info("Device selected : %s", infos[selection].name);
     return (ma_uint32) selection;
-}
\ No newline at end of file
+}
+
+/**
+ * Compile the sidetone filter and convert its level to a Q15 gain.
+ */
+static void init_sidetone(audio_engine_t* engine, const intercom_conf_t* conf) {
+    engine->sidetoneGainQ15 = 0;
+
+    if (!conf->sidetone) {
+        info("Sidetone disabled");
+        return;
+    }
+
+    if (conf->sidetone_db > 0) {
+        warn("Sidetone level %.1f dB above unity, disabling sidetone", conf->sidetone_db);
+        return;
+    }
+
+    if (init_dsp_graph(&engine->sidetone, &conf->sidetone_dsp, SAMPLE_RATE, SAMPLE_RATE) != ST_GOOD) {
+        warn("Failed to initialise sidetone DSP chain, disabling sidetone");
+        return;
+    }
+
+    const long gainQ15 = lrint(pow(10.0, conf->sidetone_db / 20.0) * 32768.0);
+    engine->sidetoneGainQ15 = (int16_t)MIN(gainQ15, INT16_MAX);
+    info("Sidetone at %.1f dB", conf->sidetone_db);
+}
+
+/**
+ * Initialise the miniaudio context, only trying the named backend if one is
+ * given.
+ */
+static int init_context(audio_engine_t* engine, const char* backendName) {
+    ma_result res;
+    ma_backend backend;
+
+    if (backendName == NULL) {
+        res = ma_context_init(NULL, 0, NULL, &engine->context);
+    } else if ((res = ma_get_backend_from_name(backendName, &backend)) == MA_SUCCESS) {
+        res = ma_context_init(&backend, 1, NULL, &engine->context);
+    }
+
+    if (res != MA_SUCCESS) {
+        ma_warn("Failed to initialise miniaudio context", res);
+        return ST_FAIL;
+    }
+
+    return ST_GOOD;
+}
+
+/**
+ * Open the duplex device. NULL ids select the system defaults.
+ */
+static int open_device(audio_engine_t* engine, const ma_device_id* playbackID, const ma_device_id* captureID) {
+    ma_result res;
+    ma_device_config config = ma_device_config_init(ma_device_type_duplex);
+
+    config.capture.channels  = CHANNELS;
+    config.playback.channels = CHANNELS;
+    config.capture.format  = FORMAT;
+    config.playback.format = FORMAT;
+
+    config.capture.pDeviceID  = captureID;
+    config.playback.pDeviceID = playbackID;
+
+    config.sampleRate   = SAMPLE_RATE;
+    config.dataCallback = &miniaudio_data_callback;
+
+    // Set the engine as the user data
+    config.pUserData = engine;
+
+    if ((res = ma_device_init(&engine->context, &config, &engine->device)) != MA_SUCCESS) {
+        ma_warn("Failed to initialise device", res);
+        return ST_FAIL;
+    }
+
+    info("Playback device : %s", engine->device.playback.name);
+    info("Capture device : %s", engine->device.capture.name);
+    return ST_GOOD;
+}
+
+/**
+ * Open the devices cached in the config without enumerating.
+ * 
+ * Returns ST_FAIL with no context left open if there is no usable cache, for
+ * example when a device has been unplugged.
+ */
+static int open_cached_device(audio_engine_t* engine, intercom_conf_t* conf) {
+    ma_device_id playbackID;
+    ma_device_id captureID;
+
+    if (conf->audio_backend[0] == '\0' || conf->playback_device[0] == '\0' || conf->capture_device[0] == '\0') {
+        return ST_FAIL;
+    }
+
+    if (device_id_from_hex(conf->playback_device, &playbackID) != ST_GOOD || device_id_from_hex(conf->capture_device, &captureID) != ST_GOOD) {
+        warn("Invalid cached audio device ids in config");
+        return ST_FAIL;
+    }
+
+    if (init_context(engine, conf->audio_backend) != ST_GOOD) {
+        return ST_FAIL;
+    }
+
+    if (open_device(engine, &playbackID, &captureID) != ST_GOOD) {
+        warn("Cached audio devices unavailable, enumerating devices");
+        ma_context_uninit(&engine->context);
+        return ST_FAIL;
+    }
+
+    return ST_GOOD;
+}
+
+/**
+ * Encode a device id as hex, dropping trailing zero bytes.
+ */
+static void device_id_to_hex(const ma_device_id* id, char* hex, size_t maxlen) {
+    const uint8_t* bytes = (const uint8_t*)id;
+    size_t length = sizeof(*id);
+
+    while (length > 0 && bytes[length - 1] == 0) {
+        length--;
+    }
+
+    for (size_t i = 0; i < length && (i + 1) * 2 < maxlen; i++) {
+        snprintf(hex + i * 2, 3, "%02x", bytes[i]);
+    }
+}
+
+static int device_id_from_hex(const char* hex, ma_device_id* id) {
+    const size_t length = strlen(hex);
+    uint8_t* bytes = (uint8_t*)id;
+
+    if (length % 2 != 0 || length / 2 > sizeof(*id)) {
+        return ST_FAIL;
+    }
+
+    memset(id, 0, sizeof(*id));
+
+    for (size_t i = 0; i < length / 2; i++) {
+        unsigned int byte;
+
+        if (sscanf(hex + i * 2, "%2x", &byte) != 1) {
+            return ST_FAIL;
+        }
+
+        bytes[i] = (uint8_t)byte;
+    }
+
+    return ST_GOOD;
+}
@@ -4,6 +4,7 @@
 #include "audiobackend/audio_backend.h"
 #include "audiobackend/transfer.h"
 #include "audiobackend/ring_buffer.h"
+#include "audiobackend/kernels.h"
 
 void init_audio_backend(audio_backend_t* backend_p, intercom_conf_t* config) {
     if (backend_p->initialised) {
@@ -17,6 +18,8 @@ void init_audio_backend(audio_backend_t* backend_p, intercom_conf_t* config) {
 
     audio_backend_impl_t* backend = backend_p->impl;
 
+    init_kernels();
+
     info("Initialising ring buffers");
     init_ring_buffer_shr(&backend->captureRB);
     init_ring_buffer_shr(&backend->playbackRB);
@@ -27,6 +30,14 @@ void init_audio_backend(audio_backend_t* backend_p, intercom_conf_t* config) {
     info("Initialising transfer engine");
     init_transfer_engine(&backend->transfer_engine, &backend->playbackRB, &backend->captureRB, config);
 
+    backend_p->warm = config->warm_audio;
+
+    // Keep the device running for the whole program, idle until a call starts
+    if (backend_p->warm && audio_engine_start(&backend->audio_engine) != ST_GOOD) {
+        warn("Failed to start warm audio device, starting it per call");
+        backend_p->warm = false;
+    }
+
     backend_p->initialised = true;
 }
 
@@ -63,11 +74,15 @@ int audio_backend_start(audio_backend_t* backend_p, audio_backend_start_info_t*
         return ST_GOOD;
     }
 
-    if ((res = audio_engine_start(&backend->audio_engine)) != ST_GOOD) {
+    if (!backend_p->warm && (res = audio_engine_start(&backend->audio_engine)) != ST_GOOD) {
         warn("Failed to start audio engine with code : %d", res);
         return res;
     }
 
+    // A ringing callee keeps its earpiece and mic quiet until it picks up,
+    // a listener hears the page straight away
+    audio_engine_set_live(&backend->audio_engine, !info->early || info->ringback || info->listen);
+
     if ((res = transfer_engine_start(&backend->transfer_engine, info)) != ST_GOOD) {
         warn("Failed to start transfer engine with code : %d", res);
         return res;
@@ -78,6 +93,36 @@ int audio_backend_start(audio_backend_t* backend_p, audio_backend_start_info_t*
     return ST_GOOD;
 }
 
+/**
+ * The call started early has been answered, so audio flows both ways.
+ */
+int audio_backend_answer(audio_backend_t* backend_p) {
+    if (!backend_p->initialised) {
+        return ST_NOT_INITIALISED;
+    }
+
+    if (!backend_p->started) {
+        return ST_FAIL;
+    }
+
+    audio_engine_set_live(&backend_p->impl->audio_engine, true);
+    transfer_engine_answer(&backend_p->impl->transfer_engine);
+
+    return ST_GOOD;
+}
+
+/**
+ * The port the next call's media is sent from, for the node to signal. 0 if
+ * it is not bound yet.
+ */
+uint16_t audio_backend_media_port(audio_backend_t* backend_p) {
+    if (!backend_p->initialised) {
+        return 0;
+    }
+
+    return transfer_engine_media_port(&backend_p->impl->transfer_engine);
+}
+
 int audio_backend_stop(audio_backend_t* backend_p) {
     audio_backend_impl_t* backend = backend_p->impl;
     int res;
@@ -90,7 +135,9 @@ int audio_backend_stop(audio_backend_t* backend_p) {
         return ST_GOOD;
     }
 
-    if ((res = audio_engine_stop(&backend->audio_engine)) != ST_GOOD) {
+    audio_engine_set_live(&backend->audio_engine, false);
+
+    if (!backend_p->warm && (res = audio_engine_stop(&backend->audio_engine)) != ST_GOOD) {
         warn("Failed to stop audio engine with code : %d", res);
         return res;
     }
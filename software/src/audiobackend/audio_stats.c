@@ -0,0 +1,161 @@
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "common.h"
+#include "audiobackend/audio_stats.h"
+
+static void* audio_stats_reporter_main(void* arg);
+static void  atomic_store_max(atomic_uint_fast64_t* value, uint64_t candidate);
+
+/**
+ * Zero the counters and start the reporter thread.
+ *
+ * Fails if the thread cannot be started.
+ */
+void init_audio_stats(audio_stats_t* stats) {
+    int err;
+
+    atomic_init(&stats->callbacks, 0);
+    atomic_init(&stats->underruns, 0);
+    atomic_init(&stats->shortReads, 0);
+    atomic_init(&stats->overruns, 0);
+    atomic_init(&stats->filterErrors, 0);
+    atomic_init(&stats->ringErrors, 0);
+    atomic_init(&stats->xruns, 0);
+    atomic_init(&stats->lateCallbacks, 0);
+    atomic_init(&stats->busyNs, 0);
+    atomic_init(&stats->maxCallbackNs, 0);
+    atomic_init(&stats->lastStartNs, 0);
+
+    if ((err = pthread_mutex_init(&stats->reporterMut, NULL))) {
+        stl_error(err, "Failed to initialise audio stats mutex");
+    }
+
+    if ((err = pthread_cond_init(&stats->reporterCond, NULL))) {
+        stl_error(err, "Failed to initialise audio stats condition");
+    }
+
+    stats->reporterRunning = true;
+
+    if ((err = pthread_create(&stats->reporter, NULL, &audio_stats_reporter_main, stats))) {
+        stl_error(err, "Failed to start audio stats reporter");
+    }
+}
+
+/**
+ * Stop and join the reporter thread.
+ */
+void destroy_audio_stats(audio_stats_t* stats) {
+    int err;
+
+    pthread_mutex_lock(&stats->reporterMut);
+    stats->reporterRunning = false;
+    pthread_cond_signal(&stats->reporterCond);
+    pthread_mutex_unlock(&stats->reporterMut);
+
+    if ((err = pthread_join(stats->reporter, NULL))) {
+        stl_warn(err, "Failed to join audio stats reporter");
+    }
+
+    pthread_cond_destroy(&stats->reporterCond);
+    pthread_mutex_destroy(&stats->reporterMut);
+}
+
+/**
+ * Mark the start of an audio callback. Real-time safe.
+ *
+ * Returns the start timestamp to be passed to audio_stats_callback_end().
+ */
+uint64_t audio_stats_callback_begin(audio_stats_t* stats, uint32_t frameCount, uint32_t sampleRate) {
+    const uint64_t now = audio_stats_now_ns();
+    const uint64_t periodNs = (uint64_t)frameCount * 1000000000 / sampleRate;
+    const uint64_t last = atomic_exchange_explicit(&stats->lastStartNs, now, memory_order_relaxed);
+
+    // If the device woke us more than two periods after the last callback then
+    // the hardware buffer has almost certainly been starved
+    if (last != 0 && now - last > 2 * periodNs) {
+        audio_stats_count(stats->lateCallbacks);
+    }
+
+    audio_stats_count(stats->callbacks);
+    return now;
+}
+
+/**
+ * Mark the end of an audio callback, checking it against its deadline of one
+ * period of `frameCount` frames. Real-time safe.
+ */
+void audio_stats_callback_end(audio_stats_t* stats, uint64_t startNs, uint32_t frameCount, uint32_t sampleRate) {
+    const uint64_t elapsed = audio_stats_now_ns() - startNs;
+    const uint64_t periodNs = (uint64_t)frameCount * 1000000000 / sampleRate;
+
+    atomic_fetch_add_explicit(&stats->busyNs, elapsed, memory_order_relaxed);
+    atomic_store_max(&stats->maxCallbackNs, elapsed);
+
+    if (elapsed > periodNs) {
+        audio_stats_count(stats->xruns);
+    }
+}
+
+static void atomic_store_max(atomic_uint_fast64_t* value, uint64_t candidate) {
+    uint_fast64_t current = atomic_load_explicit(value, memory_order_relaxed);
+
+    while (candidate > current) {
+        if (atomic_compare_exchange_weak_explicit(value, &current, candidate, memory_order_relaxed, memory_order_relaxed)) {
+            break;
+        }
+    }
+}
+
+#define take(counter) ((unsigned long long)atomic_exchange_explicit(&stats->counter, 0, memory_order_relaxed))
+
+/**
+ * Reporter thread main loop. Periodically drains the counters and logs them,
+ * keeping all formatted output off the audio thread.
+ */
+static void* audio_stats_reporter_main(void* arg) {
+    audio_stats_t* stats = (audio_stats_t*)arg;
+    struct timespec wakeAt;
+    int err;
+
+    pthread_mutex_lock(&stats->reporterMut);
+
+    while (stats->reporterRunning) {
+        clock_gettime(CLOCK_REALTIME, &wakeAt);
+        wakeAt.tv_sec += AUDIO_STATS_REPORT_INTERVAL_S;
+
+        err = pthread_cond_timedwait(&stats->reporterCond, &stats->reporterMut, &wakeAt);
+
+        if (err != 0 && err != ETIMEDOUT) {
+            stl_warn(err, "Audio stats reporter failed to wait");
+            break;
+        }
+
+        const unsigned long long callbacks     = take(callbacks);
+        const unsigned long long underruns     = take(underruns);
+        const unsigned long long shortReads    = take(shortReads);
+        const unsigned long long overruns      = take(overruns);
+        const unsigned long long filterErrors  = take(filterErrors);
+        const unsigned long long ringErrors    = take(ringErrors);
+        const unsigned long long xruns         = take(xruns);
+        const unsigned long long lateCallbacks = take(lateCallbacks);
+        const unsigned long long busyNs        = take(busyNs);
+        const unsigned long long maxCallbackNs = take(maxCallbackNs);
+
+        if (callbacks == 0) {
+            continue;
+        }
+
+        if (underruns || shortReads || overruns || filterErrors || ringErrors || xruns || lateCallbacks) {
+            warn("Audio callback over %ds: %llu underruns, %llu short reads, %llu overruns, %llu filter errors, %llu ring errors, %llu xruns, %llu late callbacks, max %llu us",
+                AUDIO_STATS_REPORT_INTERVAL_S, underruns, shortReads, overruns, filterErrors, ringErrors, xruns, lateCallbacks, maxCallbackNs / 1000);
+        } else {
+            info("Audio callback over %ds: %llu callbacks, mean %llu us, max %llu us",
+                AUDIO_STATS_REPORT_INTERVAL_S, callbacks, busyNs / callbacks / 1000, maxCallbackNs / 1000);
+        }
+    }
+
+    pthread_mutex_unlock(&stats->reporterMut);
+    return NULL;
+}
@@ -0,0 +1,287 @@
+#include <stdint.h>
+#include <string.h>
+#include "common.h"
+#include "audiobackend/codec.h"
+
+// Set in the last header byte of an ADPCM block whose last nibble is padding
+#define ADPCM_ODD 0x01
+
+#define PCMU_BIAS 0x84
+#define PCMU_CLIP 32635
+
+static const int16_t adpcmSteps[89] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+    253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+    1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+    3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442,
+    11487, 12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794,
+    32767
+};
+
+static const int8_t adpcmIndexSteps[8] = { -1, -1, -1, -1, 2, 4, 6, 8 };
+
+static uint8_t pcmu_encode(int16_t sample);
+static int16_t pcmu_decode(uint8_t code);
+static uint8_t adpcm_encode(codec_state_t* state, int16_t sample);
+static int16_t adpcm_decode(codec_state_t* state, uint8_t nibble);
+
+const char* codec_name(int codec) {
+    switch (codec) {
+        case MEDIA_CODEC_L16:
+            return "L16";
+        case MEDIA_CODEC_PCMU:
+            return "PCMU";
+        case MEDIA_CODEC_ADPCM:
+            return "ADPCM";
+        default:
+            return "unknown";
+    }
+}
+
+void init_codec_state(codec_state_t* state) {
+    state->predictor = 0;
+    state->index = 0;
+}
+
+/**
+ * Bytes taken by a block of `frames` in `codec`, 0 for an unknown codec.
+ */
+size_t codec_encoded_size(int codec, size_t frames) {
+    switch (codec) {
+        case MEDIA_CODEC_L16:
+            return frames * sizeof(int16_t);
+        case MEDIA_CODEC_PCMU:
+            return frames;
+        case MEDIA_CODEC_ADPCM:
+            return CODEC_ADPCM_HEADER_SIZE + (frames + 1) / 2;
+        default:
+            return 0;
+    }
+}
+
+/**
+ * Frames held by an encoded block of `length` bytes, 0 if it is malformed.
+ */
+size_t codec_decoded_frames(int codec, const uint8_t* in, size_t length) {
+    switch (codec) {
+        case MEDIA_CODEC_L16:
+            return length / sizeof(int16_t);
+        case MEDIA_CODEC_PCMU:
+            return length;
+        case MEDIA_CODEC_ADPCM:
+            if (length <= CODEC_ADPCM_HEADER_SIZE) {
+                return 0;
+            }
+            return (length - CODEC_ADPCM_HEADER_SIZE) * 2 - ((in[3] & ADPCM_ODD) ? 1 : 0);
+        default:
+            return 0;
+    }
+}
+
+/**
+ * Encode `frames` of mono s16 audio into `out`, which must hold
+ * codec_encoded_size() bytes.
+ *
+ * Returns the bytes written.
+ */
+size_t codec_encode(int codec, codec_state_t* state, const int16_t* in, size_t frames, uint8_t* out) {
+    switch (codec) {
+        case MEDIA_CODEC_L16:
+            for (size_t i = 0; i < frames; i++) {
+                out[2 * i] = (uint8_t)((uint16_t)in[i] >> 8);
+                out[2 * i + 1] = (uint8_t)in[i];
+            }
+            break;
+
+        case MEDIA_CODEC_PCMU:
+            for (size_t i = 0; i < frames; i++) {
+                out[i] = pcmu_encode(in[i]);
+            }
+            break;
+
+        case MEDIA_CODEC_ADPCM: {
+            out[0] = (uint8_t)((uint16_t)state->predictor >> 8);
+            out[1] = (uint8_t)state->predictor;
+            out[2] = (uint8_t)state->index;
+            out[3] = (frames & 1) ? ADPCM_ODD : 0;
+
+            uint8_t* nibbles = out + CODEC_ADPCM_HEADER_SIZE;
+
+            // Two samples a byte, the earlier one in the low nibble
+            for (size_t i = 0; i < frames; i += 2) {
+                uint8_t byte = adpcm_encode(state, in[i]);
+                if (i + 1 < frames) {
+                    byte |= adpcm_encode(state, in[i + 1]) << 4;
+                }
+                nibbles[i / 2] = byte;
+            }
+            break;
+        }
+
+        default:
+            return 0;
+    }
+
+    return codec_encoded_size(codec, frames);
+}
+
+/**
+ * Decode a block into `out`, which must hold codec_decoded_frames() frames.
+ *
+ * Returns the frames written, 0 if the block is malformed.
+ */
+size_t codec_decode(int codec, const uint8_t* in, size_t length, int16_t* out) {
+    const size_t frames = codec_decoded_frames(codec, in, length);
+
+    switch (codec) {
+        case MEDIA_CODEC_L16:
+            for (size_t i = 0; i < frames; i++) {
+                out[i] = (int16_t)(((uint16_t)in[2 * i] << 8) | in[2 * i + 1]);
+            }
+            break;
+
+        case MEDIA_CODEC_PCMU:
+            for (size_t i = 0; i < frames; i++) {
+                out[i] = pcmu_decode(in[i]);
+            }
+            break;
+
+        case MEDIA_CODEC_ADPCM: {
+            if (frames == 0 || in[2] >= sizeof(adpcmSteps) / sizeof(*adpcmSteps)) {
+                return 0;
+            }
+
+            codec_state_t state = {
+                .predictor = (int16_t)(((uint16_t)in[0] << 8) | in[1]),
+                .index = in[2],
+            };
+
+            const uint8_t* nibbles = in + CODEC_ADPCM_HEADER_SIZE;
+
+            for (size_t i = 0; i < frames; i++) {
+                out[i] = adpcm_decode(&state, (nibbles[i / 2] >> ((i & 1) * 4)) & 0x0f);
+            }
+            break;
+        }
+
+        default:
+            return 0;
+    }
+
+    return frames;
+}
+
+/**
+ * G.711 mu-law, segment and mantissa of the biased magnitude.
+ */
+static uint8_t pcmu_encode(int16_t sample) {
+    int value = sample;
+    const uint8_t sign = value < 0 ? 0x80 : 0;
+
+    if (value < 0) {
+        value = -value;
+    }
+    if (value > PCMU_CLIP) {
+        value = PCMU_CLIP;
+    }
+
+    value += PCMU_BIAS;
+
+    int segment = 7;
+    for (int mask = 0x4000; segment > 0 && !(value & mask); mask >>= 1) {
+        segment--;
+    }
+
+    const uint8_t mantissa = (value >> (segment + 3)) & 0x0f;
+    return ~(sign | (segment << 4) | mantissa);
+}
+
+static int16_t pcmu_decode(uint8_t code) {
+    code = ~code;
+
+    const int segment = (code >> 4) & 0x07;
+    const int value = ((((code & 0x0f) << 3) + PCMU_BIAS) << segment) - PCMU_BIAS;
+
+    return (int16_t)((code & 0x80) ? -value : value);
+}
+
+static uint8_t adpcm_encode(codec_state_t* state, int16_t sample) {
+    const int step = adpcmSteps[state->index];
+    int diff = sample - state->predictor;
+    uint8_t nibble = 0;
+
+    if (diff < 0) {
+        nibble = 8;
+        diff = -diff;
+    }
+
+    // Quantise the difference the same way the decoder will rebuild it
+    int delta = step >> 3;
+
+    if (diff >= step) {
+        nibble |= 4;
+        diff -= step;
+        delta += step;
+    }
+    if (diff >= step >> 1) {
+        nibble |= 2;
+        diff -= step >> 1;
+        delta += step >> 1;
+    }
+    if (diff >= step >> 2) {
+        nibble |= 1;
+        delta += step >> 2;
+    }
+
+    state->predictor += (nibble & 8) ? -delta : delta;
+
+    if (state->predictor > INT16_MAX) {
+        state->predictor = INT16_MAX;
+    } else if (state->predictor < INT16_MIN) {
+        state->predictor = INT16_MIN;
+    }
+
+    state->index += adpcmIndexSteps[nibble & 7];
+
+    if (state->index < 0) {
+        state->index = 0;
+    } else if (state->index > 88) {
+        state->index = 88;
+    }
+
+    return nibble;
+}
+
+static int16_t adpcm_decode(codec_state_t* state, uint8_t nibble) {
+    const int step = adpcmSteps[state->index];
+    int delta = step >> 3;
+
+    if (nibble & 4) {
+        delta += step;
+    }
+    if (nibble & 2) {
+        delta += step >> 1;
+    }
+    if (nibble & 1) {
+        delta += step >> 2;
+    }
+
+    state->predictor += (nibble & 8) ? -delta : delta;
+
+    if (state->predictor > INT16_MAX) {
+        state->predictor = INT16_MAX;
+    } else if (state->predictor < INT16_MIN) {
+        state->predictor = INT16_MIN;
+    }
+
+    state->index += adpcmIndexSteps[nibble & 7];
+
+    if (state->index < 0) {
+        state->index = 0;
+    } else if (state->index > 88) {
+        state->index = 88;
+    }
+
+    return (int16_t)state->predictor;
+}
@@ -0,0 +1,419 @@
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include "common.h"
+#include "utils/args.h"
+#include "audiobackend/kernels.h"
+#include "audiobackend/dsp.h"
+
+#define DEFAULT_Q 0.707
+#define DEFAULT_DC_CUTOFF 20.0
+#define DEFAULT_RELEASE_MS 50.0
+
+static int  compile_stage(dsp_graph_t* graph, const dsp_stage_conf_t* stage, uint32_t* rate);
+static int  design_biquad(const dsp_stage_conf_t* stage, uint32_t rate, dsp_biquad_t* biquad);
+static int  push_biquad(dsp_graph_t* graph, dsp_biquad_t biquad);
+static int  push_gain(dsp_graph_t* graph, float gain);
+static int  push_resampler(dsp_graph_t* graph, uint32_t inRate, uint32_t outRate);
+static dsp_op_t* push_op(dsp_graph_t* graph, enum DSP_OP op);
+static void prepare_op(dsp_op_t* op);
+
+static void process_limiter(dsp_op_t* op, float* samples, size_t count);
+
+/**
+ * Compile a DSP chain from its config.
+ *
+ * The chain takes audio at `inRate` and must produce audio at `outRate`. If the
+ * config does not resample to `outRate` itself then a resampler is appended.
+ * Coefficients for every stage are computed here so that processing is only
+ * multiply and adds.
+ *
+ * Returns ST_FAIL if a stage is invalid.
+ */
+int init_dsp_graph(dsp_graph_t* graph, const dsp_chain_conf_t* conf, uint32_t inRate, uint32_t outRate) {
+    memset(graph, 0, sizeof(*graph));
+    graph->in_rate = inRate;
+    graph->out_rate = outRate;
+
+    uint32_t rate = inRate;
+
+    for (int i = 0; i < conf->stage_count; i++) {
+        if (compile_stage(graph, &conf->stages[i], &rate) != ST_GOOD) {
+            warn("Failed to compile DSP stage %d (%s)", i, conf->stages[i].type);
+            destroy_dsp_graph(graph);
+            return ST_FAIL;
+        }
+    }
+
+    if (rate != outRate) {
+        info("DSP chain ends at %u Hz, appending resampler to %u Hz", rate, outRate);
+
+        if (push_resampler(graph, rate, outRate) != ST_GOOD) {
+            destroy_dsp_graph(graph);
+            return ST_FAIL;
+        }
+    }
+
+    for (int i = 0; i < graph->op_count; i++) {
+        prepare_op(&graph->ops[i]);
+    }
+
+    info("DSP chain compiled %d stages into %d ops", conf->stage_count, graph->op_count);
+    return ST_GOOD;
+}
+
+void destroy_dsp_graph(dsp_graph_t* graph) {
+    for (int i = 0; i < graph->op_count; i++) {
+        if (graph->ops[i].op == DSP_OP_RESAMPLE) {
+            ma_linear_resampler_uninit(&graph->ops[i].resample.resampler, NULL);
+        }
+    }
+
+    graph->op_count = 0;
+}
+
+/**
+ * Upper bound on the number of frames produced by processing `inFrames`.
+ */
+size_t dsp_graph_max_output(const dsp_graph_t* graph, size_t inFrames) {
+    const size_t blocks = inFrames / DSP_BLOCK_FRAMES + 1;
+    return (inFrames * graph->out_rate + graph->in_rate - 1) / graph->in_rate + blocks * 2;
+}
+
+/**
+ * Run `inFrames` frames of mono s16 audio through the graph.
+ *
+ * `outFrames` holds the capacity of `out` on entry, and the number of frames
+ * written on return. Use dsp_graph_max_output() to size the output.
+ */
+int dsp_graph_process(dsp_graph_t* graph, const int16_t* in, size_t inFrames, int16_t* out, size_t* outFrames) {
+    const bool fixedPoint = kernels->fixed_point;
+    const size_t capacity = *outFrames;
+    size_t produced = 0;
+
+    for (size_t offset = 0; offset < inFrames; offset += DSP_BLOCK_FRAMES) {
+        size_t count = MIN(inFrames - offset, DSP_BLOCK_FRAMES);
+        float* samples = graph->work[0];
+        float* spare = graph->work[1];
+
+        // Blocks start as s16 and are only converted when an op needs the other
+        // domain, so an all fixed point chain never touches the FPU
+        bool isFloat = false;
+        memcpy(graph->fixed, in + offset, count * sizeof(int16_t));
+
+        for (int i = 0; i < graph->op_count; i++) {
+            dsp_op_t* op = &graph->ops[i];
+            const bool wantFloat = !(fixedPoint && (op->op == DSP_OP_CASCADE || op->op == DSP_OP_GAIN));
+
+            if (wantFloat && !isFloat) {
+                kernels->s16_to_f32(samples, graph->fixed, count);
+            } else if (!wantFloat && isFloat) {
+                kernels->f32_to_s16(graph->fixed, samples, count);
+            }
+
+            isFloat = wantFloat;
+
+            switch (op->op) {
+            case DSP_OP_CASCADE:
+                if (fixedPoint) {
+                    kernels->biquad_cascade_s16(op->cascade.fixed, op->cascade.fixedState, op->cascade.count, graph->fixed, count);
+                } else {
+                    kernels->biquad_cascade_f32(op->cascade.sections, op->cascade.state, op->cascade.count, samples, count);
+                }
+                break;
+            case DSP_OP_GAIN:
+                if (fixedPoint) {
+                    kernels->gain_s16(graph->fixed, op->gain.gainQ12, count);
+                } else {
+                    kernels->gain_f32(samples, op->gain.gain, count);
+                }
+                break;
+            case DSP_OP_LIMITER:
+                process_limiter(op, samples, count);
+                break;
+            case DSP_OP_RESAMPLE: {
+                ma_uint64 frameCountIn = count;
+                ma_uint64 frameCountOut = DSP_MAX_BLOCK_FRAMES;
+
+                if (ma_linear_resampler_process_pcm_frames(&op->resample.resampler, samples, &frameCountIn, spare, &frameCountOut) != MA_SUCCESS) {
+                    *outFrames = produced;
+                    return ST_FAIL;
+                }
+
+                float* swap = samples;
+                samples = spare;
+                spare = swap;
+                count = frameCountOut;
+                break;
+            }
+            }
+        }
+
+        if (produced + count > capacity) {
+            *outFrames = produced;
+            return ST_FAIL;
+        }
+
+        if (isFloat) {
+            kernels->f32_to_s16(out + produced, samples, count);
+        } else {
+            memcpy(out + produced, graph->fixed, count * sizeof(int16_t));
+        }
+
+        produced += count;
+    }
+
+    *outFrames = produced;
+    return ST_GOOD;
+}
+
+/**
+ * Add one config stage to the graph, fusing it into the previous op when
+ * possible. `rate` is the sample rate at this point in the chain, and is
+ * updated by resamplers.
+ */
+static int compile_stage(dsp_graph_t* graph, const dsp_stage_conf_t* stage, uint32_t* rate) {
+    if (strcmp(stage->type, "gain") == 0) {
+        return push_gain(graph, (float)pow(10.0, stage->gain_db / 20.0));
+    }
+
+    if (strcmp(stage->type, "limiter") == 0) {
+        const double releaseMs = stage->release_ms > 0 ? stage->release_ms : DEFAULT_RELEASE_MS;
+        dsp_op_t* op = push_op(graph, DSP_OP_LIMITER);
+
+        if (op == NULL || stage->threshold_db > 0) {
+            return ST_FAIL;
+        }
+
+        op->limiter.threshold = (float)pow(10.0, stage->threshold_db / 20.0);
+        op->limiter.release = (float)exp(-1000.0 / (releaseMs * *rate));
+        op->limiter.envelope = 0;
+        return ST_GOOD;
+    }
+
+    if (strcmp(stage->type, "resample") == 0) {
+        if (push_resampler(graph, *rate, stage->rate) != ST_GOOD) {
+            return ST_FAIL;
+        }
+
+        *rate = stage->rate;
+        return ST_GOOD;
+    }
+
+    // Everything else is a filter
+    dsp_biquad_t biquad;
+
+    if (design_biquad(stage, *rate, &biquad) != ST_GOOD) {
+        return ST_FAIL;
+    }
+
+    return push_biquad(graph, biquad);
+}
+
+/**
+ * Compute normalised coefficients for a filter stage.
+ *
+ * https://webaudio.github.io/Audio-EQ-Cookbook/audio-eq-cookbook.html
+ */
+static int design_biquad(const dsp_stage_conf_t* stage, uint32_t rate, dsp_biquad_t* biquad) {
+    const double nyquist = rate / 2.0;
+    double frequency = stage->frequency;
+
+    if (strcmp(stage->type, "dc_block") == 0) {
+        // First order high pass: y[n] = x[n] - x[n-1] + R * y[n-1]
+        frequency = frequency > 0 ? frequency : DEFAULT_DC_CUTOFF;
+        const double R = exp(-2.0 * M_PI * frequency / rate);
+
+        *biquad = (dsp_biquad_t){ .b0 = 1, .b1 = -1, .b2 = 0, .a1 = (float)-R, .a2 = 0 };
+        return ST_GOOD;
+    }
+
+    if (frequency <= 0 || frequency >= nyquist) {
+        warn("Filter frequency %.1f Hz out of range for %u Hz", frequency, rate);
+        return ST_FAIL;
+    }
+
+    const double Q = stage->q > 0 ? stage->q : DEFAULT_Q;
+    const double w0 = 2.0 * M_PI * frequency / rate;
+    const double cosw = cos(w0);
+    const double alpha = sin(w0) / (2.0 * Q);
+    const double A = pow(10.0, stage->gain_db / 40.0);
+    const double sqrtA2alpha = 2.0 * sqrt(A) * alpha;
+
+    double b0, b1, b2, a0, a1, a2;
+
+    if (strcmp(stage->type, "lowpass") == 0) {
+        b0 = (1.0 - cosw) / 2.0; b1 = 1.0 - cosw; b2 = b0;
+        a0 = 1.0 + alpha; a1 = -2.0 * cosw; a2 = 1.0 - alpha;
+    } else if (strcmp(stage->type, "highpass") == 0) {
+        b0 = (1.0 + cosw) / 2.0; b1 = -(1.0 + cosw); b2 = b0;
+        a0 = 1.0 + alpha; a1 = -2.0 * cosw; a2 = 1.0 - alpha;
+    } else if (strcmp(stage->type, "bandpass") == 0) {
+        // Constant 0 dB peak gain
+        b0 = alpha; b1 = 0; b2 = -alpha;
+        a0 = 1.0 + alpha; a1 = -2.0 * cosw; a2 = 1.0 - alpha;
+    } else if (strcmp(stage->type, "notch") == 0) {
+        b0 = 1.0; b1 = -2.0 * cosw; b2 = 1.0;
+        a0 = 1.0 + alpha; a1 = -2.0 * cosw; a2 = 1.0 - alpha;
+    } else if (strcmp(stage->type, "peak") == 0) {
+        b0 = 1.0 + alpha * A; b1 = -2.0 * cosw; b2 = 1.0 - alpha * A;
+        a0 = 1.0 + alpha / A; a1 = -2.0 * cosw; a2 = 1.0 - alpha / A;
+    } else if (strcmp(stage->type, "lowshelf") == 0) {
+        b0 = A * ((A + 1) - (A - 1) * cosw + sqrtA2alpha);
+        b1 = 2 * A * ((A - 1) - (A + 1) * cosw);
+        b2 = A * ((A + 1) - (A - 1) * cosw - sqrtA2alpha);
+        a0 = (A + 1) + (A - 1) * cosw + sqrtA2alpha;
+        a1 = -2 * ((A - 1) + (A + 1) * cosw);
+        a2 = (A + 1) + (A - 1) * cosw - sqrtA2alpha;
+    } else if (strcmp(stage->type, "highshelf") == 0) {
+        b0 = A * ((A + 1) + (A - 1) * cosw + sqrtA2alpha);
+        b1 = -2 * A * ((A - 1) + (A + 1) * cosw);
+        b2 = A * ((A + 1) + (A - 1) * cosw - sqrtA2alpha);
+        a0 = (A + 1) - (A - 1) * cosw + sqrtA2alpha;
+        a1 = 2 * ((A - 1) - (A + 1) * cosw);
+        a2 = (A + 1) - (A - 1) * cosw - sqrtA2alpha;
+    } else {
+        warn("Unknown DSP stage type: %s", stage->type);
+        return ST_FAIL;
+    }
+
+    biquad->b0 = (float)(b0 / a0);
+    biquad->b1 = (float)(b1 / a0);
+    biquad->b2 = (float)(b2 / a0);
+    biquad->a1 = (float)(a1 / a0);
+    biquad->a2 = (float)(a2 / a0);
+
+    return ST_GOOD;
+}
+
+/**
+ * Append a biquad, joining the previous cascade if there is one. A gain op
+ * directly before the filter is folded into its numerator.
+ */
+static int push_biquad(dsp_graph_t* graph, dsp_biquad_t biquad) {
+    dsp_op_t* last = graph->op_count > 0 ? &graph->ops[graph->op_count - 1] : NULL;
+
+    if (last != NULL && last->op == DSP_OP_GAIN) {
+        const float gain = last->gain.gain;
+        biquad.b0 *= gain;
+        biquad.b1 *= gain;
+        biquad.b2 *= gain;
+
+        memset(last, 0, sizeof(*last));
+        last->op = DSP_OP_CASCADE;
+    }
+
+    if (last == NULL || last->op != DSP_OP_CASCADE || last->cascade.count >= DSP_MAX_BIQUADS) {
+        if ((last = push_op(graph, DSP_OP_CASCADE)) == NULL) {
+            return ST_FAIL;
+        }
+    }
+
+    last->cascade.coeffs[last->cascade.count++] = biquad;
+    return ST_GOOD;
+}
+
+/**
+ * Append a linear gain, folding it into a previous gain or the last filter of
+ * a previous cascade.
+ */
+static int push_gain(dsp_graph_t* graph, float gain) {
+    dsp_op_t* last = graph->op_count > 0 ? &graph->ops[graph->op_count - 1] : NULL;
+
+    if (last != NULL && last->op == DSP_OP_GAIN) {
+        last->gain.gain *= gain;
+        return ST_GOOD;
+    }
+
+    if (last != NULL && last->op == DSP_OP_CASCADE) {
+        dsp_biquad_t* biquad = &last->cascade.coeffs[last->cascade.count - 1];
+        biquad->b0 *= gain;
+        biquad->b1 *= gain;
+        biquad->b2 *= gain;
+        return ST_GOOD;
+    }
+
+    if ((last = push_op(graph, DSP_OP_GAIN)) == NULL) {
+        return ST_FAIL;
+    }
+
+    last->gain.gain = gain;
+    return ST_GOOD;
+}
+
+static int push_resampler(dsp_graph_t* graph, uint32_t inRate, uint32_t outRate) {
+    if (outRate < DSP_MIN_RATE || outRate > DSP_MAX_RATE) {
+        warn("Resampler rate %u Hz out of range", outRate);
+        return ST_FAIL;
+    }
+
+    if (inRate == outRate) {
+        return ST_GOOD;
+    }
+
+    dsp_op_t* op = push_op(graph, DSP_OP_RESAMPLE);
+
+    if (op == NULL) {
+        return ST_FAIL;
+    }
+
+    ma_result res;
+    ma_linear_resampler_config config = ma_linear_resampler_config_init(ma_format_f32, 1, inRate, outRate);
+
+    if ((res = ma_linear_resampler_init(&config, NULL, &op->resample.resampler)) != MA_SUCCESS) {
+        warn("Failed to initialise resampler, cause: %s", ma_result_description(res));
+        graph->op_count--;
+        return ST_FAIL;
+    }
+
+    return ST_GOOD;
+}
+
+static dsp_op_t* push_op(dsp_graph_t* graph, enum DSP_OP op) {
+    if (graph->op_count >= DSP_MAX_STAGES) {
+        warn("DSP graph has too many ops");
+        return NULL;
+    }
+
+    dsp_op_t* result = &graph->ops[graph->op_count++];
+    memset(result, 0, sizeof(*result));
+    result->op = op;
+
+    return result;
+}
+
+/**
+ * Build the kernel forms of an op once fusion has settled its coefficients.
+ */
+static void prepare_op(dsp_op_t* op) {
+    if (op->op == DSP_OP_CASCADE) {
+        for (int s = 0; s < op->cascade.count; s++) {
+            const dsp_biquad_t* c = &op->cascade.coeffs[s];
+            kernel_biquad_prepare(&op->cascade.sections[s], c->b0, c->b1, c->b2, c->a1, c->a2);
+            kernel_biquad_prepare_q(&op->cascade.fixed[s], &op->cascade.sections[s]);
+        }
+    } else if (op->op == DSP_OP_GAIN) {
+        const long gainQ12 = lrintf(op->gain.gain * 4096.0f);
+        op->gain.gainQ12 = (int16_t)(gainQ12 > INT16_MAX ? INT16_MAX : gainQ12);
+    }
+}
+
+/**
+ * Peak limiter with instant attack and exponential release.
+ */
+static void process_limiter(dsp_op_t* op, float* samples, size_t count) {
+    const float threshold = op->limiter.threshold;
+    const float release = op->limiter.release;
+    float envelope = op->limiter.envelope;
+
+    for (size_t i = 0; i < count; i++) {
+        const float level = fabsf(samples[i]);
+        envelope = level > envelope ? level : envelope * release;
+
+        if (envelope > threshold) {
+            samples[i] *= threshold / envelope;
+        }
+    }
+
+    op->limiter.envelope = envelope;
+}
@@ -0,0 +1,331 @@
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "common.h"
+#include "audiobackend/kernels.h"
+
+#if defined(KERNELS_NEON) && defined(__arm__) && defined(linux)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+static void mix_s16(int16_t* dst, const int16_t* src, size_t count);
+static void mix_scaled_s16(int16_t* dst, const int16_t* src, int16_t gainQ15, size_t count);
+static void gain_s16(int16_t* samples, int16_t gainQ12, size_t count);
+static void accumulate_s16(int32_t* acc, const int16_t* src, size_t count);
+static void saturate_s32(int16_t* dst, const int32_t* src, size_t count);
+static void mix_minus_s16(int16_t* dst, const int32_t* sum, const int16_t* own, int16_t gainQ15, size_t count);
+static uint32_t peak_minus_s32(const int32_t* sum, const int16_t* own, size_t count);
+static void s16_to_f32(float* dst, const int16_t* src, size_t count);
+static void f32_to_s16(int16_t* dst, const float* src, size_t count);
+static void gain_f32(float* samples, float gain, size_t count);
+static void biquad_cascade_f32(const kernel_biquad_t* sections, float (*state)[2], int sectionCount, float* samples, size_t count);
+static uint64_t energy_s16(const int16_t* src, size_t count);
+static int32_t dot_s16(const int16_t* a, const int16_t* b, size_t count);
+
+const audio_kernels_t kernels_scalar = {
+    .name = "scalar",
+    .fixed_point = false,
+    .mix_s16 = &mix_s16,
+    .mix_scaled_s16 = &mix_scaled_s16,
+    .gain_s16 = &gain_s16,
+    .accumulate_s16 = &accumulate_s16,
+    .saturate_s32 = &saturate_s32,
+    .mix_minus_s16 = &mix_minus_s16,
+    .peak_minus_s32 = &peak_minus_s32,
+    .s16_to_f32 = &s16_to_f32,
+    .f32_to_s16 = &f32_to_s16,
+    .gain_f32 = &gain_f32,
+    .biquad_cascade_f32 = &biquad_cascade_f32,
+    .biquad_cascade_s16 = &kernels_scalar_biquad_cascade_s16,
+    .energy_s16 = &energy_s16,
+    .dot_s16 = &dot_s16,
+};
+
+// The scalar table with the fixed point paths preferred, for ARM cores without
+// NEON such as the Pi Zero
+static const audio_kernels_t kernels_fixed = {
+    .name = "scalar-fixed",
+    .fixed_point = true,
+    .mix_s16 = &mix_s16,
+    .mix_scaled_s16 = &mix_scaled_s16,
+    .gain_s16 = &gain_s16,
+    .accumulate_s16 = &accumulate_s16,
+    .saturate_s32 = &saturate_s32,
+    .mix_minus_s16 = &mix_minus_s16,
+    .peak_minus_s32 = &peak_minus_s32,
+    .s16_to_f32 = &s16_to_f32,
+    .f32_to_s16 = &f32_to_s16,
+    .gain_f32 = &gain_f32,
+    .biquad_cascade_f32 = &biquad_cascade_f32,
+    .biquad_cascade_s16 = &kernels_scalar_biquad_cascade_s16,
+    .energy_s16 = &energy_s16,
+    .dot_s16 = &dot_s16,
+};
+
+const audio_kernels_t* kernels = &kernels_scalar;
+
+/**
+ * Select the fastest kernels supported by the running CPU.
+ */
+void init_kernels(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        kernels = &kernels_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        kernels = &kernels_sse2;
+    }
+#elif defined(__aarch64__)
+    // Advanced SIMD is mandatory on ARMv8
+    kernels = &kernels_neon;
+#elif defined(KERNELS_NEON) && defined(linux)
+    if (getauxval(AT_HWCAP) & HWCAP_NEON) {
+        kernels = &kernels_neon;
+    } else {
+        kernels = &kernels_fixed;
+    }
+#elif defined(__arm__) && !defined(KERNELS_NEON)
+    // Built for ARMv6, which has no NEON
+    kernels = &kernels_fixed;
+#endif
+
+    info("Using %s audio kernels", kernels->name);
+}
+
+/**
+ * Force a kernel table by name, for benchmarking and comparing outputs.
+ *
+ * Returns ST_INVALID_ARG if the table is not available on this CPU.
+ */
+int kernels_select(const char* name) {
+    const audio_kernels_t* available[] = {
+        &kernels_scalar,
+        &kernels_fixed,
+#if defined(__x86_64__) || defined(__i386__)
+        &kernels_sse2,
+        __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") ? &kernels_avx2 : NULL,
+#endif
+#if defined(__aarch64__)
+        &kernels_neon,
+#elif defined(KERNELS_NEON) && defined(linux)
+        getauxval(AT_HWCAP) & HWCAP_NEON ? &kernels_neon : NULL,
+#endif
+    };
+
+    for (size_t i = 0; i < sizeof(available) / sizeof(*available); i++) {
+        if (available[i] != NULL && strcmp(available[i]->name, name) == 0) {
+            kernels = available[i];
+            return ST_GOOD;
+        }
+    }
+
+    return ST_INVALID_ARG;
+}
+
+/**
+ * Fill in a biquad section and precompute its block form.
+ *
+ * The block form is found by running the filter over KERNEL_BIQUAD_BLOCK
+ * samples from each unit state and each unit impulse, since the outputs of a
+ * block are linear in the starting state and the block's inputs.
+ */
+void kernel_biquad_prepare(kernel_biquad_t* biquad, float b0, float b1, float b2, float a1, float a2) {
+    memset(biquad, 0, sizeof(*biquad));
+    biquad->b0 = b0;
+    biquad->b1 = b1;
+    biquad->b2 = b2;
+    biquad->a1 = a1;
+    biquad->a2 = a2;
+
+    float samples[KERNEL_BIQUAD_BLOCK];
+    float state[2];
+
+    memset(samples, 0, sizeof(samples));
+    state[0] = 1;
+    state[1] = 0;
+    kernels_scalar_biquad_section(biquad, state, samples, KERNEL_BIQUAD_BLOCK);
+    memcpy(biquad->ys1, samples, sizeof(samples));
+
+    memset(samples, 0, sizeof(samples));
+    state[0] = 0;
+    state[1] = 1;
+    kernels_scalar_biquad_section(biquad, state, samples, KERNEL_BIQUAD_BLOCK);
+    memcpy(biquad->ys2, samples, sizeof(samples));
+
+    for (int j = 0; j < KERNEL_BIQUAD_BLOCK; j++) {
+        memset(samples, 0, sizeof(samples));
+        samples[j] = 1;
+        state[0] = 0;
+        state[1] = 0;
+        kernels_scalar_biquad_section(biquad, state, samples, KERNEL_BIQUAD_BLOCK);
+        memcpy(biquad->yx[j], samples, sizeof(samples));
+    }
+}
+
+/**
+ * Quantise a biquad section to KERNEL_BIQUAD_Q fixed point.
+ */
+void kernel_biquad_prepare_q(kernel_biquad_q_t* biquad, const kernel_biquad_t* source) {
+    const float scale = (float)(1 << KERNEL_BIQUAD_Q);
+
+    biquad->b0 = (int32_t)lrintf(source->b0 * scale);
+    biquad->b1 = (int32_t)lrintf(source->b1 * scale);
+    biquad->b2 = (int32_t)lrintf(source->b2 * scale);
+    biquad->a1 = (int32_t)lrintf(source->a1 * scale);
+    biquad->a2 = (int32_t)lrintf(source->a2 * scale);
+}
+
+static inline int16_t sat16(int32_t value) {
+    return value > INT16_MAX ? INT16_MAX : value < INT16_MIN ? INT16_MIN : (int16_t)value;
+}
+
+/**
+ * One biquad section in transposed direct form II.
+ */
+void kernels_scalar_biquad_section(const kernel_biquad_t* section, float* state, float* samples, size_t count) {
+    const float b0 = section->b0, b1 = section->b1, b2 = section->b2;
+    const float a1 = section->a1, a2 = section->a2;
+    float s1 = state[0];
+    float s2 = state[1];
+
+    for (size_t i = 0; i < count; i++) {
+        const float x = samples[i];
+        const float y = b0 * x + s1;
+        s1 = b1 * x - a1 * y + s2;
+        s2 = b2 * x - a2 * y;
+        samples[i] = y;
+    }
+
+    state[0] = s1;
+    state[1] = s2;
+}
+
+static void mix_s16(int16_t* dst, const int16_t* src, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        dst[i] = sat16((int32_t)dst[i] + src[i]);
+    }
+}
+
+static void mix_scaled_s16(int16_t* dst, const int16_t* src, int16_t gainQ15, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        const int32_t scaled = ((int32_t)src[i] * gainQ15 + (1 << 14)) >> 15;
+        dst[i] = sat16(dst[i] + sat16(scaled));
+    }
+}
+
+static void gain_s16(int16_t* samples, int16_t gainQ12, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        samples[i] = sat16(((int32_t)samples[i] * gainQ12 + (1 << 11)) >> 12);
+    }
+}
+
+static void accumulate_s16(int32_t* acc, const int16_t* src, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        acc[i] += src[i];
+    }
+}
+
+static void saturate_s32(int16_t* dst, const int32_t* src, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        dst[i] = sat16(src[i]);
+    }
+}
+
+static void mix_minus_s16(int16_t* dst, const int32_t* sum, const int16_t* own, int16_t gainQ15, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        const int64_t scaled = ((int64_t)(sum[i] - own[i]) * gainQ15 + (1 << 14)) >> 15;
+        dst[i] = sat16((int32_t)scaled);
+    }
+}
+
+static uint32_t peak_minus_s32(const int32_t* sum, const int16_t* own, size_t count) {
+    uint32_t peak = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        const int32_t value = sum[i] - own[i];
+        const uint32_t magnitude = value < 0 ? (uint32_t)-value : (uint32_t)value;
+        peak = magnitude > peak ? magnitude : peak;
+    }
+
+    return peak;
+}
+
+static void s16_to_f32(float* dst, const int16_t* src, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        dst[i] = src[i] * (1.0f / 32768.0f);
+    }
+}
+
+static void f32_to_s16(int16_t* dst, const float* src, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        float scaled = src[i] * 32768.0f;
+        scaled = scaled > 32767.0f ? 32767.0f : scaled;
+        scaled = scaled < -32768.0f ? -32768.0f : scaled;
+        dst[i] = (int16_t)lrintf(scaled);
+    }
+}
+
+static void gain_f32(float* samples, float gain, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        samples[i] *= gain;
+    }
+}
+
+static void biquad_cascade_f32(const kernel_biquad_t* sections, float (*state)[2], int sectionCount, float* samples, size_t count) {
+    for (int s = 0; s < sectionCount; s++) {
+        kernels_scalar_biquad_section(&sections[s], state[s], samples, count);
+    }
+}
+
+/**
+ * Fixed point cascade in direct form I with a 64 bit accumulator, which only
+ * needs the integer multiply-accumulate of ARMv6.
+ */
+void kernels_scalar_biquad_cascade_s16(const kernel_biquad_q_t* sections, int32_t (*state)[4], int sectionCount, int16_t* samples, size_t count) {
+    for (int s = 0; s < sectionCount; s++) {
+        const kernel_biquad_q_t* c = &sections[s];
+        int32_t x1 = state[s][0], x2 = state[s][1];
+        int32_t y1 = state[s][2], y2 = state[s][3];
+
+        for (size_t i = 0; i < count; i++) {
+            const int32_t x = samples[i];
+            int64_t acc = (int64_t)c->b0 * x + (int64_t)c->b1 * x1 + (int64_t)c->b2 * x2
+                        - (int64_t)c->a1 * y1 - (int64_t)c->a2 * y2;
+
+            const int32_t y = sat16((int32_t)((acc + (1 << (KERNEL_BIQUAD_Q - 1))) >> KERNEL_BIQUAD_Q));
+
+            x2 = x1;
+            x1 = x;
+            y2 = y1;
+            y1 = y;
+            samples[i] = (int16_t)y;
+        }
+
+        state[s][0] = x1;
+        state[s][1] = x2;
+        state[s][2] = y1;
+        state[s][3] = y2;
+    }
+}
+
+static uint64_t energy_s16(const int16_t* src, size_t count) {
+    uint64_t energy = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        energy += (uint64_t)((int32_t)src[i] * src[i]);
+    }
+
+    return energy;
+}
+
+static int32_t dot_s16(const int16_t* a, const int16_t* b, size_t count) {
+    int32_t sum = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        sum += (int32_t)a[i] * b[i];
+    }
+
+    return sum;
+}
@@ -0,0 +1,293 @@
+#include <stdint.h>
+#include "audiobackend/kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+/**
+ * AVX2 and FMA kernels, 16 samples per s16 iteration and 8 per f32 iteration.
+ *
+ * This file is the only one compiled with -mavx2 -mfma, and its table is only
+ * selected once the CPU has been checked for both.
+ */
+
+static void mix_s16(int16_t* dst, const int16_t* src, size_t count) {
+    size_t i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        const __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+        const __m256i s = _mm256_loadu_si256((const __m256i*)(src + i));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_adds_epi16(d, s));
+    }
+
+    kernels_sse2.mix_s16(dst + i, src + i, count - i);
+}
+
+/**
+ * Multiply s16 lanes by a 16 bit gain into two vectors of 32 bit products.
+ *
+ * Unpack and pack both work within 128 bit lanes, so packing lo and hi back
+ * together restores the original sample order.
+ */
+static inline void mul_widen(__m256i x, __m256i gain, __m256i* lo, __m256i* hi) {
+    const __m256i productLo = _mm256_mullo_epi16(x, gain);
+    const __m256i productHi = _mm256_mulhi_epi16(x, gain);
+    *lo = _mm256_unpacklo_epi16(productLo, productHi);
+    *hi = _mm256_unpackhi_epi16(productLo, productHi);
+}
+
+static void mix_scaled_s16(int16_t* dst, const int16_t* src, int16_t gainQ15, size_t count) {
+    const __m256i gain = _mm256_set1_epi16(gainQ15);
+    const __m256i round = _mm256_set1_epi32(1 << 14);
+    size_t i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        __m256i lo, hi;
+        mul_widen(_mm256_loadu_si256((const __m256i*)(src + i)), gain, &lo, &hi);
+
+        lo = _mm256_srai_epi32(_mm256_add_epi32(lo, round), 15);
+        hi = _mm256_srai_epi32(_mm256_add_epi32(hi, round), 15);
+
+        const __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_adds_epi16(d, _mm256_packs_epi32(lo, hi)));
+    }
+
+    kernels_sse2.mix_scaled_s16(dst + i, src + i, gainQ15, count - i);
+}
+
+static void gain_s16(int16_t* samples, int16_t gainQ12, size_t count) {
+    const __m256i gain = _mm256_set1_epi16(gainQ12);
+    const __m256i round = _mm256_set1_epi32(1 << 11);
+    size_t i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        __m256i lo, hi;
+        mul_widen(_mm256_loadu_si256((const __m256i*)(samples + i)), gain, &lo, &hi);
+
+        lo = _mm256_srai_epi32(_mm256_add_epi32(lo, round), 12);
+        hi = _mm256_srai_epi32(_mm256_add_epi32(hi, round), 12);
+
+        _mm256_storeu_si256((__m256i*)(samples + i), _mm256_packs_epi32(lo, hi));
+    }
+
+    kernels_sse2.gain_s16(samples + i, gainQ12, count - i);
+}
+
+static void accumulate_s16(int32_t* acc, const int16_t* src, size_t count) {
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        const __m256i x = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(src + i)));
+        __m256i* out = (__m256i*)(acc + i);
+        _mm256_storeu_si256(out, _mm256_add_epi32(_mm256_loadu_si256(out), x));
+    }
+
+    kernels_scalar.accumulate_s16(acc + i, src + i, count - i);
+}
+
+static void saturate_s32(int16_t* dst, const int32_t* src, size_t count) {
+    size_t i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        const __m256i lo = _mm256_loadu_si256((const __m256i*)(src + i));
+        const __m256i hi = _mm256_loadu_si256((const __m256i*)(src + i + 8));
+
+        // Packing interleaves the 128 bit lanes, so put the quarters back in order
+        const __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), _MM_SHUFFLE(3, 1, 2, 0));
+        _mm256_storeu_si256((__m256i*)(dst + i), packed);
+    }
+
+    kernels_sse2.saturate_s32(dst + i, src + i, count - i);
+}
+
+static void mix_minus_s16(int16_t* dst, const int32_t* sum, const int16_t* own, int16_t gainQ15, size_t count) {
+    const __m256i gain = _mm256_set1_epi32(gainQ15);
+    const __m256i round = _mm256_set1_epi32(1 << 14);
+    size_t i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        const __m256i lo = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i*)(sum + i)), _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(own + i))));
+        const __m256i hi = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i*)(sum + i + 8)), _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(own + i + 8))));
+
+        const __m256i scaledLo = _mm256_srai_epi32(_mm256_add_epi32(_mm256_mullo_epi32(lo, gain), round), 15);
+        const __m256i scaledHi = _mm256_srai_epi32(_mm256_add_epi32(_mm256_mullo_epi32(hi, gain), round), 15);
+
+        const __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(scaledLo, scaledHi), _MM_SHUFFLE(3, 1, 2, 0));
+        _mm256_storeu_si256((__m256i*)(dst + i), packed);
+    }
+
+    kernels_sse2.mix_minus_s16(dst + i, sum + i, own + i, gainQ15, count - i);
+}
+
+static uint32_t peak_minus_s32(const int32_t* sum, const int16_t* own, size_t count) {
+    __m256i peak = _mm256_setzero_si256();
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        const __m256i value = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i*)(sum + i)), _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(own + i))));
+        peak = _mm256_max_epu32(peak, _mm256_abs_epi32(value));
+    }
+
+    uint32_t lanes[8];
+    _mm256_storeu_si256((__m256i*)lanes, peak);
+
+    uint32_t result = kernels_sse2.peak_minus_s32(sum + i, own + i, count - i);
+
+    for (int lane = 0; lane < 8; lane++) {
+        result = lanes[lane] > result ? lanes[lane] : result;
+    }
+
+    return result;
+}
+
+static void s16_to_f32(float* dst, const int16_t* src, size_t count) {
+    const __m256 scale = _mm256_set1_ps(1.0f / 32768.0f);
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        const __m256i x = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(src + i)));
+        _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(x), scale));
+    }
+
+    kernels_scalar.s16_to_f32(dst + i, src + i, count - i);
+}
+
+static void f32_to_s16(int16_t* dst, const float* src, size_t count) {
+    const __m256 scale = _mm256_set1_ps(32768.0f);
+    const __m256 max = _mm256_set1_ps(32767.0f);
+    const __m256 min = _mm256_set1_ps(-32768.0f);
+    size_t i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        const __m256 lo = _mm256_max_ps(_mm256_min_ps(_mm256_mul_ps(_mm256_loadu_ps(src + i), scale), max), min);
+        const __m256 hi = _mm256_max_ps(_mm256_min_ps(_mm256_mul_ps(_mm256_loadu_ps(src + i + 8), scale), max), min);
+
+        const __m256i packed = _mm256_packs_epi32(_mm256_cvtps_epi32(lo), _mm256_cvtps_epi32(hi));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_permute4x64_epi64(packed, _MM_SHUFFLE(3, 1, 2, 0)));
+    }
+
+    kernels_sse2.f32_to_s16(dst + i, src + i, count - i);
+}
+
+static void gain_f32(float* samples, float gain, size_t count) {
+    const __m256 g = _mm256_set1_ps(gain);
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        _mm256_storeu_ps(samples + i, _mm256_mul_ps(_mm256_loadu_ps(samples + i), g));
+    }
+
+    kernels_scalar.gain_f32(samples + i, gain, count - i);
+}
+
+#define broadcast(v, n) _mm256_permutevar8x32_ps(v, _mm256_set1_epi32(n))
+
+/**
+ * Cascade using the full 8 sample block form of each section, with fused
+ * multiply adds.
+ */
+static void biquad_cascade_f32(const kernel_biquad_t* sections, float (*state)[2], int sectionCount, float* samples, size_t count) {
+    for (int s = 0; s < sectionCount; s++) {
+        const kernel_biquad_t* c = &sections[s];
+        const __m256 ys1 = _mm256_loadu_ps(c->ys1);
+        const __m256 ys2 = _mm256_loadu_ps(c->ys2);
+        __m256 yx[KERNEL_BIQUAD_BLOCK];
+
+        for (int j = 0; j < KERNEL_BIQUAD_BLOCK; j++) {
+            yx[j] = _mm256_loadu_ps(c->yx[j]);
+        }
+
+        float s1 = state[s][0];
+        float s2 = state[s][1];
+        size_t i = 0;
+
+        for (; i + 8 <= count; i += 8) {
+            const __m256 x = _mm256_loadu_ps(samples + i);
+
+            __m256 y = _mm256_fmadd_ps(ys1, _mm256_set1_ps(s1), _mm256_mul_ps(ys2, _mm256_set1_ps(s2)));
+            y = _mm256_fmadd_ps(yx[0], broadcast(x, 0), y);
+            y = _mm256_fmadd_ps(yx[1], broadcast(x, 1), y);
+            y = _mm256_fmadd_ps(yx[2], broadcast(x, 2), y);
+            y = _mm256_fmadd_ps(yx[3], broadcast(x, 3), y);
+            y = _mm256_fmadd_ps(yx[4], broadcast(x, 4), y);
+            y = _mm256_fmadd_ps(yx[5], broadcast(x, 5), y);
+            y = _mm256_fmadd_ps(yx[6], broadcast(x, 6), y);
+            y = _mm256_fmadd_ps(yx[7], broadcast(x, 7), y);
+
+            _mm256_storeu_ps(samples + i, y);
+
+            // The state after the block only depends on its last two samples
+            const __m128 xHigh = _mm256_extractf128_ps(x, 1);
+            const __m128 yHigh = _mm256_extractf128_ps(y, 1);
+            const float x6 = _mm_cvtss_f32(_mm_shuffle_ps(xHigh, xHigh, _MM_SHUFFLE(2, 2, 2, 2)));
+            const float x7 = _mm_cvtss_f32(_mm_shuffle_ps(xHigh, xHigh, _MM_SHUFFLE(3, 3, 3, 3)));
+            const float y6 = _mm_cvtss_f32(_mm_shuffle_ps(yHigh, yHigh, _MM_SHUFFLE(2, 2, 2, 2)));
+            const float y7 = _mm_cvtss_f32(_mm_shuffle_ps(yHigh, yHigh, _MM_SHUFFLE(3, 3, 3, 3)));
+            s1 = c->b1 * x7 - c->a1 * y7 + c->b2 * x6 - c->a2 * y6;
+            s2 = c->b2 * x7 - c->a2 * y7;
+        }
+
+        state[s][0] = s1;
+        state[s][1] = s2;
+        kernels_scalar_biquad_section(c, state[s], samples + i, count - i);
+    }
+}
+
+static uint64_t energy_s16(const int16_t* src, size_t count) {
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        const __m256i x = _mm256_loadu_si256((const __m256i*)(src + i));
+
+        // Each pair sum is at most 2^31 so fits when treated as unsigned
+        const __m256i pairs = _mm256_madd_epi16(x, x);
+        acc = _mm256_add_epi64(acc, _mm256_unpacklo_epi32(pairs, zero));
+        acc = _mm256_add_epi64(acc, _mm256_unpackhi_epi32(pairs, zero));
+    }
+
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, acc);
+
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + kernels_sse2.energy_s16(src + i, count - i);
+}
+
+static int32_t dot_s16(const int16_t* a, const int16_t* b, size_t count) {
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        const __m256i x = _mm256_loadu_si256((const __m256i*)(a + i));
+        const __m256i y = _mm256_loadu_si256((const __m256i*)(b + i));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(x, y));
+    }
+
+    __m128i half = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(1, 0, 3, 2)));
+    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(2, 3, 0, 1)));
+
+    return _mm_cvtsi128_si32(half) + kernels_sse2.dot_s16(a + i, b + i, count - i);
+}
+
+const audio_kernels_t kernels_avx2 = {
+    .name = "avx2",
+    .fixed_point = false,
+    .mix_s16 = &mix_s16,
+    .mix_scaled_s16 = &mix_scaled_s16,
+    .gain_s16 = &gain_s16,
+    .accumulate_s16 = &accumulate_s16,
+    .saturate_s32 = &saturate_s32,
+    .mix_minus_s16 = &mix_minus_s16,
+    .peak_minus_s32 = &peak_minus_s32,
+    .s16_to_f32 = &s16_to_f32,
+    .f32_to_s16 = &f32_to_s16,
+    .gain_f32 = &gain_f32,
+    .biquad_cascade_f32 = &biquad_cascade_f32,
+    .biquad_cascade_s16 = &kernels_scalar_biquad_cascade_s16,
+    .energy_s16 = &energy_s16,
+    .dot_s16 = &dot_s16,
+};
+
+#endif
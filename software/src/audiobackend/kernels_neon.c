@@ -0,0 +1,254 @@
+#include <stdint.h>
+#include "audiobackend/kernels.h"
+
+#ifdef KERNELS_NEON
+
+#include <arm_neon.h>
+
+/**
+ * NEON kernels, 8 samples per s16 iteration and 4 per f32 iteration.
+ *
+ * On ARMv7 this file is the only one compiled with -mfpu=neon, and its table
+ * is only selected when the kernel reports NEON in the hardware capabilities.
+ */
+
+static void mix_s16(int16_t* dst, const int16_t* src, size_t count) {
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        vst1q_s16(dst + i, vqaddq_s16(vld1q_s16(dst + i), vld1q_s16(src + i)));
+    }
+
+    kernels_scalar.mix_s16(dst + i, src + i, count - i);
+}
+
+static void mix_scaled_s16(int16_t* dst, const int16_t* src, int16_t gainQ15, size_t count) {
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        // Saturating rounding doubling multiply high is a rounded Q15 multiply
+        const int16x8_t scaled = vqrdmulhq_n_s16(vld1q_s16(src + i), gainQ15);
+        vst1q_s16(dst + i, vqaddq_s16(vld1q_s16(dst + i), scaled));
+    }
+
+    kernels_scalar.mix_scaled_s16(dst + i, src + i, gainQ15, count - i);
+}
+
+static void gain_s16(int16_t* samples, int16_t gainQ12, size_t count) {
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        const int16x8_t x = vld1q_s16(samples + i);
+        const int32x4_t lo = vmull_n_s16(vget_low_s16(x), gainQ12);
+        const int32x4_t hi = vmull_n_s16(vget_high_s16(x), gainQ12);
+
+        vst1q_s16(samples + i, vcombine_s16(vqrshrn_n_s32(lo, 12), vqrshrn_n_s32(hi, 12)));
+    }
+
+    kernels_scalar.gain_s16(samples + i, gainQ12, count - i);
+}
+
+static void accumulate_s16(int32_t* acc, const int16_t* src, size_t count) {
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        const int16x8_t x = vld1q_s16(src + i);
+        vst1q_s32(acc + i, vaddw_s16(vld1q_s32(acc + i), vget_low_s16(x)));
+        vst1q_s32(acc + i + 4, vaddw_s16(vld1q_s32(acc + i + 4), vget_high_s16(x)));
+    }
+
+    kernels_scalar.accumulate_s16(acc + i, src + i, count - i);
+}
+
+static void saturate_s32(int16_t* dst, const int32_t* src, size_t count) {
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        vst1q_s16(dst + i, vcombine_s16(vqmovn_s32(vld1q_s32(src + i)), vqmovn_s32(vld1q_s32(src + i + 4))));
+    }
+
+    kernels_scalar.saturate_s32(dst + i, src + i, count - i);
+}
+
+static void mix_minus_s16(int16_t* dst, const int32_t* sum, const int16_t* own, int16_t gainQ15, size_t count) {
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        const int16x8_t x = vld1q_s16(own + i);
+        const int32x4_t lo = vsubw_s16(vld1q_s32(sum + i), vget_low_s16(x));
+        const int32x4_t hi = vsubw_s16(vld1q_s32(sum + i + 4), vget_high_s16(x));
+
+        // The rounding shift adds half before shifting, as the scalar kernel does
+        const int32x4_t scaledLo = vrshrq_n_s32(vmulq_n_s32(lo, gainQ15), 15);
+        const int32x4_t scaledHi = vrshrq_n_s32(vmulq_n_s32(hi, gainQ15), 15);
+        vst1q_s16(dst + i, vcombine_s16(vqmovn_s32(scaledLo), vqmovn_s32(scaledHi)));
+    }
+
+    kernels_scalar.mix_minus_s16(dst + i, sum + i, own + i, gainQ15, count - i);
+}
+
+static uint32_t peak_minus_s32(const int32_t* sum, const int16_t* own, size_t count) {
+    uint32x4_t peak = vdupq_n_u32(0);
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        const int16x8_t x = vld1q_s16(own + i);
+        const int32x4_t lo = vsubw_s16(vld1q_s32(sum + i), vget_low_s16(x));
+        const int32x4_t hi = vsubw_s16(vld1q_s32(sum + i + 4), vget_high_s16(x));
+
+        peak = vmaxq_u32(peak, vreinterpretq_u32_s32(vabsq_s32(lo)));
+        peak = vmaxq_u32(peak, vreinterpretq_u32_s32(vabsq_s32(hi)));
+    }
+
+    uint32x2_t pairs = vpmax_u32(vget_low_u32(peak), vget_high_u32(peak));
+    pairs = vpmax_u32(pairs, pairs);
+
+    const uint32_t tail = kernels_scalar.peak_minus_s32(sum + i, own + i, count - i);
+    const uint32_t result = vget_lane_u32(pairs, 0);
+
+    return result > tail ? result : tail;
+}
+
+static void s16_to_f32(float* dst, const int16_t* src, size_t count) {
+    const float scale = 1.0f / 32768.0f;
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        const int16x8_t x = vld1q_s16(src + i);
+        vst1q_f32(dst + i, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(x))), scale));
+        vst1q_f32(dst + i + 4, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(x))), scale));
+    }
+
+    kernels_scalar.s16_to_f32(dst + i, src + i, count - i);
+}
+
+/**
+ * Round to the nearest integer. ARMv7 NEON only truncates, so add a half away
+ * from zero first.
+ */
+static inline int32x4_t round_f32(float32x4_t x) {
+#if defined(__aarch64__)
+    return vcvtnq_s32_f32(x);
+#else
+    const float32x4_t half = vbslq_f32(vcltq_f32(x, vdupq_n_f32(0)), vdupq_n_f32(-0.5f), vdupq_n_f32(0.5f));
+    return vcvtq_s32_f32(vaddq_f32(x, half));
+#endif
+}
+
+static void f32_to_s16(int16_t* dst, const float* src, size_t count) {
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        // Float to int conversion saturates on ARM, then narrowing saturates again
+        const int32x4_t lo = round_f32(vmulq_n_f32(vld1q_f32(src + i), 32768.0f));
+        const int32x4_t hi = round_f32(vmulq_n_f32(vld1q_f32(src + i + 4), 32768.0f));
+
+        vst1q_s16(dst + i, vcombine_s16(vqmovn_s32(lo), vqmovn_s32(hi)));
+    }
+
+    kernels_scalar.f32_to_s16(dst + i, src + i, count - i);
+}
+
+static void gain_f32(float* samples, float gain, size_t count) {
+    size_t i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        vst1q_f32(samples + i, vmulq_n_f32(vld1q_f32(samples + i), gain));
+    }
+
+    kernels_scalar.gain_f32(samples + i, gain, count - i);
+}
+
+/**
+ * Cascade using the 4 sample block form of each section.
+ */
+static void biquad_cascade_f32(const kernel_biquad_t* sections, float (*state)[2], int sectionCount, float* samples, size_t count) {
+    for (int s = 0; s < sectionCount; s++) {
+        const kernel_biquad_t* c = &sections[s];
+        const float32x4_t ys1 = vld1q_f32(c->ys1);
+        const float32x4_t ys2 = vld1q_f32(c->ys2);
+        const float32x4_t yx0 = vld1q_f32(c->yx[0]);
+        const float32x4_t yx1 = vld1q_f32(c->yx[1]);
+        const float32x4_t yx2 = vld1q_f32(c->yx[2]);
+        const float32x4_t yx3 = vld1q_f32(c->yx[3]);
+
+        float s1 = state[s][0];
+        float s2 = state[s][1];
+        size_t i = 0;
+
+        for (; i + 4 <= count; i += 4) {
+            const float32x4_t x = vld1q_f32(samples + i);
+            const float32x2_t xLow = vget_low_f32(x);
+            const float32x2_t xHigh = vget_high_f32(x);
+
+            float32x4_t y = vmulq_n_f32(ys1, s1);
+            y = vmlaq_n_f32(y, ys2, s2);
+            y = vmlaq_lane_f32(y, yx0, xLow, 0);
+            y = vmlaq_lane_f32(y, yx1, xLow, 1);
+            y = vmlaq_lane_f32(y, yx2, xHigh, 0);
+            y = vmlaq_lane_f32(y, yx3, xHigh, 1);
+
+            vst1q_f32(samples + i, y);
+
+            // The state after the block only depends on its last two samples
+            const float x2 = vgetq_lane_f32(x, 2), x3 = vgetq_lane_f32(x, 3);
+            const float y2 = vgetq_lane_f32(y, 2), y3 = vgetq_lane_f32(y, 3);
+            s1 = c->b1 * x3 - c->a1 * y3 + c->b2 * x2 - c->a2 * y2;
+            s2 = c->b2 * x3 - c->a2 * y3;
+        }
+
+        state[s][0] = s1;
+        state[s][1] = s2;
+        kernels_scalar_biquad_section(c, state[s], samples + i, count - i);
+    }
+}
+
+static uint64_t energy_s16(const int16_t* src, size_t count) {
+    int64x2_t acc = vdupq_n_s64(0);
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        const int16x8_t x = vld1q_s16(src + i);
+        acc = vpadalq_s32(acc, vmull_s16(vget_low_s16(x), vget_low_s16(x)));
+        acc = vpadalq_s32(acc, vmull_s16(vget_high_s16(x), vget_high_s16(x)));
+    }
+
+    return (uint64_t)(vgetq_lane_s64(acc, 0) + vgetq_lane_s64(acc, 1)) + kernels_scalar.energy_s16(src + i, count - i);
+}
+
+static int32_t dot_s16(const int16_t* a, const int16_t* b, size_t count) {
+    int32x4_t acc = vdupq_n_s32(0);
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        const int16x8_t x = vld1q_s16(a + i);
+        const int16x8_t y = vld1q_s16(b + i);
+        acc = vmlal_s16(acc, vget_low_s16(x), vget_low_s16(y));
+        acc = vmlal_s16(acc, vget_high_s16(x), vget_high_s16(y));
+    }
+
+    const int32x2_t pair = vadd_s32(vget_low_s32(acc), vget_high_s32(acc));
+
+    return vget_lane_s32(vpadd_s32(pair, pair), 0) + kernels_scalar.dot_s16(a + i, b + i, count - i);
+}
+
+const audio_kernels_t kernels_neon = {
+    .name = "neon",
+    .fixed_point = false,
+    .mix_s16 = &mix_s16,
+    .mix_scaled_s16 = &mix_scaled_s16,
+    .gain_s16 = &gain_s16,
+    .accumulate_s16 = &accumulate_s16,
+    .saturate_s32 = &saturate_s32,
+    .mix_minus_s16 = &mix_minus_s16,
+    .peak_minus_s32 = &peak_minus_s32,
+    .s16_to_f32 = &s16_to_f32,
+    .f32_to_s16 = &f32_to_s16,
+    .gain_f32 = &gain_f32,
+    .biquad_cascade_f32 = &biquad_cascade_f32,
+    .biquad_cascade_s16 = &kernels_scalar_biquad_cascade_s16,
+    .energy_s16 = &energy_s16,
+    .dot_s16 = &dot_s16,
+};
+
+#endif
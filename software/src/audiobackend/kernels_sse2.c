@@ -0,0 +1,303 @@
+#include <stdint.h>
+#include "audiobackend/kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <emmintrin.h>
+
+/**
+ * SSE2 kernels, 8 samples per s16 iteration and 4 per f32 iteration.
+ *
+ * SSE2 is part of the x86-64 baseline, so this table is always available on
+ * the server.
+ */
+
+static void mix_s16(int16_t* dst, const int16_t* src, size_t count) {
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        const __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+        const __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_adds_epi16(d, s));
+    }
+
+    kernels_scalar.mix_s16(dst + i, src + i, count - i);
+}
+
+/**
+ * Multiply s16 lanes by a 16 bit gain into two vectors of 32 bit products.
+ */
+static inline void mul_widen(__m128i x, __m128i gain, __m128i* lo, __m128i* hi) {
+    const __m128i productLo = _mm_mullo_epi16(x, gain);
+    const __m128i productHi = _mm_mulhi_epi16(x, gain);
+    *lo = _mm_unpacklo_epi16(productLo, productHi);
+    *hi = _mm_unpackhi_epi16(productLo, productHi);
+}
+
+static void mix_scaled_s16(int16_t* dst, const int16_t* src, int16_t gainQ15, size_t count) {
+    const __m128i gain = _mm_set1_epi16(gainQ15);
+    const __m128i round = _mm_set1_epi32(1 << 14);
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        __m128i lo, hi;
+        mul_widen(_mm_loadu_si128((const __m128i*)(src + i)), gain, &lo, &hi);
+
+        lo = _mm_srai_epi32(_mm_add_epi32(lo, round), 15);
+        hi = _mm_srai_epi32(_mm_add_epi32(hi, round), 15);
+
+        const __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_adds_epi16(d, _mm_packs_epi32(lo, hi)));
+    }
+
+    kernels_scalar.mix_scaled_s16(dst + i, src + i, gainQ15, count - i);
+}
+
+static void gain_s16(int16_t* samples, int16_t gainQ12, size_t count) {
+    const __m128i gain = _mm_set1_epi16(gainQ12);
+    const __m128i round = _mm_set1_epi32(1 << 11);
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        __m128i lo, hi;
+        mul_widen(_mm_loadu_si128((const __m128i*)(samples + i)), gain, &lo, &hi);
+
+        lo = _mm_srai_epi32(_mm_add_epi32(lo, round), 12);
+        hi = _mm_srai_epi32(_mm_add_epi32(hi, round), 12);
+
+        _mm_storeu_si128((__m128i*)(samples + i), _mm_packs_epi32(lo, hi));
+    }
+
+    kernels_scalar.gain_s16(samples + i, gainQ12, count - i);
+}
+
+static void accumulate_s16(int32_t* acc, const int16_t* src, size_t count) {
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        const __m128i x = _mm_loadu_si128((const __m128i*)(src + i));
+
+        // Sign extend by placing each sample in the top half and shifting down
+        const __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+        const __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+
+        __m128i* out = (__m128i*)(acc + i);
+        _mm_storeu_si128(out, _mm_add_epi32(_mm_loadu_si128(out), lo));
+        _mm_storeu_si128(out + 1, _mm_add_epi32(_mm_loadu_si128(out + 1), hi));
+    }
+
+    kernels_scalar.accumulate_s16(acc + i, src + i, count - i);
+}
+
+static void saturate_s32(int16_t* dst, const int32_t* src, size_t count) {
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        const __m128i lo = _mm_loadu_si128((const __m128i*)(src + i));
+        const __m128i hi = _mm_loadu_si128((const __m128i*)(src + i + 4));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_packs_epi32(lo, hi));
+    }
+
+    kernels_scalar.saturate_s32(dst + i, src + i, count - i);
+}
+
+/**
+ * The low 32 bits of each product, which SSE2 has no single instruction for.
+ * They are the same whether the inputs are signed or not.
+ */
+static inline __m128i mullo_epi32(__m128i a, __m128i b) {
+    const __m128i even = _mm_mul_epu32(a, b);
+    const __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+static void mix_minus_s16(int16_t* dst, const int32_t* sum, const int16_t* own, int16_t gainQ15, size_t count) {
+    const __m128i gain = _mm_set1_epi32(gainQ15);
+    const __m128i round = _mm_set1_epi32(1 << 14);
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        const __m128i x = _mm_loadu_si128((const __m128i*)(own + i));
+        const __m128i lo = _mm_sub_epi32(_mm_loadu_si128((const __m128i*)(sum + i)), _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16));
+        const __m128i hi = _mm_sub_epi32(_mm_loadu_si128((const __m128i*)(sum + i + 4)), _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16));
+
+        const __m128i scaledLo = _mm_srai_epi32(_mm_add_epi32(mullo_epi32(lo, gain), round), 15);
+        const __m128i scaledHi = _mm_srai_epi32(_mm_add_epi32(mullo_epi32(hi, gain), round), 15);
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_packs_epi32(scaledLo, scaledHi));
+    }
+
+    kernels_scalar.mix_minus_s16(dst + i, sum + i, own + i, gainQ15, count - i);
+}
+
+static uint32_t peak_minus_s32(const int32_t* sum, const int16_t* own, size_t count) {
+    // Magnitudes are compared unsigned, by flipping the sign bit first
+    const __m128i bias = _mm_set1_epi32((int32_t)0x80000000u);
+    __m128i peak = bias;
+    size_t i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        const __m128i x = _mm_loadl_epi64((const __m128i*)(own + i));
+        const __m128i value = _mm_sub_epi32(_mm_loadu_si128((const __m128i*)(sum + i)), _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16));
+        const __m128i sign = _mm_srai_epi32(value, 31);
+        const __m128i magnitude = _mm_xor_si128(_mm_sub_epi32(_mm_xor_si128(value, sign), sign), bias);
+
+        const __m128i greater = _mm_cmpgt_epi32(magnitude, peak);
+        peak = _mm_or_si128(_mm_and_si128(greater, magnitude), _mm_andnot_si128(greater, peak));
+    }
+
+    uint32_t lanes[4];
+    _mm_storeu_si128((__m128i*)lanes, _mm_xor_si128(peak, bias));
+
+    uint32_t result = kernels_scalar.peak_minus_s32(sum + i, own + i, count - i);
+
+    for (int lane = 0; lane < 4; lane++) {
+        result = lanes[lane] > result ? lanes[lane] : result;
+    }
+
+    return result;
+}
+
+static void s16_to_f32(float* dst, const int16_t* src, size_t count) {
+    const __m128 scale = _mm_set1_ps(1.0f / 32768.0f);
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        const __m128i x = _mm_loadu_si128((const __m128i*)(src + i));
+        const __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+        const __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+        _mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+    }
+
+    kernels_scalar.s16_to_f32(dst + i, src + i, count - i);
+}
+
+static void f32_to_s16(int16_t* dst, const float* src, size_t count) {
+    const __m128 scale = _mm_set1_ps(32768.0f);
+    const __m128 max = _mm_set1_ps(32767.0f);
+    const __m128 min = _mm_set1_ps(-32768.0f);
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        // Clamp before converting, out of range conversions give INT32_MIN
+        const __m128 lo = _mm_max_ps(_mm_min_ps(_mm_mul_ps(_mm_loadu_ps(src + i), scale), max), min);
+        const __m128 hi = _mm_max_ps(_mm_min_ps(_mm_mul_ps(_mm_loadu_ps(src + i + 4), scale), max), min);
+
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_packs_epi32(_mm_cvtps_epi32(lo), _mm_cvtps_epi32(hi)));
+    }
+
+    kernels_scalar.f32_to_s16(dst + i, src + i, count - i);
+}
+
+static void gain_f32(float* samples, float gain, size_t count) {
+    const __m128 g = _mm_set1_ps(gain);
+    size_t i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        _mm_storeu_ps(samples + i, _mm_mul_ps(_mm_loadu_ps(samples + i), g));
+    }
+
+    kernels_scalar.gain_f32(samples + i, gain, count - i);
+}
+
+#define broadcast(v, lane) _mm_shuffle_ps(v, v, _MM_SHUFFLE(lane, lane, lane, lane))
+#define lane(v, n) _mm_cvtss_f32(broadcast(v, n))
+
+/**
+ * Cascade using the 4 sample block form of each section.
+ */
+static void biquad_cascade_f32(const kernel_biquad_t* sections, float (*state)[2], int sectionCount, float* samples, size_t count) {
+    for (int s = 0; s < sectionCount; s++) {
+        const kernel_biquad_t* c = &sections[s];
+        const __m128 ys1 = _mm_loadu_ps(c->ys1);
+        const __m128 ys2 = _mm_loadu_ps(c->ys2);
+        const __m128 yx0 = _mm_loadu_ps(c->yx[0]);
+        const __m128 yx1 = _mm_loadu_ps(c->yx[1]);
+        const __m128 yx2 = _mm_loadu_ps(c->yx[2]);
+        const __m128 yx3 = _mm_loadu_ps(c->yx[3]);
+
+        float s1 = state[s][0];
+        float s2 = state[s][1];
+        size_t i = 0;
+
+        for (; i + 4 <= count; i += 4) {
+            const __m128 x = _mm_loadu_ps(samples + i);
+
+            __m128 y = _mm_add_ps(_mm_mul_ps(ys1, _mm_set1_ps(s1)), _mm_mul_ps(ys2, _mm_set1_ps(s2)));
+            y = _mm_add_ps(y, _mm_mul_ps(yx0, broadcast(x, 0)));
+            y = _mm_add_ps(y, _mm_mul_ps(yx1, broadcast(x, 1)));
+            y = _mm_add_ps(y, _mm_mul_ps(yx2, broadcast(x, 2)));
+            y = _mm_add_ps(y, _mm_mul_ps(yx3, broadcast(x, 3)));
+
+            _mm_storeu_ps(samples + i, y);
+
+            // The state after the block only depends on its last two samples
+            const float x2 = lane(x, 2), x3 = lane(x, 3);
+            const float y2 = lane(y, 2), y3 = lane(y, 3);
+            s1 = c->b1 * x3 - c->a1 * y3 + c->b2 * x2 - c->a2 * y2;
+            s2 = c->b2 * x3 - c->a2 * y3;
+        }
+
+        state[s][0] = s1;
+        state[s][1] = s2;
+        kernels_scalar_biquad_section(c, state[s], samples + i, count - i);
+    }
+}
+
+static uint64_t energy_s16(const int16_t* src, size_t count) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = _mm_setzero_si128();
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        const __m128i x = _mm_loadu_si128((const __m128i*)(src + i));
+
+        // Each pair sum is at most 2^31 so fits when treated as unsigned
+        const __m128i pairs = _mm_madd_epi16(x, x);
+        acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(pairs, zero));
+        acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(pairs, zero));
+    }
+
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i*)lanes, acc);
+
+    return lanes[0] + lanes[1] + kernels_scalar.energy_s16(src + i, count - i);
+}
+
+static int32_t dot_s16(const int16_t* a, const int16_t* b, size_t count) {
+    __m128i acc = _mm_setzero_si128();
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        const __m128i x = _mm_loadu_si128((const __m128i*)(a + i));
+        const __m128i y = _mm_loadu_si128((const __m128i*)(b + i));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(x, y));
+    }
+
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+
+    return _mm_cvtsi128_si32(acc) + kernels_scalar.dot_s16(a + i, b + i, count - i);
+}
+
+const audio_kernels_t kernels_sse2 = {
+    .name = "sse2",
+    .fixed_point = false,
+    .mix_s16 = &mix_s16,
+    .mix_scaled_s16 = &mix_scaled_s16,
+    .gain_s16 = &gain_s16,
+    .accumulate_s16 = &accumulate_s16,
+    .saturate_s32 = &saturate_s32,
+    .mix_minus_s16 = &mix_minus_s16,
+    .peak_minus_s32 = &peak_minus_s32,
+    .s16_to_f32 = &s16_to_f32,
+    .f32_to_s16 = &f32_to_s16,
+    .gain_f32 = &gain_f32,
+    .biquad_cascade_f32 = &biquad_cascade_f32,
+    .biquad_cascade_s16 = &kernels_scalar_biquad_cascade_s16,
+    .energy_s16 = &energy_s16,
+    .dot_s16 = &dot_s16,
+};
+
+#endif
@@ -0,0 +1,303 @@
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "common.h"
+#include "audiobackend/audio_backend.h"
+#include "audiobackend/codec.h"
+#include "audiobackend/media_control.h"
+#include "crypto/media_crypto.h"
+
+// IPv4 and UDP headers, counted in the bitrate a relay sees
+#define IP_UDP_OVERHEAD 28
+
+// More than 2 % of packets lost in a report interval
+#define LOSS_THRESHOLD 5
+
+// Round trip rise, over the lowest seen, that marks a queue building up
+#define RTT_RISE_FACTOR 1.5
+#define RTT_RISE_MS 20
+
+#define CLEAN_REPORTS_TO_RECOVER 5
+#define RELAY_CAP_MS 10000
+
+#define NS_PER_MS 1000000
+
+static const media_level_t levels[] = {
+    { MEDIA_CODEC_L16,   20 },
+    { MEDIA_CODEC_PCMU,  20 },
+    { MEDIA_CODEC_ADPCM, 20 },
+    { MEDIA_CODEC_ADPCM, 40 },
+    { MEDIA_CODEC_ADPCM, 60 },
+};
+
+#define LEVEL_COUNT ((int)(sizeof(levels) / sizeof(*levels)))
+
+static size_t level_block_size(const media_control_t* control, int level);
+static bool   level_allowed(const media_control_t* control, int level, int fec, uint64_t nowNs);
+static void   step_down(media_control_t* control, uint64_t nowNs);
+static void   add_fec(media_control_t* control, uint64_t nowNs);
+static void   enforce_relay_cap(media_control_t* control, uint64_t nowNs);
+static bool   level_changed(const media_control_t* control, int level, int fec);
+
+void init_media_control(media_control_t* control, unsigned int wireRate, bool adaptive, uint64_t nowNs) {
+    memset(control, 0, sizeof(*control));
+    control->adaptive = adaptive;
+    control->wireRate = wireRate;
+    control->nextReportNs = nowNs + (uint64_t)MEDIA_REPORT_INTERVAL_MS * NS_PER_MS;
+
+    // The best level that fits in a packet at this wire rate
+    while (control->level < LEVEL_COUNT - 1 && !level_allowed(control, control->level, 0, nowNs)) {
+        control->level++;
+    }
+}
+
+const media_level_t* media_control_level(const media_control_t* control) {
+    return &levels[control->level];
+}
+
+/**
+ * Bits a second on the wire when sending at `level` with `fec` previous
+ * blocks in every packet.
+ */
+uint32_t media_control_bitrate(const media_control_t* control, int level, int fec) {
+    const size_t block = level_block_size(control, level);
+    const size_t packet = IP_UDP_OVERHEAD + MEDIA_OVERHEAD + block + (size_t)fec * (block + sizeof(uint16_t));
+
+    return (uint32_t)(packet * 8 * 1000 / levels[level].ptimeMs);
+}
+
+/**
+ * Count a packet from the peer that has opened, and fold audio into the
+ * interarrival jitter as RFC 3550 does.
+ */
+void media_control_received(media_control_t* control, const struct media_header* header, uint64_t nowNs) {
+    const uint32_t sequence = ntohl(header->sequence);
+
+    if (!control->receiving) {
+        control->receiving = true;
+        control->baseSequence = sequence;
+        control->highestSequence = sequence;
+    } else if ((int32_t)(sequence - control->highestSequence) > 0) {
+        control->highestSequence = sequence;
+    }
+
+    control->received++;
+
+    if (header->type != MEDIA_TYPE_AUDIO) {
+        return;
+    }
+
+    // Arrival and send times on the wire clock, their difference only
+    // matters from one packet to the next
+    const uint32_t arrival = (uint32_t)(nowNs / 1000 * control->wireRate / 1000000);
+    const uint32_t transit = arrival - ntohl(header->timestamp);
+
+    if (control->hasTransit) {
+        int32_t delta = (int32_t)(transit - control->transit);
+        if (delta < 0) {
+            delta = -delta;
+        }
+        control->jitter += (delta - control->jitter) / 16;
+    }
+
+    control->transit = transit;
+    control->hasTransit = true;
+}
+
+bool media_control_report_due(const media_control_t* control, uint64_t nowNs) {
+    return nowNs >= control->nextReportNs;
+}
+
+/**
+ * Fill in a report on what has been received since the last one.
+ */
+void media_control_build_report(media_control_t* control, struct media_report* report, uint64_t nowNs) {
+    const uint32_t expected = control->receiving ? control->highestSequence - control->baseSequence + 1 : 0;
+    const int64_t lost = (int64_t)expected - control->received;
+
+    const uint32_t expectedInterval = expected - control->expectedPrior;
+    const uint32_t receivedInterval = control->received - control->receivedPrior;
+    const int64_t lostInterval = (int64_t)expectedInterval - receivedInterval;
+
+    control->expectedPrior = expected;
+    control->receivedPrior = control->received;
+
+    memset(report, 0, sizeof(*report));
+    report->fraction_lost = expectedInterval == 0 || lostInterval <= 0 ? 0 : (uint8_t)((lostInterval << 8) / expectedInterval);
+    report->packets = htons(receivedInterval > UINT16_MAX ? UINT16_MAX : (uint16_t)receivedInterval);
+    report->cumulative_lost = htonl(lost > 0 ? (uint32_t)lost : 0);
+    report->highest_sequence = htonl(control->highestSequence);
+    report->jitter_us = htonl((uint32_t)(control->jitter * 1000000 / control->wireRate));
+    report->timestamp_ms = htonl((uint32_t)(nowNs / NS_PER_MS));
+
+    if (control->peerReportNs != 0) {
+        report->echo_timestamp_ms = htonl(control->peerTimestampMs);
+        report->echo_delay_ms = htonl((uint32_t)((nowNs - control->peerReportNs) / NS_PER_MS));
+    }
+
+    control->nextReportNs = nowNs + (uint64_t)MEDIA_REPORT_INTERVAL_MS * NS_PER_MS;
+}
+
+/**
+ * Take the round trip from a report of the peer's and adapt to it.
+ *
+ * Returns true if the level or FEC depth changed.
+ */
+bool media_control_peer_report(media_control_t* control, const struct media_report* report, uint64_t nowNs) {
+    control->peerTimestampMs = ntohl(report->timestamp_ms);
+    control->peerReportNs = nowNs;
+
+    const uint32_t echo = ntohl(report->echo_timestamp_ms);
+    bool rising = false;
+
+    if (echo != 0) {
+        const uint32_t rtt = (uint32_t)(nowNs / NS_PER_MS) - echo - ntohl(report->echo_delay_ms);
+
+        // A report held longer than it took to come back is garbage
+        if ((int32_t)rtt >= 0) {
+            control->rttMs = rtt;
+
+            if (control->baseRttMs == 0 || rtt < control->baseRttMs) {
+                control->baseRttMs = rtt == 0 ? 1 : rtt;
+            }
+
+            rising = rtt > control->baseRttMs * RTT_RISE_FACTOR + RTT_RISE_MS;
+        }
+    }
+
+    // Nothing arrived to judge the path by
+    if (!control->adaptive || report->packets == 0) {
+        return false;
+    }
+
+    const int level = control->level;
+    const int fec = control->fec;
+
+    if (report->fraction_lost > LOSS_THRESHOLD) {
+        control->cleanReports = 0;
+
+        if (rising) {
+            step_down(control, nowNs);
+        } else if (control->fec < MEDIA_MAX_FEC) {
+            add_fec(control, nowNs);
+        }
+    } else if (++control->cleanReports >= CLEAN_REPORTS_TO_RECOVER) {
+        control->cleanReports = 0;
+
+        if (control->fec > 0) {
+            control->fec--;
+        } else if (control->level > 0 && level_allowed(control, control->level - 1, 0, nowNs)) {
+            control->level--;
+        }
+    }
+
+    enforce_relay_cap(control, nowNs);
+    return level_changed(control, level, fec);
+}
+
+/**
+ * Cap the bitrate at what an overloaded relay asks for, until it stops
+ * asking for RELAY_CAP_MS.
+ *
+ * Returns true if the level or FEC depth changed.
+ */
+bool media_control_relay_report(media_control_t* control, const struct relay_report* report, uint64_t nowNs) {
+    const uint32_t cap = ntohl(report->max_bitrate);
+
+    if (!control->adaptive || cap == 0) {
+        return false;
+    }
+
+    const int level = control->level;
+    const int fec = control->fec;
+
+    enforce_relay_cap(control, nowNs);
+
+    if (control->relayCap == 0 || cap < control->relayCap) {
+        control->relayCap = cap;
+    }
+
+    control->relayCapUntilNs = nowNs + (uint64_t)RELAY_CAP_MS * NS_PER_MS;
+    control->cleanReports = 0;
+
+    enforce_relay_cap(control, nowNs);
+    return level_changed(control, level, fec);
+}
+
+static size_t level_block_size(const media_control_t* control, int level) {
+    const size_t frames = (size_t)control->wireRate * levels[level].ptimeMs / 1000;
+    return codec_encoded_size(levels[level].codec, frames);
+}
+
+/**
+ * Whether a level fits in a packet, and under the relay's cap if there is one.
+ */
+static bool level_allowed(const media_control_t* control, int level, int fec, uint64_t nowNs) {
+    const size_t block = level_block_size(control, level);
+
+    if (MEDIA_OVERHEAD + block + (size_t)fec * (block + sizeof(uint16_t)) > TRANSFER_MAX_PACKET) {
+        return false;
+    }
+
+    return control->relayCap == 0 || nowNs >= control->relayCapUntilNs || media_control_bitrate(control, level, fec) <= control->relayCap;
+}
+
+/**
+ * Move to the next level down that is allowed, keeping as much FEC as fits.
+ */
+static void step_down(media_control_t* control, uint64_t nowNs) {
+    for (int level = control->level + 1; level < LEVEL_COUNT; level++) {
+        for (int fec = control->fec; fec >= 0; fec--) {
+            if (level_allowed(control, level, fec, nowNs)) {
+                control->level = level;
+                control->fec = fec;
+                return;
+            }
+        }
+    }
+}
+
+/**
+ * Repeat one more block, moving down only as far as it takes to fit it.
+ */
+static void add_fec(media_control_t* control, uint64_t nowNs) {
+    for (int level = control->level; level < LEVEL_COUNT; level++) {
+        if (level_allowed(control, level, control->fec + 1, nowNs)) {
+            control->level = level;
+            control->fec++;
+            return;
+        }
+    }
+}
+
+static void enforce_relay_cap(media_control_t* control, uint64_t nowNs) {
+    if (control->relayCap != 0 && nowNs >= control->relayCapUntilNs) {
+        control->relayCap = 0;
+    }
+
+    // Shed FEC before quality, and stop at the bottom of the ladder
+    while (!level_allowed(control, control->level, control->fec, nowNs)) {
+        if (control->fec > 0) {
+            control->fec--;
+        } else if (control->level < LEVEL_COUNT - 1) {
+            control->level++;
+        } else {
+            break;
+        }
+    }
+}
+
+static bool level_changed(const media_control_t* control, int level, int fec) {
+    if (control->level == level && control->fec == fec) {
+        return false;
+    }
+
+    info("Media now %s at %d ms with FEC %d, %u bit/s (round trip %u ms)",
+        codec_name(levels[control->level].codec),
+        levels[control->level].ptimeMs,
+        control->fec,
+        media_control_bitrate(control, control->level, control->fec),
+        control->rttMs);
+
+    return true;
+}
@@ -0,0 +1,158 @@
+#include <math.h>
+#include <string.h>
+#include "common.h"
+#include "audiobackend/kernels.h"
+#include "audiobackend/resampler.h"
+
+// Cutoff as a fraction of the lower rate's Nyquist, leaving a transition band
+#define RESAMPLER_CUTOFF 0.9
+
+// Fractional bits of the taps. Q14 rather than Q15 leaves room for the sinc's
+// negative lobes, whose absolute sum comes to over two at the lowest cutoffs
+#define RESAMPLER_Q 14
+#define RESAMPLER_UNITY (1 << RESAMPLER_Q)
+
+static uint32_t filter_length(unsigned int inRate, unsigned int outRate);
+static uint32_t gcd(uint32_t a, uint32_t b);
+
+/**
+ * Whether the rates reduce to few enough taps for a resampler.
+ */
+bool resampler_supports(unsigned int inRate, unsigned int outRate) {
+    if (inRate == 0 || outRate == 0 || inRate > outRate * RESAMPLER_MAX_RATIO) {
+        return false;
+    }
+
+    return (uint64_t)(outRate / gcd(inRate, outRate)) * filter_length(inRate, outRate) <= RESAMPLER_MAX_COEFFICIENTS;
+}
+
+/**
+ * Design the filter for `inRate` to `outRate` and start with silence behind
+ * it.
+ */
+int init_resampler(resampler_t* resampler, unsigned int inRate, unsigned int outRate) {
+    if (!resampler_supports(inRate, outRate)) {
+        warn("Cannot resample from %u Hz to %u Hz", inRate, outRate);
+        return ST_INVALID_ARG;
+    }
+
+    const uint32_t common = gcd(inRate, outRate);
+
+    resampler->inRate = inRate;
+    resampler->outRate = outRate;
+    resampler->phases = outRate / common;
+    resampler->step = inRate / common;
+    resampler->length = filter_length(inRate, outRate);
+
+    const int length = (int)resampler->length;
+
+    // In cycles per input sample times two, so 1 is the input's Nyquist
+    const double cutoff = RESAMPLER_CUTOFF * MIN(1.0, (double)outRate / inRate);
+    const double centre = length / 2.0;
+
+    for (uint32_t phase = 0; phase < resampler->phases; phase++) {
+        int16_t* phaseTaps = resampler->taps + (size_t)phase * length;
+        double taps[RESAMPLER_MAX_TAPS];
+        double sum = 0;
+
+        // Tap j is for the input (length - 1 - j) before the output's
+        // position, and the phase puts the output phase / L past that input
+        for (int j = 0; j < length; j++) {
+            const double delay = (length - 1 - j) + (double)phase / resampler->phases;
+            const double x = cutoff * (delay - centre);
+            const double sinc = x == 0 ? 1.0 : sin(M_PI * x) / (M_PI * x);
+            const double window = 0.42 - 0.5 * cos(2.0 * M_PI * delay / length) + 0.08 * cos(4.0 * M_PI * delay / length);
+
+            taps[j] = sinc * window;
+            sum += taps[j];
+        }
+
+        // Rounding leaves the sum a little off unity, which goes on the
+        // largest tap
+        int32_t total = 0;
+        int largest = 0;
+
+        for (int j = 0; j < length; j++) {
+            const long tap = lround(taps[j] * RESAMPLER_UNITY / sum);
+            phaseTaps[j] = (int16_t)MAX(MIN(tap, INT16_MAX), INT16_MIN);
+            total += phaseTaps[j];
+
+            if (taps[j] > taps[largest]) {
+                largest = j;
+            }
+        }
+
+        const int32_t adjusted = phaseTaps[largest] + RESAMPLER_UNITY - total;
+        phaseTaps[largest] = (int16_t)MAX(MIN(adjusted, INT16_MAX), INT16_MIN);
+    }
+
+    reset_resampler(resampler);
+    return ST_GOOD;
+}
+
+/**
+ * Forget the input so far, for a stream that starts again after a gap.
+ */
+void reset_resampler(resampler_t* resampler) {
+    resampler->position = 0;
+    memset(resampler->window, 0, sizeof(resampler->window));
+}
+
+/**
+ * The most output `frames` of input can give, whatever the phase.
+ */
+size_t resampler_max_output(const resampler_t* resampler, size_t frames) {
+    return (frames * resampler->phases + resampler->step - 1) / resampler->step + 1;
+}
+
+/**
+ * Resample `frames` of input into `out`, which must have room for
+ * resampler_max_output() frames. Returns the frames written.
+ */
+size_t resample(resampler_t* resampler, const int16_t* in, size_t frames, int16_t* out) {
+    size_t produced = 0;
+
+    while (frames > 0) {
+        const size_t chunk = MIN(frames, RESAMPLER_CHUNK_FRAMES);
+        const uint32_t end = (uint32_t)chunk * resampler->phases;
+
+        // The last length - 1 inputs of the chunk before stay in front
+        int16_t* history = resampler->window + RESAMPLER_MAX_TAPS - resampler->length;
+        memcpy(resampler->window + RESAMPLER_MAX_TAPS - 1, in, chunk * sizeof(*in));
+
+        for (; resampler->position < end; resampler->position += resampler->step) {
+            const uint32_t index = resampler->position / resampler->phases;
+            const uint32_t phase = resampler->position % resampler->phases;
+            const int32_t sum = kernels->dot_s16(resampler->taps + (size_t)phase * resampler->length, history + index, resampler->length);
+            const int32_t sample = (sum + (RESAMPLER_UNITY >> 1)) >> RESAMPLER_Q;
+
+            out[produced++] = (int16_t)MAX(MIN(sample, INT16_MAX), INT16_MIN);
+        }
+
+        resampler->position -= end;
+        memmove(resampler->window, resampler->window + chunk, (RESAMPLER_MAX_TAPS - 1) * sizeof(*resampler->window));
+
+        in += chunk;
+        frames -= chunk;
+    }
+
+    return produced;
+}
+
+/**
+ * Taps a phase needs to span RESAMPLER_TAPS outputs, or as many inputs when
+ * upsampling.
+ */
+static uint32_t filter_length(unsigned int inRate, unsigned int outRate) {
+    return RESAMPLER_TAPS * ((inRate + outRate - 1) / outRate);
+}
+
+static uint32_t gcd(uint32_t a, uint32_t b) {
+    while (b != 0) {
+        const uint32_t rest = a % b;
+        a = b;
+        b = rest;
+    }
+
+    return a;
+}
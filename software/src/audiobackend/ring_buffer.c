@@ -1,3 +1,4 @@
+#include <string.h>
 #include "miniaudio.h"
 #include "common.h"
 #include "audiobackend/audio.h"
@@ -96,6 +97,81 @@ int ring_buffer_commit_write(ring_buffer_t* rb, size_t size) {
     return ma_call(ma_rb_commit_write(&rb->impl, size));
 }
 
+/**
+ * Copy up to `size` bytes out of the ring buffer into `dst`, following the
+ * read pointer around the end of the buffer if needed.
+ * 
+ * On return `size` holds the number of bytes copied. Lock free, so safe to
+ * call from the audio callback.
+ */
+int ring_buffer_read(ring_buffer_t* rb, void* dst, size_t* size) {
+    size_t copied = 0;
+
+    // At most two passes, one up to the end of the buffer and one from the start
+    for (int pass = 0; pass < 2 && copied < *size; pass++) {
+        size_t len = *size - copied;
+        void* buffer;
+
+        if (ring_buffer_acquire_read(rb, &len, &buffer) != ST_GOOD) {
+            *size = copied;
+            return ST_FAIL;
+        }
+
+        if (len == 0) {
+            break;
+        }
+
+        memcpy((uint8_t*)dst + copied, buffer, len);
+
+        if (ring_buffer_commit_read(rb, len) != ST_GOOD) {
+            *size = copied;
+            return ST_FAIL;
+        }
+
+        copied += len;
+    }
+
+    *size = copied;
+    return ST_GOOD;
+}
+
+/**
+ * Copy up to `size` bytes from `src` into the ring buffer, following the write
+ * pointer around the end of the buffer if needed.
+ * 
+ * On return `size` holds the number of bytes copied. Lock free, so safe to
+ * call from the audio callback.
+ */
+int ring_buffer_write(ring_buffer_t* rb, const void* src, size_t* size) {
+    size_t copied = 0;
+
+    for (int pass = 0; pass < 2 && copied < *size; pass++) {
+        size_t len = *size - copied;
+        void* buffer;
+
+        if (ring_buffer_acquire_write(rb, &len, &buffer) != ST_GOOD) {
+            *size = copied;
+            return ST_FAIL;
+        }
+
+        if (len == 0) {
+            break;
+        }
+
+        memcpy(buffer, (const uint8_t*)src + copied, len);
+
+        if (ring_buffer_commit_write(rb, len) != ST_GOOD) {
+            *size = copied;
+            return ST_FAIL;
+        }
+
+        copied += len;
+    }
+
+    *size = copied;
+    return ST_GOOD;
+}
+
 int ring_buffer_seek_read(ring_buffer_t* rb, size_t offset) {
     return ma_call(ma_rb_seek_read(&rb->impl, offset));
 }
@@ -1,26 +1,120 @@
+#ifdef linux
+// recvmmsg() and sendmmsg()
+#define _GNU_SOURCE
+#endif
+
+#include <math.h>
 #include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <semaphore.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include "common.h"
 #include "audiobackend/audio_backend.h"
 #include "audiobackend/transfer.h"
+#include "audiobackend/audio_stats.h"
+#include "audiobackend/codec.h"
+#include "audiobackend/media_control.h"
+#include "crypto/media_crypto.h"
 
 #include "miniaudio.h"
 #include "audiobackend/audio.h"
 
+// Ringback, 425 Hz on for a second and off for four
+#define RINGBACK_FREQUENCY 425.0f
+#define RINGBACK_AMPLITUDE 5000.0f
+#define RINGBACK_ON_FRAMES (SAMPLE_RATE * 1)
+#define RINGBACK_PERIOD_FRAMES (SAMPLE_RATE * 5)
+
+// Tone kept queued ahead of the device, so it stops soon after an answer
+#define RINGBACK_LEAD_FRAMES (DSP_BLOCK_FRAMES * 8)
+
+// A direct path is probed for 3 s, then kept alive and given up once quiet
+#define PROBE_INTERVAL_MS 200
+#define PROBE_ATTEMPTS 15
+#define DIRECT_KEEPALIVE_MS 1000
+#define DIRECT_TIMEOUT_MS 3000
+
+// How long to wait before trying again for a media socket that would not bind
+#define MEDIA_SOCKET_RETRY_MS 1000
+
+#define NS_PER_MS 1000000ULL
+
+/**
+ * The child's state for one call, wiped when it ends.
+ * 
+ * The last few blocks sent are kept to repeat as FEC, newest first. They are
+ * all in one codec, the history is dropped when the codec changes.
+ * 
+ * Media goes through the relay until a probe to the peer's address is
+ * answered, and back to it if nothing arrives over the direct path for
+ * DIRECT_TIMEOUT_MS.
+ */
+typedef struct transfer_call {
+    media_crypto_t crypto;
+    media_control_t control;
+    codec_state_t encoder;
+    uint32_t timestamp;     // Wire clock of the next block sent
+    int historyCodec;
+    int historyCount;
+    size_t historyLengths[MEDIA_MAX_FEC];
+    uint8_t history[MEDIA_MAX_FEC][TRANSFER_MAX_PACKET];
+    bool playing;
+    uint32_t playTimestamp; // Wire clock of the next block expected
+    uint32_t recovered;     // Blocks played from FEC since the last report
+    uint32_t late;          // Packets too late to play since the last report
+    uint32_t ringbackFrame; // Position in the ringback cadence
+    struct sockaddr_in peerAddr; // Direct path, port 0 without
+    bool direct;            // Media goes to peerAddr rather than the relay
+    int probesLeft;
+    uint32_t probeSequence; // Of the last probe sent, as on the wire
+    uint64_t nextProbeNs;
+    uint64_t directSeenNs;  // Last authentic packet over the direct path
+} transfer_call_t;
+
 static void handle_child_signal(int sigid);
 static int  wait_for_start(struct transfer_engine* engine);
 static void transfer_engine_main(struct transfer_engine* engine);
+static void transfer_engine_call(struct transfer_engine* engine, int sockfd, const struct sockaddr* serverAddr, socklen_t serverAddrLen);
+static int  open_media_socket(struct transfer_engine* engine);
+static void close_media_socket(struct transfer_engine* engine, int sockfd);
+static void receive_audio(struct transfer_engine* engine, int sockfd, transfer_call_t* call, const struct sockaddr* serverAddr);
+static int  play_audio(struct transfer_engine* engine, transfer_call_t* call, const struct media_header* header, const uint8_t* payload, size_t length);
+static void send_audio(struct transfer_engine* engine, int sockfd, transfer_call_t* call, const struct sockaddr* serverAddr, socklen_t serverAddrLen);
+static void send_report(int sockfd, transfer_call_t* call, const struct sockaddr* serverAddr, socklen_t serverAddrLen, uint64_t nowNs);
+static void play_ringback(struct transfer_engine* engine, transfer_call_t* call);
+static void probe_direct(int sockfd, transfer_call_t* call, const struct sockaddr* serverAddr, uint64_t nowNs);
+static void receive_probe(int sockfd, transfer_call_t* call, const struct media_header* header, const uint8_t* payload, size_t length, const struct sockaddr_in* source, uint64_t nowNs);
+static void send_probe(int sockfd, transfer_call_t* call, uint8_t type, const void* payload, size_t length, const struct sockaddr_in* addr);
+static bool same_endpoint(const struct sockaddr_in* a, const struct sockaddr_in* b);
+static int  receive_packets(int sockfd, size_t* lengths);
+static int  send_packets(int sockfd, const size_t* lengths, int count, const struct sockaddr* serverAddr, socklen_t serverAddrLen);
 static void transfer_engine_debug(struct transfer_engine* engine);
 
 bool childKilled = false;
 
+// Child side buffers for samples moving through the DSP chains
+static int16_t netBuffer[TRANSFER_REQUEST_SIZE / sizeof(int16_t)];
+static int16_t dspBuffer[(TRANSFER_REQUEST_SIZE / sizeof(int16_t)) * (DSP_MAX_RATE / DSP_MIN_RATE) + DSP_MAX_BLOCK_FRAMES];
+
+// Sealed packets, a batch at a time, and where received ones came from
+static uint8_t packets[TRANSFER_BATCH][TRANSFER_MAX_PACKET] __attribute__((aligned(8)));
+static struct sockaddr_in sources[TRANSFER_BATCH];
+
+// An audio payload being put together, FEC blocks and all
+static uint8_t payloadBuffer[TRANSFER_MAX_PACKET];
+
+// Probes are sent while a batch is being read, so they have their own buffer
+static uint8_t probeBuffer[MEDIA_OVERHEAD + sizeof(uint32_t)];
+
+static transfer_call_t call;
+
 void init_transfer_engine(struct transfer_engine* engine, ring_buffer_t* playback, ring_buffer_t* capture, intercom_conf_t* config) {
     if (capture == NULL || playback == NULL) {
         error("Ring buffers point to NULL in transfer engine");
@@ -29,6 +123,12 @@ void init_transfer_engine(struct transfer_engine* engine, ring_buffer_t* playbac
     engine->capture = capture;
     engine->playback = playback;
     engine->started = false;
+    atomic_init(&engine->early, false);
+    atomic_init(&engine->mediaPort, 0);
+    engine->warm = config->warm_audio;
+    engine->adaptive = config->adaptive_media;
+    engine->direct = config->direct_media;
+    engine->wireRate = config->wire_sample_rate;
 
     int err;
 
@@ -91,6 +191,16 @@ void init_transfer_engine(struct transfer_engine* engine, ring_buffer_t* playbac
         engine->procID = pid;
         return;
     } else {
+        // Compile the DSP chains, capture goes from the device rate to the
+        // wire rate and playback back again
+        if (init_dsp_graph(&engine->captureDsp, &config->capture_dsp, SAMPLE_RATE, config->wire_sample_rate) != ST_GOOD) {
+            error("Failed to initialise capture DSP chain");
+        }
+
+        if (init_dsp_graph(&engine->playbackDsp, &config->playback_dsp, config->wire_sample_rate, SAMPLE_RATE) != ST_GOOD) {
+            error("Failed to initialise playback DSP chain");
+        }
+
         // Start child thread running main engine
         transfer_engine_main(engine);
         (void)transfer_engine_debug;
@@ -128,6 +238,7 @@ int transfer_engine_start(struct transfer_engine* engine, audio_backend_start_in
         return ST_FAIL;
     }
 
+    atomic_store_explicit(&engine->early, info->early, memory_order_release);
     engine->started = true;
     info("Transfer engine started");
 
@@ -164,128 +275,655 @@ int transfer_engine_stop(struct transfer_engine* engine) {
     return ST_GOOD;
 }
 
-static void transfer_engine_main(struct transfer_engine* engine) {
-    // int res;
+/**
+ * Start sending audio on a call that was started early.
+ */
+void transfer_engine_answer(struct transfer_engine* engine) {
+    atomic_store_explicit(&engine->early, false, memory_order_release);
+}
 
+/**
+ * The port of the socket the next call is sent from, 0 if it is not bound
+ * yet.
+ */
+uint16_t transfer_engine_media_port(struct transfer_engine* engine) {
+    return (uint16_t)atomic_load_explicit(&engine->mediaPort, memory_order_acquire);
+}
+
+static void transfer_engine_main(struct transfer_engine* engine) {
     struct sockaddr_in serverAddr;
     socklen_t serverAddrLen;
 
+    // Bound up front so its port can be signalled before the call starts
+    int sockfd = open_media_socket(engine);
+
     while (true) {
         if (!engine->started) {
             wait_for_start(engine);
         }
 
+        // Nothing can be sent without a socket, so back off rather than spin
+        // until the engine is stopped
+        if (sockfd < 0 && (sockfd = open_media_socket(engine)) < 0) {
+            poll(NULL, 0, MEDIA_SOCKET_RETRY_MS);
+            continue;
+        }
+
         memcpy(&serverAddr, &engine->info.serverAddr, engine->info.serverAddrLen);
         serverAddrLen = engine->info.serverAddrLen;
 
-        // Socket information in engine->info now valid
-        // Initialise sockets
-        int sockfd = socket(
-            AF_INET, 
-#ifdef linux
-            SOCK_DGRAM | SOCK_NONBLOCK, 
-#else
-            SOCK_DGRAM,
-#endif
-            0);
+        transfer_engine_call(engine, sockfd, (const struct sockaddr*)&serverAddr, serverAddrLen);
 
-        // Check for valid socket id
-        if (sockfd < 0) {
-            stl_warn(errno, "Failed to initialise socket with code : %d", sockfd);
-            continue;
+        // A fresh port for every call, ready for the next one to signal
+        if (!engine->warm) {
+            close_media_socket(engine, sockfd);
+            sockfd = open_media_socket(engine);
         }
+    }
+}
 
-        // Have to set non blocking manually on macos
-#ifndef linux
-        // Read existing socket flags
-        int flags;
-        if ((flags = fcntl(sockfd, F_GETFL, 0)) < 0) {
-            stl_warn(errno, "Transfer engine couldn't read flags from socket!");
-            goto transfer_engine_cleanup;
+/**
+ * Move audio between the ring buffers and the network until the engine is
+ * stopped.
+ * 
+ * Captured audio goes out as soon as a whole packet is buffered, so the first
+ * packet leaves one packet time after the call starts. Between packets the
+ * child sleeps in poll() until audio arrives or the next packet is due. A
+ * report on the audio received goes back every MEDIA_REPORT_INTERVAL_MS.
+ * 
+ * The first report goes out as soon as the call starts, so the relay has
+ * this end's address before the call is answered. Until then captured audio
+ * is dropped.
+ * 
+ * The call's key only lives in the child for the length of the call.
+ */
+static void transfer_engine_call(struct transfer_engine* engine, int sockfd, const struct sockaddr* serverAddr, socklen_t serverAddrLen) {
+    // Anything queued from before this call is stale
+    while (recvfrom(sockfd, netBuffer, sizeof(netBuffer), 0, NULL, NULL) >= 0);
+
+    int32_t available = ring_buffer_pointer_distance(engine->capture);
+    if (available > 0) {
+        ring_buffer_seek_read(engine->capture, available);
+    }
+
+    memset(&call, 0, sizeof(call));
+    init_media_crypto(&call.crypto, engine->info.mediaKey, engine->info.mediaSender, engine->info.mediaToken);
+    init_media_control(&call.control, engine->wireRate, engine->adaptive, audio_stats_now_ns());
+    init_codec_state(&call.encoder);
+
+    call.peerAddr = engine->info.peerAddr;
+    call.probesLeft = engine->direct && call.peerAddr.sin_port != 0 && call.peerAddr.sin_addr.s_addr != 0 ? PROBE_ATTEMPTS : 0;
+
+    send_report(sockfd, &call, serverAddr, serverAddrLen, audio_stats_now_ns());
+
+    struct pollfd pfd = { .fd = sockfd, .events = POLLIN };
+
+    while (engine->started) {
+        // The packet time can change with every report
+        const size_t packetBytes = (size_t)SAMPLE_RATE * media_control_level(&call.control)->ptimeMs / 1000 * FRAME_SIZE;
+
+        // Sleep until the capture buffer should hold a whole packet
+        available = ring_buffer_pointer_distance(engine->capture);
+        const size_t missing = available > 0 && (size_t)available < packetBytes ? packetBytes - available : packetBytes;
+        const int timeoutMs = available > 0 && (size_t)available >= packetBytes ? 0 : (int)(missing / FRAME_SIZE * 1000 / SAMPLE_RATE) + 1;
+
+        int res = poll(&pfd, 1, timeoutMs);
+
+        if (res == -1 && errno != EINTR) {
+            stl_warn(errno, "Transfer engine poll failed");
+        }
+
+        if (res > 0 && (pfd.revents & POLLIN)) {
+            receive_audio(engine, sockfd, &call, serverAddr);
         }
 
-        // Make non blocking
-        flags |= O_NONBLOCK;
+        probe_direct(sockfd, &call, serverAddr, audio_stats_now_ns());
 
-        if (fcntl(sockfd, F_SETFL, flags) < 0) {
-            stl_warn(errno, "Transfer engine couldn't write flags to socket!");
-            goto transfer_engine_cleanup;
+        const struct sockaddr* mediaAddr = call.direct ? (const struct sockaddr*)&call.peerAddr : serverAddr;
+        const socklen_t mediaAddrLen = call.direct ? sizeof(call.peerAddr) : serverAddrLen;
+
+        if (!atomic_load_explicit(&engine->early, memory_order_acquire)) {
+            send_audio(engine, sockfd, &call, mediaAddr, mediaAddrLen);
+        } else {
+            available = ring_buffer_pointer_distance(engine->capture);
+            if (available > 0) {
+                ring_buffer_seek_read(engine->capture, available);
+            }
+
+            if (engine->info.ringback) {
+                play_ringback(engine, &call);
+            }
         }
+
+        const uint64_t nowNs = audio_stats_now_ns();
+        if (media_control_report_due(&call.control, nowNs)) {
+            send_report(sockfd, &call, mediaAddr, mediaAddrLen, nowNs);
+        }
+    }
+
+    destroy_media_crypto(&call.crypto);
+    memset(&call, 0, sizeof(call));
+}
+
+/**
+ * Create a non blocking UDP socket bound to an ephemeral port, and publish
+ * the port.
+ * 
+ * Returns the socket, or -1 on failure.
+ */
+static int open_media_socket(struct transfer_engine* engine) {
+    int sockfd = socket(
+        AF_INET, 
+#ifdef linux
+        SOCK_DGRAM | SOCK_NONBLOCK, 
+#else
+        SOCK_DGRAM,
+#endif
+        0);
+
+    // Check for valid socket id
+    if (sockfd < 0) {
+        stl_warn(errno, "Failed to initialise socket with code : %d", sockfd);
+        return -1;
+    }
+
+    // Have to set non blocking manually on macos
+#ifndef linux
+    // Read existing socket flags
+    int flags;
+    if ((flags = fcntl(sockfd, F_GETFL, 0)) < 0 || fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        stl_warn(errno, "Transfer engine couldn't make socket non blocking!");
+        close(sockfd);
+        return -1;
+    }
 #endif
 
-        // // Bind the receive socket
-        // if ((res = connect(sockfd, (struct sockaddr*)&serverAddr, serverAddrLen)) == -1) {
-        //     stl_warn(errno, "Failed to connect socket to address in transfer engine");
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = 0;
 
-        //     char addrBuf[IPV4_MAX_STRLEN];
-        //     inet_ntop(AF_INET, &serverAddr.sin_addr, addrBuf, sizeof(addrBuf));
+    if (bind(sockfd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        stl_warn(errno, "Transfer engine couldn't bind media socket");
+        close(sockfd);
+        return -1;
+    }
 
-        //     warn("Tried to connect to addr %s on port %hu", addrBuf, ntohs(serverAddr.sin_port));
+    socklen_t addrLen = sizeof(addr);
+    if (getsockname(sockfd, (struct sockaddr*)&addr, &addrLen) == -1) {
+        stl_warn(errno, "Transfer engine couldn't read its media port");
+        close(sockfd);
+        return -1;
+    }
 
-        //     goto transfer_engine_cleanup;
-        // }
+    atomic_store_explicit(&engine->mediaPort, ntohs(addr.sin_port), memory_order_release);
+    return sockfd;
+}
 
-        ssize_t written;
-        size_t len;
-        void* buffer;
-        while (engine->started) {
-            // Request size for the ring buffer
-            len = TRANSFER_REQUEST_SIZE;
-            if (ring_buffer_acquire_write(engine->playback, &len, &buffer) != ST_GOOD) {
-                warn("Transfer engine failed to obtain write pointer to capture buffer");
+static void close_media_socket(struct transfer_engine* engine, int sockfd) {
+    atomic_store_explicit(&engine->mediaPort, 0, memory_order_release);
+
+    if ((close(sockfd))) {
+        stl_warn(errno, "Failed to close socket");
+    }
+}
+
+/**
+ * Handle every datagram waiting on the socket, audio goes into the playback
+ * ring buffer and reports to the controller.
+ * 
+ * Packets that fail to open are forged, corrupted or replayed, and dropped.
+ * Relay reports cannot be authenticated, so they are only taken from the
+ * relay's own address.
+ */
+static void receive_audio(struct transfer_engine* engine, int sockfd, transfer_call_t* call, const struct sockaddr* serverAddr) {
+    const struct sockaddr_in* relayAddr = (const struct sockaddr_in*)serverAddr;
+    size_t lengths[TRANSFER_BATCH];
+    int count;
+    int dropped = 0;
+
+    while ((count = receive_packets(sockfd, lengths)) > 0) {
+        const uint64_t nowNs = audio_stats_now_ns();
+
+        for (int i = 0; i < count; i++) {
+            const struct media_header* header = (const struct media_header*)packets[i];
+            uint8_t* payload;
+            size_t payloadLength;
+
+            if (lengths[i] < sizeof(*header)) {
+                dropped++;
                 continue;
             }
 
-            // Do a non-blocking read from the socket
-            // Write the data into the ring buffer
-            written = recvfrom(sockfd, buffer, len, 0, NULL, NULL);
-            if (written == -1) {
-                if (errno != EAGAIN && errno != EWOULDBLOCK) {
-                    // Bad error 
-                    stl_warn(errno, "Transfer engine recfrom failed");
+            if (header->type == MEDIA_TYPE_RELAY_REPORT) {
+                if (header->version != MEDIA_VERSION || header->sender != MEDIA_SENDER_RELAY
+                    || lengths[i] != sizeof(*header) + sizeof(struct relay_report)
+                    || !same_endpoint(&sources[i], relayAddr)) {
+                    dropped++;
+                    continue;
                 }
-                // No data available in non blocking so just go again
-                goto transfer_engine_do_write;
-            }
 
-            // Commit the write
-            if (ring_buffer_commit_write(engine->playback, written) != ST_GOOD) {
-                warn("Transfer engine failed to commit the write");
+                media_control_relay_report(&call->control, (const struct relay_report*)(packets[i] + sizeof(*header)), nowNs);
+                continue;
             }
 
-transfer_engine_do_write:
-            // Request size for the ring buffer
-            len = TRANSFER_REQUEST_SIZE;
-
-            // Get a pointer to the ring buffer
-            if (ring_buffer_acquire_read(engine->capture, &len, &buffer) != ST_GOOD) {
-                warn("Transfer engine failed to obtain read pointer to capture buffer");
+            if (media_open(&call->crypto, packets[i], lengths[i], &payload, &payloadLength) != ST_GOOD) {
+                dropped++;
                 continue;
             }
 
-            // Send data from the ring buffer
-            written = sendto(sockfd, buffer, len, 0, (const struct sockaddr*)&serverAddr, serverAddrLen);
-            if (written == -1) {
-                if (errno != EAGAIN && errno != EWOULDBLOCK) {
-                    // Bad error 
-                    stl_warn(errno, "Transfer engine sendto failed");
+            if (call->direct && same_endpoint(&sources[i], &call->peerAddr)) {
+                call->directSeenNs = nowNs;
+            }
+
+            // Probes over the relay prove nothing about the direct path
+            if (MEDIA_TYPE_IS_PROBE(header->type)) {
+                if (engine->direct && !same_endpoint(&sources[i], relayAddr)) {
+                    receive_probe(sockfd, call, header, payload, payloadLength, &sources[i], nowNs);
                 }
                 continue;
             }
 
-            // Commit the read 
-            if (ring_buffer_commit_read(engine->capture, written) != ST_GOOD) {
-                warn("Transfer engine failed to commit the read");
+            media_control_received(&call->control, header, nowNs);
+
+            if (header->type == MEDIA_TYPE_REPORT && payloadLength == sizeof(struct media_report)) {
+                media_control_peer_report(&call->control, (const struct media_report*)payload, nowNs);
+            } else if (header->type != MEDIA_TYPE_AUDIO || play_audio(engine, call, header, payload, payloadLength) != ST_GOOD) {
+                dropped++;
+            } else if (!engine->info.listen && atomic_load_explicit(&engine->early, memory_order_acquire)) {
+                // The peer only sends audio once it has picked up, and it is
+                // authentic, so do not wait for the server to say so
+                info("Audio arrived, the call has been answered");
+                transfer_engine_answer(engine);
             }
         }
-transfer_engine_cleanup:
-        // Close the socket
-        if ((close(sockfd))) {
-            stl_warn(errno, "Failed to close socket");
+    }
+
+    if (dropped > 0) {
+        warn("Transfer engine dropped %d media packets that failed to open", dropped);
+    }
+}
+
+/**
+ * Decode an audio payload into the playback ring buffer.
+ * 
+ * After a gap, the FEC blocks that fill it are played ahead of the packet's
+ * own block. A packet behind what has already been played is dropped, since
+ * the playback ring buffer can only be appended to.
+ */
+static int play_audio(struct transfer_engine* engine, transfer_call_t* call, const struct media_header* header, const uint8_t* payload, size_t length) {
+    const int codec = MEDIA_FORMAT_CODEC(header->format);
+    const int fec = MEDIA_FORMAT_FEC(header->format);
+
+    if (codec >= MEDIA_CODEC_COUNT || fec > MEDIA_MAX_FEC || length < fec * sizeof(uint16_t)) {
+        return ST_FAIL;
+    }
+
+    const uint8_t* blocks[MEDIA_MAX_FEC + 1];
+    size_t blockLengths[MEDIA_MAX_FEC + 1];
+    size_t blockFrames[MEDIA_MAX_FEC + 1];
+    uint32_t starts[MEDIA_MAX_FEC + 1];
+
+    const uint8_t* block = payload + fec * sizeof(uint16_t);
+    size_t remaining = length - fec * sizeof(uint16_t);
+
+    for (int i = 0; i <= fec; i++) {
+        blockLengths[i] = i < fec ? (size_t)((payload[2 * i] << 8) | payload[2 * i + 1]) : remaining;
+
+        if (blockLengths[i] > remaining) {
+            return ST_FAIL;
+        }
+
+        blocks[i] = block;
+        blockFrames[i] = codec_decoded_frames(codec, block, blockLengths[i]);
+
+        if (blockFrames[i] == 0 || blockFrames[i] > sizeof(netBuffer) / sizeof(*netBuffer)) {
+            return ST_FAIL;
+        }
+
+        block += blockLengths[i];
+        remaining -= blockLengths[i];
+    }
+
+    // Blocks run back to back, ending with the one the timestamp is for
+    starts[fec] = ntohl(header->timestamp);
+    for (int i = fec - 1; i >= 0; i--) {
+        starts[i] = starts[i + 1] - (uint32_t)blockFrames[i];
+    }
+
+    for (int i = 0; i <= fec; i++) {
+        const bool primary = i == fec;
+
+        if (call->playing ? (int32_t)(starts[i] - call->playTimestamp) < 0 : !primary) {
+            call->late += primary;
+            continue;
+        }
+
+        const size_t decoded = codec_decode(codec, blocks[i], blockLengths[i], netBuffer);
+
+        // Run the received audio through the playback chain
+        size_t frames = sizeof(dspBuffer) / sizeof(*dspBuffer);
+        if (dsp_graph_process(&engine->playbackDsp, netBuffer, decoded, dspBuffer, &frames) != ST_GOOD) {
+            warn("Transfer engine failed to process playback audio");
+        }
+
+        // Write the data into the ring buffer
+        size_t len = frames * FRAME_SIZE;
+        if (ring_buffer_write(engine->playback, dspBuffer, &len) != ST_GOOD || len != frames * FRAME_SIZE) {
+            warn("Transfer engine dropped %zu bytes of playback audio", frames * FRAME_SIZE - len);
+        }
+
+        call->playing = true;
+        call->playTimestamp = starts[i] + (uint32_t)decoded;
+        call->recovered += !primary;
+    }
+
+    return ST_GOOD;
+}
+
+/**
+ * Encode, seal and send every whole packet waiting in the capture ring
+ * buffer, at the controller's current level.
+ */
+static void send_audio(struct transfer_engine* engine, int sockfd, transfer_call_t* call, const struct sockaddr* serverAddr, socklen_t serverAddrLen) {
+    const media_level_t* level = media_control_level(&call->control);
+    const size_t captureFrames = (size_t)SAMPLE_RATE * level->ptimeMs / 1000;
+    const size_t packetBytes = captureFrames * FRAME_SIZE;
+    size_t lengths[TRANSFER_BATCH];
+    size_t frames;
+    size_t len;
+    int count = 0;
+
+    // FEC blocks must be in the packet's codec
+    if (call->historyCodec != level->codec) {
+        call->historyCodec = level->codec;
+        call->historyCount = 0;
+    }
+
+    while (ring_buffer_pointer_distance(engine->capture) >= (int32_t)packetBytes) {
+        len = packetBytes;
+        if (ring_buffer_read(engine->capture, dspBuffer, &len) != ST_GOOD || len != packetBytes) {
+            warn("Transfer engine failed to read from capture buffer");
+            break;
+        }
+
+        // Run the captured audio through the capture chain
+        frames = sizeof(netBuffer) / sizeof(*netBuffer);
+        if (dsp_graph_process(&engine->captureDsp, dspBuffer, captureFrames, netBuffer, &frames) != ST_GOOD) {
+            warn("Transfer engine failed to process capture audio");
+        }
+
+        const size_t encodedLength = codec_encoded_size(level->codec, frames);
+
+        if (encodedLength + MEDIA_OVERHEAD > TRANSFER_MAX_PACKET) {
+            warn("Transfer engine dropped a packet of %zu frames, too large to send", frames);
+            continue;
+        }
+
+        // Repeat as many previous blocks as were asked for and fit
+        int fec = call->control.fec < call->historyCount ? call->control.fec : call->historyCount;
+        size_t payloadLength = encodedLength;
+
+        for (int i = 0; i < fec; i++) {
+            payloadLength += sizeof(uint16_t) + call->historyLengths[i];
+        }
+
+        while (fec > 0 && payloadLength + MEDIA_OVERHEAD > TRANSFER_MAX_PACKET) {
+            fec--;
+            payloadLength -= sizeof(uint16_t) + call->historyLengths[fec];
+        }
+
+        // Lengths, then the previous blocks oldest first, then this one
+        uint8_t* out = payloadBuffer + fec * sizeof(uint16_t);
+
+        for (int i = fec - 1; i >= 0; i--) {
+            const int slot = fec - 1 - i;
+            payloadBuffer[2 * slot] = (uint8_t)(call->historyLengths[i] >> 8);
+            payloadBuffer[2 * slot + 1] = (uint8_t)call->historyLengths[i];
+
+            memcpy(out, call->history[i], call->historyLengths[i]);
+            out += call->historyLengths[i];
+        }
+
+        codec_encode(level->codec, &call->encoder, netBuffer, frames, out);
+
+        // Keep this block to repeat in the next packets
+        memmove(&call->history[1], &call->history[0], sizeof(call->history[0]) * (MEDIA_MAX_FEC - 1));
+        memmove(&call->historyLengths[1], &call->historyLengths[0], sizeof(call->historyLengths[0]) * (MEDIA_MAX_FEC - 1));
+        memcpy(call->history[0], out, encodedLength);
+        call->historyLengths[0] = encodedLength;
+
+        if (call->historyCount < MEDIA_MAX_FEC) {
+            call->historyCount++;
+        }
+
+        const uint8_t format = MEDIA_FORMAT(level->codec, fec);
+
+        if ((lengths[count] = media_seal(&call->crypto, packets[count], MEDIA_TYPE_AUDIO, format, call->timestamp, payloadBuffer, payloadLength)) == 0) {
+            warn("Transfer engine ran out of sequence numbers for the call");
+            break;
+        }
+
+        call->timestamp += (uint32_t)frames;
+
+        if (++count == TRANSFER_BATCH) {
+            send_packets(sockfd, lengths, count, serverAddr, serverAddrLen);
+            count = 0;
+        }
+    }
+
+    if (count > 0) {
+        send_packets(sockfd, lengths, count, serverAddr, serverAddrLen);
+    }
+}
+
+/**
+ * Seal and send a report on the audio received since the last one.
+ */
+static void send_report(int sockfd, transfer_call_t* call, const struct sockaddr* serverAddr, socklen_t serverAddrLen, uint64_t nowNs) {
+    struct media_report report;
+    media_control_build_report(&call->control, &report, nowNs);
+
+    if (call->recovered > 0 || call->late > 0) {
+        info("Transfer engine repaired %u blocks with FEC and dropped %u late packets", call->recovered, call->late);
+        call->recovered = 0;
+        call->late = 0;
+    }
+
+    size_t length = media_seal(&call->crypto, packets[0], MEDIA_TYPE_REPORT, 0, call->timestamp, &report, sizeof(report));
+
+    if (length > 0) {
+        send_packets(sockfd, &length, 1, serverAddr, serverAddrLen);
+    }
+}
+
+/**
+ * Keep RINGBACK_LEAD_FRAMES of ringback queued for the device. The tone is
+ * local, so it skips the playback chain.
+ */
+static void play_ringback(struct transfer_engine* engine, transfer_call_t* call) {
+    while (ring_buffer_pointer_distance(engine->playback) < (int32_t)(RINGBACK_LEAD_FRAMES * FRAME_SIZE)) {
+        for (int i = 0; i < DSP_BLOCK_FRAMES; i++) {
+            const uint32_t frame = call->ringbackFrame;
+            const float phase = 2.0f * (float)M_PI * RINGBACK_FREQUENCY * frame / SAMPLE_RATE;
+
+            dspBuffer[i] = frame < RINGBACK_ON_FRAMES ? (int16_t)(RINGBACK_AMPLITUDE * sinf(phase)) : 0;
+            call->ringbackFrame = (frame + 1) % RINGBACK_PERIOD_FRAMES;
+        }
+
+        size_t len = DSP_BLOCK_FRAMES * FRAME_SIZE;
+        if (ring_buffer_write(engine->playback, dspBuffer, &len) != ST_GOOD || len != DSP_BLOCK_FRAMES * FRAME_SIZE) {
+            break;
+        }
+    }
+}
+
+/**
+ * Probe the direct path while there are attempts left, and keep it alive
+ * once it works. A direct path that has gone quiet is given up for the rest
+ * of the call, media goes back through the relay.
+ *
+ * While direct the relay is sent a probe too, which the peer ignores, so the
+ * server does not take the call for dead.
+ */
+static void probe_direct(int sockfd, transfer_call_t* call, const struct sockaddr* serverAddr, uint64_t nowNs) {
+    if (call->direct && nowNs - call->directSeenNs > DIRECT_TIMEOUT_MS * NS_PER_MS) {
+        warn("Direct path to the peer went quiet, falling back to the relay");
+        call->direct = false;
+        call->probesLeft = 0;
+    }
+
+    if ((!call->direct && call->probesLeft == 0) || nowNs < call->nextProbeNs) {
+        return;
+    }
+
+    // Before the peer's, whose sequence is the one its answer must carry
+    if (call->direct) {
+        send_probe(sockfd, call, MEDIA_TYPE_PROBE, NULL, 0, (const struct sockaddr_in*)serverAddr);
+    }
+
+    send_probe(sockfd, call, MEDIA_TYPE_PROBE, NULL, 0, &call->peerAddr);
+    call->probeSequence = ((const struct media_header*)probeBuffer)->sequence;
+
+    if (!call->direct && --call->probesLeft == 0) {
+        info("No answer from the peer directly, media stays on the relay");
+    }
+
+    call->nextProbeNs = nowNs + (call->direct ? DIRECT_KEEPALIVE_MS : PROBE_INTERVAL_MS) * NS_PER_MS;
+}
+
+/**
+ * Answer a probe from the peer, or take an answer to ours. Only an answer to
+ * the last probe, from where it was sent, moves media onto the direct path,
+ * so a replayed one cannot.
+ */
+static void receive_probe(int sockfd, transfer_call_t* call, const struct media_header* header, const uint8_t* payload, size_t length, const struct sockaddr_in* source, uint64_t nowNs) {
+    if (header->type == MEDIA_TYPE_PROBE) {
+        send_probe(sockfd, call, MEDIA_TYPE_PROBE_ACK, &header->sequence, sizeof(header->sequence), source);
+        return;
+    }
+
+    if (length != sizeof(call->probeSequence) || memcmp(payload, &call->probeSequence, length) != 0 || !same_endpoint(source, &call->peerAddr)) {
+        return;
+    }
+
+    if (!call->direct) {
+        info("Direct path to the peer works, media no longer goes through the relay");
+        call->direct = true;
+        call->nextProbeNs = nowNs + DIRECT_KEEPALIVE_MS * NS_PER_MS;
+    }
+
+    call->directSeenNs = nowNs;
+}
+
+static void send_probe(int sockfd, transfer_call_t* call, uint8_t type, const void* payload, size_t length, const struct sockaddr_in* addr) {
+    const size_t packetLength = media_seal(&call->crypto, probeBuffer, type, 0, call->timestamp, payload, length);
+
+    if (packetLength > 0 && sendto(sockfd, probeBuffer, packetLength, 0, (const struct sockaddr*)addr, sizeof(*addr)) == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            stl_warn(errno, "Transfer engine failed to send a probe");
+        }
+    }
+}
+
+static bool same_endpoint(const struct sockaddr_in* a, const struct sockaddr_in* b) {
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+/**
+ * Read up to a batch of datagrams into `packets`, and their senders into
+ * `sources`.
+ * 
+ * Returns the number read, 0 if none are waiting.
+ */
+static int receive_packets(int sockfd, size_t* lengths) {
+#ifdef linux
+    struct mmsghdr msgs[TRANSFER_BATCH];
+    struct iovec iovecs[TRANSFER_BATCH];
+
+    memset(msgs, 0, sizeof(msgs));
+
+    for (int i = 0; i < TRANSFER_BATCH; i++) {
+        iovecs[i].iov_base = packets[i];
+        iovecs[i].iov_len = TRANSFER_MAX_PACKET;
+        msgs[i].msg_hdr.msg_iov = &iovecs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &sources[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(sources[i]);
+    }
+
+    int count = recvmmsg(sockfd, msgs, TRANSFER_BATCH, MSG_DONTWAIT, NULL);
+
+    if (count == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            stl_warn(errno, "Transfer engine recvmmsg failed");
         }
+        return 0;
+    }
+
+    for (int i = 0; i < count; i++) {
+        lengths[i] = msgs[i].msg_len;
     }
+
+    return count;
+#else
+    int count = 0;
+    ssize_t received;
+    socklen_t sourceLen = sizeof(sources[0]);
+
+    while (count < TRANSFER_BATCH && (received = recvfrom(sockfd, packets[count], TRANSFER_MAX_PACKET, 0, (struct sockaddr*)&sources[count], &sourceLen)) >= 0) {
+        lengths[count++] = received;
+        sourceLen = sizeof(sources[0]);
+    }
+
+    if (count == 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        stl_warn(errno, "Transfer engine recfrom failed");
+    }
+
+    return count;
+#endif
 }
 
+/**
+ * Send the first `count` of `packets`. A full socket buffer drops the rest,
+ * late audio is no use anyway.
+ */
+static int send_packets(int sockfd, const size_t* lengths, int count, const struct sockaddr* serverAddr, socklen_t serverAddrLen) {
+#ifdef linux
+    struct mmsghdr msgs[TRANSFER_BATCH];
+    struct iovec iovecs[TRANSFER_BATCH];
+
+    memset(msgs, 0, sizeof(msgs));
+
+    for (int i = 0; i < count; i++) {
+        iovecs[i].iov_base = packets[i];
+        iovecs[i].iov_len = lengths[i];
+        msgs[i].msg_hdr.msg_iov = &iovecs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = (void*)serverAddr;
+        msgs[i].msg_hdr.msg_namelen = serverAddrLen;
+    }
+
+    if (sendmmsg(sockfd, msgs, count, 0) == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            stl_warn(errno, "Transfer engine sendmmsg failed");
+        }
+        return ST_FAIL;
+    }
+#else
+    for (int i = 0; i < count; i++) {
+        if (sendto(sockfd, packets[i], lengths[i], 0, serverAddr, serverAddrLen) == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                stl_warn(errno, "Transfer engine sendto failed");
+            }
+            return ST_FAIL;
+        }
+    }
+#endif
+
+    return ST_GOOD;
+}
 
 static void transfer_engine_debug(struct transfer_engine* engine) {
     ma_waveform_config config = ma_waveform_config_init(
@@ -32,4 +32,19 @@ uint64_t ntime(void) {
     }
 
     return get_ntime() - tm_start;
-}
\ No newline at end of file
+}
+
+/**
+ * Copy `src` into `dst`, which holds `size` bytes. Returns ST_FAIL, leaving
+ * `dst` as it was, if it does not fit with its terminator.
+ */
+int copy_string(char* dst, size_t size, const char* src) {
+    const size_t length = strlen(src);
+
+    if (length >= size) {
+        return ST_FAIL;
+    }
+
+    memcpy(dst, src, length + 1);
+    return ST_GOOD;
+}
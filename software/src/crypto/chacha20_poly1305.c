@@ -0,0 +1,312 @@
+#include <stdint.h>
+#include <string.h>
+#include "common.h"
+#include "crypto/chacha20_poly1305.h"
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QUARTER_ROUND(a, b, c, d) \
+    a += b; d ^= a; d = ROTL32(d, 16); \
+    c += d; b ^= c; b = ROTL32(b, 12); \
+    a += b; d ^= a; d = ROTL32(d, 8);  \
+    c += d; b ^= c; b = ROTL32(b, 7);
+
+// Poly1305 state in 26 bit limbs, so products fit in 64 bits on 32 bit cores
+typedef struct poly1305 {
+    uint32_t r[5];
+    uint32_t h[5];
+    uint32_t pad[4];
+    uint8_t buffer[16];
+    size_t buffered;
+} poly1305_t;
+
+static void chacha20_init(uint32_t state[16], const uint8_t key[CHACHA20_KEY_SIZE], const uint8_t nonce[CHACHA20_NONCE_SIZE], uint32_t counter);
+static void chacha20_rounds(uint32_t x[16]);
+static void chacha20_block(const uint32_t state[16], uint8_t out[64]);
+
+static void poly1305_init(poly1305_t* poly, const uint8_t key[32]);
+static void poly1305_update(poly1305_t* poly, const uint8_t* data, size_t length);
+static void poly1305_pad(poly1305_t* poly);
+static void poly1305_finish(poly1305_t* poly, uint8_t tag[POLY1305_TAG_SIZE]);
+static void poly1305_blocks(poly1305_t* poly, const uint8_t* data, size_t length, uint32_t hibit);
+static void aead_tag(uint8_t tag[POLY1305_TAG_SIZE], const uint8_t* ciphertext, size_t length, const uint8_t* aad, size_t aadLength,
+                     const uint8_t key[CHACHA20_KEY_SIZE], const uint8_t nonce[CHACHA20_NONCE_SIZE]);
+
+static inline uint32_t load32_le(const uint8_t* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void store32_le(uint8_t* p, uint32_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+void chacha20_poly1305_seal(uint8_t* out, uint8_t tag[POLY1305_TAG_SIZE], const uint8_t* in, size_t length,
+                            const uint8_t* aad, size_t aadLength,
+                            const uint8_t key[CHACHA20_KEY_SIZE], const uint8_t nonce[CHACHA20_NONCE_SIZE]) {
+    chacha20_xor(out, in, length, key, nonce, 1);
+    aead_tag(tag, out, length, aad, aadLength, key, nonce);
+}
+
+int chacha20_poly1305_open(uint8_t* out, const uint8_t* in, size_t length, const uint8_t tag[POLY1305_TAG_SIZE],
+                           const uint8_t* aad, size_t aadLength,
+                           const uint8_t key[CHACHA20_KEY_SIZE], const uint8_t nonce[CHACHA20_NONCE_SIZE]) {
+    uint8_t expected[POLY1305_TAG_SIZE];
+    aead_tag(expected, in, length, aad, aadLength, key, nonce);
+
+    // Compare without an early exit, so the time taken leaks nothing
+    uint8_t diff = 0;
+    for (int i = 0; i < POLY1305_TAG_SIZE; i++) {
+        diff |= expected[i] ^ tag[i];
+    }
+
+    if (diff != 0) {
+        return ST_FAIL;
+    }
+
+    chacha20_xor(out, in, length, key, nonce, 1);
+    return ST_GOOD;
+}
+
+void chacha20_xor(uint8_t* out, const uint8_t* in, size_t length,
+                  const uint8_t key[CHACHA20_KEY_SIZE], const uint8_t nonce[CHACHA20_NONCE_SIZE], uint32_t counter) {
+    uint32_t state[16];
+    uint8_t block[64];
+
+    chacha20_init(state, key, nonce, counter);
+
+    while (length > 0) {
+        const size_t n = MIN(length, sizeof(block));
+        chacha20_block(state, block);
+        state[12]++;
+
+        for (size_t i = 0; i < n; i++) {
+            out[i] = in[i] ^ block[i];
+        }
+
+        out += n;
+        in += n;
+        length -= n;
+    }
+}
+
+void hchacha20(uint8_t out[CHACHA20_KEY_SIZE], const uint8_t key[CHACHA20_KEY_SIZE], const uint8_t input[16]) {
+    uint32_t x[16];
+
+    chacha20_init(x, key, input + 4, load32_le(input));
+    chacha20_rounds(x);
+
+    for (int i = 0; i < 4; i++) {
+        store32_le(out + i * 4, x[i]);
+        store32_le(out + 16 + i * 4, x[12 + i]);
+    }
+}
+
+static void chacha20_init(uint32_t state[16], const uint8_t key[CHACHA20_KEY_SIZE], const uint8_t nonce[CHACHA20_NONCE_SIZE], uint32_t counter) {
+    // "expand 32-byte k"
+    state[0] = 0x61707865;
+    state[1] = 0x3320646e;
+    state[2] = 0x79622d32;
+    state[3] = 0x6b206574;
+
+    for (int i = 0; i < 8; i++) {
+        state[4 + i] = load32_le(key + i * 4);
+    }
+
+    state[12] = counter;
+    state[13] = load32_le(nonce);
+    state[14] = load32_le(nonce + 4);
+    state[15] = load32_le(nonce + 8);
+}
+
+static void chacha20_rounds(uint32_t x[16]) {
+    for (int i = 0; i < 10; i++) {
+        QUARTER_ROUND(x[0], x[4], x[8],  x[12])
+        QUARTER_ROUND(x[1], x[5], x[9],  x[13])
+        QUARTER_ROUND(x[2], x[6], x[10], x[14])
+        QUARTER_ROUND(x[3], x[7], x[11], x[15])
+        QUARTER_ROUND(x[0], x[5], x[10], x[15])
+        QUARTER_ROUND(x[1], x[6], x[11], x[12])
+        QUARTER_ROUND(x[2], x[7], x[8],  x[13])
+        QUARTER_ROUND(x[3], x[4], x[9],  x[14])
+    }
+}
+
+static void chacha20_block(const uint32_t state[16], uint8_t out[64]) {
+    uint32_t x[16];
+    memcpy(x, state, sizeof(x));
+
+    chacha20_rounds(x);
+
+    for (int i = 0; i < 16; i++) {
+        store32_le(out + i * 4, x[i] + state[i]);
+    }
+}
+
+/**
+ * The tag covers the aad and ciphertext, each padded to 16 bytes, then both
+ * lengths. The Poly1305 key is the first block of the key stream.
+ */
+static void aead_tag(uint8_t tag[POLY1305_TAG_SIZE], const uint8_t* ciphertext, size_t length, const uint8_t* aad, size_t aadLength,
+                     const uint8_t key[CHACHA20_KEY_SIZE], const uint8_t nonce[CHACHA20_NONCE_SIZE]) {
+    uint32_t state[16];
+    uint8_t block[64];
+    uint8_t lengths[16];
+    poly1305_t poly;
+
+    chacha20_init(state, key, nonce, 0);
+    chacha20_block(state, block);
+    poly1305_init(&poly, block);
+
+    poly1305_update(&poly, aad, aadLength);
+    poly1305_pad(&poly);
+    poly1305_update(&poly, ciphertext, length);
+    poly1305_pad(&poly);
+
+    store32_le(lengths, (uint32_t)aadLength);
+    store32_le(lengths + 4, (uint32_t)((uint64_t)aadLength >> 32));
+    store32_le(lengths + 8, (uint32_t)length);
+    store32_le(lengths + 12, (uint32_t)((uint64_t)length >> 32));
+    poly1305_update(&poly, lengths, sizeof(lengths));
+
+    poly1305_finish(&poly, tag);
+    memset(block, 0, sizeof(block));
+}
+
+static void poly1305_init(poly1305_t* poly, const uint8_t key[32]) {
+    // Clamp r as the spec requires
+    poly->r[0] = load32_le(key + 0) & 0x3ffffff;
+    poly->r[1] = (load32_le(key + 3) >> 2) & 0x3ffff03;
+    poly->r[2] = (load32_le(key + 6) >> 4) & 0x3ffc0ff;
+    poly->r[3] = (load32_le(key + 9) >> 6) & 0x3f03fff;
+    poly->r[4] = (load32_le(key + 12) >> 8) & 0x00fffff;
+
+    memset(poly->h, 0, sizeof(poly->h));
+
+    for (int i = 0; i < 4; i++) {
+        poly->pad[i] = load32_le(key + 16 + i * 4);
+    }
+
+    poly->buffered = 0;
+}
+
+static void poly1305_update(poly1305_t* poly, const uint8_t* data, size_t length) {
+    if (length == 0) {
+        return;
+    }
+
+    if (poly->buffered > 0) {
+        const size_t n = MIN(length, 16 - poly->buffered);
+        memcpy(poly->buffer + poly->buffered, data, n);
+        poly->buffered += n;
+        data += n;
+        length -= n;
+
+        if (poly->buffered < 16) {
+            return;
+        }
+
+        poly1305_blocks(poly, poly->buffer, 16, 1 << 24);
+        poly->buffered = 0;
+    }
+
+    const size_t whole = length & ~(size_t)15;
+    poly1305_blocks(poly, data, whole, 1 << 24);
+
+    memcpy(poly->buffer, data + whole, length - whole);
+    poly->buffered = length - whole;
+}
+
+/**
+ * Zero pad what has been absorbed so far to a whole block.
+ */
+static void poly1305_pad(poly1305_t* poly) {
+    if (poly->buffered > 0) {
+        memset(poly->buffer + poly->buffered, 0, 16 - poly->buffered);
+        poly1305_blocks(poly, poly->buffer, 16, 1 << 24);
+        poly->buffered = 0;
+    }
+}
+
+static void poly1305_blocks(poly1305_t* poly, const uint8_t* data, size_t length, uint32_t hibit) {
+    const uint32_t r0 = poly->r[0], r1 = poly->r[1], r2 = poly->r[2], r3 = poly->r[3], r4 = poly->r[4];
+    const uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+    uint32_t h0 = poly->h[0], h1 = poly->h[1], h2 = poly->h[2], h3 = poly->h[3], h4 = poly->h[4];
+
+    for (; length >= 16; data += 16, length -= 16) {
+        h0 += load32_le(data + 0) & 0x3ffffff;
+        h1 += (load32_le(data + 3) >> 2) & 0x3ffffff;
+        h2 += (load32_le(data + 6) >> 4) & 0x3ffffff;
+        h3 += (load32_le(data + 9) >> 6) & 0x3ffffff;
+        h4 += (load32_le(data + 12) >> 8) | hibit;
+
+        uint64_t d0 = (uint64_t)h0 * r0 + (uint64_t)h1 * s4 + (uint64_t)h2 * s3 + (uint64_t)h3 * s2 + (uint64_t)h4 * s1;
+        uint64_t d1 = (uint64_t)h0 * r1 + (uint64_t)h1 * r0 + (uint64_t)h2 * s4 + (uint64_t)h3 * s3 + (uint64_t)h4 * s2;
+        uint64_t d2 = (uint64_t)h0 * r2 + (uint64_t)h1 * r1 + (uint64_t)h2 * r0 + (uint64_t)h3 * s4 + (uint64_t)h4 * s3;
+        uint64_t d3 = (uint64_t)h0 * r3 + (uint64_t)h1 * r2 + (uint64_t)h2 * r1 + (uint64_t)h3 * r0 + (uint64_t)h4 * s4;
+        uint64_t d4 = (uint64_t)h0 * r4 + (uint64_t)h1 * r3 + (uint64_t)h2 * r2 + (uint64_t)h3 * r1 + (uint64_t)h4 * r0;
+
+        uint32_t c = (uint32_t)(d0 >> 26); h0 = (uint32_t)d0 & 0x3ffffff;
+        d1 += c; c = (uint32_t)(d1 >> 26); h1 = (uint32_t)d1 & 0x3ffffff;
+        d2 += c; c = (uint32_t)(d2 >> 26); h2 = (uint32_t)d2 & 0x3ffffff;
+        d3 += c; c = (uint32_t)(d3 >> 26); h3 = (uint32_t)d3 & 0x3ffffff;
+        d4 += c; c = (uint32_t)(d4 >> 26); h4 = (uint32_t)d4 & 0x3ffffff;
+        h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+        h1 += c;
+    }
+
+    poly->h[0] = h0;
+    poly->h[1] = h1;
+    poly->h[2] = h2;
+    poly->h[3] = h3;
+    poly->h[4] = h4;
+}
+
+static void poly1305_finish(poly1305_t* poly, uint8_t tag[POLY1305_TAG_SIZE]) {
+    // A final partial block gets its 1 byte here rather than the high bit
+    if (poly->buffered > 0) {
+        poly->buffer[poly->buffered] = 1;
+        memset(poly->buffer + poly->buffered + 1, 0, 15 - poly->buffered);
+        poly1305_blocks(poly, poly->buffer, 16, 0);
+    }
+
+    uint32_t h0 = poly->h[0], h1 = poly->h[1], h2 = poly->h[2], h3 = poly->h[3], h4 = poly->h[4];
+    uint32_t c;
+
+    c = h1 >> 26; h1 &= 0x3ffffff;
+    h2 += c; c = h2 >> 26; h2 &= 0x3ffffff;
+    h3 += c; c = h3 >> 26; h3 &= 0x3ffffff;
+    h4 += c; c = h4 >> 26; h4 &= 0x3ffffff;
+    h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+    h1 += c;
+
+    // Compute h - p, and keep it if it did not go negative
+    uint32_t g0 = h0 + 5; c = g0 >> 26; g0 &= 0x3ffffff;
+    uint32_t g1 = h1 + c; c = g1 >> 26; g1 &= 0x3ffffff;
+    uint32_t g2 = h2 + c; c = g2 >> 26; g2 &= 0x3ffffff;
+    uint32_t g3 = h3 + c; c = g3 >> 26; g3 &= 0x3ffffff;
+    uint32_t g4 = h4 + c - (1 << 26);
+
+    uint32_t mask = (g4 >> 31) - 1;
+    h0 = (h0 & ~mask) | (g0 & mask);
+    h1 = (h1 & ~mask) | (g1 & mask);
+    h2 = (h2 & ~mask) | (g2 & mask);
+    h3 = (h3 & ~mask) | (g3 & mask);
+    h4 = (h4 & ~mask) | (g4 & mask);
+
+    // Pack into 32 bit words and add the pad
+    h0 = h0 | (h1 << 26);
+    h1 = (h1 >> 6) | (h2 << 20);
+    h2 = (h2 >> 12) | (h3 << 14);
+    h3 = (h3 >> 18) | (h4 << 8);
+
+    uint64_t f;
+    f = (uint64_t)h0 + poly->pad[0];             store32_le(tag + 0, (uint32_t)f);
+    f = (uint64_t)h1 + poly->pad[1] + (f >> 32); store32_le(tag + 4, (uint32_t)f);
+    f = (uint64_t)h2 + poly->pad[2] + (f >> 32); store32_le(tag + 8, (uint32_t)f);
+    f = (uint64_t)h3 + poly->pad[3] + (f >> 32); store32_le(tag + 12, (uint32_t)f);
+
+    memset(poly, 0, sizeof(*poly));
+}
@@ -0,0 +1,184 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include "common.h"
+#include "crypto/media_crypto.h"
+
+#define MEDIA_REPLAY_WINDOW 64
+
+// Binds the key to its use, so the shared secret is never a cipher key itself
+static const uint8_t MEDIA_KEY_CONTEXT[16] = "intercom media 1";
+
+// Authenticated with a wrapped key, so it cannot be taken for anything else
+static const uint8_t MEDIA_WRAP_CONTEXT[16] = "intercom wrap 1";
+
+static void media_nonce(uint8_t nonce[CHACHA20_NONCE_SIZE], const struct media_header* header);
+
+/**
+ * Agree the call's media key from our secret and the peer's public key.
+ *
+ * The X25519 output is hashed through HChaCha20, as crypto_box does with
+ * HSalsa20, since its bits are not uniform. Both secrets are fresh for every
+ * call, so every call gets its own key.
+ */
+int media_crypto_derive(uint8_t key[MEDIA_KEY_SIZE], const uint8_t secret[X25519_KEY_SIZE], const uint8_t peerKey[X25519_KEY_SIZE]) {
+    uint8_t shared[X25519_KEY_SIZE];
+
+    if (x25519_shared(shared, secret, peerKey) != ST_GOOD) {
+        return ST_FAIL;
+    }
+
+    hchacha20(key, shared, MEDIA_KEY_CONTEXT);
+    memset(shared, 0, sizeof(shared));
+    return ST_GOOD;
+}
+
+/**
+ * A fresh key from the system's random source, for a page.
+ */
+int media_crypto_random_key(uint8_t key[MEDIA_KEY_SIZE]) {
+    FILE* random = fopen("/dev/urandom", "rb");
+
+    if (random == NULL) {
+        stl_warn(errno, "Failed to open /dev/urandom");
+        return ST_FAIL;
+    }
+
+    const size_t read = fread(key, 1, MEDIA_KEY_SIZE, random);
+    fclose(random);
+
+    if (read != MEDIA_KEY_SIZE) {
+        warn("Failed to generate a media key");
+        return ST_FAIL;
+    }
+
+    return ST_GOOD;
+}
+
+/**
+ * Seal `key` under `wrappingKey`, one agreed with media_crypto_derive() from
+ * two fresh secrets. Each wrapping key seals exactly one key, so the nonce
+ * can be fixed.
+ */
+void media_crypto_wrap(uint8_t wrapped[MEDIA_WRAPPED_KEY_SIZE], const uint8_t key[MEDIA_KEY_SIZE], const uint8_t wrappingKey[MEDIA_KEY_SIZE]) {
+    const uint8_t nonce[CHACHA20_NONCE_SIZE] = { 0 };
+    chacha20_poly1305_seal(wrapped, wrapped + MEDIA_KEY_SIZE, key, MEDIA_KEY_SIZE, MEDIA_WRAP_CONTEXT, sizeof(MEDIA_WRAP_CONTEXT), wrappingKey, nonce);
+}
+
+/**
+ * Returns ST_GOOD and the key only if it was sealed under `wrappingKey`.
+ */
+int media_crypto_unwrap(uint8_t key[MEDIA_KEY_SIZE], const uint8_t wrapped[MEDIA_WRAPPED_KEY_SIZE], const uint8_t wrappingKey[MEDIA_KEY_SIZE]) {
+    const uint8_t nonce[CHACHA20_NONCE_SIZE] = { 0 };
+    return chacha20_poly1305_open(key, wrapped, MEDIA_KEY_SIZE, wrapped + MEDIA_KEY_SIZE, MEDIA_WRAP_CONTEXT, sizeof(MEDIA_WRAP_CONTEXT), wrappingKey, nonce);
+}
+
+void init_media_crypto(media_crypto_t* crypto, const uint8_t key[MEDIA_KEY_SIZE], uint8_t sender, uint32_t token) {
+    memset(crypto, 0, sizeof(*crypto));
+    memcpy(crypto->key, key, MEDIA_KEY_SIZE);
+    crypto->sender = sender;
+    crypto->token = token;
+}
+
+void destroy_media_crypto(media_crypto_t* crypto) {
+    memset(crypto, 0, sizeof(*crypto));
+}
+
+/**
+ * Seal `length` bytes of payload into `packet` as a MEDIA_TYPE `type`, which
+ * must have room for MEDIA_OVERHEAD more.
+ *
+ * Returns the packet length, or 0 once the sequence numbers have run out and
+ * the key must not be used again.
+ */
+size_t media_seal(media_crypto_t* crypto, uint8_t* packet, uint8_t type, uint8_t format, uint32_t timestamp, const void* payload, size_t length) {
+    uint32_t* sequence = MEDIA_TYPE_IS_PROBE(type) ? &crypto->probeSequence : &crypto->sendSequence;
+
+    if (*sequence == UINT32_MAX) {
+        return 0;
+    }
+
+    struct media_header* header = (struct media_header*)packet;
+    header->version = MEDIA_VERSION;
+    header->sender = crypto->sender;
+    header->type = type;
+    header->format = format;
+    header->token = crypto->token;
+    header->sequence = htonl((*sequence)++);
+    header->timestamp = htonl(timestamp);
+
+    uint8_t nonce[CHACHA20_NONCE_SIZE];
+    media_nonce(nonce, header);
+
+    uint8_t* body = packet + sizeof(*header);
+    chacha20_poly1305_seal(body, body + length, payload, length, packet, sizeof(*header), crypto->key, nonce);
+
+    return length + MEDIA_OVERHEAD;
+}
+
+/**
+ * Open a packet in place. Returns ST_GOOD and points `payload` into the
+ * packet if it is authentic and has not been seen before.
+ */
+int media_open(media_crypto_t* crypto, uint8_t* packet, size_t length, uint8_t** payload, size_t* payloadLength) {
+    if (length < MEDIA_OVERHEAD) {
+        return ST_FAIL;
+    }
+
+    const struct media_header* header = (const struct media_header*)packet;
+
+    // Our own packets reflected back must not open
+    if (header->version != MEDIA_VERSION || header->sender == crypto->sender) {
+        return ST_FAIL;
+    }
+
+    const bool probe = MEDIA_TYPE_IS_PROBE(header->type);
+    const uint32_t sequence = ntohl(header->sequence);
+    const uint32_t age = crypto->highestSequence - sequence;
+    const bool newest = !crypto->received || sequence > crypto->highestSequence;
+
+    // Reject replays before spending time on the tag
+    if (!probe && !newest && (age >= MEDIA_REPLAY_WINDOW || (crypto->window & ((uint64_t)1 << age)) != 0)) {
+        return ST_FAIL;
+    }
+
+    uint8_t nonce[CHACHA20_NONCE_SIZE];
+    media_nonce(nonce, header);
+
+    uint8_t* body = packet + sizeof(*header);
+    const size_t bodyLength = length - MEDIA_OVERHEAD;
+
+    if (chacha20_poly1305_open(body, body, bodyLength, body + bodyLength, packet, sizeof(*header), crypto->key, nonce) != ST_GOOD) {
+        return ST_FAIL;
+    }
+
+    *payload = body;
+    *payloadLength = bodyLength;
+
+    // Probes have their own sequence numbers, and no window
+    if (probe) {
+        return ST_GOOD;
+    }
+
+    // Only an authentic packet may move the window
+    if (newest) {
+        const uint32_t shift = sequence - crypto->highestSequence;
+        crypto->window = crypto->received && shift < MEDIA_REPLAY_WINDOW ? crypto->window << shift : 0;
+        crypto->window |= 1;
+        crypto->highestSequence = sequence;
+        crypto->received = true;
+    } else {
+        crypto->window |= (uint64_t)1 << age;
+    }
+
+    return ST_GOOD;
+}
+
+static void media_nonce(uint8_t nonce[CHACHA20_NONCE_SIZE], const struct media_header* header) {
+    memset(nonce, 0, CHACHA20_NONCE_SIZE);
+    nonce[0] = header->sender;
+    nonce[1] = MEDIA_TYPE_IS_PROBE(header->type) ? 1 : 0;
+    memcpy(nonce + 8, &header->sequence, sizeof(header->sequence));
+}
@@ -0,0 +1,239 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "common.h"
+#include "crypto/x25519.h"
+
+// Field elements mod 2^255 - 19 as 16 signed limbs of 16 bits, with headroom
+// so additions need no carries
+typedef int64_t fe_t[16];
+
+static const fe_t A24 = { 0xdb41, 1 }; // (486662 - 2) / 4
+
+static void fe_carry(fe_t o);
+static void fe_select(fe_t p, fe_t q, int64_t swap);
+static void fe_pack(uint8_t out[X25519_KEY_SIZE], const fe_t n);
+static void fe_unpack(fe_t o, const uint8_t in[X25519_KEY_SIZE]);
+static void fe_add(fe_t o, const fe_t a, const fe_t b);
+static void fe_sub(fe_t o, const fe_t a, const fe_t b);
+static void fe_mul(fe_t o, const fe_t a, const fe_t b);
+static void fe_invert(fe_t o, const fe_t in);
+
+/**
+ * Montgomery ladder over the u coordinate. Every bit takes the same steps,
+ * the conditional swaps are masks rather than branches.
+ */
+void x25519(uint8_t out[X25519_KEY_SIZE], const uint8_t scalar[X25519_KEY_SIZE], const uint8_t point[X25519_KEY_SIZE]) {
+    uint8_t z[X25519_KEY_SIZE];
+    fe_t x, a, b, c, d, e, f;
+
+    memcpy(z, scalar, sizeof(z));
+    z[0] &= 248;
+    z[31] = (z[31] & 127) | 64;
+
+    fe_unpack(x, point);
+
+    for (int i = 0; i < 16; i++) {
+        b[i] = x[i];
+        a[i] = c[i] = d[i] = 0;
+    }
+    a[0] = d[0] = 1;
+
+    for (int i = 254; i >= 0; i--) {
+        const int64_t bit = (z[i >> 3] >> (i & 7)) & 1;
+
+        fe_select(a, b, bit);
+        fe_select(c, d, bit);
+        fe_add(e, a, c);
+        fe_sub(a, a, c);
+        fe_add(c, b, d);
+        fe_sub(b, b, d);
+        fe_mul(d, e, e);
+        fe_mul(f, a, a);
+        fe_mul(a, c, a);
+        fe_mul(c, b, e);
+        fe_add(e, a, c);
+        fe_sub(a, a, c);
+        fe_mul(b, a, a);
+        fe_sub(c, d, f);
+        fe_mul(a, c, A24);
+        fe_add(a, a, d);
+        fe_mul(c, c, a);
+        fe_mul(a, d, f);
+        fe_mul(d, b, x);
+        fe_mul(b, e, e);
+        fe_select(a, b, bit);
+        fe_select(c, d, bit);
+    }
+
+    fe_invert(c, c);
+    fe_mul(a, a, c);
+    fe_pack(out, a);
+
+    memset(z, 0, sizeof(z));
+}
+
+int x25519_keypair(uint8_t secret[X25519_KEY_SIZE], uint8_t publicKey[X25519_KEY_SIZE]) {
+    static const uint8_t basePoint[X25519_KEY_SIZE] = { 9 };
+
+    FILE* random = fopen("/dev/urandom", "rb");
+
+    if (random == NULL) {
+        stl_warn(errno, "Failed to open /dev/urandom");
+        return ST_FAIL;
+    }
+
+    const size_t read = fread(secret, 1, X25519_KEY_SIZE, random);
+    fclose(random);
+
+    if (read != X25519_KEY_SIZE) {
+        warn("Failed to generate a secret key");
+        return ST_FAIL;
+    }
+
+    x25519(publicKey, secret, basePoint);
+    return ST_GOOD;
+}
+
+int x25519_shared(uint8_t out[X25519_KEY_SIZE], const uint8_t secret[X25519_KEY_SIZE], const uint8_t peerKey[X25519_KEY_SIZE]) {
+    x25519(out, secret, peerKey);
+
+    // Small order points give an all zero secret
+    uint8_t acc = 0;
+    for (int i = 0; i < X25519_KEY_SIZE; i++) {
+        acc |= out[i];
+    }
+
+    if (acc == 0) {
+        warn("Peer sent an invalid public key");
+        return ST_FAIL;
+    }
+
+    return ST_GOOD;
+}
+
+static void fe_carry(fe_t o) {
+    for (int i = 0; i < 16; i++) {
+        o[i] += (int64_t)1 << 16;
+        const int64_t c = o[i] >> 16;
+
+        // 2^256 = 38 mod p, so the top carry wraps round times 38
+        if (i < 15) {
+            o[i + 1] += c - 1;
+        } else {
+            o[0] += 38 * (c - 1);
+        }
+
+        o[i] -= c * ((int64_t)1 << 16);
+    }
+}
+
+static void fe_select(fe_t p, fe_t q, int64_t swap) {
+    const int64_t mask = -swap;
+
+    for (int i = 0; i < 16; i++) {
+        const int64_t t = mask & (p[i] ^ q[i]);
+        p[i] ^= t;
+        q[i] ^= t;
+    }
+}
+
+static void fe_pack(uint8_t out[X25519_KEY_SIZE], const fe_t n) {
+    fe_t t, m;
+
+    for (int i = 0; i < 16; i++) {
+        t[i] = n[i];
+    }
+
+    fe_carry(t);
+    fe_carry(t);
+    fe_carry(t);
+
+    // Subtract p twice if it does not go negative, leaving the canonical value
+    for (int j = 0; j < 2; j++) {
+        m[0] = t[0] - 0xffed;
+
+        for (int i = 1; i < 15; i++) {
+            m[i] = t[i] - 0xffff - ((m[i - 1] >> 16) & 1);
+            m[i - 1] &= 0xffff;
+        }
+
+        m[15] = t[15] - 0x7fff - ((m[14] >> 16) & 1);
+        const int64_t borrow = (m[15] >> 16) & 1;
+        m[14] &= 0xffff;
+        fe_select(t, m, 1 - borrow);
+    }
+
+    for (int i = 0; i < 16; i++) {
+        out[2 * i] = (uint8_t)(t[i] & 0xff);
+        out[2 * i + 1] = (uint8_t)(t[i] >> 8);
+    }
+}
+
+static void fe_unpack(fe_t o, const uint8_t in[X25519_KEY_SIZE]) {
+    for (int i = 0; i < 16; i++) {
+        o[i] = in[2 * i] + ((int64_t)in[2 * i + 1] << 8);
+    }
+
+    o[15] &= 0x7fff;
+}
+
+static void fe_add(fe_t o, const fe_t a, const fe_t b) {
+    for (int i = 0; i < 16; i++) {
+        o[i] = a[i] + b[i];
+    }
+}
+
+static void fe_sub(fe_t o, const fe_t a, const fe_t b) {
+    for (int i = 0; i < 16; i++) {
+        o[i] = a[i] - b[i];
+    }
+}
+
+static void fe_mul(fe_t o, const fe_t a, const fe_t b) {
+    int64_t t[31];
+
+    for (int i = 0; i < 31; i++) {
+        t[i] = 0;
+    }
+
+    for (int i = 0; i < 16; i++) {
+        for (int j = 0; j < 16; j++) {
+            t[i + j] += a[i] * b[j];
+        }
+    }
+
+    for (int i = 0; i < 15; i++) {
+        t[i] += 38 * t[i + 16];
+    }
+
+    for (int i = 0; i < 16; i++) {
+        o[i] = t[i];
+    }
+
+    fe_carry(o);
+    fe_carry(o);
+}
+
+/**
+ * Raise to p - 2, which is the inverse by Fermat.
+ */
+static void fe_invert(fe_t o, const fe_t in) {
+    fe_t c;
+
+    for (int i = 0; i < 16; i++) {
+        c[i] = in[i];
+    }
+
+    for (int i = 253; i >= 0; i--) {
+        fe_mul(c, c, c);
+
+        if (i != 2 && i != 4) {
+            fe_mul(c, c, in);
+        }
+    }
+
+    for (int i = 0; i < 16; i++) {
+        o[i] = c[i];
+    }
+}
@@ -0,0 +1,128 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "common.h"
+#include "logicbackend/dial_plan.h"
+
+typedef char dial_string_t[DIAL_PLAN_MAX_DIGITS + 1];
+
+static int compare_dial_strings(const void* a, const void* b);
+
+/**
+ * Start with an empty plan, which completes nothing early.
+ */
+void init_dial_plan(dial_plan_t* plan) {
+    plan->node_count = 1;
+    plan->number_count = 0;
+    memset(&plan->nodes[0], 0, sizeof(plan->nodes[0]));
+}
+
+/**
+ * Replace the plan with `numbers`, duplicates are ignored.
+ *
+ * The trie is laid out breadth first from the sorted digit strings, so each
+ * node's children come out contiguous and in digit order.
+ */
+int dial_plan_build(dial_plan_t* plan, const uint16_t* numbers, int count) {
+    if (count < 0 || count > DIAL_PLAN_MAX_NUMBERS) {
+        warn("Dial plan of %d numbers is too large", count);
+        return ST_INVALID_ARG;
+    }
+
+    dial_string_t strings[DIAL_PLAN_MAX_NUMBERS];
+
+    for (int i = 0; i < count; i++) {
+        snprintf(strings[i], sizeof(strings[i]), "%hu", numbers[i]);
+    }
+
+    qsort(strings, count, sizeof(*strings), &compare_dial_strings);
+
+    // Pending nodes, each covering the strings that share its prefix
+    struct { int lo; int hi; int depth; int node; } queue[DIAL_PLAN_MAX_NODES];
+    int head = 0;
+    int tail = 0;
+
+    init_dial_plan(plan);
+    queue[tail].lo = 0;
+    queue[tail].hi = count;
+    queue[tail].depth = 0;
+    queue[tail++].node = 0;
+
+    while (head < tail) {
+        const int lo = queue[head].lo;
+        const int hi = queue[head].hi;
+        const int depth = queue[head].depth;
+        dial_plan_node_t* node = &plan->nodes[queue[head++].node];
+
+        int i = lo;
+
+        // Sorting puts the string ending here first, skip it and any duplicates
+        while (i < hi && strings[i][depth] == '\0') {
+            if (!node->terminal) {
+                node->terminal = true;
+                plan->number_count++;
+            }
+            i++;
+        }
+
+        node->first = (uint16_t)plan->node_count;
+
+        while (i < hi) {
+            const char digit = strings[i][depth];
+            int end = i;
+
+            while (end < hi && strings[end][depth] == digit) {
+                end++;
+            }
+
+            dial_plan_node_t* child = &plan->nodes[plan->node_count];
+            memset(child, 0, sizeof(*child));
+            const int value = digit - '0';
+            node->children |= BIT(value);
+
+            queue[tail].lo = i;
+            queue[tail].hi = end;
+            queue[tail].depth = depth + 1;
+            queue[tail++].node = plan->node_count++;
+
+            i = end;
+        }
+    }
+
+    return ST_GOOD;
+}
+
+/**
+ * Check whether the `digits` digits of `number` dialled so far are a whole
+ * number in the plan and the start of no longer one, so nothing can follow.
+ */
+bool dial_plan_complete(const dial_plan_t* plan, int number, int digits) {
+    if (digits <= 0 || digits > DIAL_PLAN_MAX_DIGITS) {
+        return false;
+    }
+
+    int divisor = 1;
+    for (int i = 1; i < digits; i++) {
+        divisor *= 10;
+    }
+
+    const dial_plan_node_t* node = &plan->nodes[0];
+
+    for (; divisor > 0; divisor /= 10) {
+        const int digit = (number / divisor) % 10;
+
+        if ((node->children & BIT(digit)) == 0) {
+            return false;
+        }
+
+        const int below = __builtin_popcount(node->children & (BIT(digit) - 1));
+        node = &plan->nodes[node->first + below];
+    }
+
+    return node->terminal && node->children == 0;
+}
+
+static int compare_dial_strings(const void* a, const void* b) {
+    return strcmp((const char*)a, (const char*)b);
+}
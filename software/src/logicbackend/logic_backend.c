@@ -6,6 +6,8 @@
 #include <unistd.h>
 #include <netdb.h>
 #include <poll.h>
+#include <errno.h>
+#include <sys/socket.h>
 
 #ifdef linux
 #include <endian.h>
@@ -15,24 +17,124 @@
 
 #include <arpa/inet.h>
 
-#ifdef RASPBERRY_PI
-#include <wiringPi.h>
-#endif
-
 #include "utils/args.h"
+#include "utils/event_loop.h"
 #include "common.h"
 #include "audiobackend/audio_backend.h"
 #include "server/packets.h"
 #include "logicbackend/logic_backend.h"
+#include "logicbackend/pulse_decoder.h"
+#include "logicbackend/dial_plan.h"
+#include "crypto/media_crypto.h"
+
+#define HANDSHAKE_TIMEOUT_MS 5000
+#define CALL_REQUEST_TIMEOUT_MS 30000
+#define INCOMING_RESPONSE_TIMEOUT_MS 5000
+#define CONFERENCE_ADD_TIMEOUT_MS 5000
+#define CALL_HOLD_TIMEOUT_MS 5000
 
+#define NODE_MAX_REQUESTS 8
+
+// Reconnect attempts back off from the first to the last delay
+#define RECONNECT_MIN_MS 100
+#define RECONNECT_MAX_MS 2000
+#define RECONNECT_ATTEMPT_MS 2000
+
+struct node_context;
+
+/**
+ * A state of the node. States do not block, each handler is called from the
+ * event loop when its event happens and may set `next` to move to another
+ * state. Handlers left NULL ignore that event.
+ * 
+ * on_message only sees messages that are not replies, replies go to the
+ * handler given to send_request(). on_resume is called once the session is
+ * resumed after a reconnect, with the server's view of the call.
+ */
 struct state_t {
-    int(*start)(struct state_t** current);
+    const char* name;
+    int (*enter)(struct state_t* state, struct state_t** next);
+    int (*on_message)(struct state_t* state, struct state_t** next, struct message_wrapper* msg);
+    int (*on_input)(struct state_t* state, struct state_t** next, const char* line);
+    int (*on_dial)(struct state_t* state, struct state_t** next, int number);
+    int (*on_resume)(struct state_t* state, struct state_t** next, const struct resume_response* resume);
+};
+
+/**
+ * Called with the reply to a request, or with NULL if none came in time.
+ */
+typedef int (*reply_handler_t)(struct state_t* state, struct state_t** next, struct message_wrapper* msg);
+
+/**
+ * A request waiting for its reply. Requests belong to the state that sent
+ * them and are dropped when it is left, so a late reply cannot act on a
+ * state that has moved on.
+ */
+struct pending_request {
+    uint8_t id;   // 0 when free
+    uint8_t msgId;
+    uint64_t deadlineNs;
+    struct state_t* state;
+    reply_handler_t on_reply;
+};
+
+/**
+ * Everything the event loop owns for the lifetime of the node. The control
+ * connection comes and goes, the session outlives it.
+ */
+struct node_context {
+    struct logic_backend* logic;
+    int sockfd; // -1 while reconnecting
+    bool connected; // Set once the session is usable on sockfd
+    event_loop_t loop;
+    message_buffer_t messages;
+    struct state_t* current;
+    struct pending_request requests[NODE_MAX_REQUESTS];
+    uint8_t nextRequestId;
+    int requestTimer; // Armed for the earliest request deadline
+    uint8_t token[SESSION_TOKEN_SIZE];
+    bool hasToken;
+    uint8_t resumeRequest; // Id of the resume in flight, 0 if none
+    int reconnectTimer;
+    int heartbeatTimer; // Every HEARTBEAT_INTERVAL_MS, sends while connected
+    uint64_t backoffMs;
+    struct state_t* handshake;
+    dial_plan_t plan;
+    uint16_t planNumbers[DIAL_PLAN_MAX_NUMBERS]; // Plan being received
+    int planCount;
+
+#ifndef RASPBERRY_PI
+    char input[128];
+    size_t inputLength;
+#else
+    edge_source_t dial;
+    pulse_decoder_t decoder;
+    int dialTimer; // Next digit or number boundary
+#endif
 };
 
 struct server_state {
     struct state_t state;
-    struct logic_backend* logic;
-    int sockfd;
+    struct node_context* node;
+};
+
+/**
+ * Keys for the call being set up. Every call gets a fresh key pair, and the
+ * secret is wiped as soon as the media key is agreed.
+ */
+struct call_keys {
+    uint8_t secret[X25519_KEY_SIZE];
+    uint8_t own[X25519_KEY_SIZE]; // Our public key
+    uint8_t peer[X25519_KEY_SIZE];
+    uint8_t media[MEDIA_KEY_SIZE];
+    uint8_t sender;
+    uint32_t token; // Names our side to the relay, as the server sent it
+    struct media_candidate peer_media; // Offered by the server for a direct path
+    bool agreed; // The media key is known, so audio can start
+    uint8_t page[MEDIA_KEY_SIZE]; // A pager's page key, or the key a listener unwraps it with
+    bool record;   // We asked for the call to be recorded
+    bool recorded; // The media key is to be sealed to the recorder once agreed
+    uint8_t recorder[X25519_KEY_SIZE]; // The recorder's public key
 };
 
 struct handshake_state {
@@ -44,25 +146,23 @@ struct wait_for_call_state {
     struct server_state server;
     struct state_t* make_call;
     struct state_t* accept_call;
+    struct state_t* listen_page;
     // For transition into ring state
     int* from_phone_number;
     uint16_t* server_udp_port;
     // For transition into external call state
     int* call_phone_number;
-
-#ifndef RASPBERRY_PI
-    bool prompt_user;
-#else
-    int gpio_dial_pin;
-#endif
+    struct call_keys* keys;
 };
 
 struct execute_external_call_state {
     struct server_state server;
     struct state_t* call;
+    struct state_t* page;
     struct state_t* put_down_call;
     uint16_t* server_udp_port;
     const int* number_to_call;
+    struct call_keys* keys;
 };
 
 struct execute_ring_state {
@@ -70,6 +170,7 @@ struct execute_ring_state {
     struct state_t* call;
     struct state_t* put_down_call;
     const int* from_phone_number;
+    struct call_keys* keys;
 };
 
 struct execute_call_state {
@@ -77,38 +178,120 @@ struct execute_call_state {
     struct state_t* put_down_call;
     uint16_t server_udp_port;
     int other_number;
-#ifndef RASPBERRY_PI
-    bool prompt_user;
-#endif
+    struct call_keys keys;
+    bool answered;
+    bool holding; // The other side is on hold, our audio is stopped
+    bool held;    // On hold, listening to the hold player
     uint8_t magic;
 };
 
+/**
+ * Paging a group, or listening to a page. The pager is MEDIA_SENDER_CALLER,
+ * and keeps its secret for the whole page to seal the page's key to each
+ * listener as it answers.
+ */
+struct execute_page_state {
+    struct server_state server;
+    struct state_t* put_down_call;
+    const uint16_t* server_udp_port;
+    const int* other_number;
+    struct call_keys* keys;
+};
+
 static int start_server(struct logic_backend* logic);
 static int resolve_hostname(const char* hostname, const char* hostport, const struct addrinfo* hints, struct sockaddr* result, socklen_t* resultLen);
 
-// Misc time functions
-static unsigned long ts_to_micros(struct timespec* ts);
+// Event loop plumbing
+static int transition(struct node_context* node, struct state_t* next);
+static int handle_socket(struct event_loop* loop, int fd, uint32_t events, void* data);
+static int handle_request_timer(struct event_loop* loop, int fd, uint32_t events, void* data);
+static int handle_reconnect_timer(struct event_loop* loop, int fd, uint32_t events, void* data);
+static int handle_heartbeat_timer(struct event_loop* loop, int fd, uint32_t events, void* data);
+static int handle_connecting(struct event_loop* loop, int fd, uint32_t events, void* data);
+static int lose_connection(struct node_context* node);
+static void drop_attempt(struct node_context* node);
+static int schedule_reconnect(struct node_context* node);
+static int connection_ready(struct node_context* node);
+static int resume_reply(struct node_context* node, struct message_wrapper* msg);
+static int handle_stdin(struct event_loop* loop, int fd, uint32_t events, void* data);
+static int handle_dial_edge(struct event_loop* loop, int fd, uint32_t events, void* data);
+static int handle_dial_timer(struct event_loop* loop, int fd, uint32_t events, void* data);
+static int drain_dial_edges(struct node_context* node);
+static int arm_dial_timer(struct node_context* node);
+static int dial_number(struct node_context* node, int number);
+static bool number_in_plan(void* data, int number, int digits);
+static void receive_dial_plan(struct node_context* node, struct message_wrapper* msg);
+
+// Requests
+static int send_request(struct state_t* state, uint8_t msgId, const void* data, uint8_t length, uint64_t timeoutMs, reply_handler_t on_reply);
+static uint8_t next_request_id(struct node_context* node);
+static int dispatch_reply(struct node_context* node, struct message_wrapper* msg);
+static void cancel_requests(struct node_context* node, const struct state_t* state);
+static int arm_request_timer(struct node_context* node);
 
 // Server state functions
-static int handshake_start(struct state_t** state);
-
-static int wait_for_call_start_gpio(struct state_t** state);
-static int wait_for_call_start(struct state_t** state);
-
-static int execute_external_call(struct state_t** state);
-
-static int execute_ring_gpio(struct state_t** state);
-static int execute_ring(struct state_t** state);
-
-static int execute_call(struct state_t** state);
+static int handshake_enter(struct state_t* state, struct state_t** next);
+static int handshake_reply(struct state_t* state, struct state_t** next, struct message_wrapper* msg);
+
+static int wait_for_call_enter(struct state_t* state, struct state_t** next);
+static int wait_for_call_input(struct state_t* state, struct state_t** next, const char* line);
+static int wait_for_call_dial(struct state_t* state, struct state_t** next, int number);
+static int wait_for_call_message(struct state_t* state, struct state_t** next, struct message_wrapper* msg);
+static int wait_for_call_resume(struct state_t* state, struct state_t** next, const struct resume_response* resume);
+static int listen_to_page(struct wait_for_call_state* wait_for_call_state, struct state_t** next, const struct incoming_page* page);
+
+static int external_call_enter(struct state_t* state, struct state_t** next);
+static int external_call_reply(struct state_t* state, struct state_t** next, struct message_wrapper* msg);
+
+static int execute_ring_gpio(struct state_t* state, struct state_t** next);
+static int execute_ring(struct state_t* state, struct state_t** next);
+static int execute_ring_input(struct state_t* state, struct state_t** next, const char* line);
+static int execute_ring_reply(struct state_t* state, struct state_t** next, struct message_wrapper* msg);
+static int execute_ring_message(struct state_t* state, struct state_t** next, struct message_wrapper* msg);
+static int execute_ring_resume(struct state_t* state, struct state_t** next, const struct resume_response* resume);
+
+static int execute_call(struct state_t* state, struct state_t** next);
+static int execute_call_input(struct state_t* state, struct state_t** next, const char* line);
+static int execute_call_dial(struct state_t* state, struct state_t** next, int number);
+static int execute_call_message(struct state_t* state, struct state_t** next, struct message_wrapper* msg);
+static int execute_call_resume(struct state_t* state, struct state_t** next, const struct resume_response* resume);
+static int add_to_call(struct state_t* state, int number);
+static int add_to_call_reply(struct state_t* state, struct state_t** next, struct message_wrapper* msg);
+static int join_conference(struct execute_call_state* call_state, struct state_t** next, const struct conference_join* join);
+static int leave_message(struct execute_call_state* call_state, struct state_t** next, const struct voicemail_divert* divert);
+static int rekey_call(struct call_keys* keys, const uint8_t* publicKey, uint32_t token);
+static int restart_call_audio(struct execute_call_state* call_state, uint16_t udpPort);
+static int start_call_audio(struct server_state* server, uint16_t udpPort, struct call_keys* keys, bool ringback);
+static int agree_media_key(struct call_keys* keys);
+static void own_media_candidate(struct node_context* node, struct media_candidate* candidate);
+static bool refuse_relayed_clear(const struct node_context* node, uint8_t flags, int number);
+static int note_recording(struct execute_call_state* call_state, const struct record_call* record);
+static int seal_for_recorder(struct execute_call_state* call_state);
+static int toggle_hold(struct state_t* state);
+static int toggle_hold_reply(struct state_t* state, struct state_t** next, struct message_wrapper* msg);
+static int send_hold_off(struct execute_call_state* call_state);
+static int go_on_hold(struct execute_call_state* call_state, const struct hold_start* start);
+static int listen_to_hold(struct execute_call_state* call_state, const struct hold_key* key);
+static int come_off_hold(struct execute_call_state* call_state, const struct hold_end* end);
 
 // Server state helpers
-static int no_block_check_receive_call(const struct wait_for_call_state* state, bool* received);
+static int execute_page(struct state_t* state, struct state_t** next);
+static int execute_page_input(struct state_t* state, struct state_t** next, const char* line);
+static int execute_page_message(struct state_t* state, struct state_t** next, struct message_wrapper* msg);
+static int execute_page_resume(struct state_t* state, struct state_t** next, const struct resume_response* resume);
+static int key_page_listener(struct execute_page_state* page_state, const struct page_listen* listen);
+static int play_page(struct execute_page_state* page_state, const struct page_key* key);
+
+static int send_client_terminate(struct server_state* server);
 
 void init_logic_backend(struct logic_backend* logic, intercom_conf_t* config) {
     info("Initialising audio backend");
     init_audio_backend(logic->audio, config);
     logic->conf = config;
+
+    logic->hardware.dial_gpio_pin = config->dial_pin;
+    logic->hardware.dial_normal_state = 0;
+    logic->hardware.ringer_pwm_pin = -1;
 }
 
 void destroy_logic_backend(struct logic_backend* logic) {
@@ -160,12 +343,15 @@ int logic_backend_start(struct logic_backend* logic) {
 /**
  * Start the backend server. Assumes that the addrinfo structs are initialised
  * in the logic_backend.
+ * 
+ * Runs an event loop over the control socket, user input and timers until a
+ * state fails. While idle the loop sleeps in the kernel.
  */
 static int start_server(struct logic_backend* logic) {
     int res;
 
     // Initialise a connection
-    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
 
     // Check for valid socket id
     if (sockfd < 0) {
@@ -173,644 +359,2125 @@ static int start_server(struct logic_backend* logic) {
         return ST_FAIL;
     }
 
-    // Connect the receive socket
+    // Connect the control socket
     if ((res = connect(sockfd, (const struct sockaddr*)&logic->serverAddr, sizeof(logic->serverAddr)))) {
         stl_warn(errno, "Failed to connect to server");
+        close(sockfd);
+        return ST_FAIL;
+    }
+
+    configure_control_socket(sockfd);
+
+    struct node_context node;
+    memset(&node, 0, sizeof(node));
+    node.logic = logic;
+    node.sockfd = sockfd;
+    node.connected = true;
+    node.backoffMs = RECONNECT_MIN_MS;
+    init_message_buffer(&node.messages);
+    init_dial_plan(&node.plan);
+
+    if (init_event_loop(&node.loop) != ST_GOOD) {
+        close(sockfd);
+        return ST_FAIL;
+    }
+
+    res = event_loop_add(&node.loop, sockfd, EVENT_READ, &handle_socket, &node);
+
+    if (res == ST_GOOD && (node.requestTimer = event_loop_add_timer(&node.loop, &handle_request_timer, &node)) < 0) {
+        res = ST_FAIL;
+    }
+
+    if (res == ST_GOOD && (node.reconnectTimer = event_loop_add_timer(&node.loop, &handle_reconnect_timer, &node)) < 0) {
+        res = ST_FAIL;
+    }
+
+    if (res == ST_GOOD && (node.heartbeatTimer = event_loop_add_timer(&node.loop, &handle_heartbeat_timer, &node)) < 0) {
+        res = ST_FAIL;
+    }
+
+    if (res == ST_GOOD) {
+        res = event_loop_arm_timer(&node.loop, node.heartbeatTimer, HEARTBEAT_INTERVAL_MS, HEARTBEAT_INTERVAL_MS);
+    }
+
+#ifndef RASPBERRY_PI
+    if (res == ST_GOOD) {
+        res = event_loop_add(&node.loop, STDIN_FILENO, EVENT_READ, &handle_stdin, &node);
+    }
+#else
+    node.dial.fd = -1;
+    node.dial.writefd = -1;
+
+    pulse_decoder_conf_t dialConf;
+    dialConf.debounce_ns = (uint64_t)logic->conf->dial_debounce_ms * 1000000;
+    dialConf.digit_gap_ns = (uint64_t)logic->conf->dial_digit_gap_ms * 1000000;
+    dialConf.number_timeout_ns = (uint64_t)logic->conf->dial_timeout_ms * 1000000;
+    init_pulse_decoder(&node.decoder, &dialConf);
+    pulse_decoder_set_complete(&node.decoder, &number_in_plan, &node.plan);
+
+    if (res == ST_GOOD) {
+        res = open_gpio_edge_source(&node.dial, logic->conf->gpio_chip, logic->hardware.dial_gpio_pin);
+    }
+
+    if (res == ST_GOOD) {
+        res = event_loop_add(&node.loop, node.dial.fd, EVENT_READ, &handle_dial_edge, &node);
+    }
+
+    if (res == ST_GOOD && (node.dialTimer = event_loop_add_timer(&node.loop, &handle_dial_timer, &node)) < 0) {
         res = ST_FAIL;
+    }
+#endif
+
+    if (res != ST_GOOD) {
+        warn("Failed to initialise logic event loop");
         goto logic_server_cleanup;
     }
 
     // Initialise states
     struct server_state server;
-    server.logic = logic;
-    server.sockfd = sockfd;
+    memset(&server, 0, sizeof(server));
+    server.node = &node;
 
     struct handshake_state handshake;
     handshake.server = server;
-    handshake.server.state.start = &handshake_start;
+    handshake.server.state.name = "handshake";
+    handshake.server.state.enter = &handshake_enter;
 
     struct wait_for_call_state waitForCall;
     waitForCall.server = server;
+    waitForCall.server.state.name = "wait for call";
+    waitForCall.server.state.enter = &wait_for_call_enter;
+    waitForCall.server.state.on_message = &wait_for_call_message;
+    waitForCall.server.state.on_resume = &wait_for_call_resume;
 #ifdef RASPBERRY_PI
-    waitForCall.server.state.start = &wait_for_call_start_gpio;
-    waitForCall.gpio_dial_pin = logic->hardware.dial_gpio_pin;
+    waitForCall.server.state.on_dial = &wait_for_call_dial;
+    (void)wait_for_call_input;
 #else
-    waitForCall.server.state.start = &wait_for_call_start;
-    waitForCall.prompt_user = true;
+    waitForCall.server.state.on_input = &wait_for_call_input;
+    (void)wait_for_call_dial;
 #endif
 
     struct execute_external_call_state externalCall;
     externalCall.server = server;
-    externalCall.server.state.start = &execute_external_call;
-    externalCall.number_to_call = 0;
+    externalCall.server.state.name = "external call";
+    externalCall.server.state.enter = &external_call_enter;
 
     struct execute_ring_state ringBell;
     ringBell.server = server;
+    ringBell.server.state.name = "ring";
 #ifdef RASPBERRY_PI
-    ringBell.server.state.start = &execute_ring_gpio;
+    ringBell.server.state.enter = &execute_ring_gpio;
 #else
-    ringBell.server.state.start = &execute_ring;
+    ringBell.server.state.enter = &execute_ring;
+    ringBell.server.state.on_input = &execute_ring_input;
 #endif
+    ringBell.server.state.on_message = &execute_ring_message;
+    ringBell.server.state.on_resume = &execute_ring_resume;
 
     struct execute_call_state executeCall;
     executeCall.server = server;
-    executeCall.server.state.start = &execute_call;
+    executeCall.server.state.name = "call";
+    executeCall.server.state.enter = &execute_call;
+    executeCall.server.state.on_input = &execute_call_input;
+    executeCall.server.state.on_message = &execute_call_message;
+    executeCall.server.state.on_resume = &execute_call_resume;
+#ifdef RASPBERRY_PI
+    executeCall.server.state.on_dial = &execute_call_dial;
+#else
+    (void)execute_call_dial;
+#endif
     executeCall.server_udp_port = 0;
-    executeCall.prompt_user = true;
+    executeCall.other_number = 0;
+    memset(&executeCall.keys, 0, sizeof(executeCall.keys));
     executeCall.magic = 0xaa;
 
+    struct execute_page_state executePage;
+    executePage.server = server;
+    executePage.server.state.name = "page";
+    executePage.server.state.enter = &execute_page;
+    executePage.server.state.on_message = &execute_page_message;
+    executePage.server.state.on_resume = &execute_page_resume;
+#ifndef RASPBERRY_PI
+    executePage.server.state.on_input = &execute_page_input;
+#else
+    (void)execute_page_input;
+#endif
+
     // Ling together variables
     waitForCall.call_phone_number = &executeCall.other_number;
     waitForCall.from_phone_number = &executeCall.other_number;
     waitForCall.server_udp_port = &executeCall.server_udp_port;
 
+    waitForCall.keys = &executeCall.keys;
+
     ringBell.from_phone_number = &executeCall.other_number;
+    ringBell.keys = &executeCall.keys;
 
     externalCall.number_to_call = &executeCall.other_number;
     externalCall.server_udp_port = &executeCall.server_udp_port;
+    externalCall.keys = &executeCall.keys;
+
+    executePage.server_udp_port = &executeCall.server_udp_port;
+    executePage.other_number = &executeCall.other_number;
+    executePage.keys = &executeCall.keys;
 
     // Link together states
+    node.handshake = (struct state_t*)&handshake;
     handshake.wait_for_call = (struct state_t*)&waitForCall;
 
     waitForCall.make_call = (struct state_t*)&externalCall;
     waitForCall.accept_call = (struct state_t*)&ringBell;
+    waitForCall.listen_page = (struct state_t*)&executePage;
 
     externalCall.call = (struct state_t*)&executeCall;
+    externalCall.page = (struct state_t*)&executePage;
     externalCall.put_down_call = (struct state_t*)&waitForCall;
 
     ringBell.call = (struct state_t*)&executeCall;
     ringBell.put_down_call = (struct state_t*)&waitForCall;
 
     executeCall.put_down_call = (struct state_t*)&waitForCall;
+    executePage.put_down_call = (struct state_t*)&waitForCall;
 
-    struct state_t* currentState = (struct state_t*)&handshake;
-
-    res = ST_GOOD;
-
-    while (res == ST_GOOD) {
-        res = currentState->start(&currentState);
+    if ((res = transition(&node, (struct state_t*)&handshake)) == ST_GOOD) {
+        res = event_loop_run(&node.loop);
     }
 
+    // Never leave the audio running without a call
+    audio_backend_stop(logic->audio);
+
 logic_server_cleanup:
-    close(sockfd);
+    destroy_event_loop(&node.loop);
+#ifdef RASPBERRY_PI
+    close_edge_source(&node.dial);
+#endif
+    if (node.sockfd != -1) {
+        close(node.sockfd);
+    }
     return res;
 }
 
-static unsigned long __attribute((unused)) ts_to_micros(struct timespec* ts) {
-    return ts->tv_sec / 1000 + ts->tv_nsec * 1000000;
+/**
+ * Enter `next`, and any states its enter handler moves on to.
+ */
+static int transition(struct node_context* node, struct state_t* next) {
+    int res;
+
+    while (next != NULL) {
+        struct state_t* chained = NULL;
+
+        if (node->current != NULL && node->current != next) {
+            cancel_requests(node, node->current);
+        }
+
+        node->current = next;
+        info("Entered state %s", next->name);
+
+        if (next->enter != NULL && (res = next->enter(next, &chained)) != ST_GOOD) {
+            return res;
+        }
+
+        next = chained;
+    }
+
+    return ST_GOOD;
 }
 
 /**
- * Resolve a host name and port to an addrinfo struct.
- * 
- * Note that the pointer `result` must point to the correct addrinfo struct for
- * the socket type in hints, i.e. if the type is AF_INET, then it must point to
- * an addrinfo_in
+ * Read from the control socket and pass each complete message to the current
+ * state.
  */
-static int resolve_hostname(const char* hostname, const char* hostport, const struct addrinfo* hints, struct sockaddr* result, socklen_t* resultLength) {
-    // Info returned as a linked list, the next item in results.ai_next
-    struct addrinfo* foundAddr;
-    struct addrinfo* saved;
+static int handle_socket(struct event_loop* loop, int fd, uint32_t events, void* data) {
+    struct node_context* node = (struct node_context*)data;
+    int res;
 
-    int ret;
-    if ((ret = getaddrinfo(hostname, hostport, hints, &foundAddr))) {
-        warn("Failed to get address information for server: %s on port %s", hostname, hostport);
-        return ST_FAIL;
+    if (message_buffer_fill(&node->messages, fd) != ST_GOOD) {
+        warn("Lost connection to server, reconnecting");
+        return lose_connection(node);
     }
 
-    saved = foundAddr;
+    struct message_wrapper* msg;
 
-    // Find the first available ip address from hostname.
-    while (foundAddr != NULL) {
-        // Ensure address is ipv4
-        if (foundAddr->ai_family != hints->ai_family || foundAddr->ai_socktype != hints->ai_socktype) {
-            foundAddr = foundAddr->ai_next;
+    while (node->sockfd == fd && (msg = message_buffer_peek(&node->messages)) != NULL) {
+        struct state_t* state = node->current;
+        struct state_t* next = NULL;
+
+        if (node->resumeRequest != 0 && msg->request == node->resumeRequest) {
+            res = resume_reply(node, msg);
+            message_buffer_pop(&node->messages);
+
+            if (res != ST_GOOD) {
+                return res;
+            }
             continue;
         }
 
-        // Extract address
-        if (foundAddr->ai_family == AF_INET) {
-            // *(struct sockaddr_in*)result = *(struct sockaddr_in*)foundAddr->ai_addr;
-            memcpy(result, foundAddr->ai_addr, foundAddr->ai_addrlen);
-            *resultLength = foundAddr->ai_addrlen;
-        } else {
-            warn("Family not recognised in addrinfo");
-            foundAddr = foundAddr->ai_next;
-            continue;
+        if (msg->id == DIAL_PLAN) {
+            // The plan can be updated in any state
+            receive_dial_plan(node, msg);
+        } else if (msg->request != 0) {
+            if ((res = dispatch_reply(node, msg)) != ST_GOOD) {
+                return res;
+            }
+        } else if (state->on_message == NULL) {
+            warn("Ignoring message with id %x in state %s", msg->id, state->name);
+        } else if ((res = state->on_message(state, &next, msg)) != ST_GOOD) {
+            return res;
         }
 
-        char addrStr[39];
+        message_buffer_pop(&node->messages);
 
-        if (foundAddr->ai_family == AF_INET) {
-            inet_ntop(foundAddr->ai_family, &((struct sockaddr_in*)result)->sin_addr, addrStr, sizeof(addrStr));
+        if ((res = transition(node, next)) != ST_GOOD) {
+            return res;
         }
-        
-        info("Resolved hostname %s at %s on port %hu, socket type %s", hostname, addrStr, ntohs(((struct sockaddr_in*)foundAddr->ai_addr)->sin_port), foundAddr->ai_socktype == SOCK_STREAM ? "SOCK_STREAM" : "SOCK_DGRAM");
-
-        break;
     }
 
-    freeaddrinfo(saved);
-
-    return foundAddr != NULL ? ST_GOOD : ST_FAIL;
+    return ST_GOOD;
 }
 
-static int handshake_start(struct state_t** state) {
-    const struct handshake_state* handshake_state = (struct handshake_state*)*state;
-    ssize_t res;
-
-    info("Entered state handshake");
+/**
+ * Time out every request whose deadline has passed.
+ */
+static int handle_request_timer(struct event_loop* loop, int fd, uint32_t events, void* data) {
+    struct node_context* node = (struct node_context*)data;
+    const uint64_t nowNs = event_loop_now();
+    int res;
 
-    // Send handshake message
-    uint8_t msgBuffer[MESSAGE_WRAPPER_SIZE + sizeof(struct handshake_request)];
-    struct message_wrapper* wrapper = (struct message_wrapper*)msgBuffer;
+    for (int i = 0; i < NODE_MAX_REQUESTS; i++) {
+        struct pending_request request = node->requests[i];
 
-    wrapper->start = MESSAGE_WRAPPER_START;
-    wrapper->id = HANDSHAKE_REQUEST;
-    wrapper->length = sizeof(struct handshake_request);
+        if (request.id == 0 || request.deadlineNs > nowNs) {
+            continue;
+        }
 
-    struct handshake_request* msgData = (struct handshake_request*)wrapper->data;
+        node->requests[i].id = 0;
+        warn("Request %u with id %x timed out", request.id, request.msgId);
 
-    msgData->phone_number = htons(handshake_state->server.logic->conf->phone_number);
-    strncpy(msgData->magic, HANDSHAKE_MAGIC, sizeof(HANDSHAKE_MAGIC));
-    
-    res = send(handshake_state->server.sockfd, (void*)msgBuffer, sizeof(msgBuffer), 0);
+        struct state_t* next = NULL;
 
-    if (res == -1) {
-        stl_warn(errno, "Failed to send handshake request");
-        return ST_FAIL;
-    }
+        if ((res = request.on_reply(request.state, &next, NULL)) != ST_GOOD) {
+            return res;
+        }
 
-    if (res != sizeof(msgBuffer)) {
-        warn("Failed to send handshake request");
-        return ST_FAIL;
+        if ((res = transition(node, next)) != ST_GOOD) {
+            return res;
+        }
     }
 
-    // Listen for response
-    uint8_t respBuffer[MESSAGE_WRAPPER_SIZE + sizeof(struct handshake_response)];
-    
-    res = read(handshake_state->server.sockfd, respBuffer, sizeof(respBuffer));
+    return arm_request_timer(node);
+}
 
-    if (res == -1) {
-        stl_warn(errno, "Failed to receive handshake request");
-        return ST_FAIL;
-    }
+/**
+ * Tell the server the node is still there, so it can drop a node that has
+ * gone without it noticing. A connection that cannot take it is lost.
+ */
+static int handle_heartbeat_timer(struct event_loop* loop, int fd, uint32_t events, void* data) {
+    struct node_context* node = (struct node_context*)data;
 
-    if (res != sizeof(respBuffer)) {
-        warn("Size of received handshake response message not valid");
-        return ST_FAIL;
+    if (!node->connected || send_wrapped_message(node->sockfd, HEARTBEAT, 0, NULL, 0) == ST_GOOD) {
+        return ST_GOOD;
     }
 
-    wrapper = (struct message_wrapper*)respBuffer;
+    warn("Failed to send a heartbeat, reconnecting");
+    return lose_connection(node);
+}
 
-    if (wrapper->start != MESSAGE_WRAPPER_START) {
-        warn("Message start byte not valid");
-        return ST_FAIL;
-    }
+/**
+ * Send a request from `state`. `on_reply` is called with the reply, matched
+ * by request id, or with NULL after `timeoutMs`, as long as `state` is still
+ * current.
+ */
+static int send_request(struct state_t* state, uint8_t msgId, const void* data, uint8_t length, uint64_t timeoutMs, reply_handler_t on_reply) {
+    struct node_context* node = ((struct server_state*)state)->node;
+    struct pending_request* request = NULL;
 
-    if (wrapper->id != HANDSHAKE_RESPONSE) {
-        warn("Handshake response id invalid");
-        return ST_FAIL;
+    for (int i = 0; i < NODE_MAX_REQUESTS; i++) {
+        if (node->requests[i].id == 0) {
+            request = &node->requests[i];
+            break;
+        }
     }
 
-    if (wrapper->length != sizeof(struct handshake_response)) {
-        warn("Received message length invalid for handshake");
+    if (request == NULL) {
+        warn("Too many requests in flight to send id %x", msgId);
         return ST_FAIL;
     }
 
-    struct handshake_response* respMsg = (struct handshake_response*)wrapper->data;
+    const uint8_t id = next_request_id(node);
 
-    // Validate response
-    if (strncmp(HANDSHAKE_MAGIC, respMsg->magic, sizeof(HANDSHAKE_MAGIC)) != 0) {
-        warn("Handshake response magic invalid");
+    // Without a connection the request fails straight away, as if it timed out
+    if (node->connected && send_wrapped_message(node->sockfd, msgId, id, data, length) != ST_GOOD) {
         return ST_FAIL;
     }
 
-    // Save the phone number
-    handshake_state->server.logic->conf->phone_number = ntohs(respMsg->phone_number);
-
-    info("Handshake successful, allocated phone number: %hu", handshake_state->server.logic->conf->phone_number);
+    request->id = id;
+    request->msgId = msgId;
+    request->deadlineNs = event_loop_now() + (node->connected ? timeoutMs * 1000000 : 0);
+    request->state = state;
+    request->on_reply = on_reply;
 
-    // All good so move to next state
-    *state = handshake_state->wait_for_call;
-    return ST_GOOD;
+    return arm_request_timer(node);
 }
 
-static int no_block_check_receive_call(const struct wait_for_call_state* state, bool* received) {
-    // Get received data
-    uint8_t msgBuffer[MESSAGE_WRAPPER_SIZE + sizeof(struct incoming_call)];
+/**
+ * Ids wrap, skipping 0 and any still in flight.
+ */
+static uint8_t next_request_id(struct node_context* node) {
+    bool inUse;
 
-    // Non-blocking read on the socket
-    ssize_t recvBytes = recv(state->server.sockfd, &msgBuffer, sizeof(msgBuffer), MSG_DONTWAIT);
+    do {
+        node->nextRequestId = node->nextRequestId == UINT8_MAX ? 1 : node->nextRequestId + 1;
+        inUse = node->resumeRequest == node->nextRequestId;
 
-    if (recvBytes == -1 && (errno != EAGAIN && errno != EWOULDBLOCK)) {
-        // Socket error
-        stl_warn(errno, "Socket error reading incoming call");
-        return ST_FAIL;
-    }
+        for (int i = 0; i < NODE_MAX_REQUESTS; i++) {
+            inUse |= node->requests[i].id == node->nextRequestId;
+        }
+    } while (inUse);
 
-    if (recvBytes == -1 || recvBytes != sizeof(msgBuffer)) {
-        // No valid data
-        return ST_GOOD;
-    } else {
-        void* msg = receive_wrapped_message(msgBuffer, recvBytes, sizeof(struct incoming_call), INCOMING_CALL);
+    return node->nextRequestId;
+}
 
-        if (msg == NULL) {
-            // Invalid message so ignore
-            warn("Received invalid message when waiting for incoming call");
-            return ST_GOOD;
+/**
+ * Pass a reply to the handler of the request it answers.
+ */
+static int dispatch_reply(struct node_context* node, struct message_wrapper* msg) {
+    for (int i = 0; i < NODE_MAX_REQUESTS; i++) {
+        struct pending_request request = node->requests[i];
+
+        if (request.id != msg->request) {
+            continue;
         }
 
-        struct incoming_call* call = (struct incoming_call*)msg;
-        
-        *state->from_phone_number = ntohs(call->from_phone_number);
-        *state->server_udp_port = ntohs(call->udp_server_port);
+        node->requests[i].id = 0;
+        arm_request_timer(node);
 
-        info("Received call from %d", *state->from_phone_number);
-        *received = true;
+        struct state_t* next = NULL;
+        int res;
 
-        return ST_GOOD;
+        if ((res = request.on_reply(request.state, &next, msg)) != ST_GOOD) {
+            return res;
+        }
+
+        return transition(node, next);
     }
-}
 
-// Also needs a function for checking for server messages at, for example, 2Hz
-static int INTERCOM_RPI_FUNCTION wait_for_call_start_gpio(struct state_t** state) {
-#ifdef RASPBERRY_PI
-    const struct wait_for_call_state* wait_for_call_state = (struct wait_for_call_state*)*state;
-    info("Entered state wait for call start gpio");
+    info("Dropping message with id %x for request %u, no longer waiting", msg->id, msg->request);
+    return ST_GOOD;
+}
 
-    // Listen for changes on the gpio pin
-    int pulses = 0;
+static void cancel_requests(struct node_context* node, const struct state_t* state) {
+    for (int i = 0; i < NODE_MAX_REQUESTS; i++) {
+        if (node->requests[i].id != 0 && node->requests[i].state == state) {
+            node->requests[i].id = 0;
+        }
+    }
 
-    // According to the hardware spec, the pin should be normally grounded 
-    int pinState;
-    int debouncedState = LOW;
+    arm_request_timer(node);
+}
 
-    // If the pin is up, then wait for it to fall
-    int attempts = 0;
-    while ((pinState = digitalRead(wait_for_call_state->gpio_dial_pin)) == HIGH) {
-        warn("Dial pin is supposed to be normally grounded, it was high");
-        usleep(200 * 1000);
+static int arm_request_timer(struct node_context* node) {
+    uint64_t deadlineNs = 0;
 
-        if (attempts++ >= 10) {
-            return ST_FAIL;
+    for (int i = 0; i < NODE_MAX_REQUESTS; i++) {
+        if (node->requests[i].id != 0 && (deadlineNs == 0 || node->requests[i].deadlineNs < deadlineNs)) {
+            deadlineNs = node->requests[i].deadlineNs;
         }
     }
 
-    // TODO For now this only allows single digit dialing.
-    // 1ms
-    const long debounceUs = 1000;
-    // 1s
-    const long callCommitUs = 1000000;
-
-    unsigned long lastChangeUs;
+    if (deadlineNs == 0) {
+        return event_loop_disarm_timer(&node->loop, node->requestTimer);
+    }
 
-    struct timespec ts;
+    const uint64_t nowNs = event_loop_now();
+    const uint64_t delayMs = deadlineNs > nowNs ? (deadlineNs - nowNs + 999999) / 1000000 : 0;
 
-    int res = clock_gettime(CLOCK_REALTIME, &ts);
-    if (res != 0) {
-        stl_warn(errno, "Failed to initialise clock time");
-        return ST_FAIL;
-    }
+    return event_loop_arm_timer(&node->loop, node->requestTimer, delayMs, 0);
+}
 
-    lastChangeUs = 0;
+/**
+ * Drop the control connection and start reconnecting. The state carries on,
+ * requests in flight fail as their replies can no longer come.
+ */
+static int lose_connection(struct node_context* node) {
+    drop_attempt(node);
+    node->connected = false;
+    node->resumeRequest = 0;
+    node->backoffMs = RECONNECT_MIN_MS;
 
-    // pinState is LOW when entering this function
-    int pinRead;
-    while (true) {
-        // Get the iteration time
-        if ((res = clock_gettime(CLOCK_REALTIME, &ts)) != 0) {
-            stl_warn(errno, "Failed to initialise clock time");
-            return ST_FAIL;
-        }
-        unsigned long currentUs = ts_to_micros(&ts);
+    const uint64_t nowNs = event_loop_now();
 
-        if ((pinRead = digitalRead(wait_for_call_state->gpio_dial_pin)) != pinState) {
-            pinState = pinRead;
-            lastChangeUs = currentUs;
+    for (int i = 0; i < NODE_MAX_REQUESTS; i++) {
+        if (node->requests[i].id == 0) {
+            continue;
         }
 
-        if (currentUs - lastChangeUs > debounceUs) {
-            debouncedState = pinState;
-            if (debouncedState == LOW) {
-                pulses++;
-            }
+        if (node->hasToken) {
+            node->requests[i].deadlineNs = nowNs;
+        } else {
+            // Without a session the handshake is simply sent again
+            node->requests[i].id = 0;
         }
+    }
 
-        if (debouncedState == LOW && currentUs - lastChangeUs > callCommitUs) {
-            // Transition to make call state
-            *wait_for_call_state->phone_number = pulses - 1;
-            *state = wait_for_call_state->make_call;
+    if (arm_request_timer(node) != ST_GOOD) {
+        return ST_FAIL;
+    }
 
-            info("Calling number %d", *wait_for_call_state->phone_number);
-            return ST_GOOD;
-        }
+    return schedule_reconnect(node);
+}
 
-        // Check for incoming calls
-        bool received_call;
-        no_block_check_receive_call(wait_for_call_state, &received_call);
-        
-        if (received_call) {
-            // Transition to accept call state
-            *state = wait_for_call_state->accept_call;
-            return ST_GOOD;
-        }
-        
-        // Sleep so we dont thrash
-        usleep(50);
+static void drop_attempt(struct node_context* node) {
+    if (node->sockfd == -1) {
+        return;
     }
-#else
-    error("Function not implemented");
-    return ST_GOOD;
-#endif
+
+    event_loop_remove(&node->loop, node->sockfd);
+    close(node->sockfd);
+    node->sockfd = -1;
+    init_message_buffer(&node->messages);
+}
+
+static int schedule_reconnect(struct node_context* node) {
+    const uint64_t delayMs = node->backoffMs;
+    node->backoffMs = MIN(node->backoffMs * 2, RECONNECT_MAX_MS);
+    return event_loop_arm_timer(&node->loop, node->reconnectTimer, delayMs, 0);
 }
 
-static int INTERCOM_FUNCTION wait_for_call_start(struct state_t** state) {
-    struct wait_for_call_state* wait_for_call_state = (struct wait_for_call_state*)*state;
+/**
+ * Start a connection attempt, or give up on one that took too long.
+ */
+static int handle_reconnect_timer(struct event_loop* loop, int fd, uint32_t events, void* data) {
+    struct node_context* node = (struct node_context*)data;
 
-    if (wait_for_call_state->prompt_user) {
-        wait_for_call_state->prompt_user = false;
-        prompt("Enter a number to call: ");
-        fflush(stdout);
+    if (node->sockfd != -1) {
+        warn("Reconnect attempt timed out");
+        drop_attempt(node);
+        return schedule_reconnect(node);
     }
 
-    // Nonblocking read of stdin
-    char stdinBuf[16] = { 0 };
-    ssize_t bytesRead = read(STDIN_FILENO, stdinBuf, sizeof(stdinBuf));
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
 
-    if (bytesRead == -1) {
-        if (errno != EAGAIN && errno != EWOULDBLOCK) {
-            stl_warn(errno, "Error when reading stdin");
-        }
-    } else if (bytesRead != 0) {
-        char* endPtr;
-        wait_for_call_state->prompt_user = true;
+    if (sockfd < 0) {
+        stl_warn(errno, "Failed to create socket to reconnect");
+        return schedule_reconnect(node);
+    }
 
-        int phone_number = (int)strtoul(stdinBuf, &endPtr, 10);
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
 
-        if (endPtr != stdinBuf) {
-            info("Calling number %d", phone_number);
+    if (connect(sockfd, (const struct sockaddr*)&node->logic->serverAddr, sizeof(node->logic->serverAddr)) == -1 && errno != EINPROGRESS) {
+        close(sockfd);
+        return schedule_reconnect(node);
+    }
 
-            *wait_for_call_state->call_phone_number = phone_number;
-            *state = wait_for_call_state->make_call;
-        }
+    if (event_loop_add(loop, sockfd, EVENT_WRITE, &handle_connecting, node) != ST_GOOD) {
+        close(sockfd);
+        return schedule_reconnect(node);
     }
 
-    // Check for incoming calls
-    bool received_call = false;
-    int err = no_block_check_receive_call(wait_for_call_state, &received_call);
+    node->sockfd = sockfd;
+    return event_loop_arm_timer(loop, node->reconnectTimer, RECONNECT_ATTEMPT_MS, 0);
+}
+
+static int handle_connecting(struct event_loop* loop, int fd, uint32_t events, void* data) {
+    struct node_context* node = (struct node_context*)data;
+    int err = 0;
+    socklen_t errLen = sizeof(err);
 
-    if (err != ST_GOOD) {
-        warn("Failed to check if receiving a call");
-        return err;
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errLen) == -1 || err != 0) {
+        drop_attempt(node);
+        return schedule_reconnect(node);
     }
-    
-    if (received_call) {
-        // Transition to accept call state
-        // Assumes necessary variables set in receive call function
-        info("Received call, ringing bell");
-        wait_for_call_state->prompt_user = true;
-        *state = wait_for_call_state->accept_call;
+
+    // Sends block like on the first connection, reads come from the loop
+    event_loop_remove(loop, fd);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    configure_control_socket(fd);
+
+    if (event_loop_add(loop, fd, EVENT_READ, &handle_socket, node) != ST_GOOD) {
+        close(fd);
+        node->sockfd = -1;
+        return schedule_reconnect(node);
+    }
+
+    info("Reconnected to server");
+    return connection_ready(node);
+}
+
+/**
+ * Resume the session on a new connection, or start over without one. The
+ * reconnect timer stays armed until the server answers.
+ */
+static int connection_ready(struct node_context* node) {
+    if (!node->hasToken) {
+        event_loop_disarm_timer(&node->loop, node->reconnectTimer);
+        node->connected = true;
+        return transition(node, node->handshake);
+    }
+
+    struct resume_request request;
+    memcpy(request.token, node->token, SESSION_TOKEN_SIZE);
+
+    const uint8_t id = next_request_id(node);
+
+    if (send_wrapped_message(node->sockfd, RESUME_REQUEST, id, &request, sizeof(request)) != ST_GOOD) {
+        return lose_connection(node);
+    }
+
+    node->resumeRequest = id;
+    return ST_GOOD;
+}
+
+static int resume_reply(struct node_context* node, struct message_wrapper* msg) {
+    node->resumeRequest = 0;
+    event_loop_disarm_timer(&node->loop, node->reconnectTimer);
+
+    struct resume_response* resume = receive_wrapped_message(msg, MESSAGE_WRAPPER_SIZE + msg->length, sizeof(struct resume_response), RESUME_RESPONSE);
+
+    if (resume == NULL) {
+        warn("Expected a resume response, received id %x", msg->id);
+        return lose_connection(node);
+    }
+
+    node->connected = true;
+    node->backoffMs = RECONNECT_MIN_MS;
+
+    if (!resume->accepted) {
+        // The session expired, so any call went with it
+        info("Session expired, starting a new one");
+        node->hasToken = false;
+        audio_backend_stop(node->logic->audio);
+        return transition(node, node->handshake);
+    }
+
+    info("Resumed session for %hu", ntohs(resume->phone_number));
+
+    struct state_t* state = node->current;
+    struct state_t* next = NULL;
+    int res;
+
+    if (state->on_resume != NULL && (res = state->on_resume(state, &next, resume)) != ST_GOOD) {
+        return res;
+    }
+
+    return transition(node, next);
+}
+
+/**
+ * Collect user input and pass each complete line to the current state.
+ */
+static int INTERCOM_FUNCTION handle_stdin(struct event_loop* loop, int fd, uint32_t events, void* data) {
+#ifndef RASPBERRY_PI
+    struct node_context* node = (struct node_context*)data;
+    int res;
+
+    ssize_t bytesRead = read(fd, node->input + node->inputLength, sizeof(node->input) - node->inputLength - 1);
+
+    if (bytesRead == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            stl_warn(errno, "Error when reading stdin");
+        }
+        return ST_GOOD;
+    }
+
+    if (bytesRead == 0) {
+        // Input closed, stop watching it rather than waking up forever
+        event_loop_remove(loop, fd);
+        return ST_GOOD;
+    }
+
+    node->inputLength += bytesRead;
+    node->input[node->inputLength] = '\0';
+
+    char* newline;
+
+    while ((newline = strchr(node->input, '\n')) != NULL) {
+        *newline = '\0';
+
+        struct state_t* state = node->current;
+        struct state_t* next = NULL;
+
+        if (state->on_input != NULL && (res = state->on_input(state, &next, node->input)) != ST_GOOD) {
+            return res;
+        }
+
+        const size_t consumed = newline - node->input + 1;
+        memmove(node->input, newline + 1, node->inputLength - consumed + 1);
+        node->inputLength -= consumed;
+
+        if ((res = transition(node, next)) != ST_GOOD) {
+            return res;
+        }
+    }
+
+    // Drop a line too long to ever complete
+    if (node->inputLength == sizeof(node->input) - 1) {
+        warn("Input line too long");
+        node->inputLength = 0;
+    }
+#endif
+
+    return ST_GOOD;
+}
+
+/**
+ * Decode the dial from its line events. The kernel timestamps each edge, so
+ * decoding does not depend on when the loop wakes up.
+ */
+static int INTERCOM_RPI_FUNCTION handle_dial_edge(struct event_loop* loop, int fd, uint32_t events, void* data) {
+#ifdef RASPBERRY_PI
+    struct node_context* node = (struct node_context*)data;
+    int res;
+
+    if ((res = drain_dial_edges(node)) != ST_GOOD) {
+        return res;
+    }
+
+    return arm_dial_timer(node);
+#else
+    return ST_GOOD;
+#endif
+}
+
+/**
+ * A digit or number boundary has passed without another pulse.
+ */
+static int INTERCOM_RPI_FUNCTION handle_dial_timer(struct event_loop* loop, int fd, uint32_t events, void* data) {
+#ifdef RASPBERRY_PI
+    struct node_context* node = (struct node_context*)data;
+    int number;
+    int res;
+
+    // Edges from before the deadline may still be queued if the loop was slow
+    if ((res = drain_dial_edges(node)) != ST_GOOD) {
+        return res;
+    }
+
+    if (pulse_decoder_expire(&node->decoder, edge_source_now(), &number) && (res = dial_number(node, number)) != ST_GOOD) {
+        return res;
+    }
+
+    return arm_dial_timer(node);
+#else
+    return ST_GOOD;
+#endif
+}
+
+static int INTERCOM_RPI_FUNCTION drain_dial_edges(struct node_context* node) {
+#ifdef RASPBERRY_PI
+    dial_edge_t edges[EDGE_SOURCE_BATCH];
+    int count;
+    int number;
+    int res;
+
+    while ((count = node->dial.read(&node->dial, edges, EDGE_SOURCE_BATCH)) > 0) {
+        for (int i = 0; i < count; i++) {
+            if (pulse_decoder_edge(&node->decoder, &edges[i], &number) && (res = dial_number(node, number)) != ST_GOOD) {
+                return res;
+            }
+        }
+    }
+
+    return count == 0 ? ST_GOOD : ST_FAIL;
+#else
+    return ST_GOOD;
+#endif
+}
+
+static int INTERCOM_RPI_FUNCTION arm_dial_timer(struct node_context* node) {
+#ifdef RASPBERRY_PI
+    const uint64_t deadlineNs = pulse_decoder_deadline(&node->decoder);
+
+    if (deadlineNs == 0) {
+        return event_loop_disarm_timer(&node->loop, node->dialTimer);
+    }
+
+    const uint64_t nowNs = edge_source_now();
+    const uint64_t delayMs = deadlineNs > nowNs ? (deadlineNs - nowNs + 999999) / 1000000 : 0;
+
+    return event_loop_arm_timer(&node->loop, node->dialTimer, delayMs, 0);
+#else
+    return ST_GOOD;
+#endif
+}
+
+static int INTERCOM_RPI_FUNCTION dial_number(struct node_context* node, int number) {
+    struct state_t* state = node->current;
+    struct state_t* next = NULL;
+    int res;
+
+    if (state->on_dial == NULL) {
+        info("Ignoring dialled number %d in state %s", number, state->name);
+        return ST_GOOD;
+    }
+
+    if ((res = state->on_dial(state, &next, number)) != ST_GOOD) {
+        return res;
+    }
+
+    return transition(node, next);
+}
+
+/**
+ * Numbers in the dial plan are sent as soon as their last digit is dialled,
+ * without waiting for the dial timeout.
+ */
+static bool INTERCOM_RPI_FUNCTION number_in_plan(void* data, int number, int digits) {
+    return dial_plan_complete((const dial_plan_t*)data, number, digits);
+}
+
+/**
+ * Collect the numbers of a dial plan, which may span several messages, and
+ * replace the current plan once it is whole.
+ */
+static void receive_dial_plan(struct node_context* node, struct message_wrapper* msg) {
+    if (msg->length < sizeof(struct dial_plan_update) || (msg->length - sizeof(struct dial_plan_update)) % sizeof(uint16_t) != 0) {
+        warn("Received malformed dial plan");
+        return;
+    }
+
+    const struct dial_plan_update* update = (const struct dial_plan_update*)msg->data;
+    const int count = (msg->length - sizeof(struct dial_plan_update)) / sizeof(uint16_t);
+
+    if (update->flags & DIAL_PLAN_FIRST) {
+        node->planCount = 0;
+    }
+
+    for (int i = 0; i < count && node->planCount < DIAL_PLAN_MAX_NUMBERS; i++) {
+        node->planNumbers[node->planCount++] = ntohs(update->numbers[i]);
+    }
+
+    if ((update->flags & DIAL_PLAN_LAST) && dial_plan_build(&node->plan, node->planNumbers, node->planCount) == ST_GOOD) {
+        info("Received dial plan with %d numbers", node->plan.number_count);
+    }
+}
+
+/**
+ * Resolve a host name and port to an addrinfo struct.
+ * 
+ * Note that the pointer `result` must point to the correct addrinfo struct for
+ * the socket type in hints, i.e. if the type is AF_INET, then it must point to
+ * an addrinfo_in
+ */
+static int resolve_hostname(const char* hostname, const char* hostport, const struct addrinfo* hints, struct sockaddr* result, socklen_t* resultLength) {
+    // Info returned as a linked list, the next item in results.ai_next
+    struct addrinfo* foundAddr;
+    struct addrinfo* saved;
+
+    int ret;
+    if ((ret = getaddrinfo(hostname, hostport, hints, &foundAddr))) {
+        warn("Failed to get address information for server: %s on port %s", hostname, hostport);
+        return ST_FAIL;
+    }
+
+    saved = foundAddr;
+
+    // Find the first available ip address from hostname.
+    while (foundAddr != NULL) {
+        // Ensure address is ipv4
+        if (foundAddr->ai_family != hints->ai_family || foundAddr->ai_socktype != hints->ai_socktype) {
+            foundAddr = foundAddr->ai_next;
+            continue;
+        }
+
+        // Extract address
+        if (foundAddr->ai_family == AF_INET) {
+            // *(struct sockaddr_in*)result = *(struct sockaddr_in*)foundAddr->ai_addr;
+            memcpy(result, foundAddr->ai_addr, foundAddr->ai_addrlen);
+            *resultLength = foundAddr->ai_addrlen;
+        } else {
+            warn("Family not recognised in addrinfo");
+            foundAddr = foundAddr->ai_next;
+            continue;
+        }
+
+        char addrStr[39];
+
+        if (foundAddr->ai_family == AF_INET) {
+            inet_ntop(foundAddr->ai_family, &((struct sockaddr_in*)result)->sin_addr, addrStr, sizeof(addrStr));
+        }
+        
+        info("Resolved hostname %s at %s on port %hu, socket type %s", hostname, addrStr, ntohs(((struct sockaddr_in*)foundAddr->ai_addr)->sin_port), foundAddr->ai_socktype == SOCK_STREAM ? "SOCK_STREAM" : "SOCK_DGRAM");
+
+        break;
+    }
+
+    freeaddrinfo(saved);
+
+    return foundAddr != NULL ? ST_GOOD : ST_FAIL;
+}
+
+static int handshake_enter(struct state_t* state, struct state_t** next) {
+    struct handshake_state* handshake_state = (struct handshake_state*)state;
+
+    // Send handshake message
+    const intercom_conf_t* conf = handshake_state->server.node->logic->conf;
+
+    // The transfer engine decodes every codec, whatever it sends in
+    struct handshake_request request;
+    request.phone_number = htons(conf->phone_number);
+    strncpy(request.magic, HANDSHAKE_MAGIC, sizeof(HANDSHAKE_MAGIC));
+    request.wire_sample_rate = htonl(conf->wire_sample_rate);
+    request.codecs = MEDIA_CODECS_ALL;
+
+    if (send_request(state, HANDSHAKE_REQUEST, &request, sizeof(request), HANDSHAKE_TIMEOUT_MS, &handshake_reply) != ST_GOOD) {
+        warn("Failed to send handshake request");
+        return ST_FAIL;
+    }
+
+    return ST_GOOD;
+}
+
+static int handshake_reply(struct state_t* state, struct state_t** next, struct message_wrapper* msg) {
+    struct handshake_state* handshake_state = (struct handshake_state*)state;
+
+    if (msg == NULL) {
+        warn("Timed out waiting for handshake response");
+        return ST_FAIL;
+    }
+
+    struct handshake_response* respMsg = receive_wrapped_message(msg, MESSAGE_WRAPPER_SIZE + msg->length, sizeof(struct handshake_response), HANDSHAKE_RESPONSE);
+
+    if (respMsg == NULL) {
+        warn("Expected a handshake response, received id %x", msg->id);
+        return ST_FAIL;
+    }
+
+    // Validate response
+    if (strncmp(HANDSHAKE_MAGIC, respMsg->magic, sizeof(HANDSHAKE_MAGIC)) != 0) {
+        warn("Handshake response magic invalid");
+        return ST_FAIL;
+    }
+
+    // Save the phone number, and the token to resume the session with
+    struct node_context* node = handshake_state->server.node;
+    intercom_conf_t* conf = node->logic->conf;
+    conf->phone_number = ntohs(respMsg->phone_number);
+    memcpy(node->token, respMsg->token, SESSION_TOKEN_SIZE);
+    node->hasToken = true;
+
+    info("Handshake successful, allocated phone number: %hu", conf->phone_number);
+
+    // All good so move to next state
+    *next = handshake_state->wait_for_call;
+    return ST_GOOD;
+}
+
+static int wait_for_call_enter(struct state_t* state, struct state_t** next) {
+    struct wait_for_call_state* wait_for_call_state = (struct wait_for_call_state*)state;
+
+    // Nothing of the last call's keys or audio outlives it
+    memset(wait_for_call_state->keys, 0, sizeof(*wait_for_call_state->keys));
+    audio_backend_stop(wait_for_call_state->server.node->logic->audio);
+
+#ifndef RASPBERRY_PI
+    prompt("Enter a number to call: ");
+#endif
+    return ST_GOOD;
+}
+
+/**
+ * A number to call, with an r in front to ask for the call to be recorded.
+ */
+static int INTERCOM_FUNCTION wait_for_call_input(struct state_t* state, struct state_t** next, const char* line) {
+    struct wait_for_call_state* wait_for_call_state = (struct wait_for_call_state*)state;
+    const bool record = line[0] == 'r';
+    char* endPtr;
+
+    int phone_number = (int)strtoul(line + record, &endPtr, 10);
+
+    if (endPtr == line + record) {
+        prompt("Enter a number to call: ");
+        return ST_GOOD;
+    }
+
+    info("Calling number %d%s", phone_number, record ? ", asking for it to be recorded" : "");
+
+    wait_for_call_state->keys->record = record;
+
+    *wait_for_call_state->call_phone_number = phone_number;
+    *next = wait_for_call_state->make_call;
+    return ST_GOOD;
+}
+
+static int INTERCOM_RPI_FUNCTION wait_for_call_dial(struct state_t* state, struct state_t** next, int number) {
+    struct wait_for_call_state* wait_for_call_state = (struct wait_for_call_state*)state;
+
+    info("Calling number %d", number);
+
+    *wait_for_call_state->call_phone_number = number;
+    *next = wait_for_call_state->make_call;
+    return ST_GOOD;
+}
+
+static int wait_for_call_message(struct state_t* state, struct state_t** next, struct message_wrapper* msg) {
+    struct wait_for_call_state* wait_for_call_state = (struct wait_for_call_state*)state;
+
+    struct incoming_page* page = receive_wrapped_message(msg, MESSAGE_WRAPPER_SIZE + msg->length, sizeof(struct incoming_page), INCOMING_PAGE);
+
+    if (page != NULL) {
+        return listen_to_page(wait_for_call_state, next, page);
+    }
+
+    struct incoming_call* call = receive_wrapped_message(msg, MESSAGE_WRAPPER_SIZE + msg->length, sizeof(struct incoming_call), INCOMING_CALL);
+
+    if (call == NULL) {
+        // Invalid message so ignore
+        warn("Received invalid message when waiting for incoming call");
+        return ST_GOOD;
+    }
+
+    *wait_for_call_state->from_phone_number = ntohs(call->from_phone_number);
+    *wait_for_call_state->server_udp_port = ntohs(call->udp_server_port);
+
+    // The caller's key came with the call, so the audio path can be opened
+    // while the bell rings and is ready the moment the phone is picked up
+    struct call_keys* keys = wait_for_call_state->keys;
+    memcpy(keys->peer, call->public_key, sizeof(call->public_key));
+    keys->sender = MEDIA_SENDER_CALLEE;
+    keys->token = call->media_token;
+    keys->peer_media = call->caller_media;
+    keys->agreed = false;
+
+    if (refuse_relayed_clear(wait_for_call_state->server.node, call->flags, *wait_for_call_state->from_phone_number)) {
+        return send_client_terminate(&wait_for_call_state->server);
+    }
+
+    // Where media comes from goes with the ringing, so the relay can forward
+    // to it straight away and the caller can try it directly
+    struct call_ringing ringing;
+    ringing.phone_number = htons(wait_for_call_state->server.node->logic->conf->phone_number);
+    ringing.flags = 0;
+    own_media_candidate(wait_for_call_state->server.node, &ringing.media);
+
+    if (x25519_keypair(keys->secret, keys->own) != ST_GOOD || agree_media_key(keys) != ST_GOOD) {
+        return send_client_terminate(&wait_for_call_state->server);
+    }
+
+    memcpy(ringing.public_key, keys->own, sizeof(ringing.public_key));
+
+    if (start_call_audio(&wait_for_call_state->server, *wait_for_call_state->server_udp_port, keys, false) != ST_GOOD) {
+        warn("Failed to open the audio path while ringing");
+    }
+
+    if (send_wrapped_message(wait_for_call_state->server.node->sockfd, CALL_RINGING, 0, &ringing, sizeof(ringing)) != ST_GOOD) {
+        warn("Failed to tell the caller the phone is ringing");
+    }
+
+    info("Received call from %d, ringing bell", *wait_for_call_state->from_phone_number);
+    *next = wait_for_call_state->accept_call;
+    return ST_GOOD;
+}
+
+/**
+ * A page is answered without asking. The key to unwrap the page's key with
+ * is agreed with the pager's public key straight away, ours goes to the pager
+ * with the page listen.
+ */
+static int listen_to_page(struct wait_for_call_state* wait_for_call_state, struct state_t** next, const struct incoming_page* page) {
+    struct call_keys* keys = wait_for_call_state->keys;
+    struct node_context* node = wait_for_call_state->server.node;
+
+    *wait_for_call_state->from_phone_number = ntohs(page->from_phone_number);
+    *wait_for_call_state->server_udp_port = ntohs(page->udp_server_port);
+
+    memcpy(keys->peer, page->public_key, sizeof(page->public_key));
+    keys->sender = page->media_sender;
+    keys->token = page->media_token;
+    memset(&keys->peer_media, 0, sizeof(keys->peer_media));
+    keys->agreed = false;
+
+    // The pager's sender, or another listener's, would reuse their nonces
+    if (keys->sender < MEDIA_SENDER_LISTENER) {
+        warn("Page gave this node media sender %u", keys->sender);
+        return send_client_terminate(&wait_for_call_state->server);
+    }
+
+    if (x25519_keypair(keys->secret, keys->own) != ST_GOOD) {
+        return send_client_terminate(&wait_for_call_state->server);
+    }
+
+    const int res = media_crypto_derive(keys->page, keys->secret, keys->peer);
+    memset(keys->secret, 0, sizeof(keys->secret));
+
+    if (res != ST_GOOD) {
+        warn("Failed to agree a key with the pager");
+        return send_client_terminate(&wait_for_call_state->server);
+    }
+
+    struct page_listen listen;
+    listen.phone_number = htons(node->logic->conf->phone_number);
+    memcpy(listen.public_key, keys->own, sizeof(listen.public_key));
+    own_media_candidate(node, &listen.media);
+
+    if (send_wrapped_message(node->sockfd, PAGE_LISTEN, 0, &listen, sizeof(listen)) != ST_GOOD) {
+        warn("Failed to answer the page");
+    }
+
+    info("Paged by %d", *wait_for_call_state->from_phone_number);
+    *next = wait_for_call_state->listen_page;
+    return ST_GOOD;
+}
+
+/**
+ * A call the server still has for this node was lost with the connection, so
+ * end it.
+ */
+static int wait_for_call_resume(struct state_t* state, struct state_t** next, const struct resume_response* resume) {
+    struct wait_for_call_state* wait_for_call_state = (struct wait_for_call_state*)state;
+
+    if (resume->call_state == RESUME_NO_CALL) {
+        return ST_GOOD;
+    }
+
+    return send_client_terminate(&wait_for_call_state->server);
+}
+
+static int external_call_enter(struct state_t* state, struct state_t** next) {
+    struct execute_external_call_state* external_call_state = (struct execute_external_call_state*)state;
+
+    struct call_keys* keys = external_call_state->keys;
+    struct call_request request;
+    request.to_phone_number = htons(*external_call_state->number_to_call);
+    request.from_phone_number = htons(external_call_state->server.node->logic->conf->phone_number);
+
+    // The callee's key comes back once it rings
+    keys->sender = MEDIA_SENDER_CALLER;
+    keys->token = 0;
+    memset(&keys->peer_media, 0, sizeof(keys->peer_media));
+    keys->agreed = false;
+
+    own_media_candidate(external_call_state->server.node, &request.media);
+    request.flags = keys->record ? CALL_FLAG_RECORD : 0;
+
+    if (x25519_keypair(keys->secret, keys->own) != ST_GOOD) {
+        return ST_FAIL;
+    }
+
+    memcpy(request.public_key, keys->own, sizeof(request.public_key));
+
+    if (send_request(state, CALL_REQUEST, &request, sizeof(request), CALL_REQUEST_TIMEOUT_MS, &external_call_reply) != ST_GOOD) {
+        warn("Failed to send call request");
+        return ST_FAIL;
+    }
+
+    return ST_GOOD;
+}
+
+/**
+ * The server replies to a call request with either a call response or a
+ * terminate call.
+ */
+static int external_call_reply(struct state_t* state, struct state_t** next, struct message_wrapper* msg) {
+    struct execute_external_call_state* external_call_state = (struct execute_external_call_state*)state;
+
+    if (msg == NULL) {
+        // The server may still set the call up, make sure it is torn down
+        warn("Timed out waiting for call response");
+        *next = external_call_state->put_down_call;
+        return send_client_terminate(&external_call_state->server);
+    }
+
+    const size_t msgLen = MESSAGE_WRAPPER_SIZE + msg->length;
+    void* data;
+
+    if ((data = receive_wrapped_message(msg, msgLen, sizeof(struct call_response), CALL_RESPONSE)) != NULL) {
+        struct call_response* callResp = (struct call_response*)data;
+        *external_call_state->server_udp_port = ntohs(callResp->udp_server_port);
+        external_call_state->keys->token = callResp->media_token;
+        info("Call accepted on udp port: %hu", *external_call_state->server_udp_port);
+        *next = external_call_state->call;
+    } else if ((data = receive_wrapped_message(msg, msgLen, sizeof(struct page_response), PAGE_RESPONSE)) != NULL) {
+        struct page_response* pageResp = (struct page_response*)data;
+        *external_call_state->server_udp_port = ntohs(pageResp->udp_server_port);
+        external_call_state->keys->token = pageResp->media_token;
+        info("Paging on udp port: %hu", *external_call_state->server_udp_port);
+        *next = external_call_state->page;
+    } else if ((data = receive_wrapped_message(msg, msgLen, sizeof(struct terminate_call), TERMINATE_CALL)) != NULL) {
+        struct terminate_call* termCall = (struct terminate_call*)data;
+        info("Call terminated with code: %hu", termCall->err_code);
+        *next = external_call_state->put_down_call;
+    } else {
+        warn("Unexpected reply with id %x to call request", msg->id);
+        *next = external_call_state->put_down_call;
+        return send_client_terminate(&external_call_state->server);
+    }
+
+    return ST_GOOD;
+}
+
+static int INTERCOM_RPI_FUNCTION execute_ring_gpio(struct state_t* state, struct state_t** next) {
+    return ST_FAIL;
+}
+
+static int INTERCOM_FUNCTION execute_ring(struct state_t* state, struct state_t** next) {
+    prompt("Receiving call! Pickup (y/n): ");
+    return ST_GOOD;
+}
+
+static int INTERCOM_FUNCTION execute_ring_input(struct state_t* state, struct state_t** next, const char* line) {
+    struct execute_ring_state* ring_state = (struct execute_ring_state*)state;
+
+    if (line[0] == 'y') {
+        info("Picking up call");
+
+        struct incoming_response response;
+        response.from_phone_number = htons(ring_state->server.node->logic->conf->phone_number);
+        memcpy(response.public_key, ring_state->keys->own, sizeof(response.public_key));
+
+        if (!ring_state->keys->agreed) {
+            *next = ring_state->put_down_call;
+            return send_client_terminate(&ring_state->server);
+        }
+
+        // Speak straight away, the audio path opened while ringing. The call
+        // is connected once the server replies
+        audio_backend_answer(ring_state->server.node->logic->audio);
+
+        return send_request(state, INCOMING_RESPONSE, &response, sizeof(response), INCOMING_RESPONSE_TIMEOUT_MS, &execute_ring_reply);
+    }
+
+    if (line[0] == 'n') {
+        info("Putting down call");
+
+        if (send_client_terminate(&ring_state->server) != ST_GOOD) {
+            return ST_FAIL;
+        }
+
+        *next = ring_state->put_down_call;
+        return ST_GOOD;
+    }
+
+    warn("%s is not a vaild argument", line);
+    prompt("Pickup (y/n): ");
+    return ST_GOOD;
+}
+
+static int execute_ring_reply(struct state_t* state, struct state_t** next, struct message_wrapper* msg) {
+    struct execute_ring_state* ring_state = (struct execute_ring_state*)state;
+
+    if (msg == NULL) {
+        warn("Timed out connecting the call");
+        *next = ring_state->put_down_call;
+        return send_client_terminate(&ring_state->server);
+    }
+
+    if (receive_wrapped_message(msg, MESSAGE_WRAPPER_SIZE + msg->length, sizeof(struct call_response), CALL_RESPONSE) != NULL) {
+        *next = ring_state->call;
+        return ST_GOOD;
+    }
+
+    info("Call could not be connected, id %x", msg->id);
+    *next = ring_state->put_down_call;
+    return ST_GOOD;
+}
+
+static int execute_ring_message(struct state_t* state, struct state_t** next, struct message_wrapper* msg) {
+    struct execute_ring_state* ring_state = (struct execute_ring_state*)state;
+
+    if (receive_wrapped_message(msg, MESSAGE_WRAPPER_SIZE + msg->length, sizeof(struct record_call), RECORD_CALL) != NULL) {
+        info("The call will be recorded");
+        return ST_GOOD;
+    }
+
+    struct terminate_call* termCall = receive_wrapped_message(msg, MESSAGE_WRAPPER_SIZE + msg->length, sizeof(struct terminate_call), TERMINATE_CALL);
+
+    if (termCall == NULL) {
+        warn("Unexpected message with id %x while ringing", msg->id);
+        return ST_GOOD;
+    }
+
+    info("Caller hung up with code: %x", termCall->err_code);
+    *next = ring_state->put_down_call;
+    return ST_GOOD;
+}
+
+static int execute_ring_resume(struct state_t* state, struct state_t** next, const struct resume_response* resume) {
+    struct execute_ring_state* ring_state = (struct execute_ring_state*)state;
+
+    if (resume->call_state == RESUME_NO_CALL) {
+        info("Caller hung up while disconnected");
+        *next = ring_state->put_down_call;
+    }
+
+    return ST_GOOD;
+}
+
+static int execute_call(struct state_t* state, struct state_t** next) {
+    struct execute_call_state* call_state = (struct execute_call_state*)state;
+
+    info("Executing a call to number %d", call_state->other_number);
+
+    // A callee answered in the ring state, a caller waits to hear it has
+    call_state->answered = call_state->keys.sender == MEDIA_SENDER_CALLEE;
+    call_state->holding = false;
+    call_state->held = false;
+
+    if (!call_state->answered) {
+        info("Waiting for %d to answer", call_state->other_number);
+    }
+
+#ifndef RASPBERRY_PI
+    prompt("Press q to end call, h to hold it, or a and a number to add it: ");
+#endif
+    return ST_GOOD;
+}
+
+/**
+ * Open the audio path for a call that is still ringing, it goes live with
+ * audio_backend_answer(). The media key is wiped once handed over.
+ */
+static int start_call_audio(struct server_state* server, uint16_t udpPort, struct call_keys* keys, bool ringback) {
+    struct logic_backend* logic = server->node->logic;
+    audio_backend_start_info_t info;
+
+    memcpy(&info.serverAddr, &logic->serverAddr, logic->serverAddrLen);
+    info.serverAddrLen = logic->serverAddrLen;
+
+    info.serverAddr.sin_port = htons(udpPort);
+
+    memcpy(info.mediaKey, keys->media, MEDIA_KEY_SIZE);
+    info.mediaSender = keys->sender;
+    info.mediaToken = keys->token;
+
+    memset(&info.peerAddr, 0, sizeof(info.peerAddr));
+    info.peerAddr.sin_family = AF_INET;
+    info.peerAddr.sin_addr.s_addr = keys->peer_media.address;
+    info.peerAddr.sin_port = keys->peer_media.port;
+    info.early = true;
+    info.ringback = ringback;
+    info.listen = keys->sender >= MEDIA_SENDER_LISTENER;
+
+    int res = audio_backend_start(logic->audio, &info);
+
+    memset(info.mediaKey, 0, sizeof(info.mediaKey));
+    memset(keys->media, 0, sizeof(keys->media));
+    return res;
+}
+
+/**
+ * Where this node's media comes from, with the address it has on the network
+ * the server is reached over.
+ */
+static void own_media_candidate(struct node_context* node, struct media_candidate* candidate) {
+    struct sockaddr_in addr;
+    socklen_t addrLen = sizeof(addr);
+
+    memset(candidate, 0, sizeof(*candidate));
+
+    if (getsockname(node->sockfd, (struct sockaddr*)&addr, &addrLen) == -1) {
+        stl_warn(errno, "Failed to read the node's own address");
+        return;
+    }
+
+    candidate->address = addr.sin_addr.s_addr;
+    candidate->port = htons(audio_backend_media_port(node->logic->audio));
+}
+
+/**
+ * Warn of a call whose key is the server's rather than the peer's, so the
+ * server hears it in the clear. Returns true if the node refuses such calls.
+ */
+static bool refuse_relayed_clear(const struct node_context* node, uint8_t flags, int number) {
+    if (!(flags & CALL_FLAG_RELAYED_CLEAR)) {
+        return false;
+    }
+
+    if (node->logic->conf->refuse_relayed_clear) {
+        warn("Refusing the call with %d, the server would hear it in the clear", number);
+        return true;
+    }
+
+    warn("The call with %d is keyed with the server, which hears it in the clear", number);
+    return false;
+}
+
+static int agree_media_key(struct call_keys* keys) {
+    const int res = media_crypto_derive(keys->media, keys->secret, keys->peer);
+    memset(keys->secret, 0, sizeof(keys->secret));
+
+    if (res != ST_GOOD) {
+        warn("Failed to agree a key for the call");
+        return res;
+    }
+
+    keys->agreed = true;
+    return ST_GOOD;
+}
+
+static int INTERCOM_FUNCTION execute_call_input(struct state_t* state, struct state_t** next, const char* line) {
+    struct execute_call_state* call_state = (struct execute_call_state*)state;
+
+    if (line[0] == 'a') {
+        char* endPtr;
+        int number = (int)strtoul(line + 1, &endPtr, 10);
+
+        if (endPtr != line + 1) {
+            return add_to_call(state, number);
+        }
+    }
+
+    if (line[0] == 'h') {
+        return toggle_hold(state);
+    }
+
+    if (line[0] != 'q') {
+        warn("%s is an invalid argument", line);
+        prompt("Press q to end call, h to hold it, or a and a number to add it: ");
+        return ST_GOOD;
+    }
+
+    // Call ended
+    info("Terminated call");
+    audio_backend_stop(call_state->server.node->logic->audio);
+    *next = call_state->put_down_call;
+
+    return send_client_terminate(&call_state->server);
+}
+
+/**
+ * A number dialled during a call is added to it.
+ */
+static int INTERCOM_RPI_FUNCTION execute_call_dial(struct state_t* state, struct state_t** next, int number) {
+    return add_to_call(state, number);
+}
+
+static int add_to_call(struct state_t* state, int number) {
+    struct execute_call_state* call_state = (struct execute_call_state*)state;
+
+    struct conference_add add;
+    add.phone_number = htons(call_state->server.node->logic->conf->phone_number);
+    add.to_phone_number = htons(number);
+
+    info("Adding %d to the call", number);
+    return send_request(state, CONFERENCE_ADD, &add, sizeof(add), CONFERENCE_ADD_TIMEOUT_MS, &add_to_call_reply);
+}
+
+/**
+ * The server replies to an add with a conference join, or a terminate call
+ * if the number could not be added. Either way the call carries on.
+ */
+static int add_to_call_reply(struct state_t* state, struct state_t** next, struct message_wrapper* msg) {
+    struct execute_call_state* call_state = (struct execute_call_state*)state;
+
+    if (msg == NULL) {
+        warn("Timed out adding to the call");
+        return ST_GOOD;
+    }
+
+    const size_t msgLen = MESSAGE_WRAPPER_SIZE + msg->length;
+    void* data;
+
+    if ((data = receive_wrapped_message(msg, msgLen, sizeof(struct conference_join), CONFERENCE_JOIN)) != NULL) {
+        return join_conference(call_state, next, (struct conference_join*)data);
+    }
+
+    if ((data = receive_wrapped_message(msg, msgLen, sizeof(struct terminate_call), TERMINATE_CALL)) != NULL) {
+        info("Could not add to the call, code: %x", ((struct terminate_call*)data)->err_code);
+        return ST_GOOD;
+    }
+
+    warn("Unexpected reply with id %x to conference add", msg->id);
+    return ST_GOOD;
+}
+
+/**
+ * Move the call's media to the conference bridge, under a key agreed with it.
+ * The bridge only mixes members that have answered, so audio goes live
+ * straight away.
+ */
+static int join_conference(struct execute_call_state* call_state, struct state_t** next, const struct conference_join* join) {
+    struct call_keys* keys = &call_state->keys;
+    const uint16_t udpPort = ntohs(join->udp_server_port);
+
+    if (udpPort == call_state->server_udp_port && join->media_token == keys->token) {
+        return ST_GOOD;
+    }
+
+    if (refuse_relayed_clear(call_state->server.node, join->flags, call_state->other_number)) {
+        *next = call_state->put_down_call;
+        return send_client_terminate(&call_state->server);
+    }
+
+    if (rekey_call(keys, join->public_key, join->media_token) != ST_GOOD) {
+        return ST_FAIL;
+    }
+
+    struct conference_joined joined;
+    joined.phone_number = htons(call_state->server.node->logic->conf->phone_number);
+    memcpy(joined.public_key, keys->own, sizeof(joined.public_key));
+
+    if (send_wrapped_message(call_state->server.node->sockfd, CONFERENCE_JOINED, 0, &joined, sizeof(joined)) != ST_GOOD) {
+        warn("Failed to tell the server the call joined the conference");
+    }
+
+    if (restart_call_audio(call_state, udpPort) != ST_GOOD) {
+        warn("Failed to move the call's audio to the conference");
+        return ST_GOOD;
+    }
+
+    info("Call is now a conference on udp port %hu", udpPort);
+    return ST_GOOD;
+}
+
+/**
+ * The callee turned the call down or left it ringing, move the call's media
+ * to its mailbox to leave a message, as for a conference.
+ */
+static int leave_message(struct execute_call_state* call_state, struct state_t** next, const struct voicemail_divert* divert) {
+    struct call_keys* keys = &call_state->keys;
+    const intercom_conf_t* conf = call_state->server.node->logic->conf;
+    const uint16_t udpPort = ntohs(divert->udp_server_port);
+
+    if (udpPort == call_state->server_udp_port && divert->media_token == keys->token) {
+        return ST_GOOD;
+    }
+
+    if (refuse_relayed_clear(call_state->server.node, divert->flags, call_state->other_number)) {
+        *next = call_state->put_down_call;
+        return send_client_terminate(&call_state->server);
+    }
+
+    if (rekey_call(keys, divert->public_key, divert->media_token) != ST_GOOD) {
+        return ST_FAIL;
+    }
+
+    struct voicemail_joined joined;
+    joined.phone_number = htons(conf->phone_number);
+    memcpy(joined.public_key, keys->own, sizeof(joined.public_key));
+    joined.wire_sample_rate = htonl(conf->wire_sample_rate);
+
+    if (send_wrapped_message(call_state->server.node->sockfd, VOICEMAIL_JOINED, 0, &joined, sizeof(joined)) != ST_GOOD) {
+        warn("Failed to tell the server the call moved to the mailbox");
+    }
+
+    if (restart_call_audio(call_state, udpPort) != ST_GOOD) {
+        warn("Failed to move the call's audio to the mailbox");
+        return ST_GOOD;
     }
 
+    info("%d is not answering, leaving a message on udp port %hu", call_state->other_number, udpPort);
     return ST_GOOD;
 }
 
-// Need to make this non-blocking
-static int execute_external_call(struct state_t** state) {
-    struct execute_external_call_state* external_call_state = (struct execute_external_call_state*)*state;
-    ssize_t res;
+/**
+ * Agree a fresh media key with the server's end of the call, whose public
+ * key is `publicKey`, for media sent with `token`. A direct path to the old
+ * peer is no use any more.
+ */
+static int rekey_call(struct call_keys* keys, const uint8_t* publicKey, uint32_t token) {
+    memcpy(keys->peer, publicKey, MEDIA_PUBLIC_KEY_SIZE);
+    keys->token = token;
+    memset(&keys->peer_media, 0, sizeof(keys->peer_media));
+
+    if (x25519_keypair(keys->secret, keys->own) != ST_GOOD) {
+        return ST_FAIL;
+    }
 
-    info("Executing external call");
+    return agree_media_key(keys);
+}
 
-    uint8_t msgBuffer[MESSAGE_WRAPPER_SIZE + sizeof(struct call_request)];
-    struct message_wrapper* wrapper = (struct message_wrapper*)msgBuffer;
+/**
+ * Restart the call's audio on `udpPort` under the agreed key, live at once.
+ */
+static int restart_call_audio(struct execute_call_state* call_state, uint16_t udpPort) {
+    audio_backend_t* audio = call_state->server.node->logic->audio;
+    audio_backend_stop(audio);
+    call_state->server_udp_port = udpPort;
+    call_state->answered = true;
 
-    wrapper->start = MESSAGE_WRAPPER_START;
-    wrapper->id = CALL_REQUEST;
-    wrapper->length = sizeof(struct call_request);
+    if (start_call_audio(&call_state->server, udpPort, &call_state->keys, false) != ST_GOOD) {
+        return ST_FAIL;
+    }
 
-    struct call_request* request = (struct call_request*)wrapper->data;
+    return audio_backend_answer(audio);
+}
 
-    request->to_phone_number = htons(*external_call_state->number_to_call);
-    request->from_phone_number = htons(external_call_state->server.logic->conf->phone_number);
+static int execute_call_message(struct state_t* state, struct state_t** next, struct message_wrapper* msg) {
+    struct execute_call_state* call_state = (struct execute_call_state*)state;
 
-    res = send(external_call_state->server.sockfd, msgBuffer, sizeof(msgBuffer), 0);
+    const size_t msgLen = MESSAGE_WRAPPER_SIZE + msg->length;
+    struct conference_join* join = receive_wrapped_message(msg, msgLen, sizeof(struct conference_join), CONFERENCE_JOIN);
 
-    if (res == -1) {
-        stl_warn(errno, "Failed to send call request over socket");
-        return ST_FAIL;
+    if (join != NULL) {
+        return join_conference(call_state, next, join);
     }
 
-    if (res != sizeof(msgBuffer)) {
-        warn("Size of bytes sent for call request is not correct");
-        return ST_FAIL;
+    struct voicemail_divert* divert = receive_wrapped_message(msg, msgLen, sizeof(struct voicemail_divert), VOICEMAIL_DIVERT);
+
+    if (divert != NULL) {
+        return leave_message(call_state, next, divert);
     }
 
-    // Receive either a call response or terminate call
-    uint8_t respBuffer[MESSAGE_WRAPPER_SIZE + MAX(sizeof(struct call_response), sizeof(struct terminate_call))];
-    
-    res = recv(external_call_state->server.sockfd, respBuffer, sizeof(respBuffer), 0);
+    struct hold_start* start = receive_wrapped_message(msg, msgLen, sizeof(struct hold_start), HOLD_START);
 
-    void* msg;
+    if (start != NULL) {
+        return go_on_hold(call_state, start);
+    }
+
+    struct hold_key* holdKey = receive_wrapped_message(msg, msgLen, sizeof(struct hold_key), HOLD_KEY);
+
+    if (holdKey != NULL) {
+        return listen_to_hold(call_state, holdKey);
+    }
+
+    struct hold_end* end = receive_wrapped_message(msg, msgLen, sizeof(struct hold_end), HOLD_END);
+
+    if (end != NULL) {
+        return come_off_hold(call_state, end);
+    }
+
+    struct record_call* record = receive_wrapped_message(msg, msgLen, sizeof(struct record_call), RECORD_CALL);
+
+    if (record != NULL) {
+        return note_recording(call_state, record);
+    }
+
+    struct call_ringing* ringing = receive_wrapped_message(msg, msgLen, sizeof(struct call_ringing), CALL_RINGING);
+    struct call_answered* answered = receive_wrapped_message(msg, msgLen, sizeof(struct call_answered), CALL_ANSWERED);
+
+    if (ringing != NULL || answered != NULL) {
+        // Both are sent again after a resume, the key is only agreed once,
+        // and a call that has been on hold has moved on to another
+        if (!call_state->keys.agreed && !call_state->holding && !call_state->held) {
+            if (refuse_relayed_clear(call_state->server.node, ringing != NULL ? ringing->flags : answered->flags, call_state->other_number)) {
+                *next = call_state->put_down_call;
+                return send_client_terminate(&call_state->server);
+            }
+
+            memcpy(call_state->keys.peer, ringing != NULL ? ringing->public_key : answered->public_key, MEDIA_PUBLIC_KEY_SIZE);
+            call_state->keys.peer_media = ringing != NULL ? ringing->media : answered->callee_media;
+
+            if (agree_media_key(&call_state->keys) != ST_GOOD) {
+                *next = call_state->put_down_call;
+                return send_client_terminate(&call_state->server);
+            }
+
+            if (call_state->keys.recorded) {
+                seal_for_recorder(call_state);
+            }
+
+            if (start_call_audio(&call_state->server, call_state->server_udp_port, &call_state->keys, true) != ST_GOOD) {
+                warn("Failed to start call audio");
+            }
+
+            info("%d is ringing", call_state->other_number);
+        }
+
+        if (answered != NULL && !call_state->answered) {
+            info("Call answered");
+            call_state->answered = true;
+            audio_backend_answer(call_state->server.node->logic->audio);
+        }
 
-    if ((msg = receive_wrapped_message(respBuffer, res, sizeof(struct call_response), CALL_RESPONSE)) != NULL) {
-        struct call_response* callResp = (struct call_response*)msg;
-        *external_call_state->server_udp_port = ntohs(callResp->udp_server_port);
-        info("Call accepted on udp port: %hu", *external_call_state->server_udp_port);
-        *state = external_call_state->call;
         return ST_GOOD;
-    } else if ((msg = receive_wrapped_message(respBuffer, res, sizeof(struct call_response), CALL_RESPONSE)) != NULL) {
-        struct terminate_call* termCall = (struct terminate_call*)msg;
+    }
 
-        info("Call terminated with code: %hu", termCall->err_code);
-        *state = external_call_state->put_down_call;
+    struct terminate_call* termCall = receive_wrapped_message(msg, MESSAGE_WRAPPER_SIZE + msg->length, sizeof(struct terminate_call), TERMINATE_CALL);
+
+    if (termCall == NULL) {
+        warn("Received message was not terminate call");
         return ST_GOOD;
-    } else {
-        warn("Failed to parse received message");
-        return ST_FAIL;
     }
+
+    info("Server terminated call with code: %x", termCall->err_code);
+    audio_backend_stop(call_state->server.node->logic->audio);
+    *next = call_state->put_down_call;
+    return ST_GOOD;
 }
 
-static int INTERCOM_RPI_FUNCTION execute_ring_gpio(struct state_t** state) {
-    return ST_FAIL;
+/**
+ * The server records the call. The caller keeps the recorder's key to seal
+ * the media key to once it is agreed, which is before any audio. A key
+ * already handed to the audio cannot be sealed any more.
+ */
+static int note_recording(struct execute_call_state* call_state, const struct record_call* record) {
+    struct call_keys* keys = &call_state->keys;
+
+    info("The call is being recorded");
+
+    if (!record->seal || keys->recorded) {
+        return ST_GOOD;
+    }
+
+    if (keys->agreed) {
+        warn("The call's key is already in use, it cannot be sealed for the recorder");
+        return ST_GOOD;
+    }
+
+    memcpy(keys->recorder, record->public_key, sizeof(keys->recorder));
+    keys->recorded = true;
+    return ST_GOOD;
+}
+
+/**
+ * Seal the media key to the recorder, under a key agreed from a key pair made
+ * for it alone, so the call's own secret is still wiped as soon as it can be.
+ */
+static int seal_for_recorder(struct execute_call_state* call_state) {
+    struct call_keys* keys = &call_state->keys;
+    const intercom_conf_t* conf = call_state->server.node->logic->conf;
+
+    struct record_key record;
+    record.phone_number = htons(conf->phone_number);
+    record.wire_sample_rate = htonl(conf->wire_sample_rate);
+
+    uint8_t secret[X25519_KEY_SIZE];
+    uint8_t wrappingKey[MEDIA_KEY_SIZE];
+
+    keys->recorded = false;
+
+    int res = x25519_keypair(secret, record.public_key);
+
+    if (res == ST_GOOD) {
+        res = media_crypto_derive(wrappingKey, secret, keys->recorder);
+    }
+
+    memset(secret, 0, sizeof(secret));
+
+    if (res != ST_GOOD) {
+        warn("Failed to seal the call's key for the recorder");
+        return res;
+    }
+
+    media_crypto_wrap(record.wrapped_key, keys->media, wrappingKey);
+    memset(wrappingKey, 0, sizeof(wrappingKey));
+
+    return send_wrapped_message(call_state->server.node->sockfd, RECORD_KEY, 0, &record, sizeof(record));
 }
 
-static int INTERCOM_FUNCTION execute_ring(struct state_t** state) {
-    struct execute_ring_state* ring_state = (struct execute_ring_state*)*state;
-    info("Ringing the phone");
+/**
+ * Put the other side on hold, or take it off. Only a call of two can be put
+ * on hold, the server refuses the rest.
+ */
+static int INTERCOM_FUNCTION toggle_hold(struct state_t* state) {
+    struct execute_call_state* call_state = (struct execute_call_state*)state;
 
-    prompt("Receiving call! Pickup (y/n): ");
+    if (call_state->held) {
+        warn("%d has put the call on hold", call_state->other_number);
+        return ST_GOOD;
+    }
 
-    char linebuf[1024] = { 0 };
+    if (call_state->holding) {
+        return send_hold_off(call_state);
+    }
 
-    ssize_t bytesRead = 0;
+    struct call_hold hold;
+    memset(&hold, 0, sizeof(hold));
+    hold.phone_number = htons(call_state->server.node->logic->conf->phone_number);
+    hold.hold = 1;
 
-    while (1) {
-        bytesRead = read(STDIN_FILENO, &linebuf, sizeof(linebuf) - 1);
+    info("Putting %d on hold", call_state->other_number);
+    return send_request(state, CALL_HOLD, &hold, sizeof(hold), CALL_HOLD_TIMEOUT_MS, &toggle_hold_reply);
+}
 
-        if (bytesRead == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
-            stl_warn(errno, "Failed to read from stdin");
-        }
+/**
+ * The server replies to a hold with the hold, once the other side has been
+ * moved to the hold player, or a terminate call if it could not be. Either
+ * way the call carries on.
+ */
+static int toggle_hold_reply(struct state_t* state, struct state_t** next, struct message_wrapper* msg) {
+    struct execute_call_state* call_state = (struct execute_call_state*)state;
 
-        if (bytesRead <= 0) {
-            usleep(10000);
-            continue;
+    if (msg == NULL) {
+        warn("Timed out putting the call on hold");
+        return ST_GOOD;
+    }
+
+    const size_t msgLen = MESSAGE_WRAPPER_SIZE + msg->length;
+    void* data;
+
+    if (receive_wrapped_message(msg, msgLen, sizeof(struct call_hold), CALL_HOLD) != NULL) {
+        if (!call_state->holding) {
+            call_state->holding = true;
+            audio_backend_stop(call_state->server.node->logic->audio);
+            info("%d is on hold", call_state->other_number);
         }
 
-        if (linebuf[0] == 'n' || linebuf[0] == 'y') {
-            break;
+        return ST_GOOD;
+    }
+
+    if ((data = receive_wrapped_message(msg, msgLen, sizeof(struct terminate_call), TERMINATE_CALL)) != NULL) {
+        info("Could not put the call on hold, code: %x", ((struct terminate_call*)data)->err_code);
+        return ST_GOOD;
+    }
+
+    warn("Unexpected reply with id %x to call hold", msg->id);
+    return ST_GOOD;
+}
+
+/**
+ * Take the other side off hold, with the public key of a fresh key pair to
+ * agree the call's new key. The pair is kept until the other side's key
+ * arrives, so the same one is sent again after a reconnect.
+ */
+static int send_hold_off(struct execute_call_state* call_state) {
+    struct call_keys* keys = &call_state->keys;
+
+    if (keys->agreed) {
+        if (x25519_keypair(keys->secret, keys->own) != ST_GOOD) {
+            return ST_FAIL;
         }
 
-        warn("%s is not a vaild argument", linebuf);
-        memset(linebuf, 0, sizeof(linebuf));
-        prompt("Pickup (y/n): ");
+        keys->agreed = false;
+        info("Taking %d off hold", call_state->other_number);
     }
 
-    if (linebuf[0] == 'y') {
-        info("Picking up call");
-        *state = ring_state->call;
+    struct call_hold hold;
+    memset(&hold, 0, sizeof(hold));
+    hold.phone_number = htons(call_state->server.node->logic->conf->phone_number);
+    memcpy(hold.public_key, keys->own, sizeof(hold.public_key));
+
+    return send_wrapped_message(call_state->server.node->sockfd, CALL_HOLD, 0, &hold, sizeof(hold));
+}
+
+/**
+ * The other side put the call on hold. Agree a key with the server to have
+ * the hold program's key sealed under, as a page listener does with the
+ * pager, and stop the call's audio until it arrives.
+ */
+static int go_on_hold(struct execute_call_state* call_state, const struct hold_start* start) {
+    struct call_keys* keys = &call_state->keys;
+    struct node_context* node = call_state->server.node;
+
+    // The player's sender, or another call's on hold, would reuse their nonces
+    if (start->media_sender < MEDIA_SENDER_LISTENER) {
+        warn("Hold gave this node media sender %u", start->media_sender);
         return ST_GOOD;
-    } else {
-        info("Putting down call");
+    }
 
-        // Send terminate request
-        uint8_t msgSendBuffer[MESSAGE_WRAPPER_SIZE + sizeof(struct client_terminate_call)];
-        struct message_wrapper* wrapper = (struct message_wrapper*)msgSendBuffer;
-        
-        wrapper->start = MESSAGE_WRAPPER_START;
-        wrapper->id = CLIENT_TERMINATE_CALL;
-        wrapper->length = sizeof(struct client_terminate_call);
+    if (x25519_keypair(keys->secret, keys->own) != ST_GOOD) {
+        return ST_FAIL;
+    }
+
+    const int res = media_crypto_derive(keys->page, keys->secret, start->public_key);
+    memset(keys->secret, 0, sizeof(keys->secret));
+
+    if (res != ST_GOOD) {
+        warn("Failed to agree a key for the hold");
+        return res;
+    }
+
+    memcpy(keys->peer, start->public_key, MEDIA_PUBLIC_KEY_SIZE);
+    keys->sender = start->media_sender;
+    keys->token = start->media_token;
+    memset(&keys->peer_media, 0, sizeof(keys->peer_media));
+    keys->agreed = false;
+
+    if (!call_state->held) {
+        audio_backend_stop(node->logic->audio);
+        info("%d put the call on hold", call_state->other_number);
+    }
+
+    call_state->held = true;
+    call_state->server_udp_port = ntohs(start->udp_server_port);
+
+    struct hold_joined joined;
+    joined.phone_number = htons(node->logic->conf->phone_number);
+    memcpy(joined.public_key, keys->own, sizeof(joined.public_key));
+
+    return send_wrapped_message(node->sockfd, HOLD_JOINED, 0, &joined, sizeof(joined));
+}
+
+/**
+ * Unwrap the hold program's key and listen to it. A key that does not
+ * unwrap is ignored.
+ */
+static int listen_to_hold(struct execute_call_state* call_state, const struct hold_key* key) {
+    struct call_keys* keys = &call_state->keys;
+
+    if (!call_state->held || keys->agreed) {
+        return ST_GOOD;
+    }
+
+    if (media_crypto_unwrap(keys->media, key->wrapped_key, keys->page) != ST_GOOD) {
+        warn("Hold key did not unwrap");
+        return ST_GOOD;
+    }
+
+    memset(keys->page, 0, sizeof(keys->page));
+    keys->agreed = true;
+
+    if (start_call_audio(&call_state->server, call_state->server_udp_port, keys, false) != ST_GOOD) {
+        warn("Failed to start hold audio");
+    }
+
+    return ST_GOOD;
+}
 
-        struct client_terminate_call* termCall = (struct client_terminate_call*)wrapper->data;
-        termCall->err_code = CALL_PUTDOWN;
-        termCall->phone_number = htons(ring_state->server.logic->conf->phone_number);
+/**
+ * The call is off hold, move back to its relay under a key agreed with the
+ * other side's new public key. The side that was on hold answers with its
+ * own, the holder sent its when it took the call off hold.
+ */
+static int come_off_hold(struct execute_call_state* call_state, const struct hold_end* end) {
+    struct call_keys* keys = &call_state->keys;
+    struct node_context* node = call_state->server.node;
+    const uint16_t udpPort = ntohs(end->udp_server_port);
+
+    if (end->media_sender >= MEDIA_SENDER_LISTENER) {
+        warn("Hold end gave this node media sender %u", end->media_sender);
+        return ST_GOOD;
+    }
+
+    if (call_state->holding) {
+        // Sent again after a reconnect, the key is only agreed once
+        if (keys->agreed) {
+            return ST_GOOD;
+        }
 
-        ssize_t bytesSent = send(ring_state->server.sockfd, msgSendBuffer, sizeof(msgSendBuffer), 0);
+        memcpy(keys->peer, end->public_key, MEDIA_PUBLIC_KEY_SIZE);
+        keys->sender = end->media_sender;
+        keys->token = end->media_token;
+        memset(&keys->peer_media, 0, sizeof(keys->peer_media));
 
-        if (bytesSent == -1) {
-            stl_error(errno, "Failed to terminate call");
+        if (agree_media_key(keys) != ST_GOOD) {
+            return ST_FAIL;
         }
+    } else {
+        keys->sender = end->media_sender;
+        memset(keys->page, 0, sizeof(keys->page));
 
-        if (bytesSent != sizeof(msgSendBuffer)) {
-            warn("Failed to send full terminate message");
+        if (rekey_call(keys, end->public_key, end->media_token) != ST_GOOD) {
             return ST_FAIL;
         }
 
-        *state = ring_state->put_down_call;
+        struct hold_joined joined;
+        joined.phone_number = htons(node->logic->conf->phone_number);
+        memcpy(joined.public_key, keys->own, sizeof(joined.public_key));
+
+        if (send_wrapped_message(node->sockfd, HOLD_JOINED, 0, &joined, sizeof(joined)) != ST_GOOD) {
+            warn("Failed to tell the server the call came off hold");
+        }
+    }
+
+    call_state->holding = false;
+    call_state->held = false;
+
+    if (restart_call_audio(call_state, udpPort) != ST_GOOD) {
+        warn("Failed to move the call's audio back from hold");
         return ST_GOOD;
     }
+
+    info("Call with %d is off hold on udp port %hu", call_state->other_number, udpPort);
+    return ST_GOOD;
 }
 
-static int INTERCOM_RPI_FUNCTION execute_call_gpio(struct state_t** state) {
-    return ST_FAIL;
+/**
+ * The audio runs over udp and carries on through a reconnect, unless the call
+ * ended in the meantime. A caller may still be waiting for an answer.
+ */
+static int execute_call_resume(struct state_t* state, struct state_t** next, const struct resume_response* resume) {
+    struct execute_call_state* call_state = (struct execute_call_state*)state;
+
+    // Taking the call off hold may have been lost with the connection
+    if (resume->call_state != RESUME_NO_CALL && call_state->holding && !call_state->keys.agreed) {
+        return send_hold_off(call_state);
+    }
+
+    if (resume->call_state != RESUME_NO_CALL) {
+        return ST_GOOD;
+    }
+
+    info("Call ended while disconnected");
+    audio_backend_stop(call_state->server.node->logic->audio);
+    *next = call_state->put_down_call;
+    return ST_GOOD;
 }
 
-// TODO : Make nonblocking
-static int INTERCOM_FUNCTION execute_call(struct state_t** state) {
-    struct execute_call_state* call_state = (struct execute_call_state*)*state;
-    info("Executing a call to number %d", call_state->other_number);
+/**
+ * A pager makes up the page's key and speaks straight away, listeners hear
+ * it once their key arrives. A listener never sends audio.
+ */
+static int execute_page(struct state_t* state, struct state_t** next) {
+    struct execute_page_state* page_state = (struct execute_page_state*)state;
+    struct call_keys* keys = page_state->keys;
 
-    // Just start the audio backend
-    audio_backend_start_info_t info;
+    if (keys->sender != MEDIA_SENDER_CALLER) {
+        info("Listening to a page from %d", *page_state->other_number);
+#ifndef RASPBERRY_PI
+        prompt("Press q to stop listening: ");
+#endif
+        return ST_GOOD;
+    }
 
-    memcpy(&info.serverAddr, &call_state->server.logic->serverAddr, call_state->server.logic->serverAddrLen);
-    info.serverAddrLen = call_state->server.logic->serverAddrLen;
+    if (media_crypto_random_key(keys->page) != ST_GOOD) {
+        *next = page_state->put_down_call;
+        return send_client_terminate(&page_state->server);
+    }
 
-    info.serverAddr.sin_port = htons(call_state->server_udp_port);
+    memcpy(keys->media, keys->page, MEDIA_KEY_SIZE);
+    keys->agreed = true;
 
-    audio_backend_start(call_state->server.logic->audio, &info);
+    audio_backend_t* audio = page_state->server.node->logic->audio;
 
-    while (true) {
-        // Wait for termination
-        uint8_t msgBuffer[MESSAGE_WRAPPER_SIZE + sizeof(struct terminate_call)];
+    if (start_call_audio(&page_state->server, *page_state->server_udp_port, keys, false) != ST_GOOD || audio_backend_answer(audio) != ST_GOOD) {
+        warn("Failed to start page audio");
+    }
 
-        // Non-blocking read from socket
-        ssize_t bytesRead = recv(call_state->server.sockfd, &msgBuffer, sizeof(msgBuffer), MSG_DONTWAIT);
+    info("Paging %d", *page_state->other_number);
+#ifndef RASPBERRY_PI
+    prompt("Press q to stop paging: ");
+#endif
+    return ST_GOOD;
+}
 
-        if (bytesRead == -1 && (errno != EAGAIN && errno != EWOULDBLOCK)) {
-            // Error
-            stl_warn(errno, "Failed to recv terminate call from socket");
-            audio_backend_stop(call_state->server.logic->audio);
-            return ST_FAIL;
-        }
+static int INTERCOM_FUNCTION execute_page_input(struct state_t* state, struct state_t** next, const char* line) {
+    struct execute_page_state* page_state = (struct execute_page_state*)state;
 
-        if (bytesRead != -1) {
-            if (bytesRead != sizeof(msgBuffer)) {
-                warn("Wrong number of bytes read for terminate command");
-                goto check_user_terminate;
-            }
+    if (line[0] != 'q') {
+        warn("%s is an invalid argument", line);
+        prompt("Press q to stop: ");
+        return ST_GOOD;
+    }
 
-            void* msg = receive_wrapped_message(msgBuffer, bytesRead, sizeof(struct terminate_call), TERMINATE_CALL);
+    info("Left the page");
+    audio_backend_stop(page_state->server.node->logic->audio);
+    *next = page_state->put_down_call;
 
-            if (msg == NULL) {
-                warn("Received message was not terminate call");
-                goto check_user_terminate;
-            }
+    return send_client_terminate(&page_state->server);
+}
 
-            struct terminate_call* termCall = (struct terminate_call*)msg;
+static int execute_page_message(struct state_t* state, struct state_t** next, struct message_wrapper* msg) {
+    struct execute_page_state* page_state = (struct execute_page_state*)state;
 
-            info("Server terminated call with code: %x", termCall->err_code);
-            audio_backend_stop(call_state->server.logic->audio);
-            *state = call_state->put_down_call;
-            return ST_GOOD;
-        }
+    const size_t msgLen = MESSAGE_WRAPPER_SIZE + msg->length;
+    void* data;
 
-    check_user_terminate:
-        if (call_state->prompt_user) {
-            call_state->prompt_user = false;
-            prompt("Press q to end call: ");
-        }
+    if ((data = receive_wrapped_message(msg, msgLen, sizeof(struct page_listen), PAGE_LISTEN)) != NULL) {
+        return key_page_listener(page_state, (struct page_listen*)data);
+    }
 
-        char stdinBuf[16] = { 0 };
-        bytesRead = read(STDIN_FILENO, stdinBuf, sizeof(stdinBuf) - 1);
+    if ((data = receive_wrapped_message(msg, msgLen, sizeof(struct page_key), PAGE_KEY)) != NULL) {
+        return play_page(page_state, (struct page_key*)data);
+    }
 
-        if (bytesRead == -1) {
-            if (errno != EAGAIN && errno != EWOULDBLOCK) {
-                stl_warn(errno, "Error when reading stdin");
-            }
-        } else if (bytesRead != 0) {
-            if (stdinBuf[0] != 'q') {
-                warn("%s is an invalid argument", stdinBuf);
-                memset(stdinBuf, 0, sizeof(stdinBuf));
-                call_state->prompt_user = true;
-            } else {
-                // Call ended
-                info("Terminated call");
-                audio_backend_stop(call_state->server.logic->audio);
-                *state = call_state->put_down_call;
-
-                uint8_t msgSendBuffer[MESSAGE_WRAPPER_SIZE + sizeof(struct client_terminate_call)];
-                struct message_wrapper* wrapper = (struct message_wrapper*)msgSendBuffer;
-                
-                wrapper->start = MESSAGE_WRAPPER_START;
-                wrapper->id = CLIENT_TERMINATE_CALL;
-                wrapper->length = sizeof(struct client_terminate_call);
-
-                struct client_terminate_call* termCall = (struct client_terminate_call*)wrapper->data;
-                termCall->err_code = CALL_PUTDOWN;
-                termCall->phone_number = htons(call_state->server.logic->conf->phone_number);
-
-                ssize_t bytesSent = send(call_state->server.sockfd, msgSendBuffer, sizeof(msgSendBuffer), 0);
-
-                if (bytesSent == -1) {
-                    stl_error(errno, "Failed to terminate call");
-                }
-
-                if (bytesSent != sizeof(msgSendBuffer)) {
-                    warn("Failed to send full terminate message");
-                    return ST_FAIL;
-                }
-
-                return ST_GOOD;
-            }
-        }
+    if ((data = receive_wrapped_message(msg, msgLen, sizeof(struct terminate_call), TERMINATE_CALL)) == NULL) {
+        warn("Unexpected message with id %x during a page", msg->id);
+        return ST_GOOD;
+    }
+
+    info("Page ended with code: %x", ((struct terminate_call*)data)->err_code);
+    audio_backend_stop(page_state->server.node->logic->audio);
+    *next = page_state->put_down_call;
+    return ST_GOOD;
+}
+
+static int execute_page_resume(struct state_t* state, struct state_t** next, const struct resume_response* resume) {
+    struct execute_page_state* page_state = (struct execute_page_state*)state;
+
+    if (resume->call_state != RESUME_NO_CALL) {
+        return ST_GOOD;
+    }
+
+    info("Page ended while disconnected");
+    audio_backend_stop(page_state->server.node->logic->audio);
+    *next = page_state->put_down_call;
+    return ST_GOOD;
+}
+
+/**
+ * Seal the page's key to a listener that answered, under a key agreed from
+ * our secret and its public key. It is sent again after a reconnect, sealing
+ * it again gives the same bytes.
+ */
+static int key_page_listener(struct execute_page_state* page_state, const struct page_listen* listen) {
+    struct call_keys* keys = page_state->keys;
+
+    if (keys->sender != MEDIA_SENDER_CALLER) {
+        return ST_GOOD;
+    }
+
+    uint8_t wrappingKey[MEDIA_KEY_SIZE];
+    struct page_key key;
+    key.phone_number = listen->phone_number;
+
+    if (media_crypto_derive(wrappingKey, keys->secret, listen->public_key) != ST_GOOD) {
+        warn("Failed to agree a key with listener %hu", ntohs(listen->phone_number));
+        return ST_GOOD;
+    }
+
+    media_crypto_wrap(key.wrapped_key, keys->page, wrappingKey);
+    memset(wrappingKey, 0, sizeof(wrappingKey));
+
+    return send_wrapped_message(page_state->server.node->sockfd, PAGE_KEY, 0, &key, sizeof(key));
+}
+
+/**
+ * Unwrap the page's key and start listening. A key that does not unwrap was
+ * not sealed by the pager, and is ignored.
+ */
+static int play_page(struct execute_page_state* page_state, const struct page_key* key) {
+    struct call_keys* keys = page_state->keys;
+
+    if (keys->sender == MEDIA_SENDER_CALLER || keys->agreed) {
+        return ST_GOOD;
+    }
+
+    if (media_crypto_unwrap(keys->media, key->wrapped_key, keys->page) != ST_GOOD) {
+        warn("Page key did not unwrap");
+        return ST_GOOD;
+    }
+
+    memset(keys->page, 0, sizeof(keys->page));
+    keys->agreed = true;
+
+    if (start_call_audio(&page_state->server, *page_state->server_udp_port, keys, false) != ST_GOOD) {
+        warn("Failed to start page audio");
+    }
+
+    return ST_GOOD;
+}
+
+/**
+ * Tell the server this node is putting down the call. Without a connection
+ * there is nothing to tell, the resume settles the call instead.
+ */
+static int send_client_terminate(struct server_state* server) {
+    if (!server->node->connected) {
+        return ST_GOOD;
+    }
+
+    struct client_terminate_call termCall;
+    termCall.err_code = CALL_PUTDOWN;
+    termCall.phone_number = htons(server->node->logic->conf->phone_number);
+
+    if (send_wrapped_message(server->node->sockfd, CLIENT_TERMINATE_CALL, 0, &termCall, sizeof(termCall)) != ST_GOOD) {
+        warn("Failed to send terminate message");
+        return ST_FAIL;
     }
+
+    return ST_GOOD;
 }
 
 // Secure communication design
 
-// First do a diffie-hellman exchange with server to obtain a secret key
-// Use secret key to secure all future comms
+// Media is sealed end to end with ChaCha20-Poly1305, under a key the two nodes
+// agree per call with X25519 over the control channel. The server only ever
+// sees public keys and ciphertext
+
+// In a conference each node agrees its key with the bridge instead, which
+// has to open the audio to mix it, so conference audio is in the clear on
+// the server
+
+// A page sends the same packets to every listener, so they share one key.
+// The pager makes it up and seals it to each listener under a key the two
+// agree, so the server never sees it
+
+// A recorded call's key is sealed to the server's recorder by the caller, and
+// both nodes are told, so the server only hears calls it says it records
+
+// A message is left under a key agreed with the mailbox, as with a bridge,
+// and played back the same way, so voicemail is in the clear on the server
+
+// Every call on hold hears the same packets under one key the server makes
+// up, sealed to each held node as a pager seals a page's. Taking a call off
+// hold, its two sides agree a new key through the server as they did when
+// it started, so the server never sees the call's key
+
+// Whenever the server keys a call in place of the peer, bridge, mailbox and
+// transcoding relay alike, it says so with CALL_FLAG_RELAYED_CLEAR, and
+// nodes set to refuse_relayed_clear hang up rather than talk in the clear
 
-// UDP and main TCP comms to use ChaCha20 / Salsa20 / **Blowfish** (OpenSSL) encryption (for speed)
\ No newline at end of file
+// The control channel itself is still in the clear, and nothing yet stops the
+// server handing out its own keys without the flag. Long term node keys would
+// fix both
@@ -0,0 +1,315 @@
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#ifdef linux
+#include <linux/gpio.h>
+#endif
+
+#include "common.h"
+#include "logicbackend/pulse_decoder.h"
+
+// Room for a whole digit of edges, bounce included, between reads
+#define GPIO_EVENT_BUFFER_SIZE 64
+
+static bool close_digit(pulse_decoder_t* decoder);
+static bool take_number(pulse_decoder_t* decoder, int* number);
+static int  read_gpio_edges(edge_source_t* source, dial_edge_t* edges, int maxEdges);
+static int  read_mock_edges(edge_source_t* source, dial_edge_t* edges, int maxEdges);
+
+void init_pulse_decoder(pulse_decoder_t* decoder, const pulse_decoder_conf_t* conf) {
+    memset(decoder, 0, sizeof(*decoder));
+    decoder->conf = *conf;
+}
+
+/**
+ * Drop any partly dialled number.
+ */
+void pulse_decoder_reset(pulse_decoder_t* decoder) {
+    decoder->pulses = 0;
+    decoder->digits = 0;
+    decoder->number = 0;
+}
+
+/**
+ * Let `complete` end a number as soon as its last digit is closed, rather
+ * than after the number timeout.
+ */
+void pulse_decoder_set_complete(pulse_decoder_t* decoder, number_complete_t complete, void* data) {
+    decoder->complete = complete;
+    decoder->completeData = data;
+}
+
+/**
+ * Feed an edge to the decoder.
+ *
+ * Returns true and sets `number` if the edge completed a number, either by
+ * filling the last digit or by starting a new number after a late timer.
+ */
+bool pulse_decoder_edge(pulse_decoder_t* decoder, const dial_edge_t* edge, int* number) {
+    if (decoder->seenEdge && edge->timestamp_ns < decoder->lastEdgeNs + decoder->conf.debounce_ns) {
+        return false;
+    }
+
+    decoder->seenEdge = true;
+    decoder->lastEdgeNs = edge->timestamp_ns;
+
+    // The line is normally grounded, each pulse breaks it
+    if (!edge->rising) {
+        return false;
+    }
+
+    const uint64_t gapNs = edge->timestamp_ns - decoder->lastPulseNs;
+    bool full = false;
+    bool ready = false;
+
+    if (decoder->pulses > 0 && gapNs >= decoder->conf.digit_gap_ns) {
+        full = close_digit(decoder);
+    }
+
+    if (decoder->pulses == 0 && decoder->digits > 0 && (full || gapNs >= decoder->conf.number_timeout_ns)) {
+        ready = take_number(decoder, number);
+    }
+
+    decoder->pulses++;
+    decoder->lastPulseNs = edge->timestamp_ns;
+    return ready;
+}
+
+/**
+ * Close digits and numbers whose silence has run out by `nowNs`. Call this
+ * once pulse_decoder_deadline() has passed, after feeding any edges that are
+ * still waiting to be read.
+ *
+ * Returns true and sets `number` when a number is complete.
+ */
+bool pulse_decoder_expire(pulse_decoder_t* decoder, uint64_t nowNs, int* number) {
+    if (decoder->pulses == 0 && decoder->digits == 0) {
+        return false;
+    }
+
+    const uint64_t gapNs = nowNs > decoder->lastPulseNs ? nowNs - decoder->lastPulseNs : 0;
+    bool full = false;
+
+    if (decoder->pulses > 0 && gapNs >= decoder->conf.digit_gap_ns) {
+        full = close_digit(decoder);
+    }
+
+    if (decoder->pulses == 0 && decoder->digits > 0 && (full || gapNs >= decoder->conf.number_timeout_ns)) {
+        return take_number(decoder, number);
+    }
+
+    return false;
+}
+
+/**
+ * When pulse_decoder_expire() next has something to do, or 0 if idle.
+ */
+uint64_t pulse_decoder_deadline(const pulse_decoder_t* decoder) {
+    if (decoder->pulses > 0) {
+        return decoder->lastPulseNs + decoder->conf.digit_gap_ns;
+    }
+
+    if (decoder->digits > 0) {
+        return decoder->lastPulseNs + decoder->conf.number_timeout_ns;
+    }
+
+    return 0;
+}
+
+/**
+ * Returns true once nothing more can be dialled onto the number.
+ */
+static bool close_digit(pulse_decoder_t* decoder) {
+    const int pulses = decoder->pulses;
+    decoder->pulses = 0;
+
+    if (pulses > 10) {
+        warn("Discarding dialled number, a digit had %d pulses", pulses);
+        decoder->digits = 0;
+        decoder->number = 0;
+        return false;
+    }
+
+    // Ten pulses dial a zero
+    decoder->number = decoder->number * 10 + pulses % 10;
+    decoder->digits++;
+
+    if (decoder->digits >= PULSE_DECODER_MAX_DIGITS) {
+        return true;
+    }
+
+    return decoder->complete != NULL && decoder->complete(decoder->completeData, decoder->number, decoder->digits);
+}
+
+static bool take_number(pulse_decoder_t* decoder, int* number) {
+    *number = decoder->number;
+    decoder->digits = 0;
+    decoder->number = 0;
+    return true;
+}
+
+/**
+ * Request both edges of the dial line through the GPIO character device. The
+ * kernel timestamps each edge on CLOCK_MONOTONIC as it happens.
+ */
+int open_gpio_edge_source(edge_source_t* source, const char* chip, unsigned int pin) {
+    source->fd = -1;
+    source->writefd = -1;
+    source->read = &read_gpio_edges;
+
+#ifdef GPIO_V2_GET_LINE_IOCTL
+    int chipfd = open(chip, O_RDONLY | O_CLOEXEC);
+
+    if (chipfd == -1) {
+        stl_warn(errno, "Failed to open gpio chip %s", chip);
+        return ST_FAIL;
+    }
+
+    struct gpio_v2_line_request request;
+    memset(&request, 0, sizeof(request));
+
+    request.offsets[0] = pin;
+    request.num_lines = 1;
+    request.event_buffer_size = GPIO_EVENT_BUFFER_SIZE;
+    request.config.flags = GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_EDGE_RISING | GPIO_V2_LINE_FLAG_EDGE_FALLING;
+    strncpy(request.consumer, "intercom-dial", sizeof(request.consumer) - 1);
+
+    if (ioctl(chipfd, GPIO_V2_GET_LINE_IOCTL, &request) == -1) {
+        stl_warn(errno, "Failed to request dial line %u on %s", pin, chip);
+        close(chipfd);
+        return ST_FAIL;
+    }
+
+    close(chipfd);
+
+    if (fcntl(request.fd, F_SETFL, fcntl(request.fd, F_GETFL) | O_NONBLOCK) == -1) {
+        stl_warn(errno, "Failed to make dial line non blocking");
+        close(request.fd);
+        return ST_FAIL;
+    }
+
+    source->fd = request.fd;
+    info("Listening for dial pulses on %s line %u", chip, pin);
+    return ST_GOOD;
+#else
+    warn("GPIO line events are not supported on this platform");
+    return ST_FAIL;
+#endif
+}
+
+/**
+ * A source fed by mock_edge_source_push(), for driving the decoder without
+ * dial hardware.
+ */
+int open_mock_edge_source(edge_source_t* source) {
+    int fds[2];
+
+    source->fd = -1;
+    source->writefd = -1;
+    source->read = &read_mock_edges;
+
+    if (pipe(fds) == -1) {
+        stl_warn(errno, "Failed to create mock edge source");
+        return ST_FAIL;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    source->fd = fds[0];
+    source->writefd = fds[1];
+    return ST_GOOD;
+}
+
+int mock_edge_source_push(edge_source_t* source, uint64_t timestampNs, bool rising) {
+    if (source->writefd == -1) {
+        return ST_INVALID_ARG;
+    }
+
+    dial_edge_t edge;
+    memset(&edge, 0, sizeof(edge));
+    edge.timestamp_ns = timestampNs;
+    edge.rising = rising;
+
+    if (write(source->writefd, &edge, sizeof(edge)) != sizeof(edge)) {
+        stl_warn(errno, "Failed to push mock edge");
+        return ST_FAIL;
+    }
+
+    return ST_GOOD;
+}
+
+void close_edge_source(edge_source_t* source) {
+    if (source->fd != -1) {
+        close(source->fd);
+        source->fd = -1;
+    }
+
+    if (source->writefd != -1) {
+        close(source->writefd);
+        source->writefd = -1;
+    }
+}
+
+/**
+ * The clock edge timestamps are taken on.
+ */
+uint64_t edge_source_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Returns the number of edges read, 0 if none are waiting, or -1 on failure.
+ */
+static int read_gpio_edges(edge_source_t* source, dial_edge_t* edges, int maxEdges) {
+#ifdef GPIO_V2_GET_LINE_IOCTL
+    struct gpio_v2_line_event events[EDGE_SOURCE_BATCH];
+    const int wanted = MIN(maxEdges, EDGE_SOURCE_BATCH);
+
+    ssize_t bytesRead = read(source->fd, events, wanted * sizeof(*events));
+
+    if (bytesRead == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        }
+
+        stl_warn(errno, "Failed to read dial line events");
+        return -1;
+    }
+
+    const int count = (int)(bytesRead / sizeof(*events));
+
+    for (int i = 0; i < count; i++) {
+        edges[i].timestamp_ns = events[i].timestamp_ns;
+        edges[i].rising = events[i].id == GPIO_V2_LINE_EVENT_RISING_EDGE;
+    }
+
+    return count;
+#else
+    return -1;
+#endif
+}
+
+static int read_mock_edges(edge_source_t* source, dial_edge_t* edges, int maxEdges) {
+    ssize_t bytesRead = read(source->fd, edges, maxEdges * sizeof(*edges));
+
+    if (bytesRead == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        }
+
+        stl_warn(errno, "Failed to read mock edges");
+        return -1;
+    }
+
+    return (int)(bytesRead / sizeof(*edges));
+}
@@ -0,0 +1,630 @@
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include "common.h"
+#include "server/packets.h"
+#include "server/conference.h"
+#include "audiobackend/codec.h"
+#include "audiobackend/dsp.h"
+#include "audiobackend/kernels.h"
+#include "audiobackend/media_control.h"
+#include "utils/event_loop.h"
+
+// Audio is mixed and sent in blocks of this long
+#define CONFERENCE_TICK_MS 20
+#define CONFERENCE_MAX_TICK_FRAMES (DSP_MAX_RATE * CONFERENCE_TICK_MS / 1000)
+
+// Ticks run late are caught up to this many at once, the rest are skipped
+#define CONFERENCE_MAX_CATCH_UP 5
+
+// How far behind its newest audio a member is played out
+#define CONFERENCE_JITTER_MS 60
+
+// Decoded audio waiting to be mixed, per member. A power of two, so it
+// indexes by timestamp through the wrap
+#define CONFERENCE_RING_FRAMES 16384
+
+// Late packets in a row before a member's playout is moved to its clock
+#define CONFERENCE_LATE_RESYNC 10
+
+// The mix is held under -1 dBFS, gains are Q15
+#define CONFERENCE_LIMIT 29205
+#define CONFERENCE_UNITY_GAIN 32767
+
+// Gain regained each tick after the limiter pulled it down, unity in 0.5 s
+#define CONFERENCE_RELEASE_STEP 1311
+
+// Room for a packet of 20 ms of L16 at the highest wire rate, header and tag
+#define CONFERENCE_MAX_PACKET 2048
+
+/**
+ * The bridge's view of one member, owned by the child.
+ */
+typedef struct bridge_member {
+    conference_member_info_t signalled; // As the server last wrote it
+    struct sockaddr_in addr;            // Port learned from its packets
+    media_crypto_t crypto;
+    media_control_t control;
+    codec_state_t encoder;
+    uint32_t sendTimestamp;
+
+    // Playout of the audio it sends
+    bool playing;
+    uint32_t playTimestamp;
+    int late;
+
+    int16_t gainQ15; // Limiter on the mix sent to it
+    int16_t ring[CONFERENCE_RING_FRAMES];
+} bridge_member_t;
+
+typedef struct bridge {
+    conference_bridge_t* shared;
+    unsigned int generation;
+    unsigned int tickFrames;
+    unsigned int jitterFrames;
+    uint64_t startNs;
+    uint64_t ticks;
+    bridge_member_t members[CONFERENCE_MAX_MEMBERS];
+    int32_t sum[CONFERENCE_MAX_TICK_FRAMES];
+    int16_t blocks[CONFERENCE_MAX_MEMBERS][CONFERENCE_MAX_TICK_FRAMES];
+    int16_t mixed[CONFERENCE_MAX_TICK_FRAMES];
+    int16_t decoded[CONFERENCE_MAX_PACKET];
+    uint8_t packet[CONFERENCE_MAX_PACKET];
+    uint8_t payload[CONFERENCE_MAX_PACKET];
+} bridge_t;
+
+// Owned by the child, too large for its stack
+static bridge_t bridge;
+
+static void conference_main(conference_bridge_t* shared);
+static int  handle_packets(struct event_loop* loop, int fd, uint32_t events, void* data);
+static int  handle_tick(struct event_loop* loop, int fd, uint32_t events, void* data);
+static void refresh_members(bridge_t* bridge);
+static void reset_member(bridge_t* bridge, bridge_member_t* member);
+static bridge_member_t* find_member(bridge_t* bridge, const struct media_header* header);
+static void store_audio(bridge_t* bridge, bridge_member_t* member, const struct media_header* header, const uint8_t* payload, size_t length);
+static void write_ring(bridge_t* bridge, bridge_member_t* member, uint32_t start, const int16_t* samples, size_t frames, bool primary);
+static void take_block(bridge_t* bridge, bridge_member_t* member, int16_t* block);
+static void mix_tick(bridge_t* bridge);
+static void send_mix(bridge_t* bridge, bridge_member_t* member, const int16_t* own, uint64_t nowNs);
+static void send_report(bridge_t* bridge, bridge_member_t* member, uint64_t nowNs);
+static void send_sealed(bridge_t* bridge, bridge_member_t* member, size_t length);
+static bool same_endpoint(const struct sockaddr_in* a, const struct sockaddr_in* b);
+static void log_member(const char* what, int slot, const struct sockaddr_in* addr);
+
+/**
+ * Start a child process bridging a conference on `port`, mixing at
+ * `wireRate`. The members are added with set_conference_member().
+ */
+int start_conference_bridge(conference_bridge_t** bridgeOut, uint16_t port, unsigned int wireRate) {
+    if (wireRate < DSP_MIN_RATE || wireRate > DSP_MAX_RATE || wireRate % (1000 / CONFERENCE_TICK_MS) != 0) {
+        warn("Conference bridge cannot mix at %u Hz", wireRate);
+        return ST_INVALID_ARG;
+    }
+
+    conference_bridge_t* shared = (conference_bridge_t*)create_shared_memory(sizeof(conference_bridge_t));
+
+    if (shared == MAP_FAILED) {
+        stl_warn(errno, "Failed to allocate conference bridge");
+        return ST_FAIL;
+    }
+
+    memset(shared->members, 0, sizeof(shared->members));
+    shared->port = port;
+    shared->wireRate = wireRate;
+    atomic_init(&shared->generation, 0);
+
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if (sockfd == -1) {
+        stl_warn(errno, "Failed to open conference bridge socket");
+        destroy_shared_memory(shared, sizeof(conference_bridge_t));
+        return ST_FAIL;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+
+    if (bind(sockfd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        stl_warn(errno, "Failed to bind conference bridge port %hu", port);
+        close(sockfd);
+        destroy_shared_memory(shared, sizeof(conference_bridge_t));
+        return ST_FAIL;
+    }
+
+    shared->sockfd = sockfd;
+
+    info("Starting conference bridge on port: %hu", port);
+
+    pid_t pid = fork();
+
+    if (pid == -1) {
+        stl_warn(errno, "Failed to fork to start the conference bridge");
+        close(sockfd);
+        destroy_shared_memory(shared, sizeof(conference_bridge_t));
+        return ST_FAIL;
+    }
+
+    if (pid == 0) {
+        conference_main(shared);
+        exit(0);
+    }
+
+    close(sockfd);
+    shared->pid = pid;
+    *bridgeOut = shared;
+
+    return ST_GOOD;
+}
+
+void stop_conference_bridge(conference_bridge_t* shared) {
+    info("Killing conference bridge on port: %hu", shared->port);
+    kill(shared->pid, SIGINT);
+
+    destroy_shared_memory(shared, sizeof(conference_bridge_t));
+}
+
+/**
+ * Write the member in `slot`, a zeroed member frees it. Called whenever the
+ * server learns more of it, the child picks the change up on its next packet
+ * or tick.
+ */
+void set_conference_member(conference_bridge_t* shared, int slot, const conference_member_info_t* member) {
+    if (slot < 0 || slot >= CONFERENCE_MAX_MEMBERS) {
+        return;
+    }
+
+    // Odd while writing, the child skips members it catches half done
+    atomic_fetch_add_explicit(&shared->generation, 1, memory_order_acq_rel);
+    shared->members[slot] = *member;
+    atomic_fetch_add_explicit(&shared->generation, 1, memory_order_release);
+}
+
+/**
+ * The bridge's main loop.
+ *
+ * Each member's packets are opened with its own key and decoded, FEC blocks
+ * included, into a ring indexed by timestamp. The ring is played out
+ * CONFERENCE_JITTER_MS behind the first packet, so packets that arrive out
+ * of order or a little late still land in time. A member whose clock drifts
+ * far enough from the bridge's is moved back to its own timeline.
+ *
+ * Every CONFERENCE_TICK_MS a block is taken from each member and those of
+ * the live members are summed. Each member is sent the sum less its own block, through
+ * a limiter that holds the mix under CONFERENCE_LIMIT and releases over half
+ * a second, then saturates. Each send is encoded in the codec the member's
+ * reports allow and sealed under its key. The bridge always sends a tick a
+ * packet and no FEC, the mix is never repeated.
+ *
+ * This function returns when the parent kills it.
+ */
+static void conference_main(conference_bridge_t* shared) {
+    info("Child started conference bridge on socket %d", shared->sockfd);
+
+    init_kernels();
+
+    memset(&bridge, 0, sizeof(bridge));
+    bridge.shared = shared;
+    bridge.tickFrames = shared->wireRate * CONFERENCE_TICK_MS / 1000;
+    bridge.jitterFrames = shared->wireRate * CONFERENCE_JITTER_MS / 1000;
+    bridge.startNs = event_loop_now();
+
+    fcntl(shared->sockfd, F_SETFL, fcntl(shared->sockfd, F_GETFL) | O_NONBLOCK);
+
+    event_loop_t loop;
+
+    if (init_event_loop(&loop) != ST_GOOD) {
+        return;
+    }
+
+    int tickTimer = event_loop_add_timer(&loop, &handle_tick, &bridge);
+
+    if (event_loop_add(&loop, shared->sockfd, EVENT_READ, &handle_packets, &bridge) != ST_GOOD || tickTimer < 0
+        || event_loop_arm_timer(&loop, tickTimer, CONFERENCE_TICK_MS, CONFERENCE_TICK_MS) != ST_GOOD) {
+        destroy_event_loop(&loop);
+        return;
+    }
+
+    event_loop_run(&loop);
+    destroy_event_loop(&loop);
+}
+
+static int handle_packets(struct event_loop* loop, int fd, uint32_t events, void* data) {
+    bridge_t* bridge = (bridge_t*)data;
+    int dropped = 0;
+
+    refresh_members(bridge);
+
+    while (1) {
+        struct sockaddr_in addr;
+        socklen_t addrLen = sizeof(addr);
+
+        ssize_t bytesRead = recvfrom(fd, bridge->packet, sizeof(bridge->packet), 0, (struct sockaddr*)&addr, &addrLen);
+
+        if (bytesRead == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                stl_warn(errno, "Failed to read audio data from member");
+            }
+            break;
+        }
+
+        if ((size_t)bytesRead < sizeof(struct media_header) || addrLen != sizeof(addr)) {
+            continue;
+        }
+
+        const struct media_header* header = (const struct media_header*)bridge->packet;
+        bridge_member_t* member = find_member(bridge, header);
+
+        if (member == NULL || addr.sin_addr.s_addr != member->addr.sin_addr.s_addr) {
+            continue;
+        }
+
+        const uint64_t nowNs = event_loop_now();
+        uint8_t* payload;
+        size_t payloadLength;
+
+        if (media_open(&member->crypto, bridge->packet, bytesRead, &payload, &payloadLength) != ST_GOOD) {
+            dropped++;
+            continue;
+        }
+
+        // Only an authentic packet moves where the member is sent to
+        if (!same_endpoint(&addr, &member->addr)) {
+            member->addr.sin_port = addr.sin_port;
+            log_member("now at", (int)(member - bridge->members), &addr);
+        }
+
+        if (MEDIA_TYPE_IS_PROBE(header->type)) {
+            continue;
+        }
+
+        media_control_received(&member->control, header, nowNs);
+
+        if (header->type == MEDIA_TYPE_REPORT && payloadLength == sizeof(struct media_report)) {
+            media_control_peer_report(&member->control, (const struct media_report*)payload, nowNs);
+        } else if (header->type == MEDIA_TYPE_AUDIO) {
+            store_audio(bridge, member, header, payload, payloadLength);
+        }
+    }
+
+    if (dropped > 0) {
+        warn("Conference bridge dropped %d media packets that failed to open", dropped);
+    }
+
+    return ST_GOOD;
+}
+
+/**
+ * Run every tick due by the clock, the timer only says some are.
+ */
+static int handle_tick(struct event_loop* loop, int fd, uint32_t events, void* data) {
+    bridge_t* bridge = (bridge_t*)data;
+    const uint64_t due = (event_loop_now() - bridge->startNs) / ((uint64_t)CONFERENCE_TICK_MS * 1000000);
+
+    if (due > bridge->ticks + CONFERENCE_MAX_CATCH_UP) {
+        warn("Conference bridge on port %hu skipped %llu ticks", bridge->shared->port, (unsigned long long)(due - bridge->ticks - CONFERENCE_MAX_CATCH_UP));
+        bridge->ticks = due - CONFERENCE_MAX_CATCH_UP;
+    }
+
+    refresh_members(bridge);
+
+    while (bridge->ticks < due) {
+        mix_tick(bridge);
+        bridge->ticks++;
+    }
+
+    return ST_GOOD;
+}
+
+/**
+ * Take any member the server has changed since it was last seen. A member
+ * with a new token or key starts afresh, one that only moved keeps its
+ * stream.
+ */
+static void refresh_members(bridge_t* bridge) {
+    conference_bridge_t* shared = bridge->shared;
+    const unsigned int current = atomic_load_explicit(&shared->generation, memory_order_acquire);
+
+    if (current == bridge->generation || (current & 1)) {
+        return;
+    }
+
+    conference_member_info_t copy[CONFERENCE_MAX_MEMBERS];
+    memcpy(copy, shared->members, sizeof(copy));
+
+    // The server started writing again while this was copied
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&shared->generation, memory_order_relaxed) != current) {
+        return;
+    }
+
+    for (int i = 0; i < CONFERENCE_MAX_MEMBERS; i++) {
+        bridge_member_t* member = &bridge->members[i];
+
+        if (memcmp(&copy[i], &member->signalled, sizeof(copy[i])) == 0) {
+            continue;
+        }
+
+        const bool fresh = copy[i].token != member->signalled.token || copy[i].keyed != member->signalled.keyed
+            || memcmp(copy[i].key, member->signalled.key, sizeof(copy[i].key)) != 0;
+        const bool moved = !same_endpoint(&copy[i].addr, &member->signalled.addr);
+
+        member->signalled = copy[i];
+
+        if (fresh) {
+            reset_member(bridge, member);
+        }
+
+        if (fresh || moved) {
+            member->addr = member->signalled.addr;
+
+            if (member->signalled.token != 0) {
+                log_member("bound to", i, &member->addr);
+            }
+        }
+    }
+
+    memset(copy, 0, sizeof(copy));
+    bridge->generation = current;
+}
+
+static void reset_member(bridge_t* bridge, bridge_member_t* member) {
+    destroy_media_crypto(&member->crypto);
+
+    if (member->signalled.keyed) {
+        init_media_crypto(&member->crypto, member->signalled.key, MEDIA_SENDER_RELAY, 0);
+    }
+
+    init_media_control(&member->control, bridge->shared->wireRate, true, event_loop_now());
+    init_codec_state(&member->encoder);
+    member->sendTimestamp = 0;
+    member->playing = false;
+    member->late = 0;
+    member->gainQ15 = CONFERENCE_UNITY_GAIN;
+    memset(member->ring, 0, sizeof(member->ring));
+}
+
+/**
+ * The keyed member that sent a packet, by its token.
+ */
+static bridge_member_t* find_member(bridge_t* bridge, const struct media_header* header) {
+    if (header->version != MEDIA_VERSION || header->token == 0) {
+        return NULL;
+    }
+
+    for (int i = 0; i < CONFERENCE_MAX_MEMBERS; i++) {
+        bridge_member_t* member = &bridge->members[i];
+
+        if (member->signalled.token == header->token && member->signalled.keyed) {
+            return member;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Decode an audio payload into the member's ring. The blocks run back to
+ * back, ending with the one the timestamp is for, as in the transfer engine.
+ */
+static void store_audio(bridge_t* bridge, bridge_member_t* member, const struct media_header* header, const uint8_t* payload, size_t length) {
+    const int codec = MEDIA_FORMAT_CODEC(header->format);
+    const int fec = MEDIA_FORMAT_FEC(header->format);
+
+    if (codec >= MEDIA_CODEC_COUNT || fec > MEDIA_MAX_FEC || length < fec * sizeof(uint16_t)) {
+        return;
+    }
+
+    const uint8_t* blocks[MEDIA_MAX_FEC + 1];
+    size_t blockLengths[MEDIA_MAX_FEC + 1];
+    size_t blockFrames[MEDIA_MAX_FEC + 1];
+
+    const uint8_t* block = payload + fec * sizeof(uint16_t);
+    size_t remaining = length - fec * sizeof(uint16_t);
+
+    for (int i = 0; i <= fec; i++) {
+        blockLengths[i] = i < fec ? (size_t)((payload[2 * i] << 8) | payload[2 * i + 1]) : remaining;
+
+        if (blockLengths[i] > remaining) {
+            return;
+        }
+
+        blocks[i] = block;
+        blockFrames[i] = codec_decoded_frames(codec, block, blockLengths[i]);
+
+        if (blockFrames[i] == 0 || blockFrames[i] > sizeof(bridge->decoded) / sizeof(*bridge->decoded)) {
+            return;
+        }
+
+        block += blockLengths[i];
+        remaining -= blockLengths[i];
+    }
+
+    uint32_t start = ntohl(header->timestamp);
+
+    for (int i = fec; i >= 0; i--) {
+        const size_t decoded = codec_decode(codec, blocks[i], blockLengths[i], bridge->decoded);
+        write_ring(bridge, member, start, bridge->decoded, decoded, i == fec);
+
+        if (i > 0) {
+            start -= (uint32_t)blockFrames[i - 1];
+        }
+    }
+}
+
+/**
+ * Place decoded samples in the ring at their timestamp. Whatever is already
+ * behind the playout is dropped, a primary block too far either side of it
+ * moves the playout to the member's clock.
+ */
+static void write_ring(bridge_t* bridge, bridge_member_t* member, uint32_t start, const int16_t* samples, size_t frames, bool primary) {
+    const uint32_t mask = CONFERENCE_RING_FRAMES - 1;
+
+    if (!member->playing) {
+        if (!primary) {
+            return;
+        }
+
+        member->playing = true;
+        member->playTimestamp = start - bridge->jitterFrames;
+    }
+
+    int32_t offset = (int32_t)(start - member->playTimestamp);
+    const bool late = offset + (int32_t)frames <= 0;
+    const bool ahead = offset + (int32_t)frames > CONFERENCE_RING_FRAMES - (int32_t)bridge->tickFrames;
+
+    if (primary && ((late && ++member->late >= CONFERENCE_LATE_RESYNC) || ahead)) {
+        info("Conference member %d moved to its own clock", (int)(member - bridge->members));
+        member->playTimestamp = start - bridge->jitterFrames;
+        memset(member->ring, 0, sizeof(member->ring));
+        offset = (int32_t)bridge->jitterFrames;
+    } else if (late || ahead) {
+        return;
+    }
+
+    if (primary) {
+        member->late = 0;
+    }
+
+    // Only the part still to be played
+    size_t skip = offset < 0 ? (size_t)-offset : 0;
+
+    for (size_t i = skip; i < frames; i++) {
+        member->ring[(start + (uint32_t)i) & mask] = samples[i];
+    }
+}
+
+/**
+ * Take the next tick of a member's audio, leaving silence behind so a gap
+ * plays as silence when it comes round again.
+ */
+static void take_block(bridge_t* bridge, bridge_member_t* member, int16_t* block) {
+    const size_t frames = bridge->tickFrames;
+
+    if (!member->playing) {
+        memset(block, 0, frames * sizeof(*block));
+        return;
+    }
+
+    const size_t index = member->playTimestamp & (CONFERENCE_RING_FRAMES - 1);
+    const size_t first = MIN(frames, CONFERENCE_RING_FRAMES - index);
+
+    memcpy(block, member->ring + index, first * sizeof(*block));
+    memset(member->ring + index, 0, first * sizeof(*block));
+    memcpy(block + first, member->ring, (frames - first) * sizeof(*block));
+    memset(member->ring, 0, (frames - first) * sizeof(*block));
+
+    member->playTimestamp += (uint32_t)frames;
+}
+
+static void mix_tick(bridge_t* bridge) {
+    const size_t frames = bridge->tickFrames;
+    const uint64_t nowNs = event_loop_now();
+
+    memset(bridge->sum, 0, frames * sizeof(*bridge->sum));
+
+    for (int i = 0; i < CONFERENCE_MAX_MEMBERS; i++) {
+        bridge_member_t* member = &bridge->members[i];
+
+        if (!member->signalled.keyed) {
+            continue;
+        }
+
+        // A member still ringing is played out but not heard
+        take_block(bridge, member, bridge->blocks[i]);
+
+        if (member->signalled.live && member->playing) {
+            kernels->accumulate_s16(bridge->sum, bridge->blocks[i], frames);
+        }
+    }
+
+    for (int i = 0; i < CONFERENCE_MAX_MEMBERS; i++) {
+        bridge_member_t* member = &bridge->members[i];
+
+        if (!member->signalled.keyed || member->addr.sin_port == 0) {
+            continue;
+        }
+
+        // Reports go to a member still ringing too, opening its NAT
+        if (media_control_report_due(&member->control, nowNs)) {
+            send_report(bridge, member, nowNs);
+        }
+
+        if (member->signalled.live) {
+            send_mix(bridge, member, bridge->blocks[i], nowNs);
+        }
+    }
+}
+
+/**
+ * Send a member everyone else's audio. The limiter's gain drops straight to
+ * what keeps this tick's peak under the limit and climbs back a step a tick,
+ * never above what the peak allows, which also keeps the kernel's product in
+ * 32 bits.
+ */
+static void send_mix(bridge_t* bridge, bridge_member_t* member, const int16_t* own, uint64_t nowNs) {
+    const size_t frames = bridge->tickFrames;
+    const uint32_t peak = kernels->peak_minus_s32(bridge->sum, own, frames);
+
+    const int32_t allowed = peak > CONFERENCE_LIMIT ? (int32_t)((uint64_t)CONFERENCE_LIMIT * CONFERENCE_UNITY_GAIN / peak) : CONFERENCE_UNITY_GAIN;
+    const int32_t released = member->gainQ15 + CONFERENCE_RELEASE_STEP;
+    member->gainQ15 = (int16_t)MIN(allowed, released);
+
+    kernels->mix_minus_s16(bridge->mixed, bridge->sum, own, member->gainQ15, frames);
+
+    const int codec = media_control_level(&member->control)->codec;
+
+    if (codec_encoded_size(codec, frames) + MEDIA_OVERHEAD > sizeof(bridge->packet)) {
+        return;
+    }
+
+    const size_t encodedLength = codec_encode(codec, &member->encoder, bridge->mixed, frames, bridge->payload);
+    const size_t length = media_seal(&member->crypto, bridge->packet, MEDIA_TYPE_AUDIO, MEDIA_FORMAT(codec, 0), member->sendTimestamp, bridge->payload, encodedLength);
+
+    member->sendTimestamp += (uint32_t)frames;
+    send_sealed(bridge, member, length);
+}
+
+static void send_report(bridge_t* bridge, bridge_member_t* member, uint64_t nowNs) {
+    struct media_report report;
+    media_control_build_report(&member->control, &report, nowNs);
+
+    send_sealed(bridge, member, media_seal(&member->crypto, bridge->packet, MEDIA_TYPE_REPORT, 0, member->sendTimestamp, &report, sizeof(report)));
+}
+
+static void send_sealed(bridge_t* bridge, bridge_member_t* member, size_t length) {
+    if (length == 0) {
+        warn("Conference bridge ran out of sequence numbers for a member");
+        return;
+    }
+
+    if (sendto(bridge->shared->sockfd, bridge->packet, length, 0, (const struct sockaddr*)&member->addr, sizeof(member->addr)) == -1
+        && errno != ENOBUFS && errno != EAGAIN && errno != EWOULDBLOCK) {
+        stl_warn(errno, "Failed to send audio data to member");
+    }
+}
+
+static bool same_endpoint(const struct sockaddr_in* a, const struct sockaddr_in* b) {
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+static void log_member(const char* what, int slot, const struct sockaddr_in* addr) {
+    char addrBuf[INET_ADDRSTRLEN];
+    const char* str = inet_ntop(AF_INET, &addr->sin_addr, addrBuf, INET_ADDRSTRLEN);
+
+    if (str == NULL) {
+        warn("Issue translating added IPV4 address");
+        return;
+    }
+
+    info("Conference member %d %s %s:%hu", slot, what, addrBuf, ntohs(addr->sin_port));
+}
@@ -0,0 +1,619 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "common.h"
+#include "server/handover.h"
+#include "server/server_internal.h"
+
+// How often an upgrade that is held up looks again
+#define UPGRADE_RETRY_MS 1000
+
+static void describe_layouts(handover_hello_t* hello);
+static const char* upgrade_blocker(server_t* server);
+static int handle_upgrade_retry(struct timer_wheel* wheel, uint64_t arg, void* data);
+static int hand_over(server_t* server, int sockfd);
+static int handle_handover_closed(struct event_loop* loop, int fd, uint32_t events, void* data);
+
+/**
+ * Start a new server from the same command line, so from the binary as it is
+ * on disk now, with the other end of a socket to be handed over on. It
+ * inherits nothing else, everything it takes comes through the socket.
+ */
+int start_successor(char** argv, int* sockfd, pid_t* pid) {
+    int fds[2];
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) == -1) {
+        stl_warn(errno, "Failed to open the handover socket");
+        return ST_FAIL;
+    }
+
+    if ((*pid = fork()) == -1) {
+        stl_warn(errno, "Failed to fork the upgraded server");
+        close(fds[0]);
+        close(fds[1]);
+        return ST_FAIL;
+    }
+
+    if (*pid == 0) {
+        const long maxFd = sysconf(_SC_OPEN_MAX);
+
+        for (int fd = 3; fd < (maxFd > 0 ? maxFd : 1024); fd++) {
+            if (fd != fds[1]) {
+                close(fd);
+            }
+        }
+
+        char value[16];
+        snprintf(value, sizeof(value), "%d", fds[1]);
+        setenv(HANDOVER_ENV, value, 1);
+
+        execvp(argv[0], argv);
+        stl_warn(errno, "Failed to start the upgraded server %s", argv[0]);
+        _exit(1);
+    }
+
+    close(fds[1]);
+    *sockfd = fds[0];
+
+    info("Started the upgraded server %s as %d", argv[0], (int)*pid);
+    return ST_GOOD;
+}
+
+/**
+ * The socket this server is handed over on, if a server being upgraded
+ * started it, otherwise -1. Taken out of the environment, so it is not
+ * passed on again.
+ */
+int take_handover_fd(void) {
+    const char* value = getenv(HANDOVER_ENV);
+
+    if (value == NULL) {
+        return -1;
+    }
+
+    char* end;
+    const long fd = strtol(value, &end, 10);
+    const bool valid = *value != '\0' && *end == '\0' && fd > 2 && fd <= INT32_MAX && fcntl((int)fd, F_GETFD) != -1;
+
+    unsetenv(HANDOVER_ENV);
+
+    if (!valid) {
+        warn("Ignoring %s, it is not an open descriptor", HANDOVER_ENV);
+        return -1;
+    }
+
+    fcntl((int)fd, F_SETFD, FD_CLOEXEC);
+    return (int)fd;
+}
+
+/**
+ * Start handing over, with the layouts this server was built with and its
+ * listening socket.
+ */
+int offer_handover(int sockfd, int listener) {
+    handover_hello_t hello;
+    describe_layouts(&hello);
+
+    if (handover_send(sockfd, HANDOVER_HELLO, &hello, sizeof(hello), -1) != ST_GOOD
+        || handover_send(sockfd, HANDOVER_LISTENER, NULL, 0, listener) != ST_GOOD) {
+        return ST_FAIL;
+    }
+
+    return ST_GOOD;
+}
+
+/**
+ * Take the listening socket of the server being upgraded, refusing the
+ * handover if it was built with other layouts. Closing the socket then tells
+ * it to carry on.
+ */
+int accept_handover(int sockfd, int* listener) {
+    handover_hello_t hello;
+    handover_hello_t expected;
+    uint8_t type;
+    size_t length;
+    int fd;
+
+    describe_layouts(&expected);
+
+    if (handover_receive(sockfd, &type, &hello, sizeof(hello), &length, &fd) != ST_GOOD) {
+        return ST_FAIL;
+    }
+
+    if (fd != -1) {
+        close(fd);
+    }
+
+    if (type != HANDOVER_HELLO || length != sizeof(hello) || memcmp(&hello, &expected, sizeof(hello)) != 0) {
+        warn("Refusing the handover, the server being upgraded keeps its state differently");
+        return ST_FAIL;
+    }
+
+    if (handover_receive(sockfd, &type, NULL, 0, &length, listener) != ST_GOOD) {
+        return ST_FAIL;
+    }
+
+    if (type != HANDOVER_LISTENER || *listener == -1) {
+        warn("Handover did not start with the listening socket");
+
+        if (*listener != -1) {
+            close(*listener);
+        }
+        return ST_FAIL;
+    }
+
+    return ST_GOOD;
+}
+
+/**
+ * Send one record, with `fd` passed along if it is not -1. The descriptor
+ * is duplicated into the receiver, this server's stays open.
+ */
+int handover_send(int sockfd, uint8_t type, const void* payload, size_t length, int fd) {
+    struct iovec iov[2] = {
+        { &type, sizeof(type) },
+        { (void*)payload, length },
+    };
+
+    union {
+        struct cmsghdr header;
+        uint8_t data[CMSG_SPACE(sizeof(int))];
+    } control;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = length > 0 ? 2 : 1;
+
+    if (fd != -1) {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.data;
+        msg.msg_controllen = sizeof(control.data);
+
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    if (sendmsg(sockfd, &msg, MSG_NOSIGNAL) == -1) {
+        stl_warn(errno, "Failed to hand over a record of type %u", type);
+        return ST_FAIL;
+    }
+
+    return ST_GOOD;
+}
+
+/**
+ * Receive one record into `payload`, and the descriptor passed with it into
+ * `fd`, or -1. A record larger than `size` fails, as does the other end
+ * closing.
+ */
+int handover_receive(int sockfd, uint8_t* type, void* payload, size_t size, size_t* length, int* fd) {
+    struct iovec iov[2] = {
+        { type, sizeof(*type) },
+        { payload, size },
+    };
+
+    union {
+        struct cmsghdr header;
+        uint8_t data[CMSG_SPACE(sizeof(int))];
+    } control;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = size > 0 ? 2 : 1;
+    msg.msg_control = control.data;
+    msg.msg_controllen = sizeof(control.data);
+
+    int flags = 0;
+
+#ifdef MSG_CMSG_CLOEXEC
+    flags |= MSG_CMSG_CLOEXEC;
+#endif
+
+    *fd = -1;
+    const ssize_t received = recvmsg(sockfd, &msg, flags);
+
+    if (received == -1) {
+        stl_warn(errno, "Failed to receive the handover");
+        return ST_FAIL;
+    }
+
+    if (received == 0) {
+        warn("Handover closed by the other server");
+        return ST_FAIL;
+    }
+
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+            memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+
+    if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+        warn("Handover record of type %u cut short", *type);
+
+        if (*fd != -1) {
+            close(*fd);
+            *fd = -1;
+        }
+        return ST_FAIL;
+    }
+
+    *length = (size_t)received - sizeof(*type);
+    return ST_GOOD;
+}
+
+/**
+ * Wait up to HANDOVER_TIMEOUT_MS for the new server to say it is serving.
+ */
+int await_handover_ready(int sockfd) {
+    struct timeval timeout = { HANDOVER_TIMEOUT_MS / 1000, (HANDOVER_TIMEOUT_MS % 1000) * 1000 };
+    uint8_t type;
+    size_t length;
+    int fd;
+
+    if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1) {
+        stl_warn(errno, "Failed to time out the handover");
+    }
+
+    if (handover_receive(sockfd, &type, NULL, 0, &length, &fd) != ST_GOOD) {
+        return ST_FAIL;
+    }
+
+    if (fd != -1) {
+        close(fd);
+    }
+
+    return type == HANDOVER_READY ? ST_GOOD : ST_FAIL;
+}
+
+/**
+ * Hand over to a server started again from the same command line, so from
+ * the binary now on disk, and exit once it is serving. Nodes keep their
+ * connections and relays keep forwarding throughout, the upgraded server
+ * takes them over as they are. If anything goes wrong this server carries on.
+ */
+void upgrade_server(server_t* server) {
+    const char* blocker = upgrade_blocker(server);
+
+    if (blocker != NULL) {
+        if (!server->upgradePending) {
+            info("Upgrade waits for %s to end", blocker);
+            server->upgradePending = timer_wheel_add(&server->timers, UPGRADE_RETRY_MS, &handle_upgrade_retry, 0, server) != TIMER_NONE;
+
+            if (!server->upgradePending) {
+                warn("Upgrade failed, carrying on");
+            }
+        }
+        return;
+    }
+
+    const uint64_t startNs = event_loop_now();
+    int sockfd;
+    pid_t pid;
+
+    if (start_successor(server->argv, &sockfd, &pid) != ST_GOOD) {
+        warn("Upgrade failed, carrying on");
+        return;
+    }
+
+    if (hand_over(server, sockfd) != ST_GOOD || await_handover_ready(sockfd) != ST_GOOD) {
+        warn("Upgrade failed, carrying on");
+        close(sockfd);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return;
+    }
+
+    // The upgraded server has its own of each connection, and writes the
+    // journal from now on, so they are only closed here
+    for (int i = 0; i < SERVER_MAX_CONNECTIONS; i++) {
+        connection_t* conn = &server->connections[i];
+
+        if (conn->fd != -1) {
+            event_loop_remove(&server->loop, conn->fd);
+            close(conn->fd);
+            conn->fd = -1;
+        }
+    }
+
+    server->handoverfd = sockfd;
+
+    info("Handed over to the upgraded server in %llu us, exiting", (unsigned long long)((event_loop_now() - startNs) / 1000));
+    event_loop_stop(&server->loop, ST_GOOD);
+}
+
+/**
+ * What is running that cannot be handed over, NULL if nothing. Bridges, page
+ * relays, mailboxes and the hold player's listeners only answer to this
+ * server, as does a relay whose info only it can map.
+ */
+static const char* upgrade_blocker(server_t* server) {
+    if (server->handoverfd != -1) {
+        return "the server upgraded from to exit";
+    }
+
+    for (int i = 0; i < SERVER_MAX_CONFERENCES; i++) {
+        if (server->conferences[i].bridge != NULL) {
+            return "a conference";
+        }
+    }
+
+    for (int i = 0; i < SERVER_MAX_PAGES; i++) {
+        if (server->pages[i].relay != NULL) {
+            return "a page";
+        }
+    }
+
+    for (int i = 0; i < SERVER_MAX_VOICEMAIL_CALLS; i++) {
+        if (server->voicemail_calls[i].mailbox != NULL) {
+            return "a call to voicemail";
+        }
+    }
+
+    for (int i = 0; i < HOLD_MAX_LISTENERS; i++) {
+        if (server->holds[i].holder != 0) {
+            return "a call on hold";
+        }
+    }
+
+    for (int i = 0; i < server->udp_server.port_count; i++) {
+        if (server->udp_server.fds[i] == -1) {
+            return "a call whose relay cannot be handed over";
+        }
+    }
+
+    return NULL;
+}
+
+static int handle_upgrade_retry(struct timer_wheel* wheel, uint64_t arg, void* data) {
+    server_t* server = (server_t*)data;
+
+    server->upgradePending = false;
+    upgrade_server(server);
+    return ST_GOOD;
+}
+
+/**
+ * Send the upgraded server the listening socket, each node's connection and
+ * session, every call, and what backs each relay's info. Connections go
+ * before the clients that refer to them.
+ */
+static int hand_over(server_t* server, int sockfd) {
+    if (offer_handover(sockfd, server->sockfd) != ST_GOOD) {
+        return ST_FAIL;
+    }
+
+    for (int i = 0; i < SERVER_MAX_CONNECTIONS; i++) {
+        const connection_t* conn = &server->connections[i];
+
+        if (conn->fd == -1) {
+            continue;
+        }
+
+        handover_connection_t saved;
+        memset(&saved, 0, sizeof(saved));
+        saved.index = (uint8_t)i;
+        saved.address = conn->address;
+        saved.addrLen = conn->addrLen;
+        saved.heardNs = conn->heardNs;
+        saved.keepalive = conn->keepaliveTimer != TIMER_NONE;
+        saved.messages = conn->messages;
+
+        if (handover_send(sockfd, HANDOVER_CONNECTION, &saved, sizeof(saved), conn->fd) != ST_GOOD) {
+            return ST_FAIL;
+        }
+    }
+
+    for (int i = 0; i < server->client_count; i++) {
+        const client_info_t* client = &server->clients[i];
+
+        handover_client_t saved;
+        memset(&saved, 0, sizeof(saved));
+        saved.connection = client->connection != NULL ? (int)(client->connection - server->connections) : -1;
+        saved.client = *client;
+        saved.client.connection = NULL;
+
+        if (handover_send(sockfd, HANDOVER_CLIENT, &saved, sizeof(saved), -1) != ST_GOOD) {
+            return ST_FAIL;
+        }
+    }
+
+    for (int i = 0; i < server->pending_count; i++) {
+        if (handover_send(sockfd, HANDOVER_PENDING_CALL, &server->pending_calls[i], sizeof(call_info_t), -1) != ST_GOOD) {
+            return ST_FAIL;
+        }
+    }
+
+    for (int i = 0; i < server->ongoing_count; i++) {
+        if (handover_send(sockfd, HANDOVER_ONGOING_CALL, &server->ongoing_calls[i], sizeof(call_info_t), -1) != ST_GOOD) {
+            return ST_FAIL;
+        }
+    }
+
+    for (int i = 0; i < server->udp_server.port_count; i++) {
+        if (handover_send(sockfd, HANDOVER_RELAY, NULL, 0, server->udp_server.fds[i]) != ST_GOOD) {
+            return ST_FAIL;
+        }
+    }
+
+    return handover_send(sockfd, HANDOVER_DONE, NULL, 0, -1);
+}
+
+/**
+ * Take what the server being upgraded hands over after its listening socket,
+ * and tell it this server is serving. Each timeout runs on from when it was
+ * last reset, by the clock both servers share.
+ */
+int take_over(server_t* server) {
+    union {
+        handover_connection_t connection;
+        handover_client_t client;
+        call_info_t call;
+    } record;
+
+    const uint64_t nowNs = event_loop_now();
+    const size_t maxCalls = sizeof(server->pending_calls) / sizeof(*server->pending_calls);
+    const uint64_t ringMs = server->voicemail.fd != -1 ? (uint64_t)server->conf->voicemail_answer_s * 1000 : RING_TIMEOUT_MS;
+    int relays = 0;
+    uint8_t type = 0;
+
+    while (type != HANDOVER_DONE) {
+        size_t length;
+        int fd;
+
+        if (handover_receive(server->handoverfd, &type, &record, sizeof(record), &length, &fd) != ST_GOOD) {
+            return ST_FAIL;
+        }
+
+        bool valid = false;
+
+        switch (type) {
+        case HANDOVER_CONNECTION: {
+            const int index = record.connection.index;
+
+            if (length != sizeof(record.connection) || fd == -1 || index >= SERVER_MAX_CONNECTIONS || server->connections[index].fd != -1) {
+                break;
+            }
+
+            connection_t* conn = &server->connections[index];
+
+            if (event_loop_add(&server->loop, fd, EVENT_READ, &handle_connection, conn) != ST_GOOD) {
+                break;
+            }
+
+            conn->fd = fd;
+            conn->address = record.connection.address;
+            conn->addrLen = record.connection.addrLen;
+            conn->heardNs = record.connection.heardNs;
+            conn->messages = record.connection.messages;
+            conn->keepaliveTimer = TIMER_NONE;
+
+            // Its handler waits for the rest of the timeout, or closes it
+            if (record.connection.keepalive) {
+                conn->keepaliveTimer = timer_wheel_add(&server->timers, 0, &handle_keepalive_timeout, index, server);
+            }
+
+            fd = -1;
+            valid = !record.connection.keepalive || conn->keepaliveTimer != TIMER_NONE;
+            break;
+        }
+        case HANDOVER_CLIENT: {
+            const int index = record.client.connection;
+
+            if (length != sizeof(record.client) || server->client_count >= SERVER_MAX_CLIENTS
+                || index < -1 || index >= SERVER_MAX_CONNECTIONS || (index != -1 && server->connections[index].fd == -1)) {
+                break;
+            }
+
+            client_info_t* client = &server->clients[server->client_count];
+            *client = record.client.client;
+            client->connection = index != -1 ? &server->connections[index] : NULL;
+            insert_session(server, server->client_count++);
+
+            const uint64_t detachedMs = (nowNs - MIN(client->detachedNs, nowNs)) / 1000000;
+            valid = client->connection != NULL
+                || timer_wheel_add(&server->timers, SESSION_RESUME_TIMEOUT_MS - MIN(detachedMs, SESSION_RESUME_TIMEOUT_MS), &handle_session_expiry, client->phone_number, server) != TIMER_NONE;
+            break;
+        }
+        case HANDOVER_PENDING_CALL: {
+            if (length != sizeof(record.call) || (size_t)server->pending_count >= maxCalls) {
+                break;
+            }
+
+            call_info_t* call = &server->pending_calls[server->pending_count++];
+            *call = record.call;
+
+            const uint64_t ringingMs = (nowNs - MIN(call->time, nowNs)) / 1000000;
+            valid = timer_wheel_add(&server->timers, ringMs - MIN(ringingMs, ringMs), &handle_ring_timeout, call->caller_token, server) != TIMER_NONE;
+            break;
+        }
+        case HANDOVER_ONGOING_CALL: {
+            if (length != sizeof(record.call) || (size_t)server->ongoing_count >= maxCalls) {
+                break;
+            }
+
+            call_info_t* call = &server->ongoing_calls[server->ongoing_count++];
+            *call = record.call;
+
+            // Its handler waits for the rest of the timeout, or ends it
+            valid = timer_wheel_add(&server->timers, 0, &handle_media_timeout, call->caller_token, server) != TIMER_NONE;
+            break;
+        }
+        case HANDOVER_RELAY:
+            // Closed on failure too
+            valid = fd != -1 && length == 0 && adopt_udp_port(&server->udp_server, fd) == ST_GOOD;
+            relays += valid;
+            fd = -1;
+            break;
+        case HANDOVER_DONE:
+            valid = length == 0;
+            break;
+        default:
+            break;
+        }
+
+        if (fd != -1) {
+            close(fd);
+        }
+
+        if (!valid) {
+            warn("Handover record of type %u is not valid", type);
+            return ST_FAIL;
+        }
+    }
+
+    if (handover_send(server->handoverfd, HANDOVER_READY, NULL, 0, -1) != ST_GOOD) {
+        return ST_FAIL;
+    }
+
+    info("Took over %d nodes, %d ringing and %d answered calls and %d relays", server->client_count, server->pending_count,
+        server->ongoing_count, relays);
+
+    // Until the old server exits it keeps its hold player
+    if (event_loop_add(&server->loop, server->handoverfd, EVENT_READ, &handle_handover_closed, server) != ST_GOOD) {
+        handle_handover_closed(&server->loop, server->handoverfd, 0, server);
+    }
+
+    return ST_GOOD;
+}
+
+/**
+ * The server upgraded from has exited, its hold player with it.
+ */
+static int handle_handover_closed(struct event_loop* loop, int fd, uint32_t events, void* data) {
+    server_t* server = (server_t*)data;
+
+    event_loop_remove(loop, fd);
+    close(fd);
+    server->handoverfd = -1;
+
+    info("The server upgraded from has exited");
+
+    if (server->conf->hold_music[0] != '\0' && timer_wheel_add(&server->timers, 0, &handle_hold_restart, 0, server) == TIMER_NONE) {
+        warn("Hold is off, its player could not be started");
+    }
+
+    return ST_GOOD;
+}
+
+static void describe_layouts(handover_hello_t* hello) {
+    memset(hello, 0, sizeof(*hello));
+    memcpy(hello->magic, HANDOVER_MAGIC, sizeof(hello->magic));
+    hello->version = HANDOVER_VERSION;
+    hello->connection_size = sizeof(handover_connection_t);
+    hello->client_size = sizeof(handover_client_t);
+    hello->call_size = sizeof(call_info_t);
+    hello->port_info_size = sizeof(udp_port_info_t);
+}
@@ -0,0 +1,387 @@
+#ifdef linux
+// sendmmsg()
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include "common.h"
+#include "server/packets.h"
+#include "server/hold_player.h"
+#include "utils/event_loop.h"
+
+// Room for a packet of 20 ms of L16 at the highest wire rate, header and tag
+#define HOLD_MAX_PACKET 2048
+
+/**
+ * The child's view of the player. The listeners with a known port are kept
+ * packed in `targets`, with a message for each already pointing at its
+ * address and at the one shared iovec, as at the page relay.
+ */
+typedef struct player {
+    hold_player_t* shared;
+    unsigned int generation;
+    uint8_t key[MEDIA_KEY_SIZE]; // As the server last wrote it
+    bool keyed;
+    media_crypto_t crypto;
+    relay_binding_t signalled[HOLD_MAX_LISTENERS];
+    relay_binding_t listeners[HOLD_MAX_LISTENERS];
+    int targetCount;
+    struct sockaddr_in targets[HOLD_MAX_LISTENERS];
+    struct iovec iov;
+#ifdef linux
+    struct mmsghdr msgs[HOLD_MAX_LISTENERS];
+#endif
+    uint64_t startNs;
+    uint64_t sentBlock; // The prompt's cursor, one for every listener
+    uint32_t sendFailures;
+    uint8_t packet[HOLD_MAX_PACKET];
+} player_t;
+
+// Owned by the child
+static player_t player;
+
+static void hold_player_main(hold_player_t* shared);
+static int  handle_packets(struct event_loop* loop, int fd, uint32_t events, void* data);
+static int  handle_tick(struct event_loop* loop, int fd, uint32_t events, void* data);
+static void refresh_listeners(player_t* player);
+static void update_targets(player_t* player);
+static void send_fan_out(player_t* player, size_t length);
+
+/**
+ * Start a child process playing `prompt` round and round on `port` to the
+ * listeners set with set_hold_listener(), sealed under `key`.
+ */
+int start_hold_player(hold_player_t** playerOut, uint16_t port, const prompt_t* prompt, const uint8_t* key) {
+    if (prompt->blockSize + MEDIA_OVERHEAD > HOLD_MAX_PACKET) {
+        warn("Hold player cannot send blocks of %u bytes", prompt->blockSize);
+        return ST_INVALID_ARG;
+    }
+
+    hold_player_t* shared = (hold_player_t*)create_shared_memory(sizeof(hold_player_t));
+
+    if (shared == MAP_FAILED) {
+        stl_warn(errno, "Failed to allocate hold player");
+        return ST_FAIL;
+    }
+
+    memset(shared->listeners, 0, sizeof(shared->listeners));
+    memcpy(shared->key, key, sizeof(shared->key));
+    shared->port = port;
+    shared->prompt = prompt;
+    atomic_init(&shared->generation, 0);
+
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if (sockfd == -1) {
+        stl_warn(errno, "Failed to open hold player socket");
+        destroy_shared_memory(shared, sizeof(hold_player_t));
+        return ST_FAIL;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+
+    if (bind(sockfd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        stl_warn(errno, "Failed to bind hold player port %hu", port);
+        close(sockfd);
+        destroy_shared_memory(shared, sizeof(hold_player_t));
+        return ST_FAIL;
+    }
+
+    shared->sockfd = sockfd;
+
+    info("Starting hold player on port: %hu", port);
+
+    pid_t pid = fork();
+
+    if (pid == -1) {
+        stl_warn(errno, "Failed to fork to start the hold player");
+        close(sockfd);
+        destroy_shared_memory(shared, sizeof(hold_player_t));
+        return ST_FAIL;
+    }
+
+    if (pid == 0) {
+        hold_player_main(shared);
+        exit(0);
+    }
+
+    close(sockfd);
+    shared->pid = pid;
+    *playerOut = shared;
+
+    return ST_GOOD;
+}
+
+void stop_hold_player(hold_player_t* shared) {
+    info("Killing hold player on port: %hu", shared->port);
+    kill(shared->pid, SIGINT);
+
+    memset(shared->key, 0, sizeof(shared->key));
+    destroy_shared_memory(shared, sizeof(hold_player_t));
+}
+
+/**
+ * Replace the key the program is sealed under. Only done with nobody
+ * listening, anyone still on hold would go quiet.
+ */
+void set_hold_key(hold_player_t* shared, const uint8_t* key) {
+    atomic_fetch_add_explicit(&shared->generation, 1, memory_order_acq_rel);
+    memcpy(shared->key, key, sizeof(shared->key));
+    atomic_fetch_add_explicit(&shared->generation, 1, memory_order_release);
+}
+
+/**
+ * Bind the listener in `slot`, a zeroed binding frees it.
+ */
+void set_hold_listener(hold_player_t* shared, int slot, const relay_binding_t* binding) {
+    if (slot < 0 || slot >= HOLD_MAX_LISTENERS) {
+        return;
+    }
+
+    // Odd while writing, the child skips bindings it catches half done
+    atomic_fetch_add_explicit(&shared->generation, 1, memory_order_acq_rel);
+    shared->listeners[slot] = *binding;
+    atomic_fetch_add_explicit(&shared->generation, 1, memory_order_release);
+}
+
+/**
+ * The hold player's main loop.
+ *
+ * The prompt has one cursor, moved on by the clock every PROMPT_BLOCK_MS
+ * whether anyone is listening or not, so a call put on hold joins the
+ * program wherever it has got to. Each block is sealed once, straight from
+ * the shared prompt, and sent to every listener whose port is known with one
+ * sendmmsg(). Putting fifty calls on hold costs the sends and nothing else.
+ * A tick run late skips to the block that is due, the ones missed are not
+ * worth catching up.
+ *
+ * Listeners only send reports, which open the path through any NAT. They
+ * are used to learn the listener's port and then dropped.
+ *
+ * This function returns when the parent kills it.
+ */
+static void hold_player_main(hold_player_t* shared) {
+    info("Child started hold player on socket %d", shared->sockfd);
+
+    memset(&player, 0, sizeof(player));
+    player.shared = shared;
+    player.startNs = event_loop_now();
+
+    fcntl(shared->sockfd, F_SETFL, fcntl(shared->sockfd, F_GETFL) | O_NONBLOCK);
+    refresh_listeners(&player);
+
+    event_loop_t loop;
+
+    if (init_event_loop(&loop) != ST_GOOD) {
+        return;
+    }
+
+    int tickTimer = event_loop_add_timer(&loop, &handle_tick, &player);
+
+    if (event_loop_add(&loop, shared->sockfd, EVENT_READ, &handle_packets, &player) != ST_GOOD || tickTimer < 0
+        || event_loop_arm_timer(&loop, tickTimer, PROMPT_BLOCK_MS, PROMPT_BLOCK_MS) != ST_GOOD) {
+        destroy_event_loop(&loop);
+        return;
+    }
+
+    event_loop_run(&loop);
+    destroy_event_loop(&loop);
+}
+
+static int handle_packets(struct event_loop* loop, int fd, uint32_t events, void* data) {
+    player_t* player = (player_t*)data;
+
+    refresh_listeners(player);
+
+    while (1) {
+        struct sockaddr_in addr;
+        socklen_t addrLen = sizeof(addr);
+
+        ssize_t bytesRead = recvfrom(fd, player->packet, sizeof(player->packet), 0, (struct sockaddr*)&addr, &addrLen);
+
+        if (bytesRead == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                stl_warn(errno, "Failed to read from a listener on hold");
+            }
+            break;
+        }
+
+        if ((size_t)bytesRead < sizeof(struct media_header) || addrLen != sizeof(addr)) {
+            continue;
+        }
+
+        const struct media_header* header = (const struct media_header*)player->packet;
+
+        if (header->version != MEDIA_VERSION || header->token == 0) {
+            continue;
+        }
+
+        for (int i = 0; i < HOLD_MAX_LISTENERS; i++) {
+            relay_binding_t* listener = &player->listeners[i];
+
+            if (header->token != listener->token || addr.sin_addr.s_addr != listener->addr.sin_addr.s_addr) {
+                continue;
+            }
+
+            if (addr.sin_port != listener->addr.sin_port) {
+                char addrBuf[INET_ADDRSTRLEN];
+                inet_ntop(AF_INET, &addr.sin_addr, addrBuf, INET_ADDRSTRLEN);
+                info("Hold player learned %s:%hu", addrBuf, ntohs(addr.sin_port));
+
+                listener->addr.sin_port = addr.sin_port;
+                update_targets(player);
+            }
+            break;
+        }
+    }
+
+    return ST_GOOD;
+}
+
+static int handle_tick(struct event_loop* loop, int fd, uint32_t events, void* data) {
+    player_t* player = (player_t*)data;
+    const prompt_t* prompt = player->shared->prompt;
+    const uint64_t due = (event_loop_now() - player->startNs) / ((uint64_t)PROMPT_BLOCK_MS * 1000000);
+
+    if (due < player->sentBlock) {
+        return ST_GOOD;
+    }
+
+    player->sentBlock = due + 1;
+    refresh_listeners(player);
+
+    if (player->targetCount == 0) {
+        return ST_GOOD;
+    }
+
+    const uint32_t timestamp = (uint32_t)(due * prompt->blockFrames);
+    const size_t length = media_seal(&player->crypto, player->packet, MEDIA_TYPE_AUDIO, MEDIA_FORMAT(prompt->codec, 0), timestamp,
+        prompt_block(prompt, due), prompt->blockSize);
+
+    if (length == 0) {
+        warn("Hold player ran out of sequence numbers");
+        return ST_GOOD;
+    }
+
+    send_fan_out(player, length);
+    return ST_GOOD;
+}
+
+/**
+ * Take any change the server has made since it was last seen. A port learned
+ * from packets is kept until the server binds the listener again.
+ */
+static void refresh_listeners(player_t* player) {
+    hold_player_t* shared = player->shared;
+    const unsigned int current = atomic_load_explicit(&shared->generation, memory_order_acquire);
+
+    if (player->keyed && (current == player->generation || (current & 1))) {
+        return;
+    }
+
+    uint8_t key[MEDIA_KEY_SIZE];
+    relay_binding_t copy[HOLD_MAX_LISTENERS];
+    memcpy(key, shared->key, sizeof(key));
+    memcpy(copy, shared->listeners, sizeof(copy));
+
+    // The server started writing again while this was copied
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&shared->generation, memory_order_relaxed) != current || (current & 1)) {
+        memset(key, 0, sizeof(key));
+        return;
+    }
+
+    // The sequence starts again under a new key, never under the old one
+    if (!player->keyed || memcmp(key, player->key, sizeof(key)) != 0) {
+        memcpy(player->key, key, sizeof(key));
+        destroy_media_crypto(&player->crypto);
+        init_media_crypto(&player->crypto, key, MEDIA_SENDER_RELAY, 0);
+        player->keyed = true;
+    }
+
+    for (int i = 0; i < HOLD_MAX_LISTENERS; i++) {
+        if (memcmp(&copy[i], &player->signalled[i], sizeof(copy[i])) != 0) {
+            player->signalled[i] = copy[i];
+            player->listeners[i] = copy[i];
+        }
+    }
+
+    memset(key, 0, sizeof(key));
+    player->generation = current;
+    update_targets(player);
+}
+
+/**
+ * Pack the listeners that can be sent to into `targets`.
+ */
+static void update_targets(player_t* player) {
+    player->targetCount = 0;
+
+    for (int i = 0; i < HOLD_MAX_LISTENERS; i++) {
+        const relay_binding_t* listener = &player->listeners[i];
+
+        if (listener->token != 0 && listener->addr.sin_port != 0) {
+            player->targets[player->targetCount++] = listener->addr;
+        }
+    }
+
+#ifdef linux
+    memset(player->msgs, 0, sizeof(player->msgs));
+
+    for (int i = 0; i < player->targetCount; i++) {
+        player->msgs[i].msg_hdr.msg_name = &player->targets[i];
+        player->msgs[i].msg_hdr.msg_namelen = sizeof(player->targets[i]);
+        player->msgs[i].msg_hdr.msg_iov = &player->iov;
+        player->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+#endif
+}
+
+/**
+ * Send the packet to every target. A listener whose socket buffer is full
+ * misses the block.
+ */
+static void send_fan_out(player_t* player, size_t length) {
+    player->iov.iov_base = player->packet;
+    player->iov.iov_len = length;
+
+    int sent = 0;
+
+    while (sent < player->targetCount) {
+#ifdef linux
+        const int res = sendmmsg(player->shared->sockfd, &player->msgs[sent], player->targetCount - sent, 0);
+#else
+        const int res = sendto(player->shared->sockfd, player->packet, length, 0, (const struct sockaddr*)&player->targets[sent], sizeof(player->targets[sent])) == -1 ? -1 : 1;
+#endif
+
+        if (res > 0) {
+            sent += res;
+            continue;
+        }
+
+        if (errno == EINTR) {
+            continue;
+        }
+
+        // sendmmsg() stops at the first datagram it cannot send, skip it
+        if (errno != ENOBUFS && errno != EAGAIN && errno != EWOULDBLOCK) {
+            stl_warn(errno, "Failed to send hold audio to a listener");
+        } else if (player->sendFailures++ % 1000 == 0) {
+            warn("Hold player on port %hu is dropping audio for slow listeners", player->shared->port);
+        }
+
+        sent++;
+    }
+}
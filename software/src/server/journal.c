@@ -0,0 +1,413 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "common.h"
+#include "server/journal.h"
+#include "utils/event_loop.h"
+
+static int write_snapshot(journal_t* journal);
+static void sync_directory(const char* path);
+static int append(journal_t* journal, uint8_t type, const void* payload, uint16_t length);
+static size_t write_record(uint8_t* base, size_t offset, uint64_t sequence, uint8_t type, const void* payload, uint16_t length);
+static int replay(journal_t* journal, const uint8_t* base, size_t size);
+static void apply(journal_state_t* state, uint8_t type, const uint8_t* payload, uint16_t length);
+static uint32_t crc32(uint32_t crc, const void* data, size_t length);
+
+/**
+ * Open the journal at `path`, creating it if need be, and rebuild the state
+ * from what it holds. The state is then written to a fresh journal, so one
+ * left half written by a crash is never appended to.
+ */
+int open_journal(journal_t* journal, const char* path) {
+    memset(journal, 0, sizeof(*journal));
+    journal->fd = -1;
+
+    if (copy_string(journal->path, sizeof(journal->path), path) != ST_GOOD) {
+        warn("Journal path %s is too long", path);
+        return ST_FAIL;
+    }
+
+    const uint64_t startNs = event_loop_now();
+    int fd = open(path, O_RDONLY);
+
+    if (fd == -1 && errno != ENOENT) {
+        stl_warn(errno, "Failed to open the journal %s", path);
+        return ST_FAIL;
+    }
+
+    if (fd != -1) {
+        struct stat st;
+        void* base = MAP_FAILED;
+
+        if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(journal_header_t)) {
+            base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+
+        if (base == MAP_FAILED) {
+            warn("Journal %s cannot be read, starting empty", path);
+        } else {
+            const int records = replay(journal, (const uint8_t*)base, (size_t)st.st_size);
+            munmap(base, (size_t)st.st_size);
+
+            info("Journal %s replayed %d records, %d nodes and %d calls in %llu us", path, records, journal->state.client_count,
+                journal->state.call_count, (unsigned long long)((event_loop_now() - startNs) / 1000));
+        }
+
+        close(fd);
+    }
+
+    return write_snapshot(journal);
+}
+
+void close_journal(journal_t* journal) {
+    if (journal->fd == -1) {
+        return;
+    }
+
+    msync(journal->base, JOURNAL_SIZE, MS_SYNC);
+    munmap(journal->base, JOURNAL_SIZE);
+    close(journal->fd);
+    journal->base = NULL;
+    journal->fd = -1;
+}
+
+/**
+ * Replace the journal with the state as it stands, if anything has changed
+ * since it last was.
+ */
+int compact_journal(journal_t* journal) {
+    if (journal->fd == -1 || journal->appended == 0) {
+        return ST_GOOD;
+    }
+
+    const uint32_t appended = journal->appended;
+
+    if (write_snapshot(journal) != ST_GOOD) {
+        return ST_FAIL;
+    }
+
+    info("Journal %s compacted %u records to %llu bytes", journal->path, appended, (unsigned long long)journal->length);
+    return ST_GOOD;
+}
+
+int journal_put_client(journal_t* journal, const journal_client_t* client) {
+    return append(journal, JOURNAL_CLIENT, client, sizeof(*client));
+}
+
+int journal_drop_client(journal_t* journal, uint16_t phoneNumber) {
+    return append(journal, JOURNAL_CLIENT_GONE, &phoneNumber, sizeof(phoneNumber));
+}
+
+int journal_put_call(journal_t* journal, const journal_call_t* call) {
+    return append(journal, JOURNAL_CALL, call, sizeof(*call));
+}
+
+int journal_drop_call(journal_t* journal, uint32_t callerToken) {
+    return append(journal, JOURNAL_CALL_GONE, &callerToken, sizeof(callerToken));
+}
+
+/**
+ * Write the state to a new file, synced, and rename it over the journal.
+ * Until the rename the old journal is the one a restart reads, and until its
+ * directory is synced a crash may still bring the old one back.
+ */
+static int write_snapshot(journal_t* journal) {
+    char path[JOURNAL_PATH_LEN + 8];
+    snprintf(path, sizeof(path), "%s.new", journal->path);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0640);
+
+    if (fd == -1) {
+        stl_warn(errno, "Failed to create the journal %s", path);
+        return ST_FAIL;
+    }
+
+    if (ftruncate(fd, JOURNAL_SIZE) == -1) {
+        stl_warn(errno, "Failed to size the journal %s", path);
+        close(fd);
+        unlink(path);
+        return ST_FAIL;
+    }
+
+    uint8_t* base = (uint8_t*)mmap(NULL, JOURNAL_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (base == MAP_FAILED) {
+        stl_warn(errno, "Failed to map the journal %s", path);
+        close(fd);
+        unlink(path);
+        return ST_FAIL;
+    }
+
+    journal_header_t* header = (journal_header_t*)base;
+    memcpy(header->magic, JOURNAL_MAGIC, sizeof(header->magic));
+    header->version = JOURNAL_VERSION;
+    header->sequence = journal->sequence;
+    header->checksum = crc32(0, header, offsetof(journal_header_t, checksum));
+
+    const journal_state_t* state = &journal->state;
+    size_t length = sizeof(*header);
+
+    for (int i = 0; i < state->client_count; i++) {
+        length = write_record(base, length, journal->sequence++, JOURNAL_CLIENT, &state->clients[i], sizeof(state->clients[i]));
+    }
+
+    for (int i = 0; i < state->call_count; i++) {
+        length = write_record(base, length, journal->sequence++, JOURNAL_CALL, &state->calls[i], sizeof(state->calls[i]));
+    }
+
+    if (msync(base, JOURNAL_SIZE, MS_SYNC) == -1 || rename(path, journal->path) == -1) {
+        stl_warn(errno, "Failed to replace the journal %s", journal->path);
+        munmap(base, JOURNAL_SIZE);
+        close(fd);
+        unlink(path);
+        return ST_FAIL;
+    }
+
+    sync_directory(journal->path);
+
+    if (journal->fd != -1) {
+        munmap(journal->base, JOURNAL_SIZE);
+        close(journal->fd);
+    }
+
+    journal->fd = fd;
+    journal->base = base;
+    journal->length = length;
+    journal->appended = 0;
+    return ST_GOOD;
+}
+
+/**
+ * Sync the directory holding `path`, so a rename into it survives a crash.
+ */
+static void sync_directory(const char* path) {
+    char directory[JOURNAL_PATH_LEN];
+    const char* slash = strrchr(path, '/');
+
+    if (slash == NULL) {
+        strcpy(directory, ".");
+    } else if (slash == path) {
+        strcpy(directory, "/");
+    } else {
+        snprintf(directory, sizeof(directory), "%.*s", (int)(slash - path), path);
+    }
+
+    int fd = open(directory, O_RDONLY | O_DIRECTORY);
+
+    if (fd == -1 || fsync(fd) == -1) {
+        stl_warn(errno, "Failed to sync the journal's directory %s", directory);
+    }
+
+    if (fd != -1) {
+        close(fd);
+    }
+}
+
+/**
+ * Write a record after the last, compacting first if it does not fit, and
+ * only then apply it to the state. Without a journal there is nothing to do.
+ */
+static int append(journal_t* journal, uint8_t type, const void* payload, uint16_t length) {
+    if (journal->fd == -1) {
+        return ST_GOOD;
+    }
+
+    const size_t size = sizeof(journal_record_t) + length;
+
+    if (journal->length + size > JOURNAL_SIZE && write_snapshot(journal) != ST_GOOD) {
+        return ST_FAIL;
+    }
+
+    if (journal->length + size > JOURNAL_SIZE) {
+        warn("Journal %s is full", journal->path);
+        return ST_FAIL;
+    }
+
+    const size_t start = journal->length;
+    journal->length = write_record(journal->base, start, journal->sequence++, type, payload, length);
+    journal->appended++;
+
+    // The pages the record is on, for the kernel to write out without waiting
+    const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    const size_t first = start / page * page;
+    msync(journal->base + first, journal->length - first, MS_ASYNC);
+
+    apply(&journal->state, type, (const uint8_t*)payload, length);
+    return ST_GOOD;
+}
+
+/**
+ * Lay a record out at `offset` and return where the next one goes. The
+ * checksum covers everything after it, so a record cut short by a crash is
+ * where replay stops.
+ */
+static size_t write_record(uint8_t* base, size_t offset, uint64_t sequence, uint8_t type, const void* payload, uint16_t length) {
+    journal_record_t* record = (journal_record_t*)(base + offset);
+
+    record->length = length;
+    record->type = type;
+    record->reserved = 0;
+    record->sequence = sequence;
+    memcpy(base + offset + sizeof(*record), payload, length);
+    record->checksum = crc32(0, &record->length, sizeof(*record) - offsetof(journal_record_t, length) + length);
+
+    return offset + sizeof(*record) + length;
+}
+
+/**
+ * Apply every record that checks out, in order, and return how many did.
+ */
+static int replay(journal_t* journal, const uint8_t* base, size_t size) {
+    const journal_header_t* header = (const journal_header_t*)base;
+
+    if (memcmp(header->magic, JOURNAL_MAGIC, sizeof(header->magic)) != 0 || header->version != JOURNAL_VERSION
+        || header->checksum != crc32(0, header, offsetof(journal_header_t, checksum))) {
+        warn("Journal %s has no valid header, starting empty", journal->path);
+        return 0;
+    }
+
+    size_t offset = sizeof(*header);
+    uint64_t sequence = header->sequence;
+    int count = 0;
+
+    while (offset + sizeof(journal_record_t) <= size) {
+        const journal_record_t* record = (const journal_record_t*)(base + offset);
+        const size_t end = offset + sizeof(*record) + record->length;
+
+        if (record->sequence != sequence || end > size
+            || record->checksum != crc32(0, &record->length, sizeof(*record) - offsetof(journal_record_t, length) + record->length)) {
+            break;
+        }
+
+        apply(&journal->state, record->type, base + offset + sizeof(*record), record->length);
+        offset = end;
+        sequence++;
+        count++;
+    }
+
+    journal->sequence = sequence;
+    return count;
+}
+
+static void apply(journal_state_t* state, uint8_t type, const uint8_t* payload, uint16_t length) {
+    switch (type) {
+    case JOURNAL_CLIENT: {
+        if (length != sizeof(journal_client_t)) {
+            break;
+        }
+
+        journal_client_t client;
+        memcpy(&client, payload, sizeof(client));
+        int i = 0;
+
+        while (i < state->client_count && state->clients[i].phone_number != client.phone_number) {
+            i++;
+        }
+
+        if (i == JOURNAL_MAX_CLIENTS) {
+            warn("Journal holds too many nodes, dropping %hu", client.phone_number);
+            break;
+        }
+
+        state->clients[i] = client;
+        state->client_count += i == state->client_count;
+        break;
+    }
+    case JOURNAL_CLIENT_GONE: {
+        uint16_t phoneNumber;
+
+        if (length != sizeof(phoneNumber)) {
+            break;
+        }
+
+        memcpy(&phoneNumber, payload, sizeof(phoneNumber));
+
+        for (int i = 0; i < state->client_count; i++) {
+            if (state->clients[i].phone_number == phoneNumber) {
+                state->clients[i] = state->clients[--state->client_count];
+                break;
+            }
+        }
+        break;
+    }
+    case JOURNAL_CALL: {
+        if (length != sizeof(journal_call_t)) {
+            break;
+        }
+
+        journal_call_t call;
+        memcpy(&call, payload, sizeof(call));
+        int i = 0;
+
+        while (i < state->call_count && state->calls[i].caller_token != call.caller_token) {
+            i++;
+        }
+
+        if (i == JOURNAL_MAX_CALLS) {
+            warn("Journal holds too many calls, dropping %hu to %hu", call.caller, call.callee);
+            break;
+        }
+
+        state->calls[i] = call;
+        state->call_count += i == state->call_count;
+        break;
+    }
+    case JOURNAL_CALL_GONE: {
+        uint32_t callerToken;
+
+        if (length != sizeof(callerToken)) {
+            break;
+        }
+
+        memcpy(&callerToken, payload, sizeof(callerToken));
+
+        for (int i = 0; i < state->call_count; i++) {
+            if (state->calls[i].caller_token == callerToken) {
+                state->calls[i] = state->calls[--state->call_count];
+                break;
+            }
+        }
+        break;
+    }
+    default:
+        warn("Journal record of unknown type %u skipped", type);
+        break;
+    }
+}
+
+/**
+ * CRC-32 as in zlib, with the table built on first use.
+ */
+static uint32_t crc32(uint32_t crc, const void* data, size_t length) {
+    static uint32_t table[256];
+    static bool built = false;
+
+    if (!built) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t value = i;
+
+            for (int bit = 0; bit < 8; bit++) {
+                value = (value & 1) ? (value >> 1) ^ 0xEDB88320u : value >> 1;
+            }
+
+            table[i] = value;
+        }
+
+        built = true;
+    }
+
+    const uint8_t* bytes = (const uint8_t*)data;
+    crc = ~crc;
+
+    for (size_t i = 0; i < length; i++) {
+        crc = table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    }
+
+    return ~crc;
+}
@@ -0,0 +1,547 @@
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include "common.h"
+#include "server/packets.h"
+#include "server/mailbox.h"
+#include "audiobackend/codec.h"
+#include "utils/event_loop.h"
+
+// Messages are played out on this tick, each block sent once it is due
+#define MAILBOX_TICK_MS 20
+
+// Silence left between two messages
+#define MAILBOX_GAP_MS 1000
+
+// Room for a packet of 20 ms of L16 at the highest wire rate, header and tag
+#define MAILBOX_MAX_PACKET 2048
+
+/**
+ * The child's view of the line.
+ */
+typedef struct line {
+    mailbox_t* shared;
+    unsigned int generation;
+    mailbox_peer_t signalled; // As the server last wrote it
+    struct sockaddr_in addr;  // Port learned from its packets
+    media_crypto_t crypto;
+
+    // Recording, timestamps from the message's first block
+    bool started;
+    uint32_t firstTimestamp;
+    uint32_t nextTimestamp; // Past the newest block kept
+    bool full;
+
+    // Playing
+    int message; // The one playing, or next
+    voicemail_map_t map;
+    uint32_t position; // Into the map's frames
+    uint64_t messageNs; // When the message started, or starts
+    uint32_t baseTimestamp; // Sent for its first block
+    uint32_t endTimestamp; // Past its newest block sent
+
+    uint8_t packet[MAILBOX_MAX_PACKET];
+} line_t;
+
+// Owned by the child
+static line_t line;
+
+static int  start_mailbox(mailbox_t* shared, uint16_t port);
+static void mailbox_main(mailbox_t* shared);
+static int  handle_packets(struct event_loop* loop, int fd, uint32_t events, void* data);
+static int  handle_tick(struct event_loop* loop, int fd, uint32_t events, void* data);
+static void refresh_peer(line_t* line);
+static void record_audio(line_t* line, const struct media_header* header, const uint8_t* payload, size_t length);
+static void keep_block(line_t* line, uint32_t timestamp, uint8_t codec, const uint8_t* block, size_t length);
+static bool play_message(line_t* line, uint64_t nowNs);
+static void next_message(line_t* line);
+
+/**
+ * Start a child process taking a message for `owner` on `port`. The caller
+ * is bound with set_mailbox_peer(), and the message is stored when the
+ * mailbox is stopped.
+ */
+int start_mailbox_recording(mailbox_t** mailboxOut, uint16_t port, uint16_t owner, uint16_t from, uint32_t maxMs) {
+    mailbox_t* shared = (mailbox_t*)create_shared_memory(sizeof(mailbox_t));
+
+    if (shared == MAP_FAILED) {
+        stl_warn(errno, "Failed to allocate mailbox");
+        return ST_FAIL;
+    }
+
+    shared->playing = false;
+    shared->owner = owner;
+    shared->from_phone_number = from;
+    shared->max_ms = maxMs;
+    shared->recorded_frames = 0;
+    atomic_init(&shared->length, 0);
+
+    if (start_mailbox(shared, port) != ST_GOOD) {
+        return ST_FAIL;
+    }
+
+    info("Taking a message from %hu for %hu on port %hu", from, owner, port);
+    *mailboxOut = shared;
+    return ST_GOOD;
+}
+
+/**
+ * Start a child process playing `messages` on `port`, newest first, to the
+ * peer bound with set_mailbox_peer(). Each is mapped from its segment in
+ * turn and sent block by block as it was received.
+ */
+int start_mailbox_playback(mailbox_t** mailboxOut, uint16_t port, const voicemail_store_t* store, const voicemail_entry_t* messages, int count) {
+    mailbox_t* shared = (mailbox_t*)create_shared_memory(sizeof(mailbox_t));
+
+    if (shared == MAP_FAILED) {
+        stl_warn(errno, "Failed to allocate mailbox");
+        return ST_FAIL;
+    }
+
+    shared->playing = true;
+    memcpy(shared->directory, store->directory, sizeof(shared->directory));
+    shared->message_count = MIN(count, VOICEMAIL_MAX_MESSAGES);
+    memcpy(shared->messages, messages, shared->message_count * sizeof(*messages));
+
+    if (start_mailbox(shared, port) != ST_GOOD) {
+        return ST_FAIL;
+    }
+
+    info("Playing %d messages on port %hu", shared->message_count, port);
+    *mailboxOut = shared;
+    return ST_GOOD;
+}
+
+static int start_mailbox(mailbox_t* shared, uint16_t port) {
+    memset(&shared->peer, 0, sizeof(shared->peer));
+    shared->port = port;
+    atomic_init(&shared->generation, 0);
+    atomic_init(&shared->finished, false);
+
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if (sockfd == -1) {
+        stl_warn(errno, "Failed to open mailbox socket");
+        destroy_shared_memory(shared, sizeof(mailbox_t));
+        return ST_FAIL;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+
+    if (bind(sockfd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        stl_warn(errno, "Failed to bind mailbox port %hu", port);
+        close(sockfd);
+        destroy_shared_memory(shared, sizeof(mailbox_t));
+        return ST_FAIL;
+    }
+
+    shared->sockfd = sockfd;
+
+    pid_t pid = fork();
+
+    if (pid == -1) {
+        stl_warn(errno, "Failed to fork to start the mailbox");
+        close(sockfd);
+        destroy_shared_memory(shared, sizeof(mailbox_t));
+        return ST_FAIL;
+    }
+
+    if (pid == 0) {
+        mailbox_main(shared);
+        exit(0);
+    }
+
+    close(sockfd);
+    shared->pid = pid;
+
+    return ST_GOOD;
+}
+
+/**
+ * Stop the mailbox. A message it was taking is stored in `store` once the
+ * child is gone, so nothing is still being added to it, unless `store` is
+ * NULL.
+ */
+void stop_mailbox(mailbox_t* shared, voicemail_store_t* store) {
+    info("Killing mailbox on port: %hu", shared->port);
+    kill(shared->pid, SIGINT);
+
+    if (waitpid(shared->pid, NULL, 0) == -1) {
+        stl_warn(errno, "Failed to wait for the mailbox on port %hu", shared->port);
+        store = NULL;
+    }
+
+    const size_t length = atomic_load_explicit(&shared->length, memory_order_acquire);
+
+    if (!shared->playing && store != NULL && length > 0 && shared->peer.wireRate != 0) {
+        voicemail_message_t message;
+        message.mailbox = shared->owner;
+        message.from_phone_number = shared->from_phone_number;
+        message.wire_rate = shared->peer.wireRate;
+        message.duration_ms = (uint32_t)((uint64_t)shared->recorded_frames * 1000 / shared->peer.wireRate);
+        message.frames = shared->frames;
+        message.length = (uint32_t)length;
+
+        voicemail_append(store, &message);
+    }
+
+    memset(&shared->peer, 0, sizeof(shared->peer));
+    destroy_shared_memory(shared, sizeof(mailbox_t));
+}
+
+/**
+ * Write the node on the line. Called whenever the server learns more of it,
+ * the child picks the change up on its next packet or tick.
+ */
+void set_mailbox_peer(mailbox_t* shared, const mailbox_peer_t* peer) {
+    // Odd while writing, the child skips a peer it catches half done
+    atomic_fetch_add_explicit(&shared->generation, 1, memory_order_acq_rel);
+    shared->peer = *peer;
+    atomic_fetch_add_explicit(&shared->generation, 1, memory_order_release);
+}
+
+/**
+ * Whether a mailbox has played all its messages, or has taken as long a
+ * message as it can.
+ */
+bool mailbox_finished(mailbox_t* shared) {
+    return atomic_load_explicit(&shared->finished, memory_order_acquire);
+}
+
+/**
+ * The mailbox's main loop.
+ *
+ * Taking a message, the caller's audio is opened and each block kept as it
+ * came, in its codec, FEC blocks filling in for lost packets. Nothing is
+ * decoded, and nothing is written to disk until the server stores the
+ * message.
+ *
+ * Playing, each message is mapped from its segment and every block is
+ * sealed straight from the mapping once it is due, so playback needs no
+ * buffer of its own but the packet. Blocks go out at the pace they were
+ * recorded, with a gap between messages.
+ *
+ * This function returns when the parent kills it.
+ */
+static void mailbox_main(mailbox_t* shared) {
+    info("Child started mailbox on socket %d", shared->sockfd);
+
+    memset(&line, 0, sizeof(line));
+    line.shared = shared;
+
+    fcntl(shared->sockfd, F_SETFL, fcntl(shared->sockfd, F_GETFL) | O_NONBLOCK);
+
+    event_loop_t loop;
+
+    if (init_event_loop(&loop) != ST_GOOD) {
+        return;
+    }
+
+    if (event_loop_add(&loop, shared->sockfd, EVENT_READ, &handle_packets, &line) != ST_GOOD) {
+        destroy_event_loop(&loop);
+        return;
+    }
+
+    if (shared->playing) {
+        const int tickTimer = event_loop_add_timer(&loop, &handle_tick, &line);
+
+        if (tickTimer < 0 || event_loop_arm_timer(&loop, tickTimer, MAILBOX_TICK_MS, MAILBOX_TICK_MS) != ST_GOOD) {
+            destroy_event_loop(&loop);
+            return;
+        }
+    }
+
+    event_loop_run(&loop);
+    destroy_event_loop(&loop);
+}
+
+static int handle_packets(struct event_loop* loop, int fd, uint32_t events, void* data) {
+    line_t* line = (line_t*)data;
+
+    refresh_peer(line);
+
+    while (1) {
+        struct sockaddr_in addr;
+        socklen_t addrLen = sizeof(addr);
+
+        ssize_t bytesRead = recvfrom(fd, line->packet, sizeof(line->packet), 0, (struct sockaddr*)&addr, &addrLen);
+
+        if (bytesRead == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                stl_warn(errno, "Failed to read mailbox audio");
+            }
+            break;
+        }
+
+        if ((size_t)bytesRead < sizeof(struct media_header) || addrLen != sizeof(addr)) {
+            continue;
+        }
+
+        const struct media_header* header = (const struct media_header*)line->packet;
+
+        if (!line->signalled.keyed || header->version != MEDIA_VERSION || header->token != line->signalled.token
+            || addr.sin_addr.s_addr != line->addr.sin_addr.s_addr) {
+            continue;
+        }
+
+        uint8_t* payload;
+        size_t payloadLength;
+
+        if (media_open(&line->crypto, line->packet, bytesRead, &payload, &payloadLength) != ST_GOOD) {
+            continue;
+        }
+
+        // Only an authentic packet moves where messages are played to
+        line->addr.sin_port = addr.sin_port;
+
+        if (!line->shared->playing && header->type == MEDIA_TYPE_AUDIO) {
+            record_audio(line, header, payload, payloadLength);
+        }
+    }
+
+    return ST_GOOD;
+}
+
+/**
+ * Take the peer if the server has changed it since it was last seen. A new
+ * key starts the stream afresh.
+ */
+static void refresh_peer(line_t* line) {
+    mailbox_t* shared = line->shared;
+    const unsigned int current = atomic_load_explicit(&shared->generation, memory_order_acquire);
+
+    if (current == line->generation || (current & 1)) {
+        return;
+    }
+
+    mailbox_peer_t copy = shared->peer;
+
+    // The server started writing again while this was copied
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&shared->generation, memory_order_relaxed) != current) {
+        return;
+    }
+
+    if (copy.keyed != line->signalled.keyed || memcmp(copy.key, line->signalled.key, sizeof(copy.key)) != 0) {
+        destroy_media_crypto(&line->crypto);
+
+        if (copy.keyed) {
+            init_media_crypto(&line->crypto, copy.key, MEDIA_SENDER_RELAY, 0);
+        }
+    }
+
+    if (copy.addr.sin_addr.s_addr != line->signalled.addr.sin_addr.s_addr || copy.addr.sin_port != line->signalled.addr.sin_port) {
+        line->addr = copy.addr;
+    }
+
+    line->signalled = copy;
+    memset(&copy, 0, sizeof(copy));
+    line->generation = current;
+}
+
+/**
+ * Keep the blocks of an audio payload that are newer than any kept, oldest
+ * first. The blocks run back to back, ending with the one the timestamp is
+ * for, as in the transfer engine.
+ */
+static void record_audio(line_t* line, const struct media_header* header, const uint8_t* payload, size_t length) {
+    const int codec = MEDIA_FORMAT_CODEC(header->format);
+    const int fec = MEDIA_FORMAT_FEC(header->format);
+
+    if (codec >= MEDIA_CODEC_COUNT || fec > MEDIA_MAX_FEC || length < fec * sizeof(uint16_t)) {
+        return;
+    }
+
+    const uint8_t* blocks[MEDIA_MAX_FEC + 1];
+    size_t blockLengths[MEDIA_MAX_FEC + 1];
+    size_t blockFrames[MEDIA_MAX_FEC + 1];
+
+    const uint8_t* block = payload + fec * sizeof(uint16_t);
+    size_t remaining = length - fec * sizeof(uint16_t);
+    size_t frames = 0;
+
+    for (int i = 0; i <= fec; i++) {
+        blockLengths[i] = i < fec ? (size_t)((payload[2 * i] << 8) | payload[2 * i + 1]) : remaining;
+
+        if (blockLengths[i] > remaining || blockLengths[i] > UINT16_MAX) {
+            return;
+        }
+
+        blocks[i] = block;
+        blockFrames[i] = codec_decoded_frames(codec, block, blockLengths[i]);
+
+        if (blockFrames[i] == 0) {
+            return;
+        }
+
+        block += blockLengths[i];
+        remaining -= blockLengths[i];
+        frames += blockFrames[i];
+    }
+
+    // The oldest block starts this far before the primary's end
+    const uint32_t end = ntohl(header->timestamp) + (uint32_t)blockFrames[fec];
+
+    if (!line->started) {
+        line->started = true;
+        line->firstTimestamp = end - (uint32_t)blockFrames[fec];
+    }
+
+    uint32_t start = end - (uint32_t)frames;
+
+    for (int i = 0; i <= fec; i++) {
+        keep_block(line, start, (uint8_t)codec, blocks[i], blockLengths[i]);
+        start += (uint32_t)blockFrames[i];
+    }
+}
+
+/**
+ * Append a block to the message, unless it is older than the newest kept or
+ * the message is full.
+ */
+static void keep_block(line_t* line, uint32_t timestamp, uint8_t codec, const uint8_t* block, size_t length) {
+    mailbox_t* shared = line->shared;
+    const int32_t relative = (int32_t)(timestamp - line->firstTimestamp);
+
+    if (line->full || relative < 0 || (uint32_t)relative < line->nextTimestamp) {
+        return;
+    }
+
+    const size_t frames = codec_decoded_frames(codec, block, length);
+    const uint64_t maxFrames = (uint64_t)shared->max_ms * line->signalled.wireRate / 1000;
+    const size_t used = atomic_load_explicit(&shared->length, memory_order_relaxed);
+
+    if ((uint64_t)relative + frames > maxFrames || used + sizeof(voicemail_frame_t) + length > sizeof(shared->frames)) {
+        info("Message for %hu is full at %u ms", shared->owner, (unsigned int)((uint64_t)line->nextTimestamp * 1000 / MAX(line->signalled.wireRate, 1u)));
+        line->full = true;
+        atomic_store_explicit(&shared->finished, true, memory_order_release);
+        return;
+    }
+
+    voicemail_frame_t frame;
+    frame.timestamp = (uint32_t)relative;
+    frame.format = MEDIA_FORMAT(codec, 0);
+    frame.length = (uint16_t)length;
+
+    memcpy(shared->frames + used, &frame, sizeof(frame));
+    memcpy(shared->frames + used + sizeof(frame), block, length);
+
+    line->nextTimestamp = (uint32_t)relative + (uint32_t)frames;
+    shared->recorded_frames = line->nextTimestamp;
+
+    // A child killed part way through a block leaves it uncounted
+    atomic_store_explicit(&shared->length, used + sizeof(frame) + length, memory_order_release);
+}
+
+static int handle_tick(struct event_loop* loop, int fd, uint32_t events, void* data) {
+    line_t* line = (line_t*)data;
+    const uint64_t nowNs = event_loop_now();
+
+    refresh_peer(line);
+
+    // Nothing is played until there is somewhere to play it
+    if (!line->signalled.keyed || line->addr.sin_port == 0 || atomic_load_explicit(&line->shared->finished, memory_order_relaxed)) {
+        return ST_GOOD;
+    }
+
+    while (play_message(line, nowNs)) {
+        next_message(line);
+    }
+
+    return ST_GOOD;
+}
+
+/**
+ * Send the blocks of the current message that are due, mapping it first if
+ * it is time it started. True once the message is done with.
+ */
+static bool play_message(line_t* line, uint64_t nowNs) {
+    mailbox_t* shared = line->shared;
+
+    if (line->message >= shared->message_count) {
+        info("Played every message for %hu", shared->owner);
+        atomic_store_explicit(&shared->finished, true, memory_order_release);
+        return false;
+    }
+
+    const voicemail_entry_t* entry = &shared->messages[line->message];
+
+    if (line->map.base == NULL) {
+        if (line->messageNs == 0) {
+            line->messageNs = nowNs;
+        }
+
+        if (nowNs < line->messageNs) {
+            return false;
+        }
+
+        if (entry->wire_rate == 0 || voicemail_map(shared->directory, entry, &line->map) != ST_GOOD) {
+            warn("Skipping message %d for %hu", line->message, shared->owner);
+            return true;
+        }
+
+        line->position = 0;
+        line->endTimestamp = 0;
+    }
+
+    const uint64_t due = (nowNs - line->messageNs) * entry->wire_rate / 1000000000;
+
+    while (line->position + sizeof(voicemail_frame_t) <= line->map.length) {
+        voicemail_frame_t frame;
+        memcpy(&frame, line->map.frames + line->position, sizeof(frame));
+
+        const uint8_t* block = line->map.frames + line->position + sizeof(frame);
+        const int codec = MEDIA_FORMAT_CODEC(frame.format);
+
+        if (frame.length > line->map.length - line->position - sizeof(frame) || codec >= MEDIA_CODEC_COUNT) {
+            warn("Message %d for %hu is damaged, cutting it short", line->message, shared->owner);
+            return true;
+        }
+
+        if (frame.timestamp > due) {
+            return false;
+        }
+
+        // Sealed from the mapping, the block is never copied out of it
+        const size_t length = media_seal(&line->crypto, line->packet, MEDIA_TYPE_AUDIO, frame.format, line->baseTimestamp + frame.timestamp, block, frame.length);
+
+        if (length != 0 && sendto(shared->sockfd, line->packet, length, 0, (const struct sockaddr*)&line->addr, sizeof(line->addr)) == -1
+            && errno != ENOBUFS && errno != EAGAIN && errno != EWOULDBLOCK) {
+            stl_warn(errno, "Failed to send a message");
+        }
+
+        line->endTimestamp = frame.timestamp + (uint32_t)codec_decoded_frames(codec, block, frame.length);
+        line->position += sizeof(frame) + frame.length;
+    }
+
+    return true;
+}
+
+/**
+ * Move on to the next message, after a gap. Its timestamps carry on from
+ * this one's, so the node hears one stream.
+ */
+static void next_message(line_t* line) {
+    const voicemail_entry_t* entry = &line->shared->messages[line->message];
+
+    if (line->map.base != NULL) {
+        const uint32_t gap = entry->wire_rate * MAILBOX_GAP_MS / 1000;
+
+        line->messageNs += (uint64_t)(line->endTimestamp + gap) * 1000000000 / entry->wire_rate;
+        line->baseTimestamp += line->endTimestamp + gap;
+        voicemail_unmap(&line->map);
+    }
+
+    line->message++;
+}
@@ -1,6 +1,22 @@
 #include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "common.h"
 #include "server/packets.h"
 
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// A dead control connection is noticed after about idle + interval * count
+#define CONTROL_KEEPALIVE_IDLE_S 5
+#define CONTROL_KEEPALIVE_INTERVAL_S 2
+#define CONTROL_KEEPALIVE_COUNT 3
+
 /**
  * Unwrap a wrapped message struct.
  * 
@@ -21,4 +37,150 @@ void* receive_wrapped_message(void* msg, size_t msgLen, size_t desiredLen, uint8
     }
 
     return wrapper->data;
-}
\ No newline at end of file
+}
+
+/**
+ * Wrap `data` in a message with id `msgId` and send it in one call.
+ * 
+ * `requestId` is the id of a new request, the id of the request being replied
+ * to, or 0.
+ * 
+ * Returns ST_FAIL if the message could not be sent whole.
+ */
+int send_wrapped_message(int sockfd, uint8_t msgId, uint8_t requestId, const void* data, uint8_t length) {
+    uint8_t buffer[MESSAGE_WRAPPER_SIZE + UINT8_MAX];
+    struct message_wrapper* wrapper = (struct message_wrapper*)buffer;
+
+    wrapper->start = MESSAGE_WRAPPER_START;
+    wrapper->id = msgId;
+    wrapper->request = requestId;
+    wrapper->length = length;
+
+    if (length > 0) {
+        memcpy(wrapper->data, data, length);
+    }
+
+    const size_t size = MESSAGE_WRAPPER_SIZE + length;
+    ssize_t sent = send(sockfd, buffer, size, MSG_NOSIGNAL);
+
+    if (sent == -1) {
+        stl_warn(errno, "Failed to send message with id: %x", msgId);
+        return ST_FAIL;
+    }
+
+    if ((size_t)sent != size) {
+        warn("Failed to send full message with id: %x", msgId);
+        return ST_FAIL;
+    }
+
+    return ST_GOOD;
+}
+
+/**
+ * Tune a control connection. Requests and replies are small, so disable
+ * Nagle's algorithm rather than hold them back, and probe an idle connection
+ * so a peer that silently went away is noticed in seconds rather than hours.
+ */
+int configure_control_socket(int sockfd) {
+    int enable = 1;
+
+    if (setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable)) == -1) {
+        stl_warn(errno, "Failed to disable Nagle on control socket");
+        return ST_FAIL;
+    }
+
+    if (setsockopt(sockfd, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(enable)) == -1) {
+        stl_warn(errno, "Failed to enable keepalive on control socket");
+        return ST_FAIL;
+    }
+
+#ifdef TCP_KEEPIDLE
+    int idle = CONTROL_KEEPALIVE_IDLE_S;
+    int interval = CONTROL_KEEPALIVE_INTERVAL_S;
+    int count = CONTROL_KEEPALIVE_COUNT;
+
+    setsockopt(sockfd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(sockfd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+    setsockopt(sockfd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+#endif
+
+    return ST_GOOD;
+}
+
+void init_message_buffer(message_buffer_t* buffer) {
+    buffer->length = 0;
+}
+
+/**
+ * Read whatever is available on a non blocking socket into the buffer.
+ * 
+ * Returns ST_FAIL if the connection was closed or errored.
+ */
+int message_buffer_fill(message_buffer_t* buffer, int sockfd) {
+    while (buffer->length < sizeof(buffer->data)) {
+        ssize_t received = recv(sockfd, buffer->data + buffer->length, sizeof(buffer->data) - buffer->length, MSG_DONTWAIT);
+
+        if (received == 0) {
+            warn("Connection closed by peer");
+            return ST_FAIL;
+        }
+
+        if (received == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                return ST_GOOD;
+            }
+
+            stl_warn(errno, "Failed to receive from socket");
+            return ST_FAIL;
+        }
+
+        buffer->length += received;
+    }
+
+    return ST_GOOD;
+}
+
+/**
+ * Return the first complete message in the buffer, or NULL if there is none
+ * yet. Bytes before a start byte are discarded.
+ */
+struct message_wrapper* message_buffer_peek(message_buffer_t* buffer) {
+    size_t skip = 0;
+
+    while (skip < buffer->length && buffer->data[skip] != MESSAGE_WRAPPER_START) {
+        skip++;
+    }
+
+    if (skip > 0) {
+        warn("Skipped %zu bytes before message start", skip);
+        memmove(buffer->data, buffer->data + skip, buffer->length - skip);
+        buffer->length -= skip;
+    }
+
+    if (buffer->length < MESSAGE_WRAPPER_SIZE) {
+        return NULL;
+    }
+
+    struct message_wrapper* wrapper = (struct message_wrapper*)buffer->data;
+
+    if (buffer->length < MESSAGE_WRAPPER_SIZE + wrapper->length) {
+        return NULL;
+    }
+
+    return wrapper;
+}
+
+/**
+ * Remove the message returned by message_buffer_peek().
+ */
+void message_buffer_pop(message_buffer_t* buffer) {
+    struct message_wrapper* wrapper = message_buffer_peek(buffer);
+
+    if (wrapper == NULL) {
+        return;
+    }
+
+    const size_t size = MESSAGE_WRAPPER_SIZE + wrapper->length;
+    memmove(buffer->data, buffer->data + size, buffer->length - size);
+    buffer->length -= size;
+}
@@ -0,0 +1,335 @@
+#ifdef linux
+// sendmmsg()
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include "common.h"
+#include "server/packets.h"
+#include "server/page_relay.h"
+
+// Room for a packet of 20 ms of L16 at the highest wire rate, header and tag
+#define PAGE_MAX_PACKET 2048
+
+/**
+ * The child's view of the page. The listeners with a known port are kept
+ * packed in `targets`, with a message for each already pointing at its
+ * address and at the one shared iovec, so fanning a packet out only sets the
+ * iovec.
+ */
+typedef struct fan_out {
+    page_relay_t* shared;
+    unsigned int generation;
+    relay_binding_t signalledPager; // As the server last wrote them
+    relay_binding_t signalled[PAGE_MAX_LISTENERS];
+    relay_binding_t pager;
+    relay_binding_t listeners[PAGE_MAX_LISTENERS];
+    int targetCount;
+    struct sockaddr_in targets[PAGE_MAX_LISTENERS];
+    struct iovec iov;
+#ifdef linux
+    struct mmsghdr msgs[PAGE_MAX_LISTENERS];
+#endif
+    uint32_t sendFailures;
+    uint8_t packet[PAGE_MAX_PACKET];
+} fan_out_t;
+
+// Owned by the child
+static fan_out_t fanOut;
+
+static void page_relay_main(page_relay_t* shared);
+static void refresh_bindings(fan_out_t* fan);
+static void update_targets(fan_out_t* fan);
+static void send_fan_out(fan_out_t* fan, size_t length);
+static bool take_source(relay_binding_t* binding, const struct sockaddr_in* addr);
+static void write_binding(page_relay_t* shared, relay_binding_t* binding, const relay_binding_t* value);
+
+/**
+ * Start a child process fanning a page out on `port`. The pager and the
+ * listeners are bound with set_page_pager() and set_page_listener().
+ */
+int start_page_relay(page_relay_t** relayOut, uint16_t port) {
+    page_relay_t* shared = (page_relay_t*)create_shared_memory(sizeof(page_relay_t));
+
+    if (shared == MAP_FAILED) {
+        stl_warn(errno, "Failed to allocate page relay");
+        return ST_FAIL;
+    }
+
+    memset(&shared->pager, 0, sizeof(shared->pager));
+    memset(shared->listeners, 0, sizeof(shared->listeners));
+    shared->port = port;
+    atomic_init(&shared->generation, 0);
+
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if (sockfd == -1) {
+        stl_warn(errno, "Failed to open page relay socket");
+        destroy_shared_memory(shared, sizeof(page_relay_t));
+        return ST_FAIL;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+
+    if (bind(sockfd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        stl_warn(errno, "Failed to bind page relay port %hu", port);
+        close(sockfd);
+        destroy_shared_memory(shared, sizeof(page_relay_t));
+        return ST_FAIL;
+    }
+
+    shared->sockfd = sockfd;
+
+    info("Starting page relay on port: %hu", port);
+
+    pid_t pid = fork();
+
+    if (pid == -1) {
+        stl_warn(errno, "Failed to fork to start the page relay");
+        close(sockfd);
+        destroy_shared_memory(shared, sizeof(page_relay_t));
+        return ST_FAIL;
+    }
+
+    if (pid == 0) {
+        page_relay_main(shared);
+        exit(0);
+    }
+
+    close(sockfd);
+    shared->pid = pid;
+    *relayOut = shared;
+
+    return ST_GOOD;
+}
+
+void stop_page_relay(page_relay_t* shared) {
+    info("Killing page relay on port: %hu", shared->port);
+    kill(shared->pid, SIGINT);
+
+    destroy_shared_memory(shared, sizeof(page_relay_t));
+}
+
+void set_page_pager(page_relay_t* shared, const relay_binding_t* binding) {
+    write_binding(shared, &shared->pager, binding);
+}
+
+/**
+ * Bind the listener in `slot`, a zeroed binding frees it.
+ */
+void set_page_listener(page_relay_t* shared, int slot, const relay_binding_t* binding) {
+    if (slot < 0 || slot >= PAGE_MAX_LISTENERS) {
+        return;
+    }
+
+    write_binding(shared, &shared->listeners[slot], binding);
+}
+
+static void write_binding(page_relay_t* shared, relay_binding_t* binding, const relay_binding_t* value) {
+    // Odd while writing, the child skips bindings it catches half done
+    atomic_fetch_add_explicit(&shared->generation, 1, memory_order_acq_rel);
+    *binding = *value;
+    atomic_fetch_add_explicit(&shared->generation, 1, memory_order_release);
+}
+
+/**
+ * The page relay's main loop.
+ *
+ * Packets are told apart by their token, as at the call relay, and only the
+ * pager's are forwarded. Each is sent on to every listener whose port is
+ * known with one sendmmsg(), every message pointing at the one buffer it was
+ * received into, so the data is never copied per listener. The kernel copies
+ * it into each datagram before sendmmsg() returns, so the buffer is free for
+ * the next packet straight away and needs no count of who still holds it.
+ *
+ * Listeners only send reports, which open the path through any NAT and keep
+ * it open. They are used to learn the listener's port and then dropped, the
+ * pager could do nothing useful with a report from each listener.
+ *
+ * This function returns when the parent kills it.
+ */
+static void page_relay_main(page_relay_t* shared) {
+    info("Child started page relay on socket %d", shared->sockfd);
+
+    fan_out_t* fan = &fanOut;
+    memset(fan, 0, sizeof(*fan));
+    fan->shared = shared;
+
+    while (1) {
+        struct sockaddr_in addr;
+        socklen_t addrLen = sizeof(addr);
+
+        ssize_t bytesRead = recvfrom(shared->sockfd, fan->packet, sizeof(fan->packet), 0, (struct sockaddr*)&addr, &addrLen);
+
+        if (bytesRead == -1) {
+            if (errno != EINTR) {
+                stl_warn(errno, "Failed to read page audio");
+            }
+            continue;
+        }
+
+        if ((size_t)bytesRead < sizeof(struct media_header) || addrLen != sizeof(addr)) {
+            continue;
+        }
+
+        refresh_bindings(fan);
+
+        const struct media_header* header = (const struct media_header*)fan->packet;
+
+        if (header->version != MEDIA_VERSION || header->token == 0) {
+            continue;
+        }
+
+        if (header->token == fan->pager.token) {
+            if (take_source(&fan->pager, &addr)) {
+                send_fan_out(fan, (size_t)bytesRead);
+            }
+            continue;
+        }
+
+        for (int i = 0; i < PAGE_MAX_LISTENERS; i++) {
+            if (header->token != fan->listeners[i].token) {
+                continue;
+            }
+
+            const uint16_t port = fan->listeners[i].addr.sin_port;
+
+            if (take_source(&fan->listeners[i], &addr) && fan->listeners[i].addr.sin_port != port) {
+                update_targets(fan);
+            }
+            break;
+        }
+    }
+}
+
+/**
+ * Whether a packet from `addr` can be from the side bound, taking its port if
+ * a NAT picked another.
+ */
+static bool take_source(relay_binding_t* binding, const struct sockaddr_in* addr) {
+    if (addr->sin_addr.s_addr != binding->addr.sin_addr.s_addr) {
+        return false;
+    }
+
+    if (addr->sin_port != binding->addr.sin_port) {
+        char addrBuf[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &addr->sin_addr, addrBuf, INET_ADDRSTRLEN);
+        info("Page relay learned %s:%hu", addrBuf, ntohs(addr->sin_port));
+
+        binding->addr.sin_port = addr->sin_port;
+    }
+
+    return true;
+}
+
+/**
+ * Take any binding the server has changed since it was last seen. A port
+ * learned from packets is kept until the server binds the side again.
+ */
+static void refresh_bindings(fan_out_t* fan) {
+    page_relay_t* shared = fan->shared;
+    const unsigned int current = atomic_load_explicit(&shared->generation, memory_order_acquire);
+
+    if (current == fan->generation || (current & 1)) {
+        return;
+    }
+
+    relay_binding_t pager = shared->pager;
+    relay_binding_t copy[PAGE_MAX_LISTENERS];
+    memcpy(copy, shared->listeners, sizeof(copy));
+
+    // The server started writing again while this was copied
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&shared->generation, memory_order_relaxed) != current) {
+        return;
+    }
+
+    if (memcmp(&pager, &fan->signalledPager, sizeof(pager)) != 0) {
+        fan->signalledPager = pager;
+        fan->pager = pager;
+    }
+
+    for (int i = 0; i < PAGE_MAX_LISTENERS; i++) {
+        if (memcmp(&copy[i], &fan->signalled[i], sizeof(copy[i])) != 0) {
+            fan->signalled[i] = copy[i];
+            fan->listeners[i] = copy[i];
+        }
+    }
+
+    fan->generation = current;
+    update_targets(fan);
+}
+
+/**
+ * Pack the listeners that can be sent to into `targets`.
+ */
+static void update_targets(fan_out_t* fan) {
+    fan->targetCount = 0;
+
+    for (int i = 0; i < PAGE_MAX_LISTENERS; i++) {
+        const relay_binding_t* listener = &fan->listeners[i];
+
+        if (listener->token != 0 && listener->addr.sin_port != 0) {
+            fan->targets[fan->targetCount++] = listener->addr;
+        }
+    }
+
+#ifdef linux
+    memset(fan->msgs, 0, sizeof(fan->msgs));
+
+    for (int i = 0; i < fan->targetCount; i++) {
+        fan->msgs[i].msg_hdr.msg_name = &fan->targets[i];
+        fan->msgs[i].msg_hdr.msg_namelen = sizeof(fan->targets[i]);
+        fan->msgs[i].msg_hdr.msg_iov = &fan->iov;
+        fan->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+#endif
+}
+
+/**
+ * Send the packet to every target. A listener whose socket buffer is full
+ * misses the packet, late audio is no use to it anyway.
+ */
+static void send_fan_out(fan_out_t* fan, size_t length) {
+    fan->iov.iov_base = fan->packet;
+    fan->iov.iov_len = length;
+
+    int sent = 0;
+
+    while (sent < fan->targetCount) {
+#ifdef linux
+        const int res = sendmmsg(fan->shared->sockfd, &fan->msgs[sent], fan->targetCount - sent, 0);
+#else
+        const int res = sendto(fan->shared->sockfd, fan->packet, length, 0, (const struct sockaddr*)&fan->targets[sent], sizeof(fan->targets[sent])) == -1 ? -1 : 1;
+#endif
+
+        if (res > 0) {
+            sent += res;
+            continue;
+        }
+
+        if (errno == EINTR) {
+            continue;
+        }
+
+        // sendmmsg() stops at the first datagram it cannot send, skip it
+        if (errno != ENOBUFS && errno != EAGAIN && errno != EWOULDBLOCK) {
+            stl_warn(errno, "Failed to send page audio to a listener");
+        } else if (fan->sendFailures++ % 1000 == 0) {
+            warn("Page relay on port %hu is dropping audio for slow listeners", fan->shared->port);
+        }
+
+        sent++;
+    }
+}
@@ -0,0 +1,144 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "miniaudio.h"
+#include "common.h"
+#include "server/packets.h"
+#include "server/prompt.h"
+#include "audiobackend/codec.h"
+
+static int decode_file(const char* file, unsigned int wireRate, int16_t** samples, size_t* frames, size_t* capacity);
+
+/**
+ * Load `files` one after another as a single prompt, resampled to mono at
+ * `wireRate` and encoded in `codec`. The last block is filled out with
+ * silence.
+ */
+int load_prompt(prompt_t** promptOut, const char* const* files, int count, unsigned int wireRate, int codec) {
+    const uint32_t blockFrames = wireRate * PROMPT_BLOCK_MS / 1000;
+
+    if (blockFrames == 0 || codec < 0 || codec >= MEDIA_CODEC_COUNT) {
+        warn("Cannot load a prompt at %u Hz in codec %d", wireRate, codec);
+        return ST_INVALID_ARG;
+    }
+
+    int16_t* samples = NULL;
+    size_t frames = 0;
+    size_t capacity = 0;
+
+    for (int i = 0; i < count; i++) {
+        if (decode_file(files[i], wireRate, &samples, &frames, &capacity) != ST_GOOD) {
+            free(samples);
+            return ST_FAIL;
+        }
+    }
+
+    const uint32_t blockCount = (uint32_t)((frames + blockFrames - 1) / blockFrames);
+    const uint32_t blockSize = (uint32_t)codec_encoded_size(codec, blockFrames);
+
+    if (blockCount == 0) {
+        warn("Prompt %s has no audio", files[0]);
+        free(samples);
+        return ST_FAIL;
+    }
+
+    const size_t size = sizeof(prompt_t) + (size_t)blockCount * blockSize;
+    prompt_t* prompt = (prompt_t*)create_shared_memory(size);
+
+    if (prompt == MAP_FAILED) {
+        stl_warn(errno, "Failed to allocate a prompt of %zu bytes", size);
+        free(samples);
+        return ST_FAIL;
+    }
+
+    prompt->size = size;
+    prompt->wireRate = wireRate;
+    prompt->codec = (uint8_t)codec;
+    prompt->blockFrames = blockFrames;
+    prompt->blockSize = blockSize;
+    prompt->blockCount = blockCount;
+
+    // The padding past the end of the audio is silence
+    memset(samples + frames, 0, ((size_t)blockCount * blockFrames - frames) * sizeof(*samples));
+
+    codec_state_t state;
+    init_codec_state(&state);
+
+    for (uint32_t i = 0; i < blockCount; i++) {
+        codec_encode(codec, &state, samples + (size_t)i * blockFrames, blockFrames, prompt->blocks + (size_t)i * blockSize);
+    }
+
+    free(samples);
+
+    // Only ever read from now on, by the server and every child
+    mprotect(prompt, size, PROT_READ);
+
+    info("Loaded a prompt of %u ms in %s, %zu bytes", blockCount * PROMPT_BLOCK_MS, codec_name(codec), size);
+    *promptOut = prompt;
+    return ST_GOOD;
+}
+
+void destroy_prompt(prompt_t* prompt) {
+    destroy_shared_memory(prompt, prompt->size);
+}
+
+/**
+ * Block `index` of the prompt, counting round from its start again once it
+ * has all been played.
+ */
+const uint8_t* prompt_block(const prompt_t* prompt, uint64_t index) {
+    return prompt->blocks + (size_t)(index % prompt->blockCount) * prompt->blockSize;
+}
+
+/**
+ * Append a file's audio to `samples`, which grows as it needs to and always
+ * has room for a block of padding after it.
+ */
+static int decode_file(const char* file, unsigned int wireRate, int16_t** samples, size_t* frames, size_t* capacity) {
+    const size_t maxFrames = (size_t)PROMPT_MAX_SECONDS * wireRate;
+    const size_t padding = wireRate * PROMPT_BLOCK_MS / 1000;
+
+    ma_decoder_config config = ma_decoder_config_init(ma_format_s16, 1, wireRate);
+    ma_decoder decoder;
+
+    if (ma_decoder_init_file(file, &config, &decoder) != MA_SUCCESS) {
+        warn("Failed to open prompt %s", file);
+        return ST_FAIL;
+    }
+
+    int res = ST_GOOD;
+
+    while (1) {
+        if (*frames >= maxFrames) {
+            warn("Prompt is cut off at %d s in %s", PROMPT_MAX_SECONDS, file);
+            break;
+        }
+
+        if (*capacity < *frames + padding * 2) {
+            const size_t grown = MAX(*capacity * 2, (size_t)wireRate * 4);
+            int16_t* resized = (int16_t*)realloc(*samples, (grown + padding) * sizeof(**samples));
+
+            if (resized == NULL) {
+                warn("Out of memory loading prompt %s", file);
+                res = ST_FAIL;
+                break;
+            }
+
+            *samples = resized;
+            *capacity = grown;
+        }
+
+        const size_t room = MIN(*capacity - *frames, maxFrames - *frames);
+        ma_uint64 framesRead = 0;
+        const ma_result result = ma_decoder_read_pcm_frames(&decoder, *samples + *frames, room, &framesRead);
+
+        *frames += (size_t)framesRead;
+
+        if (result != MA_SUCCESS || framesRead == 0) {
+            break;
+        }
+    }
+
+    ma_decoder_uninit(&decoder);
+    return res;
+}
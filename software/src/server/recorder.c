@@ -0,0 +1,575 @@
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include "common.h"
+#include "server/packets.h"
+#include "server/recorder.h"
+#include "audiobackend/codec.h"
+#include "utils/event_loop.h"
+
+// Packets waiting for the recorder. A power of two, so the counters index it
+// through the wrap
+#define RECORDER_QUEUE_SLOTS 256
+
+// Room for a packet of 20 ms of L16 at the highest wire rate, header and tag
+#define RECORDER_MAX_PACKET 2048
+
+// Decoded audio waiting to be written, per side. A power of two, so it
+// indexes by timestamp through the wrap
+#define RECORDER_RING_FRAMES 32768
+
+// Writes are aligned to this in memory and in the file, the audio starts
+// after a header padded out to it
+#define RECORDER_ALIGN 4096
+
+// WAV IMA ADPCM blocks, the first sample in the header and two a byte after
+#define RECORDER_ADPCM_BLOCK 256
+#define RECORDER_ADPCM_BLOCK_FRAMES ((RECORDER_ADPCM_BLOCK - CODEC_ADPCM_HEADER_SIZE) * 2 + 1)
+
+// Frames written at once, 32 KiB of PCM or 8 KiB of ADPCM
+#define RECORDER_PCM_BATCH_FRAMES 16384
+#define RECORDER_ADPCM_BATCH_FRAMES (RECORDER_ADPCM_BLOCK_FRAMES * 32)
+
+// How long the recorder sleeps when nothing is waiting
+#define RECORDER_IDLE_MS 5
+
+// How often drops are reported, if there were any
+#define RECORDER_REPORT_MS 1000
+
+// A side silent for longer than this, or late this many packets in a row,
+// is taken up again where it is now
+#define RECORDER_MAX_GAP_S 2
+#define RECORDER_LATE_RESYNC 10
+
+#define WAV_FORMAT_PCM 0x0001
+#define WAV_FORMAT_IMA_ADPCM 0x0011
+
+typedef struct recorder_slot {
+    uint16_t length;
+    uint8_t packet[RECORDER_MAX_PACKET];
+} recorder_slot_t;
+
+/**
+ * One side of the call, as written to its file. Audio is placed in the ring
+ * by its timestamp and written out a batch at a time from `writeTimestamp`,
+ * so packets reordered by up to the ring less a batch still land.
+ */
+typedef struct recorder_track {
+    int fd; // -1 until the side's first audio
+    bool failed;
+    char path[RECORDING_PATH_LEN + 16];
+    media_crypto_t crypto;
+    codec_state_t encoder;
+    bool started;
+    uint32_t writeTimestamp; // The next frame to write
+    uint32_t endTimestamp;   // Past the newest frame placed
+    int late;
+    uint64_t frames; // Written, as the header has it
+    uint64_t bytes;
+    int16_t ring[RECORDER_RING_FRAMES];
+} recorder_track_t;
+
+/**
+ * A recorder, fed by the relay and drained by its own thread. The queue is
+ * lock free, the relay only moves `head` and the recorder only `tail`.
+ */
+struct recorder {
+    _Alignas(RECORDER_ALIGN) uint8_t out[RECORDER_PCM_BATCH_FRAMES * sizeof(int16_t)];
+    int16_t batch[RECORDER_PCM_BATCH_FRAMES];
+    int16_t decoded[RECORDER_MAX_PACKET * 2];
+
+    recording_info_t info;
+    uint16_t port;
+    size_t batchFrames;
+    pthread_t thread;
+    atomic_bool stopping;
+
+    _Alignas(64) atomic_uint head;
+    _Alignas(64) atomic_uint tail;
+    atomic_uint dropped;
+
+    // Owned by the recorder's thread
+    unsigned int peakBacklog;
+    unsigned int reportedDrops;
+    uint64_t reportNs;
+    recorder_track_t tracks[2]; // By MEDIA_SENDER, caller and callee
+
+    recorder_slot_t slots[RECORDER_QUEUE_SLOTS];
+};
+
+static void* recorder_main(void* data);
+static void report_backlog(recorder_t* recorder, unsigned int backlog);
+static void record_packet(recorder_t* recorder, uint8_t* packet, size_t length);
+static void place_audio(recorder_t* recorder, recorder_track_t* track, uint32_t start, const int16_t* samples, size_t frames, bool primary);
+static int  open_track(recorder_t* recorder, recorder_track_t* track, int sender);
+static void close_track(recorder_t* recorder, recorder_track_t* track);
+static void drain_track(recorder_t* recorder, recorder_track_t* track);
+static void write_batch(recorder_t* recorder, recorder_track_t* track, size_t frames);
+static size_t encode_adpcm(recorder_t* recorder, recorder_track_t* track, size_t frames);
+static void write_header(recorder_t* recorder, recorder_track_t* track);
+static uint8_t* put_tag(uint8_t* p, const char* tag);
+static uint8_t* put_le16(uint8_t* p, uint16_t value);
+static uint8_t* put_le32(uint8_t* p, uint32_t value);
+
+/**
+ * Start a thread recording the call `info` is for. It is fed with
+ * recorder_push() and writes the files in large batches of its own, so the
+ * relay never waits on the disk.
+ */
+int start_recorder(recorder_t** recorderOut, const recording_info_t* info, uint16_t port) {
+    if (info->wireRate == 0) {
+        warn("Cannot record udp port %hu without a wire rate", port);
+        return ST_INVALID_ARG;
+    }
+
+    recorder_t* recorder;
+
+    if (posix_memalign((void**)&recorder, RECORDER_ALIGN, sizeof(recorder_t)) != 0) {
+        warn("Failed to allocate recorder");
+        return ST_MALLOC_FAIL;
+    }
+
+    memset(recorder, 0, sizeof(*recorder));
+    recorder->info = *info;
+    recorder->port = port;
+    recorder->batchFrames = info->adpcm ? RECORDER_ADPCM_BATCH_FRAMES : RECORDER_PCM_BATCH_FRAMES;
+    atomic_init(&recorder->stopping, false);
+    atomic_init(&recorder->head, 0);
+    atomic_init(&recorder->tail, 0);
+    atomic_init(&recorder->dropped, 0);
+
+    for (int i = 0; i < 2; i++) {
+        recorder->tracks[i].fd = -1;
+        init_media_crypto(&recorder->tracks[i].crypto, info->key, MEDIA_SENDER_RELAY, 0);
+        init_codec_state(&recorder->tracks[i].encoder);
+    }
+
+    // The tracks hold the key now
+    memset(recorder->info.key, 0, sizeof(recorder->info.key));
+
+    // The relay is stopped with SIGINT, which must land on its thread
+    sigset_t block;
+    sigset_t old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+
+    const int res = pthread_create(&recorder->thread, NULL, &recorder_main, recorder);
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (res != 0) {
+        stl_warn(res, "Failed to start the recorder for udp port %hu", port);
+        destroy_media_crypto(&recorder->tracks[0].crypto);
+        destroy_media_crypto(&recorder->tracks[1].crypto);
+        free(recorder);
+        return ST_FAIL;
+    }
+
+    info("Recording udp port %hu to %s", port, info->path);
+
+    *recorderOut = recorder;
+    return ST_GOOD;
+}
+
+/**
+ * Write out whatever is still queued, finish the files and free the recorder.
+ */
+void stop_recorder(recorder_t* recorder) {
+    atomic_store_explicit(&recorder->stopping, true, memory_order_release);
+    pthread_join(recorder->thread, NULL);
+
+    destroy_media_crypto(&recorder->tracks[0].crypto);
+    destroy_media_crypto(&recorder->tracks[1].crypto);
+    free(recorder);
+}
+
+/**
+ * Queue a packet as the relay forwarded it, still sealed. Called from the
+ * relay, it never blocks, a packet that does not fit is dropped and counted.
+ */
+void recorder_push(recorder_t* recorder, const uint8_t* packet, size_t length) {
+    const unsigned int head = atomic_load_explicit(&recorder->head, memory_order_relaxed);
+    const unsigned int tail = atomic_load_explicit(&recorder->tail, memory_order_acquire);
+
+    if (head - tail >= RECORDER_QUEUE_SLOTS || length > RECORDER_MAX_PACKET) {
+        atomic_fetch_add_explicit(&recorder->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    recorder_slot_t* slot = &recorder->slots[head & (RECORDER_QUEUE_SLOTS - 1)];
+    slot->length = (uint16_t)length;
+    memcpy(slot->packet, packet, length);
+
+    atomic_store_explicit(&recorder->head, head + 1, memory_order_release);
+}
+
+/**
+ * The recorder's thread. It sleeps RECORDER_IDLE_MS at a time while the
+ * queue is empty, the ring holds far more than that, and only stops once the
+ * queue has been drained.
+ */
+static void* recorder_main(void* data) {
+    recorder_t* recorder = (recorder_t*)data;
+    recorder->reportNs = event_loop_now();
+
+    while (1) {
+        const unsigned int tail = atomic_load_explicit(&recorder->tail, memory_order_relaxed);
+        const unsigned int head = atomic_load_explicit(&recorder->head, memory_order_acquire);
+
+        if (head == tail) {
+            if (atomic_load_explicit(&recorder->stopping, memory_order_acquire)) {
+                break;
+            }
+
+            report_backlog(recorder, 0);
+
+            struct timespec idle = { 0, RECORDER_IDLE_MS * 1000000L };
+            nanosleep(&idle, NULL);
+            continue;
+        }
+
+        recorder->peakBacklog = MAX(recorder->peakBacklog, head - tail);
+
+        recorder_slot_t* slot = &recorder->slots[tail & (RECORDER_QUEUE_SLOTS - 1)];
+        record_packet(recorder, slot->packet, slot->length);
+
+        atomic_store_explicit(&recorder->tail, tail + 1, memory_order_release);
+        report_backlog(recorder, head - tail - 1);
+    }
+
+    close_track(recorder, &recorder->tracks[MEDIA_SENDER_CALLER]);
+    close_track(recorder, &recorder->tracks[MEDIA_SENDER_CALLEE]);
+
+    info("Recorder on udp port %hu stopped, %u packets dropped, at most %u waiting", recorder->port,
+        atomic_load_explicit(&recorder->dropped, memory_order_relaxed), recorder->peakBacklog);
+    return NULL;
+}
+
+/**
+ * Warn once a report period if the relay had to drop packets, with how many
+ * are waiting, so a recorder falling behind the disk shows.
+ */
+static void report_backlog(recorder_t* recorder, unsigned int backlog) {
+    const uint64_t nowNs = event_loop_now();
+
+    if (nowNs - recorder->reportNs < (uint64_t)RECORDER_REPORT_MS * 1000000) {
+        return;
+    }
+
+    const unsigned int dropped = atomic_load_explicit(&recorder->dropped, memory_order_relaxed);
+
+    if (dropped != recorder->reportedDrops) {
+        warn("Recorder on udp port %hu dropped %u packets, %u waiting, at most %u", recorder->port, dropped - recorder->reportedDrops, backlog, recorder->peakBacklog);
+    }
+
+    recorder->reportedDrops = dropped;
+    recorder->reportNs = nowNs;
+}
+
+/**
+ * Open a packet from either side and place its audio, the blocks of any FEC
+ * as well, which fill in for packets lost on the way to the relay.
+ */
+static void record_packet(recorder_t* recorder, uint8_t* packet, size_t length) {
+    if (length < MEDIA_OVERHEAD) {
+        return;
+    }
+
+    const struct media_header* header = (const struct media_header*)packet;
+
+    if (header->type != MEDIA_TYPE_AUDIO || header->sender > MEDIA_SENDER_CALLEE) {
+        return;
+    }
+
+    recorder_track_t* track = &recorder->tracks[header->sender];
+    uint8_t* payload;
+    size_t payloadLength;
+
+    if (track->failed || media_open(&track->crypto, packet, length, &payload, &payloadLength) != ST_GOOD) {
+        return;
+    }
+
+    if (track->fd < 0 && open_track(recorder, track, header->sender) != ST_GOOD) {
+        return;
+    }
+
+    const int codec = MEDIA_FORMAT_CODEC(header->format);
+    const int fec = MEDIA_FORMAT_FEC(header->format);
+
+    if (codec >= MEDIA_CODEC_COUNT || fec > MEDIA_MAX_FEC || payloadLength < fec * sizeof(uint16_t)) {
+        return;
+    }
+
+    const uint8_t* blocks[MEDIA_MAX_FEC + 1];
+    size_t blockLengths[MEDIA_MAX_FEC + 1];
+    size_t blockFrames[MEDIA_MAX_FEC + 1];
+
+    const uint8_t* block = payload + fec * sizeof(uint16_t);
+    size_t remaining = payloadLength - fec * sizeof(uint16_t);
+
+    for (int i = 0; i <= fec; i++) {
+        blockLengths[i] = i < fec ? (size_t)((payload[2 * i] << 8) | payload[2 * i + 1]) : remaining;
+
+        if (blockLengths[i] > remaining) {
+            return;
+        }
+
+        blocks[i] = block;
+        blockFrames[i] = codec_decoded_frames(codec, block, blockLengths[i]);
+
+        if (blockFrames[i] == 0 || blockFrames[i] > sizeof(recorder->decoded) / sizeof(*recorder->decoded)) {
+            return;
+        }
+
+        block += blockLengths[i];
+        remaining -= blockLengths[i];
+    }
+
+    uint32_t start = ntohl(header->timestamp);
+
+    for (int i = fec; i >= 0; i--) {
+        const size_t decoded = codec_decode(codec, blocks[i], blockLengths[i], recorder->decoded);
+        place_audio(recorder, track, start, recorder->decoded, decoded, i == fec);
+
+        if (i > 0) {
+            start -= (uint32_t)blockFrames[i - 1];
+        }
+    }
+}
+
+/**
+ * Place decoded samples in the side's ring at their timestamp, first writing
+ * out as much of the oldest audio as it takes to make room. Audio already
+ * written is dropped, a primary block far behind the write position or far
+ * ahead of the newest audio starts the side again from where it is.
+ */
+static void place_audio(recorder_t* recorder, recorder_track_t* track, uint32_t start, const int16_t* samples, size_t frames, bool primary) {
+    const uint32_t mask = RECORDER_RING_FRAMES - 1;
+
+    if (!track->started) {
+        if (!primary) {
+            return;
+        }
+
+        track->started = true;
+        track->writeTimestamp = start;
+        track->endTimestamp = start;
+    }
+
+    int32_t offset = (int32_t)(start - track->writeTimestamp);
+    const bool late = offset + (int32_t)frames <= 0;
+    const bool gap = (int32_t)(start - track->endTimestamp) > (int32_t)(recorder->info.wireRate * RECORDER_MAX_GAP_S);
+
+    if (primary && ((late && ++track->late >= RECORDER_LATE_RESYNC) || gap)) {
+        info("Recorder on udp port %hu moved %s to its clock", recorder->port, track->path);
+        drain_track(recorder, track);
+        track->writeTimestamp = start;
+        track->endTimestamp = start;
+    } else if (late || gap) {
+        return;
+    }
+
+    if (primary) {
+        track->late = 0;
+    }
+
+    while ((int32_t)(start + (uint32_t)frames - track->writeTimestamp) > RECORDER_RING_FRAMES && !track->failed) {
+        write_batch(recorder, track, recorder->batchFrames);
+    }
+
+    offset = (int32_t)(start - track->writeTimestamp);
+
+    for (size_t i = offset < 0 ? (size_t)-offset : 0; i < frames; i++) {
+        track->ring[(start + (uint32_t)i) & mask] = samples[i];
+    }
+
+    if ((int32_t)(start + (uint32_t)frames - track->endTimestamp) > 0) {
+        track->endTimestamp = start + (uint32_t)frames;
+    }
+}
+
+static int open_track(recorder_t* recorder, recorder_track_t* track, int sender) {
+    snprintf(track->path, sizeof(track->path), "%s-%s.wav", recorder->info.path, sender == MEDIA_SENDER_CALLER ? "caller" : "callee");
+
+    track->fd = open(track->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+
+    if (track->fd == -1) {
+        stl_warn(errno, "Failed to open recording %s", track->path);
+        track->failed = true;
+        return ST_FAIL;
+    }
+
+    write_header(recorder, track);
+    return ST_GOOD;
+}
+
+static void close_track(recorder_t* recorder, recorder_track_t* track) {
+    if (track->fd < 0) {
+        return;
+    }
+
+    drain_track(recorder, track);
+    write_header(recorder, track);
+    close(track->fd);
+    track->fd = -1;
+
+    info("Recorded %llu ms to %s", (unsigned long long)(track->frames * 1000 / recorder->info.wireRate), track->path);
+}
+
+/**
+ * Write out everything placed, the last batch short.
+ */
+static void drain_track(recorder_t* recorder, recorder_track_t* track) {
+    while ((int32_t)(track->endTimestamp - track->writeTimestamp) > 0 && !track->failed) {
+        write_batch(recorder, track, MIN(recorder->batchFrames, track->endTimestamp - track->writeTimestamp));
+    }
+}
+
+/**
+ * Write the next `frames` of the ring to the file with one write, leaving
+ * silence behind in the ring, and bring the header up to date so the file
+ * plays even if the relay never gets to finish it.
+ */
+static void write_batch(recorder_t* recorder, recorder_track_t* track, size_t frames) {
+    const size_t index = track->writeTimestamp & (RECORDER_RING_FRAMES - 1);
+    const size_t first = MIN(frames, RECORDER_RING_FRAMES - index);
+
+    memcpy(recorder->batch, track->ring + index, first * sizeof(int16_t));
+    memset(track->ring + index, 0, first * sizeof(int16_t));
+    memcpy(recorder->batch + first, track->ring, (frames - first) * sizeof(int16_t));
+    memset(track->ring, 0, (frames - first) * sizeof(int16_t));
+
+    track->writeTimestamp += (uint32_t)frames;
+
+    size_t length;
+
+    if (recorder->info.adpcm) {
+        length = encode_adpcm(recorder, track, frames);
+    } else {
+        for (size_t i = 0; i < frames; i++) {
+            put_le16(recorder->out + 2 * i, (uint16_t)recorder->batch[i]);
+        }
+
+        length = frames * sizeof(int16_t);
+        track->frames += frames;
+    }
+
+    size_t written = 0;
+
+    while (written < length) {
+        const ssize_t res = pwrite(track->fd, recorder->out + written, length - written, RECORDER_ALIGN + track->bytes + written);
+
+        if (res == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if (res <= 0) {
+            stl_warn(errno, "Failed to write recording %s, giving up on it", track->path);
+            track->failed = true;
+            break;
+        }
+
+        written += res;
+    }
+
+    track->bytes += written;
+    write_header(recorder, track);
+}
+
+/**
+ * Encode the batch as whole WAV IMA ADPCM blocks, padding the last with
+ * silence. Each block starts from its first sample, while the step index
+ * carries on from the block before.
+ */
+static size_t encode_adpcm(recorder_t* recorder, recorder_track_t* track, size_t frames) {
+    const size_t blocks = (frames + RECORDER_ADPCM_BLOCK_FRAMES - 1) / RECORDER_ADPCM_BLOCK_FRAMES;
+
+    memset(recorder->batch + frames, 0, (blocks * RECORDER_ADPCM_BLOCK_FRAMES - frames) * sizeof(int16_t));
+
+    for (size_t i = 0; i < blocks; i++) {
+        const int16_t* in = recorder->batch + i * RECORDER_ADPCM_BLOCK_FRAMES;
+        uint8_t* out = recorder->out + i * RECORDER_ADPCM_BLOCK;
+
+        track->encoder.predictor = in[0];
+        codec_encode(MEDIA_CODEC_ADPCM, &track->encoder, in + 1, RECORDER_ADPCM_BLOCK_FRAMES - 1, out);
+
+        // The codec's header is big endian, WAV's is little
+        put_le16(out, (uint16_t)in[0]);
+        out[3] = 0;
+    }
+
+    track->frames += blocks * RECORDER_ADPCM_BLOCK_FRAMES;
+    return blocks * RECORDER_ADPCM_BLOCK;
+}
+
+/**
+ * The header takes up the file's first RECORDER_ALIGN bytes, a JUNK chunk
+ * pads it so the audio starts aligned.
+ */
+static void write_header(recorder_t* recorder, recorder_track_t* track) {
+    const bool adpcm = recorder->info.adpcm;
+    const uint32_t rate = recorder->info.wireRate;
+
+    uint8_t header[RECORDER_ALIGN];
+    memset(header, 0, sizeof(header));
+
+    uint8_t* p = put_tag(header, "RIFF");
+    p = put_le32(p, (uint32_t)(RECORDER_ALIGN - 8 + track->bytes));
+    p = put_tag(p, "WAVE");
+
+    p = put_tag(p, "fmt ");
+    p = put_le32(p, adpcm ? 20 : 16);
+    p = put_le16(p, adpcm ? WAV_FORMAT_IMA_ADPCM : WAV_FORMAT_PCM);
+    p = put_le16(p, 1);
+    p = put_le32(p, rate);
+    p = put_le32(p, adpcm ? rate * RECORDER_ADPCM_BLOCK / RECORDER_ADPCM_BLOCK_FRAMES : rate * sizeof(int16_t));
+    p = put_le16(p, adpcm ? RECORDER_ADPCM_BLOCK : sizeof(int16_t));
+    p = put_le16(p, adpcm ? 4 : 16);
+
+    if (adpcm) {
+        p = put_le16(p, 2);
+        p = put_le16(p, RECORDER_ADPCM_BLOCK_FRAMES);
+
+        // Anything but PCM gives its length in frames
+        p = put_tag(p, "fact");
+        p = put_le32(p, 4);
+        p = put_le32(p, (uint32_t)track->frames);
+    }
+
+    uint8_t* data = header + RECORDER_ALIGN - 8;
+
+    p = put_tag(p, "JUNK");
+    put_le32(p, (uint32_t)(data - (p + 4)));
+
+    put_le32(put_tag(data, "data"), (uint32_t)track->bytes);
+
+    if (pwrite(track->fd, header, sizeof(header), 0) != sizeof(header)) {
+        stl_warn(errno, "Failed to write the header of recording %s", track->path);
+    }
+}
+
+static uint8_t* put_tag(uint8_t* p, const char* tag) {
+    memcpy(p, tag, 4);
+    return p + 4;
+}
+
+static uint8_t* put_le16(uint8_t* p, uint16_t value) {
+    p[0] = (uint8_t)value;
+    p[1] = (uint8_t)(value >> 8);
+    return p + 2;
+}
+
+static uint8_t* put_le32(uint8_t* p, uint32_t value) {
+    p[0] = (uint8_t)value;
+    p[1] = (uint8_t)(value >> 8);
+    p[2] = (uint8_t)(value >> 16);
+    p[3] = (uint8_t)(value >> 24);
+    return p + 4;
+}
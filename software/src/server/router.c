@@ -0,0 +1,319 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "common.h"
+#include "server/router.h"
+
+// A pattern's tail for a prefix, which any number of digits may follow
+#define ROUTER_ANY 0xFF
+
+/**
+ * Digits every number the pattern matches starts with, then how many more
+ * follow.
+ */
+typedef struct route_pattern {
+    char digits[ROUTER_MAX_DIGITS + 1];
+    uint8_t tail;
+    uint8_t route; // Index into the routes
+} route_pattern_t;
+
+/**
+ * What a build needs only while it runs, too large for the stack.
+ */
+typedef struct router_scratch {
+    int pattern_count;
+    route_pattern_t patterns[ROUTER_MAX_PATTERNS];
+    struct { int lo; int hi; int depth; int node; } queue[ROUTER_MAX_NODES];
+    route_node_t nodes[ROUTER_MAX_NODES];
+} router_scratch_t;
+
+static int add_pattern(router_scratch_t* scratch, const char* digits, uint8_t tail, int route);
+static int add_range(router_scratch_t* scratch, uint32_t low, uint32_t high, int route);
+static int build_nodes(router_scratch_t* scratch);
+static const route_node_t* find_child(const router_t* router, const route_node_t* node, int digit);
+static bool router_extends(const router_t* router, uint16_t number);
+static int compare_patterns(const void* a, const void* b);
+
+/**
+ * Build a router for `routes`, which are copied. Earlier routes win where
+ * two match a number equally well.
+ */
+int build_router(router_t** routerOut, const route_conf_t* routes, int count) {
+    if (count < 0 || count > ROUTER_MAX_ROUTES) {
+        warn("Dial plan of %d routes is too large", count);
+        return ST_INVALID_ARG;
+    }
+
+    router_scratch_t* scratch = (router_scratch_t*)malloc(sizeof(router_scratch_t));
+
+    if (scratch == NULL) {
+        warn("Failed to allocate a dial plan");
+        return ST_FAIL;
+    }
+
+    scratch->pattern_count = 0;
+
+    for (int i = 0; i < count; i++) {
+        const int res = routes[i].prefix[0] != '\0' ? add_pattern(scratch, routes[i].prefix, ROUTER_ANY, i)
+            : add_range(scratch, routes[i].low, routes[i].high, i);
+
+        if (res != ST_GOOD) {
+            warn("Dial plan has too many routes, a range splits into up to 18 for each length");
+            free(scratch);
+            return ST_INVALID_ARG;
+        }
+    }
+
+    const int nodeCount = build_nodes(scratch);
+    router_t* router = (router_t*)malloc(sizeof(router_t) + nodeCount * sizeof(route_node_t));
+
+    if (router == NULL) {
+        warn("Failed to allocate a dial plan");
+        free(scratch);
+        return ST_FAIL;
+    }
+
+    router->route_count = count;
+    router->node_count = nodeCount;
+    router->number_count = 0;
+    memcpy(router->routes, routes, count * sizeof(*routes));
+    memcpy(router->nodes, scratch->nodes, nodeCount * sizeof(route_node_t));
+    free(scratch);
+
+    // A node places a call once nothing longer can follow, and is never sent
+    // what prefixes and ranges route
+    for (int i = 0; i < count; i++) {
+        if (routes[i].prefix[0] == '\0' && routes[i].low == routes[i].high && !router_extends(router, routes[i].low)) {
+            router->numbers[router->number_count++] = routes[i].low;
+        }
+    }
+
+    info("Dial plan built from %d routes, %d nodes", count, nodeCount);
+    *routerOut = router;
+    return ST_GOOD;
+}
+
+void free_router(router_t* router) {
+    free(router);
+}
+
+/**
+ * The route `number` goes to, or NULL if it is dialled straight. Visits one
+ * node per digit.
+ */
+const route_conf_t* route_number(const router_t* router, uint16_t number) {
+    if (router == NULL || number == 0) {
+        return NULL;
+    }
+
+    char digits[ROUTER_MAX_DIGITS + 1];
+    const int length = snprintf(digits, sizeof(digits), "%hu", number);
+    const route_node_t* node = &router->nodes[0];
+    int best = 0;
+
+    for (int depth = 0; node != NULL; depth++) {
+        const int match = node->tail[length - depth] != 0 ? node->tail[length - depth] : node->any;
+
+        if (match != 0) {
+            best = match;
+        }
+
+        if (depth == length) {
+            break;
+        }
+
+        node = find_child(router, node, digits[depth] - '0');
+    }
+
+    return best != 0 ? &router->routes[best - 1] : NULL;
+}
+
+/**
+ * Whether `number` cannot be a node's, as it is routed or a prefix or range
+ * routes longer numbers starting with it. Nodes are never sent those, so
+ * would place a call as soon as the node's number was dialled.
+ */
+bool router_reserves(const router_t* router, uint16_t number) {
+    return route_number(router, number) != NULL || router_extends(router, number);
+}
+
+static int add_pattern(router_scratch_t* scratch, const char* digits, uint8_t tail, int route) {
+    if (scratch->pattern_count >= ROUTER_MAX_PATTERNS) {
+        return ST_FAIL;
+    }
+
+    route_pattern_t* pattern = &scratch->patterns[scratch->pattern_count];
+    memset(pattern->digits, 0, sizeof(pattern->digits));
+
+    if (copy_string(pattern->digits, sizeof(pattern->digits), digits) != ST_GOOD) {
+        return ST_FAIL;
+    }
+
+    scratch->pattern_count++;
+    pattern->tail = tail;
+    pattern->route = (uint8_t)route;
+    return ST_GOOD;
+}
+
+/**
+ * Split the range into the fewest prefixes each followed by a fixed number
+ * of free digits, 200 to 349 being 2XX then 30X to 34X.
+ */
+static int add_range(router_scratch_t* scratch, uint32_t low, uint32_t high, int route) {
+    while (low <= high) {
+        // The largest number with as many digits as `low`
+        uint32_t top = 9;
+
+        while (top < low) {
+            top = top * 10 + 9;
+        }
+
+        const uint32_t end = MIN(high, top);
+        uint32_t block = 1;
+        uint8_t tail = 0;
+
+        while (low % (block * 10) == 0 && low + block * 10 - 1 <= end) {
+            block *= 10;
+            tail++;
+        }
+
+        char digits[ROUTER_MAX_DIGITS + 1];
+        snprintf(digits, sizeof(digits), "%u", low / block);
+
+        if (add_pattern(scratch, digits, tail, route) != ST_GOOD) {
+            return ST_FAIL;
+        }
+
+        low += block;
+    }
+
+    return ST_GOOD;
+}
+
+/**
+ * Lay the trie out breadth first from the sorted patterns, as
+ * dial_plan_build() does, and return its node count.
+ */
+static int build_nodes(router_scratch_t* scratch) {
+    route_pattern_t* patterns = scratch->patterns;
+    int nodeCount = 1;
+    int head = 0;
+    int tail = 0;
+
+    qsort(patterns, scratch->pattern_count, sizeof(*patterns), &compare_patterns);
+
+    memset(&scratch->nodes[0], 0, sizeof(scratch->nodes[0]));
+    scratch->queue[tail].lo = 0;
+    scratch->queue[tail].hi = scratch->pattern_count;
+    scratch->queue[tail].depth = 0;
+    scratch->queue[tail++].node = 0;
+
+    while (head < tail) {
+        const int lo = scratch->queue[head].lo;
+        const int hi = scratch->queue[head].hi;
+        const int depth = scratch->queue[head].depth;
+        route_node_t* node = &scratch->nodes[scratch->queue[head++].node];
+
+        int i = lo;
+
+        // Patterns ending here sort first, and by route within a pattern
+        for (; i < hi && patterns[i].digits[depth] == '\0'; i++) {
+            uint8_t* slot = patterns[i].tail == ROUTER_ANY ? &node->any : &node->tail[patterns[i].tail];
+
+            if (*slot == 0) {
+                *slot = patterns[i].route + 1;
+            } else if (*slot != patterns[i].route + 1) {
+                warn("Route %d is overlapped by route %d, which wins", patterns[i].route, *slot - 1);
+            }
+        }
+
+        node->first = (uint16_t)nodeCount;
+
+        while (i < hi) {
+            const char digit = patterns[i].digits[depth];
+            int end = i;
+
+            while (end < hi && patterns[end].digits[depth] == digit) {
+                end++;
+            }
+
+            memset(&scratch->nodes[nodeCount], 0, sizeof(route_node_t));
+            const int value = digit - '0';
+            node->children |= BIT(value);
+
+            scratch->queue[tail].lo = i;
+            scratch->queue[tail].hi = end;
+            scratch->queue[tail].depth = depth + 1;
+            scratch->queue[tail++].node = nodeCount++;
+
+            i = end;
+        }
+    }
+
+    // Children come after their parents, so are done first going back
+    for (int n = nodeCount - 1; n >= 0; n--) {
+        route_node_t* node = &scratch->nodes[n];
+        node->open = node->any != 0;
+
+        for (int rest = 1; rest <= ROUTER_MAX_DIGITS; rest++) {
+            node->open |= node->tail[rest] != 0;
+        }
+
+        for (int child = 0; child < __builtin_popcount(node->children); child++) {
+            node->open |= scratch->nodes[node->first + child].open;
+        }
+    }
+
+    return nodeCount;
+}
+
+static const route_node_t* find_child(const router_t* router, const route_node_t* node, int digit) {
+    if ((node->children & BIT(digit)) == 0) {
+        return NULL;
+    }
+
+    const int below = __builtin_popcount(node->children & (BIT(digit) - 1));
+    return &router->nodes[node->first + below];
+}
+
+/**
+ * Whether a prefix or range routes a longer number starting with `number`.
+ */
+static bool router_extends(const router_t* router, uint16_t number) {
+    if (router == NULL || number == 0) {
+        return false;
+    }
+
+    char digits[ROUTER_MAX_DIGITS + 1];
+    const int length = snprintf(digits, sizeof(digits), "%hu", number);
+    const route_node_t* node = &router->nodes[0];
+
+    for (int depth = 0; node != NULL; depth++) {
+        if (node->any != 0) {
+            return true;
+        }
+
+        for (int rest = length - depth + 1; rest <= ROUTER_MAX_DIGITS; rest++) {
+            if (node->tail[rest] != 0) {
+                return true;
+            }
+        }
+
+        if (depth == length) {
+            return node->open;
+        }
+
+        node = find_child(router, node, digits[depth] - '0');
+    }
+
+    return false;
+}
+
+static int compare_patterns(const void* a, const void* b) {
+    const route_pattern_t* first = (const route_pattern_t*)a;
+    const route_pattern_t* second = (const route_pattern_t*)b;
+    const int order = strcmp(first->digits, second->digits);
+
+    return order != 0 ? order : (int)first->route - (int)second->route;
+}
@@ -2,40 +2,92 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <errno.h>
+#include <signal.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include "common.h"
 #include "utils/args.h"
+#include "utils/event_loop.h"
 #include "server/packets.h"
 #include "server/upd_forward.h"
+#include "server/conference.h"
+#include "server/page_relay.h"
+#include "server/hold_player.h"
+#include "server/prompt.h"
+#include "server/router.h"
+#include "server/journal.h"
+#include "server/handover.h"
 #include "server/server.h"
+#include "server/server_internal.h"
+#include "audiobackend/resampler.h"
 
 #define INTERNET_PROTOCOL AF_INET
 #define LOCAL_ADDR "127.0.0.1"
 
-#define MSG_BUFFER_SIZE 1024
+// How long a node that sends heartbeats can go without sending anything
+#define KEEPALIVE_TIMEOUT_MS (HEARTBEAT_INTERVAL_MS * 7 / 2)
+
+// The SIGHUP, SIGUSR2 and SIGCHLD handlers write the signal, the event loop acts on it
+static int signalPipe[2] = { -1, -1 };
 
 // To run the server needs : TCP port, UDP port min, UPD port max
 
-// When a new connection arrives, fork to handle. This child process
-// will 'own' the connection with that node. When a call happens the
-// child will fork again and start its child to run the udp forwarding
+// One event loop owns the listening socket and every node connection. When a
+// call happens a child is forked to run the udp forwarding
 
 static int init_server(server_t* server);
 static int start_server(server_t* server);
-static int handle_message_data(server_t* server, uint8_t* buffer, size_t length, size_t* read, struct sockaddr* recvAddress, socklen_t sockaddrLen);
+
+// Connection handling
+static int handle_accept(struct event_loop* loop, int fd, uint32_t events, void* data);
+static void close_connection(server_t* server, connection_t* conn);
+static void handle_message(server_t* server, connection_t* conn, struct message_wrapper* msg);
 
 // Message handling functions
-static int handle_handshake(server_t* server, uint8_t* buffer, uint8_t len, struct sockaddr* recvAddress, socklen_t sockaddrLen);
-static int handle_call_request(server_t* server, uint8_t* buffer, uint8_t len, struct sockaddr* recvAddress, socklen_t sockaddrLen);
-static int handle_incoming_response(server_t* server, uint8_t* buffer, uint8_t len);
-static int handle_terminate(server_t* server, uint8_t* buffer, uint8_t len);
+static int handle_handshake(server_t* server, connection_t* conn, struct message_wrapper* msg);
+static int handle_call_request(server_t* server, connection_t* conn, struct message_wrapper* msg);
+static int handle_incoming_response(server_t* server, connection_t* conn, struct message_wrapper* msg);
+static int handle_call_ringing(server_t* server, connection_t* conn, struct message_wrapper* msg);
+static int handle_terminate(server_t* server, connection_t* conn, struct message_wrapper* msg);
+static int handle_resume(server_t* server, connection_t* conn, struct message_wrapper* msg);
+static int handle_heartbeat(server_t* server, connection_t* conn, struct message_wrapper* msg);
+
+// Timeouts
+static call_info_t* find_call_by_token(call_info_t* calls, int count, uint32_t callerToken);
+
+// Sessions
+static client_info_t* find_session(server_t* server, const uint8_t* token);
+static void remove_client(server_t* server, int index);
+static void expire_session(server_t* server, int index);
+static int generate_media_tokens(call_info_t* call);
+
+// Signals
+static int handle_signal_pipe(struct event_loop* loop, int fd, uint32_t events, void* data);
+static void handle_signal(int sigid);
+
+// Transcoding
+static bool should_transcode(const client_info_t* caller, const client_info_t* callee);
+static int key_transcoded_side(server_t* server, call_info_t* call, uint8_t sender, const uint8_t* publicKey);
+static const uint8_t* peer_media_key(const call_info_t* call, uint8_t sender);
+static uint8_t call_flags(const call_info_t* call);
 
 // Misc
+static int send_dial_plan(server_t* server, const client_info_t* client);
+static int send_call_answered(server_t* server, const call_info_t* call);
+static int send_call_ringing(server_t* server, const call_info_t* call);
+static void offer_call_media(server_t* server, const call_info_t* call, uint8_t sender, struct media_candidate* candidate);
+static bool number_reserved(server_t* server, uint16_t number);
 static uint16_t allocate_phone_number(server_t* server, uint16_t requested);
 static uint16_t allocate_udp_port(server_t* server);
+static uint16_t first_call_port(const server_t* server);
+static void reap_call_relays(server_t* server);
 
 int server_run(int argc, char** argv) {
     int err;
@@ -46,6 +98,9 @@ int server_run(int argc, char** argv) {
     info("Initialising server");
     server_t server;
     server.conf = &config;
+    server.argv = argv;
+    server.handoverfd = take_handover_fd();
+    server.upgradePending = false;
 
     if ((err = init_server(&server)) != ST_GOOD) {
         warn("Failed to initialise server");
@@ -60,32 +115,45 @@ static int init_server(server_t* server) {
     int err;
 
     // Address to receive on
-    
+
     server->server_addr.sin_family = AF_INET;
     server->server_addr.sin_port = htons(server->conf->server_port);
     server->server_addr_len = sizeof(server->server_addr);
 
     inet_pton(AF_INET, LOCAL_ADDR, &server->server_addr.sin_addr);
 
-    int sockfd = socket(
-        AF_INET, 
-        SOCK_STREAM,
-        0);
+    int sockfd;
 
-    // Check for valid socket id
-    if (sockfd < 0) {
-        stl_warn(errno, "Failed to initialise socket with code : %d", sockfd);
-        close(sockfd);
-        return ST_FAIL;
-    }
+    if (server->handoverfd != -1) {
+        // Upgrading, the server being replaced has the port and passes it on
+        if (accept_handover(server->handoverfd, &sockfd) != ST_GOOD) {
+            warn("Failed to take over from the server being upgraded");
+            return ST_FAIL;
+        }
+    } else {
+        sockfd = socket(
+            AF_INET,
+            SOCK_STREAM,
+            0);
+
+        // Check for valid socket id
+        if (sockfd < 0) {
+            stl_warn(errno, "Failed to initialise socket with code : %d", sockfd);
+            close(sockfd);
+            return ST_FAIL;
+        }
 
-    // Bind socket to local port
-    if ((err = bind(sockfd, (const struct sockaddr*)&server->server_addr, server->server_addr_len)) != 0) {
-        stl_warn(errno, "Failed to bind address to socket");
-        close(sockfd);
-        return ST_FAIL;
+        // Bind socket to local port
+        if ((err = bind(sockfd, (const struct sockaddr*)&server->server_addr, server->server_addr_len)) != 0) {
+            stl_warn(errno, "Failed to bind address to socket");
+            close(sockfd);
+            return ST_FAIL;
+        }
     }
 
+    // Accepting happens from the event loop, so never block on it
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+
     info("Server opened on sockfd %d", sockfd);
 
     server->sockfd = sockfd;
@@ -93,425 +161,1656 @@ static int init_server(server_t* server) {
     server->ongoing_count = 0;
     server->pending_count = 0;
 
+    memset(server->sessions, 0, sizeof(server->sessions));
+    memset(server->conferences, 0, sizeof(server->conferences));
+    memset(server->pages, 0, sizeof(server->pages));
+    memset(server->voicemail_calls, 0, sizeof(server->voicemail_calls));
+    memset(server->call_relays, 0, sizeof(server->call_relays));
+
+    for (int i = 0; i < SERVER_MAX_CONNECTIONS; i++) {
+        server->connections[i].fd = -1;
+        server->connections[i].server = server;
+    }
+
+    const char* recordings = server->conf->recording_directory;
+
+    if (recordings[0] != '\0' && mkdir(recordings, 0750) == -1 && errno != EEXIST) {
+        stl_warn(errno, "Failed to create the recording directory %s", recordings);
+    }
+
+    // Without a store calls are never diverted
+    server->voicemail.fd = -1;
+    server->journal.fd = -1;
+
+    if (server->conf->voicemail_directory[0] != '\0' && open_voicemail_store(&server->voicemail, server->conf->voicemail_directory) != ST_GOOD) {
+        warn("Voicemail is off, its store could not be opened");
+    }
+
+    // Without a player calls are never put on hold
+    server->hold_prompt = NULL;
+    server->hold_player = NULL;
+    memset(server->holds, 0, sizeof(server->holds));
+
+    // Upgrading, the old server's player has the port until it exits
+    if (server->conf->hold_music[0] != '\0' && server->handoverfd == -1 && start_hold(server) != ST_GOOD) {
+        warn("Hold is off, its player could not be started");
+    }
+
+    // After the voicemail store, whose number is only routed once it is open
+    if ((err = build_server_router(server, &server->conf->routing, &server->router)) != ST_GOOD) {
+        warn("Failed to build the dial plan");
+        close(sockfd);
+        return ST_FAIL;
+    }
+
     if ((err = init_udp_server(&server->udp_server)) != ST_GOOD) {
         warn("Failed to initialise udp server");
         close(sockfd);
         return ST_FAIL;
     }
 
+    if ((err = init_event_loop(&server->loop)) != ST_GOOD) {
+        close(sockfd);
+        return ST_FAIL;
+    }
+
     return ST_GOOD;
 }
 
 /**
- * Main thread server loop. This function will have 1 thread listening for
- * connections on the socket. When one arrives, it will fork off a thread.
- * 
- * The main server thread is stateless, and handles connections with data
- * stored in the server_t.
+ * Main server loop. A single event loop accepts connections and reads from
+ * every node, so a slow or silent node never holds up the others.
  */
 static int start_server(server_t* server) {
-    // Listen for connections and fork off to handle them
-    uint8_t msgBuffer[MSG_BUFFER_SIZE];
-
-    // These variables handle overflowing buffers
-    // If the buffer has overflowed then the flag is set
-    bool overflow = false;
-
-    // Once the data is processed, the remaining bytes are shifted to the top
-    // of the array, and writeInd updated to point just after it.
-    // Then the next set of data is copied in just after the write pointer.
-    size_t writeInd = 0;
+    info("Server started");
 
-    // To handle saving the user address
-    struct sockaddr_in recvAddress;
+    if (listen(server->sockfd, 128) == -1) {
+        stl_warn(errno, "Failed to listen to the socket");
+        return ST_FAIL;
+    }
 
-    info("Server started");
+    if (event_loop_add(&server->loop, server->sockfd, EVENT_READ, &handle_accept, server) != ST_GOOD) {
+        return ST_FAIL;
+    }
 
-    int connectionfd = 0;
+    if (init_timer_wheel(&server->timers, &server->loop, SERVER_MAX_TIMERS) != ST_GOOD) {
+        return ST_FAIL;
+    }
 
-    int error = listen(server->sockfd, 128);
+    // Upgrading, nodes and calls are taken over as they are before the
+    // journal is opened, so a failed handover leaves the old server's alone
+    const bool upgraded = server->handoverfd != -1;
 
-    if (error == -1) {
-        stl_warn(errno, "Failed to listen to the socket");
+    if (upgraded && take_over(server) != ST_GOOD) {
         return ST_FAIL;
     }
-    
-    while (1) {
-        // Read bytes from the socket if not in an overflow state
-        socklen_t addressLen = sizeof(recvAddress);
-
-        if (!overflow) {
-            connectionfd = accept(server->sockfd, (struct sockaddr*)&server->server_addr, &server->server_addr_len);
-            
-            if (connectionfd == -1) {
-                stl_warn(errno, "Failed to accept connection on socket %d", server->sockfd);
-                continue;
+
+    // Nodes and calls from before a restart are back before any node is
+    // accepted, so each can resume. On an upgrade they are handed over
+    // instead, and the journal already holds them
+    if (server->conf->journal_path[0] != '\0') {
+        if (open_journal(&server->journal, server->conf->journal_path) == ST_GOOD) {
+            if (!upgraded) {
+                restore_journal(server);
+            }
+
+            if (timer_wheel_add(&server->timers, (uint64_t)server->conf->journal_compact_s * 1000, &handle_journal_compact, 0, server) == TIMER_NONE) {
+                return ST_FAIL;
             }
-            
-            info("Accepted a connection");
+        } else {
+            warn("Journal is off, a restart forgets every node and call");
         }
+    }
+
+    if ((server->voicemailTimer = event_loop_add_timer(&server->loop, &handle_voicemail_sweep, server)) < 0) {
+        return ST_FAIL;
+    }
 
-        ssize_t received = recvfrom(connectionfd, msgBuffer + writeInd, MSG_BUFFER_SIZE - writeInd, 0, (struct sockaddr*)&recvAddress, &addressLen);
+    if (pipe(signalPipe) == -1) {
+        stl_warn(errno, "Failed to open the signal pipe");
+        return ST_FAIL;
+    }
 
-        writeInd = 0;
+    fcntl(signalPipe[0], F_SETFL, fcntl(signalPipe[0], F_GETFL) | O_NONBLOCK);
+    fcntl(signalPipe[1], F_SETFL, fcntl(signalPipe[1], F_GETFL) | O_NONBLOCK);
 
-        // Check for an error, TODO probably dont error out here
-        if (received == -1) {
-            stl_error(errno, "Server failed to receive data");
-        }
+    if (event_loop_add(&server->loop, signalPipe[0], EVENT_READ, &handle_signal_pipe, server) != ST_GOOD) {
+        return ST_FAIL;
+    }
+
+    // SIGHUP reads the routes again, SIGUSR2 upgrades the server, SIGCHLD
+    // frees the port of a call's relay that exited
+    struct sigaction sa;
+    sa.sa_handler = handle_signal;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+
+    if (sigaction(SIGHUP, &sa, NULL) == -1) {
+        stl_warn(errno, "Failed to register the SIGHUP handler, routes are only read at start up");
+    }
+
+    if (sigaction(SIGUSR2, &sa, NULL) == -1) {
+        stl_warn(errno, "Failed to register the SIGUSR2 handler, the server cannot be upgraded in place");
+    }
 
-        // Check to see if the buffer has 'overflowed'
-        overflow = received == MSG_BUFFER_SIZE;
+    if (sigaction(SIGCHLD, &sa, NULL) == -1) {
+        stl_warn(errno, "Failed to register the SIGCHLD handler, relays' ports are freed on the next call");
+    }
 
-        // Iterate over the message buffer
-        handle_message_data(server, msgBuffer, received, &writeInd, (struct sockaddr*)&recvAddress, addressLen);
+    int res = event_loop_run(&server->loop);
 
-        // If buffer overflow, then shift remaining bytes down
-        if (overflow && writeInd < received) {
-            memmove(msgBuffer, msgBuffer + writeInd, received - writeInd);
+    for (int i = 0; i < SERVER_MAX_CONNECTIONS; i++) {
+        if (server->connections[i].fd != -1) {
+            close_connection(server, &server->connections[i]);
         }
     }
 
-    return ST_GOOD;
+    destroy_event_loop(&server->loop);
+    destroy_timer_wheel(&server->timers);
+    close_journal(&server->journal);
+    close_voicemail_store(&server->voicemail);
+    stop_hold(server);
+    free_router(server->router);
+    close(signalPipe[0]);
+    close(signalPipe[1]);
+    close(server->sockfd);
+
+    // Handed over, the upgraded server goes on once this closes
+    if (server->handoverfd != -1) {
+        close(server->handoverfd);
+    }
+
+    return res;
 }
 
-static int handle_message_data(server_t* server, uint8_t* buffer, size_t length, size_t* read, struct sockaddr* recvAddress, socklen_t sockaddrLen) {
-    size_t ind = 0;
-    size_t lastStart = 0;
-    struct message_wrapper* msg;
-    while (ind < (length - MESSAGE_WRAPPER_SIZE)) {
-        msg = (struct message_wrapper*)(buffer + ind);
+static int handle_accept(struct event_loop* loop, int fd, uint32_t events, void* data) {
+    server_t* server = (server_t*)data;
 
-        if (msg->start != MESSAGE_WRAPPER_START) {
-            // Skip over start byte to repeat
-            warn("Invalid packet wrapper start");
-            ind++;
-            continue;
+    while (1) {
+        struct sockaddr_in address;
+        socklen_t addrLen = sizeof(address);
+
+        int connectionfd = accept(fd, (struct sockaddr*)&address, &addrLen);
+
+        if (connectionfd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                stl_warn(errno, "Failed to accept connection on socket %d", fd);
+            }
+            return ST_GOOD;
         }
 
-        lastStart = ind;
+        connection_t* conn = NULL;
 
-        // Handle each message
-        int err = ST_FAIL;
-        switch (msg->id) {
-            case HANDSHAKE_REQUEST:
-                err = handle_handshake(server, msg->data, msg->length, recvAddress, sockaddrLen);
-                break;
-            case CALL_REQUEST:
-                err = handle_call_request(server, msg->data, msg->length, recvAddress, sockaddrLen);
-                break;
-            case INCOMING_RESPONSE:
-                err = handle_incoming_response(server, msg->data, msg->length);
-                break;
-            case CLIENT_TERMINATE_CALL:
-                err = handle_terminate(server, msg->data, msg->length);
-                break;
-            default:
-                warn("Unrecognised message id: %x", msg->id);
+        for (int i = 0; i < SERVER_MAX_CONNECTIONS; i++) {
+            if (server->connections[i].fd == -1) {
+                conn = &server->connections[i];
                 break;
+            }
         }
 
-        // If handling was a success, then skip over the entire message,
-        // else just skip the start byte and start again
-        if (err == ST_GOOD) {
-            ind += MESSAGE_WRAPPER_SIZE + msg->length;
-        } else {
-            warn("Failed to handle message with id: %x", msg->id);
-            ind ++;
+        if (conn == NULL) {
+            warn("Too many connections, refusing a node");
+            close(connectionfd);
+            continue;
         }
-    }
 
-    // We want to return last start here so that a half-read message will 
-    // be intact
-    *read = lastStart;
-    return ST_GOOD;
-}
+        fcntl(connectionfd, F_SETFL, fcntl(connectionfd, F_GETFL) | O_NONBLOCK);
+        configure_control_socket(connectionfd);
 
-static int handle_handshake(server_t* server, uint8_t* buffer, uint8_t len, struct sockaddr* recvAddress, socklen_t sockaddrLen) {
-    info("Handling handshake request");
-    if (len < sizeof(struct handshake_request)) {
-        return ST_FAIL;
-    }
+        if (event_loop_add(loop, connectionfd, EVENT_READ, &handle_connection, conn) != ST_GOOD) {
+            close(connectionfd);
+            continue;
+        }
 
-    struct handshake_request* msg = (struct handshake_request*)buffer;
+        conn->fd = connectionfd;
+        memcpy(&conn->address, &address, addrLen);
+        conn->addrLen = addrLen;
+        conn->heardNs = event_loop_now();
+        conn->keepaliveTimer = TIMER_NONE;
+        init_message_buffer(&conn->messages);
 
-    // Verify magic
-    if (strncmp(msg->magic, HANDSHAKE_MAGIC, HANDSHAKE_MAGIC_SIZE) != 0) {
-        return ST_FAIL;
+        info("Accepted a connection");
     }
+}
 
-    // Allocate number
-    uint16_t phoneNumber = allocate_phone_number(server, ntohs(msg->phone_number));
+/**
+ * Read from a node and handle each complete message. A failing message is
+ * dropped on its own, only a closed connection ends the node.
+ */
+int handle_connection(struct event_loop* loop, int fd, uint32_t events, void* data) {
+    connection_t* conn = (connection_t*)data;
+    server_t* server = conn->server;
 
-    // Add to client list
-    if (server->client_count >= sizeof(server->clients) / sizeof(*server->clients)) {
-        server->client_count--;
+    if (message_buffer_fill(&conn->messages, fd) != ST_GOOD) {
+        close_connection(server, conn);
+        return ST_GOOD;
     }
-    
-    client_info_t* clientInfo = &server->clients[server->client_count++];
-    clientInfo->phone_number = phoneNumber;
-    memcpy(&clientInfo->address, recvAddress, sockaddrLen);
-    clientInfo->addrLen = sockaddrLen;
 
-    // Send a response back
-    uint8_t response[MESSAGE_WRAPPER_SIZE + sizeof(struct handshake_response)];
-    struct message_wrapper* respMsg = (struct message_wrapper*)response;
+    conn->heardNs = event_loop_now();
+    struct message_wrapper* msg;
 
-    respMsg->start = MESSAGE_WRAPPER_START;
-    respMsg->id = HANDSHAKE_RESPONSE;
-    respMsg->length = sizeof(struct handshake_response);
+    while ((msg = message_buffer_peek(&conn->messages)) != NULL) {
+        handle_message(server, conn, msg);
+        message_buffer_pop(&conn->messages);
+    }
 
-    struct handshake_response* respData = (struct handshake_response*)respMsg->data;
-    strncpy(respData->magic, HANDSHAKE_MAGIC, sizeof(HANDSHAKE_MAGIC));
-    respData->phone_number = htons(phoneNumber);
+    return ST_GOOD;
+}
 
-    ssize_t sendBytes = sendto(server->sockfd, response, sizeof(response), 0, recvAddress, sockaddrLen);
+static void handle_message(server_t* server, connection_t* conn, struct message_wrapper* msg) {
+    int err = ST_FAIL;
 
-    if (sendBytes == -1) {
-        stl_error(errno, "Failed to respond to handshake");
+    switch (msg->id) {
+        case HANDSHAKE_REQUEST:
+            err = handle_handshake(server, conn, msg);
+            break;
+        case CALL_REQUEST:
+            err = handle_call_request(server, conn, msg);
+            break;
+        case INCOMING_RESPONSE:
+            err = handle_incoming_response(server, conn, msg);
+            break;
+        case CALL_RINGING:
+            err = handle_call_ringing(server, conn, msg);
+            break;
+        case CLIENT_TERMINATE_CALL:
+            err = handle_terminate(server, conn, msg);
+            break;
+        case RESUME_REQUEST:
+            err = handle_resume(server, conn, msg);
+            break;
+        case CONFERENCE_ADD:
+            err = handle_conference_add(server, conn, msg);
+            break;
+        case CONFERENCE_JOINED:
+            err = handle_conference_joined(server, conn, msg);
+            break;
+        case PAGE_LISTEN:
+            err = handle_page_listen(server, conn, msg);
+            break;
+        case PAGE_KEY:
+            err = handle_page_key(server, conn, msg);
+            break;
+        case RECORD_KEY:
+            err = handle_record_key(server, conn, msg);
+            break;
+        case VOICEMAIL_JOINED:
+            err = handle_voicemail_joined(server, conn, msg);
+            break;
+        case CALL_HOLD:
+            err = handle_call_hold(server, conn, msg);
+            break;
+        case HOLD_JOINED:
+            err = handle_hold_joined(server, conn, msg);
+            break;
+        case HEARTBEAT:
+            err = handle_heartbeat(server, conn, msg);
+            break;
+        default:
+            warn("Unrecognised message id: %x", msg->id);
+            return;
     }
 
-    if (sendBytes != sizeof(response)) {
-        error("Failed to send full handshake packet");
+    if (err != ST_GOOD) {
+        warn("Failed to handle message with id: %x", msg->id);
     }
-
-    info("Handshake successful with number: %hu", phoneNumber);
-
-    return ST_GOOD;
 }
 
-static int handle_call_request(server_t* server, uint8_t* buffer, uint8_t len, struct sockaddr* recvAddress, socklen_t sockaddrLen) {
-    info("Handling call request");
-    if (len != sizeof(struct call_request)) {
-        warn("Invalid message size for call request");
-        return ST_FAIL;
-    }
-
-    struct call_request* callRequest = (struct call_request*)buffer;
+/**
+ * Close a connection. Its node is only detached, keeping its number and call
+ * until the session expires, in case it is just reconnecting.
+ */
+static void close_connection(server_t* server, connection_t* conn) {
+    info("Closing connection %d", conn->fd);
 
-    const uint16_t fromPhoneNumber = ntohs(callRequest->from_phone_number);
-    const uint16_t toPhoneNumber = ntohs(callRequest->to_phone_number);
+    timer_wheel_cancel(&server->timers, conn->keepaliveTimer);
+    conn->keepaliveTimer = TIMER_NONE;
 
-    // First lookup the phone number and check that it is an 'online' number
-    client_info_t* fromClient = NULL;
-    client_info_t* toClient = NULL;
+    int unwatched = -1;
 
     for (int i = 0; i < server->client_count; i++) {
-        if (server->clients[i].phone_number == fromPhoneNumber) {
-            info("From phone number found");
-            fromClient = &server->clients[i];
+        if (server->clients[i].connection != conn) {
+            continue;
         }
-        if (server->clients[i].phone_number == toPhoneNumber) {
-            info("To phone number found");
-            toClient = &server->clients[i];
+
+        info("Detached session for %hu", server->clients[i].phone_number);
+        server->clients[i].connection = NULL;
+        server->clients[i].detachedNs = event_loop_now();
+
+        if (timer_wheel_add(&server->timers, SESSION_RESUME_TIMEOUT_MS, &handle_session_expiry, server->clients[i].phone_number, server) == TIMER_NONE) {
+            unwatched = i;
         }
+        break;
     }
 
-    if (fromClient == NULL || toClient == NULL) {
-        info("To / from phone number not valid");
-        return ST_GOOD;
+    event_loop_remove(&server->loop, conn->fd);
+    close(conn->fd);
+    conn->fd = -1;
+
+    // A session that would never expire is ended now instead
+    if (unwatched != -1) {
+        expire_session(server, unwatched);
     }
+}
 
-    // Start the udp server
-    uint16_t updPort = allocate_udp_port(server);
-    start_udp_port(&server->udp_server, updPort);
+static int handle_handshake(server_t* server, connection_t* conn, struct message_wrapper* msg) {
+    info("Handling handshake request");
+    if (msg->length < offsetof(struct handshake_request, wire_sample_rate)) {
+        return ST_FAIL;
+    }
 
-    // Add to pending calls list
-    call_info_t* pendingCall = &server->pending_calls[server->pending_count++];
-    pendingCall->caller = fromPhoneNumber;
-    pendingCall->callee = toPhoneNumber;
-    pendingCall->port = updPort;
+    struct handshake_request* request = (struct handshake_request*)msg->data;
 
-    // Respond to caller
-    uint8_t callRespBuf[MESSAGE_WRAPPER_SIZE + sizeof(struct call_response)];
-    struct message_wrapper* wrapper = (struct message_wrapper*)callRespBuf;
-    
-    wrapper->start = MESSAGE_WRAPPER_START;
-    wrapper->id = CALL_RESPONSE;
-    wrapper->length = sizeof(struct call_response);
-    
-    struct call_response* respMsg = (struct call_response*)wrapper->data;
-    respMsg->udp_server_port = htons(updPort);
-    
-    ssize_t bytesSent = sendto(server->sockfd, callRespBuf, sizeof(callRespBuf), 0, (struct sockaddr*)&fromClient->address, fromClient->addrLen);
-    (void) bytesSent;
+    // Verify magic
+    if (strncmp(request->magic, HANDSHAKE_MAGIC, HANDSHAKE_MAGIC_SIZE) != 0) {
+        return ST_FAIL;
+    }
 
-    // Call the other number
-    uint8_t incomingCallBuf[MESSAGE_WRAPPER_SIZE + sizeof(struct incoming_call)];
-    wrapper = (struct message_wrapper*)incomingCallBuf;
-    
-    wrapper->start = MESSAGE_WRAPPER_START;
-    wrapper->id = INCOMING_CALL;
-    wrapper->length = sizeof(struct incoming_call);
-    
-    struct incoming_call* incomMsg = (struct incoming_call*)wrapper->data;
-    incomMsg->from_phone_number = htons(fromPhoneNumber);
-    incomMsg->udp_server_port = htons(updPort);
-    
-    bytesSent = sendto(server->sockfd, incomingCallBuf, sizeof(incomingCallBuf), 0, (struct sockaddr*)&toClient->address, toClient->addrLen);
-    (void) bytesSent;
-    
-    return ST_GOOD;
-}
+    // A node handshaking again keeps its slot
+    client_info_t* clientInfo = NULL;
+    uint16_t previousNumber = 0;
 
-static int handle_incoming_response(server_t* server, uint8_t* buffer, uint8_t len) {
-    info("Handling incoming call response");
-    if (len != sizeof(struct incoming_response)) {
-        warn("Invalid message size for incoming response");
-        return ST_FAIL;
+    for (int i = 0; i < server->client_count; i++) {
+        if (server->clients[i].connection == conn) {
+            clientInfo = &server->clients[i];
+            previousNumber = clientInfo->phone_number;
+            clientInfo->phone_number = 0;
+        }
     }
 
-    struct incoming_response* response = (struct incoming_response*)buffer;
+    if (clientInfo == NULL) {
+        if (server->client_count >= sizeof(server->clients) / sizeof(*server->clients)) {
+            warn("Server is full, refusing handshake");
+            return ST_FAIL;
+        }
 
-    uint16_t phoneNumber = ntohs(response->from_phone_number);
+        clientInfo = &server->clients[server->client_count];
+        clientInfo->phone_number = 0;
 
-    // Find in pending calls
-    int index = -1;
-    for (int i = 0; i < server->pending_count; i++) {
-        if (server->pending_calls[i].callee == phoneNumber) {
-            index = i;
-            break;
+        if (generate_token(clientInfo->token, SESSION_TOKEN_SIZE) != ST_GOOD) {
+            return ST_FAIL;
         }
+
+        insert_session(server, server->client_count++);
     }
 
-    if (index == -1) {
-        warn("Incoming response callee not found");
-        return ST_FAIL;
+    // Allocate number
+    uint16_t phoneNumber = allocate_phone_number(server, ntohs(request->phone_number));
+
+    clientInfo->phone_number = phoneNumber;
+    clientInfo->connection = conn;
+    clientInfo->detachedNs = 0;
+    memcpy(&clientInfo->address, &conn->address, conn->addrLen);
+    clientInfo->addrLen = conn->addrLen;
+
+    // A node from before it said what it sends is taken to match any other
+    const bool capabilities = msg->length >= sizeof(struct handshake_request);
+    clientInfo->wire_rate = capabilities ? ntohl(request->wire_sample_rate) : 0;
+    clientInfo->codecs = capabilities ? request->codecs : MEDIA_CODECS_ALL;
+
+    if (previousNumber != 0 && previousNumber != phoneNumber) {
+        journal_drop_client(&server->journal, previousNumber);
     }
 
-    call_info_t* pendingCall = &server->pending_calls[index];
+    journal_save_client(server, clientInfo);
 
-    // Success so first add to ongoing calls
-    call_info_t* ongoingCall = &server->ongoing_calls[server->ongoing_count++];
-    memcpy(ongoingCall, pendingCall, sizeof(call_info_t));
+    // Send a response back
+    struct handshake_response response;
+    strncpy(response.magic, HANDSHAKE_MAGIC, sizeof(HANDSHAKE_MAGIC));
+    response.phone_number = htons(phoneNumber);
+    memcpy(response.token, clientInfo->token, SESSION_TOKEN_SIZE);
 
-    // Now remove pending call
-    if (index != server->pending_count - 1) {
-        // Swap pending call with the last one to 'remove' it
-        memcpy(pendingCall, &server->pending_calls[server->pending_count - 1], sizeof(call_info_t));
+    if (send_wrapped_message(conn->fd, HANDSHAKE_RESPONSE, msg->request, &response, sizeof(response)) != ST_GOOD) {
+        return ST_FAIL;
     }
-    server->pending_count--;
+
+    info("Handshake successful with number: %hu", phoneNumber);
+
+    // Every node can now reach the new number, so refresh all their plans
+    broadcast_dial_plan(server);
 
     return ST_GOOD;
 }
 
-static int handle_terminate(server_t* server, uint8_t* buffer, uint8_t len) {
-    info("Handling call terminate");
-    if (len != sizeof(struct client_terminate_call)) {
-        warn("Invalid message size for terminate call");
+/**
+ * Give a reconnected node back its session in one round trip, along with
+ * the state of its call.
+ */
+static int handle_resume(server_t* server, connection_t* conn, struct message_wrapper* msg) {
+    if (msg->length != sizeof(struct resume_request)) {
+        warn("Invalid message size for resume request");
         return ST_FAIL;
     }
 
-    struct client_terminate_call* clientTerm = (struct client_terminate_call*)buffer;
+    struct resume_request* request = (struct resume_request*)msg->data;
+    client_info_t* client = find_session(server, request->token);
 
-    info("Terminating call with code: %hu", clientTerm->err_code);
+    struct resume_response response;
+    memset(&response, 0, sizeof(response));
+
+    if (client == NULL) {
+        info("Rejecting resume of an unknown session");
+        return send_wrapped_message(conn->fd, RESUME_RESPONSE, msg->request, &response, sizeof(response));
+    }
 
-    uint16_t phoneNumber = ntohs(clientTerm->phone_number);
+    // The old connection may not have noticed it is dead yet
+    if (client->connection != NULL && client->connection != conn) {
+        connection_t* old = client->connection;
+        client->connection = NULL;
+        close_connection(server, old);
+    }
+
+    client->connection = conn;
+    client->detachedNs = 0;
+    memcpy(&client->address, &conn->address, conn->addrLen);
+    client->addrLen = conn->addrLen;
+    journal_save_client(server, client);
+
+    response.accepted = 1;
+    response.phone_number = htons(client->phone_number);
+    response.call_state = RESUME_NO_CALL;
 
-    // Terminate the call
-    call_info_t* callInfo = NULL;
-    bool ongoing = false;
     for (int i = 0; i < server->ongoing_count; i++) {
-        if (server->ongoing_calls[i].callee == phoneNumber || server->ongoing_calls[i].caller == phoneNumber) {
-            callInfo = server->ongoing_calls + i;
-            ongoing = true;
-            break;
+        if (server->ongoing_calls[i].caller == client->phone_number || server->ongoing_calls[i].callee == client->phone_number) {
+            response.call_state = RESUME_CALL_ONGOING;
+            response.udp_server_port = htons(server->ongoing_calls[i].port);
         }
     }
 
-    // Check pending calls if not found
-    if (callInfo == NULL) {
-        for (int i = 0; i < server->pending_count; i++) {
-            if (server->pending_calls[i].callee == phoneNumber || server->pending_calls[i].caller == phoneNumber) {
-                callInfo = server->pending_calls + i;
-                break;
-            }
+    for (int i = 0; i < server->pending_count; i++) {
+        if (server->pending_calls[i].caller == client->phone_number || server->pending_calls[i].callee == client->phone_number) {
+            response.call_state = RESUME_CALL_PENDING;
+            response.udp_server_port = htons(server->pending_calls[i].port);
         }
     }
 
-    // Send terminate call to other client
-    uint16_t toTerminate = callInfo->callee == phoneNumber ? callInfo->caller : callInfo->callee;
+    int slot;
+    conference_t* conference = find_conference(server, client->phone_number, &slot);
 
-    // Find the client
-    client_info_t* client = NULL;
-    for (int i = 0; i < server->client_count; i++) {
-        if (server->clients[i].phone_number == toTerminate) {
-            client = server->clients + i;
-            break;
-        }
-    }
+    if (conference != NULL) {
+        conference_member_t* member = &conference->members[slot];
+        response.call_state = member->info.live ? RESUME_CALL_ONGOING : RESUME_CALL_PENDING;
+        response.udp_server_port = htons(conference->bridge->port);
 
-    if (client == NULL) {
-        warn("Erm what the sigma");
-        return ST_FAIL;
+        // The bridge learns the port again from the member's first packet
+        member->info.addr.sin_addr = client->address.sin_addr;
+        member->info.addr.sin_port = 0;
+        set_conference_member(conference->bridge, slot, &member->info);
     }
 
-    info("Terminating call for phone number: %hu, from %hu", toTerminate, phoneNumber);
+    int pageSlot;
+    page_t* page = find_page(server, client->phone_number, &pageSlot);
 
-    uint8_t msgBuffer[MESSAGE_WRAPPER_SIZE + sizeof(struct terminate_call)];
+    if (page != NULL) {
+        response.call_state = pageSlot < 0 || page->listeners[pageSlot].keyed ? RESUME_CALL_ONGOING : RESUME_CALL_PENDING;
+        response.udp_server_port = htons(page->relay->port);
 
-    struct message_wrapper* wrapper = (struct message_wrapper*)msgBuffer;
-    wrapper->start = MESSAGE_WRAPPER_START;
-    wrapper->id = TERMINATE_CALL;
-    wrapper->length = sizeof(struct terminate_call);
+        if (pageSlot < 0) {
+            relay_binding_t binding = page->relay->pager;
+            binding.addr.sin_addr = client->address.sin_addr;
+            binding.addr.sin_port = 0;
+            set_page_pager(page->relay, &binding);
+        } else {
+            page->listeners[pageSlot].media_port = 0;
+            bind_page_listener(server, page, pageSlot);
+        }
+    }
 
-    struct terminate_call* termCall = (struct terminate_call*)wrapper->data;
-    termCall->err_code = CALL_PUTDOWN;
+    voicemail_call_t* voicemail = find_voicemail_call(server, client->phone_number);
 
-    ssize_t bytesSent = sendto(server->sockfd, msgBuffer, sizeof(msgBuffer), 0, (struct sockaddr*)&client->address, client->addrLen);
+    if (voicemail != NULL) {
+        response.call_state = RESUME_CALL_ONGOING;
+        response.udp_server_port = htons(voicemail->mailbox->port);
 
-    if (bytesSent == -1) {
-        warn("Failed to send terminate to client");
-        return ST_FAIL;
+        // The mailbox learns the port again from the node's first packet
+        voicemail->peer.addr.sin_addr = client->address.sin_addr;
+        voicemail->peer.addr.sin_port = 0;
+        set_mailbox_peer(voicemail->mailbox, &voicemail->peer);
     }
 
-    if (bytesSent != sizeof(msgBuffer)) {
-        warn("Full terminate request not sent");
-        return ST_FAIL;
-    }
+    int holdSlot;
+    hold_t* hold = find_hold(server, client->phone_number, &holdSlot);
 
-    // Kill ongoing call
-    if (ongoing) {
-        // First stop the udp port
-        stop_udp_port(&server->udp_server, callInfo->port);
+    if (hold != NULL && hold->held == client->phone_number && !hold->resuming) {
+        response.udp_server_port = htons(server->hold_player->port);
+        bind_hold_listener(server, holdSlot);
     }
 
-    // Now destroy the struct
-    call_info_t* callArray = ongoing ? server->ongoing_calls : server->pending_calls;
-    int* count = ongoing ? &server->ongoing_count : &server->pending_count;
+    // It may have come back from another address
+    for (int i = 0; i < server->ongoing_count; i++) {
+        const call_info_t* call = &server->ongoing_calls[i];
+        if (call->caller == client->phone_number || call->callee == client->phone_number) {
+            bind_call_media(server, call, call->caller == client->phone_number ? MEDIA_SENDER_CALLER : MEDIA_SENDER_CALLEE);
+        }
+    }
 
-    if (callInfo - callArray < *count - 1) {
-        memcpy(callInfo, callArray + *count - 1, sizeof(call_info_t));
+    for (int i = 0; i < server->pending_count; i++) {
+        const call_info_t* call = &server->pending_calls[i];
+        if (call->caller == client->phone_number || (call->callee == client->phone_number && call->ringing)) {
+            bind_call_media(server, call, call->caller == client->phone_number ? MEDIA_SENDER_CALLER : MEDIA_SENDER_CALLEE);
+        }
     }
 
-    (*count)--;
+    info("Resumed session for %hu", client->phone_number);
 
-    return ST_GOOD;
-}
+    if (send_wrapped_message(conn->fd, RESUME_RESPONSE, msg->request, &response, sizeof(response)) != ST_GOOD) {
+        return ST_FAIL;
+    }
 
-static uint16_t allocate_phone_number(server_t* server, uint16_t requested) {
-    // Check if phone number exists
-    bool found = false;
-    uint16_t largest = 0;
-    for (int i = 0; i < server->client_count; i++) {
-        if (requested == server->clients[i].phone_number) {
-            found = true;
-        }
+    // It may have missed the move to a conference while it was away
+    if (conference != NULL && conference->members[slot].joining) {
+        send_conference_join(server, conference, slot, 0);
+    }
 
-        if (server->clients[i].phone_number > largest) {
-            largest = server->clients[i].phone_number;
+    // Either side of a page may have missed its part of passing the key on
+    if (page != NULL && pageSlot < 0) {
+        for (int i = 0; i < PAGE_MAX_LISTENERS; i++) {
+            if (page->listeners[i].listening && !page->listeners[i].keyed) {
+                send_page_listen(server, page, i);
+            }
         }
+    } else if (page != NULL && !page->listeners[pageSlot].listening) {
+        send_incoming_page(server, page, pageSlot);
+    } else if (page != NULL && !page->listeners[pageSlot].keyed) {
+        send_page_listen(server, page, pageSlot);
     }
 
-    // If not found then return requested number
-    if (!found) {
-        return requested;
+    // Or the move to a mailbox, or its answer
+    if (voicemail != NULL && voicemail->mailbox->playing) {
+        send_voicemail_answer(server, voicemail);
+    } else if (voicemail != NULL && !voicemail->peer.keyed) {
+        send_voicemail_divert(server, voicemail);
     }
 
-    // Else just make a new number
-    return largest + 1;
-}
-
+    // Or its part of a hold, the holder being told once the held side is back
+    // on the call
+    const call_info_t* holdCall = find_ongoing_call(server, client->phone_number);
+
+    if (hold != NULL && hold->held == client->phone_number) {
+        if (!hold->resuming && hold->keyed) {
+            send_hold_key(server, holdSlot);
+        } else if (!hold->resuming) {
+            send_hold_start(server, holdSlot);
+        } else if (!hold->rejoined) {
+            send_hold_end(server, holdCall, hold->held, hold->holder_key);
+        }
+    } else if (hold != NULL && hold->rejoined && send_hold_end(server, holdCall, hold->holder, hold->held_key) == ST_GOOD) {
+        end_hold(server, holdSlot);
+    }
+
+    // A caller that has not sealed its key to the recorder is asked again,
+    // before it is sent anything it would agree the key from
+    call_info_t* recorded = find_recorded_call(server, client->phone_number);
+
+    if (recorded != NULL) {
+        send_record_call(server, recorded, MEDIA_SENDER_CALLER);
+    }
+
+    // The caller may have missed the ringing or answer while it was away
+    for (int i = 0; i < server->ongoing_count; i++) {
+        if (server->ongoing_calls[i].caller == client->phone_number) {
+            send_call_answered(server, &server->ongoing_calls[i]);
+        }
+    }
+
+    for (int i = 0; i < server->pending_count; i++) {
+        if (server->pending_calls[i].caller == client->phone_number && server->pending_calls[i].ringing) {
+            send_call_ringing(server, &server->pending_calls[i]);
+        }
+    }
+
+    // Plans may have changed while it was away
+    return send_dial_plan(server, client);
+}
+
+/**
+ * Reply to the caller with a call response, or a terminate call if the call
+ * cannot be made, then ring the callee.
+ */
+static int handle_call_request(server_t* server, connection_t* conn, struct message_wrapper* msg) {
+    info("Handling call request");
+    if (msg->length != sizeof(struct call_request)) {
+        warn("Invalid message size for call request");
+        return ST_FAIL;
+    }
+
+    struct call_request* callRequest = (struct call_request*)msg->data;
+
+    const uint16_t fromPhoneNumber = ntohs(callRequest->from_phone_number);
+    const uint16_t toPhoneNumber = ntohs(callRequest->to_phone_number);
+
+    // First lookup the phone number and check that it is an 'online' number
+    client_info_t* fromClient = find_client(server, fromPhoneNumber);
+    const route_conf_t* route = fromClient != NULL ? route_number(server->router, toPhoneNumber) : NULL;
+    uint16_t calleeNumber = toPhoneNumber;
+
+    if (route != NULL) {
+        switch (route->type) {
+        case ROUTE_VOICEMAIL: return play_voicemail(server, conn, msg->request, callRequest);
+        case ROUTE_PAGE: return start_page(server, conn, msg->request, callRequest, find_page_group(server, route->target));
+        case ROUTE_HUNT: calleeNumber = hunt_member(server, route, fromPhoneNumber); break;
+        default: calleeNumber = route->target; break;
+        }
+
+        info("%hu is routed to %hu", toPhoneNumber, calleeNumber);
+    }
+
+    client_info_t* toClient = find_client(server, calleeNumber);
+
+    if (fromClient == NULL || toClient == NULL || toClient == fromClient || toClient->connection == NULL) {
+        info("To / from phone number not valid");
+        return send_terminate(server, conn, msg->request, NUMBER_UNAVAILABLE);
+    }
+
+    if (server->pending_count >= sizeof(server->pending_calls) / sizeof(*server->pending_calls)) {
+        warn("Too many pending calls");
+        return send_terminate(server, conn, msg->request, SERVER_ERROR);
+    }
+
+    call_info_t* pendingCall = &server->pending_calls[server->pending_count];
+    memset(pendingCall, 0, sizeof(*pendingCall));
+
+    if (generate_media_tokens(pendingCall) != ST_GOOD) {
+        return send_terminate(server, conn, msg->request, SERVER_ERROR);
+    }
+
+    // The relay's key pairs are the server's own, the relay only gets the
+    // keys agreed from them
+    if (should_transcode(fromClient, toClient)) {
+        pendingCall->transcoded = true;
+
+        if (!resampler_supports(fromClient->wire_rate, toClient->wire_rate) || !resampler_supports(toClient->wire_rate, fromClient->wire_rate)
+            || x25519_keypair(pendingCall->relay_secret[MEDIA_SENDER_CALLER], pendingCall->relay_key[MEDIA_SENDER_CALLER]) != ST_GOOD
+            || x25519_keypair(pendingCall->relay_secret[MEDIA_SENDER_CALLEE], pendingCall->relay_key[MEDIA_SENDER_CALLEE]) != ST_GOOD) {
+            warn("Cannot transcode between %u Hz and %u Hz", fromClient->wire_rate, toClient->wire_rate);
+            memset(pendingCall->relay_secret, 0, sizeof(pendingCall->relay_secret));
+            return send_terminate(server, conn, msg->request, SERVER_ERROR);
+        }
+    }
+
+    // It goes to voicemail, or is hung up, if nobody answers
+    const uint64_t ringMs = server->voicemail.fd != -1 ? (uint64_t)server->conf->voicemail_answer_s * 1000 : RING_TIMEOUT_MS;
+
+    if (timer_wheel_add(&server->timers, ringMs, &handle_ring_timeout, pendingCall->caller_token, server) == TIMER_NONE) {
+        return send_terminate(server, conn, msg->request, SERVER_ERROR);
+    }
+
+    // Start the udp server
+    uint16_t updPort = allocate_udp_port(server);
+
+    if (updPort == 0) {
+        warn("No free port for the call's relay");
+        return send_terminate(server, conn, msg->request, SERVER_ERROR);
+    }
+
+    if (start_udp_port(&server->udp_server, updPort) != ST_GOOD) {
+        return send_terminate(server, conn, msg->request, SERVER_ERROR);
+    }
+
+    // Add to pending calls list
+    server->pending_count++;
+    pendingCall->time = event_loop_now();
+    pendingCall->caller = fromPhoneNumber;
+    pendingCall->callee = calleeNumber;
+    pendingCall->port = updPort;
+    pendingCall->ringing = false;
+    pendingCall->caller_media_port = ntohs(callRequest->media.port);
+    pendingCall->caller_media_address = callRequest->media.address;
+    memcpy(pendingCall->caller_key, callRequest->public_key, MEDIA_PUBLIC_KEY_SIZE);
+
+    // The recorder's key pair is the server's own, the relay never sees it
+    if (should_record(server, callRequest)) {
+        pendingCall->recorded = x25519_keypair(pendingCall->recorder_secret, pendingCall->recorder_key) == ST_GOOD;
+    }
+
+    // The relay forwards to the caller from the callee's first packet
+    bind_call_media(server, pendingCall, MEDIA_SENDER_CALLER);
+
+    if (pendingCall->transcoded) {
+        key_transcoded_side(server, pendingCall, MEDIA_SENDER_CALLER, callRequest->public_key);
+    }
+
+    // Respond to caller
+    struct call_response response;
+    response.udp_server_port = htons(updPort);
+    response.media_token = pendingCall->caller_token;
+
+    if (send_wrapped_message(conn->fd, CALL_RESPONSE, msg->request, &response, sizeof(response)) != ST_GOOD) {
+        return ST_FAIL;
+    }
+
+    if (pendingCall->recorded) {
+        send_record_call(server, pendingCall, MEDIA_SENDER_CALLER);
+    }
+
+    // Call the other number
+    struct incoming_call incoming;
+    incoming.from_phone_number = htons(fromPhoneNumber);
+    incoming.udp_server_port = htons(updPort);
+    memcpy(incoming.public_key, peer_media_key(pendingCall, MEDIA_SENDER_CALLEE), MEDIA_PUBLIC_KEY_SIZE);
+    incoming.media_token = pendingCall->callee_token;
+    offer_call_media(server, pendingCall, MEDIA_SENDER_CALLER, &incoming.caller_media);
+    incoming.flags = call_flags(pendingCall);
+
+    if (send_wrapped_message(toClient->connection->fd, INCOMING_CALL, 0, &incoming, sizeof(incoming)) != ST_GOOD) {
+        return ST_FAIL;
+    }
+
+    return pendingCall->recorded ? send_record_call(server, pendingCall, MEDIA_SENDER_CALLEE) : ST_GOOD;
+}
+
+/**
+ * The callee picked up, connect the call and confirm it with a call response.
+ */
+static int handle_incoming_response(server_t* server, connection_t* conn, struct message_wrapper* msg) {
+    info("Handling incoming call response");
+    if (msg->length != sizeof(struct incoming_response)) {
+        warn("Invalid message size for incoming response");
+        return ST_FAIL;
+    }
+
+    struct incoming_response* response = (struct incoming_response*)msg->data;
+
+    uint16_t phoneNumber = ntohs(response->from_phone_number);
+
+    int slot;
+    conference_t* conference = find_conference(server, phoneNumber, &slot);
+
+    if (conference != NULL) {
+        conference_member_t* member = &conference->members[slot];
+
+        // The key came with the ringing, unless that was lost
+        if (key_conference_member(member, response->public_key) != ST_GOOD) {
+            return send_terminate(server, conn, msg->request, SERVER_ERROR);
+        }
+
+        member->info.live = true;
+        set_conference_member(conference->bridge, slot, &member->info);
+
+        struct call_response callResponse;
+        callResponse.udp_server_port = htons(conference->bridge->port);
+        callResponse.media_token = member->info.token;
+
+        info("%hu joined the conference on port %hu", phoneNumber, conference->bridge->port);
+        return send_wrapped_message(conn->fd, CALL_RESPONSE, msg->request, &callResponse, sizeof(callResponse));
+    }
+
+    // Find in pending calls
+    int index = -1;
+    for (int i = 0; i < server->pending_count; i++) {
+        if (server->pending_calls[i].callee == phoneNumber) {
+            index = i;
+            break;
+        }
+    }
+
+    if (index == -1) {
+        warn("Incoming response callee not found");
+        return send_terminate(server, conn, msg->request, CALL_PUTDOWN);
+    }
+
+    call_info_t* pendingCall = &server->pending_calls[index];
+    memcpy(pendingCall->callee_key, response->public_key, MEDIA_PUBLIC_KEY_SIZE);
+
+    // The key came with the ringing, unless that was lost
+    if (pendingCall->transcoded) {
+        key_transcoded_side(server, pendingCall, MEDIA_SENDER_CALLEE, response->public_key);
+    }
+
+    // Without its media timeout the call could outlive either side, so it is
+    // left ringing until its ring timeout instead
+    if (timer_wheel_add(&server->timers, MEDIA_TIMEOUT_MS, &handle_media_timeout, pendingCall->caller_token, server) == TIMER_NONE) {
+        return send_terminate(server, conn, msg->request, SERVER_ERROR);
+    }
+
+    // Success so first add to ongoing calls
+    call_info_t* ongoingCall = &server->ongoing_calls[server->ongoing_count++];
+    memcpy(ongoingCall, pendingCall, sizeof(call_info_t));
+    ongoingCall->relayed = event_loop_now();
+    journal_save_call(server, ongoingCall);
+
+    // Now remove pending call
+    if (index != server->pending_count - 1) {
+        // Swap pending call with the last one to 'remove' it
+        memcpy(pendingCall, &server->pending_calls[server->pending_count - 1], sizeof(call_info_t));
+    }
+    server->pending_count--;
+
+    struct call_response callResponse;
+    callResponse.udp_server_port = htons(ongoingCall->port);
+    callResponse.media_token = ongoingCall->callee_token;
+
+    if (send_wrapped_message(conn->fd, CALL_RESPONSE, msg->request, &callResponse, sizeof(callResponse)) != ST_GOOD) {
+        return ST_FAIL;
+    }
+
+    return send_call_answered(server, ongoingCall);
+}
+
+/**
+ * The callee's phone is ringing, pass its key on so the caller can open the
+ * audio path and play ringback, and bind the callee's media at the relay.
+ */
+static int handle_call_ringing(server_t* server, connection_t* conn, struct message_wrapper* msg) {
+    if (msg->length != sizeof(struct call_ringing)) {
+        warn("Invalid message size for call ringing");
+        return ST_FAIL;
+    }
+
+    struct call_ringing* ringing = (struct call_ringing*)msg->data;
+    const uint16_t phoneNumber = ntohs(ringing->phone_number);
+
+    int slot;
+    conference_t* conference = find_conference(server, phoneNumber, &slot);
+
+    // A number added to a conference rings with the bridge's key, nobody
+    // waits on its ringing
+    if (conference != NULL) {
+        conference_member_t* member = &conference->members[slot];
+        const int res = key_conference_member(member, ringing->public_key);
+
+        member->info.addr.sin_port = ringing->media.port;
+        set_conference_member(conference->bridge, slot, &member->info);
+        return res;
+    }
+
+    for (int i = 0; i < server->pending_count; i++) {
+        call_info_t* pendingCall = &server->pending_calls[i];
+
+        if (pendingCall->callee == phoneNumber) {
+            memcpy(pendingCall->callee_key, ringing->public_key, MEDIA_PUBLIC_KEY_SIZE);
+            pendingCall->ringing = true;
+            pendingCall->callee_media_port = ntohs(ringing->media.port);
+            pendingCall->callee_media_address = ringing->media.address;
+            bind_call_media(server, pendingCall, MEDIA_SENDER_CALLEE);
+
+            if (pendingCall->transcoded) {
+                key_transcoded_side(server, pendingCall, MEDIA_SENDER_CALLEE, ringing->public_key);
+            }
+
+            return send_call_ringing(server, pendingCall);
+        }
+    }
+
+    // The caller hung up before the callee started ringing
+    info("No pending call ringing %hu", phoneNumber);
+    return ST_GOOD;
+}
+
+static int handle_terminate(server_t* server, connection_t* conn, struct message_wrapper* msg) {
+    info("Handling call terminate");
+    if (msg->length != sizeof(struct client_terminate_call)) {
+        warn("Invalid message size for terminate call");
+        return ST_FAIL;
+    }
+
+    struct client_terminate_call* clientTerm = (struct client_terminate_call*)msg->data;
+    const uint16_t phoneNumber = ntohs(clientTerm->phone_number);
+
+    info("Terminating call with code: %hu", clientTerm->err_code);
+
+    // A callee turning its call down sends the caller to its voicemail
+    for (int i = 0; i < server->pending_count && server->voicemail.fd != -1; i++) {
+        if (server->pending_calls[i].callee == phoneNumber && divert_to_voicemail(server, &server->pending_calls[i]) == ST_GOOD) {
+            return ST_GOOD;
+        }
+    }
+
+    return end_call(server, phoneNumber);
+}
+
+/**
+ * End the pending or ongoing call `phoneNumber` is part of, telling the other
+ * party. A conference carries on without it, as does a page without one of
+ * its listeners. A message being left is stored, a call on hold is taken off
+ * the hold player.
+ */
+int end_call(server_t* server, uint16_t phoneNumber) {
+    release_hold(server, phoneNumber);
+
+    if (leave_voicemail(server, phoneNumber) || leave_conference(server, phoneNumber) || leave_page(server, phoneNumber)) {
+        return ST_GOOD;
+    }
+
+    call_info_t* callInfo = NULL;
+    bool ongoing = false;
+    for (int i = 0; i < server->ongoing_count; i++) {
+        if (server->ongoing_calls[i].callee == phoneNumber || server->ongoing_calls[i].caller == phoneNumber) {
+            callInfo = server->ongoing_calls + i;
+            ongoing = true;
+            break;
+        }
+    }
+
+    // Check pending calls if not found
+    if (callInfo == NULL) {
+        for (int i = 0; i < server->pending_count; i++) {
+            if (server->pending_calls[i].callee == phoneNumber || server->pending_calls[i].caller == phoneNumber) {
+                callInfo = server->pending_calls + i;
+                break;
+            }
+        }
+    }
+
+    if (callInfo == NULL) {
+        info("No call to terminate for %hu", phoneNumber);
+        return ST_GOOD;
+    }
+
+    // Send terminate call to other client, if it is still connected
+    uint16_t toTerminate = callInfo->callee == phoneNumber ? callInfo->caller : callInfo->callee;
+    client_info_t* client = find_client(server, toTerminate);
+
+    if (client != NULL && client->connection != NULL) {
+        info("Terminating call for phone number: %hu, from %hu", toTerminate, phoneNumber);
+        send_terminate(server, client->connection, 0, CALL_PUTDOWN);
+    }
+
+    if (ongoing) {
+        journal_drop_call(&server->journal, callInfo->caller_token);
+    }
+
+    // The udp port is running for pending calls too
+    stop_udp_port(&server->udp_server, callInfo->port);
+    memset(callInfo->recorder_secret, 0, sizeof(callInfo->recorder_secret));
+    memset(callInfo->relay_secret, 0, sizeof(callInfo->relay_secret));
+
+    // Now destroy the struct
+    call_info_t* callArray = ongoing ? server->ongoing_calls : server->pending_calls;
+    int* count = ongoing ? &server->ongoing_count : &server->pending_count;
+
+    if (callInfo - callArray < *count - 1) {
+        memcpy(callInfo, callArray + *count - 1, sizeof(call_info_t));
+    }
+
+    (*count)--;
+
+    return ST_GOOD;
+}
+
+/**
+ * A node that sends heartbeats is held to them from its first, each message
+ * it sends puts the keepalive timeout back.
+ */
+static int handle_heartbeat(server_t* server, connection_t* conn, struct message_wrapper* msg) {
+    // Also where a keepalive the wheel could not take is tried again
+    if (conn->keepaliveTimer == TIMER_NONE) {
+        conn->keepaliveTimer = timer_wheel_add(&server->timers, KEEPALIVE_TIMEOUT_MS, &handle_keepalive_timeout, conn - server->connections, server);
+    }
+
+    return ST_GOOD;
+}
+
+int send_terminate(server_t* server, connection_t* conn, uint8_t requestId, uint8_t code) {
+    struct terminate_call termCall;
+    termCall.err_code = code;
+
+    return send_wrapped_message(conn->fd, TERMINATE_CALL, requestId, &termCall, sizeof(termCall));
+}
+
+/**
+ * Send the numbers currently online to a node, so it can place a call as
+ * soon as the last digit is dialled.
+ */
+static int send_dial_plan(server_t* server, const client_info_t* client) {
+    if (client->connection == NULL) {
+        return ST_GOOD;
+    }
+
+    uint8_t buffer[UINT8_MAX];
+    struct dial_plan_update* update = (struct dial_plan_update*)buffer;
+
+    // Routed numbers can be dialled like any node. Prefixes and ranges are
+    // left out, a node waits out its digit gap for them
+    const int total = server->client_count + server->router->number_count;
+    int sent = 0;
+
+    do {
+        const int count = MIN(total - sent, (int)DIAL_PLAN_CHUNK);
+
+        update->flags = (sent == 0 ? DIAL_PLAN_FIRST : 0) | (sent + count == total ? DIAL_PLAN_LAST : 0);
+
+        for (int i = 0; i < count; i++) {
+            const int index = sent + i;
+            const uint16_t number = index < server->client_count ? server->clients[index].phone_number
+                : server->router->numbers[index - server->client_count];
+            update->numbers[i] = htons(number);
+        }
+
+        sent += count;
+
+        const uint8_t length = sizeof(struct dial_plan_update) + count * sizeof(uint16_t);
+
+        if (send_wrapped_message(client->connection->fd, DIAL_PLAN, 0, buffer, length) != ST_GOOD) {
+            warn("Failed to send dial plan to %hu", client->phone_number);
+            return ST_FAIL;
+        }
+    } while (sent < total);
+
+    return ST_GOOD;
+}
+
+/**
+ * Tell the caller the callee picked up, so its audio goes live.
+ */
+static int send_call_answered(server_t* server, const call_info_t* call) {
+    client_info_t* caller = find_client(server, call->caller);
+
+    if (caller == NULL || caller->connection == NULL) {
+        return ST_GOOD;
+    }
+
+    struct call_answered answered;
+    memcpy(answered.public_key, peer_media_key(call, MEDIA_SENDER_CALLER), MEDIA_PUBLIC_KEY_SIZE);
+    offer_call_media(server, call, MEDIA_SENDER_CALLEE, &answered.callee_media);
+    answered.flags = call_flags(call);
+
+    return send_wrapped_message(caller->connection->fd, CALL_ANSWERED, 0, &answered, sizeof(answered));
+}
+
+static int send_call_ringing(server_t* server, const call_info_t* call) {
+    client_info_t* caller = find_client(server, call->caller);
+
+    if (caller == NULL || caller->connection == NULL) {
+        return ST_GOOD;
+    }
+
+    struct call_ringing ringing;
+    ringing.phone_number = htons(call->callee);
+    memcpy(ringing.public_key, peer_media_key(call, MEDIA_SENDER_CALLER), MEDIA_PUBLIC_KEY_SIZE);
+    offer_call_media(server, call, MEDIA_SENDER_CALLEE, &ringing.media);
+    ringing.flags = call_flags(call);
+
+    return send_wrapped_message(caller->connection->fd, CALL_RINGING, 0, &ringing, sizeof(ringing));
+}
+
+/**
+ * Bind one side's token at the relay to the address its control connection
+ * comes from and the media port it signalled. Media is expected from the
+ * same address, a NAT may still pick another port, which the relay learns.
+ */
+void bind_call_media(server_t* server, const call_info_t* call, uint8_t sender) {
+    const bool caller = sender == MEDIA_SENDER_CALLER;
+    client_info_t* client = find_client(server, caller ? call->caller : call->callee);
+
+    if (client == NULL) {
+        return;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr = client->address.sin_addr;
+    addr.sin_port = htons(caller ? call->caller_media_port : call->callee_media_port);
+
+    if (bind_udp_peer(&server->udp_server, call->port, sender, caller ? call->caller_token : call->callee_token, &addr) != ST_GOOD) {
+        warn("Failed to bind %hu's media on udp port %hu", client->phone_number, call->port);
+    }
+}
+
+/**
+ * Offer `sender`'s media to the other side for a direct path. Its own address
+ * is only any use to a node on the same network, which is taken to be one
+ * that reaches the server from the same address.
+ */
+static void offer_call_media(server_t* server, const call_info_t* call, uint8_t sender, struct media_candidate* candidate) {
+    const bool caller = sender == MEDIA_SENDER_CALLER;
+    client_info_t* from = find_client(server, caller ? call->caller : call->callee);
+    client_info_t* to = find_client(server, caller ? call->callee : call->caller);
+
+    memset(candidate, 0, sizeof(*candidate));
+
+    // The relay can only record or transcode what passes through it
+    if (from == NULL || to == NULL || call->recorded || call->transcoded) {
+        return;
+    }
+
+    const bool sameNetwork = from->address.sin_addr.s_addr == to->address.sin_addr.s_addr;
+
+    if (sameNetwork) {
+        candidate->address = caller ? call->caller_media_address : call->callee_media_address;
+    } else {
+        candidate->address = from->address.sin_addr.s_addr;
+    }
+
+    // A port with no address to go with it is no use
+    if (candidate->address != 0) {
+        candidate->port = htons(caller ? call->caller_media_port : call->callee_media_port);
+    }
+}
+
+void broadcast_dial_plan(server_t* server) {
+    for (int i = 0; i < server->client_count; i++) {
+        send_dial_plan(server, &server->clients[i]);
+    }
+}
+
+/**
+ * Hang up a call left ringing, diverting it to voicemail if there is any.
+ * Keyed by the caller's media token, so a call answered or ended since is
+ * left alone.
+ */
+int handle_ring_timeout(struct timer_wheel* wheel, uint64_t arg, void* data) {
+    server_t* server = (server_t*)data;
+    call_info_t* call = find_call_by_token(server->pending_calls, server->pending_count, (uint32_t)arg);
+
+    if (call == NULL) {
+        return ST_GOOD;
+    }
+
+    const uint16_t callee = call->callee;
+    client_info_t* client = find_client(server, callee);
+
+    info("%hu did not answer %hu", callee, call->caller);
+
+    if (client != NULL && client->connection != NULL) {
+        send_terminate(server, client->connection, 0, CALL_PUTDOWN);
+    }
+
+    if (server->voicemail.fd == -1 || divert_to_voicemail(server, call) != ST_GOOD) {
+        end_call(server, callee);
+    }
+
+    return ST_GOOD;
+}
+
+/**
+ * Drop a node that sends heartbeats but has gone quiet, as though its
+ * connection had closed, or wait for the rest of the timeout from the last
+ * message.
+ */
+int handle_keepalive_timeout(struct timer_wheel* wheel, uint64_t arg, void* data) {
+    server_t* server = (server_t*)data;
+    connection_t* conn = &server->connections[arg];
+    const uint64_t quietMs = (event_loop_now() - conn->heardNs) / 1000000;
+
+    conn->keepaliveTimer = TIMER_NONE;
+
+    if (conn->fd == -1) {
+        return ST_GOOD;
+    }
+
+    if (quietMs >= KEEPALIVE_TIMEOUT_MS) {
+        warn("Nothing from connection %d for %llu ms, closing it", conn->fd, (unsigned long long)quietMs);
+        close_connection(server, conn);
+        return ST_GOOD;
+    }
+
+    conn->keepaliveTimer = timer_wheel_add(wheel, KEEPALIVE_TIMEOUT_MS - quietMs, &handle_keepalive_timeout, arg, server);
+    return ST_GOOD;
+}
+
+/**
+ * Tear down an answered call the relay has not heard one side of for
+ * MEDIA_TIMEOUT_MS, or wait until the quieter side could be. A call on hold
+ * is not relayed, so is only checked again once it is back.
+ */
+int handle_media_timeout(struct timer_wheel* wheel, uint64_t arg, void* data) {
+    server_t* server = (server_t*)data;
+    call_info_t* call = find_call_by_token(server->ongoing_calls, server->ongoing_count, (uint32_t)arg);
+    int slot;
+
+    if (call == NULL) {
+        return ST_GOOD;
+    }
+
+    const bool held = find_hold(server, call->caller, &slot) != NULL;
+    const uint64_t nowNs = event_loop_now();
+    uint64_t quietMs = 0;
+    uint8_t quiet = MEDIA_SENDER_CALLER;
+
+    for (uint8_t sender = MEDIA_SENDER_CALLER; sender <= MEDIA_SENDER_CALLEE && !held; sender++) {
+        const uint64_t heardNs = MAX(udp_port_heard(&server->udp_server, call->port, sender), call->relayed);
+        const uint64_t ms = (nowNs - MIN(heardNs, nowNs)) / 1000000;
+
+        if (ms >= quietMs) {
+            quietMs = ms;
+            quiet = sender;
+        }
+    }
+
+    if (quietMs < MEDIA_TIMEOUT_MS && timer_wheel_add(wheel, MEDIA_TIMEOUT_MS - quietMs, &handle_media_timeout, arg, server) != TIMER_NONE) {
+        return ST_GOOD;
+    }
+
+    // The quiet side is gone, so the other is told as for a hang up
+    const uint16_t phoneNumber = quiet == MEDIA_SENDER_CALLER ? call->caller : call->callee;
+    client_info_t* client = find_client(server, phoneNumber);
+
+    if (quietMs < MEDIA_TIMEOUT_MS) {
+        warn("Media on port %hu can no longer be watched, ending the call", call->port);
+    } else {
+        warn("No media from %hu on port %hu for %llu ms, ending the call", phoneNumber, call->port, (unsigned long long)quietMs);
+    }
+
+    if (client != NULL && client->connection != NULL) {
+        send_terminate(server, client->connection, 0, CALL_PUTDOWN);
+    }
+
+    end_call(server, phoneNumber);
+    return ST_GOOD;
+}
+
+/**
+ * The call in `calls` made with `callerToken`.
+ */
+static call_info_t* find_call_by_token(call_info_t* calls, int count, uint32_t callerToken) {
+    for (int i = 0; i < count; i++) {
+        if (calls[i].caller_token == callerToken) {
+            return &calls[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Forget a node that has been detached for too long, ending its call. Keyed
+ * by number, so a node that resumed, or detached again since, is left to
+ * its own timer.
+ */
+int handle_session_expiry(struct timer_wheel* wheel, uint64_t arg, void* data) {
+    server_t* server = (server_t*)data;
+    const uint16_t phoneNumber = (uint16_t)arg;
+
+    for (int i = 0; i < server->client_count; i++) {
+        client_info_t* client = &server->clients[i];
+
+        if (client->phone_number != phoneNumber) {
+            continue;
+        }
+
+        if (client->connection != NULL || event_loop_now() - client->detachedNs < (uint64_t)SESSION_RESUME_TIMEOUT_MS * 1000000) {
+            return ST_GOOD;
+        }
+
+        info("Session for %hu expired", phoneNumber);
+        expire_session(server, i);
+        return ST_GOOD;
+    }
+
+    return ST_GOOD;
+}
+
+/**
+ * Forget a detached node, ending its call.
+ */
+static void expire_session(server_t* server, int index) {
+    const uint16_t phoneNumber = server->clients[index].phone_number;
+
+    end_call(server, phoneNumber);
+    remove_client(server, index);
+    broadcast_dial_plan(server);
+}
+
+static uint32_t session_slot(const uint8_t* token) {
+    // Tokens are random, so any of their bytes make a good hash
+    uint32_t hash;
+    memcpy(&hash, token, sizeof(hash));
+    return hash & (SERVER_SESSION_SLOTS - 1);
+}
+
+static client_info_t* find_session(server_t* server, const uint8_t* token) {
+    for (uint32_t slot = session_slot(token); server->sessions[slot] != 0; slot = (slot + 1) & (SERVER_SESSION_SLOTS - 1)) {
+        client_info_t* client = &server->clients[server->sessions[slot] - 1];
+
+        if (memcmp(client->token, token, SESSION_TOKEN_SIZE) == 0) {
+            return client;
+        }
+    }
+
+    return NULL;
+}
+
+void insert_session(server_t* server, int index) {
+    uint32_t slot = session_slot(server->clients[index].token);
+
+    while (server->sessions[slot] != 0) {
+        slot = (slot + 1) & (SERVER_SESSION_SLOTS - 1);
+    }
+
+    server->sessions[slot] = (uint8_t)(index + 1);
+}
+
+/**
+ * Remove the client at `index`, moving the last client into its place.
+ */
+static void remove_client(server_t* server, int index) {
+    const uint32_t mask = SERVER_SESSION_SLOTS - 1;
+    journal_drop_client(&server->journal, server->clients[index].phone_number);
+
+    uint32_t hole = session_slot(server->clients[index].token);
+
+    while (server->sessions[hole] != index + 1) {
+        hole = (hole + 1) & mask;
+    }
+
+    // Shift later entries of the probe run back so lookups never stop early
+    server->sessions[hole] = 0;
+
+    for (uint32_t slot = (hole + 1) & mask; server->sessions[slot] != 0; slot = (slot + 1) & mask) {
+        const uint32_t home = session_slot(server->clients[server->sessions[slot] - 1].token);
+
+        // Move the entry unless its home lies cyclically in (hole, slot]
+        if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+            server->sessions[hole] = server->sessions[slot];
+            server->sessions[slot] = 0;
+            hole = slot;
+        }
+    }
+
+    const int last = --server->client_count;
+
+    if (index != last) {
+        server->clients[index] = server->clients[last];
+
+        for (uint32_t slot = session_slot(server->clients[index].token); ; slot = (slot + 1) & mask) {
+            if (server->sessions[slot] == last + 1) {
+                server->sessions[slot] = (uint8_t)(index + 1);
+                break;
+            }
+        }
+    }
+}
+
+int generate_token(uint8_t* token, size_t length) {
+    FILE* random = fopen("/dev/urandom", "rb");
+
+    if (random == NULL) {
+        stl_warn(errno, "Failed to open /dev/urandom");
+        return ST_FAIL;
+    }
+
+    const size_t read = fread(token, 1, length, random);
+    fclose(random);
+
+    if (read != length) {
+        warn("Failed to generate a token");
+        return ST_FAIL;
+    }
+
+    return ST_GOOD;
+}
+
+/**
+ * A token for each side of a call, non zero and distinct, so the relay can
+ * tell who sent a packet from its header.
+ */
+static int generate_media_tokens(call_info_t* call) {
+    do {
+        if (generate_token((uint8_t*)&call->caller_token, sizeof(call->caller_token)) != ST_GOOD ||
+            generate_token((uint8_t*)&call->callee_token, sizeof(call->callee_token)) != ST_GOOD) {
+            return ST_FAIL;
+        }
+    } while (call->caller_token == 0 || call->callee_token == 0 || call->caller_token == call->callee_token);
+
+    return ST_GOOD;
+}
+
+client_info_t* find_client(server_t* server, uint16_t phoneNumber) {
+    for (int i = 0; i < server->client_count; i++) {
+        if (server->clients[i].phone_number == phoneNumber) {
+            return &server->clients[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * The call of two `phoneNumber` is talking on.
+ */
+call_info_t* find_ongoing_call(server_t* server, uint16_t phoneNumber) {
+    for (int i = 0; i < server->ongoing_count; i++) {
+        if (server->ongoing_calls[i].caller == phoneNumber || server->ongoing_calls[i].callee == phoneNumber) {
+            return &server->ongoing_calls[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Whether `phoneNumber` is in a call, ringing, in a conference or a page.
+ */
+bool in_call(server_t* server, uint16_t phoneNumber) {
+    for (int i = 0; i < server->ongoing_count; i++) {
+        if (server->ongoing_calls[i].caller == phoneNumber || server->ongoing_calls[i].callee == phoneNumber) {
+            return true;
+        }
+    }
+
+    for (int i = 0; i < server->pending_count; i++) {
+        if (server->pending_calls[i].caller == phoneNumber || server->pending_calls[i].callee == phoneNumber) {
+            return true;
+        }
+    }
+
+    int slot;
+    return find_conference(server, phoneNumber, &slot) != NULL || find_page(server, phoneNumber, &slot) != NULL
+        || find_voicemail_call(server, phoneNumber) != NULL;
+}
+
+/**
+ * Whether `number` is dialled for something other than a node.
+ */
+static bool number_reserved(server_t* server, uint16_t number) {
+    return router_reserves(server->router, number);
+}
+
+static uint16_t allocate_phone_number(server_t* server, uint16_t requested) {
+    // Check if phone number exists
+    bool found = false;
+    uint16_t largest = 0;
+    for (int i = 0; i < server->client_count; i++) {
+        if (requested == server->clients[i].phone_number) {
+            found = true;
+        }
+
+        if (server->clients[i].phone_number > largest) {
+            largest = server->clients[i].phone_number;
+        }
+    }
+
+    // If not found then return requested number, a page group's is taken
+    if (!found && !number_reserved(server, requested)) {
+        return requested;
+    }
+
+    // Else just make a new number
+    uint16_t number = largest + 1;
+
+    while (number_reserved(server, number)) {
+        number++;
+    }
+
+    return number;
+}
+
+/**
+ * A free port for a call's relay, 0 if there is none. A stopped relay may
+ * still be finishing its recording, so its port is only free once it exits.
+ */
 static uint16_t allocate_udp_port(server_t* server) {
-    return 9090;
-}
\ No newline at end of file
+    const uint16_t first = first_call_port(server);
+
+    if (first == 0) {
+        return 0;
+    }
+
+    reap_call_relays(server);
+
+    for (int slot = 0; slot < SERVER_MAX_CALLS; slot++) {
+        if (server->call_relays[slot] == 0) {
+            const unsigned int port = first + slot;
+            return port <= server->conf->audio_port_max ? (uint16_t)port : 0;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Calls' relays take the ports after hold's, one for each call slot.
+ */
+static uint16_t first_call_port(const server_t* server) {
+    const unsigned int port = server->conf->audio_port_min + SERVER_MAX_CONFERENCES + SERVER_MAX_PAGES + SERVER_MAX_VOICEMAIL_CALLS + 1;
+    return server->conf->audio_port_min != 0 && port <= server->conf->audio_port_max ? (uint16_t)port : 0;
+}
+
+/**
+ * Note the relays started or taken over on the call ports, and free the
+ * port of each that has exited. Relays taken over on an upgrade are not
+ * children, so whether they are still running is all that can be asked.
+ */
+static void reap_call_relays(server_t* server) {
+    const uint16_t first = first_call_port(server);
+
+    if (first == 0) {
+        return;
+    }
+
+    for (int i = 0; i < server->udp_server.port_count; i++) {
+        const udp_port_info_t* relay = server->udp_server.ports[i];
+
+        if (relay->port >= first && relay->port - first < SERVER_MAX_CALLS) {
+            server->call_relays[relay->port - first] = relay->pid;
+        }
+    }
+
+    for (int slot = 0; slot < SERVER_MAX_CALLS; slot++) {
+        const pid_t pid = server->call_relays[slot];
+
+        if (pid == 0) {
+            continue;
+        }
+
+        const pid_t res = waitpid(pid, NULL, WNOHANG);
+
+        if (res == pid || (res == -1 && errno == ECHILD && kill(pid, 0) == -1 && errno == ESRCH)) {
+            server->call_relays[slot] = 0;
+        }
+    }
+}
+
+/**
+ * Act on the signals the handler wrote, each once however often it came.
+ */
+static int handle_signal_pipe(struct event_loop* loop, int fd, uint32_t events, void* data) {
+    server_t* server = (server_t*)data;
+    uint8_t signals[16];
+    bool reload = false;
+    bool upgrade = false;
+    bool exited = false;
+    ssize_t count;
+
+    while ((count = read(fd, signals, sizeof(signals))) > 0) {
+        for (ssize_t i = 0; i < count; i++) {
+            reload |= signals[i] == SIGHUP;
+            upgrade |= signals[i] == SIGUSR2;
+            exited |= signals[i] == SIGCHLD;
+        }
+    }
+
+    if (exited) {
+        reap_call_relays(server);
+    }
+
+    if (reload) {
+        reload_routes(server);
+    }
+
+    if (upgrade) {
+        upgrade_server(server);
+    }
+
+    return ST_GOOD;
+}
+
+/**
+ * This handler should only handle SIGHUP, SIGUSR2 and SIGCHLD.
+ */
+static void handle_signal(int sigid) {
+    const int savedErrno = errno;
+    const uint8_t byte = (uint8_t)sigid;
+
+    if (write(signalPipe[1], &byte, sizeof(byte)) == -1) {
+        // Full, plenty is already pending
+    }
+
+    errno = savedErrno;
+}
+
+/**
+ * Whether the sides of a call differ in the rate or codecs they send and
+ * receive. A side that did not say is taken to match.
+ */
+static bool should_transcode(const client_info_t* caller, const client_info_t* callee) {
+    if (caller->wire_rate == 0 || callee->wire_rate == 0) {
+        return false;
+    }
+
+    return caller->wire_rate != callee->wire_rate || caller->codecs != callee->codecs;
+}
+
+/**
+ * Agree the relay's key with one side of a transcoded call from the side's
+ * public key, and pass it to the relay with the side's wire rate and codecs.
+ * The relay's secret for the side is wiped, so each side is keyed once.
+ */
+static int key_transcoded_side(server_t* server, call_info_t* call, uint8_t sender, const uint8_t* publicKey) {
+    if (call->relay_keyed[sender]) {
+        return ST_GOOD;
+    }
+
+    const client_info_t* client = find_client(server, sender == MEDIA_SENDER_CALLER ? call->caller : call->callee);
+
+    if (client == NULL) {
+        return ST_FAIL;
+    }
+
+    transcode_side_t side;
+    memset(&side, 0, sizeof(side));
+
+    int res = media_crypto_derive(side.key, call->relay_secret[sender], publicKey);
+
+    if (res == ST_GOOD) {
+        side.keyed = true;
+        side.wireRate = client->wire_rate;
+        side.codecs = client->codecs;
+        res = transcode_udp_port(&server->udp_server, call->port, sender, &side);
+    }
+
+    memset(&side, 0, sizeof(side));
+
+    if (res != ST_GOOD) {
+        warn("Failed to key the relay on udp port %hu with %hu", call->port, client->phone_number);
+        return res;
+    }
+
+    memset(call->relay_secret[sender], 0, sizeof(call->relay_secret[sender]));
+    call->relay_keyed[sender] = true;
+
+    info("Transcoding %hu's side of the call on udp port %hu at %u Hz", client->phone_number, call->port, client->wire_rate);
+    return ST_GOOD;
+}
+
+/**
+ * The public key `sender` agrees its media key from, the other side's or,
+ * for a transcoded call, the relay's.
+ */
+static const uint8_t* peer_media_key(const call_info_t* call, uint8_t sender) {
+    if (call->transcoded) {
+        return call->relay_key[sender];
+    }
+
+    return sender == MEDIA_SENDER_CALLER ? call->callee_key : call->caller_key;
+}
+
+/**
+ * The CALL_FLAG bits the server tells either side of `call`. A node keyed
+ * with the relay rather than its peer is told so.
+ */
+static uint8_t call_flags(const call_info_t* call) {
+    return call->transcoded ? CALL_FLAG_RELAYED_CLEAR : 0;
+}
@@ -0,0 +1,352 @@
+#include <arpa/inet.h>
+#include <string.h>
+#include "common.h"
+#include "server/server_internal.h"
+
+static int start_conference(server_t* server, call_info_t* call);
+static int add_conference_member(server_t* server, conference_t* conference, uint16_t phoneNumber, bool joining, int* slot);
+static uint16_t allocate_conference_port(server_t* server, int index);
+
+/**
+ * Add a number to the sender's call. A call of two becomes a conference
+ * first, its two sides are moved to a bridge and told with a conference join,
+ * the sender's as the reply. The number added is rung as for any call.
+ */
+int handle_conference_add(server_t* server, connection_t* conn, struct message_wrapper* msg) {
+    if (msg->length != sizeof(struct conference_add)) {
+        warn("Invalid message size for conference add");
+        return ST_FAIL;
+    }
+
+    struct conference_add* add = (struct conference_add*)msg->data;
+    const uint16_t fromPhoneNumber = ntohs(add->phone_number);
+    const uint16_t toPhoneNumber = ntohs(add->to_phone_number);
+
+    client_info_t* toClient = find_client(server, toPhoneNumber);
+
+    if (toClient == NULL || toClient->connection == NULL || in_call(server, toPhoneNumber)) {
+        info("%hu cannot be added to a conference", toPhoneNumber);
+        return send_terminate(server, conn, msg->request, NUMBER_UNAVAILABLE);
+    }
+
+    int slot;
+    conference_t* conference = find_conference(server, fromPhoneNumber, &slot);
+
+    if (conference == NULL) {
+        call_info_t* call = NULL;
+
+        for (int i = 0; i < server->ongoing_count; i++) {
+            if (server->ongoing_calls[i].caller == fromPhoneNumber || server->ongoing_calls[i].callee == fromPhoneNumber) {
+                call = &server->ongoing_calls[i];
+            }
+        }
+
+        if (call == NULL) {
+            info("%hu has no call to add %hu to", fromPhoneNumber, toPhoneNumber);
+            return send_terminate(server, conn, msg->request, CALL_PUTDOWN);
+        }
+
+        // Its sides would have to come off hold to move to the bridge
+        if (find_hold(server, fromPhoneNumber, &slot) != NULL) {
+            info("%hu cannot add %hu to a call on hold", fromPhoneNumber, toPhoneNumber);
+            return send_terminate(server, conn, msg->request, SERVER_ERROR);
+        }
+
+        if (start_conference(server, call) != ST_GOOD) {
+            return send_terminate(server, conn, msg->request, SERVER_ERROR);
+        }
+
+        conference = find_conference(server, fromPhoneNumber, &slot);
+
+        for (int i = 0; i < CONFERENCE_MAX_MEMBERS; i++) {
+            if (i != slot && conference->members[i].joining) {
+                send_conference_join(server, conference, i, 0);
+            }
+        }
+    }
+
+    int added;
+
+    if (add_conference_member(server, conference, toPhoneNumber, false, &added) != ST_GOOD) {
+        return send_terminate(server, conn, msg->request, SERVER_ERROR);
+    }
+
+    if (send_conference_join(server, conference, slot, msg->request) != ST_GOOD) {
+        return ST_FAIL;
+    }
+
+    // The media goes through the bridge, so there is no direct path to offer
+    struct incoming_call incoming;
+    memset(&incoming, 0, sizeof(incoming));
+    incoming.from_phone_number = htons(fromPhoneNumber);
+    incoming.udp_server_port = htons(conference->bridge->port);
+    memcpy(incoming.public_key, conference->members[added].public_key, MEDIA_PUBLIC_KEY_SIZE);
+    incoming.media_token = conference->members[added].info.token;
+    incoming.flags = CALL_FLAG_RELAYED_CLEAR;
+
+    if (send_wrapped_message(toClient->connection->fd, INCOMING_CALL, 0, &incoming, sizeof(incoming)) != ST_GOOD) {
+        leave_conference(server, toPhoneNumber);
+        return ST_FAIL;
+    }
+
+    info("%hu added %hu to the conference on port %hu", fromPhoneNumber, toPhoneNumber, conference->bridge->port);
+    return ST_GOOD;
+}
+
+/**
+ * A member moved from the call has agreed its key with the bridge.
+ */
+int handle_conference_joined(server_t* server, connection_t* conn, struct message_wrapper* msg) {
+    if (msg->length != sizeof(struct conference_joined)) {
+        warn("Invalid message size for conference joined");
+        return ST_FAIL;
+    }
+
+    struct conference_joined* joined = (struct conference_joined*)msg->data;
+    const uint16_t phoneNumber = ntohs(joined->phone_number);
+
+    int slot;
+    conference_t* conference = find_conference(server, phoneNumber, &slot);
+
+    if (conference == NULL || !conference->members[slot].joining) {
+        info("No conference for %hu to join", phoneNumber);
+        return ST_GOOD;
+    }
+
+    conference_member_t* member = &conference->members[slot];
+
+    if (key_conference_member(member, joined->public_key) != ST_GOOD) {
+        end_call(server, phoneNumber);
+        return send_terminate(server, conn, 0, SERVER_ERROR);
+    }
+
+    member->joining = false;
+    set_conference_member(conference->bridge, slot, &member->info);
+
+    info("%hu moved to the conference on port %hu", phoneNumber, conference->bridge->port);
+    return ST_GOOD;
+}
+
+/**
+ * Move an ongoing call to a new conference bridge. Both sides are already
+ * answered, so they are live as soon as they have joined.
+ */
+static int start_conference(server_t* server, call_info_t* call) {
+    int index = -1;
+
+    for (int i = 0; i < SERVER_MAX_CONFERENCES; i++) {
+        if (server->conferences[i].bridge == NULL) {
+            index = i;
+            break;
+        }
+    }
+
+    const uint16_t port = index < 0 ? 0 : allocate_conference_port(server, index);
+
+    if (port == 0) {
+        warn("Too many conferences");
+        return ST_FAIL;
+    }
+
+    conference_t* conference = &server->conferences[index];
+    memset(conference, 0, sizeof(*conference));
+
+    if (start_conference_bridge(&conference->bridge, port, server->conf->conference_wire_rate) != ST_GOOD) {
+        conference->bridge = NULL;
+        return ST_FAIL;
+    }
+
+    if (add_conference_member(server, conference, call->caller, true, NULL) != ST_GOOD ||
+        add_conference_member(server, conference, call->callee, true, NULL) != ST_GOOD) {
+        stop_conference_bridge(conference->bridge);
+        memset(conference, 0, sizeof(*conference));
+        return ST_FAIL;
+    }
+
+    // The relay has nothing left to forward once the sides move
+    stop_udp_port(&server->udp_server, call->port);
+    journal_drop_call(&server->journal, call->caller_token);
+
+    if (call - server->ongoing_calls < server->ongoing_count - 1) {
+        memcpy(call, &server->ongoing_calls[server->ongoing_count - 1], sizeof(call_info_t));
+    }
+
+    server->ongoing_count--;
+
+    return ST_GOOD;
+}
+
+/**
+ * Give `phoneNumber` a slot on the bridge, with a token and a key pair of its
+ * own, bound to the address its control connection comes from.
+ */
+static int add_conference_member(server_t* server, conference_t* conference, uint16_t phoneNumber, bool joining, int* slot) {
+    conference_member_t* member = NULL;
+    int index;
+
+    for (index = 0; index < CONFERENCE_MAX_MEMBERS; index++) {
+        if (conference->members[index].info.token == 0) {
+            member = &conference->members[index];
+            break;
+        }
+    }
+
+    if (member == NULL) {
+        warn("Conference on port %hu is full", conference->bridge->port);
+        return ST_FAIL;
+    }
+
+    memset(member, 0, sizeof(*member));
+
+    // Non zero and unique on the bridge, so the bridge can tell who sent a packet
+    uint32_t token;
+    bool taken;
+
+    do {
+        if (generate_token((uint8_t*)&token, sizeof(token)) != ST_GOOD) {
+            return ST_FAIL;
+        }
+
+        taken = token == 0;
+
+        for (int i = 0; i < CONFERENCE_MAX_MEMBERS; i++) {
+            taken |= conference->members[i].info.token == token;
+        }
+    } while (taken);
+
+    if (x25519_keypair(member->secret, member->public_key) != ST_GOOD) {
+        memset(member, 0, sizeof(*member));
+        return ST_FAIL;
+    }
+
+    client_info_t* client = find_client(server, phoneNumber);
+
+    member->phone_number = phoneNumber;
+    member->joining = joining;
+    member->info.token = token;
+    member->info.addr.sin_family = AF_INET;
+    member->info.live = joining;
+
+    if (client != NULL) {
+        member->info.addr.sin_addr = client->address.sin_addr;
+    }
+
+    set_conference_member(conference->bridge, index, &member->info);
+
+    if (slot != NULL) {
+        *slot = index;
+    }
+
+    return ST_GOOD;
+}
+
+/**
+ * Agree the bridge's key with a member from its public key, once.
+ */
+int key_conference_member(conference_member_t* member, const uint8_t* publicKey) {
+    if (member->info.keyed) {
+        return ST_GOOD;
+    }
+
+    const int res = media_crypto_derive(member->info.key, member->secret, publicKey);
+    memset(member->secret, 0, sizeof(member->secret));
+
+    if (res != ST_GOOD) {
+        warn("Failed to agree a key with conference member %hu", member->phone_number);
+        return res;
+    }
+
+    member->info.keyed = true;
+    return ST_GOOD;
+}
+
+int send_conference_join(server_t* server, const conference_t* conference, int slot, uint8_t requestId) {
+    const conference_member_t* member = &conference->members[slot];
+    client_info_t* client = find_client(server, member->phone_number);
+
+    if (client == NULL || client->connection == NULL) {
+        return ST_GOOD;
+    }
+
+    struct conference_join join;
+    join.udp_server_port = htons(conference->bridge->port);
+    join.media_token = member->info.token;
+    memcpy(join.public_key, member->public_key, MEDIA_PUBLIC_KEY_SIZE);
+    join.flags = CALL_FLAG_RELAYED_CLEAR;
+
+    return send_wrapped_message(client->connection->fd, CONFERENCE_JOIN, requestId, &join, sizeof(join));
+}
+
+/**
+ * Take `phoneNumber` out of its conference, if it is in one. With one member
+ * left there is nobody to talk to, so the conference ends.
+ */
+bool leave_conference(server_t* server, uint16_t phoneNumber) {
+    int slot;
+    conference_t* conference = find_conference(server, phoneNumber, &slot);
+
+    if (conference == NULL) {
+        return false;
+    }
+
+    info("%hu left the conference on port %hu", phoneNumber, conference->bridge->port);
+
+    memset(&conference->members[slot], 0, sizeof(conference->members[slot]));
+    set_conference_member(conference->bridge, slot, &conference->members[slot].info);
+
+    int remaining = 0;
+    int last = -1;
+
+    for (int i = 0; i < CONFERENCE_MAX_MEMBERS; i++) {
+        if (conference->members[i].info.token != 0) {
+            remaining++;
+            last = i;
+        }
+    }
+
+    if (remaining > 1) {
+        return true;
+    }
+
+    if (last >= 0) {
+        client_info_t* client = find_client(server, conference->members[last].phone_number);
+
+        if (client != NULL && client->connection != NULL) {
+            info("Terminating conference for phone number: %hu", client->phone_number);
+            send_terminate(server, client->connection, 0, CALL_PUTDOWN);
+        }
+    }
+
+    stop_conference_bridge(conference->bridge);
+    memset(conference, 0, sizeof(*conference));
+
+    return true;
+}
+
+conference_t* find_conference(server_t* server, uint16_t phoneNumber, int* slot) {
+    for (int i = 0; i < SERVER_MAX_CONFERENCES; i++) {
+        conference_t* conference = &server->conferences[i];
+
+        if (conference->bridge == NULL) {
+            continue;
+        }
+
+        for (int j = 0; j < CONFERENCE_MAX_MEMBERS; j++) {
+            if (conference->members[j].info.token != 0 && conference->members[j].phone_number == phoneNumber) {
+                *slot = j;
+                return conference;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Each conference slot has its own port, counting up from audio_port_min.
+ * 0 if the range has run out.
+ */
+static uint16_t allocate_conference_port(server_t* server, int index) {
+    const unsigned int port = server->conf->audio_port_min + index;
+    return server->conf->audio_port_min != 0 && port <= server->conf->audio_port_max ? (uint16_t)port : 0;
+}
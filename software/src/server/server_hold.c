@@ -0,0 +1,472 @@
+#include <arpa/inet.h>
+#include <string.h>
+#include "common.h"
+#include "server/server_internal.h"
+
+// How often an upgraded server tries to start its hold player, whose port
+// the old server's may not have let go of yet
+#define HOLD_RESTART_MS 100
+#define HOLD_RESTART_TRIES 20
+
+static int put_on_hold(server_t* server, connection_t* conn, uint8_t requestId, uint16_t holder);
+static int take_off_hold(server_t* server, uint16_t holder, const uint8_t* publicKey);
+static hold_t* add_hold(server_t* server, uint16_t holder, uint16_t held, int* slot);
+static int rotate_hold_key(server_t* server);
+static uint16_t allocate_hold_port(server_t* server);
+
+/**
+ * Put the other side of the sender's call on hold, or take it off. Only a
+ * call of two can be put on hold.
+ */
+int handle_call_hold(server_t* server, connection_t* conn, struct message_wrapper* msg) {
+    if (msg->length != sizeof(struct call_hold)) {
+        warn("Invalid message size for call hold");
+        return ST_FAIL;
+    }
+
+    struct call_hold* hold = (struct call_hold*)msg->data;
+    const uint16_t phoneNumber = ntohs(hold->phone_number);
+    client_info_t* client = find_client(server, phoneNumber);
+
+    if (client == NULL || client->connection != conn) {
+        warn("Call hold for %hu did not come from it", phoneNumber);
+        return ST_FAIL;
+    }
+
+    if (hold->hold) {
+        return put_on_hold(server, conn, msg->request, phoneNumber);
+    }
+
+    return take_off_hold(server, phoneNumber, hold->public_key);
+}
+
+/**
+ * The side on hold agreed a key with the server, pass the program's key on
+ * sealed under it. Taken off hold, its new key is passed on to the holder
+ * instead, and the hold is over once the holder has it.
+ */
+int handle_hold_joined(server_t* server, connection_t* conn, struct message_wrapper* msg) {
+    if (msg->length != sizeof(struct hold_joined)) {
+        warn("Invalid message size for hold joined");
+        return ST_FAIL;
+    }
+
+    struct hold_joined* joined = (struct hold_joined*)msg->data;
+    const uint16_t phoneNumber = ntohs(joined->phone_number);
+
+    int slot;
+    hold_t* hold = find_hold(server, phoneNumber, &slot);
+
+    if (hold == NULL || hold->held != phoneNumber) {
+        info("No hold for %hu to join", phoneNumber);
+        return ST_GOOD;
+    }
+
+    if (hold->resuming) {
+        if (hold->rejoined) {
+            return ST_GOOD;
+        }
+
+        memcpy(hold->held_key, joined->public_key, MEDIA_PUBLIC_KEY_SIZE);
+        hold->rejoined = true;
+
+        info("%hu is back on the call from hold", phoneNumber);
+
+        // Passed on once the holder is back otherwise
+        client_info_t* holder = find_client(server, hold->holder);
+
+        if (holder == NULL || holder->connection == NULL) {
+            return ST_GOOD;
+        }
+
+        const int res = send_hold_end(server, find_ongoing_call(server, phoneNumber), hold->holder, hold->held_key);
+        end_hold(server, slot);
+        return res;
+    }
+
+    if (!hold->keyed) {
+        uint8_t wrappingKey[MEDIA_KEY_SIZE];
+        const int res = media_crypto_derive(wrappingKey, hold->secret, joined->public_key);
+        memset(hold->secret, 0, sizeof(hold->secret));
+
+        if (res != ST_GOOD) {
+            warn("Failed to agree a key with %hu for its hold", phoneNumber);
+            end_call(server, phoneNumber);
+            return send_terminate(server, conn, 0, SERVER_ERROR);
+        }
+
+        media_crypto_wrap(hold->wrapped_key, server->hold_key, wrappingKey);
+        memset(wrappingKey, 0, sizeof(wrappingKey));
+        hold->keyed = true;
+
+        info("%hu is on hold on port %hu", phoneNumber, server->hold_player->port);
+    }
+
+    return send_hold_key(server, slot);
+}
+
+/**
+ * Load the hold program, the announcement then the music, and start the
+ * player with a key of its own.
+ */
+int start_hold(server_t* server) {
+    const server_conf_t* conf = server->conf;
+    const uint16_t port = allocate_hold_port(server);
+    const char* files[2];
+    int count = 0;
+
+    if (port == 0) {
+        warn("No port left for the hold player");
+        return ST_FAIL;
+    }
+
+    if (conf->hold_announcement[0] != '\0') {
+        files[count++] = conf->hold_announcement;
+    }
+
+    files[count++] = conf->hold_music;
+
+    if (load_prompt(&server->hold_prompt, files, count, conf->conference_wire_rate, conf->hold_codec) != ST_GOOD) {
+        server->hold_prompt = NULL;
+        return ST_FAIL;
+    }
+
+    server->hold_next_sender = MEDIA_SENDER_LISTENER;
+
+    if (media_crypto_random_key(server->hold_key) != ST_GOOD
+        || start_hold_player(&server->hold_player, port, server->hold_prompt, server->hold_key) != ST_GOOD) {
+        memset(server->hold_key, 0, sizeof(server->hold_key));
+        destroy_prompt(server->hold_prompt);
+        server->hold_prompt = NULL;
+        server->hold_player = NULL;
+        return ST_FAIL;
+    }
+
+    return ST_GOOD;
+}
+
+void stop_hold(server_t* server) {
+    if (server->hold_player == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < HOLD_MAX_LISTENERS; i++) {
+        memset(server->holds[i].secret, 0, sizeof(server->holds[i].secret));
+    }
+
+    stop_hold_player(server->hold_player);
+    destroy_prompt(server->hold_prompt);
+    memset(server->hold_key, 0, sizeof(server->hold_key));
+    server->hold_player = NULL;
+    server->hold_prompt = NULL;
+}
+
+/**
+ * Move the other side of `holder`'s call to the hold player, replying with
+ * the hold once it has been told, or a terminate call if it cannot be. The
+ * call's relay keeps running for both sides to come back to.
+ *
+ * A recorded call is not put on hold, its new key after would have to be
+ * sealed to the recorder again. Nor is a transcoded one, the relay's keys are
+ * agreed once for the call.
+ */
+static int put_on_hold(server_t* server, connection_t* conn, uint8_t requestId, uint16_t holder) {
+    call_info_t* call = find_ongoing_call(server, holder);
+
+    int slot;
+    hold_t* hold = find_hold(server, holder, &slot);
+
+    struct call_hold reply;
+    memset(&reply, 0, sizeof(reply));
+    reply.phone_number = htons(holder);
+    reply.hold = 1;
+
+    // Asked again, the reply was lost
+    if (hold != NULL && hold->holder == holder && !hold->resuming) {
+        return send_wrapped_message(conn->fd, CALL_HOLD, requestId, &reply, sizeof(reply));
+    }
+
+    if (server->hold_player == NULL || call == NULL || call->recorded || call->transcoded || hold != NULL) {
+        info("%hu cannot put its call on hold", holder);
+        return send_terminate(server, conn, requestId, SERVER_ERROR);
+    }
+
+    const uint16_t held = call->caller == holder ? call->callee : call->caller;
+    client_info_t* client = find_client(server, held);
+
+    if (client == NULL || client->connection == NULL) {
+        return send_terminate(server, conn, requestId, NUMBER_UNAVAILABLE);
+    }
+
+    if ((hold = add_hold(server, holder, held, &slot)) == NULL) {
+        return send_terminate(server, conn, requestId, SERVER_ERROR);
+    }
+
+    if (send_hold_start(server, slot) != ST_GOOD) {
+        end_hold(server, slot);
+        return send_terminate(server, conn, requestId, SERVER_ERROR);
+    }
+
+    info("%hu put %hu on hold", holder, held);
+    return send_wrapped_message(conn->fd, CALL_HOLD, requestId, &reply, sizeof(reply));
+}
+
+/**
+ * Send the held side back to the call's relay, to agree a new key with the
+ * holder's `publicKey`. Asked again, the holder having missed the held
+ * side's new key, it is sent on now.
+ */
+static int take_off_hold(server_t* server, uint16_t holder, const uint8_t* publicKey) {
+    const call_info_t* call = find_ongoing_call(server, holder);
+
+    int slot;
+    hold_t* hold = find_hold(server, holder, &slot);
+
+    if (call == NULL || hold == NULL || hold->holder != holder) {
+        info("%hu has no call on hold", holder);
+        return ST_GOOD;
+    }
+
+    if (hold->rejoined) {
+        const int res = send_hold_end(server, call, holder, hold->held_key);
+        end_hold(server, slot);
+        return res;
+    }
+
+    if (!hold->resuming) {
+        relay_binding_t unbound;
+        memset(&unbound, 0, sizeof(unbound));
+        set_hold_listener(server->hold_player, slot, &unbound);
+
+        memset(hold->secret, 0, sizeof(hold->secret));
+        memcpy(hold->holder_key, publicKey, MEDIA_PUBLIC_KEY_SIZE);
+        hold->resuming = true;
+
+        info("%hu took %hu off hold", holder, hold->held);
+    }
+
+    return send_hold_end(server, call, hold->held, hold->holder_key);
+}
+
+/**
+ * Take a free hold slot, with a token and sender for the held side at the
+ * player and a key pair to seal the program's key to it under. The held side
+ * is bound to the address its control connection comes from, its port is
+ * learned from its first report.
+ */
+static hold_t* add_hold(server_t* server, uint16_t holder, uint16_t held, int* slot) {
+    hold_player_t* player = server->hold_player;
+    int index = -1;
+    bool idle = true;
+
+    for (int i = 0; i < HOLD_MAX_LISTENERS; i++) {
+        if (server->holds[i].holder != 0) {
+            idle = false;
+        } else if (index < 0) {
+            index = i;
+        }
+    }
+
+    if (idle && server->hold_next_sender != MEDIA_SENDER_LISTENER && rotate_hold_key(server) != ST_GOOD) {
+        return NULL;
+    }
+
+    // Senders wrap to 0 once every one has been used under the key
+    if (index < 0 || server->hold_next_sender < MEDIA_SENDER_LISTENER) {
+        warn("No room on hold for %hu", held);
+        return NULL;
+    }
+
+    hold_t* hold = &server->holds[index];
+    memset(hold, 0, sizeof(*hold));
+
+    relay_binding_t binding;
+    memset(&binding, 0, sizeof(binding));
+
+    bool taken;
+
+    do {
+        if (generate_token((uint8_t*)&binding.token, sizeof(binding.token)) != ST_GOOD) {
+            return NULL;
+        }
+
+        taken = binding.token == 0;
+
+        for (int i = 0; i < HOLD_MAX_LISTENERS; i++) {
+            taken |= player->listeners[i].token == binding.token;
+        }
+    } while (taken);
+
+    if (x25519_keypair(hold->secret, hold->public_key) != ST_GOOD) {
+        memset(hold, 0, sizeof(*hold));
+        return NULL;
+    }
+
+    hold->holder = holder;
+    hold->held = held;
+    hold->sender = server->hold_next_sender++;
+
+    client_info_t* client = find_client(server, held);
+    binding.addr.sin_family = AF_INET;
+
+    if (client != NULL) {
+        binding.addr.sin_addr = client->address.sin_addr;
+    }
+
+    set_hold_listener(player, index, &binding);
+
+    *slot = index;
+    return hold;
+}
+
+/**
+ * Change the program's key, with nobody on hold to hear it go quiet. The
+ * senders can all be used again under the new one.
+ */
+static int rotate_hold_key(server_t* server) {
+    if (media_crypto_random_key(server->hold_key) != ST_GOOD) {
+        return ST_FAIL;
+    }
+
+    set_hold_key(server->hold_player, server->hold_key);
+    server->hold_next_sender = MEDIA_SENDER_LISTENER;
+    return ST_GOOD;
+}
+
+/**
+ * Bind the held side to the address it is back from, its port is learned
+ * again from its first report.
+ */
+void bind_hold_listener(server_t* server, int slot) {
+    client_info_t* client = find_client(server, server->holds[slot].held);
+    relay_binding_t binding = server->hold_player->listeners[slot];
+
+    if (client != NULL) {
+        binding.addr.sin_addr = client->address.sin_addr;
+    }
+
+    binding.addr.sin_port = 0;
+    set_hold_listener(server->hold_player, slot, &binding);
+}
+
+int send_hold_start(server_t* server, int slot) {
+    const hold_t* hold = &server->holds[slot];
+    client_info_t* client = find_client(server, hold->held);
+
+    if (client == NULL || client->connection == NULL) {
+        return ST_GOOD;
+    }
+
+    struct hold_start start;
+    start.udp_server_port = htons(server->hold_player->port);
+    start.media_token = server->hold_player->listeners[slot].token;
+    start.media_sender = hold->sender;
+    memcpy(start.public_key, hold->public_key, MEDIA_PUBLIC_KEY_SIZE);
+
+    return send_wrapped_message(client->connection->fd, HOLD_START, 0, &start, sizeof(start));
+}
+
+int send_hold_key(server_t* server, int slot) {
+    const hold_t* hold = &server->holds[slot];
+    client_info_t* client = find_client(server, hold->held);
+
+    if (client == NULL || client->connection == NULL) {
+        return ST_GOOD;
+    }
+
+    struct hold_key key;
+    memcpy(key.wrapped_key, hold->wrapped_key, MEDIA_WRAPPED_KEY_SIZE);
+
+    return send_wrapped_message(client->connection->fd, HOLD_KEY, 0, &key, sizeof(key));
+}
+
+/**
+ * Send `to` back to the call's relay with its own token and sender, to agree
+ * a new key with the other side's `publicKey`.
+ */
+int send_hold_end(server_t* server, const call_info_t* call, uint16_t to, const uint8_t* publicKey) {
+    client_info_t* client = find_client(server, to);
+
+    if (call == NULL || client == NULL || client->connection == NULL) {
+        return ST_GOOD;
+    }
+
+    const bool caller = call->caller == to;
+
+    struct hold_end end;
+    end.udp_server_port = htons(call->port);
+    end.media_token = caller ? call->caller_token : call->callee_token;
+    end.media_sender = caller ? MEDIA_SENDER_CALLER : MEDIA_SENDER_CALLEE;
+    memcpy(end.public_key, publicKey, MEDIA_PUBLIC_KEY_SIZE);
+
+    return send_wrapped_message(client->connection->fd, HOLD_END, 0, &end, sizeof(end));
+}
+
+/**
+ * End the hold `phoneNumber` is part of, if any, as its call ends.
+ */
+void release_hold(server_t* server, uint16_t phoneNumber) {
+    int slot;
+
+    if (find_hold(server, phoneNumber, &slot) != NULL) {
+        end_hold(server, slot);
+    }
+}
+
+void end_hold(server_t* server, int slot) {
+    relay_binding_t unbound;
+    memset(&unbound, 0, sizeof(unbound));
+    set_hold_listener(server->hold_player, slot, &unbound);
+
+    // The relay has not heard the held side while it was away
+    call_info_t* call = find_ongoing_call(server, server->holds[slot].holder);
+
+    if (call != NULL) {
+        call->relayed = event_loop_now();
+    }
+
+    memset(&server->holds[slot], 0, sizeof(server->holds[slot]));
+}
+
+/**
+ * The hold `phoneNumber` is either side of, with `slot` its slot.
+ */
+hold_t* find_hold(server_t* server, uint16_t phoneNumber, int* slot) {
+    for (int i = 0; i < HOLD_MAX_LISTENERS; i++) {
+        hold_t* hold = &server->holds[i];
+
+        if (hold->holder != 0 && (hold->holder == phoneNumber || hold->held == phoneNumber)) {
+            *slot = i;
+            return hold;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Start the hold player after an upgrade, trying again while the old one's
+ * port is still taken.
+ */
+int handle_hold_restart(struct timer_wheel* wheel, uint64_t arg, void* data) {
+    server_t* server = (server_t*)data;
+
+    if (start_hold(server) == ST_GOOD) {
+        return ST_GOOD;
+    }
+
+    if (arg + 1 >= HOLD_RESTART_TRIES || timer_wheel_add(wheel, HOLD_RESTART_MS, &handle_hold_restart, arg + 1, server) == TIMER_NONE) {
+        warn("Hold is off, its player could not be started");
+    }
+
+    return ST_GOOD;
+}
+
+/**
+ * The hold player has the port above the mailboxes'. 0 if the range has run
+ * out.
+ */
+static uint16_t allocate_hold_port(server_t* server) {
+    const unsigned int port = server->conf->audio_port_min + SERVER_MAX_CONFERENCES + SERVER_MAX_PAGES + SERVER_MAX_VOICEMAIL_CALLS;
+    return server->conf->audio_port_min != 0 && port <= server->conf->audio_port_max ? (uint16_t)port : 0;
+}
@@ -0,0 +1,125 @@
+#include <string.h>
+#include "common.h"
+#include "server/journal.h"
+#include "server/server_internal.h"
+
+/**
+ * Take back the nodes and calls the journal holds from before a restart.
+ * Nodes come back detached, to resume or expire as though their connections
+ * had just dropped. A call comes back with its relay started again and both
+ * sides bound, so its media carries on as soon as they send.
+ */
+void restore_journal(server_t* server) {
+    const journal_state_t* state = &server->journal.state;
+    const uint64_t nowNs = event_loop_now();
+
+    for (int i = state->client_count - 1; i >= 0; i--) {
+        const journal_client_t* saved = &state->clients[i];
+
+        // Nothing would ever expire a node taken back without its timer
+        if (server->client_count >= SERVER_MAX_CLIENTS || find_client(server, saved->phone_number) != NULL
+            || timer_wheel_add(&server->timers, SESSION_RESUME_TIMEOUT_MS, &handle_session_expiry, saved->phone_number, server) == TIMER_NONE) {
+            journal_drop_client(&server->journal, saved->phone_number);
+            continue;
+        }
+
+        client_info_t* client = &server->clients[server->client_count];
+        memset(client, 0, sizeof(*client));
+        client->phone_number = saved->phone_number;
+        memcpy(client->token, saved->token, SESSION_TOKEN_SIZE);
+        client->detachedNs = nowNs;
+        client->address.sin_family = AF_INET;
+        client->address.sin_addr.s_addr = saved->address;
+        client->addrLen = sizeof(client->address);
+        client->wire_rate = saved->wire_rate;
+        client->codecs = saved->codecs;
+
+        insert_session(server, server->client_count++);
+    }
+
+    for (int i = state->call_count - 1; i >= 0; i--) {
+        const journal_call_t* saved = &state->calls[i];
+
+        if (server->ongoing_count >= sizeof(server->ongoing_calls) / sizeof(*server->ongoing_calls)
+            || find_client(server, saved->caller) == NULL || find_client(server, saved->callee) == NULL
+            || find_ongoing_call(server, saved->caller) != NULL || find_ongoing_call(server, saved->callee) != NULL
+            || timer_wheel_add(&server->timers, MEDIA_TIMEOUT_MS, &handle_media_timeout, saved->caller_token, server) == TIMER_NONE
+            || start_udp_port(&server->udp_server, saved->port) != ST_GOOD) {
+            warn("Call from %hu to %hu could not be taken back", saved->caller, saved->callee);
+            journal_drop_call(&server->journal, saved->caller_token);
+            continue;
+        }
+
+        call_info_t* call = &server->ongoing_calls[server->ongoing_count++];
+        memset(call, 0, sizeof(*call));
+        call->time = nowNs;
+        call->relayed = nowNs;
+        call->port = saved->port;
+        call->caller = saved->caller;
+        call->callee = saved->callee;
+        call->ringing = true;
+        call->caller_token = saved->caller_token;
+        call->callee_token = saved->callee_token;
+        call->caller_media_port = saved->caller_media_port;
+        call->callee_media_port = saved->callee_media_port;
+        call->caller_media_address = saved->caller_media_address;
+        call->callee_media_address = saved->callee_media_address;
+        memcpy(call->caller_key, saved->caller_key, MEDIA_PUBLIC_KEY_SIZE);
+        memcpy(call->callee_key, saved->callee_key, MEDIA_PUBLIC_KEY_SIZE);
+
+        bind_call_media(server, call, MEDIA_SENDER_CALLER);
+        bind_call_media(server, call, MEDIA_SENDER_CALLEE);
+    }
+
+    info("Took back %d nodes and %d calls from the journal", server->client_count, server->ongoing_count);
+}
+
+int handle_journal_compact(struct timer_wheel* wheel, uint64_t arg, void* data) {
+    server_t* server = (server_t*)data;
+
+    compact_journal(&server->journal);
+
+    if (timer_wheel_add(wheel, (uint64_t)server->conf->journal_compact_s * 1000, &handle_journal_compact, 0, server) == TIMER_NONE) {
+        warn("Journal will not be compacted again");
+    }
+
+    return ST_GOOD;
+}
+
+void journal_save_client(server_t* server, const client_info_t* client) {
+    journal_client_t saved;
+    memset(&saved, 0, sizeof(saved));
+    saved.phone_number = client->phone_number;
+    memcpy(saved.token, client->token, SESSION_TOKEN_SIZE);
+    saved.address = client->address.sin_addr.s_addr;
+    saved.wire_rate = client->wire_rate;
+    saved.codecs = client->codecs;
+
+    journal_put_client(&server->journal, &saved);
+}
+
+/**
+ * Journal an answered call. The relay of a transcoded or recorded call holds
+ * keys the journal does not keep, so those end with the server.
+ */
+void journal_save_call(server_t* server, const call_info_t* call) {
+    if (call->transcoded || call->recorded) {
+        return;
+    }
+
+    journal_call_t saved;
+    memset(&saved, 0, sizeof(saved));
+    saved.caller = call->caller;
+    saved.callee = call->callee;
+    saved.port = call->port;
+    saved.caller_token = call->caller_token;
+    saved.callee_token = call->callee_token;
+    saved.caller_media_port = call->caller_media_port;
+    saved.callee_media_port = call->callee_media_port;
+    saved.caller_media_address = call->caller_media_address;
+    saved.callee_media_address = call->callee_media_address;
+    memcpy(saved.caller_key, call->caller_key, MEDIA_PUBLIC_KEY_SIZE);
+    memcpy(saved.callee_key, call->callee_key, MEDIA_PUBLIC_KEY_SIZE);
+
+    journal_put_call(&server->journal, &saved);
+}
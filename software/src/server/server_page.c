@@ -0,0 +1,376 @@
+#include <arpa/inet.h>
+#include <string.h>
+#include "common.h"
+#include "server/server_internal.h"
+
+static void add_page_listener(server_t* server, page_t* page, uint16_t phoneNumber);
+static int generate_page_token(const page_t* page, uint32_t* token);
+static void end_page(server_t* server, page_t* page);
+static uint16_t allocate_page_port(server_t* server, int index);
+
+/**
+ * A paged node answered by itself, pass its key on to the pager to seal the
+ * page's key to, and bind its media at the relay.
+ */
+int handle_page_listen(server_t* server, connection_t* conn, struct message_wrapper* msg) {
+    if (msg->length != sizeof(struct page_listen)) {
+        warn("Invalid message size for page listen");
+        return ST_FAIL;
+    }
+
+    struct page_listen* listen = (struct page_listen*)msg->data;
+    const uint16_t phoneNumber = ntohs(listen->phone_number);
+
+    int slot;
+    page_t* page = find_page(server, phoneNumber, &slot);
+
+    if (page == NULL || slot < 0) {
+        info("No page for %hu to listen to", phoneNumber);
+        return send_terminate(server, conn, 0, CALL_PUTDOWN);
+    }
+
+    page_listener_t* listener = &page->listeners[slot];
+    listener->listening = true;
+    listener->media_port = ntohs(listen->media.port);
+    memcpy(listener->public_key, listen->public_key, MEDIA_PUBLIC_KEY_SIZE);
+
+    bind_page_listener(server, page, slot);
+
+    info("%hu is listening to the page on port %hu", phoneNumber, page->relay->port);
+    return send_page_listen(server, page, slot);
+}
+
+/**
+ * The pager sealed the page's key to a listener, pass it on. Only the pager
+ * can key its listeners.
+ */
+int handle_page_key(server_t* server, connection_t* conn, struct message_wrapper* msg) {
+    if (msg->length != sizeof(struct page_key)) {
+        warn("Invalid message size for page key");
+        return ST_FAIL;
+    }
+
+    struct page_key* key = (struct page_key*)msg->data;
+    const uint16_t phoneNumber = ntohs(key->phone_number);
+
+    int slot;
+    page_t* page = find_page(server, phoneNumber, &slot);
+
+    if (page == NULL || slot < 0) {
+        info("No page listener %hu to pass a key to", phoneNumber);
+        return ST_GOOD;
+    }
+
+    client_info_t* pager = find_client(server, page->pager);
+
+    if (pager == NULL || pager->connection != conn) {
+        warn("Page key for %hu did not come from the pager", phoneNumber);
+        return ST_FAIL;
+    }
+
+    client_info_t* client = find_client(server, phoneNumber);
+
+    // Asked for again once the listener is back
+    if (client == NULL || client->connection == NULL) {
+        return ST_GOOD;
+    }
+
+    if (send_wrapped_message(client->connection->fd, PAGE_KEY, 0, key, sizeof(*key)) != ST_GOOD) {
+        return ST_FAIL;
+    }
+
+    page->listeners[slot].keyed = true;
+    return ST_GOOD;
+}
+
+/**
+ * Page every free node in `group` for the pager, replying with a page
+ * response once the relay is up, or a terminate call if nobody can be paged.
+ */
+int start_page(server_t* server, connection_t* conn, uint8_t requestId, const struct call_request* request, const page_group_conf_t* group) {
+    const uint16_t pagerNumber = ntohs(request->from_phone_number);
+    int index = -1;
+
+    for (int i = 0; i < SERVER_MAX_PAGES; i++) {
+        if (server->pages[i].relay == NULL) {
+            index = i;
+            break;
+        }
+    }
+
+    const uint16_t port = index < 0 ? 0 : allocate_page_port(server, index);
+
+    if (port == 0 || in_call(server, pagerNumber)) {
+        warn("%hu cannot page %hu", pagerNumber, group->number);
+        return send_terminate(server, conn, requestId, SERVER_ERROR);
+    }
+
+    page_t* page = &server->pages[index];
+    memset(page, 0, sizeof(*page));
+
+    if (start_page_relay(&page->relay, port) != ST_GOOD) {
+        page->relay = NULL;
+        return send_terminate(server, conn, requestId, SERVER_ERROR);
+    }
+
+    page->pager = pagerNumber;
+    memcpy(page->pager_key, request->public_key, MEDIA_PUBLIC_KEY_SIZE);
+
+    if (group->member_count == 0) {
+        for (int i = 0; i < server->client_count; i++) {
+            add_page_listener(server, page, server->clients[i].phone_number);
+        }
+    } else {
+        for (int i = 0; i < group->member_count; i++) {
+            add_page_listener(server, page, group->members[i]);
+        }
+    }
+
+    int listeners = 0;
+
+    for (int i = 0; i < PAGE_MAX_LISTENERS; i++) {
+        listeners += page->listeners[i].phone_number != 0;
+    }
+
+    relay_binding_t pager;
+    memset(&pager, 0, sizeof(pager));
+
+    if (listeners == 0 || generate_page_token(page, &pager.token) != ST_GOOD) {
+        info("Nobody in page group %hu can be paged", group->number);
+        end_page(server, page);
+        return send_terminate(server, conn, requestId, NUMBER_UNAVAILABLE);
+    }
+
+    client_info_t* pagerClient = find_client(server, pagerNumber);
+    pager.addr.sin_family = AF_INET;
+    pager.addr.sin_addr = pagerClient->address.sin_addr;
+    pager.addr.sin_port = request->media.port;
+    set_page_pager(page->relay, &pager);
+
+    struct page_response response;
+    response.udp_server_port = htons(port);
+    response.media_token = pager.token;
+
+    if (send_wrapped_message(conn->fd, PAGE_RESPONSE, requestId, &response, sizeof(response)) != ST_GOOD) {
+        end_page(server, page);
+        return ST_FAIL;
+    }
+
+    info("%hu is paging %d in group %hu on port %hu", pagerNumber, listeners, group->number, port);
+
+    for (int i = 0; i < PAGE_MAX_LISTENERS; i++) {
+        if (page->listeners[i].phone_number != 0 && send_incoming_page(server, page, i) != ST_GOOD) {
+            leave_page(server, page->listeners[i].phone_number);
+        }
+    }
+
+    return ST_GOOD;
+}
+
+/**
+ * Give `phoneNumber` a slot in the page if it is online and free, with a
+ * token of its own, bound to the address its control connection comes from.
+ */
+static void add_page_listener(server_t* server, page_t* page, uint16_t phoneNumber) {
+    client_info_t* client = find_client(server, phoneNumber);
+
+    if (client == NULL || client->connection == NULL || phoneNumber == page->pager || in_call(server, phoneNumber)) {
+        return;
+    }
+
+    for (int i = 0; i < PAGE_MAX_LISTENERS; i++) {
+        if (page->listeners[i].phone_number != 0) {
+            continue;
+        }
+
+        if (generate_page_token(page, &page->relay->listeners[i].token) != ST_GOOD) {
+            return;
+        }
+
+        page->listeners[i].phone_number = phoneNumber;
+        bind_page_listener(server, page, i);
+        return;
+    }
+
+    warn("Page on port %hu is full, not paging %hu", page->relay->port, phoneNumber);
+}
+
+/**
+ * Bind a listener's token to its address and signalled media port, a port of
+ * 0 is learned from its first report.
+ */
+void bind_page_listener(server_t* server, page_t* page, int slot) {
+    const page_listener_t* listener = &page->listeners[slot];
+    client_info_t* client = find_client(server, listener->phone_number);
+
+    relay_binding_t binding;
+    memset(&binding, 0, sizeof(binding));
+    binding.token = page->relay->listeners[slot].token;
+    binding.addr.sin_family = AF_INET;
+    binding.addr.sin_port = htons(listener->media_port);
+
+    if (client != NULL) {
+        binding.addr.sin_addr = client->address.sin_addr;
+    }
+
+    set_page_listener(page->relay, slot, &binding);
+}
+
+/**
+ * A token not 0 and not yet used in the page.
+ */
+static int generate_page_token(const page_t* page, uint32_t* token) {
+    bool taken;
+
+    do {
+        if (generate_token((uint8_t*)token, sizeof(*token)) != ST_GOOD) {
+            return ST_FAIL;
+        }
+
+        taken = *token == 0 || *token == page->relay->pager.token;
+
+        for (int i = 0; i < PAGE_MAX_LISTENERS; i++) {
+            taken |= page->listeners[i].phone_number != 0 && page->relay->listeners[i].token == *token;
+        }
+    } while (taken);
+
+    return ST_GOOD;
+}
+
+int send_incoming_page(server_t* server, const page_t* page, int slot) {
+    client_info_t* client = find_client(server, page->listeners[slot].phone_number);
+
+    if (client == NULL || client->connection == NULL) {
+        return ST_GOOD;
+    }
+
+    struct incoming_page incoming;
+    incoming.from_phone_number = htons(page->pager);
+    incoming.udp_server_port = htons(page->relay->port);
+    memcpy(incoming.public_key, page->pager_key, MEDIA_PUBLIC_KEY_SIZE);
+    incoming.media_token = page->relay->listeners[slot].token;
+    incoming.media_sender = (uint8_t)(MEDIA_SENDER_LISTENER + slot);
+
+    return send_wrapped_message(client->connection->fd, INCOMING_PAGE, 0, &incoming, sizeof(incoming));
+}
+
+int send_page_listen(server_t* server, const page_t* page, int slot) {
+    client_info_t* pager = find_client(server, page->pager);
+
+    if (pager == NULL || pager->connection == NULL) {
+        return ST_GOOD;
+    }
+
+    // The pager only needs the key, the relay takes the media
+    struct page_listen listen;
+    memset(&listen, 0, sizeof(listen));
+    listen.phone_number = htons(page->listeners[slot].phone_number);
+    memcpy(listen.public_key, page->listeners[slot].public_key, MEDIA_PUBLIC_KEY_SIZE);
+
+    return send_wrapped_message(pager->connection->fd, PAGE_LISTEN, 0, &listen, sizeof(listen));
+}
+
+/**
+ * Take `phoneNumber` out of its page, if it is in one. The page ends with the
+ * pager, or once nobody is left listening.
+ */
+bool leave_page(server_t* server, uint16_t phoneNumber) {
+    int slot;
+    page_t* page = find_page(server, phoneNumber, &slot);
+
+    if (page == NULL) {
+        return false;
+    }
+
+    if (slot < 0) {
+        info("%hu stopped paging on port %hu", phoneNumber, page->relay->port);
+        end_page(server, page);
+        return true;
+    }
+
+    info("%hu stopped listening to the page on port %hu", phoneNumber, page->relay->port);
+
+    relay_binding_t unbound;
+    memset(&unbound, 0, sizeof(unbound));
+    memset(&page->listeners[slot], 0, sizeof(page->listeners[slot]));
+    set_page_listener(page->relay, slot, &unbound);
+
+    for (int i = 0; i < PAGE_MAX_LISTENERS; i++) {
+        if (page->listeners[i].phone_number != 0) {
+            return true;
+        }
+    }
+
+    client_info_t* pager = find_client(server, page->pager);
+
+    if (pager != NULL && pager->connection != NULL) {
+        info("Terminating page for phone number: %hu", page->pager);
+        send_terminate(server, pager->connection, 0, CALL_PUTDOWN);
+    }
+
+    end_page(server, page);
+    return true;
+}
+
+/**
+ * Stop the page's relay and tell any listeners left.
+ */
+static void end_page(server_t* server, page_t* page) {
+    for (int i = 0; i < PAGE_MAX_LISTENERS; i++) {
+        client_info_t* client = page->listeners[i].phone_number != 0 ? find_client(server, page->listeners[i].phone_number) : NULL;
+
+        if (client != NULL && client->connection != NULL) {
+            send_terminate(server, client->connection, 0, CALL_PUTDOWN);
+        }
+    }
+
+    stop_page_relay(page->relay);
+    memset(page, 0, sizeof(*page));
+}
+
+/**
+ * The page `phoneNumber` is in, with `slot` its listener slot, or -1 for the
+ * pager.
+ */
+page_t* find_page(server_t* server, uint16_t phoneNumber, int* slot) {
+    for (int i = 0; i < SERVER_MAX_PAGES; i++) {
+        page_t* page = &server->pages[i];
+
+        if (page->relay == NULL) {
+            continue;
+        }
+
+        if (page->pager == phoneNumber) {
+            *slot = -1;
+            return page;
+        }
+
+        for (int j = 0; j < PAGE_MAX_LISTENERS; j++) {
+            if (page->listeners[j].phone_number == phoneNumber) {
+                *slot = j;
+                return page;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+const page_group_conf_t* find_page_group(server_t* server, uint16_t number) {
+    for (int i = 0; i < server->conf->page_group_count; i++) {
+        if (server->conf->page_groups[i].number == number) {
+            return &server->conf->page_groups[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Pages have their own ports, above the conferences'. 0 if the range has run
+ * out.
+ */
+static uint16_t allocate_page_port(server_t* server, int index) {
+    const unsigned int port = server->conf->audio_port_min + SERVER_MAX_CONFERENCES + index;
+    return server->conf->audio_port_min != 0 && port <= server->conf->audio_port_max ? (uint16_t)port : 0;
+}
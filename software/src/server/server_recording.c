@@ -0,0 +1,126 @@
+#include <arpa/inet.h>
+#include <string.h>
+#include <time.h>
+#include "common.h"
+#include "server/server_internal.h"
+
+/**
+ * The caller of a recorded call sealed its media key to the recorder. Open
+ * it and have the relay record the call, the recorder's secret is no use
+ * after.
+ */
+int handle_record_key(server_t* server, connection_t* conn, struct message_wrapper* msg) {
+    if (msg->length != sizeof(struct record_key)) {
+        warn("Invalid message size for record key");
+        return ST_FAIL;
+    }
+
+    struct record_key* recordKey = (struct record_key*)msg->data;
+    call_info_t* call = find_recorded_call(server, ntohs(recordKey->phone_number));
+
+    if (call == NULL) {
+        info("No call waiting to be recorded for %hu", ntohs(recordKey->phone_number));
+        return ST_GOOD;
+    }
+
+    recording_info_t recording;
+    memset(&recording, 0, sizeof(recording));
+
+    uint8_t wrappingKey[MEDIA_KEY_SIZE];
+    int res = media_crypto_derive(wrappingKey, call->recorder_secret, recordKey->public_key);
+
+    if (res == ST_GOOD) {
+        res = media_crypto_unwrap(recording.key, recordKey->wrapped_key, wrappingKey);
+    }
+
+    memset(wrappingKey, 0, sizeof(wrappingKey));
+
+    if (res != ST_GOOD) {
+        warn("Recording key from %hu did not unwrap", call->caller);
+        return ST_GOOD;
+    }
+
+    memset(call->recorder_secret, 0, sizeof(call->recorder_secret));
+    call->recording = true;
+
+    recording.keyed = true;
+    recording.adpcm = server->conf->recording_adpcm;
+    recording.wireRate = ntohl(recordKey->wire_sample_rate);
+    snprintf(recording.path, sizeof(recording.path), "%s/%llu-%hu-%hu", server->conf->recording_directory,
+        (unsigned long long)time(NULL), call->caller, call->callee);
+
+    res = record_udp_port(&server->udp_server, call->port, &recording);
+    memset(&recording, 0, sizeof(recording));
+
+    info("Recording the call from %hu to %hu on udp port %hu", call->caller, call->callee, call->port);
+    return res;
+}
+
+/**
+ * Whether a call is recorded, at the caller's asking or because either side
+ * is a number that always is.
+ */
+bool should_record(server_t* server, const struct call_request* request) {
+    const server_conf_t* conf = server->conf;
+
+    if (conf->recording_directory[0] == '\0') {
+        if (request->flags & CALL_FLAG_RECORD) {
+            warn("Cannot record a call, there is no recording directory");
+        }
+        return false;
+    }
+
+    if (request->flags & CALL_FLAG_RECORD) {
+        return true;
+    }
+
+    for (int i = 0; i < conf->recording_number_count; i++) {
+        if (conf->recording_numbers[i] == ntohs(request->from_phone_number) || conf->recording_numbers[i] == ntohs(request->to_phone_number)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Tell one side its call is recorded, the caller with the recorder's key to
+ * seal the media key to.
+ */
+int send_record_call(server_t* server, const call_info_t* call, uint8_t sender) {
+    client_info_t* client = find_client(server, sender == MEDIA_SENDER_CALLER ? call->caller : call->callee);
+
+    if (client == NULL || client->connection == NULL) {
+        return ST_GOOD;
+    }
+
+    struct record_call record;
+    memcpy(record.public_key, call->recorder_key, MEDIA_PUBLIC_KEY_SIZE);
+    record.seal = sender == MEDIA_SENDER_CALLER;
+
+    return send_wrapped_message(client->connection->fd, RECORD_CALL, 0, &record, sizeof(record));
+}
+
+/**
+ * The pending or ongoing call `caller` made that is to be recorded and whose
+ * key has not arrived yet.
+ */
+call_info_t* find_recorded_call(server_t* server, uint16_t caller) {
+    for (int i = 0; i < server->ongoing_count; i++) {
+        call_info_t* call = &server->ongoing_calls[i];
+
+        if (call->caller == caller && call->recorded && !call->recording) {
+            return call;
+        }
+    }
+
+    for (int i = 0; i < server->pending_count; i++) {
+        call_info_t* call = &server->pending_calls[i];
+
+        if (call->caller == caller && call->recorded && !call->recording) {
+            return call;
+        }
+    }
+
+    return NULL;
+}
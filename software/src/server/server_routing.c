@@ -0,0 +1,83 @@
+#include <string.h>
+#include "common.h"
+#include "server/server_internal.h"
+
+/**
+ * Build a router from the page groups, the voicemail number and then
+ * `routing`, so a configured route never takes a number they already have.
+ * Routes to a page group or voicemail that is not there are left out.
+ */
+int build_server_router(server_t* server, const routes_conf_t* routing, router_t** router) {
+    const server_conf_t* conf = server->conf;
+    route_conf_t routes[ROUTER_MAX_ROUTES];
+    int count = 0;
+
+    memset(routes, 0, sizeof(routes));
+
+    for (int i = 0; i < conf->page_group_count; i++) {
+        routes[count].low = conf->page_groups[i].number;
+        routes[count].high = conf->page_groups[i].number;
+        routes[count].type = ROUTE_PAGE;
+        routes[count++].target = conf->page_groups[i].number;
+    }
+
+    if (server->voicemail.fd != -1 && conf->voicemail_number != 0) {
+        routes[count].low = conf->voicemail_number;
+        routes[count].high = conf->voicemail_number;
+        routes[count++].type = ROUTE_VOICEMAIL;
+    }
+
+    for (int i = 0; i < routing->route_count; i++) {
+        const route_conf_t* route = &routing->routes[i];
+
+        if ((route->type == ROUTE_PAGE && find_page_group(server, route->target) == NULL)
+            || (route->type == ROUTE_VOICEMAIL && server->voicemail.fd == -1)) {
+            warn("Route %d is left out, it goes to a page group or voicemail that is not there", i);
+            continue;
+        }
+
+        routes[count++] = *route;
+    }
+
+    return build_router(router, routes, count);
+}
+
+/**
+ * Read the routes again and swap in a router built from them. Calls already
+ * routed are left as they are, and the old plan is kept if the new one
+ * cannot be read or built.
+ */
+void reload_routes(server_t* server) {
+    routes_conf_t routing;
+    router_t* router;
+
+    if (read_server_routes(server->conf->config_file, &routing) != ST_GOOD
+        || build_server_router(server, &routing, &router) != ST_GOOD) {
+        warn("Keeping the dial plan, the routes in %s could not be read", server->conf->config_file);
+        return;
+    }
+
+    router_t* old = server->router;
+    server->router = router;
+    server->conf->routing = routing;
+    free_router(old);
+
+    info("Dial plan replaced");
+    broadcast_dial_plan(server);
+}
+
+/**
+ * The first member of a hunt group online and free to answer, 0 if none.
+ */
+uint16_t hunt_member(server_t* server, const route_conf_t* route, uint16_t caller) {
+    for (int i = 0; i < route->member_count; i++) {
+        const uint16_t member = route->members[i];
+        const client_info_t* client = find_client(server, member);
+
+        if (member != caller && client != NULL && client->connection != NULL && !in_call(server, member)) {
+            return member;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,315 @@
+#include <arpa/inet.h>
+#include <string.h>
+#include "common.h"
+#include "server/server_internal.h"
+
+// How often mailboxes are checked for being done
+#define VOICEMAIL_SWEEP_MS 1000
+
+static voicemail_call_t* add_voicemail_call(server_t* server, uint16_t phoneNumber, uint16_t* port);
+static void end_voicemail(server_t* server, voicemail_call_t* voicemail);
+static void arm_voicemail_sweep(server_t* server);
+static uint16_t allocate_voicemail_port(server_t* server, int index);
+
+/**
+ * A caller moved to a mailbox, agree the mailbox's key with it so the mailbox
+ * can open its message.
+ */
+int handle_voicemail_joined(server_t* server, connection_t* conn, struct message_wrapper* msg) {
+    if (msg->length != sizeof(struct voicemail_joined)) {
+        warn("Invalid message size for voicemail joined");
+        return ST_FAIL;
+    }
+
+    struct voicemail_joined* joined = (struct voicemail_joined*)msg->data;
+    const uint16_t phoneNumber = ntohs(joined->phone_number);
+    voicemail_call_t* voicemail = find_voicemail_call(server, phoneNumber);
+
+    if (voicemail == NULL || voicemail->mailbox->playing || voicemail->peer.keyed) {
+        info("No mailbox for %hu to join", phoneNumber);
+        return ST_GOOD;
+    }
+
+    const int res = ntohl(joined->wire_sample_rate) == 0 ? ST_INVALID_ARG : media_crypto_derive(voicemail->peer.key, voicemail->secret, joined->public_key);
+    memset(voicemail->secret, 0, sizeof(voicemail->secret));
+
+    if (res != ST_GOOD) {
+        warn("Failed to agree a key with %hu for its message", phoneNumber);
+        end_call(server, phoneNumber);
+        return send_terminate(server, conn, 0, SERVER_ERROR);
+    }
+
+    voicemail->peer.keyed = true;
+    voicemail->peer.wireRate = ntohl(joined->wire_sample_rate);
+    set_mailbox_peer(voicemail->mailbox, &voicemail->peer);
+
+    info("%hu moved to the mailbox on port %hu", phoneNumber, voicemail->mailbox->port);
+    return ST_GOOD;
+}
+
+/**
+ * Send the caller of a call that was turned down or left ringing to the
+ * callee's mailbox. The call's relay is stopped, the caller moves its media
+ * to the mailbox once told with a voicemail divert.
+ */
+int divert_to_voicemail(server_t* server, call_info_t* call) {
+    client_info_t* caller = find_client(server, call->caller);
+
+    if (caller == NULL || caller->connection == NULL) {
+        return ST_FAIL;
+    }
+
+    uint16_t port;
+    voicemail_call_t* voicemail = add_voicemail_call(server, call->caller, &port);
+
+    if (voicemail == NULL) {
+        return ST_FAIL;
+    }
+
+    const uint32_t maxMs = (uint32_t)server->conf->voicemail_max_s * 1000;
+
+    if (start_mailbox_recording(&voicemail->mailbox, port, call->callee, call->caller, maxMs) != ST_GOOD) {
+        memset(voicemail, 0, sizeof(*voicemail));
+        return ST_FAIL;
+    }
+
+    // Keyed once the caller replies with its key
+    voicemail->peer.addr.sin_family = AF_INET;
+    voicemail->peer.addr.sin_addr = caller->address.sin_addr;
+    voicemail->peer.addr.sin_port = htons(call->caller_media_port);
+    set_mailbox_peer(voicemail->mailbox, &voicemail->peer);
+
+    info("%hu is leaving a message for %hu on port %hu", call->caller, call->callee, port);
+
+    stop_udp_port(&server->udp_server, call->port);
+    memset(call->recorder_secret, 0, sizeof(call->recorder_secret));
+
+    if (call - server->pending_calls < server->pending_count - 1) {
+        memcpy(call, &server->pending_calls[server->pending_count - 1], sizeof(call_info_t));
+    }
+
+    server->pending_count--;
+
+    arm_voicemail_sweep(server);
+    send_voicemail_divert(server, voicemail);
+    return ST_GOOD;
+}
+
+/**
+ * Answer a call to the voicemail number with a mailbox playing the caller its
+ * messages, or turn it down if there are none. The key is agreed straight
+ * away, the mailbox's public key goes back in the call answered.
+ */
+int play_voicemail(server_t* server, connection_t* conn, uint8_t requestId, const struct call_request* request) {
+    const uint16_t phoneNumber = ntohs(request->from_phone_number);
+    voicemail_entry_t entries[VOICEMAIL_MAX_MESSAGES];
+
+    if (in_call(server, phoneNumber)) {
+        return send_terminate(server, conn, requestId, SERVER_ERROR);
+    }
+
+    const int count = voicemail_list(&server->voicemail, phoneNumber, entries);
+
+    if (count == 0) {
+        info("No messages for %hu", phoneNumber);
+        return send_terminate(server, conn, requestId, NUMBER_UNAVAILABLE);
+    }
+
+    uint16_t port;
+    voicemail_call_t* voicemail = add_voicemail_call(server, phoneNumber, &port);
+
+    if (voicemail == NULL) {
+        return send_terminate(server, conn, requestId, SERVER_ERROR);
+    }
+
+    if (start_mailbox_playback(&voicemail->mailbox, port, &server->voicemail, entries, count) != ST_GOOD) {
+        memset(voicemail, 0, sizeof(*voicemail));
+        return send_terminate(server, conn, requestId, SERVER_ERROR);
+    }
+
+    const int res = media_crypto_derive(voicemail->peer.key, voicemail->secret, request->public_key);
+    memset(voicemail->secret, 0, sizeof(voicemail->secret));
+
+    if (res != ST_GOOD) {
+        warn("Failed to agree a key with %hu for its messages", phoneNumber);
+        end_voicemail(server, voicemail);
+        return send_terminate(server, conn, requestId, SERVER_ERROR);
+    }
+
+    client_info_t* client = find_client(server, phoneNumber);
+    voicemail->peer.keyed = true;
+    voicemail->peer.addr.sin_family = AF_INET;
+    voicemail->peer.addr.sin_addr = client->address.sin_addr;
+    voicemail->peer.addr.sin_port = request->media.port;
+    set_mailbox_peer(voicemail->mailbox, &voicemail->peer);
+
+    struct call_response response;
+    response.udp_server_port = htons(port);
+    response.media_token = voicemail->peer.token;
+
+    if (send_wrapped_message(conn->fd, CALL_RESPONSE, requestId, &response, sizeof(response)) != ST_GOOD) {
+        end_voicemail(server, voicemail);
+        return ST_FAIL;
+    }
+
+    arm_voicemail_sweep(server);
+    return send_voicemail_answer(server, voicemail);
+}
+
+/**
+ * Take a free voicemail slot for `phoneNumber`, with the port it runs on, a
+ * key pair for the mailbox and a token for the node. The mailbox is left to
+ * the caller to start, a slot without one is free again.
+ */
+static voicemail_call_t* add_voicemail_call(server_t* server, uint16_t phoneNumber, uint16_t* port) {
+    int index = -1;
+
+    for (int i = 0; i < SERVER_MAX_VOICEMAIL_CALLS; i++) {
+        if (server->voicemail_calls[i].mailbox == NULL) {
+            index = i;
+            break;
+        }
+    }
+
+    *port = index < 0 ? 0 : allocate_voicemail_port(server, index);
+
+    if (*port == 0) {
+        warn("No mailbox free for %hu", phoneNumber);
+        return NULL;
+    }
+
+    voicemail_call_t* voicemail = &server->voicemail_calls[index];
+    memset(voicemail, 0, sizeof(*voicemail));
+    voicemail->phone_number = phoneNumber;
+    voicemail->startedNs = event_loop_now();
+
+    if (x25519_keypair(voicemail->secret, voicemail->public_key) != ST_GOOD) {
+        return NULL;
+    }
+
+    do {
+        if (generate_token((uint8_t*)&voicemail->peer.token, sizeof(voicemail->peer.token)) != ST_GOOD) {
+            memset(voicemail, 0, sizeof(*voicemail));
+            return NULL;
+        }
+    } while (voicemail->peer.token == 0);
+
+    return voicemail;
+}
+
+int send_voicemail_divert(server_t* server, const voicemail_call_t* voicemail) {
+    client_info_t* client = find_client(server, voicemail->phone_number);
+
+    if (client == NULL || client->connection == NULL) {
+        return ST_GOOD;
+    }
+
+    struct voicemail_divert divert;
+    divert.udp_server_port = htons(voicemail->mailbox->port);
+    divert.media_token = voicemail->peer.token;
+    memcpy(divert.public_key, voicemail->public_key, MEDIA_PUBLIC_KEY_SIZE);
+    divert.flags = CALL_FLAG_RELAYED_CLEAR;
+
+    return send_wrapped_message(client->connection->fd, VOICEMAIL_DIVERT, 0, &divert, sizeof(divert));
+}
+
+int send_voicemail_answer(server_t* server, const voicemail_call_t* voicemail) {
+    client_info_t* client = find_client(server, voicemail->phone_number);
+
+    if (client == NULL || client->connection == NULL) {
+        return ST_GOOD;
+    }
+
+    // Nothing to offer for a direct path, the mailbox is the server
+    struct call_answered answered;
+    memset(&answered, 0, sizeof(answered));
+    memcpy(answered.public_key, voicemail->public_key, MEDIA_PUBLIC_KEY_SIZE);
+    answered.flags = CALL_FLAG_RELAYED_CLEAR;
+
+    return send_wrapped_message(client->connection->fd, CALL_ANSWERED, 0, &answered, sizeof(answered));
+}
+
+/**
+ * Hang `phoneNumber` up from its mailbox, if it is on the line to one,
+ * storing a message it was leaving.
+ */
+bool leave_voicemail(server_t* server, uint16_t phoneNumber) {
+    voicemail_call_t* voicemail = find_voicemail_call(server, phoneNumber);
+
+    if (voicemail == NULL) {
+        return false;
+    }
+
+    info("%hu hung up from the mailbox on port %hu", phoneNumber, voicemail->mailbox->port);
+    end_voicemail(server, voicemail);
+    return true;
+}
+
+static void end_voicemail(server_t* server, voicemail_call_t* voicemail) {
+    stop_mailbox(voicemail->mailbox, &server->voicemail);
+    memset(voicemail, 0, sizeof(*voicemail));
+}
+
+voicemail_call_t* find_voicemail_call(server_t* server, uint16_t phoneNumber) {
+    for (int i = 0; i < SERVER_MAX_VOICEMAIL_CALLS; i++) {
+        if (server->voicemail_calls[i].mailbox != NULL && server->voicemail_calls[i].phone_number == phoneNumber) {
+            return &server->voicemail_calls[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Hang up mailboxes that are done. A node that never moved to its mailbox is
+ * hung up once a message could have been left.
+ */
+int handle_voicemail_sweep(struct event_loop* loop, int fd, uint32_t events, void* data) {
+    server_t* server = (server_t*)data;
+    const uint64_t nowNs = event_loop_now();
+    const uint64_t maxNs = (uint64_t)(server->conf->voicemail_answer_s + server->conf->voicemail_max_s) * 1000000000ull;
+    bool busy = false;
+
+    for (int i = 0; i < SERVER_MAX_VOICEMAIL_CALLS; i++) {
+        voicemail_call_t* voicemail = &server->voicemail_calls[i];
+
+        if (voicemail->mailbox == NULL) {
+            continue;
+        }
+
+        if (!mailbox_finished(voicemail->mailbox) && (voicemail->mailbox->playing || nowNs - voicemail->startedNs < maxNs)) {
+            busy = true;
+            continue;
+        }
+
+        client_info_t* client = find_client(server, voicemail->phone_number);
+
+        if (client != NULL && client->connection != NULL) {
+            send_terminate(server, client->connection, 0, CALL_PUTDOWN);
+        }
+
+        info("Mailbox on port %hu is done with %hu", voicemail->mailbox->port, voicemail->phone_number);
+        end_voicemail(server, voicemail);
+    }
+
+    if (!busy) {
+        event_loop_disarm_timer(loop, server->voicemailTimer);
+    }
+
+    return ST_GOOD;
+}
+
+static void arm_voicemail_sweep(server_t* server) {
+    if (server->voicemail.fd != -1) {
+        event_loop_arm_timer(&server->loop, server->voicemailTimer, VOICEMAIL_SWEEP_MS, VOICEMAIL_SWEEP_MS);
+    }
+}
+
+/**
+ * Mailboxes have their own ports, above the pages'. 0 if the range has run
+ * out.
+ */
+static uint16_t allocate_voicemail_port(server_t* server, int index) {
+    const unsigned int port = server->conf->audio_port_min + SERVER_MAX_CONFERENCES + SERVER_MAX_PAGES + index;
+    return server->conf->audio_port_min != 0 && port <= server->conf->audio_port_max ? (uint16_t)port : 0;
+}
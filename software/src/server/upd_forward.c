@@ -1,13 +1,127 @@
+#ifdef linux
+// memfd_create()
+#define _GNU_SOURCE
+#endif
+
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <sys/time.h>
+#include <signal.h>
 #include <pthread.h>
 #include <unistd.h>
 #include "common.h"
+#include "server/packets.h"
 #include "server/upd_forward.h"
+#include "audiobackend/codec.h"
+#include "audiobackend/kernels.h"
+#include "audiobackend/resampler.h"
+#include "utils/event_loop.h"
+
+#ifdef linux
+#include <sys/prctl.h>
+#endif
+
+// How often the relay checks itself for overload
+#define RELAY_WINDOW_MS 1000
+
+// IPv4 and UDP headers, counted the same way senders count their bitrate
+#define IP_UDP_OVERHEAD 28
+
+// How often a relay that is recording looks for the server stopping it
+#define RELAY_STOP_POLL_MS 100
+
+// How often a relay whose server has exited looks for the one that took it
+// over having exited too
+#define RELAY_OWNER_POLL_MS 1000
 
+// A node takes datagrams of up to TRANSFER_MAX_PACKET
+#define TRANSCODE_MAX_PACKET 2048
+
+// Audio sent on in one packet, 20 ms at the highest wire rate, which fits
+// the largest datagram as 16 bit PCM
+#define TRANSCODE_MAX_FRAMES 960
+
+// Room for any block a relayed datagram can hold, decoded
+#define TRANSCODE_MAX_DECODED 8192
+
+// A primary block this far either side of the stream, in the sender's
+// samples, restarts it
+#define TRANSCODE_RESYNC_SECONDS 1
+
+/**
+ * What the relay has seen of one sender over the current window.
+ */
+typedef struct relay_peer_stats {
+    uint64_t bytes;
+    uint32_t packets;
+} relay_peer_stats_t;
+
+/**
+ * One direction of a transcoded call, by the side that sends it.
+ */
+typedef struct transcode_stream {
+    bool started;
+    uint32_t nextTimestamp; // Of the audio due next, at the sender's rate
+    uint32_t sendTimestamp; // At the receiver's rate
+    int codec;              // Last sent in
+    codec_state_t encoder;
+    resampler_t resampler;
+} transcode_stream_t;
+
+/**
+ * What the relay needs to transcode, owned by the child and only touched if
+ * the call is transcoded.
+ */
+typedef struct transcoder {
+    bool started;                  // Both sides were keyed
+    bool active;                   // And their streams could be set up
+    transcode_side_t sides[2];     // As the server wrote them, keys wiped once taken
+    media_crypto_t crypto[2];      // With each side, sealing as the other
+    transcode_stream_t streams[2];
+    size_t resampledFrames;        // Waiting to be sent
+    int codec;                     // Of the packet being transcoded
+    int16_t decoded[TRANSCODE_MAX_DECODED];
+    int16_t resampled[TRANSCODE_MAX_FRAMES];
+    uint8_t payload[TRANSCODE_MAX_PACKET];
+    uint8_t packet[TRANSCODE_MAX_PACKET];
+} transcoder_t;
+
+// Set when the server stops a relay that is recording
+static volatile sig_atomic_t stopping = 0;
+
+// Set when the server that started the relay exits
+static volatile sig_atomic_t orphaned = 0;
+
+// Too large for the child's stack, and preallocated so the call never waits
+// on the allocator
+static transcoder_t transcoder;
+
+static udp_port_info_t* create_port_info(int* fd);
+static void destroy_port_info(udp_port_info_t* portInfo, int fd);
 static void udp_server_main(udp_port_info_t* portInfo);
+static bool owner_gone(udp_port_info_t* portInfo, uint64_t* checkedNs);
+static void refresh_bindings(udp_port_info_t* portInfo, relay_binding_t* bindings, relay_binding_t* signalled, recording_info_t* recording, transcode_side_t* transcode, unsigned int* generation);
+static recorder_t* start_recording(udp_port_info_t* portInfo, recording_info_t* recording);
+static void start_transcoding(udp_port_info_t* portInfo, transcoder_t* transcoder);
+static void transcode_packet(udp_port_info_t* portInfo, transcoder_t* transcoder, const relay_binding_t* bindings, int sender, uint8_t* packet, size_t length, recorder_t* recorder, uint32_t* sendFailures);
+static void transcode_audio(udp_port_info_t* portInfo, transcoder_t* transcoder, const relay_binding_t* bindings, int sender, const struct media_header* header, const uint8_t* payload, size_t length, recorder_t* recorder, uint32_t* sendFailures);
+static void resample_block(udp_port_info_t* portInfo, transcoder_t* transcoder, const relay_binding_t* bindings, int sender, const int16_t* samples, size_t frames, recorder_t* recorder, uint32_t* sendFailures);
+static void flush_resampled(udp_port_info_t* portInfo, transcoder_t* transcoder, const relay_binding_t* bindings, int sender, recorder_t* recorder, uint32_t* sendFailures);
+static void send_transcoded(udp_port_info_t* portInfo, const relay_binding_t* bindings, int receiver, const uint8_t* packet, size_t length, recorder_t* recorder, uint32_t* sendFailures);
+static int  pick_codec(const transcode_side_t* receiver, int codec, size_t frames);
+static void forward_packet(int sockfd, const relay_binding_t* receiver, const uint8_t* packet, size_t length, uint32_t* sendFailures);
+static void handle_stop(int sig);
+static void handle_orphaned(int sig);
+static int  find_sender(const relay_binding_t* bindings, const struct media_header* header);
+static bool same_endpoint(const struct sockaddr_in* a, const struct sockaddr_in* b);
+static void log_endpoint(const char* what, int sender, const struct sockaddr_in* addr);
+static ssize_t receive_datagram(int sockfd, uint8_t* buffer, size_t length, struct sockaddr_in* addr, socklen_t* addrLen, uint32_t* drops);
+static void send_relay_report(int sockfd, const struct sockaddr_in* addr, socklen_t addrLen, uint32_t maxBitrate, uint32_t* sequence);
 
 /**
  * Initialises the udp socket.
@@ -24,22 +138,52 @@ int init_udp_server(udp_server_t* server) {
  * @param port The port to listen to.
  */
 int start_udp_port(udp_server_t* server, uint16_t port) {
-    udp_port_info_t* pInfo = (udp_port_info_t*)create_shared_memory(sizeof(udp_port_info_t));
-    server->ports[server->port_count++] = pInfo;
-    
+    if (server->port_count >= sizeof(server->ports) / sizeof(*server->ports)) {
+        warn("Too many udp ports running");
+        return ST_FAIL;
+    }
+
+    int infofd;
+    udp_port_info_t* pInfo = create_port_info(&infofd);
+
+    if (pInfo == MAP_FAILED) {
+        stl_warn(errno, "Failed to allocate udp port info");
+        return ST_FAIL;
+    }
+
     info("Starting udp port on port: %hu", port);
 
     pInfo->port = port;
+    atomic_init(&pInfo->owner, getpid());
+    atomic_init(&pInfo->generation, 0);
+    atomic_init(&pInfo->heard_ns[0], 0);
+    atomic_init(&pInfo->heard_ns[1], 0);
 
     // Initialise udp socket
     int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
 
     if (sockfd == -1) {
         warn("Failed to initialise udp server port");
+        destroy_port_info(pInfo, infofd);
+        return ST_FAIL;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+
+    if (bind(sockfd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        stl_warn(errno, "Failed to bind udp server port %hu", port);
+        close(sockfd);
+        destroy_port_info(pInfo, infofd);
         return ST_FAIL;
     }
 
     pInfo->sockfd = sockfd;
+    server->fds[server->port_count] = infofd;
+    server->ports[server->port_count++] = pInfo;
 
     // Initialise process
     pid_t pid = fork();
@@ -57,6 +201,17 @@ int start_udp_port(udp_server_t* server, uint16_t port) {
         pInfo->pid = pid;
     } else {
         // Child process
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = &handle_orphaned;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGUSR1, &action, NULL);
+
+#ifdef linux
+        // Told when the server exits, to stop with it unless an upgraded one
+        // took the relay over, so a restarted one can take the port
+        prctl(PR_SET_PDEATHSIG, SIGUSR1);
+#endif
         udp_server_main(pInfo);
         exit(0);
     }
@@ -71,6 +226,14 @@ int stop_udp_port(udp_server_t* server, uint16_t port) {
             // Kill the child
             info("Killing udp server on port: %hu", port);
             kill(server->ports[i]->pid, SIGINT);
+
+            // So the port can be started again for another call
+            memset(&server->ports[i]->recording, 0, sizeof(server->ports[i]->recording));
+            memset(server->ports[i]->transcode, 0, sizeof(server->ports[i]->transcode));
+            destroy_port_info(server->ports[i], server->fds[i]);
+            server->port_count--;
+            server->ports[i] = server->ports[server->port_count];
+            server->fds[i] = server->fds[server->port_count];
             return ST_GOOD;
         }
     }
@@ -79,66 +242,831 @@ int stop_udp_port(udp_server_t* server, uint16_t port) {
     return ST_FAIL;
 }
 
+/**
+ * Take over the relay whose info `fd` backs, handed over by the server that
+ * started it. The relay carries on as it was, answering to this server from
+ * now on, and is stopped like any other.
+ */
+int adopt_udp_port(udp_server_t* server, int fd) {
+    struct stat st;
+
+    if (server->port_count >= sizeof(server->ports) / sizeof(*server->ports)) {
+        warn("Too many udp ports running");
+        close(fd);
+        return ST_FAIL;
+    }
+
+    if (fstat(fd, &st) == -1 || st.st_size != (off_t)sizeof(udp_port_info_t)) {
+        warn("Handed over udp port info is not the size expected");
+        close(fd);
+        return ST_FAIL;
+    }
+
+    udp_port_info_t* pInfo = (udp_port_info_t*)mmap(NULL, sizeof(udp_port_info_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (pInfo == MAP_FAILED) {
+        stl_warn(errno, "Failed to map handed over udp port info");
+        close(fd);
+        return ST_FAIL;
+    }
+
+    atomic_store(&pInfo->owner, getpid());
+    server->fds[server->port_count] = fd;
+    server->ports[server->port_count++] = pInfo;
+
+    info("Took over udp server on port %hu, run by %d", pInfo->port, (int)pInfo->pid);
+    return ST_GOOD;
+}
+
+/**
+ * A port's info, shared with its child. On Linux a memfd backs it so it can
+ * be handed to an upgraded server too, elsewhere only the child shares it
+ * and `fd` is -1.
+ */
+static udp_port_info_t* create_port_info(int* fd) {
+#ifdef linux
+    if ((*fd = memfd_create("udp_port_info", MFD_CLOEXEC)) != -1) {
+        if (ftruncate(*fd, sizeof(udp_port_info_t)) == 0) {
+            void* pInfo = mmap(NULL, sizeof(udp_port_info_t), PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+
+            if (pInfo != MAP_FAILED) {
+                return (udp_port_info_t*)pInfo;
+            }
+        }
+
+        close(*fd);
+    }
+#endif
+
+    *fd = -1;
+    return (udp_port_info_t*)create_shared_memory(sizeof(udp_port_info_t));
+}
+
+static void destroy_port_info(udp_port_info_t* portInfo, int fd) {
+    destroy_shared_memory(portInfo, sizeof(udp_port_info_t));
+
+    if (fd != -1) {
+        close(fd);
+    }
+}
+
+/**
+ * Bind one side of the call on `port` to the token it will send and the
+ * address it will send from, so the relay can forward to it before it has
+ * heard from it. Called again when a side moves, on a resume.
+ */
+int bind_udp_peer(udp_server_t* server, uint16_t port, uint8_t sender, uint32_t token, const struct sockaddr_in* addr) {
+    if (sender > MEDIA_SENDER_CALLEE) {
+        return ST_FAIL;
+    }
+
+    for (int i = 0; i < server->port_count; i++) {
+        udp_port_info_t* portInfo = server->ports[i];
+
+        if (portInfo->port != port) {
+            continue;
+        }
+
+        // Odd while writing, the child skips a binding it catches half done
+        atomic_fetch_add_explicit(&portInfo->generation, 1, memory_order_acq_rel);
+        portInfo->bindings[sender].token = token;
+        portInfo->bindings[sender].addr = *addr;
+        atomic_fetch_add_explicit(&portInfo->generation, 1, memory_order_release);
+
+        return ST_GOOD;
+    }
+
+    warn("Unable to find udp server to bind on port: %hu", port);
+    return ST_FAIL;
+}
+
+/**
+ * Have the relay on `port` record its call. It starts once it next takes the
+ * bindings, from the packet after.
+ */
+int record_udp_port(udp_server_t* server, uint16_t port, const recording_info_t* recording) {
+    for (int i = 0; i < server->port_count; i++) {
+        udp_port_info_t* portInfo = server->ports[i];
+
+        if (portInfo->port != port) {
+            continue;
+        }
+
+        atomic_fetch_add_explicit(&portInfo->generation, 1, memory_order_acq_rel);
+        portInfo->recording = *recording;
+        atomic_fetch_add_explicit(&portInfo->generation, 1, memory_order_release);
+
+        return ST_GOOD;
+    }
+
+    warn("Unable to find udp server to record on port: %hu", port);
+    return ST_FAIL;
+}
+
+/**
+ * Have the relay on `port` transcode what it forwards to and from `sender`.
+ * It starts once both sides are keyed, until then neither side's audio can
+ * be forwarded.
+ */
+int transcode_udp_port(udp_server_t* server, uint16_t port, uint8_t sender, const transcode_side_t* side) {
+    if (sender > MEDIA_SENDER_CALLEE) {
+        return ST_FAIL;
+    }
+
+    for (int i = 0; i < server->port_count; i++) {
+        udp_port_info_t* portInfo = server->ports[i];
+
+        if (portInfo->port != port) {
+            continue;
+        }
+
+        atomic_fetch_add_explicit(&portInfo->generation, 1, memory_order_acq_rel);
+        portInfo->transcode[sender] = *side;
+        atomic_fetch_add_explicit(&portInfo->generation, 1, memory_order_release);
+
+        return ST_GOOD;
+    }
+
+    warn("Unable to find udp server to transcode on port: %hu", port);
+    return ST_FAIL;
+}
+
+/**
+ * When the relay on `port` last heard from `sender`, by event_loop_now(), or
+ * 0 if it never has.
+ */
+uint64_t udp_port_heard(udp_server_t* server, uint16_t port, uint8_t sender) {
+    if (sender > MEDIA_SENDER_CALLEE) {
+        return 0;
+    }
+
+    for (int i = 0; i < server->port_count; i++) {
+        if (server->ports[i]->port == port) {
+            return atomic_load_explicit(&server->ports[i]->heard_ns[sender], memory_order_relaxed);
+        }
+    }
+
+    return 0;
+}
+
 /**
  * The main upd transfer function. This function sends bytes of audio data between clients.
  * 
- * This function returns when the parent kills it.
+ * The sender of a packet is found by the token in its header, which the
+ * server bound to an address while signalling the call, so the first packet
+ * is forwarded and two nodes behind one address are told apart. A packet
+ * from the bound address, or the bound IP on another port when a NAT has
+ * rewritten it, is forwarded to the other side. The port is taken from the
+ * packet, anything else is dropped.
+ * 
+ * Every RELAY_WINDOW_MS the relay checks whether it has fallen behind, from
+ * datagrams the kernel dropped on its socket or sends that failed for want of
+ * buffer space. If it has, each sender is sent a relay report asking for three
+ * quarters of the bitrate it was sending at.
+ * 
+ * A recorded call is teed to the recorder after each packet is forwarded.
+ * The recorder has a thread of its own and a queue that never blocks, so
+ * the disk never holds up forwarding.
+ *
+ * A call whose sides differ in wire rate or codecs is transcoded rather than
+ * forwarded as it is, see transcode_packet(). A call whose sides match never
+ * touches the transcoder's state.
+ * 
+ * This function returns when the parent kills it, once any recording is
+ * finished.
  */
 static void udp_server_main(udp_port_info_t* portInfo) {
-    // List of currently connected addresses
     info("Child started udp audio server on socket %d", portInfo->sockfd);
-    bool init[2];
-    struct sockaddr_in addrs[2];
-    socklen_t addrLens[2];
+
+    // The bindings in use, and the server's as last seen
+    relay_binding_t bindings[2];
+    relay_binding_t signalled[2];
+    recording_info_t recording;
+    unsigned int generation = 0;
+
+    memset(bindings, 0, sizeof(bindings));
+    memset(signalled, 0, sizeof(signalled));
+    memset(&recording, 0, sizeof(recording));
+    memset(transcoder.sides, 0, sizeof(transcoder.sides));
+
+    recorder_t* recorder = NULL;
+    bool recordingStarted = false;
 
     // Temporary buffer
     uint8_t msgBuffer[BIT(12)];
 
-    while (1) {
+    // Overload detection
+    relay_peer_stats_t stats[2] = { 0 };
+    uint64_t windowStartNs = event_loop_now();
+    uint32_t drops = 0;
+    uint32_t windowDrops = 0;
+    uint32_t sendFailures = 0;
+    uint32_t reportSequence = 0;
+
+#ifdef SO_RXQ_OVFL
+    // Have the kernel count the datagrams it drops on a full socket
+    int enable = 1;
+    if (setsockopt(portInfo->sockfd, SOL_SOCKET, SO_RXQ_OVFL, &enable, sizeof(enable)) == -1) {
+        stl_warn(errno, "UDP relay cannot count dropped datagrams");
+    }
+#endif
+
+    uint64_t ownerCheckedNs = 0;
+
+    while (!stopping) {
         struct sockaddr_in addr;
         socklen_t addrLen;
 
-        ssize_t bytesRead = recvfrom(portInfo->sockfd, msgBuffer, sizeof(msgBuffer), 0, (struct sockaddr*)&addr, &addrLen);
+        if (orphaned && owner_gone(portInfo, &ownerCheckedNs)) {
+            info("UDP relay on port %hu has no server left, stopping", portInfo->port);
+            break;
+        }
+
+        ssize_t bytesRead = receive_datagram(portInfo->sockfd, msgBuffer, sizeof(msgBuffer), &addr, &addrLen, &drops);
 
         if (bytesRead == -1) {
-            stl_warn(errno, "Failed to read audio data from client");
+            if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
+                stl_warn(errno, "Failed to read audio data from client");
+            }
+            continue;
+        }
+
+        if ((size_t)bytesRead < sizeof(struct media_header) || addrLen != sizeof(addr)) {
             continue;
         }
 
-        // Add received from client to array if not there
-        // This loops until both clients connected
-        if (!init[0] || !init[1]) {
-            int toAdd = init[0] ? 1 : 0;
-            int other = toAdd ^ 0x1;
-            
-            // Check not already added with same address
-            if (memcmp(&addr.sin_addr, &addrs[other].sin_addr, sizeof(addr.sin_addr)) != 0) {
-                memcpy(&addrs[toAdd], &addr, addrLen);
-                addrLens[toAdd] = addrLen;
-                init[toAdd] = true;
-
-                char addrBuf[INET_ADDRSTRLEN];
-                const char* str = inet_ntop(AF_INET, &addr.sin_addr, addrBuf, INET_ADDRSTRLEN);
-
-                if (str == NULL) {
-                    warn("Issue translating added IPV4 address");
-                } else {
-                    info("UPD audio thread added address %s", addrBuf);
+        refresh_bindings(portInfo, bindings, signalled, &recording, transcoder.sides, &generation);
+
+        if (recording.keyed && !recordingStarted) {
+            recorder = start_recording(portInfo, &recording);
+            recordingStarted = true;
+        }
+
+        if (transcoder.sides[0].keyed && transcoder.sides[1].keyed && !transcoder.started) {
+            start_transcoding(portInfo, &transcoder);
+        }
+
+        const int sender = find_sender(bindings, (const struct media_header*)msgBuffer);
+
+        if (sender < 0) {
+            continue;
+        }
+
+        if (!same_endpoint(&addr, &bindings[sender].addr)) {
+            if (addr.sin_addr.s_addr != bindings[sender].addr.sin_addr.s_addr) {
+                continue;
+            }
+
+            bindings[sender].addr.sin_port = addr.sin_port;
+            log_endpoint("now at", sender, &addr);
+        }
+
+        // For the server to tell a call that has gone quiet
+        const uint64_t nowNs = event_loop_now();
+        atomic_store_explicit(&portInfo->heard_ns[sender], nowNs, memory_order_relaxed);
+
+        stats[sender].bytes += bytesRead;
+        stats[sender].packets++;
+
+        if (transcoder.sides[0].keyed || transcoder.sides[1].keyed) {
+            transcode_packet(portInfo, &transcoder, bindings, sender, msgBuffer, bytesRead, recorder, &sendFailures);
+        } else {
+            // Send to the other side, once it is known where it is
+            forward_packet(portInfo->sockfd, &bindings[sender ^ 0x1], msgBuffer, bytesRead, &sendFailures);
+
+            if (recorder != NULL) {
+                recorder_push(recorder, msgBuffer, bytesRead);
+            }
+        }
+
+        const uint64_t elapsedMs = (nowNs - windowStartNs) / 1000000;
+
+        if (elapsedMs < RELAY_WINDOW_MS) {
+            continue;
+        }
+
+        if (drops != windowDrops || sendFailures > 0) {
+            warn("UDP relay on port %hu overloaded, %u datagrams dropped and %u sends failed", portInfo->port, drops - windowDrops, sendFailures);
+
+            for (int i = 0; i < 2; i++) {
+                const uint64_t bitrate = (stats[i].bytes + (uint64_t)stats[i].packets * IP_UDP_OVERHEAD) * 8 * 1000 / elapsedMs;
+
+                if (bitrate > 0) {
+                    send_relay_report(portInfo->sockfd, &bindings[i].addr, sizeof(bindings[i].addr), (uint32_t)(bitrate * 3 / 4), &reportSequence);
                 }
             }
+        }
+
+        memset(stats, 0, sizeof(stats));
+        windowStartNs = nowNs;
+        windowDrops = drops;
+        sendFailures = 0;
+    }
+
+    if (recorder != NULL) {
+        stop_recorder(recorder);
+    }
+
+    for (int i = 0; i < 2; i++) {
+        destroy_media_crypto(&transcoder.crypto[i]);
+    }
+}
+
+/**
+ * Start recording, once. From then on SIGINT lets the relay finish the
+ * recording before it exits, and reads time out so it notices.
+ */
+static recorder_t* start_recording(udp_port_info_t* portInfo, recording_info_t* recording) {
+    recorder_t* recorder = NULL;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = &handle_stop;
+    sigemptyset(&action.sa_mask);
+
+    struct timeval timeout = { 0, RELAY_STOP_POLL_MS * 1000 };
+
+    if (sigaction(SIGINT, &action, NULL) == -1 || setsockopt(portInfo->sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1) {
+        stl_warn(errno, "UDP relay on port %hu cannot stop a recording cleanly", portInfo->port);
+    }
+
+    if (start_recorder(&recorder, recording, portInfo->port) != ST_GOOD) {
+        warn("UDP relay on port %hu is not recording", portInfo->port);
+    }
+
+    // The recorder holds the key now
+    memset(recording->key, 0, sizeof(recording->key));
+
+    return recorder;
+}
+
+static void handle_stop(int sig) {
+    stopping = 1;
+}
+
+static void handle_orphaned(int sig) {
+    orphaned = 1;
+}
+
+/**
+ * Once the server that started the relay has exited, whether the server it
+ * answers to has too, looked at every RELAY_OWNER_POLL_MS. Unless an upgraded
+ * server took the relay over that is the one that exited. Reads time out from
+ * then on, so the relay looks even with nothing to forward.
+ */
+static bool owner_gone(udp_port_info_t* portInfo, uint64_t* checkedNs) {
+    const uint64_t nowNs = event_loop_now();
+
+    if (*checkedNs == 0) {
+        struct timeval timeout = { 0, RELAY_STOP_POLL_MS * 1000 };
+
+        if (setsockopt(portInfo->sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1) {
+            stl_warn(errno, "UDP relay on port %hu cannot poll for its server", portInfo->port);
+        }
+    } else if (nowNs - *checkedNs < RELAY_OWNER_POLL_MS * 1000000ull) {
+        return false;
+    }
+
+    *checkedNs = nowNs;
+    return kill((pid_t)atomic_load(&portInfo->owner), 0) == -1 && errno == ESRCH;
+}
+
+/**
+ * Start transcoding, once both sides are keyed. Each side's key is only
+ * kept in its crypto from then on.
+ */
+static void start_transcoding(udp_port_info_t* portInfo, transcoder_t* transcoder) {
+    transcoder->started = true;
+    init_kernels();
+
+    for (int i = 0; i < 2; i++) {
+        const transcode_side_t* from = &transcoder->sides[i];
+        const transcode_side_t* to = &transcoder->sides[i ^ 1];
+        transcode_stream_t* stream = &transcoder->streams[i];
 
+        if (init_resampler(&stream->resampler, from->wireRate, to->wireRate) != ST_GOOD) {
+            warn("UDP relay on port %hu cannot transcode its call", portInfo->port);
+            memset(transcoder->sides[0].key, 0, sizeof(transcoder->sides[0].key));
+            memset(transcoder->sides[1].key, 0, sizeof(transcoder->sides[1].key));
+            return;
+        }
+
+        stream->started = false;
+        stream->sendTimestamp = 0;
+        stream->codec = -1;
+        init_codec_state(&stream->encoder);
+    }
+
+    for (int i = 0; i < 2; i++) {
+        init_media_crypto(&transcoder->crypto[i], transcoder->sides[i].key, (uint8_t)(i ^ 1), 0);
+        memset(transcoder->sides[i].key, 0, sizeof(transcoder->sides[i].key));
+    }
+
+    transcoder->active = true;
+    transcoder->resampledFrames = 0;
+
+    info("UDP relay on port %hu transcoding %u Hz to %u Hz", portInfo->port, transcoder->sides[0].wireRate, transcoder->sides[1].wireRate);
+}
+
+/**
+ * Open a packet of a transcoded call with the sender's key and pass it on
+ * sealed under the receiver's, as though from the sender. The relay counts
+ * its own sequence numbers toward each side, and sends a token of 0 as it
+ * does from itself.
+ *
+ * Audio is decoded, resampled to the receiver's rate and encoded again, see
+ * transcode_audio(). Reports are passed on as they are, so the sender still
+ * adapts to the loss the receiver sees. Probes are dropped, a transcoded
+ * call has no direct path to find.
+ *
+ * A recorded call is recorded from the caller's side, the caller's packets
+ * as it sent them and the callee's as sealed to the caller, which is the key
+ * the caller hands the recorder.
+ */
+static void transcode_packet(udp_port_info_t* portInfo, transcoder_t* transcoder, const relay_binding_t* bindings, int sender, uint8_t* packet, size_t length, recorder_t* recorder, uint32_t* sendFailures) {
+    // Opened in place below
+    if (recorder != NULL && sender == MEDIA_SENDER_CALLER) {
+        recorder_push(recorder, packet, length);
+    }
+
+    if (!transcoder->active) {
+        return;
+    }
+
+    const struct media_header* header = (const struct media_header*)packet;
+    uint8_t* payload;
+    size_t payloadLength;
+
+    if (media_open(&transcoder->crypto[sender], packet, length, &payload, &payloadLength) != ST_GOOD) {
+        return;
+    }
+
+    if (header->type == MEDIA_TYPE_AUDIO) {
+        transcode_audio(portInfo, transcoder, bindings, sender, header, payload, payloadLength, recorder, sendFailures);
+    } else if (header->type == MEDIA_TYPE_REPORT && payloadLength <= sizeof(transcoder->packet) - MEDIA_OVERHEAD) {
+        const int receiver = sender ^ 1;
+        const size_t sealed = media_seal(&transcoder->crypto[receiver], transcoder->packet, MEDIA_TYPE_REPORT, 0, transcoder->streams[sender].sendTimestamp, payload, payloadLength);
+
+        send_transcoded(portInfo, bindings, receiver, transcoder->packet, sealed, recorder, sendFailures);
+    }
+}
+
+/**
+ * Decode an audio payload and resample what the receiver has not been sent
+ * yet. The blocks of any FEC fill in for packets lost on the way to the
+ * relay, oldest first, since the relay sends none of its own. Audio nothing
+ * carried is skipped in the receiver's timestamps too, so it conceals the
+ * gap as for any loss.
+ *
+ * The relay holds no jitter buffer, a packet that arrives after the one
+ * following it is dropped.
+ */
+static void transcode_audio(udp_port_info_t* portInfo, transcoder_t* transcoder, const relay_binding_t* bindings, int sender, const struct media_header* header, const uint8_t* payload, size_t length, recorder_t* recorder, uint32_t* sendFailures) {
+    transcode_stream_t* stream = &transcoder->streams[sender];
+    const transcode_side_t* from = &transcoder->sides[sender];
+    const transcode_side_t* to = &transcoder->sides[sender ^ 1];
+
+    const int codec = MEDIA_FORMAT_CODEC(header->format);
+    const int fec = MEDIA_FORMAT_FEC(header->format);
+
+    if (codec >= MEDIA_CODEC_COUNT || fec > MEDIA_MAX_FEC || length < fec * sizeof(uint16_t)) {
+        return;
+    }
+
+    const uint8_t* blocks[MEDIA_MAX_FEC + 1];
+    size_t blockLengths[MEDIA_MAX_FEC + 1];
+    size_t blockFrames[MEDIA_MAX_FEC + 1];
+
+    const uint8_t* block = payload + fec * sizeof(uint16_t);
+    size_t remaining = length - fec * sizeof(uint16_t);
+
+    for (int i = 0; i <= fec; i++) {
+        blockLengths[i] = i < fec ? (size_t)((payload[2 * i] << 8) | payload[2 * i + 1]) : remaining;
+
+        if (blockLengths[i] > remaining) {
+            return;
+        }
+
+        blocks[i] = block;
+        blockFrames[i] = codec_decoded_frames(codec, block, blockLengths[i]);
+
+        if (blockFrames[i] == 0 || blockFrames[i] > TRANSCODE_MAX_DECODED) {
+            return;
+        }
+
+        block += blockLengths[i];
+        remaining -= blockLengths[i];
+    }
+
+    // Where each block starts, back from the primary
+    uint32_t starts[MEDIA_MAX_FEC + 1];
+    starts[fec] = ntohl(header->timestamp);
+
+    for (int i = fec - 1; i >= 0; i--) {
+        starts[i] = starts[i + 1] - (uint32_t)blockFrames[i];
+    }
+
+    // A stream that starts, or jumps, goes from its primary block
+    const int32_t drift = (int32_t)(starts[fec] - stream->nextTimestamp);
+    const int32_t resync = (int32_t)(from->wireRate * TRANSCODE_RESYNC_SECONDS);
+
+    if (!stream->started || drift > resync || drift < -resync) {
+        if (stream->started) {
+            info("UDP relay on port %hu restarted the %s's stream", portInfo->port, sender == MEDIA_SENDER_CALLER ? "caller" : "callee");
+        }
+
+        stream->started = true;
+        stream->nextTimestamp = starts[fec];
+        reset_resampler(&stream->resampler);
+    }
+
+    transcoder->resampledFrames = 0;
+    transcoder->codec = codec;
+
+    for (int i = 0; i <= fec; i++) {
+        const int32_t offset = (int32_t)(starts[i] - stream->nextTimestamp);
+
+        // Already sent
+        if (offset + (int32_t)blockFrames[i] <= 0) {
             continue;
         }
 
-        // Send to other client
-        int receiver = memcmp(&addr.sin_addr, &addrs[0].sin_addr, sizeof(addr.sin_addr)) == 0 ? 1 : 0;
+        // Lost before the relay, with nothing to fill it in
+        if (offset > 0) {
+            flush_resampled(portInfo, transcoder, bindings, sender, recorder, sendFailures);
+            stream->sendTimestamp += (uint32_t)((uint64_t)offset * to->wireRate / from->wireRate);
+            stream->nextTimestamp = starts[i];
+        }
+
+        const size_t skip = offset < 0 ? (size_t)-offset : 0;
+        const size_t decoded = codec_decode(codec, blocks[i], blockLengths[i], transcoder->decoded);
 
-        ssize_t bytesSent = sendto(portInfo->sockfd, msgBuffer, bytesRead, 0, (struct sockaddr*)&addrs[receiver], addrLens[receiver]);
+        if (decoded > skip) {
+            resample_block(portInfo, transcoder, bindings, sender, transcoder->decoded + skip, decoded - skip, recorder, sendFailures);
+        }
 
-        if (bytesSent == -1) {
-            stl_warn(errno, "Failed to send audio data to client");
+        stream->nextTimestamp = starts[i] + (uint32_t)blockFrames[i];
+    }
+
+    flush_resampled(portInfo, transcoder, bindings, sender, recorder, sendFailures);
+}
+
+/**
+ * Resample decoded audio onto what is waiting to be sent, sending it first
+ * whenever it would not fit a packet.
+ */
+static void resample_block(udp_port_info_t* portInfo, transcoder_t* transcoder, const relay_binding_t* bindings, int sender, const int16_t* samples, size_t frames, recorder_t* recorder, uint32_t* sendFailures) {
+    resampler_t* resampler = &transcoder->streams[sender].resampler;
+
+    while (frames > 0) {
+        const size_t room = TRANSCODE_MAX_FRAMES - transcoder->resampledFrames;
+
+        // The most input whose output is sure to fit
+        const size_t take = MIN(frames, room > 1 ? (room - 1) * resampler->step / resampler->phases : 0);
+
+        if (take == 0) {
+            flush_resampled(portInfo, transcoder, bindings, sender, recorder, sendFailures);
             continue;
         }
+
+        transcoder->resampledFrames += resample(resampler, samples, take, transcoder->resampled + transcoder->resampledFrames);
+        samples += take;
+        frames -= take;
     }
 }
 
+/**
+ * Encode and seal what is waiting to be sent as one block, at the
+ * receiver's timestamps.
+ */
+static void flush_resampled(udp_port_info_t* portInfo, transcoder_t* transcoder, const relay_binding_t* bindings, int sender, recorder_t* recorder, uint32_t* sendFailures) {
+    const size_t frames = transcoder->resampledFrames;
+    const int receiver = sender ^ 1;
+    transcode_stream_t* stream = &transcoder->streams[sender];
+
+    if (frames == 0) {
+        return;
+    }
+
+    transcoder->resampledFrames = 0;
+
+    const int codec = pick_codec(&transcoder->sides[receiver], transcoder->codec, frames);
+
+    if (codec < 0) {
+        stream->sendTimestamp += (uint32_t)frames;
+        return;
+    }
+
+    // ADPCM carries its state from block to block
+    if (codec != stream->codec) {
+        init_codec_state(&stream->encoder);
+        stream->codec = codec;
+    }
+
+    const size_t encoded = codec_encode(codec, &stream->encoder, transcoder->resampled, frames, transcoder->payload);
+    const size_t sealed = media_seal(&transcoder->crypto[receiver], transcoder->packet, MEDIA_TYPE_AUDIO, MEDIA_FORMAT(codec, 0), stream->sendTimestamp, transcoder->payload, encoded);
+
+    stream->sendTimestamp += (uint32_t)frames;
+    send_transcoded(portInfo, bindings, receiver, transcoder->packet, sealed, recorder, sendFailures);
+}
+
+static void send_transcoded(udp_port_info_t* portInfo, const relay_binding_t* bindings, int receiver, const uint8_t* packet, size_t length, recorder_t* recorder, uint32_t* sendFailures) {
+    if (length == 0) {
+        warn("UDP relay on port %hu ran out of sequence numbers", portInfo->port);
+        return;
+    }
+
+    forward_packet(portInfo->sockfd, &bindings[receiver], packet, length, sendFailures);
+
+    if (recorder != NULL && receiver == MEDIA_SENDER_CALLER) {
+        recorder_push(recorder, packet, length);
+    }
+}
+
+/**
+ * The codec to send `frames` to the receiver in. The sender's if the
+ * receiver decodes it and it fits a datagram, or else whichever the receiver
+ * decodes takes the fewest bytes. -1 if none of them fits.
+ */
+static int pick_codec(const transcode_side_t* receiver, int codec, size_t frames) {
+    const size_t room = TRANSCODE_MAX_PACKET - MEDIA_OVERHEAD;
+
+    if ((receiver->codecs & MEDIA_CODEC_BIT(codec)) && codec_encoded_size(codec, frames) <= room) {
+        return codec;
+    }
+
+    int smallest = -1;
+
+    for (int i = 0; i < MEDIA_CODEC_COUNT; i++) {
+        if ((receiver->codecs & MEDIA_CODEC_BIT(i)) && (smallest < 0 || codec_encoded_size(i, frames) < codec_encoded_size(smallest, frames))) {
+            smallest = i;
+        }
+    }
+
+    return smallest >= 0 && codec_encoded_size(smallest, frames) <= room ? smallest : -1;
+}
+
+/**
+ * Send a packet to one side, once it is known where it is.
+ */
+static void forward_packet(int sockfd, const relay_binding_t* receiver, const uint8_t* packet, size_t length, uint32_t* sendFailures) {
+    if (receiver->token == 0 || receiver->addr.sin_port == 0) {
+        return;
+    }
+
+    if (sendto(sockfd, packet, length, 0, (const struct sockaddr*)&receiver->addr, sizeof(receiver->addr)) == -1) {
+        if (errno == ENOBUFS || errno == EAGAIN || errno == EWOULDBLOCK) {
+            (*sendFailures)++;
+        } else {
+            stl_warn(errno, "Failed to send audio data to client");
+        }
+    }
+}
+
+/**
+ * Take any binding the server has changed since it was last seen. A side's
+ * port learned from its packets is kept until the server binds it again.
+ */
+static void refresh_bindings(udp_port_info_t* portInfo, relay_binding_t* bindings, relay_binding_t* signalled, recording_info_t* recording, transcode_side_t* transcode, unsigned int* generation) {
+    const unsigned int current = atomic_load_explicit(&portInfo->generation, memory_order_acquire);
+
+    if (current == *generation || (current & 1)) {
+        return;
+    }
+
+    relay_binding_t copy[2];
+    recording_info_t recordingCopy;
+    transcode_side_t transcodeCopy[2];
+    memcpy(copy, portInfo->bindings, sizeof(copy));
+    memcpy(&recordingCopy, &portInfo->recording, sizeof(recordingCopy));
+    memcpy(transcodeCopy, portInfo->transcode, sizeof(transcodeCopy));
+
+    // The server started writing again while this was copied
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&portInfo->generation, memory_order_relaxed) != current) {
+        memset(&recordingCopy, 0, sizeof(recordingCopy));
+        memset(transcodeCopy, 0, sizeof(transcodeCopy));
+        return;
+    }
+
+    // A recording is only taken up once, as is each side's transcoding
+    if (recordingCopy.keyed && !recording->keyed) {
+        *recording = recordingCopy;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        if (transcodeCopy[i].keyed && !transcode[i].keyed) {
+            transcode[i] = transcodeCopy[i];
+        }
+    }
+
+    memset(&recordingCopy, 0, sizeof(recordingCopy));
+    memset(transcodeCopy, 0, sizeof(transcodeCopy));
+
+    for (int i = 0; i < 2; i++) {
+        if (memcmp(&copy[i], &signalled[i], sizeof(copy[i])) != 0) {
+            signalled[i] = copy[i];
+            bindings[i] = copy[i];
+            log_endpoint("bound to", i, &bindings[i].addr);
+        }
+    }
+
+    *generation = current;
+}
+
+/**
+ * The side that sent a packet, by its token, or -1 if it is not from either.
+ */
+static int find_sender(const relay_binding_t* bindings, const struct media_header* header) {
+    if (header->version != MEDIA_VERSION || header->token == 0) {
+        return -1;
+    }
+
+    if (header->token == bindings[0].token) {
+        return 0;
+    }
+
+    if (header->token == bindings[1].token) {
+        return 1;
+    }
+
+    return -1;
+}
+
+static bool same_endpoint(const struct sockaddr_in* a, const struct sockaddr_in* b) {
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+static void log_endpoint(const char* what, int sender, const struct sockaddr_in* addr) {
+    char addrBuf[INET_ADDRSTRLEN];
+    const char* str = inet_ntop(AF_INET, &addr->sin_addr, addrBuf, INET_ADDRSTRLEN);
+
+    if (str == NULL) {
+        warn("Issue translating added IPV4 address");
+        return;
+    }
+
+    info("UDP relay %s %s %s:%hu", sender == MEDIA_SENDER_CALLER ? "caller" : "callee", what, addrBuf, ntohs(addr->sin_port));
+}
+
+/**
+ * recvfrom() that also picks up the kernel's count of datagrams dropped on
+ * the socket, where it is kept.
+ */
+static ssize_t receive_datagram(int sockfd, uint8_t* buffer, size_t length, struct sockaddr_in* addr, socklen_t* addrLen, uint32_t* drops) {
+    struct iovec iov = { .iov_base = buffer, .iov_len = length };
+    uint8_t control[CMSG_SPACE(sizeof(uint32_t))];
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = addr;
+    msg.msg_namelen = sizeof(*addr);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t bytesRead = recvmsg(sockfd, &msg, 0);
+
+    if (bytesRead == -1) {
+        return -1;
+    }
+
+    *addrLen = msg.msg_namelen;
+
+#ifdef SO_RXQ_OVFL
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+            memcpy(drops, CMSG_DATA(cmsg), sizeof(*drops));
+        }
+    }
+#else
+    (void)drops;
+#endif
+
+    return bytesRead;
+}
+
+/**
+ * Ask a sender to stay under `maxBitrate`. The relay holds no keys, so the
+ * report goes in the clear.
+ */
+static void send_relay_report(int sockfd, const struct sockaddr_in* addr, socklen_t addrLen, uint32_t maxBitrate, uint32_t* sequence) {
+    uint8_t packet[sizeof(struct media_header) + sizeof(struct relay_report)];
+
+    struct media_header* header = (struct media_header*)packet;
+    header->version = MEDIA_VERSION;
+    header->sender = MEDIA_SENDER_RELAY;
+    header->type = MEDIA_TYPE_RELAY_REPORT;
+    header->format = 0;
+    header->token = 0;
+    header->sequence = htonl((*sequence)++);
+    header->timestamp = 0;
+
+    struct relay_report* report = (struct relay_report*)(packet + sizeof(*header));
+    report->max_bitrate = htonl(maxBitrate);
+
+    if (sendto(sockfd, packet, sizeof(packet), 0, (const struct sockaddr*)addr, addrLen) == -1) {
+        stl_warn(errno, "Failed to send relay report");
+    }
+}
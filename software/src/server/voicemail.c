@@ -0,0 +1,312 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "common.h"
+#include "server/voicemail.h"
+
+static int open_segment(voicemail_store_t* store, uint32_t segment);
+static int add_to_index(voicemail_store_t* store, const voicemail_entry_t* entry, uint16_t mailbox);
+static int read_index(const voicemail_store_t* store, uint16_t mailbox, voicemail_index_t* index, int* fdOut, bool create);
+static void segment_path(const char* directory, uint32_t segment, char* path);
+static void index_path(const char* directory, uint16_t mailbox, char* path);
+
+/**
+ * Open the store in `directory`, creating it if need be, and carry on
+ * appending to its last segment.
+ */
+int open_voicemail_store(voicemail_store_t* store, const char* directory) {
+    memset(store, 0, sizeof(*store));
+    store->fd = -1;
+
+    if (copy_string(store->directory, sizeof(store->directory), directory) != ST_GOOD) {
+        warn("Voicemail directory %s is too long", directory);
+        return ST_FAIL;
+    }
+
+    if (mkdir(directory, 0750) == -1 && errno != EEXIST) {
+        stl_warn(errno, "Failed to create the voicemail directory %s", directory);
+        return ST_FAIL;
+    }
+
+    // Only done at start up, listing a mailbox never looks at the segments
+    char path[VOICEMAIL_PATH_LEN];
+    struct stat st;
+    uint32_t segment = 0;
+
+    for (;;) {
+        segment_path(directory, segment + 1, path);
+
+        if (stat(path, &st) == -1) {
+            break;
+        }
+
+        segment++;
+    }
+
+    if (open_segment(store, segment) != ST_GOOD) {
+        return ST_FAIL;
+    }
+
+    info("Voicemail store %s appending to segment %u at %llu bytes", directory, segment, (unsigned long long)store->length);
+    return ST_GOOD;
+}
+
+void close_voicemail_store(voicemail_store_t* store) {
+    if (store->fd != -1) {
+        close(store->fd);
+        store->fd = -1;
+    }
+}
+
+/**
+ * Append a message to the current segment and add it to its mailbox.
+ *
+ * The record is written with one writev() and synced before the index points
+ * at it, so an index never names a message that is not all there. A record
+ * cut short by a crash is left behind, nothing refers to it.
+ */
+int voicemail_append(voicemail_store_t* store, const voicemail_message_t* message) {
+    if (store->fd == -1) {
+        return ST_FAIL;
+    }
+
+    const uint64_t size = sizeof(voicemail_record_t) + message->length;
+
+    if (size > VOICEMAIL_SEGMENT_SIZE) {
+        warn("Message of %u bytes is too large for the voicemail store", message->length);
+        return ST_INVALID_ARG;
+    }
+
+    if (store->length + size > VOICEMAIL_SEGMENT_SIZE && open_segment(store, store->segment + 1) != ST_GOOD) {
+        return ST_FAIL;
+    }
+
+    voicemail_record_t record;
+    memcpy(record.magic, VOICEMAIL_RECORD_MAGIC, sizeof(record.magic));
+    record.mailbox = message->mailbox;
+    record.from_phone_number = message->from_phone_number;
+    record.time = (uint64_t)time(NULL);
+    record.wire_rate = message->wire_rate;
+    record.duration_ms = message->duration_ms;
+    record.length = message->length;
+
+    struct iovec iov[2];
+    iov[0].iov_base = &record;
+    iov[0].iov_len = sizeof(record);
+    iov[1].iov_base = (void*)message->frames;
+    iov[1].iov_len = message->length;
+
+    const ssize_t written = writev(store->fd, iov, 2);
+
+    if (written != (ssize_t)size || fdatasync(store->fd) == -1) {
+        stl_warn(errno, "Failed to append a message to voicemail segment %u", store->segment);
+
+        // Leave nothing half written for the next message to follow
+        if (ftruncate(store->fd, (off_t)store->length) == -1) {
+            stl_warn(errno, "Failed to cut voicemail segment %u back", store->segment);
+        }
+        return ST_FAIL;
+    }
+
+    voicemail_entry_t entry;
+    entry.segment = store->segment;
+    entry.offset = (uint32_t)(store->length + sizeof(record));
+    entry.length = message->length;
+    entry.wire_rate = message->wire_rate;
+    entry.duration_ms = message->duration_ms;
+    entry.time = record.time;
+    entry.from_phone_number = message->from_phone_number;
+
+    store->length += size;
+
+    return add_to_index(store, &entry, message->mailbox);
+}
+
+/**
+ * Fill `entries` with a mailbox's messages, newest first, and return how
+ * many there are. One read of its index, however much the store holds.
+ */
+int voicemail_list(const voicemail_store_t* store, uint16_t mailbox, voicemail_entry_t* entries) {
+    voicemail_index_t index;
+    int fd;
+
+    if (read_index(store, mailbox, &index, &fd, false) != ST_GOOD) {
+        return 0;
+    }
+
+    close(fd);
+
+    const uint32_t count = MIN(index.total, (uint32_t)VOICEMAIL_MAX_MESSAGES);
+
+    for (uint32_t i = 0; i < count; i++) {
+        entries[i] = index.entries[(index.total - 1 - i) % VOICEMAIL_MAX_MESSAGES];
+    }
+
+    return (int)count;
+}
+
+/**
+ * Map a message's frames straight from its segment, so it can be played
+ * without reading it into a buffer first.
+ */
+int voicemail_map(const char* directory, const voicemail_entry_t* entry, voicemail_map_t* map) {
+    char path[VOICEMAIL_PATH_LEN];
+    segment_path(directory, entry->segment, path);
+
+    memset(map, 0, sizeof(*map));
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1) {
+        stl_warn(errno, "Failed to open voicemail segment %s", path);
+        return ST_FAIL;
+    }
+
+    struct stat st;
+    const size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    const size_t start = entry->offset & ~(pageSize - 1);
+    const size_t end = (size_t)entry->offset + entry->length;
+
+    if (fstat(fd, &st) == -1 || entry->length == 0 || end > (size_t)st.st_size) {
+        warn("Voicemail segment %s does not hold the message at %u", path, entry->offset);
+        close(fd);
+        return ST_FAIL;
+    }
+
+    map->mappedLength = end - start;
+    map->base = mmap(NULL, map->mappedLength, PROT_READ, MAP_SHARED, fd, (off_t)start);
+    close(fd);
+
+    if (map->base == MAP_FAILED) {
+        stl_warn(errno, "Failed to map voicemail segment %s", path);
+        map->base = NULL;
+        return ST_FAIL;
+    }
+
+    // Played once front to back
+    madvise(map->base, map->mappedLength, MADV_SEQUENTIAL);
+
+    map->frames = (const uint8_t*)map->base + (entry->offset - start);
+    map->length = entry->length;
+
+    return ST_GOOD;
+}
+
+void voicemail_unmap(voicemail_map_t* map) {
+    if (map->base != NULL) {
+        munmap(map->base, map->mappedLength);
+    }
+
+    memset(map, 0, sizeof(*map));
+}
+
+static int open_segment(voicemail_store_t* store, uint32_t segment) {
+    char path[VOICEMAIL_PATH_LEN];
+    segment_path(store->directory, segment, path);
+
+    const int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0640);
+    struct stat st;
+
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        stl_warn(errno, "Failed to open voicemail segment %s", path);
+
+        if (fd != -1) {
+            close(fd);
+        }
+        return ST_FAIL;
+    }
+
+    close_voicemail_store(store);
+
+    store->fd = fd;
+    store->segment = segment;
+    store->length = (uint64_t)st.st_size;
+
+    return ST_GOOD;
+}
+
+/**
+ * Put an entry in the mailbox's ring, then count it. A crash in between
+ * loses at most the oldest message, whose place the entry took.
+ */
+static int add_to_index(voicemail_store_t* store, const voicemail_entry_t* entry, uint16_t mailbox) {
+    voicemail_index_t index;
+    int fd;
+
+    if (read_index(store, mailbox, &index, &fd, true) != ST_GOOD) {
+        return ST_FAIL;
+    }
+
+    const uint32_t slot = index.total % VOICEMAIL_MAX_MESSAGES;
+    const off_t entryOffset = (off_t)(offsetof(voicemail_index_t, entries) + slot * sizeof(voicemail_entry_t));
+
+    index.total++;
+
+    int res = ST_GOOD;
+
+    if (pwrite(fd, entry, sizeof(*entry), entryOffset) != sizeof(*entry)
+        || pwrite(fd, &index, offsetof(voicemail_index_t, entries), 0) != offsetof(voicemail_index_t, entries)) {
+        stl_warn(errno, "Failed to add a message to mailbox %hu", mailbox);
+        res = ST_FAIL;
+    }
+
+    close(fd);
+
+    if (res == ST_GOOD) {
+        info("Stored message %u for mailbox %hu in segment %u", index.total, mailbox, entry->segment);
+    }
+
+    return res;
+}
+
+/**
+ * Open a mailbox's index and read it. A mailbox that has never had a message
+ * has none, unless it is to be created for one.
+ */
+static int read_index(const voicemail_store_t* store, uint16_t mailbox, voicemail_index_t* index, int* fdOut, bool create) {
+    char path[VOICEMAIL_PATH_LEN];
+    index_path(store->directory, mailbox, path);
+
+    const int fd = open(path, create ? O_RDWR | O_CREAT | O_CLOEXEC : O_RDONLY | O_CLOEXEC, 0640);
+
+    if (fd == -1) {
+        if (create || errno != ENOENT) {
+            stl_warn(errno, "Failed to open the index of mailbox %hu", mailbox);
+        }
+        return ST_FAIL;
+    }
+
+    const ssize_t bytesRead = pread(fd, index, sizeof(*index), 0);
+
+    if (bytesRead == 0) {
+        memset(index, 0, sizeof(*index));
+        memcpy(index->magic, VOICEMAIL_INDEX_MAGIC, sizeof(index->magic));
+        index->mailbox = mailbox;
+    } else if (bytesRead < (ssize_t)offsetof(voicemail_index_t, entries) || memcmp(index->magic, VOICEMAIL_INDEX_MAGIC, sizeof(index->magic)) != 0
+        || index->mailbox != mailbox) {
+        warn("Index of mailbox %hu is damaged", mailbox);
+        close(fd);
+        return ST_FAIL;
+    } else if (bytesRead < (ssize_t)sizeof(*index)) {
+        // Entries past the end were never written
+        memset((uint8_t*)index + bytesRead, 0, sizeof(*index) - (size_t)bytesRead);
+        index->total = MIN(index->total, (uint32_t)((bytesRead - offsetof(voicemail_index_t, entries)) / sizeof(voicemail_entry_t)));
+    }
+
+    *fdOut = fd;
+    return ST_GOOD;
+}
+
+static void segment_path(const char* directory, uint32_t segment, char* path) {
+    snprintf(path, VOICEMAIL_PATH_LEN, "%s/%08u.seg", directory, segment);
+}
+
+static void index_path(const char* directory, uint16_t mailbox, char* path) {
+    snprintf(path, VOICEMAIL_PATH_LEN, "%s/%hu.idx", directory, mailbox);
+}
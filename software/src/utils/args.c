@@ -2,18 +2,40 @@
 #include <stdbool.h>
 #include <string.h>
 #include <limits.h>
+#include <stdio.h>
 #include <unistd.h>
 #include <libconfig.h>
 #include "common.h"
 #include "utils/args.h"
+#include "server/packets.h"
 
 #define conf_fail() error("One or more critical configs could not be found")
 #define set_if_fail(err, bool) if ((err) != ST_GOOD){ bool = true;}
 
 static void init_config_from_file(struct config_t* config, const char* path);
+static void read_audio_device_cache(intercom_conf_t* config);
 static int config_get_u16(struct config_t* conf, const char* path, unsigned short* ret);
-static int config_get_str(struct config_t* conf, const char* path, char* ret, ssize_t maxlen);
+static int config_get_str(struct config_t* conf, const char* path, char* ret, size_t size);
 static int config_get_bool(struct config_t* conf, const char* path, bool* ret);
+static int config_get_double(struct config_t* conf, const char* path, double* ret);
+static int config_get_dsp_chain(struct config_t* conf, const char* path, dsp_chain_conf_t* chain);
+static int config_get_page_groups(struct config_t* conf, const char* path, server_conf_t* config);
+static int config_get_recording(struct config_t* conf, const char* path, server_conf_t* config);
+static int config_get_voicemail(struct config_t* conf, const char* path, server_conf_t* config);
+static int config_get_hold(struct config_t* conf, const char* path, server_conf_t* config);
+static int config_get_journal(struct config_t* conf, const char* path, server_conf_t* config);
+static int config_get_routes(struct config_t* conf, const char* path, routes_conf_t* routes);
+static int config_get_route(const config_setting_t* setting, route_conf_t* route);
+static int config_setting_get_number(const config_setting_t* setting, const char* name, double* ret);
+static void push_default_stage(dsp_chain_conf_t* chain, const char* type, double frequency, double q);
+
+#define DEFAULT_WIRE_SAMPLE_RATE 48000
+#define DEFAULT_SIDETONE_DB -20.0
+#define DEFAULT_GPIO_CHIP "/dev/gpiochip0"
+#define DEFAULT_DIAL_PIN 17
+#define DEFAULT_DIAL_DEBOUNCE_MS 10
+#define DEFAULT_DIAL_DIGIT_GAP_MS 250
+#define DEFAULT_DIAL_TIMEOUT_MS 3000
 
 #define INTERCOM_USAGE_STR "Usage: %s [options] [-f <config-file>]"
 
@@ -38,6 +60,25 @@ void init_intercom_conf(intercom_conf_t* config, int argc, char** argv) {
     config->phone_number = 0;
     config->server_port = 0;
     config->use_audio_defaults = false;
+    config->warm_audio = false;
+    config->adaptive_media = true;
+    config->direct_media = true;
+    config->refuse_relayed_clear = false;
+    config->sidetone = true;
+    config->sidetone_db = DEFAULT_SIDETONE_DB;
+    copy_string(config->gpio_chip, sizeof(config->gpio_chip), DEFAULT_GPIO_CHIP);
+    config->dial_pin = DEFAULT_DIAL_PIN;
+    config->dial_debounce_ms = DEFAULT_DIAL_DEBOUNCE_MS;
+    config->dial_digit_gap_ms = DEFAULT_DIAL_DIGIT_GAP_MS;
+    config->dial_timeout_ms = DEFAULT_DIAL_TIMEOUT_MS;
+    memset(&config->audio_backend, 0, sizeof(config->audio_backend));
+    memset(&config->playback_device, 0, sizeof(config->playback_device));
+    memset(&config->capture_device, 0, sizeof(config->capture_device));
+    memset(&config->device_cache, 0, sizeof(config->device_cache));
+    config->wire_sample_rate = DEFAULT_WIRE_SAMPLE_RATE;
+    memset(&config->capture_dsp, 0, sizeof(config->capture_dsp));
+    memset(&config->playback_dsp, 0, sizeof(config->playback_dsp));
+    memset(&config->sidetone_dsp, 0, sizeof(config->sidetone_dsp));
 
     int opt;
 
@@ -52,7 +93,7 @@ void init_intercom_conf(intercom_conf_t* config, int argc, char** argv) {
     while ((opt = getopt(argc, argv, "hdf:")) != -1) {
         switch (opt) {
         case 'd': config->use_audio_defaults = true; break;
-        case 'f': strncpy(config->config_file, optarg, sizeof(config->config_file)); validConfigFile = true; break;
+        case 'f': validConfigFile = copy_string(config->config_file, sizeof(config->config_file), optarg) == ST_GOOD; break;
         case 'h': printHelp = true; break;
         default: error(INTERCOM_USAGE_STR, argv[0]);
         }
@@ -64,7 +105,7 @@ void init_intercom_conf(intercom_conf_t* config, int argc, char** argv) {
     }
 
     if (!validConfigFile) {
-        warn("No config file specified");
+        warn("No config file specified, or its path is too long");
         error(INTERCOM_USAGE_STR, argv[0]);
     }
     
@@ -80,6 +121,47 @@ void init_intercom_conf(intercom_conf_t* config, int argc, char** argv) {
     
     // Parse optional arguments
     config_get_bool(&libconf, "/app/use_audio_defaults", &config->use_audio_defaults);
+    config_get_bool(&libconf, "/audio/warm", &config->warm_audio);
+    config_get_bool(&libconf, "/audio/adaptive_media", &config->adaptive_media);
+    config_get_bool(&libconf, "/audio/direct_media", &config->direct_media);
+    config_get_bool(&libconf, "/audio/refuse_relayed_clear", &config->refuse_relayed_clear);
+    config_get_bool(&libconf, "/audio/sidetone", &config->sidetone);
+    config_get_double(&libconf, "/audio/sidetone_db", &config->sidetone_db);
+
+    config_get_str(&libconf, "/hardware/gpio_chip", config->gpio_chip, sizeof(config->gpio_chip));
+    config_get_u16(&libconf, "/hardware/dial_pin", &config->dial_pin);
+    config_get_u16(&libconf, "/hardware/dial_debounce_ms", &config->dial_debounce_ms);
+    config_get_u16(&libconf, "/hardware/dial_digit_gap_ms", &config->dial_digit_gap_ms);
+    config_get_u16(&libconf, "/hardware/dial_timeout_ms", &config->dial_timeout_ms);
+
+    // Devices picked on a previous run are kept next to the config file, not in it
+    if (config_get_str(&libconf, "/audio/device_cache", config->device_cache, sizeof(config->device_cache)) != ST_GOOD) {
+        snprintf(config->device_cache, sizeof(config->device_cache), "%s.devices", config->config_file);
+    }
+
+    read_audio_device_cache(config);
+
+    unsigned short wireRate;
+    if (config_get_u16(&libconf, "/dsp/wire_sample_rate", &wireRate) == ST_GOOD) {
+        config->wire_sample_rate = wireRate;
+    }
+
+    set_if_fail(config_get_dsp_chain(&libconf, "/dsp/capture", &config->capture_dsp), configFail)
+
+    // Without a playback chain keep the original telephone band pass filter
+    if (config_lookup(&libconf, "/dsp/playback") == NULL) {
+        push_default_stage(&config->playback_dsp, "bandpass", 1500, 0.707);
+    } else {
+        set_if_fail(config_get_dsp_chain(&libconf, "/dsp/playback", &config->playback_dsp), configFail)
+    }
+
+    // Sidetone defaults to the telephone voice band
+    if (config_lookup(&libconf, "/dsp/sidetone") == NULL) {
+        push_default_stage(&config->sidetone_dsp, "highpass", 300, 0.707);
+        push_default_stage(&config->sidetone_dsp, "lowpass", 3400, 0.707);
+    } else {
+        set_if_fail(config_get_dsp_chain(&libconf, "/dsp/sidetone", &config->sidetone_dsp), configFail)
+    }
 
     config_destroy(&libconf);
 
@@ -88,11 +170,98 @@ void init_intercom_conf(intercom_conf_t* config, int argc, char** argv) {
     }
 }
 
+/**
+ * Write the selected audio backend and device ids to the device cache, so
+ * that the next start can open them without enumerating devices. The config
+ * file is never written, the cache is written whole to a temporary file and
+ * renamed over the old one, so a crash leaves one or the other.
+ *
+ * Returns ST_FAIL if the cache could not be replaced.
+ */
+int save_audio_device_conf(const intercom_conf_t* config) {
+    char path[sizeof(config->device_cache) + 4];
+    snprintf(path, sizeof(path), "%s.new", config->device_cache);
+
+    struct config_t libconf;
+    config_init(&libconf);
+
+    config_setting_t* audio = config_setting_add(config_root_setting(&libconf), "audio", CONFIG_TYPE_GROUP);
+    const char* names[] = { "backend", "playback_device", "capture_device" };
+    const char* values[] = { config->audio_backend, config->playback_device, config->capture_device };
+
+    for (size_t i = 0; i < sizeof(names) / sizeof(*names); i++) {
+        config_setting_t* setting = audio == NULL ? NULL : config_setting_add(audio, names[i], CONFIG_TYPE_STRING);
+
+        if (setting == NULL || config_setting_set_string(setting, values[i]) != CONFIG_TRUE) {
+            warn("Failed to set /audio/%s for %s", names[i], config->device_cache);
+            config_destroy(&libconf);
+            return ST_FAIL;
+        }
+    }
+
+    FILE* file = fopen(path, "w");
+
+    if (file == NULL) {
+        stl_warn(errno, "Failed to open %s", path);
+        config_destroy(&libconf);
+        return ST_FAIL;
+    }
+
+    config_write(&libconf, file);
+    config_destroy(&libconf);
+
+    const bool written = fflush(file) == 0 && !ferror(file) && fsync(fileno(file)) == 0;
+
+    if (fclose(file) != 0 || !written || rename(path, config->device_cache) == -1) {
+        stl_warn(errno, "Failed to write audio devices to %s", config->device_cache);
+        unlink(path);
+        return ST_FAIL;
+    }
+
+    info("Saved audio devices to %s", config->device_cache);
+    return ST_GOOD;
+}
+
+/**
+ * Take the backend and device ids saved by save_audio_device_conf, if a
+ * previous run saved any.
+ */
+static void read_audio_device_cache(intercom_conf_t* config) {
+    if (access(config->device_cache, F_OK) != 0) {
+        info("No audio devices saved in %s", config->device_cache);
+        return;
+    }
+
+    struct config_t libconf;
+    init_config_from_file(&libconf, config->device_cache);
+
+    config_get_str(&libconf, "/audio/backend", config->audio_backend, sizeof(config->audio_backend));
+    config_get_str(&libconf, "/audio/playback_device", config->playback_device, sizeof(config->playback_device));
+    config_get_str(&libconf, "/audio/capture_device", config->capture_device, sizeof(config->capture_device));
+
+    config_destroy(&libconf);
+}
+
 void init_server_conf(server_conf_t* config, int argc, char ** argv) {
     memset(&config->config_file, 0, sizeof(config->config_file));
     config->server_port = 0;
     config->audio_port_min = 0;
     config->audio_port_max = 0;
+    config->conference_wire_rate = DEFAULT_WIRE_SAMPLE_RATE;
+    config->page_group_count = 0;
+    memset(config->recording_directory, 0, sizeof(config->recording_directory));
+    config->recording_adpcm = false;
+    config->recording_number_count = 0;
+    memset(config->voicemail_directory, 0, sizeof(config->voicemail_directory));
+    config->voicemail_number = 0;
+    config->voicemail_answer_s = 20;
+    config->voicemail_max_s = 60;
+    memset(config->hold_music, 0, sizeof(config->hold_music));
+    memset(config->hold_announcement, 0, sizeof(config->hold_announcement));
+    config->hold_codec = MEDIA_CODEC_ADPCM;
+    config->routing.route_count = 0;
+    memset(config->journal_path, 0, sizeof(config->journal_path));
+    config->journal_compact_s = 60;
 
     int opt;
 
@@ -106,7 +275,7 @@ void init_server_conf(server_conf_t* config, int argc, char ** argv) {
 
     while ((opt = getopt(argc, argv, "hdf:")) != -1) {
         switch (opt) {
-        case 'f': strncpy(config->config_file, optarg, sizeof(config->config_file)); validConfigFile = true; break;
+        case 'f': validConfigFile = copy_string(config->config_file, sizeof(config->config_file), optarg) == ST_GOOD; break;
         case 'h': printHelp = true; break;
         default: error(SERVER_USAGE_STR, argv[0]);
         }
@@ -118,7 +287,7 @@ void init_server_conf(server_conf_t* config, int argc, char ** argv) {
     }
 
     if (!validConfigFile) {
-        warn("No config file specified");
+        warn("No config file specified, or its path is too long");
         error(SERVER_USAGE_STR, argv[0]);
     }
 
@@ -133,7 +302,17 @@ void init_server_conf(server_conf_t* config, int argc, char ** argv) {
     set_if_fail(config_get_u16(&libconf, "/app/audio_port_max", &config->audio_port_max), configFail);
 
     // Parse optional arguments
+    unsigned short wireRate;
+    if (config_get_u16(&libconf, "/conference/wire_sample_rate", &wireRate) == ST_GOOD) {
+        config->conference_wire_rate = wireRate;
+    }
 
+    set_if_fail(config_get_page_groups(&libconf, "/paging/groups", config), configFail);
+    set_if_fail(config_get_recording(&libconf, "/recording", config), configFail);
+    set_if_fail(config_get_voicemail(&libconf, "/voicemail", config), configFail);
+    set_if_fail(config_get_hold(&libconf, "/hold", config), configFail);
+    set_if_fail(config_get_routes(&libconf, "/routing/routes", &config->routing), configFail);
+    set_if_fail(config_get_journal(&libconf, "/journal", config), configFail);
 
     config_destroy(&libconf);
 
@@ -170,14 +349,13 @@ static int config_get_u16(struct config_t* conf, const char* path, unsigned shor
     return ST_FAIL;
 }
 
-static int config_get_str(struct config_t* conf, const char* path, char* ret, ssize_t maxlen) {
+static int config_get_str(struct config_t* conf, const char* path, char* ret, size_t size) {
     const char* value;
     int err = config_lookup_string(conf, path, &value);
 
     if (err == CONFIG_TRUE) {
-        if (value != NULL) {
+        if (value != NULL && copy_string(ret, size, value) == ST_GOOD) {
             info("Config found: %s = %s", path, value);
-            strncpy(ret, value, maxlen);
             return ST_GOOD;
         } else {
             warn("Invalid config found: %s = %s", path, value);
@@ -202,4 +380,513 @@ static int config_get_bool(struct config_t* conf, const char* path, bool* ret) {
     }
 
     return ST_FAIL;
-}
\ No newline at end of file
+}
+
+static int config_get_double(struct config_t* conf, const char* path, double* ret) {
+    int value;
+
+    if (config_lookup_float(conf, path, ret) == CONFIG_TRUE) {
+        info("Config found: %s = %f", path, *ret);
+        return ST_GOOD;
+    }
+
+    if (config_lookup_int(conf, path, &value) == CONFIG_TRUE) {
+        *ret = value;
+        info("Config found: %s = %d", path, value);
+        return ST_GOOD;
+    }
+
+    warn("Config not found: %s", path);
+    return ST_FAIL;
+}
+
+/**
+ * Read a list of DSP stages at `path`. Each stage is a group with a `type` and
+ * the parameters for that type, for example:
+ * 
+ *     playback = ( { type = "bandpass"; frequency = 1500.0; q = 0.707; } );
+ * 
+ * A missing list is not an error, the chain is left empty.
+ */
+static int config_get_dsp_chain(struct config_t* conf, const char* path, dsp_chain_conf_t* chain) {
+    const config_setting_t* list = config_lookup(conf, path);
+    chain->stage_count = 0;
+
+    if (list == NULL) {
+        return ST_GOOD;
+    }
+
+    int length = config_setting_length(list);
+
+    if (length > DSP_MAX_STAGES) {
+        warn("Too many DSP stages in %s, maximum is %d", path, DSP_MAX_STAGES);
+        return ST_FAIL;
+    }
+
+    for (int i = 0; i < length; i++) {
+        const config_setting_t* setting = config_setting_get_elem(list, i);
+        dsp_stage_conf_t* stage = &chain->stages[chain->stage_count];
+        const char* type;
+
+        memset(stage, 0, sizeof(*stage));
+
+        if (config_setting_lookup_string(setting, "type", &type) != CONFIG_TRUE) {
+            warn("DSP stage %d in %s has no type", i, path);
+            return ST_FAIL;
+        }
+
+        if (copy_string(stage->type, sizeof(stage->type), type) != ST_GOOD) {
+            warn("DSP stage %d in %s has an unknown type %s", i, path, type);
+            return ST_FAIL;
+        }
+
+        int rate;
+        config_setting_get_number(setting, "frequency", &stage->frequency);
+        config_setting_get_number(setting, "q", &stage->q);
+        config_setting_get_number(setting, "gain_db", &stage->gain_db);
+        config_setting_get_number(setting, "threshold_db", &stage->threshold_db);
+        config_setting_get_number(setting, "release_ms", &stage->release_ms);
+        if (config_setting_lookup_int(setting, "rate", &rate) == CONFIG_TRUE && rate > 0) {
+            stage->rate = (unsigned int)rate;
+        }
+
+        info("Config found: %s[%d] = %s", path, i, stage->type);
+        chain->stage_count++;
+    }
+
+    return ST_GOOD;
+}
+
+/**
+ * Read the page groups at `path`, each a number and the numbers it pages:
+ * 
+ *     groups = ( { number = 90; members = [ 1, 2, 3 ]; } );
+ * 
+ * Leaving out `members` pages every node. A missing list is not an error.
+ */
+static int config_get_page_groups(struct config_t* conf, const char* path, server_conf_t* config) {
+    const config_setting_t* list = config_lookup(conf, path);
+    config->page_group_count = 0;
+
+    if (list == NULL) {
+        return ST_GOOD;
+    }
+
+    int length = config_setting_length(list);
+
+    if (length > PAGE_MAX_GROUPS) {
+        warn("Too many page groups in %s, maximum is %d", path, PAGE_MAX_GROUPS);
+        return ST_FAIL;
+    }
+
+    for (int i = 0; i < length; i++) {
+        const config_setting_t* setting = config_setting_get_elem(list, i);
+        page_group_conf_t* group = &config->page_groups[i];
+        int number;
+
+        memset(group, 0, sizeof(*group));
+
+        if (config_setting_lookup_int(setting, "number", &number) != CONFIG_TRUE || number <= 0 || number > USHRT_MAX) {
+            warn("Page group %d in %s has no valid number", i, path);
+            return ST_FAIL;
+        }
+
+        group->number = (unsigned short)number;
+
+        const config_setting_t* members = config_setting_get_member(setting, "members");
+        const int count = members != NULL ? config_setting_length(members) : 0;
+
+        if (count > PAGE_GROUP_MAX_MEMBERS) {
+            warn("Page group %d has too many members, maximum is %d", group->number, PAGE_GROUP_MAX_MEMBERS);
+            return ST_FAIL;
+        }
+
+        for (int j = 0; j < count; j++) {
+            const int member = config_setting_get_int_elem(members, j);
+
+            if (member <= 0 || member > USHRT_MAX) {
+                warn("Page group %d has an invalid member %d", group->number, member);
+                return ST_FAIL;
+            }
+
+            group->members[group->member_count++] = (unsigned short)member;
+        }
+
+        info("Config found: %s[%d] = %d, %d members", path, i, group->number, group->member_count);
+        config->page_group_count++;
+    }
+
+    return ST_GOOD;
+}
+
+/**
+ * Read where and how calls are recorded, and which numbers always are:
+ * 
+ *     recording: { directory = "recordings"; format = "adpcm"; numbers = [ 1, 2 ]; };
+ * 
+ * The format is "wav", 16 bit PCM and the default, or "adpcm". A missing
+ * block records nothing, a node may still ask for its own call to be.
+ */
+static int config_get_recording(struct config_t* conf, const char* path, server_conf_t* config) {
+    const config_setting_t* setting = config_lookup(conf, path);
+
+    if (setting == NULL) {
+        return ST_GOOD;
+    }
+
+    const char* directory;
+    const char* format;
+
+    if (config_setting_lookup_string(setting, "directory", &directory) != CONFIG_TRUE || directory[0] == '\0'
+        || copy_string(config->recording_directory, sizeof(config->recording_directory), directory) != ST_GOOD) {
+        warn("Config %s has no valid directory", path);
+        return ST_FAIL;
+    }
+
+    if (config_setting_lookup_string(setting, "format", &format) == CONFIG_TRUE) {
+        if (strcmp(format, "adpcm") == 0) {
+            config->recording_adpcm = true;
+        } else if (strcmp(format, "wav") != 0) {
+            warn("Invalid config found: %s/format = %s", path, format);
+            return ST_FAIL;
+        }
+    }
+
+    const config_setting_t* numbers = config_setting_get_member(setting, "numbers");
+    const int count = numbers != NULL ? config_setting_length(numbers) : 0;
+
+    if (count > RECORDING_MAX_NUMBERS) {
+        warn("Too many recorded numbers in %s, maximum is %d", path, RECORDING_MAX_NUMBERS);
+        return ST_FAIL;
+    }
+
+    for (int i = 0; i < count; i++) {
+        const int number = config_setting_get_int_elem(numbers, i);
+
+        if (number <= 0 || number > USHRT_MAX) {
+            warn("Invalid recorded number %d in %s", number, path);
+            return ST_FAIL;
+        }
+
+        config->recording_numbers[config->recording_number_count++] = (unsigned short)number;
+    }
+
+    info("Config found: %s = %s as %s, %d numbers", path, config->recording_directory, config->recording_adpcm ? "adpcm" : "wav", config->recording_number_count);
+    return ST_GOOD;
+}
+
+/**
+ * Read where voicemail is kept and how it is reached:
+ * 
+ *     voicemail: { directory = "voicemail"; number = 80; answer_seconds = 20; max_seconds = 60; };
+ * 
+ * Only the directory is needed. Without a number nodes can leave messages
+ * but not hear them. A missing block turns voicemail off.
+ */
+static int config_get_voicemail(struct config_t* conf, const char* path, server_conf_t* config) {
+    const config_setting_t* setting = config_lookup(conf, path);
+
+    if (setting == NULL) {
+        return ST_GOOD;
+    }
+
+    const char* directory;
+
+    if (config_setting_lookup_string(setting, "directory", &directory) != CONFIG_TRUE || directory[0] == '\0'
+        || copy_string(config->voicemail_directory, sizeof(config->voicemail_directory), directory) != ST_GOOD) {
+        warn("Config %s has no valid directory", path);
+        return ST_FAIL;
+    }
+
+    int number;
+    int answer;
+    int max;
+
+    if (config_setting_lookup_int(setting, "number", &number) == CONFIG_TRUE) {
+        if (number <= 0 || number > USHRT_MAX) {
+            warn("Invalid config found: %s/number = %d", path, number);
+            return ST_FAIL;
+        }
+
+        config->voicemail_number = (unsigned short)number;
+    }
+
+    if (config_setting_lookup_int(setting, "answer_seconds", &answer) == CONFIG_TRUE) {
+        if (answer <= 0 || answer > USHRT_MAX) {
+            warn("Invalid config found: %s/answer_seconds = %d", path, answer);
+            return ST_FAIL;
+        }
+
+        config->voicemail_answer_s = (unsigned short)answer;
+    }
+
+    // A message is held in memory until it is stored, see mailbox.h
+    if (config_setting_lookup_int(setting, "max_seconds", &max) == CONFIG_TRUE) {
+        if (max <= 0 || max > 80) {
+            warn("Invalid config found: %s/max_seconds = %d, at most 80", path, max);
+            return ST_FAIL;
+        }
+
+        config->voicemail_max_s = (unsigned short)max;
+    }
+
+    info("Config found: %s = %s, number %hu, after %hu s, at most %hu s", path, config->voicemail_directory,
+        config->voicemail_number, config->voicemail_answer_s, config->voicemail_max_s);
+    return ST_GOOD;
+}
+
+/**
+ * Read what a call put on hold hears:
+ * 
+ *     hold: { music = "hold.wav"; announcement = "hold_announcement.wav"; format = "adpcm"; };
+ * 
+ * Only the music is needed, the announcement is played before it each time
+ * round. The format is "l16", "pcmu" or "adpcm". A missing block means calls
+ * cannot be put on hold.
+ */
+static int config_get_hold(struct config_t* conf, const char* path, server_conf_t* config) {
+    const config_setting_t* setting = config_lookup(conf, path);
+
+    if (setting == NULL) {
+        return ST_GOOD;
+    }
+
+    const char* music;
+    const char* announcement;
+    const char* format;
+
+    if (config_setting_lookup_string(setting, "music", &music) != CONFIG_TRUE || music[0] == '\0'
+        || copy_string(config->hold_music, sizeof(config->hold_music), music) != ST_GOOD) {
+        warn("Config %s has no valid music", path);
+        return ST_FAIL;
+    }
+
+    if (config_setting_lookup_string(setting, "announcement", &announcement) == CONFIG_TRUE) {
+        if (copy_string(config->hold_announcement, sizeof(config->hold_announcement), announcement) != ST_GOOD) {
+            warn("Invalid config found: %s/announcement = %s", path, announcement);
+            return ST_FAIL;
+        }
+    }
+
+    if (config_setting_lookup_string(setting, "format", &format) == CONFIG_TRUE) {
+        if (strcmp(format, "l16") == 0) {
+            config->hold_codec = MEDIA_CODEC_L16;
+        } else if (strcmp(format, "pcmu") == 0) {
+            config->hold_codec = MEDIA_CODEC_PCMU;
+        } else if (strcmp(format, "adpcm") != 0) {
+            warn("Invalid config found: %s/format = %s", path, format);
+            return ST_FAIL;
+        }
+    }
+
+    info("Config found: %s = %s after %s", path, config->hold_music, config->hold_announcement[0] != '\0' ? config->hold_announcement : "nothing");
+    return ST_GOOD;
+}
+
+/**
+ * Read where the registry and calls are kept across restarts:
+ *
+ *     journal: { path = "server.journal"; compact_seconds = 60; };
+ *
+ * Only the path is needed. A missing block means a restart forgets every
+ * node and call.
+ */
+static int config_get_journal(struct config_t* conf, const char* path, server_conf_t* config) {
+    const config_setting_t* setting = config_lookup(conf, path);
+
+    if (setting == NULL) {
+        return ST_GOOD;
+    }
+
+    const char* file;
+    int compact;
+
+    if (config_setting_lookup_string(setting, "path", &file) != CONFIG_TRUE || file[0] == '\0'
+        || copy_string(config->journal_path, sizeof(config->journal_path), file) != ST_GOOD) {
+        warn("Config %s has no valid path", path);
+        return ST_FAIL;
+    }
+
+    if (config_setting_lookup_int(setting, "compact_seconds", &compact) == CONFIG_TRUE) {
+        if (compact <= 0 || compact > USHRT_MAX) {
+            warn("Invalid config found: %s/compact_seconds = %d", path, compact);
+            return ST_FAIL;
+        }
+
+        config->journal_compact_s = (unsigned short)compact;
+    }
+
+    info("Config found: %s = %s, compacted every %hu s", path, config->journal_path, config->journal_compact_s);
+    return ST_GOOD;
+}
+
+/**
+ * Read only the routes from the config file at `path`, to replace them while
+ * the server runs. Unlike at start up, a file that cannot be read is an error
+ * rather than an empty list.
+ */
+int read_server_routes(const char* path, routes_conf_t* routes) {
+    struct config_t libconf;
+    config_init(&libconf);
+
+    if (config_read_file(&libconf, path) != CONFIG_TRUE) {
+        warn("Error occurred int line %d while parsing %s, %s", config_error_line(&libconf), config_error_file(&libconf), config_error_text(&libconf));
+        config_destroy(&libconf);
+        return ST_FAIL;
+    }
+
+    const int res = config_get_routes(&libconf, "/routing/routes", routes);
+    config_destroy(&libconf);
+    return res;
+}
+
+/**
+ * Read the dial plan's routes at `path`, each matching one number, a range
+ * or a prefix, and where calls to them go:
+ * 
+ *     routes = ( { range = [ 200, 299 ]; type = "hunt"; members = [ 1, 2 ]; },
+ *                { prefix = "7"; type = "phone"; target = 3; } );
+ * 
+ * The type is "phone" with the node's `target`, "hunt" with its `members`,
+ * "page" with the page group's number as `target`, or "voicemail". A missing
+ * list is not an error.
+ */
+static int config_get_routes(struct config_t* conf, const char* path, routes_conf_t* routes) {
+    const config_setting_t* list = config_lookup(conf, path);
+    routes->route_count = 0;
+
+    if (list == NULL) {
+        return ST_GOOD;
+    }
+
+    const int length = config_setting_length(list);
+
+    if (length > ROUTE_MAX_ROUTES) {
+        warn("Too many routes in %s, maximum is %d", path, ROUTE_MAX_ROUTES);
+        return ST_FAIL;
+    }
+
+    for (int i = 0; i < length; i++) {
+        if (config_get_route(config_setting_get_elem(list, i), &routes->routes[i]) != ST_GOOD) {
+            warn("Route %d in %s is not valid", i, path);
+            return ST_FAIL;
+        }
+
+        routes->route_count++;
+    }
+
+    info("Config found: %s, %d routes", path, routes->route_count);
+    return ST_GOOD;
+}
+
+static int config_get_route(const config_setting_t* setting, route_conf_t* route) {
+    const config_setting_t* range = config_setting_get_member(setting, "range");
+    const char* prefix;
+    const char* type;
+    int number;
+    int target;
+
+    memset(route, 0, sizeof(*route));
+
+    // Numbers are never written with a leading zero, so no prefix has one
+    if (config_setting_lookup_string(setting, "prefix", &prefix) == CONFIG_TRUE) {
+        const size_t length = strlen(prefix);
+
+        if (length == 0 || length >= sizeof(route->prefix) || prefix[0] == '0' || strspn(prefix, "0123456789") != length) {
+            warn("Invalid route prefix \"%s\"", prefix);
+            return ST_FAIL;
+        }
+
+        memcpy(route->prefix, prefix, length + 1);
+    } else if (range != NULL && config_setting_length(range) == 2) {
+        const int low = config_setting_get_int_elem(range, 0);
+        const int high = config_setting_get_int_elem(range, 1);
+
+        if (low <= 0 || high > USHRT_MAX || low > high) {
+            warn("Invalid route range %d to %d", low, high);
+            return ST_FAIL;
+        }
+
+        route->low = (unsigned short)low;
+        route->high = (unsigned short)high;
+    } else if (config_setting_lookup_int(setting, "number", &number) == CONFIG_TRUE && number > 0 && number <= USHRT_MAX) {
+        route->low = (unsigned short)number;
+        route->high = (unsigned short)number;
+    } else {
+        warn("Route has no valid number, range or prefix");
+        return ST_FAIL;
+    }
+
+    if (config_setting_lookup_string(setting, "type", &type) != CONFIG_TRUE) {
+        warn("Route has no type");
+        return ST_FAIL;
+    }
+
+    if (strcmp(type, "phone") == 0) {
+        route->type = ROUTE_PHONE;
+    } else if (strcmp(type, "hunt") == 0) {
+        route->type = ROUTE_HUNT;
+    } else if (strcmp(type, "page") == 0) {
+        route->type = ROUTE_PAGE;
+    } else if (strcmp(type, "voicemail") == 0) {
+        route->type = ROUTE_VOICEMAIL;
+    } else {
+        warn("Invalid route type %s", type);
+        return ST_FAIL;
+    }
+
+    if (route->type == ROUTE_PHONE || route->type == ROUTE_PAGE) {
+        if (config_setting_lookup_int(setting, "target", &target) != CONFIG_TRUE || target <= 0 || target > USHRT_MAX) {
+            warn("Route of type %s has no valid target", type);
+            return ST_FAIL;
+        }
+
+        route->target = (unsigned short)target;
+    }
+
+    const config_setting_t* members = config_setting_get_member(setting, "members");
+    const int count = members != NULL ? config_setting_length(members) : 0;
+
+    if (route->type == ROUTE_HUNT && (count == 0 || count > ROUTE_MAX_MEMBERS)) {
+        warn("Hunt group needs 1 to %d members", ROUTE_MAX_MEMBERS);
+        return ST_FAIL;
+    }
+
+    for (int j = 0; route->type == ROUTE_HUNT && j < count; j++) {
+        const int member = config_setting_get_int_elem(members, j);
+
+        if (member <= 0 || member > USHRT_MAX) {
+            warn("Hunt group has an invalid member %d", member);
+            return ST_FAIL;
+        }
+
+        route->members[route->member_count++] = (unsigned short)member;
+    }
+
+    return ST_GOOD;
+}
+
+/**
+ * Look up a number that may be written as either an integer or a float.
+ */
+static int config_setting_get_number(const config_setting_t* setting, const char* name, double* ret) {
+    int value;
+
+    if (config_setting_lookup_float(setting, name, ret) == CONFIG_TRUE) {
+        return ST_GOOD;
+    }
+
+    if (config_setting_lookup_int(setting, name, &value) == CONFIG_TRUE) {
+        *ret = value;
+        return ST_GOOD;
+    }
+
+    return ST_FAIL;
+}
+
+static void push_default_stage(dsp_chain_conf_t* chain, const char* type, double frequency, double q) {
+    dsp_stage_conf_t* stage = &chain->stages[chain->stage_count++];
+    copy_string(stage->type, sizeof(stage->type), type);
+    stage->frequency = frequency;
+    stage->q = q;
+}
@@ -0,0 +1,379 @@
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include "common.h"
+#include "utils/event_loop.h"
+
+#ifdef linux
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#endif
+
+#define EVENT_LOOP_BATCH 16
+
+static event_source_t* alloc_source(event_loop_t* loop, int* index);
+static event_source_t* find_source(event_loop_t* loop, int fd);
+static int  dispatch(event_loop_t* loop, int index, int fd, uint32_t events);
+
+int init_event_loop(event_loop_t* loop) {
+    memset(loop, 0, sizeof(*loop));
+    loop->epollfd = -1;
+
+#ifdef linux
+    if ((loop->epollfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        stl_warn(errno, "Failed to create epoll instance");
+        return ST_FAIL;
+    }
+#endif
+
+    return ST_GOOD;
+}
+
+/**
+ * Destroy the loop and its timers. File descriptors added with
+ * event_loop_add() are owned by the caller and left open.
+ */
+void destroy_event_loop(event_loop_t* loop) {
+    for (int i = 0; i < EVENT_LOOP_MAX_SOURCES; i++) {
+        if (loop->sources[i].used && loop->sources[i].timer) {
+            event_loop_remove_timer(loop, i);
+        }
+    }
+
+    if (loop->epollfd != -1) {
+        close(loop->epollfd);
+        loop->epollfd = -1;
+    }
+}
+
+/**
+ * Call `handler` whenever `fd` has any of `events` ready.
+ */
+int event_loop_add(event_loop_t* loop, int fd, uint32_t events, event_handler_t handler, void* data) {
+    int index;
+    event_source_t* source = alloc_source(loop, &index);
+
+    if (source == NULL) {
+        return ST_FAIL;
+    }
+
+    source->fd = fd;
+    source->events = events;
+    source->handler = handler;
+    source->data = data;
+
+#ifdef linux
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = (events & EVENT_READ ? EPOLLIN : 0) | (events & EVENT_WRITE ? EPOLLOUT : 0);
+    event.data.u64 = ((uint64_t)(uint32_t)fd << 32) | (uint32_t)index;
+
+    if (epoll_ctl(loop->epollfd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        stl_warn(errno, "Failed to add fd %d to event loop", fd);
+        source->used = false;
+        return ST_FAIL;
+    }
+#endif
+
+    return ST_GOOD;
+}
+
+int event_loop_remove(event_loop_t* loop, int fd) {
+    event_source_t* source = find_source(loop, fd);
+
+    if (source == NULL) {
+        return ST_INVALID_ARG;
+    }
+
+#ifdef linux
+    if (epoll_ctl(loop->epollfd, EPOLL_CTL_DEL, fd, NULL) == -1) {
+        stl_warn(errno, "Failed to remove fd %d from event loop", fd);
+    }
+#endif
+
+    source->used = false;
+    return ST_GOOD;
+}
+
+/**
+ * Create a disarmed timer that calls `handler` each time it expires.
+ *
+ * Returns the timer id, passed as the fd to the handler, or -1 on failure.
+ */
+int event_loop_add_timer(event_loop_t* loop, event_handler_t handler, void* data) {
+    int index;
+    event_source_t* source = alloc_source(loop, &index);
+
+    if (source == NULL) {
+        return -1;
+    }
+
+    source->timer = true;
+    source->handler = handler;
+    source->data = data;
+    source->events = EVENT_READ;
+    source->fd = -1;
+
+#ifdef linux
+    if ((source->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1) {
+        stl_warn(errno, "Failed to create timerfd");
+        source->used = false;
+        return -1;
+    }
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u64 = ((uint64_t)(uint32_t)source->fd << 32) | (uint32_t)index;
+
+    if (epoll_ctl(loop->epollfd, EPOLL_CTL_ADD, source->fd, &event) == -1) {
+        stl_warn(errno, "Failed to add timer to event loop");
+        close(source->fd);
+        source->used = false;
+        return -1;
+    }
+#endif
+
+    return index;
+}
+
+/**
+ * Arm a timer to first fire after `delayMs`, then every `periodMs` if that is
+ * non zero. Re-arming replaces the previous deadline.
+ */
+int event_loop_arm_timer(event_loop_t* loop, int timer, uint64_t delayMs, uint64_t periodMs) {
+    if (timer < 0 || timer >= EVENT_LOOP_MAX_SOURCES || !loop->sources[timer].used || !loop->sources[timer].timer) {
+        return ST_INVALID_ARG;
+    }
+
+    event_source_t* source = &loop->sources[timer];
+
+    // A zero delay would disarm a timerfd, so round up to the next tick
+    delayMs = delayMs > 0 ? delayMs : 1;
+    source->deadlineNs = event_loop_now() + delayMs * 1000000;
+    source->periodNs = periodMs * 1000000;
+
+#ifdef linux
+    struct itimerspec spec;
+    spec.it_value.tv_sec = delayMs / 1000;
+    spec.it_value.tv_nsec = (delayMs % 1000) * 1000000;
+    spec.it_interval.tv_sec = periodMs / 1000;
+    spec.it_interval.tv_nsec = (periodMs % 1000) * 1000000;
+
+    if (timerfd_settime(source->fd, 0, &spec, NULL) == -1) {
+        stl_warn(errno, "Failed to arm timer");
+        return ST_FAIL;
+    }
+#endif
+
+    return ST_GOOD;
+}
+
+int event_loop_disarm_timer(event_loop_t* loop, int timer) {
+    if (timer < 0 || timer >= EVENT_LOOP_MAX_SOURCES || !loop->sources[timer].used || !loop->sources[timer].timer) {
+        return ST_INVALID_ARG;
+    }
+
+    event_source_t* source = &loop->sources[timer];
+    source->deadlineNs = 0;
+    source->periodNs = 0;
+
+#ifdef linux
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+
+    if (timerfd_settime(source->fd, 0, &spec, NULL) == -1) {
+        stl_warn(errno, "Failed to disarm timer");
+        return ST_FAIL;
+    }
+
+    // Drop an expiry that has already been queued
+    uint64_t expirations;
+    while (read(source->fd, &expirations, sizeof(expirations)) > 0);
+#endif
+
+    return ST_GOOD;
+}
+
+int event_loop_remove_timer(event_loop_t* loop, int timer) {
+    if (timer < 0 || timer >= EVENT_LOOP_MAX_SOURCES || !loop->sources[timer].used || !loop->sources[timer].timer) {
+        return ST_INVALID_ARG;
+    }
+
+    event_source_t* source = &loop->sources[timer];
+
+#ifdef linux
+    epoll_ctl(loop->epollfd, EPOLL_CTL_DEL, source->fd, NULL);
+    close(source->fd);
+#endif
+
+    source->used = false;
+    return ST_GOOD;
+}
+
+/**
+ * Run handlers until one fails or event_loop_stop() is called.
+ *
+ * Returns the code that stopped the loop.
+ */
+int event_loop_run(event_loop_t* loop) {
+    loop->running = true;
+    loop->result = ST_GOOD;
+
+#ifdef linux
+    struct epoll_event events[EVENT_LOOP_BATCH];
+
+    while (loop->running) {
+        int count = epoll_wait(loop->epollfd, events, EVENT_LOOP_BATCH, -1);
+
+        if (count == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            stl_warn(errno, "Event loop wait failed");
+            return ST_FAIL;
+        }
+
+        for (int i = 0; i < count && loop->running; i++) {
+            const int index = (int)(events[i].data.u64 & 0xffffffff);
+            const int fd = (int)(events[i].data.u64 >> 32);
+            const uint32_t ready = (events[i].events & EPOLLIN ? EVENT_READ : 0)
+                                 | (events[i].events & EPOLLOUT ? EVENT_WRITE : 0)
+                                 | (events[i].events & EPOLLERR ? EVENT_ERROR : 0)
+                                 | (events[i].events & EPOLLHUP ? EVENT_HANGUP : 0);
+
+            if (loop->sources[index].timer) {
+                // Clear the expiry count, a disarmed timer may still be queued
+                uint64_t expirations = 0;
+                if (read(fd, &expirations, sizeof(expirations)) <= 0) {
+                    continue;
+                }
+            }
+
+            dispatch(loop, index, fd, ready);
+        }
+    }
+#else
+    struct pollfd fds[EVENT_LOOP_MAX_SOURCES];
+    int indices[EVENT_LOOP_MAX_SOURCES];
+
+    while (loop->running) {
+        int count = 0;
+        int timeoutMs = -1;
+        const uint64_t now = event_loop_now();
+
+        for (int i = 0; i < EVENT_LOOP_MAX_SOURCES; i++) {
+            const event_source_t* source = &loop->sources[i];
+
+            if (!source->used) {
+                continue;
+            }
+
+            if (source->timer) {
+                if (source->deadlineNs != 0) {
+                    const uint64_t waitMs = source->deadlineNs > now ? (source->deadlineNs - now + 999999) / 1000000 : 0;
+                    timeoutMs = timeoutMs == -1 ? (int)waitMs : MIN(timeoutMs, (int)waitMs);
+                }
+                continue;
+            }
+
+            fds[count].fd = source->fd;
+            fds[count].events = (short)source->events;
+            fds[count].revents = 0;
+            indices[count++] = i;
+        }
+
+        if (poll(fds, count, timeoutMs) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            stl_warn(errno, "Event loop poll failed");
+            return ST_FAIL;
+        }
+
+        for (int i = 0; i < count && loop->running; i++) {
+            if (fds[i].revents != 0) {
+                dispatch(loop, indices[i], fds[i].fd, (uint32_t)fds[i].revents);
+            }
+        }
+
+        const uint64_t after = event_loop_now();
+
+        for (int i = 0; i < EVENT_LOOP_MAX_SOURCES && loop->running; i++) {
+            event_source_t* source = &loop->sources[i];
+
+            if (!source->used || !source->timer || source->deadlineNs == 0 || source->deadlineNs > after) {
+                continue;
+            }
+
+            source->deadlineNs = source->periodNs != 0 ? after + source->periodNs : 0;
+            dispatch(loop, i, i, EVENT_READ);
+        }
+    }
+#endif
+
+    return loop->result;
+}
+
+/**
+ * Stop the loop after the current handler returns.
+ */
+void event_loop_stop(event_loop_t* loop, int result) {
+    loop->running = false;
+    loop->result = result;
+}
+
+static int dispatch(event_loop_t* loop, int index, int fd, uint32_t events) {
+    event_source_t* source = &loop->sources[index];
+
+    // The source may have been removed or replaced by an earlier handler
+    if (!source->used || (!source->timer && source->fd != fd)) {
+        return ST_GOOD;
+    }
+
+    int res = source->handler(loop, source->timer ? index : fd, events, source->data);
+
+    if (res != ST_GOOD) {
+        event_loop_stop(loop, res);
+    }
+
+    return res;
+}
+
+static event_source_t* alloc_source(event_loop_t* loop, int* index) {
+    for (int i = 0; i < EVENT_LOOP_MAX_SOURCES; i++) {
+        if (!loop->sources[i].used) {
+            memset(&loop->sources[i], 0, sizeof(loop->sources[i]));
+            loop->sources[i].used = true;
+            *index = i;
+            return &loop->sources[i];
+        }
+    }
+
+    warn("Event loop has too many sources");
+    return NULL;
+}
+
+static event_source_t* find_source(event_loop_t* loop, int fd) {
+    for (int i = 0; i < EVENT_LOOP_MAX_SOURCES; i++) {
+        if (loop->sources[i].used && !loop->sources[i].timer && loop->sources[i].fd == fd) {
+            return &loop->sources[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * The clock timers run on, in nanoseconds.
+ */
+uint64_t event_loop_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
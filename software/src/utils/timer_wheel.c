@@ -0,0 +1,331 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+#include "utils/timer_wheel.h"
+
+#define TIMER_WHEEL_END UINT32_MAX
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_SPAN (1ull << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+#define TIMER_WHEEL_TICK_NS (TIMER_WHEEL_TICK_MS * 1000000ull)
+
+static int handle_wheel_timer(struct event_loop* loop, int fd, uint32_t events, void* data);
+static void advance(timer_wheel_t* wheel, uint64_t nowTick);
+static void rearm(timer_wheel_t* wheel);
+static uint64_t next_tick(const timer_wheel_t* wheel);
+static uint64_t current_tick(const timer_wheel_t* wheel);
+static void place(timer_wheel_t* wheel, uint32_t index);
+static void unlink_entry(timer_wheel_t* wheel, uint32_t index);
+static void free_entry(timer_wheel_t* wheel, uint32_t index);
+static int  grow(timer_wheel_t* wheel);
+
+/**
+ * Start an empty wheel with room for `capacity` timers at once, on a timer
+ * of `loop`. The pool doubles whenever it fills.
+ */
+int init_timer_wheel(timer_wheel_t* wheel, event_loop_t* loop, uint32_t capacity) {
+    memset(wheel, 0, sizeof(*wheel));
+
+    if (capacity == 0 || capacity >= TIMER_WHEEL_END) {
+        return ST_INVALID_ARG;
+    }
+
+    if ((wheel->entries = (timer_entry_t*)calloc(capacity, sizeof(timer_entry_t))) == NULL) {
+        warn("Failed to allocate %u timers", capacity);
+        return ST_FAIL;
+    }
+
+    if ((wheel->timer = event_loop_add_timer(loop, &handle_wheel_timer, wheel)) < 0) {
+        free(wheel->entries);
+        wheel->entries = NULL;
+        return ST_FAIL;
+    }
+
+    wheel->loop = loop;
+    wheel->armedTick = UINT64_MAX;
+    wheel->originNs = event_loop_now();
+    wheel->capacity = capacity;
+    memset(wheel->heads, 0xff, sizeof(wheel->heads));
+
+    // Generations start at 1, so no id is TIMER_NONE
+    for (uint32_t i = 0; i < capacity; i++) {
+        wheel->entries[i].generation = 1;
+        wheel->entries[i].next = i + 1 < capacity ? i + 1 : TIMER_WHEEL_END;
+    }
+
+    wheel->freeList = 0;
+    return ST_GOOD;
+}
+
+/**
+ * Drop every timer without calling it. The loop's timer goes with the loop.
+ */
+void destroy_timer_wheel(timer_wheel_t* wheel) {
+    free(wheel->entries);
+    wheel->entries = NULL;
+    wheel->count = 0;
+}
+
+/**
+ * Call `handler` with `arg` and `data` once `delayMs` has passed, to within
+ * a tick. Returns TIMER_NONE if the wheel is full and cannot grow.
+ */
+timer_id_t timer_wheel_add(timer_wheel_t* wheel, uint64_t delayMs, timer_handler_t handler, uint64_t arg, void* data) {
+    if (wheel->freeList == TIMER_WHEEL_END && grow(wheel) != ST_GOOD) {
+        warn("Timer wheel is full, %u timers pending", wheel->count);
+        return TIMER_NONE;
+    }
+
+    const uint64_t sinceNs = event_loop_now() - wheel->originNs;
+    const uint64_t nowTick = sinceNs / TIMER_WHEEL_TICK_NS;
+
+    // Nothing is waiting to be handled, so the wheel can simply catch up
+    if (wheel->count == 0) {
+        wheel->tick = MAX(wheel->tick, nowTick);
+    }
+
+    const uint32_t index = wheel->freeList;
+    timer_entry_t* entry = &wheel->entries[index];
+    wheel->freeList = entry->next;
+
+    // The first tick starting once the delay has passed, never one that has
+    // begun, it may have been handled already
+    entry->expiry = MAX((sinceNs + delayMs * 1000000 + TIMER_WHEEL_TICK_NS - 1) / TIMER_WHEEL_TICK_NS, nowTick + 1);
+    entry->handler = handler;
+    entry->arg = arg;
+    entry->data = data;
+    entry->used = true;
+    wheel->count++;
+
+    place(wheel, index);
+
+    if (next_tick(wheel) < wheel->armedTick) {
+        rearm(wheel);
+    }
+
+    return ((timer_id_t)entry->generation << 32) | index;
+}
+
+/**
+ * Cancel a timer that has not fired. An id whose timer has fired or been
+ * cancelled is ST_INVALID_ARG. The loop's timer is left armed, waking early
+ * only finds nothing due.
+ */
+int timer_wheel_cancel(timer_wheel_t* wheel, timer_id_t id) {
+    const uint32_t index = (uint32_t)id;
+
+    if (id == TIMER_NONE || index >= wheel->capacity || !wheel->entries[index].used || wheel->entries[index].generation != (uint32_t)(id >> 32)) {
+        return ST_INVALID_ARG;
+    }
+
+    unlink_entry(wheel, index);
+    free_entry(wheel, index);
+    return ST_GOOD;
+}
+
+static int handle_wheel_timer(struct event_loop* loop, int fd, uint32_t events, void* data) {
+    timer_wheel_t* wheel = (timer_wheel_t*)data;
+
+    wheel->armedTick = UINT64_MAX;
+    advance(wheel, current_tick(wheel));
+    rearm(wheel);
+    return ST_GOOD;
+}
+
+/**
+ * Handle every tick up to `nowTick` that has something in it, jumping over
+ * the rest. At each, the higher levels' slots starting then are placed again
+ * below, highest first, and then the lowest level's slot fires.
+ */
+static void advance(timer_wheel_t* wheel, uint64_t nowTick) {
+    while (wheel->count > 0 && wheel->loop->running) {
+        const uint64_t tick = next_tick(wheel);
+
+        if (tick > nowTick) {
+            break;
+        }
+
+        wheel->tick = tick;
+
+        for (int level = TIMER_WHEEL_LEVELS - 1; level > 0; level--) {
+            const int shift = level * TIMER_WHEEL_BITS;
+
+            if ((tick & ((1ull << shift) - 1)) != 0) {
+                continue;
+            }
+
+            uint32_t* head = &wheel->heads[level][(tick >> shift) & TIMER_WHEEL_MASK];
+
+            while (*head != TIMER_WHEEL_END) {
+                const uint32_t index = *head;
+                unlink_entry(wheel, index);
+                place(wheel, index);
+            }
+        }
+
+        // Handlers can only add to later ticks, so this list only shrinks
+        uint32_t* head = &wheel->heads[0][tick & TIMER_WHEEL_MASK];
+
+        while (*head != TIMER_WHEEL_END) {
+            const uint32_t index = *head;
+            const timer_entry_t entry = wheel->entries[index];
+
+            unlink_entry(wheel, index);
+            free_entry(wheel, index);
+
+            const int res = entry.handler(wheel, entry.arg, entry.data);
+
+            if (res != ST_GOOD) {
+                event_loop_stop(wheel->loop, res);
+            }
+        }
+    }
+
+    wheel->tick = MAX(wheel->tick, nowTick);
+}
+
+/**
+ * Arm the loop's timer for the next tick anything happens at, or disarm it
+ * once the wheel is empty.
+ */
+static void rearm(timer_wheel_t* wheel) {
+    if (wheel->count == 0) {
+        if (wheel->armedTick != UINT64_MAX) {
+            event_loop_disarm_timer(wheel->loop, wheel->timer);
+            wheel->armedTick = UINT64_MAX;
+        }
+        return;
+    }
+
+    const uint64_t tick = next_tick(wheel);
+    const uint64_t dueNs = wheel->originNs + tick * TIMER_WHEEL_TICK_NS;
+    const uint64_t nowNs = event_loop_now();
+    const uint64_t delayMs = dueNs > nowNs ? (dueNs - nowNs + 999999) / 1000000 : 0;
+
+    if (event_loop_arm_timer(wheel->loop, wheel->timer, delayMs, 0) == ST_GOOD) {
+        wheel->armedTick = tick;
+    }
+}
+
+/**
+ * The first tick after the current one with a slot starting, for each level
+ * the first occupied slot after the current one in the order they come
+ * round.
+ */
+static uint64_t next_tick(const timer_wheel_t* wheel) {
+    uint64_t next = UINT64_MAX;
+
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        const uint64_t occupied = wheel->occupied[level];
+
+        if (occupied == 0) {
+            continue;
+        }
+
+        const int shift = level * TIMER_WHEEL_BITS;
+        const uint64_t turn = wheel->tick >> shift;
+        const int start = (int)((turn + 1) & TIMER_WHEEL_MASK);
+        const uint64_t rotated = start == 0 ? occupied : (occupied >> start) | (occupied << (TIMER_WHEEL_SLOTS - start));
+        const uint64_t ahead = (uint64_t)__builtin_ctzll(rotated) + 1;
+
+        next = MIN(next, (turn + ahead) << shift);
+    }
+
+    return next;
+}
+
+static uint64_t current_tick(const timer_wheel_t* wheel) {
+    return (event_loop_now() - wheel->originNs) / TIMER_WHEEL_TICK_NS;
+}
+
+/**
+ * Link an entry into the lowest level whose turn from the current tick
+ * reaches its expiry, in the slot the expiry falls in. A slot of level n
+ * spans a turn of level n - 1, so an entry is at most one turn of its level
+ * ahead and its slot comes round exactly when it is due.
+ */
+static void place(timer_wheel_t* wheel, uint32_t index) {
+    timer_entry_t* entry = &wheel->entries[index];
+    const uint64_t delta = MIN(entry->expiry - MIN(entry->expiry, wheel->tick), TIMER_WHEEL_SPAN - 1);
+    const uint64_t at = wheel->tick + delta;
+    int level = 0;
+
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (1ull << ((level + 1) * TIMER_WHEEL_BITS))) {
+        level++;
+    }
+
+    const int slot = (int)((at >> (level * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK);
+    uint32_t* head = &wheel->heads[level][slot];
+
+    entry->level = (uint8_t)level;
+    entry->slot = (uint8_t)slot;
+    entry->prev = TIMER_WHEEL_END;
+    entry->next = *head;
+
+    if (*head != TIMER_WHEEL_END) {
+        wheel->entries[*head].prev = index;
+    }
+
+    *head = index;
+    wheel->occupied[level] |= 1ull << slot;
+}
+
+static void unlink_entry(timer_wheel_t* wheel, uint32_t index) {
+    timer_entry_t* entry = &wheel->entries[index];
+
+    if (entry->prev != TIMER_WHEEL_END) {
+        wheel->entries[entry->prev].next = entry->next;
+    } else {
+        wheel->heads[entry->level][entry->slot] = entry->next;
+    }
+
+    if (entry->next != TIMER_WHEEL_END) {
+        wheel->entries[entry->next].prev = entry->prev;
+    }
+
+    if (wheel->heads[entry->level][entry->slot] == TIMER_WHEEL_END) {
+        wheel->occupied[entry->level] &= ~(1ull << entry->slot);
+    }
+}
+
+static void free_entry(timer_wheel_t* wheel, uint32_t index) {
+    timer_entry_t* entry = &wheel->entries[index];
+
+    entry->used = false;
+    entry->generation++;
+    entry->generation += entry->generation == 0;
+    entry->next = wheel->freeList;
+    wheel->freeList = index;
+    wheel->count--;
+}
+
+/**
+ * Double the pool, the new entries going on the free list. Entries are only
+ * referred to by index, so they can move.
+ */
+static int grow(timer_wheel_t* wheel) {
+    const uint32_t capacity = wheel->capacity <= (TIMER_WHEEL_END - 1) / 2 ? wheel->capacity * 2 : TIMER_WHEEL_END - 1;
+
+    if (capacity <= wheel->capacity) {
+        return ST_FAIL;
+    }
+
+    timer_entry_t* entries = (timer_entry_t*)realloc(wheel->entries, (size_t)capacity * sizeof(timer_entry_t));
+
+    if (entries == NULL) {
+        warn("Failed to grow the timer wheel to %u timers", capacity);
+        return ST_FAIL;
+    }
+
+    memset(&entries[wheel->capacity], 0, (size_t)(capacity - wheel->capacity) * sizeof(timer_entry_t));
+
+    for (uint32_t i = wheel->capacity; i < capacity; i++) {
+        entries[i].generation = 1;
+        entries[i].next = i + 1 < capacity ? i + 1 : wheel->freeList;
+    }
+
+    wheel->freeList = wheel->capacity;
+    wheel->entries = entries;
+    wheel->capacity = capacity;
+    return ST_GOOD;
+}